@@ -1,18 +1,24 @@
 #!/usr/bin/python
 
+import os
 import subprocess
 import sys
+import tempfile
 import numpy
 
 nul = open("/dev/null", "w")
 
 runtimes = []
 
+# timeprogram.c's start and finish times arrive on stderr.
+timesfd, timesname = tempfile.mkstemp(prefix = "py-runtime")
+os.close(timesfd)
+
 for i in range(int(sys.argv[1])):
 
-	with open("/var/run/user/chris/py-runtime", "w") as timesf:
+	with open(timesname, "w") as timesf:
 		subprocess.check_call(sys.argv[2:], stdout=nul, stderr=timesf)
-	with open("/var/run/user/chris/py-runtime", "r") as timesf:
+	with open(timesname, "r") as timesf:
 		lines = timesf.readlines()
 		ss = int(lines[0], 16)
 		sn = int(lines[1], 16)
@@ -21,5 +27,7 @@ for i in range(int(sys.argv[1])):
 		runtime_ns = (((fs * 1000000000) + fn) - ((ss * 1000000000) + sn))
 		runtimes.append(runtime_ns)
 
-print "Got", len(runtimes), "results, mean", numpy.mean(runtimes), "sd", numpy.std(runtimes)
+os.unlink(timesname)
+
+print "Got", len(runtimes), "results, mean", numpy.mean(runtimes), "median", numpy.median(runtimes), "sd", numpy.std(runtimes)
 
@@ -6,15 +6,63 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/poll.h>
+#include <sys/mman.h>
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <string.h>
 
 static int lliowd_connfd = -1;
+// -1: failed; -2: handshake pending, or not started if lliowd_connfd == -1;
+// -3: using the validity page instead.
 static int lliowd_watchfd = -2;
 
+// The daemon's validity page and our slot in it, if it gave us one.
+// When set, lliowd_ok is a single load with no system call.
+static const volatile struct lliowd_shm_page* lliowd_shm = 0;
+static uint32_t lliowd_slot;
+static uint32_t lliowd_token;
+
+#define UNIX_PATH_MAX 108
+
+static void lliowd_mapshm(uint32_t slot, uint32_t token) {
+
+  const char* homedir = getenv("HOME");
+  if(!homedir)
+    return;
+
+  char shmpath[UNIX_PATH_MAX];
+  if(snprintf(shmpath, UNIX_PATH_MAX, "%s/.lliowd-shm", homedir) >= UNIX_PATH_MAX)
+    return;
+
+  int shmfd = open(shmpath, O_RDONLY | O_CLOEXEC);
+  if(shmfd == -1)
+    return;
+
+  void* mapped = mmap(0, sizeof(struct lliowd_shm_page), PROT_READ, MAP_SHARED, shmfd, 0);
+  close(shmfd);
+  if(mapped == MAP_FAILED)
+    return;
+
+  const struct lliowd_shm_page* page = (const struct lliowd_shm_page*)mapped;
+
+  // Only trust the page if it's the one belonging to the daemon we spoke to, which
+  // alone can have put our token in our slot.
+  if(page->magic != LLIOWD_SHM_MAGIC || slot >= page->nslots || page->valid[slot] != token) {
+
+    munmap(mapped, sizeof(struct lliowd_shm_page));
+    return;
+
+  }
+
+  lliowd_shm = page;
+  lliowd_slot = slot;
+  lliowd_token = token;
+
+}
+
 static void lliowd_getwatchfd() {
 
   // lliowd_connfd is alive. Either retrieve lliowd_watchfd from it,
@@ -23,9 +71,10 @@ static void lliowd_getwatchfd() {
   struct iovec iov[1];
   struct msghdr child_msg;
 
-  char normalbuf;
-  iov[0].iov_base = &normalbuf;
-  iov[0].iov_len = 1;
+  // Status byte, optionally followed by our validity page slot and token.
+  char normalbuf[1 + 2 * sizeof(uint32_t)];
+  iov[0].iov_base = normalbuf;
+  iov[0].iov_len = sizeof(normalbuf);
 
   memset(&child_msg, 0, sizeof(child_msg));
   char cmsgbuf[CMSG_SPACE(sizeof(int))];
@@ -49,7 +98,7 @@ static void lliowd_getwatchfd() {
   }
 
   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&child_msg);
-  if ((!normalbuf) || cmsg == NULL || cmsg -> cmsg_type != SCM_RIGHTS) {
+  if ((!normalbuf[0]) || cmsg == NULL || cmsg -> cmsg_type != SCM_RIGHTS) {
 
     // Server didn't send an FD (and/or sent a 0 in the normal message,
     // which indicates our files are already bad).
@@ -63,9 +112,24 @@ static void lliowd_getwatchfd() {
   close(lliowd_connfd);
   lliowd_connfd = -1;
 
-}
+  if(rc == sizeof(normalbuf)) {
 
-#define UNIX_PATH_MAX 108
+    uint32_t slotinfo[2];
+    memcpy(slotinfo, normalbuf + 1, sizeof(slotinfo));
+    if(slotinfo[0] != (uint32_t)-1)
+      lliowd_mapshm(slotinfo[0], slotinfo[1]);
+
+    // The page supersedes the eventfd.
+    if(lliowd_shm) {
+
+      close(lliowd_watchfd);
+      lliowd_watchfd = -3;
+
+    }
+
+  }
+
+}
 
 void lliowd_init() {
 
@@ -99,20 +163,18 @@ void lliowd_init() {
   }
 
   int ret = connect(lliowd_connfd, (struct sockaddr*)&bindaddr, sizeof(struct sockaddr_un));
-  if(ret == 0) {
-
-    lliowd_getwatchfd();
-
-  }
-  else if(errno != EINPROGRESS) {
+  if(ret != 0 && errno != EINPROGRESS) {
 
     lliowd_watchfd = -1;
     close(lliowd_connfd);
+    lliowd_connfd = -1;
     return;
 
   }
 
-  // Else finish the process in lliowd_ok()
+  // Even if the connection is already made, don't wait for the daemon's reply here:
+  // finish the process in the first lliowd_ok(), so programs that never get
+  // that far pay only for the connect.
    
 }
 
@@ -127,6 +189,15 @@ int lliowd_ok() {
   }
   else if(lliowd_watchfd == -2) {
 
+    // lliowd_init wasn't called: start the handshake now.
+    if(lliowd_connfd == -1) {
+
+      lliowd_init();
+      if(lliowd_watchfd == -1)
+	return 0;
+
+    }
+
     // Connection not completed yet. Finish it:
     struct pollfd waitfd;
     waitfd.fd = lliowd_connfd;
@@ -162,7 +233,19 @@ int lliowd_ok() {
 
   }
 
-  // Check if the inotify fd is readable. If it is, for now assume all our files are no longer good.
+  // Fast path: the daemon clears our slot when any of our files change.
+  if(lliowd_shm) {
+
+    if(lliowd_shm->valid[lliowd_slot] == lliowd_token)
+      return 1;
+
+    lliowd_shm = 0;
+    lliowd_watchfd = -1;
+    return 0;
+
+  }
+
+  // Check if the daemon has signalled the eventfd. If it has, for now assume all our files are no longer good.
   // A better implementation should check individual files.
 
   {
@@ -175,7 +258,7 @@ int lliowd_ok() {
 
     if(pollret != 0) {
 
-      // Poll failed or inotify fd is readable. Either way, fail.
+      // Poll failed or the eventfd is readable. Either way, fail.
       close(lliowd_watchfd);
       lliowd_watchfd = -1;
       return 0;
@@ -189,3 +272,20 @@ int lliowd_ok() {
   return 1;
 
 }
+
+void lliowd_reset() {
+
+  if(lliowd_shm) {
+    munmap((void*)lliowd_shm, sizeof(struct lliowd_shm_page));
+    lliowd_shm = 0;
+  }
+
+  if(lliowd_watchfd >= 0)
+    close(lliowd_watchfd);
+  if(lliowd_connfd >= 0)
+    close(lliowd_connfd);
+
+  lliowd_connfd = -1;
+  lliowd_watchfd = -2;
+
+}
@@ -1,9 +1,37 @@
-
 #ifndef LLIOWD_H
 #define LLIOWD_H
 
+#include <stdint.h>
+
+// Start connecting to the daemon without waiting for it. Optional: lliowd_ok
+// starts the handshake itself if this was never called.
 void lliowd_init();
 
+// Nonzero if the specialised program's files are still as expected.
+// The first call completes the handshake.
 int lliowd_ok();
 
+// Forget the daemon's verdict, so that the next lliowd_ok starts a new handshake.
+// For runtimes that re-specialise in-process (see llpe/jit); not safe to call while
+// another thread may be in lliowd_ok.
+void lliowd_reset();
+
+// Layout of the read-only validity page lliowd publishes at $HOME/.lliowd-shm.
+// valid[slot] holds the token the daemon gave that program while its files are
+// known good, and is cleared as soon as any of them change. A slot freed by a
+// program may be reused, but never with a token it held before, so a client
+// told (slot, token) at handshake can check its files with a single load.
+// generation is the token the daemon's run started counting from.
+#define LLIOWD_SHM_MAGIC 0x6c6c696fu
+#define LLIOWD_SHM_SLOTS 1021
+
+struct lliowd_shm_page {
+
+  uint32_t magic;
+  uint32_t nslots;
+  uint32_t generation;
+  uint32_t valid[LLIOWD_SHM_SLOTS];
+
+};
+
 #endif
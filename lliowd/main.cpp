@@ -4,28 +4,69 @@
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/statfs.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include <openssl/sha.h>
 
+#include <lliowd.h>
+
 #include <unistd.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <set>
 #include <vector>
 #include <sstream>
 #include <fstream>
+#include <string.h>
+#include <thread>
 
 using namespace std;
 
 #define UNIX_PATH_MAX 108
 
-// watch_fd is set to -1 if files are already non-matching.
+// One file a program depends on, as the config names it.
+struct file_dep {
+
+  std::string fname;
+  time_t expected_mtime;
+  std::string hashstr;
+
+  bool operator==(const file_dep& other) const {
+    return fname == other.fname && expected_mtime == other.expected_mtime && hashstr == other.hashstr;
+  }
+
+};
+
+// watch_fd is an eventfd the daemon signals when any of the program's files change,
+// handed to clients in place of a watch of their own, and is set to -1 if files are
+// already non-matching. A program dropped or replaced by a reload stays in progs,
+// removed, so that indices into progs stay put (see reload_config). slot is its place
+// in the validity page, or NO_SLOT, and slot_token what valid[slot] holds while its
+// files are good (see assign_slot).
+#define NO_SLOT ((uint32_t)-1)
+
 struct spec_program {
 
   std::string binary_name;
   int watch_fd;
+  bool removed;
+  uint32_t slot;
+  uint32_t slot_token;
+  std::vector<file_dep> files;
 
 };
 
@@ -36,7 +77,7 @@ static struct spec_program* findprog(const char* name) {
   std::string names(name);
 
   for(std::vector<struct spec_program>::iterator it = progs.begin(), itend = progs.end(); it != itend; ++it)
-    if(it->binary_name == names)
+    if(it->binary_name == names && !it->removed)
       return &*it;
   
   return 0;
@@ -56,369 +97,1477 @@ static int firstnonws(std::string& s) {
 
 }
 
+static struct lliowd_shm_page* shmpage = 0;
+
 static void mark_failed(struct spec_program& prog) {
 
+  if(prog.watch_fd == -1)
+    return;
+
+  // Wake any client polling its copy of the eventfd; the count outlives our close.
+  uint64_t one = 1;
+  if(write(prog.watch_fd, &one, sizeof(one)) == -1)
+    cerr << "Failed to signal " << prog.binary_name << "\n";
+
   close(prog.watch_fd);
   prog.watch_fd = -1;
 
 }
 
-static void parse_config(const char* confname) {
+// All programs share one inotify instance, or with -F one fanotify group, in which each
+// file depended on is watched once however many programs depend on it. With inotify,
+// where a directory holds at least coalesce_min watched files they are covered by one
+// watch of the directory instead; 0 turns this off.
+static bool use_fanotify = false;
+static unsigned coalesce_min = 8;
+static int notify_fd = -1;
 
-  ifstream ifs(confname);
-  while(!ifs.eof()) {
+// Events on a path itself and, for directories, on their entries, which is what a
+// specialised listing depends on. A watched directory also reports changes to the files
+// in it, by name.
+static const uint32_t inotify_mask = IN_ATTRIB | IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF |
+  IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
 
-    std::string line;
-    getline(ifs, line);
+struct inotify_watch {
 
-    while(line.size() && isspace(line.back()))
-      line.erase(line.size() - 1);
+  // The programs depending on the watched file or directory itself,
+  std::vector<size_t> progs;
+  // and for a directory, those depending on files in it this watch covers, by name.
+  std::map<std::string, std::vector<size_t> > children;
 
-    int wsoff = firstnonws(line);
-    if(wsoff == line.size()) {
+};
 
-      continue;
+// By watch descriptor, which inotify gives out once per inode, and for watches that
+// may cover files, by path.
+static std::map<int, inotify_watch> inotify_watches;
+static std::map<std::string, int> dir_watches;
 
-    }
-    else if(wsoff == 0) {
-      
-      // Start new program
-      progs.push_back(spec_program());
-      progs.back().binary_name = line;
+// fanotify reports files by filesystem ID and file handle; see file_key.
+static std::map<std::string, std::vector<size_t> > fanotify_files;
 
-      int new_watch = inotify_init();
+static void programs_changed(const std::vector<size_t>& which);
+static void all_programs_changed();
 
-      if(new_watch == -1) {
+// One file named in the config, checked once all of a batch of programs' have been read.
+struct file_check {
 
-	cerr << "Inotify open failed\n";
-	exit(1);
+  size_t prog;
+  std::string fname;
+  time_t expected_mtime;
+  std::string hashstr;
+  struct stat filestat;
+  bool hashok;
+  unsigned char realhash[SHA_DIGEST_LENGTH];
 
-      }
+};
 
-      progs.back().watch_fd = new_watch;
+// Hashes computed by an earlier run or an earlier load of the config, keyed by
+// (inode, mtime, size). A file whose stat still matches is not read again.
+struct cached_hash {
 
-      cout << "Adding program " << progs.back().binary_name << "\n";
+  ino_t ino;
+  time_t mtime;
+  off_t size;
+  unsigned char hash[SHA_DIGEST_LENGTH];
 
-    }
-    else {
+};
 
-      if(progs.empty()) {
+static std::map<std::string, cached_hash> hashcache;
 
-	cerr << "Indented line at start of config\n";
-	exit(1);
+static bool parse_hash(const std::string& hashstr, unsigned char* hash) {
 
-      }
+  if(hashstr.size() != SHA_DIGEST_LENGTH * 2)
+    return false;
 
-      // Already failed?
-      if(progs.back().watch_fd == -1)
-	continue;
+  istringstream iss(hashstr);
+  for(int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
 
-      // New file
-      std::string fline(line, wsoff);
+    char hexchars[3];
+    iss.get(hexchars, 3);
+    hexchars[2] = '\0';
+    hash[i] = (char)strtol(hexchars, 0, 16);
 
-      // Last two fields: expected unix time (decimal), expected sha256 hash (hex)
-      unsigned hashstart = fline.find_last_of(" ");
-      if(hashstart == std::string::npos || hashstart == 0) {
+  }
 
-	cerr << "Bad line " << fline << "\n";
-	exit(1);
+  return true;
 
-      }
+}
 
-      unsigned timestart = fline.find_last_of(" ", hashstart - 1);
-      if(timestart == std::string::npos || timestart == 0) {
+static std::string print_hash(const unsigned char* hash) {
 
-	cerr << "Bad line " << fline << "\n";
-	exit(1);
+  std::ostringstream oss;
+  for(int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
 
-      }
-      
-      std::string fname(fline, 0, timestart);
+    oss.width(2);
+    oss.fill('0');
+    oss << std::hex << (unsigned int)hash[i];
 
-      // Add an inotify watch *before* verifying file, to avoid race.
-      if(inotify_add_watch(progs.back().watch_fd, fname.c_str(), IN_ATTRIB | IN_DELETE_SELF | IN_MODIFY) == -1) {
+  }
 
-	cerr << "Failed adding watch: " << fname << "\n";
-	mark_failed(progs.back());
-	continue;
+  return oss.str();
 
-      }
+}
 
-      // First of all: file exists?
-      struct stat filestat;
-      if(stat(fname.c_str(), &filestat) == -1) {
+static std::string hash_cache_name(const char* confname) {
+
+  return std::string(confname) + ".hashcache";
+
+}
+
+static void read_hash_cache(const char* confname, std::map<std::string, cached_hash>& cache) {
+
+  ifstream ifs(hash_cache_name(confname).c_str());
+  std::string line;
+  while(getline(ifs, line)) {
+
+    // Format: inode mtime size hash path
+    istringstream iss(line);
+    cached_hash entry;
+    unsigned long long ino, size;
+    long long mtime;
+    std::string hashstr;
+    if(!(iss >> ino >> mtime >> size >> hashstr))
+      continue;
+
+    std::string fname;
+    iss.get();
+    getline(iss, fname);
+
+    if(fname.empty() || !parse_hash(hashstr, entry.hash))
+      continue;
+
+    entry.ino = (ino_t)ino;
+    entry.mtime = (time_t)mtime;
+    entry.size = (off_t)size;
+    cache[fname] = entry;
+
+  }
+
+}
 
-	cerr << fname << ": not found\n";
-	mark_failed(progs.back());
+// Entries for files no program still listed depends on are dropped.
+static void write_hash_cache(const char* confname) {
+
+  std::set<std::string> live;
+  for(std::vector<spec_program>::iterator it = progs.begin(), itend = progs.end(); it != itend; ++it) {
+    if(it->removed)
+      continue;
+    for(std::vector<file_dep>::iterator fit = it->files.begin(), fitend = it->files.end(); fit != fitend; ++fit)
+      live.insert(fit->fname);
+  }
+
+  std::string cachename = hash_cache_name(confname);
+  std::string tmpname = cachename + ".tmp";
+
+  {
+    ofstream ofs(tmpname.c_str());
+    if(!ofs)
+      return;
+
+    for(std::map<std::string, cached_hash>::iterator it = hashcache.begin(), itend = hashcache.end(); it != itend; ++it) {
+
+      if(!live.count(it->first))
 	continue;
 
-      }
+      ofs << (unsigned long long)it->second.ino << " " << (long long)it->second.mtime << " " 
+	  << (unsigned long long)it->second.size << " " << print_hash(it->second.hash) << " " << it->first << "\n";
 
-      std::string timestr(fline, timestart + 1, hashstart - timestart);
+    }
+  }
 
-      // mtimes match?
-      {
-	std::istringstream iss(timestr);
-	time_t expected_time;
-	iss >> expected_time;
+  rename(tmpname.c_str(), cachename.c_str());
 
-	if(expected_time != filestat.st_mtime) {
+}
 
-	  cerr << fname << ": bad mtime (expected " << expected_time << ", got " << filestat.st_mtime << "\n";
-	  mark_failed(progs.back());
-	  continue;
+// A directory is hashed as its getdents64 record stream, which is what LLPE hashed when it
+// specialised a scan of it.
+static ssize_t read_contents(int filefd, bool isdir, char* buf, size_t len) {
 
-	}
-      }
+  if(isdir)
+    return syscall(SYS_getdents64, filefd, buf, len);
+  else
+    return read(filefd, buf, len);
 
-      // Get hash of the real file:
+}
 
-      unsigned char realhash[SHA_DIGEST_LENGTH];
-      {
-	SHA_CTX hashctx;
-	if(!SHA1_Init(&hashctx)) {
+static bool hash_file(const std::string& fname, unsigned char* hash) {
 
-	  cerr << "SHA1_Init\n";
-	  exit(1);
+  SHA_CTX hashctx;
+  if(!SHA1_Init(&hashctx))
+    return false;
 
-	}
-	
-	int filefd = open(fname.c_str(), O_RDONLY);
-	if(filefd == -1) {
-	  
-	  cerr << "Cannot open " << fname << "\n";
-	  mark_failed(progs.back());
-	  continue;
+  int filefd = open(fname.c_str(), O_RDONLY);
+  if(filefd == -1)
+    return false;
 
-	}
-	
-	char readbuf[4096];
-	int thisread;
+  struct stat filestat;
+  if(fstat(filefd, &filestat) == -1) {
 
-	while((thisread = read(filefd, readbuf, 4096)) > 0) {
+    close(filefd);
+    return false;
 
- 	  if(!SHA1_Update(&hashctx, readbuf, thisread)) {
+  }
 
-	    cerr << "SHA1_Update\n";
-	    exit(1);
+  bool isdir = S_ISDIR(filestat.st_mode);
 
-	  }
+  char readbuf[65536];
+  ssize_t thisread;
 
-	}
+  while((thisread = read_contents(filefd, isdir, readbuf, sizeof(readbuf))) > 0) {
 
-	if(thisread == -1) {
+    if(!SHA1_Update(&hashctx, readbuf, thisread)) {
 
-	  cerr << "Read failed for " << fname << "\n";
-	  mark_failed(progs.back());
-	  close(filefd);
-	  continue;
+      close(filefd);
+      return false;
 
-	}
+    }
 
-	if(!SHA1_Final(realhash, &hashctx)) {
+  }
 
-	  cerr << "SHA1_Final\n";
-	  exit(1);
+  close(filefd);
 
-	}
+  if(thisread == -1)
+    return false;
 
-	close(filefd);
+  return SHA1_Final(hash, &hashctx);
 
-      }
+}
 
-      // Parse hash given in config:
-      unsigned char expectedhash[SHA_DIGEST_LENGTH];
-      std::string hashstr(fline, hashstart + 1);
+// Hash the files that need it using one thread per core; each claims files one at a time
+// since sizes vary widely.
+static void hash_files(std::vector<file_check*>& tohash) {
 
-      if(hashstr.size() != SHA_DIGEST_LENGTH * 2) {
+  std::atomic<size_t> next(0);
 
-	cerr << hashstr << " wrong length (expected " << (SHA_DIGEST_LENGTH * 2) << ", got " << hashstr.size() << ")\n";
-	exit(1);
+  auto worker = [&]() {
+    for(size_t i = next++; i < tohash.size(); i = next++)
+      tohash[i]->hashok = hash_file(tohash[i]->fname, tohash[i]->realhash);
+  };
 
-      }
+  unsigned nthreads = std::thread::hardware_concurrency();
+  if(nthreads == 0)
+    nthreads = 1;
+  if(nthreads > tohash.size())
+    nthreads = tohash.size();
 
-      {
-	istringstream iss(hashstr);
-	for(int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+  std::vector<std::thread> workers;
+  for(unsigned i = 1; i < nthreads; ++i)
+    workers.push_back(std::thread(worker));
 
-	  char hexchars[3];
-	  iss.get(hexchars, 3);
-	  hexchars[2] = '\0';
-	  expectedhash[i] = (char)strtol(hexchars, 0, 16);
+  worker();
 
-	}
-      }
+  for(std::vector<std::thread>::iterator it = workers.begin(), itend = workers.end(); it != itend; ++it)
+    it->join();
+
+}
+
+static void split_path(const std::string& path, std::string& dir, std::string& name) {
 
-      if(memcmp(expectedhash, realhash, SHA_DIGEST_LENGTH) != 0) {
+  size_t slash = path.rfind('/');
+  if(slash == std::string::npos) {
+    dir = ".";
+    name = path;
+  }
+  else {
+    dir = slash == 0 ? "/" : std::string(path, 0, slash);
+    name = std::string(path, slash + 1);
+  }
 
-	cerr << "Hash bad match: expected: " << hashstr << ", got: ";
-	for(int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+}
 
-	  cerr << std::hex << (unsigned int)realhash[i];
+static void watch_failed(const std::string& fname, const std::vector<size_t>& which) {
 
-	}
-	cerr << "\n";
+  cerr << "Failed adding watch: " << fname << "\n";
+  for(std::vector<size_t>::const_iterator it = which.begin(), itend = which.end(); it != itend; ++it)
+    mark_failed(progs[*it]);
+
+}
+
+static void add_inotify_watches(std::map<std::string, std::vector<size_t> >& paths) {
+
+  // Only a file with no other links is covered by its directory's watch, since a write
+  // through a link elsewhere would only be reported there.
+  std::map<std::string, std::vector<std::string> > bydir;
+  if(coalesce_min) {
 
-	mark_failed(progs.back());
+    for(std::map<std::string, std::vector<size_t> >::iterator it = paths.begin(), itend = paths.end(); it != itend; ++it) {
+
+      struct stat filestat;
+      if(stat(it->first.c_str(), &filestat) == -1 || !S_ISREG(filestat.st_mode) || filestat.st_nlink != 1)
 	continue;
 
-      }
+      std::string dir, name;
+      split_path(it->first, dir, name);
+      bydir[dir].push_back(it->first);
+
+    }
+
+  }
+
+  std::set<std::string> covered;
 
-      cout << "Verified " << fname << "\n";
+  for(std::map<std::string, std::vector<std::string> >::iterator it = bydir.begin(), itend = bydir.end(); it != itend; ++it) {
+
+    // A directory watched for its own sake, or for other files, reports its files'
+    // changes anyway.
+    if(it->second.size() < coalesce_min && !paths.count(it->first) && !dir_watches.count(it->first))
+      continue;
+
+    int wd = inotify_add_watch(notify_fd, it->first.c_str(), inotify_mask);
+    if(wd == -1)
+      continue;
+    dir_watches[it->first] = wd;
+
+    inotify_watch& watch = inotify_watches[wd];
+    for(std::vector<std::string>::iterator fit = it->second.begin(), fitend = it->second.end(); fit != fitend; ++fit) {
+
+      std::string dir, name;
+      split_path(*fit, dir, name);
+      std::vector<size_t>& which = paths[*fit];
+      watch.children[name].insert(watch.children[name].end(), which.begin(), which.end());
+      covered.insert(*fit);
 
     }
 
   }
 
-}
+  for(std::map<std::string, std::vector<size_t> >::iterator it = paths.begin(), itend = paths.end(); it != itend; ++it) {
 
-static int createlistensock() {
+    if(covered.count(it->first))
+      continue;
 
-  int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
-  if(listenfd == -1) {
+    int wd = inotify_add_watch(notify_fd, it->first.c_str(), inotify_mask);
+    if(wd == -1) {
+      watch_failed(it->first, it->second);
+      continue;
+    }
+    dir_watches[it->first] = wd;
 
-    fprintf(stderr, "Socket\n");
-    exit(1);
+    std::vector<size_t>& which = inotify_watches[wd].progs;
+    which.insert(which.end(), it->second.begin(), it->second.end());
 
   }
 
-  struct sockaddr_un bindaddr;
-  bindaddr.sun_family = AF_UNIX;
-  
-  const char* homedir = getenv("HOME");
-  if(!homedir) {
+  cout << "Watching " << paths.size() << " files with " << inotify_watches.size() << " inotify watches\n";
 
-    fprintf(stderr, "HOME not set\n");
-    exit(1);
+}
+
+#ifdef FAN_REPORT_FID
+
+static std::string file_key(const void* fsid, size_t fsidlen, const struct file_handle* handle) {
+
+  std::string key((const char*)fsid, fsidlen);
+  key.append((const char*)&handle->handle_type, sizeof(handle->handle_type));
+  key.append((const char*)handle->f_handle, handle->handle_bytes);
+  return key;
+
+}
+
+// Only fanotify's file ID mode reports attribute, entry and self events, from Linux 5.1;
+// marking whole filesystems needs CAP_SYS_ADMIN, but no mark per file.
+static const uint64_t fanotify_mask = FAN_MODIFY | FAN_ATTRIB | FAN_DELETE_SELF | FAN_MOVE_SELF |
+  FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR;
+
+// Filesystems already marked, by ID.
+static std::set<std::string> fanotify_marked;
+
+static void add_fanotify_marks(std::map<std::string, std::vector<size_t> >& paths) {
+
+  std::set<std::string>& marked = fanotify_marked;
+
+  for(std::map<std::string, std::vector<size_t> >::iterator it = paths.begin(), itend = paths.end(); it != itend; ++it) {
+
+    union {
+      struct file_handle handle;
+      char bytes[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+    } fh;
+    fh.handle.handle_bytes = MAX_HANDLE_SZ;
+    int mount_id;
+
+    struct statfs fsstat;
+    if(statfs(it->first.c_str(), &fsstat) == -1 ||
+       name_to_handle_at(AT_FDCWD, it->first.c_str(), &fh.handle, &mount_id, AT_SYMLINK_FOLLOW) == -1) {
+      watch_failed(it->first, it->second);
+      continue;
+    }
+
+    std::string fsid((const char*)&fsstat.f_fsid, sizeof(fsstat.f_fsid));
+    if(!marked.count(fsid)) {
+
+      if(fanotify_mark(notify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, fanotify_mask, AT_FDCWD, it->first.c_str()) == -1) {
+	watch_failed(it->first, it->second);
+	continue;
+      }
+      marked.insert(fsid);
+
+    }
+
+    std::vector<size_t>& which = fanotify_files[file_key(&fsstat.f_fsid, sizeof(fsstat.f_fsid), &fh.handle)];
+    which.insert(which.end(), it->second.begin(), it->second.end());
 
   }
 
-  if(snprintf(bindaddr.sun_path, UNIX_PATH_MAX, "%s/.lliowd-socket", homedir) >= UNIX_PATH_MAX) {
+  cout << "Watching " << paths.size() << " files on " << marked.size() << " filesystems with fanotify\n";
 
-    fprintf(stderr, "Socket path too long\n");
+}
+
+#endif
+
+static void init_notify() {
+
+  if(use_fanotify) {
+
+#ifdef FAN_REPORT_FID
+    notify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_FID | FAN_UNLIMITED_QUEUE | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_CLOEXEC);
+    if(notify_fd == -1) {
+
+      cerr << "fanotify_init failed (-F needs Linux 5.1 and CAP_SYS_ADMIN)\n";
+      exit(1);
+
+    }
+#else
+    cerr << "lliowd was built without fanotify file ID support\n";
     exit(1);
+#endif
 
   }
+  else {
 
-  unlink(bindaddr.sun_path);
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(notify_fd == -1) {
 
-  if(bind(listenfd, (struct sockaddr*)&bindaddr, sizeof(struct sockaddr_un)) == -1) {
+      cerr << "Inotify open failed\n";
+      exit(1);
 
-    fprintf(stderr, "Bind failed\n");
-    exit(1);
+    }
 
   }
 
-  if(listen(listenfd, 5) == -1) {
+}
 
-    fprintf(stderr, "Listen failed\n");
-    exit(1);
+static void add_watches(std::map<std::string, std::vector<size_t> >& paths) {
 
+#ifdef FAN_REPORT_FID
+  if(use_fanotify) {
+    add_fanotify_marks(paths);
+    return;
   }
+#endif
 
-  return listenfd;
+  add_inotify_watches(paths);
 
 }
 
-int main(int argc, char** argv) {
+// Read the programs and their files from the config, or say what's wrong with it.
+static bool read_config(const char* confname, std::vector<spec_program>& listed) {
 
-  if(argc < 2) {
-    fprintf(stderr, "Usage: lliowd config_file\n");
-    exit(1);
-  }
+  ifstream ifs(confname);
+  if(!ifs) {
 
-  parse_config(argv[1]);
+    cerr << "Cannot open " << confname << "\n";
+    return false;
 
-  int listenfd = createlistensock();
+  }
 
-  while(1) {
+  std::string line;
+  while(getline(ifs, line)) {
+
+    while(line.size() && isspace(line.back()))
+      line.erase(line.size() - 1);
 
-    struct sockaddr_un otherend;
-    socklen_t otherendlen;
-    int connfd = accept(listenfd, (struct sockaddr*)&otherend, &otherendlen);
+    int wsoff = firstnonws(line);
+    if(wsoff == line.size()) {
 
-    if(connfd == -1) {
-      fprintf(stderr, "Accept failed\n");
       continue;
+
+    }
+    else if(wsoff == 0) {
+      
+      // Start new program
+      listed.push_back(spec_program());
+      listed.back().binary_name = line;
+      listed.back().watch_fd = -1;
+      listed.back().removed = false;
+      listed.back().slot = NO_SLOT;
+      listed.back().slot_token = 0;
+
     }
+    else {
 
-    struct ucred otherendcreds;
-    socklen_t otherendcredslen = sizeof(struct ucred);
-    if(getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &otherendcreds, &otherendcredslen) == -1) {
+      if(listed.empty()) {
 
-      fprintf(stderr, "getsockopt failed\n");
-      close(connfd);
-      continue;
+	cerr << "Indented line at start of config\n";
+	return false;
+
+      }
+
+      // New file
+      std::string fline(line, wsoff);
+
+      // Last two fields: expected unix time (decimal), expected sha256 hash (hex)
+      unsigned hashstart = fline.find_last_of(" ");
+      if(hashstart == std::string::npos || hashstart == 0) {
+
+	cerr << "Bad line " << fline << "\n";
+	return false;
+
+      }
+
+      unsigned timestart = fline.find_last_of(" ", hashstart - 1);
+      if(timestart == std::string::npos || timestart == 0) {
+
+	cerr << "Bad line " << fline << "\n";
+	return false;
+
+      }
+      
+      file_dep dep;
+      dep.fname = std::string(fline, 0, timestart);
+      std::string timestr(fline, timestart + 1, hashstart - timestart);
+      dep.hashstr = std::string(fline, hashstart + 1);
+
+      if(dep.hashstr.size() != SHA_DIGEST_LENGTH * 2) {
+
+	cerr << dep.hashstr << " wrong length (expected " << (SHA_DIGEST_LENGTH * 2) << ", got " << dep.hashstr.size() << ")\n";
+	return false;
+
+      }
+
+      std::istringstream iss(timestr);
+      iss >> dep.expected_mtime;
+
+      listed.back().files.push_back(dep);
 
     }
 
-    char pathbuf[128];
-    sprintf(pathbuf, "/proc/%d/exe", otherendcreds.pid);
+  }
+
+  return true;
+
+}
 
-    char exebuf[4096];
-    ssize_t rlret = readlink(pathbuf, exebuf, 4096);
-    if(rlret < 0 || rlret == 4096) {
+// Append programs to progs, watch their files and verify them. Programs already there
+// are left alone, and files whose stat still matches the hash cache aren't read.
+static void add_programs(const char* confname, std::vector<spec_program>& added) {
 
-      cerr << "Path name too long for " << pathbuf << "\n";
-      close(connfd);
-      continue;
+  std::vector<file_check> checks;
+
+  for(std::vector<spec_program>::iterator it = added.begin(), itend = added.end(); it != itend; ++it) {
+
+    progs.push_back(*it);
+    spec_program& prog = progs.back();
+
+    prog.watch_fd = eventfd(0, EFD_CLOEXEC);
+    if(prog.watch_fd == -1)
+      cerr << "eventfd failed for " << prog.binary_name << "\n";
+
+    cout << "Adding program " << prog.binary_name << "\n";
+
+    for(std::vector<file_dep>::iterator fit = prog.files.begin(), fitend = prog.files.end(); fit != fitend; ++fit) {
+
+      checks.push_back(file_check());
+      file_check& check = checks.back();
+      check.prog = progs.size() - 1;
+      check.fname = fit->fname;
+      check.expected_mtime = fit->expected_mtime;
+      check.hashstr = fit->hashstr;
+      check.hashok = false;
 
     }
 
-    exebuf[rlret] = '\0';
+  }
+
+  // Add the watches *before* verifying files, to avoid a race, once we know every
+  // program that depends on each file.
+  {
+    std::map<std::string, std::vector<size_t> > paths;
+    for(std::vector<file_check>::iterator it = checks.begin(), itend = checks.end(); it != itend; ++it)
+      paths[it->fname].push_back(it->prog);
+
+    add_watches(paths);
+  }
+
+  for(std::vector<file_check>::iterator it = checks.begin(), itend = checks.end(); it != itend; ++it) {
+
+    // Already failed?
+    if(progs[it->prog].watch_fd == -1)
+      continue;
 
-    struct spec_program* prog = findprog(exebuf);
-    if(!prog) {
+    // First of all: file exists?
+    if(stat(it->fname.c_str(), &it->filestat) == -1) {
 
-      cerr << "No such program " << exebuf << "\n";
-      close(connfd);
+      cerr << it->fname << ": not found\n";
+      mark_failed(progs[it->prog]);
       continue;
 
     }
 
-    if(prog->watch_fd == -1) {
+    // mtimes match?
+    if(it->expected_mtime != it->filestat.st_mtime) {
 
-      // Couldn't verify this program's files
-      if(send(connfd, "\0", 1, MSG_NOSIGNAL) == -1)
-	cerr << "Write failed\n";
+      cerr << it->fname << ": bad mtime (expected " << it->expected_mtime << ", got " << it->filestat.st_mtime << "\n";
+      mark_failed(progs[it->prog]);
+      continue;
 
     }
-    else {
 
-      // The program's files were good at startup, and hopefully remain so! Send the inotify handle:
-      struct msghdr hdr;
-      struct iovec data;
+  }
 
-      char cmsgbuf[CMSG_SPACE(sizeof(int))];
+  // Get hashes of the real files, from the cache where the file is unchanged since
+  // we last hashed it, and otherwise by reading them in parallel.
 
-      char dummy = '\x01';
-      data.iov_base = &dummy;
-      data.iov_len = sizeof(dummy);
+  std::map<std::string, cached_hash>& cache = hashcache;
 
-      memset(&hdr, 0, sizeof(hdr));
-      hdr.msg_name = NULL;
-      hdr.msg_namelen = 0;
-      hdr.msg_iov = &data;
-      hdr.msg_iovlen = 1;
-      hdr.msg_flags = 0;
+  std::vector<file_check*> tohash;
 
-      hdr.msg_control = cmsgbuf;
-      hdr.msg_controllen = CMSG_LEN(sizeof(int));
+  for(std::vector<file_check>::iterator it = checks.begin(), itend = checks.end(); it != itend; ++it) {
 
-      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
-      cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
-      cmsg->cmsg_level = SOL_SOCKET;
-      cmsg->cmsg_type  = SCM_RIGHTS;
+    if(progs[it->prog].watch_fd == -1)
+      continue;
 
-      *(int*)CMSG_DATA(cmsg) = prog->watch_fd;
+    std::map<std::string, cached_hash>::iterator findit = cache.find(it->fname);
+    if(findit != cache.end() && 
+       findit->second.ino == it->filestat.st_ino &&
+       findit->second.mtime == it->filestat.st_mtime &&
+       findit->second.size == it->filestat.st_size) {
 
-      int n = sendmsg(connfd, &hdr, MSG_NOSIGNAL);
-      if(n == -1)
-	cerr << "sendmsg failed\n";
+      memcpy(it->realhash, findit->second.hash, SHA_DIGEST_LENGTH);
+      it->hashok = true;
 
     }
+    else {
 
-    close(connfd);
+      tohash.push_back(&*it);
+
+    }
+
+  }
+
+  hash_files(tohash);
+
+  for(std::vector<file_check>::iterator it = checks.begin(), itend = checks.end(); it != itend; ++it) {
+
+    struct spec_program& prog = progs[it->prog];
+    if(prog.watch_fd == -1)
+      continue;
+
+    if(!it->hashok) {
+
+      cerr << "Cannot read " << it->fname << "\n";
+      mark_failed(prog);
+      continue;
+
+    }
+
+    cached_hash& entry = cache[it->fname];
+    entry.ino = it->filestat.st_ino;
+    entry.mtime = it->filestat.st_mtime;
+    entry.size = it->filestat.st_size;
+    memcpy(entry.hash, it->realhash, SHA_DIGEST_LENGTH);
+
+    // Compare against the hash given in config:
+    unsigned char expectedhash[SHA_DIGEST_LENGTH];
+    parse_hash(it->hashstr, expectedhash);
+
+    if(memcmp(expectedhash, it->realhash, SHA_DIGEST_LENGTH) != 0) {
+
+      cerr << "Hash bad match: expected: " << it->hashstr << ", got: " << print_hash(it->realhash) << "\n";
+      mark_failed(prog);
+      continue;
+
+    }
+
+    cout << "Verified " << it->fname << "\n";
+
+  }
+
+  write_hash_cache(confname);
+
+}
+
+static int createlistensock() {
+
+  int listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(listenfd == -1) {
+
+    fprintf(stderr, "Socket\n");
+    exit(1);
+
+  }
+
+  struct sockaddr_un bindaddr;
+  bindaddr.sun_family = AF_UNIX;
+  
+  const char* homedir = getenv("HOME");
+  if(!homedir) {
+
+    fprintf(stderr, "HOME not set\n");
+    exit(1);
+
+  }
+
+  if(snprintf(bindaddr.sun_path, UNIX_PATH_MAX, "%s/.lliowd-socket", homedir) >= UNIX_PATH_MAX) {
+
+    fprintf(stderr, "Socket path too long\n");
+    exit(1);
+
+  }
+
+  unlink(bindaddr.sun_path);
+
+  if(bind(listenfd, (struct sockaddr*)&bindaddr, sizeof(struct sockaddr_un)) == -1) {
+
+    fprintf(stderr, "Bind failed\n");
+    exit(1);
+
+  }
+
+  if(listen(listenfd, SOMAXCONN) == -1) {
+
+    fprintf(stderr, "Listen failed\n");
+    exit(1);
+
+  }
+
+  return listenfd;
+
+}
+
+// Tell a client whether prog's files are still good. If they are, the program's eventfd
+// is passed along so the client can notice later changes itself.
+static void send_status(int connfd, struct spec_program* prog) {
+
+  if((!prog) || prog->watch_fd == -1) {
+
+    // Unknown program, or couldn't verify this program's files
+    if(send(connfd, "\0", 1, MSG_NOSIGNAL) == -1)
+      cerr << "Write failed\n";
+    return;
+
+  }
+
+  // The program's files were good at startup, and hopefully remain so! Send the eventfd:
+  struct msghdr hdr;
+  struct iovec data;
+
+  char cmsgbuf[CMSG_SPACE(sizeof(int))];
+
+  // Status byte, then the program's slot and its token in the validity page.
+  char msgbuf[1 + 2 * sizeof(uint32_t)];
+  msgbuf[0] = '\x01';
+  uint32_t slotinfo[2];
+  slotinfo[0] = prog->slot;
+  slotinfo[1] = prog->slot_token;
+  memcpy(msgbuf + 1, slotinfo, sizeof(slotinfo));
+  data.iov_base = msgbuf;
+  data.iov_len = sizeof(msgbuf);
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_name = NULL;
+  hdr.msg_namelen = 0;
+  hdr.msg_iov = &data;
+  hdr.msg_iovlen = 1;
+  hdr.msg_flags = 0;
+
+  hdr.msg_control = cmsgbuf;
+  hdr.msg_controllen = CMSG_LEN(sizeof(int));
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+  cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+
+  *(int*)CMSG_DATA(cmsg) = prog->watch_fd;
+
+  int n = sendmsg(connfd, &hdr, MSG_NOSIGNAL);
+  if(n == -1)
+    cerr << "sendmsg failed\n";
+
+}
+
+// Slots given up by retired or failed programs, and the last slot token handed out.
+static std::vector<uint32_t> free_slots;
+static uint32_t last_slot_token;
+
+// Give a verified program a slot in the validity page. A freed slot is reused, with a
+// token no earlier holder was given: a client of the old program may still be checking
+// the slot, and must go on seeing its own token gone. Programs beyond the page's
+// capacity are not given a slot and their clients fall back to polling the eventfd.
+static void assign_slot(struct spec_program& prog) {
+
+  if((!shmpage) || prog.watch_fd == -1 || prog.slot != NO_SLOT)
+    return;
+
+  uint32_t slot;
+  if(!free_slots.empty()) {
+    slot = free_slots.back();
+    free_slots.pop_back();
+  }
+  else if(shmpage->nslots < LLIOWD_SHM_SLOTS)
+    slot = shmpage->nslots;
+  else {
+    cerr << "Validity page full; clients of " << prog.binary_name << " will poll its eventfd\n";
+    return;
+  }
+
+  if(!++last_slot_token)
+    ++last_slot_token;
+
+  prog.slot = slot;
+  prog.slot_token = last_slot_token;
+  __atomic_store_n(&shmpage->valid[slot], prog.slot_token, __ATOMIC_RELEASE);
+
+  // Only then tell clients the slot exists.
+  if(slot == shmpage->nslots)
+    __atomic_store_n(&shmpage->nslots, slot + 1, __ATOMIC_RELEASE);
+
+}
+
+// Publish each program's validity in a page clients map read-only, so that
+// lliowd_ok needs no system call.
+static void create_shm_page() {
+
+  const char* homedir = getenv("HOME");
+  if(!homedir)
+    return;
+
+  std::string shmname = std::string(homedir) + "/.lliowd-shm";
+  std::string tmpname = shmname + ".tmp";
+
+  int shmfd = open(tmpname.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(shmfd == -1) {
+
+    cerr << "Failed to create " << tmpname << "\n";
+    return;
+
+  }
+
+  if(ftruncate(shmfd, sizeof(struct lliowd_shm_page)) == -1) {
+
+    cerr << "Failed to size " << tmpname << "\n";
+    close(shmfd);
+    return;
+
+  }
+
+  void* mapped = mmap(0, sizeof(struct lliowd_shm_page), PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+  close(shmfd);
+  if(mapped == MAP_FAILED) {
+
+    cerr << "Failed to map " << tmpname << "\n";
+    return;
+
+  }
+
+  shmpage = (struct lliowd_shm_page*)mapped;
+
+  // A fresh generation for every daemon run, from which slot tokens count up, so
+  // that clients of a previous instance, still mapping the page it published, are
+  // unlikely to match a slot here even before that page is cleared below.
+  uint32_t generation = (uint32_t)time(0) ^ ((uint32_t)getpid() << 16);
+  if(!generation)
+    generation = 1;
+
+  shmpage->magic = LLIOWD_SHM_MAGIC;
+  shmpage->nslots = 0;
+  shmpage->generation = generation;
+  last_slot_token = generation;
+
+  for(size_t i = 0, ilim = progs.size(); i != ilim; ++i)
+    assign_slot(progs[i]);
+
+  // Retire any page left by an earlier run before replacing it.
+  int oldfd = open(shmname.c_str(), O_RDWR | O_CLOEXEC);
+  if(oldfd != -1) {
+
+    struct lliowd_shm_page* oldpage = (struct lliowd_shm_page*)mmap(0, sizeof(struct lliowd_shm_page), PROT_READ | PROT_WRITE, MAP_SHARED, oldfd, 0);
+    if(oldpage != MAP_FAILED) {
+
+      memset(oldpage->valid, 0, sizeof(oldpage->valid));
+      munmap(oldpage, sizeof(struct lliowd_shm_page));
+
+    }
+    close(oldfd);
+
+  }
+
+  rename(tmpname.c_str(), shmname.c_str());
+
+}
+
+// Clear all slots on the way out: nobody will be watching the files any more.
+static void retire_shm_page(int) {
+
+  if(shmpage)
+    memset(shmpage->valid, 0, sizeof(shmpage->valid));
+  _exit(0);
+
+}
+
+// Clear a program's slot and free it for reuse, signal its eventfd, and stop handing
+// it out to new clients.
+static void invalidate_program(size_t progidx) {
+
+  struct spec_program& prog = progs[progidx];
+  if(prog.slot != NO_SLOT) {
+    __atomic_store_n(&shmpage->valid[prog.slot], 0, __ATOMIC_RELEASE);
+    free_slots.push_back(prog.slot);
+    prog.slot = NO_SLOT;
+  }
+
+  mark_failed(prog);
+
+}
+
+// One of a program's files changed.
+static void program_changed(size_t progidx) {
+
+  struct spec_program& prog = progs[progidx];
+  if(prog.watch_fd == -1)
+    return;
+
+  cout << "Files changed for " << prog.binary_name << "\n";
+
+  invalidate_program(progidx);
+
+}
+
+static void programs_changed(const std::vector<size_t>& which) {
+
+  for(std::vector<size_t>::const_iterator it = which.begin(), itend = which.end(); it != itend; ++it)
+    program_changed(*it);
+
+}
+
+// Lost events might have been about anything.
+static void all_programs_changed() {
+
+  for(size_t i = 0, ilim = progs.size(); i != ilim; ++i)
+    program_changed(i);
+
+}
+
+static void read_inotify_events() {
+
+  char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  ssize_t len;
+  while((len = read(notify_fd, buf, sizeof(buf))) > 0) {
+
+    for(char* p = buf; p < buf + len;) {
+
+      struct inotify_event* ev = (struct inotify_event*)p;
+      p += sizeof(struct inotify_event) + ev->len;
+
+      if(ev->mask & IN_Q_OVERFLOW) {
+	all_programs_changed();
+	continue;
+      }
+
+      std::map<int, inotify_watch>::iterator findit = inotify_watches.find(ev->wd);
+      if(findit == inotify_watches.end())
+	continue;
+      inotify_watch& watch = findit->second;
+
+      // A directory's own dependents only care about its entries, not what's in the files.
+      if((!ev->len) || (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)))
+	programs_changed(watch.progs);
+
+      if(ev->len) {
+
+	std::map<std::string, std::vector<size_t> >::iterator childit = watch.children.find(ev->name);
+	if(childit != watch.children.end())
+	  programs_changed(childit->second);
+
+      }
+      else if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)) {
+
+	// The covered files' paths are gone with the directory.
+	for(std::map<std::string, std::vector<size_t> >::iterator it = watch.children.begin(), itend = watch.children.end(); it != itend; ++it)
+	  programs_changed(it->second);
+
+      }
+
+    }
+
+  }
+
+}
+
+#ifdef FAN_REPORT_FID
+
+static void read_fanotify_events() {
+
+  char buf[65536] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+
+  ssize_t len;
+  while((len = read(notify_fd, buf, sizeof(buf))) > 0) {
+
+    struct fanotify_event_metadata* md = (struct fanotify_event_metadata*)buf;
+    for(; FAN_EVENT_OK(md, len); md = FAN_EVENT_NEXT(md, len)) {
+
+      if(md->vers != FANOTIFY_METADATA_VERSION || (md->mask & FAN_Q_OVERFLOW)) {
+	all_programs_changed();
+	continue;
+      }
+
+      if(md->fd >= 0)
+	close(md->fd);
+
+      // Entry events name the directory, so a file's own dependents only see its changes.
+      struct fanotify_event_info_fid* fid = (struct fanotify_event_info_fid*)(md + 1);
+      if(md->event_len < sizeof(*md) + sizeof(*fid) || fid->hdr.info_type != FAN_EVENT_INFO_TYPE_FID)
+	continue;
+
+      struct file_handle* handle = (struct file_handle*)fid->handle;
+      std::map<std::string, std::vector<size_t> >::iterator findit = 
+	fanotify_files.find(file_key(&fid->fsid, sizeof(fid->fsid), handle));
+      if(findit != fanotify_files.end())
+	programs_changed(findit->second);
+
+    }
+
+  }
+
+}
+
+#else
+
+static void read_fanotify_events() {}
+
+#endif
+
+// Program lookups by binary path, including misses, so that a burst of clients
+// starting the same binary doesn't repeatedly scan progs.
+static std::map<std::string, struct spec_program*> progcache;
+
+static struct spec_program* lookupprog(const char* name) {
+
+  std::string names(name);
+
+  std::map<std::string, struct spec_program*>::iterator findit = progcache.find(names);
+  if(findit != progcache.end())
+    return findit->second;
+
+  struct spec_program* prog = findprog(name);
+  if(!prog)
+    cerr << "No such program " << names << "\n";
+
+  progcache[names] = prog;
+  return prog;
+
+}
+
+// Give programs added since the validity page was made their slots, as far as it has room.
+static void publish_new_slots() {
+
+  for(size_t i = 0, ilim = progs.size(); i != ilim; ++i)
+    if(!progs[i].removed)
+      assign_slot(progs[i]);
+
+}
+
+static bool all_failed(const std::vector<size_t>& which) {
+
+  for(std::vector<size_t>::const_iterator it = which.begin(), itend = which.end(); it != itend; ++it)
+    if(progs[*it].watch_fd != -1)
+      return false;
+
+  return true;
+
+}
+
+// Stop watching files that only failed or removed programs depend on, so that repeated
+// reloads don't accumulate watches.
+static void prune_watches() {
+
+  for(std::map<int, inotify_watch>::iterator it = inotify_watches.begin(); it != inotify_watches.end();) {
+
+    bool dead = all_failed(it->second.progs);
+    for(std::map<std::string, std::vector<size_t> >::iterator cit = it->second.children.begin(), 
+	  citend = it->second.children.end(); dead && cit != citend; ++cit)
+      dead = all_failed(cit->second);
+
+    if(dead) {
+      inotify_rm_watch(notify_fd, it->first);
+      inotify_watches.erase(it++);
+    }
+    else
+      ++it;
+
+  }
+
+  for(std::map<std::string, int>::iterator it = dir_watches.begin(); it != dir_watches.end();) {
+    if(!inotify_watches.count(it->second))
+      dir_watches.erase(it++);
+    else
+      ++it;
+  }
+
+  for(std::map<std::string, std::vector<size_t> >::iterator it = fanotify_files.begin(); it != fanotify_files.end();) {
+    if(all_failed(it->second))
+      fanotify_files.erase(it++);
+    else
+      ++it;
+  }
+
+}
+
+static const char* config_name;
+
+// Bring the daemon in line with the config as it is now. A program listed with the same
+// files as before, still good, keeps its slot, eventfd and clients. Any other is retired,
+// freeing its slot, and if it is still listed is verified afresh and given a slot with a
+// new token (see assign_slot).
+static bool reload_config() {
+
+  std::vector<spec_program> listed;
+  if(!read_config(config_name, listed)) {
+
+    cerr << "Reload failed; keeping the current config\n";
+    return false;
+
+  }
+
+  std::map<std::string, size_t> live;
+  for(size_t i = 0, ilim = progs.size(); i != ilim; ++i)
+    if(!progs[i].removed)
+      live.insert(std::make_pair(progs[i].binary_name, i));
+
+  std::set<size_t> kept;
+  std::vector<spec_program> added;
+  for(std::vector<spec_program>::iterator it = listed.begin(), itend = listed.end(); it != itend; ++it) {
+
+    std::map<std::string, size_t>::iterator findit = live.find(it->binary_name);
+    if(findit != live.end() && !kept.count(findit->second) && 
+       progs[findit->second].watch_fd != -1 && progs[findit->second].files == it->files) {
+      kept.insert(findit->second);
+      continue;
+    }
+
+    added.push_back(*it);
+
+  }
+
+  size_t retired = 0;
+  for(std::map<std::string, size_t>::iterator it = live.begin(), itend = live.end(); it != itend; ++it) {
+
+    if(kept.count(it->second))
+      continue;
+
+    invalidate_program(it->second);
+    progs[it->second].removed = true;
+    ++retired;
+
+  }
+
+  // progs may move, and cached misses may now be listed.
+  progcache.clear();
+
+  add_programs(config_name, added);
+  publish_new_slots();
+  prune_watches();
+
+  cout << "Reloaded " << config_name << ": " << kept.size() << " kept, " << added.size() << " added, " << retired << " retired\n";
+  return true;
+
+}
+
+// Protocol: on connecting a client is immediately sent the status of its own
+// executable (see send_status): a zero byte for "don't use specialised code", or
+// a one byte followed by its validity page slot and token, carrying the
+// program's eventfd. It may then keep the connection open and write
+// further binary paths, one per line, each answered the same way in order; this
+// lets a launcher validate several programs over one connection. Clients that only
+// want their own status simply hang up after the first reply. The line "!reload"
+// instead reloads the config, as SIGHUP does, and is answered with a single byte,
+// one if the new config was read.
+
+#define MAX_QUERY_LINE 4096
+
+struct client_conn {
+
+  std::string inbuf;
+
+};
+
+static std::map<int, client_conn> clients;
+
+static void drop_client(int epollfd, int connfd) {
+
+  epoll_ctl(epollfd, EPOLL_CTL_DEL, connfd, 0);
+  close(connfd);
+  clients.erase(connfd);
+
+}
+
+static void accept_client(int epollfd, int connfd) {
+
+  struct ucred otherendcreds;
+  socklen_t otherendcredslen = sizeof(struct ucred);
+  if(getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &otherendcreds, &otherendcredslen) == -1) {
+
+    fprintf(stderr, "getsockopt failed\n");
+    close(connfd);
+    return;
+
+  }
+
+  char pathbuf[128];
+  sprintf(pathbuf, "/proc/%d/exe", otherendcreds.pid);
+
+  char exebuf[4096];
+  ssize_t rlret = readlink(pathbuf, exebuf, 4096);
+  if(rlret < 0 || rlret == 4096) {
+
+    cerr << "Path name too long for " << pathbuf << "\n";
+    close(connfd);
+    return;
+
+  }
+
+  exebuf[rlret] = '\0';
+
+  send_status(connfd, lookupprog(exebuf));
+
+  // Keep the connection for further queries.
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  ev.data.fd = connfd;
+  if(epoll_ctl(epollfd, EPOLL_CTL_ADD, connfd, &ev) == -1) {
+
+    close(connfd);
+    return;
+
+  }
+
+  clients[connfd] = client_conn();
+
+}
+
+static void read_client(int epollfd, int connfd) {
+
+  std::map<int, client_conn>::iterator findit = clients.find(connfd);
+  if(findit == clients.end())
+    return;
+
+  std::string& inbuf = findit->second.inbuf;
+
+  while(1) {
+
+    char readbuf[4096];
+    ssize_t thisread = read(connfd, readbuf, sizeof(readbuf));
+
+    if(thisread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+
+    if(thisread <= 0) {
+
+      // Hung up or failed.
+      drop_client(epollfd, connfd);
+      return;
+
+    }
+
+    inbuf.append(readbuf, thisread);
+
+  }
+
+  size_t linestart = 0, lineend;
+  while((lineend = inbuf.find('\n', linestart)) != std::string::npos) {
+
+    std::string query(inbuf, linestart, lineend - linestart);
+    if(query == "!reload") {
+
+      char ok = reload_config() ? '\x01' : '\0';
+      if(send(connfd, &ok, 1, MSG_NOSIGNAL) == -1)
+	cerr << "Write failed\n";
+
+    }
+    else {
+
+      send_status(connfd, lookupprog(query.c_str()));
+
+    }
+    linestart = lineend + 1;
+
+  }
+
+  inbuf.erase(0, linestart);
+
+  if(inbuf.size() > MAX_QUERY_LINE) {
+
+    cerr << "Query too long, dropping client\n";
+    drop_client(epollfd, connfd);
+
+  }
+
+}
+
+int main(int argc, char** argv) {
+
+  // -F: watch with fanotify instead of inotify. -c N: cover N or more files in one
+  // directory with a watch of the directory (inotify only; 0 never does).
+  int opt;
+  while((opt = getopt(argc, argv, "Fc:")) != -1) {
+
+    if(opt == 'F')
+      use_fanotify = true;
+    else if(opt == 'c')
+      coalesce_min = strtoul(optarg, 0, 10);
+    else {
+      fprintf(stderr, "Usage: lliowd [-F] [-c files_per_dir] config_file\n");
+      exit(1);
+    }
+
+  }
+
+  if(optind >= argc) {
+    fprintf(stderr, "Usage: lliowd [-F] [-c files_per_dir] config_file\n");
+    exit(1);
+  }
+
+  // SIGHUP reloads the config, taken through a signalfd in the event loop. Blocked
+  // before any hashing threads start, so that they never take it.
+  sigset_t hupset;
+  sigemptyset(&hupset);
+  sigaddset(&hupset, SIGHUP);
+  sigprocmask(SIG_BLOCK, &hupset, 0);
+
+  config_name = argv[optind];
+
+  std::vector<spec_program> listed;
+  if(!read_config(config_name, listed))
+    exit(1);
+
+  init_notify();
+  read_hash_cache(config_name, hashcache);
+  add_programs(config_name, listed);
+
+  int listenfd = createlistensock();
+
+  int epollfd = epoll_create1(EPOLL_CLOEXEC);
+  if(epollfd == -1) {
+
+    fprintf(stderr, "epoll_create failed\n");
+    exit(1);
+
+  }
+
+  create_shm_page();
+  signal(SIGINT, retire_shm_page);
+  signal(SIGTERM, retire_shm_page);
+
+  // All file changes arrive on the one notification FD.
+  {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = notify_fd;
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, notify_fd, &ev) == -1) {
+
+      fprintf(stderr, "epoll_ctl failed\n");
+      exit(1);
+
+    }
+  }
+
+  int hupfd = signalfd(-1, &hupset, SFD_NONBLOCK | SFD_CLOEXEC);
+  if(hupfd == -1) {
+
+    fprintf(stderr, "signalfd failed\n");
+    exit(1);
+
+  }
+
+  {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = hupfd;
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, hupfd, &ev) == -1) {
+
+      fprintf(stderr, "epoll_ctl failed\n");
+      exit(1);
+
+    }
+  }
+
+  {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listenfd;
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &ev) == -1) {
+
+      fprintf(stderr, "epoll_ctl failed\n");
+      exit(1);
+
+    }
+  }
+
+  while(1) {
+
+    struct epoll_event events[64];
+    int nevents = epoll_wait(epollfd, events, 64, -1);
+
+    if(nevents == -1) {
+
+      if(errno != EINTR)
+	fprintf(stderr, "epoll_wait failed\n");
+      continue;
+
+    }
+
+    for(int i = 0; i < nevents; ++i) {
+
+      int fd = events[i].data.fd;
+
+      if(fd == listenfd) {
+
+	// Accept everyone that's waiting.
+	while(1) {
+
+	  int connfd = accept4(listenfd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	  if(connfd == -1) {
+
+	    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	      fprintf(stderr, "Accept failed\n");
+	    break;
+
+	  }
+
+	  accept_client(epollfd, connfd);
+
+	}
+
+      }
+      else if(fd == hupfd) {
+
+	// Any number of SIGHUPs since the last look want one reload.
+	struct signalfd_siginfo info;
+	while(read(hupfd, &info, sizeof(info)) == sizeof(info))
+	  ;
+	reload_config();
+
+      }
+      else if(fd == notify_fd) {
+
+	if(use_fanotify)
+	  read_fanotify_events();
+	else
+	  read_inotify_events();
+
+      }
+      else if(events[i].events & EPOLLIN) {
+
+	read_client(epollfd, fd);
+
+      }
+      else {
+
+	drop_client(epollfd, fd);
+
+      }
+
+    }
 
   }
 
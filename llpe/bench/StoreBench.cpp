@@ -0,0 +1,339 @@
+//===-- StoreBench.cpp ----------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// -llpe-store-bench times LLPE's store primitives on synthetic workloads, so that a change
+// to SharedTree.h, ImprovedValSetMulti or the store merge can be compared without a full
+// specialisation run. It is loaded after the LLPE module and needs a module only for its
+// LLVMContext and DataLayout:
+//
+//   opt -load LLVMLLPEMain.so -load LLVMLLPEBench.so -llpe-store-bench -disable-output any.bc
+//
+// Each workload is run at each of -llpe-bench-sizes, -llpe-bench-reps times, and reports the
+// mean time per repetition:
+//
+//   fork-write    fork a heap of SIZE objects and write one of them
+//   merge-N       merge N forks of a heap of SIZE objects, each having written one object
+//   imap-seq      write then read SIZE 8-byte fields of one object in order
+//   imap-rand     the same in a random order
+//   chain-read    read an object through SIZE layers of Underlying, each writing one field
+//   ivs-merge     merge two value sets of SIZE scalars, half of them shared
+//
+// Values are distinct integer constants, so merges of differing stores do real work; the
+// store merge memo is cleared between repetitions.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+#include <time.h>
+
+namespace llvm {
+
+class LLPEStoreBenchPass : public ModulePass {
+public:
+
+  static char ID;
+  LLPEStoreBenchPass() : ModulePass(ID) {}
+
+  bool runOnModule(Module& M);
+
+  void getAnalysisUsage(AnalysisUsage& AU) const {
+    AU.addRequired<AliasAnalysis>();
+    AU.setPreservesAll();
+  }
+
+};
+
+}
+
+using namespace llvm;
+
+static RegisterPass<LLPEStoreBenchPass> X("llpe-store-bench", "Time LLPE's store primitives",
+					  false /* Only looks at CFG */,
+					  true /* Analysis Pass */);
+
+char LLPEStoreBenchPass::ID = 0;
+
+static cl::list<unsigned> BenchSizes("llpe-bench-sizes", cl::CommaSeparated);
+static cl::opt<unsigned> BenchReps("llpe-bench-reps", cl::init(100));
+
+// Heap objects used by the workloads are this big.
+#define BENCH_OBJECT_SIZE 64
+
+static IntegerType* BenchInt;
+
+static double getWallTime() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+
+}
+
+static uint32_t benchRandom() {
+
+  // xorshift32: deterministic, so runs of different builds see the same workload.
+  static uint32_t state = 2463534242U;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+
+}
+
+static ImprovedValSetSingle getScalar(uint64_t V) {
+
+  return ImprovedValSetSingle(ImprovedVal(ShadowValue(ConstantInt::get(BenchInt, V))), ValSetTypeScalar);
+
+}
+
+static void reportBench(const char* Name, unsigned Size, double Elapsed) {
+
+  outs() << format("%-12s", Name) << " size " << format("%6u", Size) << "  "
+	 << format("%12.0f", (Elapsed / BenchReps) * 1e9) << " ns/rep\n";
+
+}
+
+// Give the heap at least n objects of BENCH_OBJECT_SIZE bytes.
+static void ensureHeap(uint32_t n) {
+
+  std::vector<AllocData>& Heap = GlobalIHP->heap;
+  uint32_t oldSize = Heap.size();
+  if(oldSize >= n)
+    return;
+
+  Heap.resize(n);
+  for(uint32_t i = oldSize; i != n; ++i) {
+    Heap[i].storeSize = BENCH_OBJECT_SIZE;
+    Heap[i].allocIdx = i;
+    Heap[i].allocValue = ShadowValue::getPtrIdx(-1, i);
+  }
+
+}
+
+// Write V to Offset in heap object i of Map, in the manner of ShadowBB::getWritableStoreFor:
+// a shared store gets a fresh overlay with the old one as its Underlying.
+static void writeHeap(OrdinaryLocalStore*& Map, uint32_t i, uint64_t Offset, const ImprovedValSetSingle& V) {
+
+  Map = Map->getWritableFrameList();
+
+  ShadowValue SV = ShadowValue::getPtrIdx(-1, i);
+  bool isNewStore;
+  LocStore* LS = Map->heap.getOrCreateStoreFor(SV, &isNewStore);
+
+  if(isNewStore)
+    LS->store = new ImprovedValSetMulti(BENCH_OBJECT_SIZE);
+  else if(!LS->store->isWritableMulti()) {
+    ImprovedValSetMulti* M = new ImprovedValSetMulti(BENCH_OBJECT_SIZE);
+    M->Underlying = LS->store;
+    LS->store = M;
+  }
+
+  replaceRangeWithPB(LS->store, V, Offset, 8);
+
+}
+
+static OrdinaryLocalStore* makeHeap(uint32_t nObjects) {
+
+  ensureHeap(nObjects);
+
+  OrdinaryLocalStore* Map = new OrdinaryLocalStore(0);
+  for(uint32_t i = 0; i != nObjects; ++i) {
+    for(uint64_t off = 0; off != BENCH_OBJECT_SIZE; off += 8)
+      writeHeap(Map, i, off, getScalar(i * BENCH_OBJECT_SIZE + off));
+  }
+
+  return Map;
+
+}
+
+static OrdinaryLocalStore* forkHeap(OrdinaryLocalStore* Base) {
+
+  Base->refCount++;
+  return Base;
+
+}
+
+static void benchForkWrite(unsigned Size) {
+
+  OrdinaryLocalStore* Base = makeHeap(Size);
+
+  double start = getWallTime();
+  for(unsigned rep = 0; rep != BenchReps; ++rep) {
+
+    OrdinaryLocalStore* Fork = forkHeap(Base);
+    writeHeap(Fork, benchRandom() % Size, 0, getScalar(rep));
+    Fork->dropReference();
+
+  }
+  reportBench("fork-write", Size, getWallTime() - start);
+
+  Base->dropReference();
+
+}
+
+static void benchMerge(unsigned Size, unsigned nPreds) {
+
+  OrdinaryLocalStore* Base = makeHeap(Size);
+  std::string Name;
+  {
+    raw_string_ostream RSO(Name);
+    RSO << "merge-" << nPreds;
+  }
+
+  double elapsed = 0;
+  for(unsigned rep = 0; rep != BenchReps; ++rep) {
+
+    SmallVector<OrdinaryLocalStore*, 4> Preds;
+    for(unsigned i = 0; i != nPreds; ++i) {
+      OrdinaryLocalStore* Fork = forkHeap(Base);
+      writeHeap(Fork, benchRandom() % Size, 8 * (i % (BENCH_OBJECT_SIZE / 8)), getScalar((uint64_t)rep * nPreds + i));
+      Preds.push_back(Fork);
+    }
+
+    double start = getWallTime();
+
+    OrdinaryMerger V(0);
+    Preds[0] = Preds[0]->getWritableFrameList();
+    V.mergeHeaps(Preds[0], Preds.begin() + 1, Preds.end());
+
+    elapsed += getWallTime() - start;
+
+    for(SmallVector<OrdinaryLocalStore*, 4>::iterator it = Preds.begin(), itend = Preds.end(); it != itend; ++it)
+      (*it)->dropReference();
+    clearStoreMergeMemo();
+
+  }
+  reportBench(Name.c_str(), Size, elapsed);
+
+  Base->dropReference();
+
+}
+
+static void benchIntervalMap(unsigned Size, bool random, const char* Name) {
+
+  uint64_t objSize = (uint64_t)Size * 8;
+
+  std::vector<uint64_t> Order(Size);
+  for(unsigned i = 0; i != Size; ++i)
+    Order[i] = i;
+  if(random) {
+    for(unsigned i = Size; i > 1; --i)
+      std::swap(Order[i - 1], Order[benchRandom() % i]);
+  }
+
+  double start = getWallTime();
+  for(unsigned rep = 0; rep != BenchReps; ++rep) {
+
+    ImprovedValSetMulti* M = new ImprovedValSetMulti(objSize);
+    for(std::vector<uint64_t>::iterator it = Order.begin(), itend = Order.end(); it != itend; ++it)
+      replaceRangeWithPB(M, getScalar(*it), *it * 8, 8);
+
+    for(std::vector<uint64_t>::iterator it = Order.begin(), itend = Order.end(); it != itend; ++it) {
+      SmallVector<IVSRange, 4> Results;
+      readValRangeMultiFrom(*it * 8, 8, M, Results, 0, objSize);
+    }
+
+    M->dropReference();
+
+  }
+  reportBench(Name, Size, getWallTime() - start);
+
+}
+
+static void benchChainRead(unsigned Size) {
+
+  ImprovedValSetMulti* Top = new ImprovedValSetMulti(BENCH_OBJECT_SIZE);
+  for(uint64_t off = 0; off != BENCH_OBJECT_SIZE; off += 8)
+    replaceRangeWithPB(Top, getScalar(off), off, 8);
+
+  // Each layer is what a write to a shared store leaves behind.
+  for(unsigned i = 0; i != Size; ++i) {
+    ImprovedValSetMulti* Layer = new ImprovedValSetMulti(BENCH_OBJECT_SIZE);
+    Layer->Underlying = Top;
+    replaceRangeWithPB(Layer, getScalar(BENCH_OBJECT_SIZE + i), 8 * (i % (BENCH_OBJECT_SIZE / 8)), 8);
+    Top = Layer;
+  }
+
+  double start = getWallTime();
+  for(unsigned rep = 0; rep != BenchReps; ++rep) {
+    SmallVector<IVSRange, 4> Results;
+    readValRangeMultiFrom(0, BENCH_OBJECT_SIZE, Top, Results, 0, BENCH_OBJECT_SIZE);
+  }
+  reportBench("chain-read", Size, getWallTime() - start);
+
+  Top->dropReference();
+
+}
+
+static void benchIVSMerge(unsigned Size) {
+
+  ImprovedValSetSingle A(ValSetTypeScalar), B(ValSetTypeScalar);
+  for(unsigned i = 0; i != Size; ++i) {
+    A.insert(ImprovedVal(ShadowValue(ConstantInt::get(BenchInt, i))));
+    B.insert(ImprovedVal(ShadowValue(ConstantInt::get(BenchInt, i + Size / 2))));
+  }
+
+  double start = getWallTime();
+  for(unsigned rep = 0; rep != BenchReps; ++rep) {
+    ImprovedValSetSingle Merged(A);
+    Merged.merge(B);
+  }
+  reportBench("ivs-merge", Size, getWallTime() - start);
+
+}
+
+bool LLPEStoreBenchPass::runOnModule(Module& M) {
+
+  // The primitives find the allocator, heap and types through the analysis pass' globals.
+  LLPEAnalysisPass* Pass = new LLPEAnalysisPass();
+  GlobalIHP = Pass;
+  GlobalTD = &getAnalysisIfAvailable<DataLayoutPass>()->getDataLayout();
+  GlobalAA = &getAnalysis<AliasAnalysis>();
+
+  GInt8Ptr = Type::getInt8PtrTy(M.getContext());
+  GInt8 = Type::getInt8Ty(M.getContext());
+  GInt16 = Type::getInt16Ty(M.getContext());
+  GInt32 = Type::getInt32Ty(M.getContext());
+  GInt64 = Type::getInt64Ty(M.getContext());
+  BenchInt = Type::getInt64Ty(M.getContext());
+
+  std::vector<unsigned> Sizes(BenchSizes.begin(), BenchSizes.end());
+  if(Sizes.empty()) {
+    Sizes.push_back(16);
+    Sizes.push_back(256);
+    Sizes.push_back(4096);
+  }
+
+  for(std::vector<unsigned>::iterator it = Sizes.begin(), itend = Sizes.end(); it != itend; ++it) {
+
+    unsigned Size = std::max(*it, 1u);
+
+    benchForkWrite(Size);
+    benchMerge(Size, 2);
+    benchMerge(Size, 8);
+    benchIntervalMap(Size, false, "imap-seq");
+    benchIntervalMap(Size, true, "imap-rand");
+    benchChainRead(Size);
+    benchIVSMerge(Size);
+
+  }
+
+  return false;
+
+}
@@ -17,9 +17,16 @@
 #include <wx/sizer.h>
 #include <wx/dataview.h>
 #include <wx/bitmap.h>
+#include <wx/process.h>
+
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <map>
 
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
 using namespace llvm;
 
@@ -61,6 +68,31 @@ class IntegratorApp : public wxApp {
 
 static char workdir[] = "/tmp/integrator_XXXXXX";
 
+// Rendering a big context with dot can take tens of seconds, so it runs as an
+// asynchronous child process and the GUI stays responsive meanwhile. Rendered images
+// are kept per (context, brief) in an LRU cache of RenderCacheSize entries, which is
+// flushed whenever enabling or disabling a context changes what they would show, and
+// the neighbours of the selected context are queued for rendering behind it.
+
+static cl::opt<unsigned> RenderCacheSize("integrator-render-cache", cl::init(64));
+static cl::opt<unsigned> RenderPrefetch("integrator-render-prefetch", cl::init(8));
+
+typedef std::pair<IntegrationAttempt*, bool> RenderKey;
+
+class IntegratorFrame;
+
+class DotProcess : public wxProcess {
+
+public:
+
+  IntegratorFrame* Frame;
+
+  DotProcess(IntegratorFrame* _Frame) : wxProcess(), Frame(_Frame) {}
+
+  void OnTerminate(int pid, int status);
+
+};
+
 class IntegratorFrame: public wxFrame
 {
   
@@ -73,13 +105,29 @@ class IntegratorFrame: public wxFrame
 
   IntegratorTag* searchLastIA;
   wxString searchLastString;
-
-  std::string dotpath;
-  std::string pngpath;
-  std::string dotcommand;
+  ContextSearchIndex* searchIndex;
+
+  // PNG paths of rendered images, and their keys, most recently used first.
+  std::map<RenderKey, std::string> renderedImages;
+  std::list<RenderKey> renderLRU;
+
+  // Images waiting to be rendered, and the one being rendered now, if any.
+  std::deque<RenderKey> renderQueue;
+  DotProcess* renderProcess;
+  RenderKey renderingKey;
+  std::string renderingPath;
+  unsigned renderGeneration;
+  unsigned renderingGeneration;
+  unsigned nextImageId;
   
   bool brief;
 
+  void touchImage(const RenderKey&);
+  void showImage(const std::string& path);
+  void requestRender(const RenderKey&, bool prefetch);
+  void startNextRender();
+  void prefetchNeighbours(IntegratorTag*);
+
 public:
 
   IntegratorFrame(const wxString& title, const wxPoint& pos, const wxSize& size);
@@ -92,6 +140,9 @@ public:
   void OnSearchFunctionsNext(wxCommandEvent&);
 
   void redrawImage();
+  void invalidateImages();
+  void invalidateSearch();
+  void renderFinished(int status);
 
   DECLARE_EVENT_TABLE()
 
@@ -314,6 +365,8 @@ public:
     // All other contexts will have recalculated their stats too.
     notifyStatsChanged(RootTag);
 
+    Parent->invalidateImages();
+    Parent->invalidateSearch();
     Parent->redrawImage();
 
     return true;
@@ -394,28 +447,17 @@ public:
 };
 
 IntegratorFrame::IntegratorFrame(const wxString& title, const wxPoint& pos, const wxSize& size)
-  : wxFrame(NULL, -1, title, pos, size), currentIA(0), brief(true) {
+  : wxFrame(NULL, -1, title, pos, size), currentIA(0), renderProcess(0), renderGeneration(0), 
+    renderingGeneration(0), nextImageId(0), brief(true) {
 
   if(!mkdtemp(workdir)) {
     errs() << "Failed to create a temporary directory: " << strerror(errno) << "\n";
     exit(1);
   }
 
-  {
-    raw_string_ostream ROS(dotpath);
-    ROS << workdir << "/out.dot";
-  }
-  {
-    raw_string_ostream ROS(pngpath);
-    ROS << workdir << "/out.png";
-  }
-  {
-    raw_string_ostream ROS(dotcommand);
-    ROS << "dot " << dotpath << " -o " << pngpath << " -Tpng";
-  }
-
   searchLastString = "";
   searchLastIA = 0;
+  searchIndex = 0;
 
   wxMenu *menuFile = new wxMenu;
   menuFile->Append( ID_Quit, _("E&xit") );
@@ -492,6 +534,10 @@ void IntegratorFrame::OnBriefToggle(wxCommandEvent& WXUNUSED(event)) {
 
 void IntegratorFrame::OnClose(wxCloseEvent& WXUNUSED(event)) {
 
+  // Any render still running finishes unobserved.
+  if(renderProcess)
+    renderProcess->Frame = 0;
+
   std::string command;
   raw_string_ostream ROS(command);
   ROS << "rm -rf " << workdir;
@@ -507,54 +553,234 @@ void IntegratorFrame::OnClose(wxCloseEvent& WXUNUSED(event)) {
 
 }
 
-void IntegratorFrame::redrawImage() {
+void DotProcess::OnTerminate(int pid, int status) {
 
-  if(!currentIA)
-    return;
+  if(Frame)
+    Frame->renderFinished(status);
+  delete this;
+
+}
+
+void IntegratorFrame::touchImage(const RenderKey& Key) {
+
+  std::list<RenderKey>::iterator it = std::find(renderLRU.begin(), renderLRU.end(), Key);
+  if(it != renderLRU.end())
+    renderLRU.erase(it);
+  renderLRU.push_front(Key);
+
+  while(renderLRU.size() > RenderCacheSize) {
+
+    std::map<RenderKey, std::string>::iterator findit = renderedImages.find(renderLRU.back());
+    if(findit != renderedImages.end()) {
+      unlink(findit->second.c_str());
+      renderedImages.erase(findit);
+    }
+    renderLRU.pop_back();
+
+  }
+
+}
+
+void IntegratorFrame::showImage(const std::string& path) {
 
   delete currentBitmap;
   currentBitmap = 0;
 
-  std::error_code error;
-  std::string otherpath;
-  raw_fd_ostream RFO(dotpath.c_str(), error, sys::fs::F_None);
-  currentIA->describeAsDOT(RFO, otherpath, brief);
-  RFO.close();
+  if(!path.empty())
+    currentBitmap = new wxBitmap(_(path), wxBITMAP_TYPE_PNG);
+
+  if((!currentBitmap) || !currentBitmap->IsOk()) {
+    delete currentBitmap;
+    currentBitmap = new wxBitmap(1, 1);
+  }
+
+  image->SetBitmap(*currentBitmap);
+  imagePanel->FitInside();
+
+}
 
-  if(error) {
+void IntegratorFrame::invalidateImages() {
 
-    errs() << "Failed to open " << dotpath << ": " << error.message() << "\n";
+  for(std::map<RenderKey, std::string>::iterator it = renderedImages.begin(), 
+	itend = renderedImages.end(); it != itend; ++it)
+    unlink(it->second.c_str());
+
+  renderedImages.clear();
+  renderLRU.clear();
+  renderQueue.clear();
+
+  // An image being rendered now is discarded when it arrives.
+  ++renderGeneration;
+
+}
 
+// Queue Key for rendering: next if it's what the user is waiting for, otherwise last.
+void IntegratorFrame::requestRender(const RenderKey& Key, bool prefetch) {
+
+  if(renderedImages.count(Key))
+    return;
+  if(renderProcess && renderingKey == Key && renderingGeneration == renderGeneration)
+    return;
+
+  std::deque<RenderKey>::iterator it = std::find(renderQueue.begin(), renderQueue.end(), Key);
+  if(it != renderQueue.end()) {
+    if(prefetch)
+      return;
+    renderQueue.erase(it);
   }
-  else {
 
-    std::string thiscmd;
-    if(otherpath.size()) {
-      raw_string_ostream RSO(thiscmd);
-      RSO << "dot " << otherpath << " -o " << pngpath << " -Tpng";
+  if(prefetch)
+    renderQueue.push_back(Key);
+  else
+    renderQueue.push_front(Key);
+
+  if(!renderProcess)
+    startNextRender();
+
+}
+
+void IntegratorFrame::startNextRender() {
+
+  while(!renderQueue.empty()) {
+
+    RenderKey Key = renderQueue.front();
+    renderQueue.pop_front();
+
+    std::string dotpath, pngpath, dotcommand;
+    {
+      raw_string_ostream ROS(dotpath);
+      ROS << workdir << "/ctx" << nextImageId << ".dot";
     }
-    else {
-      thiscmd = dotcommand;
+    {
+      raw_string_ostream ROS(pngpath);
+      ROS << workdir << "/ctx" << nextImageId << ".png";
+    }
+    {
+      raw_string_ostream ROS(dotcommand);
+      ROS << "dot " << dotpath << " -o " << pngpath << " -Tpng";
+    }
+    ++nextImageId;
+
+    // Describing the context reads analysis state, so it happens here; only dot runs
+    // in the background.
+    std::error_code error;
+    raw_fd_ostream RFO(dotpath.c_str(), error, sys::fs::F_None);
+    if(error) {
+      errs() << "Failed to open " << dotpath << ": " << error.message() << "\n";
+      continue;
     }
 
-    if(int ret = system(thiscmd.c_str()) != 0) {
+    Key.first->describeAsDOT(RFO, Key.second);
+    RFO.close();
 
-      errs() << "Failed to run '" << thiscmd << "' (returned " << ret << ")\n";
-	
-    }
-    else {
+    renderProcess = new DotProcess(this);
+    if(!wxExecute(_(dotcommand), wxEXEC_ASYNC, renderProcess)) {
 
-      currentBitmap = new wxBitmap(_(pngpath), wxBITMAP_TYPE_PNG);
+      errs() << "Failed to run '" << dotcommand << "'\n";
+      delete renderProcess;
+      renderProcess = 0;
+      unlink(dotpath.c_str());
+      continue;
 
     }
 
+    renderingKey = Key;
+    renderingPath = pngpath;
+    renderingGeneration = renderGeneration;
+    return;
+
   }
 
-  if(!currentBitmap)
-    currentBitmap = new wxBitmap(1, 1);
+}
 
-  image->SetBitmap(*currentBitmap);
-  imagePanel->FitInside();
+void IntegratorFrame::renderFinished(int status) {
+
+  renderProcess = 0;
+
+  std::string dotpath = renderingPath.substr(0, renderingPath.size() - 4) + ".dot";
+  unlink(dotpath.c_str());
+
+  if(renderingGeneration != renderGeneration) {
+
+    unlink(renderingPath.c_str());
+
+  }
+  else if(status != 0) {
+
+    errs() << "dot failed rendering " << renderingKey.first->getShortHeader() << " (returned " << status << ")\n";
+    unlink(renderingPath.c_str());
+
+  }
+  else {
+
+    renderedImages[renderingKey] = renderingPath;
+
+    if(renderingKey.first == currentIA && renderingKey.second == brief)
+      showImage(renderingPath);
+
+    touchImage(renderingKey);
+
+  }
+
+  startNextRender();
+
+}
+
+void IntegratorFrame::redrawImage() {
+
+  if(!currentIA)
+    return;
+
+  RenderKey Key(currentIA, brief);
+
+  std::map<RenderKey, std::string>::iterator findit = renderedImages.find(Key);
+  if(findit != renderedImages.end()) {
+
+    showImage(findit->second);
+    touchImage(Key);
+
+  }
+  else {
+
+    // Show nothing rather than the last context's image until this one is ready.
+    showImage("");
+    requestRender(Key, false);
+
+  }
+
+}
+
+// Render the contexts next to Tag in the tree, since the user is likely to look at one
+// of them next: its parent context and its child contexts, including the iterations of
+// loops directly within it.
+void IntegratorFrame::prefetchNeighbours(IntegratorTag* Tag) {
+
+  std::vector<IntegrationAttempt*> Neighbours;
+
+  IntegratorTag* Parent = Tag->parent;
+  if(Parent && Parent->type == IntegratorTypePA)
+    Parent = Parent->parent;
+  if(Parent)
+    Neighbours.push_back((IntegrationAttempt*)Parent->ptr);
+
+  for(std::vector<IntegratorTag*>::iterator it = Tag->children.begin(), 
+	itend = Tag->children.end(); it != itend && Neighbours.size() < RenderPrefetch; ++it) {
+
+    IntegratorTag* Child = *it;
+    if(Child->type == IntegratorTypeIA) {
+      Neighbours.push_back((IntegrationAttempt*)Child->ptr);
+      continue;
+    }
+
+    for(std::vector<IntegratorTag*>::iterator iterit = Child->children.begin(), 
+	  iterend = Child->children.end(); iterit != iterend && Neighbours.size() < RenderPrefetch; ++iterit) {
+      Neighbours.push_back((IntegrationAttempt*)(*iterit)->ptr);
+    }
+
+  }
+
+  for(unsigned i = 0, ilim = std::min((unsigned)Neighbours.size(), (unsigned)RenderPrefetch); i != ilim; ++i)
+    requestRender(RenderKey(Neighbours[i], brief), true);
 
 }
 
@@ -567,20 +793,30 @@ void IntegratorFrame::OnSelectionChanged(wxDataViewEvent& event) {
 
     currentIA = (IntegrationAttempt*)(tag->ptr);
     redrawImage();
+    prefetchNeighbours(tag);
 
   }
 
 }
 
+void IntegratorFrame::invalidateSearch() {
+
+  if(searchIndex)
+    searchIndex->invalidate();
+
+}
+
 void IntegratorFrame::OnSearchFunctionsNext(wxCommandEvent& event) {
 
   if(searchLastString == "")
     return;
-  if(searchLastIA == 0)
-    searchLastIA = IHP->getRootTag();
+
+  // Built on first use, since the tree doesn't change while browsing.
+  if(!searchIndex)
+    searchIndex = new ContextSearchIndex(IHP->getRootTag());
 
   std::string stdSearchString(searchLastString.mb_str());
-  IntegratorTag* IA = searchFunctions(IHP->getRootTag(), stdSearchString, searchLastIA);
+  IntegratorTag* IA = searchIndex->findNext(stdSearchString, searchLastIA);
 
   if(IA) {
     wxDataViewItem key((void*)IA);
@@ -596,7 +832,7 @@ void IntegratorFrame::OnSearchFunctionsNext(wxCommandEvent& event) {
 
 void IntegratorFrame::OnSearchFunctions(wxCommandEvent& event) {
 
-  searchLastString = wxGetTextFromUser("Enter function name", "Search");
+  searchLastString = wxGetTextFromUser("Enter a function name, and/or residual>N, instructions>N or checks", "Search");
   searchLastIA = 0;
   OnSearchFunctionsNext(event);
 
@@ -608,6 +844,10 @@ bool LLPEPass::runOnModule(Module& M) {
 
   IHP = &getAnalysis<LLPEAnalysisPass>();
 
+  // The module already holds a committed specialisation.
+  if(IHP->loadedFromCache)
+    return true;
+
   if(!AcceptAllInt) {
   
     int argc = 0;
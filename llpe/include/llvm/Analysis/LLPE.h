@@ -10,11 +10,14 @@
 #ifndef LLVM_HYPO_CONSTFOLD_H
 #define LLVM_HYPO_CONSTFOLD_H
 
+#include "llvm/ADT/BitVector.h"
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/ADT/IntervalMap.h"
 #include "llvm/IR/ValueMap.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/SmallSet.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Pass.h"
@@ -36,7 +39,10 @@
 #include "llvm/Support/RecyclingAllocator.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
 
+#include <atomic>
+#include <functional>
 #include <limits.h>
+#include <list>
 #include <string>
 #include <vector>
 
@@ -54,6 +60,7 @@ class Type;
 class Argument;
 class InvokeInst;
 class StoreInst;
+class MemoryBuffer;
 class MemTransferInst;
 class MemIntrinsic;
 class CmpInst;
@@ -104,6 +111,26 @@ extern AliasAnalysis* GlobalAA;
 extern TargetLibraryInfo* GlobalTLI;
 extern LLPEAnalysisPass* GlobalIHP;
 
+// GlobalTD's store size for Ty, remembered per type: the same few types are sized for
+// every load, store and allocation in every context. Types live as long as their context,
+// so the cache is emptied with resetTypeStoreSizes at the start of each run.
+uint64_t getTypeStoreSize(Type* Ty);
+void resetTypeStoreSizes();
+
+// Runs functions of the module being specialised natively, for -int-native-calls (see
+// NativeCalls.cpp). LLPE links no JIT, so a runner is installed by a module loaded after it.
+class NativeCallRunner {
+public:
+
+  virtual ~NativeCallRunner() { }
+  // Call F with one integer per formal, pointers as native addresses, and set Ret to its
+  // result zero-extended. Returns false if F couldn't be compiled.
+  virtual bool run(Function* F, const std::vector<uint64_t>& Args, uint64_t& Ret) = 0;
+
+};
+
+extern NativeCallRunner* GlobalNativeCallRunner;
+
 struct ShadowBBVisitor {
 
   bool doIgnoreEdges;
@@ -115,6 +142,82 @@ ShadowBBVisitor(bool ign = false) : doIgnoreEdges(ign) { }
 
 };
 
+// A statistic kept by the subsystem that counts it, reported with GlobalStats without
+// that struct having to know about it. Declare one at file scope where it is counted:
+//   static LLPEStat VFSResolved("vfs_resolved", "VFS calls resolved");
+// then ++VFSResolved, or VFSResolved.inc(&F) to also charge it to F in the per-function
+// breakdown.
+class LLPEStat {
+
+public:
+
+  const char* name;
+  const char* desc;
+  uint64_t value;
+  DenseMap<Function*, uint64_t> byFunction;
+
+  LLPEStat(const char* name, const char* desc);
+
+  LLPEStat& operator++() { ++value; return *this; }
+  LLPEStat& operator+=(uint64_t n) { value += n; return *this; }
+
+  void inc(Function* F, uint64_t n = 1) {
+
+    value += n;
+    byFunction[F] += n;
+
+  }
+
+};
+
+std::vector<LLPEStat*>& getRegisteredStats();
+
+// A distribution kept the same way, for sizes and depths where the count alone hides
+// the shape. Sites are hot, so samples are only taken under -int-store-histograms.
+// Values go in power-of-two buckets: bucket 0 counts zeroes, and bucket i > 0 counts
+// values in [2^(i-1), 2^i).
+class LLPEHistogram {
+
+  void record(uint64_t v);
+
+public:
+
+  static bool enabled;
+
+  const char* name;
+  const char* desc;
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[65];
+
+  LLPEHistogram(const char* name, const char* desc);
+
+  void add(uint64_t v) {
+
+    if(enabled)
+      record(v);
+
+  }
+
+};
+
+std::vector<LLPEHistogram*>& getRegisteredHistograms();
+
+// Copy-on-write breaks in the store maps, counted where they occur in SharedTree.h and
+// ShadowInlines.h:
+extern LLPEStat CoWFrameLists;
+extern LLPEStat CoWFrames;
+extern LLPEStat CoWPages;
+extern LLPEStat CoWTreeNodes;
+extern LLPEStat CoWFDStores;
+extern LLPEStat CoWFDPages;
+// ...and the sizes of those copies, plus how many distinct stores meet at each merge.
+extern LLPEHistogram CoWFramePages;
+extern LLPEHistogram CoWPageSlots;
+extern LLPEHistogram CoWNodeChildren;
+extern LLPEHistogram MergeFanIn;
+
 // Include structures and functions for working with instruction and argument shadows.
 #include "ShadowInlines.h"
 
@@ -136,6 +239,34 @@ struct IntegratorTag {
 
 };
 
+// Finds contexts in the IntegratorTag tree for the GUI's search (see searchContexts in
+// Misc.cpp). The contexts are numbered in tree order once, and indexed by the name of
+// the function they specialise, so each search looks only at the function names and
+// each "next" match is a binary search in the last query's results.
+class ContextSearchIndex {
+
+  std::vector<IntegratorTag*> Order;
+  DenseMap<IntegratorTag*, uint32_t> Positions;
+  StringMap<std::vector<uint32_t> > ByFunction;
+
+  std::string LastQuery;
+  std::vector<uint32_t> LastMatches;
+
+  void addTag(IntegratorTag*);
+  void runQuery(const std::string&);
+
+public:
+
+  ContextSearchIndex(IntegratorTag* Root);
+
+  // Return the first context after After (or the first of all if null) matching Query.
+  IntegratorTag* findNext(const std::string& Query, IntegratorTag* After);
+
+  // Contexts' statistics have changed, so predicate queries must be rerun.
+  void invalidate() { LastQuery.clear(); }
+
+};
+
 enum PathConditionTypes {
   
   PathConditionTypeInt,
@@ -202,6 +333,18 @@ struct SpecialLocationDescriptor {
 
 };
 
+// The path conditions that apply from one block, in the order given.
+struct BlockPathConditions {
+
+  SmallVector<PathCondition*, 1> Int;
+  SmallVector<PathCondition*, 1> AsDef;
+  SmallVector<PathCondition*, 1> String;
+  SmallVector<PathCondition*, 1> Intmem;
+  SmallVector<PathCondition*, 1> Stream;
+  SmallVector<PathFunc*, 1> Func;
+
+};
+
 struct PathConditions {
 
   std::vector<PathCondition> IntPathConditions;
@@ -211,6 +354,22 @@ struct PathConditions {
   std::vector<PathCondition> StreamPathConditions;
   std::vector<PathFunc> FuncPathConditions;
 
+  // The conditions by the (stack index, block) they apply from, and Int and AsDef
+  // conditions also by the (stack index, block) of the instruction they describe, so a
+  // block finds its own without scanning the lot. Rebuilt on the first lookup after
+  // conditions are added, which also keeps the pointers into the vectors above valid.
+  typedef std::pair<uint32_t, BasicBlock*> BlockKey;
+  DenseMap<BlockKey, BlockPathConditions> byFromBlock;
+  DenseMap<BlockKey, SmallVector<PathCondition*, 1> > intByInstBlock;
+  DenseMap<BlockKey, SmallVector<PathCondition*, 1> > asDefByInstBlock;
+  size_t indexedConditions;
+
+  PathConditions() : indexedConditions(0) {}
+
+  void buildIndex();
+  BlockPathConditions* getFromBlock(uint32_t stackIdx, BasicBlock* BB);
+  SmallVector<PathCondition*, 1>* getForInstBlock(bool asDef, uint32_t stackIdx, BasicBlock* BB);
+
   void addForType(PathCondition newCond, PathConditionTypes Ty) {
 
     switch(Ty) {
@@ -247,10 +406,18 @@ struct AllocatorFn {
     uint32_t sizeArg;
     ConstantInt* allocSize;
   };
+  // If not UINT_MAX, the size is sizeArg's value times this argument's (as for calloc).
+  uint32_t countArg;
+  // Memory is returned zeroed.
+  bool zeroed;
+  // If not UINT_MAX, objects are carved from the arena this argument points to.
+  uint32_t arenaArg;
+  // Never returns null, aborting instead (see -int-allocator-never-fails).
+  bool neverFails;
   
-AllocatorFn() : isConstantSize(false), allocSize(0) {}
-AllocatorFn(uint32_t S) : isConstantSize(false), sizeArg(S) {}
-AllocatorFn(ConstantInt* C) : isConstantSize(true), allocSize(C) {}
+AllocatorFn() : isConstantSize(false), allocSize(0), countArg(UINT_MAX), zeroed(false), arenaArg(UINT_MAX), neverFails(false) {}
+AllocatorFn(uint32_t S) : isConstantSize(false), sizeArg(S), countArg(UINT_MAX), zeroed(false), arenaArg(UINT_MAX), neverFails(false) {}
+AllocatorFn(ConstantInt* C) : isConstantSize(true), allocSize(C), countArg(UINT_MAX), zeroed(false), arenaArg(UINT_MAX), neverFails(false) {}
 
   static AllocatorFn getConstantSize(ConstantInt* size) {
     return AllocatorFn(size);
@@ -258,15 +425,28 @@ AllocatorFn(ConstantInt* C) : isConstantSize(true), allocSize(C) {}
   static AllocatorFn getVariableSize(uint32_t arg) {
     return AllocatorFn(arg);
   }
+  static AllocatorFn getZeroedArray(uint32_t countArg, uint32_t sizeArg) {
+    AllocatorFn ret(sizeArg);
+    ret.countArg = countArg;
+    ret.zeroed = true;
+    return ret;
+  }
+  static AllocatorFn getArenaCarve(uint32_t arenaArg, uint32_t sizeArg) {
+    AllocatorFn ret(sizeArg);
+    ret.arenaArg = arenaArg;
+    return ret;
+  }
 
 };
 
 struct DeallocatorFn {
 
   uint32_t arg;
+  // arg points to an arena, and every object carved from it is released.
+  bool releasesArena;
 
-DeallocatorFn() : arg(UINT_MAX) {}
-DeallocatorFn(uint32_t a) : arg(a) {}
+DeallocatorFn() : arg(UINT_MAX), releasesArena(false) {}
+DeallocatorFn(uint32_t a, bool ra = false) : arg(a), releasesArena(ra) {}
 
 };
 
@@ -280,11 +460,24 @@ ReallocatorFn(uint32_t pa, uint32_t sa) : ptrArg(pa), sizeArg(sa) {}
 
 };
 
+// String functions evaluated directly against the store (see StringOps.cpp).
+enum StringModelKind {
+
+  SM_STRLEN,
+  SM_STRCMP,
+  SM_STRCHR,
+  SM_MEMCHR
+
+};
+
 struct IHPLocationInfo {
   
   void (*getLocation)(ShadowValue CS, ShadowValue& Loc, uint64_t& LocSize);
   uint64_t argIndex;
   uint64_t argSize;
+  // If sizeArgScale is nonzero, the size is that many times argument sizeArgIndex's value.
+  uint64_t sizeArgIndex;
+  uint64_t sizeArgScale;
 
 };
 
@@ -303,6 +496,19 @@ struct IHPFunctionInfo {
 
 };
 
+// What a defined function may write, transitively, in terms of its arguments, when that
+// can be stated without knowing its arguments' values (see CallSummaries.cpp).
+struct CallModSummary {
+
+  bool writesUnknown;
+  // Indexed by formal argument: may write to the object the argument points to.
+  std::vector<bool> writesArg;
+  SmallPtrSet<GlobalVariable*, 4> writesGlobals;
+
+CallModSummary() : writesUnknown(false) { }
+
+};
+
 struct OpenStatus {
 
   std::string Name;
@@ -319,11 +525,16 @@ struct ReadFile {
   uint64_t incomingOffset;
   uint32_t readSize;
   bool needsSeek;
+  // If not -1, the seek was left to the next residual use of this FD (see flushSeek).
+  uint32_t seekDeferredFD;
   bool isFifo;
+  // Reads stdin, of which only a prefix is known (-int-spec-stdin-prefix): the real read
+  // must still consume what it delivers, and asks for no more than readSize.
+  bool prefixRead;
 
-ReadFile(std::string n, uint64_t IO, uint32_t RS, bool _isFifo) : name(n), incomingOffset(IO), readSize(RS), needsSeek(true), isFifo(_isFifo) { }
+ReadFile(std::string n, uint64_t IO, uint32_t RS, bool _isFifo) : name(n), incomingOffset(IO), readSize(RS), needsSeek(true), seekDeferredFD((uint32_t)-1), isFifo(_isFifo), prefixRead(false) { }
 
-ReadFile() : name(), incomingOffset(0), readSize(0), needsSeek(true) { }
+ReadFile() : name(), incomingOffset(0), readSize(0), needsSeek(true), seekDeferredFD((uint32_t)-1), prefixRead(false) { }
 
 };
 
@@ -332,74 +543,210 @@ struct SeekFile {
   std::string name;
   uint64_t newOffset;
   bool MayDelete;
+  uint32_t seekDeferredFD;
+
+SeekFile(std::string n, uint64_t Off) : name(n), newOffset(Off), MayDelete(false), seekDeferredFD((uint32_t)-1) { }
+SeekFile() : name(), newOffset(0), MayDelete(false), seekDeferredFD((uint32_t)-1) { }
+
+};
+
+// A seek to bring an FD's real position up to its symbolic one, emitted before an
+// instruction that may use the FD's position for real.
+struct SeekFixup {
+
+  uint32_t FD;
+  const std::string* filename;
+  uint64_t pos;
+
+SeekFixup(uint32_t _FD, const std::string* fn, uint64_t _pos) : FD(_FD), filename(fn), pos(_pos) { }
+
+};
+
+struct CachedFile {
 
-SeekFile(std::string n, uint64_t Off) : name(n), newOffset(Off), MayDelete(false) { }
-SeekFile() : name(), newOffset(0), MayDelete(false) { }
+  MemoryBuffer* contents;
+  // For a directory, contents are its getdents64 records as the kernel returns them.
+  bool isDirectory;
+  bool hashed;
+  unsigned char sha1[20];
+
+CachedFile() : contents(0), isDirectory(false), hashed(false) { }
+
+};
+
+// A contiguous region of an input file that one or more residual reads copy from.
+struct FileBytesRegion {
+
+  uint64_t start;
+  uint64_t end;
+  GlobalVariable* G;
+
+FileBytesRegion(uint64_t s, uint64_t e) : start(s), end(e), G(0) { }
+
+};
+
+// The per-context counts gathered by preCommitStats, kept both in total and per function.
+struct ContextStats {
+
+  uint64_t contexts;
+  uint64_t disabledContexts;
+  uint64_t blocks;
+  uint64_t insts;
+  uint64_t resolvedBranches;
+  uint64_t constantInstructions;
+  uint64_t pointerInstructions;
+  uint64_t setInstructions;
+  uint64_t unknownInstructions;
+  uint64_t deadInstructions;
+  uint64_t mallocChecks;
+  uint64_t fileChecks;
+  uint64_t threadChecks;
+  uint64_t condChecks;
+
+ContextStats() : contexts(0), disabledContexts(0), blocks(0), insts(0), resolvedBranches(0),
+    constantInstructions(0), pointerInstructions(0), setInstructions(0), unknownInstructions(0),
+    deadInstructions(0), mallocChecks(0), fileChecks(0), threadChecks(0), condChecks(0) {}
 
 };
 
 struct GlobalStats {
   
-  uint32_t dynamicFunctions;
-  uint32_t dynamicContexts;
-  uint32_t dynamicBlocks;
-  uint32_t dynamicInsts;
-
-  uint32_t disabledContexts;
-
-  uint32_t resolvedBranches;
-  uint32_t constantInstructions;
-  uint32_t pointerInstructions;
-  uint32_t setInstructions;
-  uint32_t unknownInstructions;
-  uint32_t deadInstructions;
-
-  uint32_t residualBlocks;
-  uint32_t residualInstructions;
-  uint32_t mallocChecks;
-  uint32_t fileChecks;
-  uint32_t threadChecks;
-  uint32_t condChecks;
+  uint64_t dynamicFunctions;
+  uint64_t dynamicContexts;
+  uint64_t dynamicBlocks;
+  uint64_t dynamicInsts;
+
+  uint64_t disabledContexts;
+
+  uint64_t resolvedBranches;
+  uint64_t constantInstructions;
+  uint64_t pointerInstructions;
+  uint64_t setInstructions;
+  uint64_t unknownInstructions;
+  uint64_t deadInstructions;
+
+  uint64_t residualBlocks;
+  uint64_t residualInstructions;
+  uint64_t mallocChecks;
+  uint64_t fileChecks;
+  uint64_t threadChecks;
+  uint64_t condChecks;
+
+  // Value sets overdefined for exceeding -int-max-set-size, and pointer sets widened
+  // to an unknown offset within an object instead:
+  uint64_t setOverflows;
+  uint64_t setWidenings;
+  DenseMap<Function*, uint64_t> setOverflowsByFunction;
+
+  // Multi store merges answered from the merge memo, and those computed afresh:
+  uint64_t storeMergeMemoHits;
+  uint64_t storeMergeMemoMisses;
+
+  // Loops left to the general loop analysis after -int-summarise-loops-after iterations:
+  uint64_t summarisedLoops;
+
+  // Loops left to the general loop analysis because an iteration would have started in the
+  // same state as an earlier one (-int-peel-cycle-detection):
+  uint64_t cycledLoops;
+
+  // Loops whose partial peels were discarded for exceeding -int-peel-budget:
+  uint64_t overBudgetLoops;
+
+  // Terminated loops whose disabled peels were freed at once (-int-discard-disabled-loops):
+  uint64_t discardedLoops;
+
+  // Rounds of general loop analysis, and loops widened by -int-loop-widen-after:
+  uint64_t loopAnalysisRounds;
+  uint64_t widenedLoops;
+
+  // Loop-invariant instruction results copied from the previous peeled iteration:
+  uint64_t invariantReuses;
+  uint64_t unchangedReuses;
+
+  // Split residual functions merged into an identical one at commit:
+  uint64_t mergedFunctions;
+
+  // Residual printf / fprintf calls rewritten by -int-fold-format-strings:
+  uint64_t foldedFormatCalls;
+
+  // Terminated loops left rolled by -int-max-unroll-growth:
+  uint64_t unrollGrowthLoops;
+
+  // The contexts' counts broken down by the function they specialise:
+  DenseMap<Function*, ContextStats> byFunction;
 
 GlobalStats() : dynamicFunctions(0), dynamicContexts(0), dynamicBlocks(0), dynamicInsts(0),
     disabledContexts(0), resolvedBranches(0), constantInstructions(0), pointerInstructions(0),
     setInstructions(0), unknownInstructions(0), deadInstructions(0), residualBlocks(0),
-    residualInstructions(0), mallocChecks(0), fileChecks(0), threadChecks(0), condChecks(0) {}
-
-  void print(raw_ostream& Out) {
-
-    Out << "Dynamic functions: " << dynamicFunctions << "\n";
-    Out << "Dynamic contexts: " << dynamicContexts << "\n";
-    Out << "Dynamic blocks: " << dynamicBlocks << "\n";
-    Out << "Dynamic instructions: " << dynamicInsts << "\n";
-    Out << "Disabled contexts: " << disabledContexts << "\n";
-    Out << "Resolved branches: " << resolvedBranches << "\n";
-    Out << "Constant instructions: " << constantInstructions << "\n";
-    Out << "Pointer instructions: " << pointerInstructions << "\n";
-    Out << "Set instructions: " << setInstructions << "\n";
-    Out << "Unknown instructions: " << unknownInstructions << "\n";
-    Out << "Dead instructions: " << deadInstructions << "\n";
-    Out << "Residual blocks: " << residualBlocks << "\n";
-    Out << "Residual instructons: " << residualInstructions << "\n";
-    Out << "Malloc checks: " << mallocChecks << "\n";
-    Out << "File checks: " << fileChecks << "\n";
-    Out << "Thread checks: " << threadChecks << "\n";
-    Out << "Cond checks: " << condChecks << "\n";
+    residualInstructions(0), mallocChecks(0), fileChecks(0), threadChecks(0), condChecks(0),
+    setOverflows(0), setWidenings(0), storeMergeMemoHits(0), storeMergeMemoMisses(0),
+    summarisedLoops(0), cycledLoops(0), overBudgetLoops(0), discardedLoops(0),
+    loopAnalysisRounds(0), widenedLoops(0), invariantReuses(0), unchangedReuses(0), mergedFunctions(0), foldedFormatCalls(0),
+    unrollGrowthLoops(0) {}
 
-  }
+  void addContext(Function* F, const ContextStats& S);
+
+  void print(raw_ostream& Out);
+  void printJSON(raw_ostream& Out);
+  void printFunctionCSV(raw_ostream& Out);
 
 };
 
 struct ArgStore {
 
   uint32_t heapIdx;
-  std::vector<std::pair<WeakVH, uint32_t> > PatchRefs;
+  std::vector<uint32_t> PatchRefs;
 
 ArgStore() : heapIdx(0) {}
 ArgStore(uint32_t hi) : heapIdx(hi) {}
 
 };
 
+// A map from instructions to facts that only a small minority of instructions have.
+// ShadowInstruction::sideTables notes which tables hold an entry for an instruction,
+// so the common miss is answered without hashing and the map stays out of the cache.
+// Entries must be erased before their instruction is freed.
+template<class T, unsigned char Flag> class InstSideTable {
+
+  DenseMap<ShadowInstruction*, T> Map;
+
+public:
+
+  typedef typename DenseMap<ShadowInstruction*, T>::iterator iterator;
+
+  iterator begin() { return Map.begin(); }
+  iterator end() { return Map.end(); }
+  uint32_t size() const { return Map.size(); }
+
+  iterator find(ShadowInstruction* SI) {
+    if(!(SI->sideTables & Flag))
+      return Map.end();
+    return Map.find(SI);
+  }
+
+  uint32_t count(ShadowInstruction* SI) const {
+    return (SI->sideTables & Flag) ? 1 : 0;
+  }
+
+  T& operator[](ShadowInstruction* SI) {
+    SI->sideTables |= Flag;
+    return Map[SI];
+  }
+
+  bool erase(ShadowInstruction* SI) {
+    if(!(SI->sideTables & Flag))
+      return false;
+    SI->sideTables &= ~Flag;
+    return Map.erase(SI);
+  }
+
+  void erase(iterator it) {
+    it->first->sideTables &= ~Flag;
+    Map.erase(it);
+  }
+
+};
+
 class LLPEAnalysisPass : public ModulePass {
 
  public:
@@ -415,8 +762,13 @@ class LLPEAnalysisPass : public ModulePass {
    DenseMap<Function*, SmallSet<BasicBlock*, 1> > ignoreLoopsWithChildren;
    DenseMap<Function*, SmallSet<BasicBlock*, 1> > expandCallsLoops;
    DenseMap<std::pair<Function*, BasicBlock*>, uint64_t> maxLoopIters;
+   DenseMap<Function*, uint32_t> maxSetSizes;
+   uint32_t defaultMaxSetSize;
    DenseSet<Instruction*> simpleVolatileLoads;
    
+   // Why the last attempt to forward an instruction fell short, for the DOT output. Only
+   // kept with -int-verbose-overdef: the std::string* error arguments of the load
+   // forwarding functions are null otherwise, and no message is formatted.
    DenseMap<ShadowInstruction*, std::string> optimisticForwardStatus;
 
    const DataLayout* TD;
@@ -426,14 +778,28 @@ class LLPEAnalysisPass : public ModulePass {
 
    DenseMap<const GlobalVariable*, std::string> GVCache;
    DenseMap<const GlobalVariable*, std::string> GVCacheBrief;
+   bool GVCachePopulated;
+
+   struct FunctionTextCache {
+
+     DenseMap<const Value*, std::string> Full;
+     DenseMap<const Value*, std::string> Brief;
+     std::list<const Function*>::iterator LRUPos;
+
+   };
 
-   DenseMap<const Function*, DenseMap<const Value*, std::string>* > functionTextCache;
-   DenseMap<const Function*, DenseMap<const Value*, std::string>* > briefFunctionTextCache;
+   // Most recently printed function first; the tail is evicted past -int-text-cache-functions.
+   DenseMap<const Function*, FunctionTextCache*> functionTextCache;
+   std::list<const Function*> functionTextLRU;
 
    DenseMap<GlobalVariable*, uint64_t> shadowGlobalsIdx;
 
    DenseMap<Function*, IHPFunctionInfo> functionMRInfo;
 
+   // Used for calls to defined functions that aren't expanded (see CallSummaries.cpp).
+   DenseMap<Function*, CallModSummary> callModSummaries;
+   bool callModSummariesComputed;
+
    bool cacheDisabled;
 
    unsigned mallocAlignment;
@@ -444,16 +810,19 @@ class LLPEAnalysisPass : public ModulePass {
    // Pass identifier
    static char ID;
 
-   DenseMap<Function*, DominatorTree*> DTs;
+   // Built on first use and held by each live InlineAttempt for the function (see getDT).
+   DenseMap<Function*, std::pair<DominatorTree*, uint32_t> > DTs;
 
    ImprovedValSetMulti::MapTy::Allocator IMapAllocator;
 
    SmallPtrSet<Function*, 8> blacklistedFunctions;
    void initBlacklistedFunctions(Module&);
+   void initStringModels(Module&);
 
    SmallPtrSet<Function*, 8> splitFunctions;
 
-   DenseMap<Function*, std::vector<InlineAttempt*> > IAsByFunction;
+   // Sharable contexts, bucketed by callee and a fingerprint of their arguments.
+   DenseMap<std::pair<Function*, unsigned>, std::vector<InlineAttempt*> > IAsBySignature;
 
    PathConditions pathConditions;
 
@@ -462,6 +831,7 @@ class LLPEAnalysisPass : public ModulePass {
    SmallDenseMap<Function*, DeallocatorFn, 4> deallocatorFunctions;
    SmallDenseMap<Function*, ReallocatorFn, 4> reallocatorFunctions;
    SmallDenseMap<Function*, Function*> modelFunctions;
+   SmallDenseMap<Function*, StringModelKind, 4> stringModels;
    SmallPtrSet<Function*, 4> yieldFunctions;
 
    ArgStore* argStores;
@@ -474,42 +844,128 @@ class LLPEAnalysisPass : public ModulePass {
    SmallVector<Function*, 4> commitFunctions;
 
    SmallDenseMap<CallInst*, std::vector<GlobalVariable*>, 4> lockDomains;
+   // Of a mutex global, the globals it guards (-int-mutex-domain).
+   DenseMap<GlobalVariable*, std::vector<GlobalVariable*> > mutexDomains;
    SmallSet<CallInst*, 4> pessimisticLocks;
 
    // Of an allocation or FD, record instructions that may use it in the emitted program.
    DenseMap<ShadowValue, std::vector<std::pair<ShadowValue, uint32_t> > > indirectDIEUsers;
    // Of a successful copy instruction, records the values read.
-   DenseMap<ShadowInstruction*, SmallVector<IVSRange, 4> > memcpyValues;
+   InstSideTable<SmallVector<IVSRange, 4>, SIDETABLE_MEMCPYVALUES> memcpyValues;
 
-   DenseMap<ShadowInstruction*, OpenStatus*> forwardableOpenCalls;
-   DenseMap<ShadowInstruction*, ReadFile> resolvedReadCalls;
-   DenseMap<ShadowInstruction*, SeekFile> resolvedSeekCalls;
+   InstSideTable<OpenStatus*, SIDETABLE_OPENCALL> forwardableOpenCalls;
+   InstSideTable<ReadFile, SIDETABLE_READCALL> resolvedReadCalls;
+   InstSideTable<SeekFile, SIDETABLE_SEEKCALL> resolvedSeekCalls;
+   InstSideTable<SmallVector<SeekFixup, 1>, SIDETABLE_SEEKFIXUPS> seekFixups;
+   // Fix-ups due before an expanded call, needed only if its context isn't committed.
+   InstSideTable<SmallVector<SeekFixup, 1>, SIDETABLE_CALLSEEKFIXUPS> callSeekFixups;
 
    void addSharableFunction(InlineAttempt*);
    void removeSharableFunction(InlineAttempt*);
+   void refreshSharableFunction(InlineAttempt*);
    InlineAttempt* findIAMatching(ShadowInstruction*);
 
    bool mustRecomputeDIE;
+   // Of each context (InlineAttempt or PeelAttempt) toggled since DSE and DIE last ran,
+   // whether it was enabled then.
+   DenseMap<void*, bool> togglesSinceDIE;
+   // Whether each block has split points, memoised for the duration of one DIE run.
+   DenseMap<ShadowBB*, bool> DIEBlockSplits;
+   void noteContextToggled(void* Ctx, bool wasEnabled);
 
    ShadowGV* shadowGlobals;
 
    std::vector<AllocData> heap;
+   // Heap objects carved from each arena (see -int-arena-allocator-fn), by arena base object.
+   DenseMap<ShadowValue, std::vector<uint32_t> > arenaObjects;
+   // Heap slots left by allocations in discarded contexts, kept as a min-heap so that
+   // addHeapAlloc reuses the lowest first (see -int-recycle-heap-slots).
+   std::vector<uint32_t> freeHeapSlots;
+   // Set while freeing contexts that will never be committed, whose allocations may
+   // give their slots back.
+   bool recyclingHeapSlots;
    std::vector<FDGlobalState> fds;
 
    RecyclingAllocator<BumpPtrAllocator, ImprovedValSetSingle> IVSAllocator;
+   // PHI and select merges are built here and only copied out when they differ from the
+   // instruction's existing value (see tryEvaluateMerge).
+   ImprovedValSetSingle mergeScratch;
+   RecyclingAllocator<BumpPtrAllocator, TrackedStore> TrackedStoreAllocator;
+   // Value sets allocated so far, for the phase profile.
+   uint64_t IVSAllocations;
+   // Instructions evaluated so far, for the context profile.
+   uint64_t instructionsEvaluated;
 
    bool verboseOverdef;
    bool enableSharing;
    bool verboseSharing;
    bool verbosePCs;
    bool useGlobalInitialisers;
+   // Set once the first store has been given every global's initial value; see initShadowGlobals.
+   bool globalStoresInitialised;
+
+   // -int-count-check-failures: a runtime counter per check failure site, with a
+   // description of the site, gathered into one table by emitCheckFailureTable.
+   bool countCheckFailures;
+   std::vector<std::pair<GlobalVariable*, std::string> > checkFailureSites;
+   void emitCheckFailureCounter(BasicBlock* breakBlock, const std::string& desc);
+   void emitCheckFailureTable();
+
+   // Whether specialised code leaves via break blocks that report the failure.
+   bool reportsCheckFailures() {
+     return verbosePCs || countCheckFailures;
+   }
 
    Function* llioPreludeFn;
    int llioPreludeStackIdx;
    std::string llioConfigFile;
    std::vector<std::string> llioDependentFiles;
 
+   // Input files, each read once per run (see getCachedFile).
+   StringMap<CachedFile> fileContents;
+
+   // Constant globals backing residual reads, by file (see getFileBytesGlobal).
+   StringMap<std::vector<FileBytesRegion> > fileBytesRegions;
+
+   // Constant globals that committed memcpys copy from, shared between identical values.
+   DenseMap<Constant*, GlobalVariable*> memcpySourceGlobals;
+
+   // Pointers synthCommittedPointer has built in synthPointerBlock, keyed by base value,
+   // offset and type and kept with the base they were built from, so that later uses in
+   // the same block (which they must dominate) can share them. synthForwardBases does
+   // the same for the placeholders standing in for bases not yet committed.
+   BasicBlock* synthPointerBlock;
+   DenseMap<std::pair<std::pair<Value*, int64_t>, Type*>, std::pair<WeakVH, WeakVH> > synthPointers;
+   DenseMap<ShadowValue, WeakVH> synthForwardBases;
+
+   // The expected hotness of each specialised block committed, relative to its function's
+   // entry, for postCommitOptimise to lay out the hot path contiguously. Kept until then.
+   ValueMap<BasicBlock*, double> committedBlockWeights;
+
+   // Specialisation cache (see Cache.cpp):
+   std::string cacheKey;
+   // Contents of the -int-config file, if any (see Config.cpp).
+   std::string configText;
+   void loadConfigFile(const std::string&);
+   void loadConfigFiles();
+
+   // Set in a worker forked to run one -int-serve job (see Serve.cpp).
+   std::string jobConfigFile;
+   std::string jobOutputFile;
+   void serveJobs();
+   void checkpoint(const char* Name);
+   void finishServedJob();
+   std::vector<std::string> cacheDependentFiles;
+   bool cacheable;
+   bool loadedFromCache;
+
+   bool memoryBudgetExceeded;
+   uint32_t memoryBudgetQueries;
+   bool overMemoryBudget();
+
    DenseSet<ShadowInstruction*> barrierInstructions;
+   // Loads already emitted and checked as part of an earlier load's check in their block.
+   DenseSet<ShadowInstruction*> batchedThreadChecks;
 
    bool programSingleThreaded;
    bool omitChecks;
@@ -517,26 +973,75 @@ class LLPEAnalysisPass : public ModulePass {
 
    DenseSet<std::pair<IntegrationAttempt*, const ShadowLoopInvar*> > latchStoresRetained;
 
+   // Functions created by splitCommitHere, for mergeIdenticalFunctions and
+   // shareResidualFunctions.
+   std::vector<WeakVH> splitCommitFunctions;
+   void mergeIdenticalFunctions();
+   void shareResidualFunctions(Module& M);
+   void foldFormatStrings();
+   void writePartitionedOutput(Module& M);
+   void writeReport();
+
+   // Named definitions in the input module, for committing with -int-variant-name.
+   std::vector<std::string> inputDefinitions;
+   void noteInputDefinitions(Module&);
+   void commitAsVariant(Module&);
+
+   // -int-guarded-clone: the root as it was before parseArgs, and the argv and environment
+   // parseArgs assumed (unknown argv entries are false), for the guard choosing between it
+   // and the specialisation at entry.
+   Function* guardOriginal;
+   long guardArgcIdx;
+   long guardArgvIdx;
+   long guardEnvIdx;
+   std::vector<std::pair<bool, std::string> > guardArgv;
+   std::vector<std::string> guardEnv;
+   void prepareGuardedClone(Function&);
+   void commitGuardedClone(Module&);
+
+   // Sorted (case value, successor index) tables for switches, built on first use.
+   DenseMap<SwitchInst*, std::vector<std::pair<uint64_t, uint32_t> > > switchCaseTables;
+   BasicBlock* getSwitchTarget(SwitchInst*, uint64_t);
+
    GlobalStats stats;
 
    DenseMap<IntegrationAttempt*, std::string> shortHeaders;
-   DenseMap<ShadowInstruction*, TrackedStore*> trackedStores;
-   DenseMap<ShadowInstruction*, TrackedAlloc*> trackedAllocs;
+   InstSideTable<TrackedStore*, SIDETABLE_TRACKEDSTORE> trackedStores;
+   InstSideTable<TrackedAlloc*, SIDETABLE_TRACKEDALLOC> trackedAllocs;
    DenseMap<Value*, uint32_t> committedHeapAllocations;
    DenseMap<Value*, uint32_t> committedFDs;
 
    std::vector<void*> IAs;
 
+   // Was the module loaded lazily (see tool/llpe.cpp's -llpe-lazy), with bodies only
+   // read when the specialiser first reaches them?
+   bool lazyModule;
+
    PersistPrinter* persistPrinter;
 
    bool emitFakeDebug;
    DenseMap<Function*, DebugLoc> fakeDebugLocs;
    DICompositeType fakeDebugType;
 
-   explicit LLPEAnalysisPass() : ModulePass(ID), cacheDisabled(false) { 
+   explicit LLPEAnalysisPass() : ModulePass(ID), GVCachePopulated(false), cacheDisabled(false) { 
 
      mallocAlignment = 0;
+     callModSummariesComputed = false;
      mustRecomputeDIE = false;
+     cacheable = true;
+     loadedFromCache = false;
+     memoryBudgetExceeded = false;
+     memoryBudgetQueries = 0;
+     IVSAllocations = 0;
+     instructionsEvaluated = 0;
+     globalStoresInitialised = false;
+     recyclingHeapSlots = false;
+     guardOriginal = 0;
+     synthPointerBlock = 0;
+     guardArgcIdx = -1;
+     guardArgvIdx = -1;
+     guardEnvIdx = -1;
+     lazyModule = false;
 
    }
 
@@ -614,6 +1119,8 @@ class LLPEAnalysisPass : public ModulePass {
      return it->second == C;
    }
 
+   std::vector<GlobalVariable*>* getLockDomain(ShadowInstruction* SI);
+
    bool atomicOpIsSimple(Instruction* LI) {
 
      return programSingleThreaded || simpleVolatileLoads.count(LI);
@@ -626,6 +1133,10 @@ class LLPEAnalysisPass : public ModulePass {
    unsigned getMallocAlignment();
 
    ShadowFunctionInvar* getFunctionInvarInfo(Function& F);
+   void materialiseFunction(Function& F);
+   void materialiseAllFunctions(Module& M);
+   DominatorTree* getDT(Function& F);
+   void releaseDT(Function& F);
    ShadowLoopInvar* getLoopInfo(ShadowFunctionInvar* FInfo,
 				DenseMap<BasicBlock*, uint32_t>& BBIndices, 
 				const Loop* L,
@@ -633,6 +1144,8 @@ class LLPEAnalysisPass : public ModulePass {
 				ShadowLoopInvar* Parent);
 
    void initShadowGlobals(Module&, uint32_t extraSlots);
+   void createGlobalAllocation(uint32_t idx);
+   void ensureGlobalAllocation(GlobalVariable* GV);
    uint64_t getShadowGlobalIndex(GlobalVariable* GV) {
      return shadowGlobalsIdx[GV];
    }
@@ -651,15 +1164,32 @@ class LLPEAnalysisPass : public ModulePass {
    BasicBlock* parsePCBlock(Function* fStack, std::string& bbName);
    int64_t parsePCInst(BasicBlock* bb, Module* M, std::string& instIndexStr);
    void writeLliowdConfig();
+   void computeCacheKey(Module&);
+   bool tryLoadFromCache(Module&);
+   void saveToCache(Module&);
 
    void initMRInfo(Module*);
    IHPFunctionInfo* getMRInfo(Function*);
+   void computeCallModSummaries(Module&);
+   const CallModSummary* getCallModSummary(Function*);
+
+   // Functions that may be run natively, with everything they call (see NativeCalls.cpp).
+   DenseMap<Function*, bool> nativeFunctions;
+   bool isNativeFunction(Function*);
 
    void postCommitStats();
 
    void saveSplitPhase();
 
    void fixNonLocalUses();
+
+   // Placeholders in committed code owed a value committed later (see addPatchRequest),
+   // indexed by the owners' PatchRefs: the instruction and the operand to set, or a null
+   // instruction if the placeholder was deleted first. Plain pointers rather than value
+   // handles, so those deleting committed code call forgetPatchPlaceholder.
+   std::vector<std::pair<Instruction*, uint32_t> > patchRequests;
+   DenseMap<Instruction*, uint32_t> patchPlaceholders;
+   void forgetPatchPlaceholder(Instruction*);
    void initGlobalFDStore();
 
    const ShadowLoopInvar* applyIgnoreLoops(const ShadowLoopInvar*, Function*, ShadowFunctionInvar*);
@@ -709,12 +1239,14 @@ inline void printSV(raw_ostream& RSO, ShadowValue V) {
 
 inline ImprovedValSetSingle* newIVS() {
 
+  ++GlobalIHP->IVSAllocations;
   return new (GlobalIHP->IVSAllocator.Allocate()) ImprovedValSetSingle();
 
 }
 
 inline ImprovedValSetSingle* newOverdefIVS() {
 
+  ++GlobalIHP->IVSAllocations;
   return new (GlobalIHP->IVSAllocator.Allocate()) ImprovedValSetSingle(ValSetTypeUnknown, true);
 
 }
@@ -737,6 +1269,7 @@ inline void deleteIV(ImprovedValSet* I) {
 
 inline ImprovedValSetSingle* copyIVS(const ImprovedValSetSingle* IVS) {
 
+  ++GlobalIHP->IVSAllocations;
   return new (GlobalIHP->IVSAllocator.Allocate()) ImprovedValSetSingle(*IVS);  
 
 }
@@ -752,14 +1285,14 @@ inline ImprovedValSet* copyIV(const ImprovedValSet* IV) {
 
 inline bool copyImprovedVal(ShadowValue V, ImprovedValSet*& OutPB) {
 
-  switch(V.t) {
+  switch(V.getValType()) {
 
   case SHADOWVAL_INST:
-    OutPB = copyIV(V.u.I->i.PB);
+    OutPB = copyIV(V.getInst()->i.PB);
     return IVIsInitialised(OutPB);
 
   case SHADOWVAL_ARG:
-    OutPB = copyIV(V.u.A->i.PB);
+    OutPB = copyIV(V.getArg()->i.PB);
     return IVIsInitialised(OutPB);
 
   case SHADOWVAL_GV:
@@ -827,17 +1360,22 @@ struct PartialVal {
   Constant* C;
   uint64_t ReadOffset;
 
-  // Used if it's an array of bytes
+  // Used if it's an array of bytes. partialValidBuf is a bitmap, one bit per byte of partialBuf,
+  // so that fills, merges and completeness checks work a word at a time.
   uint64_t* partialBuf;
-  bool* partialValidBuf;
+  uint64_t* partialValidBuf;
   uint64_t partialBufBytes;
   bool loadFinished;
 
   uint64_t markPaddingBytes(Type*);
 
+  static uint64_t getValidWords(uint64_t nbytes) { return (nbytes + 63) / 64; }
+  bool isValidByte(uint64_t i) const { return (partialValidBuf[i / 64] >> (i % 64)) & 1; }
+  void setValidBytes(uint64_t from, uint64_t to);
+  bool allBytesValid(uint64_t from, uint64_t to) const;
+
   bool addPartialVal(PartialVal& PV, const DataLayout* TD, std::string* error);
   bool isComplete();
-  bool* getValidArray(uint64_t);
   bool convertToBytes(uint64_t, const DataLayout*, std::string* error);
   bool combineWith(PartialVal& Other, uint64_t FirstDef, uint64_t FirstNotDef, uint64_t LoadSize, const DataLayout* TD, std::string* error);
 
@@ -875,7 +1413,7 @@ struct PartialVal {
 
 #define PVNull PartialVal()
 
-inline bool operator==(PartialVal V1, PartialVal V2) {
+inline bool operator==(const PartialVal& V1, const PartialVal& V2) {
   if(V1.type == PVEmpty && V2.type == PVEmpty)
     return true;
   else if(V1.type == PVTotal && V2.type == PVTotal)
@@ -886,13 +1424,27 @@ inline bool operator==(PartialVal V1, PartialVal V2) {
   else if(V1.type == PVByteArray && V2.type == PVByteArray) {
     if(V1.partialBufBytes != V2.partialBufBytes)
       return false;
-    for(unsigned i = 0; i < V1.partialBufBytes; ++i) {
-      if(V1.partialValidBuf[i] != V2.partialValidBuf[i])
-	return false;
-      if(V1.partialValidBuf[i] && (((char*)V1.partialBuf)[i]) != (((char*)V2.partialBuf)[i]))
-	return false;
-      return true;
+    uint64_t nWords = PartialVal::getValidWords(V1.partialBufBytes);
+    if(memcmp(V1.partialValidBuf, V2.partialValidBuf, nWords * sizeof(uint64_t)))
+      return false;
+    // Same bytes valid; compare those, 64 at a time where a whole word is valid.
+    const unsigned char* B1 = (const unsigned char*)V1.partialBuf;
+    const unsigned char* B2 = (const unsigned char*)V2.partialBuf;
+    for(uint64_t w = 0; w != nWords; ++w) {
+      uint64_t valid = V1.partialValidBuf[w];
+      uint64_t base = w * 64;
+      if(valid == ~((uint64_t)0)) {
+	if(memcmp(&(B1[base]), &(B2[base]), 64))
+	  return false;
+	continue;
+      }
+      for(; valid; valid &= (valid - 1)) {
+	uint64_t i = base + __builtin_ctzll(valid);
+	if(B1[i] != B2[i])
+	  return false;
+      }
     }
+    return true;
   }
 
   return false;
@@ -992,21 +1544,62 @@ enum MultiCmpResult {
 
 };
 
+// Worklists and visited sets for an IAWalker. Walks are frequent and short, so these
+// are pooled (see IAWalker::acquireState) to keep their allocations from walk to walk.
+struct IAWalkerState {
+
+  typedef std::pair<uint32_t, ShadowBB*> WLItem;
+  typedef std::vector<std::pair<WLItem, void*> > WorklistType;
+
+  WorklistType Worklist1;
+  WorklistType Worklist2;
+
+  // Walks nearly always enter a block at its top (forward) or bottom (backward), so those
+  // visits are kept as two bits per block in a bitset per context; any other start
+  // index goes in otherVisited.
+  DenseMap<IntegrationAttempt*, uint32_t> blockSetIdx;
+  std::vector<BitVector> blockSets;
+  uint32_t blockSetsUsed;
+  DenseSet<WLItem> otherVisited;
+
+  IAWalkerState() : blockSetsUsed(0) { }
+
+  void clear() {
+    Worklist1.clear();
+    Worklist2.clear();
+    blockSetIdx.clear();
+    blockSetsUsed = 0;
+    otherVisited.clear();
+  }
+
+};
+
 class IAWalker {
 
  public:
 
-  typedef std::pair<uint32_t, ShadowBB*> WLItem;
+  typedef IAWalkerState::WLItem WLItem;
+
+ private:
+
+  IAWalkerState* State;
+  IntegrationAttempt* lastVisitedIA;
+  BitVector* lastVisitedSet;
+
+  static IAWalkerState* acquireState();
+  static void releaseState(IAWalkerState*);
 
  protected:
   WLItem makeWL(uint32_t x, ShadowBB* y) { return std::make_pair(x, y); }
 
-  DenseSet<WLItem> Visited;
-  SmallVector<std::pair<WLItem, void*>, 8> Worklist1;
-  SmallVector<std::pair<WLItem, void*>, 8> Worklist2;
+  // Returns true if wl was not already visited.
+  bool markVisited(WLItem wl);
+
+  IAWalkerState::WorklistType& Worklist1;
+  IAWalkerState::WorklistType& Worklist2;
 
-  SmallVector<std::pair<WLItem, void*>, 8>* PList;
-  SmallVector<std::pair<WLItem, void*>, 8>* CList;
+  IAWalkerState::WorklistType* PList;
+  IAWalkerState::WorklistType* CList;
 
   SmallVector<void*, 4> Contexts;
   
@@ -1029,12 +1622,18 @@ class IAWalker {
 
   bool doIgnoreEdges;
 
- IAWalker(void* IC = 0, bool ign = false) : PList(&Worklist1), CList(&Worklist2), initialContext(IC), doIgnoreEdges(ign) {
+ IAWalker(void* IC = 0, bool ign = false) : State(acquireState()), lastVisitedIA(0), lastVisitedSet(0),
+    Worklist1(State->Worklist1), Worklist2(State->Worklist2), PList(&Worklist1), CList(&Worklist2),
+    initialContext(IC), doIgnoreEdges(ign) {
     
     Contexts.push_back(initialContext);
 
  }
 
+  virtual ~IAWalker() {
+    releaseState(State);
+  }
+
   void walk();
   void queueWalkFrom(uint32_t idx, ShadowBB*, void* context, bool copyContext);
 
@@ -1108,6 +1707,11 @@ protected:
   LLPEAnalysisPass* pass;
 
   uint64_t SeqNumber;
+  // A hash of this context's position: its function's name and the call sites and loop
+  // iterations leading to it from the root. Unlike SeqNumber it doesn't depend on how many
+  // contexts were explored elsewhere first, and names committed code under
+  // -int-deterministic-names.
+  uint64_t structuralId;
 
   Function& F;
   const ShadowLoopInvar* L;
@@ -1121,8 +1725,16 @@ protected:
 
   ShadowFunctionInvar* invarInfo;
 
+  // Backing storage for this context's ShadowBBs and their instruction and
+  // edge arrays, released in bulk once the context is committed or freed.
+  BumpPtrAllocator BBAllocator;
+
   int64_t totalIntegrationGoodness;
   bool integrationGoodnessValid;
+  // The functions this context's own instructions keep referenced, for findResidualFunctions;
+  // gathered once, and again only if a child call here is toggled.
+  bool ownResidualFunctionsValid;
+  std::vector<Function*> ownResidualFunctions;
   uint64_t residualInstructionsHere;
 
   DenseMap<const ShadowLoopInvar*, PeelAttempt*> peelChildren;
@@ -1143,6 +1755,16 @@ protected:
 
   bool mayUnwind;
 
+  // For each FD queried by isVfsCallUsingFD, the calls in this context that do not simply
+  // pass the FD by. Built in one pass on first query; only valid once analysis is finished.
+  DenseMap<ShadowInstruction*, DenseMap<ShadowInstruction*, WalkInstructionResult> > fdUseSummaries;
+
+  // Memoised edgeIsDeadRising and blockIsDeadRising, which otherwise walk every iteration of
+  // the child loops on each call. Cleared by livenessChanged.
+  DenseMap<uint64_t, bool> deadEdgeCache;
+  BitVector deadBlockKnown;
+  BitVector deadBlockCache;
+
  IntegrationAttempt(LLPEAnalysisPass* Pass, Function& _F, 
 		    const ShadowLoopInvar* _L, int depth, int sdepth) : 
     improvableInstructions(0),
@@ -1155,6 +1777,7 @@ protected:
     L(_L),
     totalIntegrationGoodness(0),
     integrationGoodnessValid(false),
+    ownResidualFunctionsValid(false),
     peelChildren(1),
     pendingEdges(0),
     barrierState(BARRIER_NONE),
@@ -1181,6 +1804,10 @@ protected:
   virtual bool edgeIsDead(ShadowBBInvar* BB1I, ShadowBBInvar* BB2I);
   bool edgeIsDeadRising(ShadowBBInvar& BB1I, ShadowBBInvar& BB2I, bool ignoreThisScope = false);
   bool blockIsDeadRising(ShadowBBInvar& BBI);
+  bool blockIsDeadRisingUncached(ShadowBBInvar& BBI);
+  bool edgeIsDeadRisingUncached(ShadowBBInvar& BB1I, ShadowBBInvar& BB2I, bool ignoreThisScope);
+  void livenessChanged();
+  void getOrderedPeelChildren(SmallVectorImpl<PeelAttempt*>&);
 
   virtual bool entryBlockIsCertain() = 0;
   virtual bool entryBlockAssumed() = 0;
@@ -1247,6 +1874,7 @@ protected:
 
   // Constant propagation:
   virtual bool tryEvaluateHeaderPHI(ShadowInstruction* SI, bool& resultValid, ImprovedValSet*& result);
+  virtual bool tryGetLoopInvariantResult(ShadowInstruction* SI, ImprovedValSet*& result);
   bool tryEvaluate(ShadowValue V, bool inLoopAnalyser, bool& loadedVararg);
   bool getNewPB(ShadowInstruction* SI, ImprovedValSet*& NewPB, bool& loadedVararg);
   bool tryEvaluateOrdinaryInst(ShadowInstruction* SI, ImprovedValSet*& NewPB);
@@ -1334,9 +1962,17 @@ protected:
   virtual ReadFile* tryGetReadFile(ShadowInstruction* CI);
   bool tryPromoteOpenCall(ShadowInstruction* CI);
   void tryPromoteAllCalls();
-  bool tryResolveVFSCall(ShadowInstruction*);
-  bool executeStatCall(ShadowInstruction* SI, Function* F, std::string& Filename);
+  bool tryResolveVFSCall(ShadowInstruction*, bool inLoopAnalyser);
+  bool tryModelStringCall(ShadowInstruction*);
+  bool tryRunNativeCall(ShadowInstruction*);
+  bool executeStatCall(ShadowInstruction* SI, Function* F, const std::string& Filename);
+  bool executeMmapCall(ShadowInstruction* SI);
+  bool executeMunmapCall(ShadowInstruction* SI);
+  bool executePreadCall(ShadowInstruction* SI);
+  bool executeGetdentsCall(ShadowInstruction* SI, bool inLoopAnalyser);
   WalkInstructionResult isVfsCallUsingFD(ShadowInstruction* VFSCall, ShadowInstruction* FD, bool ignoreClose);
+  WalkInstructionResult computeVfsCallUsingFD(ShadowInstruction* VFSCall, ShadowInstruction* FD, bool ignoreClose);
+  DenseMap<ShadowInstruction*, WalkInstructionResult>& getFDUseSummary(ShadowInstruction* FD);
   virtual void resolveReadCall(ShadowInstruction*, struct ReadFile);
   virtual void resolveSeekCall(ShadowInstruction*, struct SeekFile);
   bool isResolvedVFSCall(ShadowInstruction*);
@@ -1359,6 +1995,7 @@ protected:
   void tryKillStoresInLoop(const ShadowLoopInvar* L, bool commitDisabledHere, bool disableWrites, bool latchToHeader = false);
   void tryKillStoresInUnboundedLoop(const ShadowLoopInvar* UL, bool commitDisabledHere, bool disableWrites);
   void DSEAnalyseInstruction(ShadowInstruction* I, bool commitDisabledHere, bool disableWrites, bool enterCalls, bool& bail);
+  void collectReadSummary(DenseSet<ShadowValue>& Objects, bool& Unknown);
 
   // User visitors:
   
@@ -1372,6 +2009,7 @@ protected:
   bool valueIsDead(ShadowValue);
   bool shouldDIE(ShadowInstruction* V);
   virtual void runDIE();
+  void killDeadObjects();
   void resetDeadInstructions();
 
   virtual bool ctxContains(IntegrationAttempt*) = 0;
@@ -1388,6 +2026,8 @@ protected:
 
   virtual bool isEnabled() = 0;
   virtual void setEnabled(bool, bool skipStats) = 0;
+  // Forget this context's and its ancestors' benefit figures after a change beneath them.
+  virtual void invalidateBenefit();
   bool allAncestorsEnabled();
   virtual bool commitsOutOfLine() = 0;
   virtual bool mustCommitOutOfLine() = 0;
@@ -1401,21 +2041,18 @@ protected:
   // DOT export:
 
   void inheritDiagnosticsFrom(IntegrationAttempt*);
-  void countTentativeInstructions();
   void printRHS(ShadowValue, raw_ostream& Out);
   void printOutgoingEdge(ShadowBBInvar* BBI, ShadowBB* BB, ShadowBBInvar* SBI, ShadowBB* SB, uint32_t i, bool useLabels, const ShadowLoopInvar* deferEdgesOutside, SmallVector<std::string, 4>* deferredEdges, raw_ostream& Out, bool brief);
   void describeBlockAsDOT(ShadowBBInvar* BBI, ShadowBB* BB, const ShadowLoopInvar* deferEdgesOutside, SmallVector<std::string, 4>* deferredEdges, raw_ostream& Out, SmallVector<ShadowBBInvar*, 4>* forceSuccessors, bool brief, bool plain = false);
   void describeScopeAsDOT(const ShadowLoopInvar* DescribeL, uint32_t headerIdx, raw_ostream& Out, bool brief, SmallVector<std::string, 4>* deferredEdges);
   void describeLoopAsDOT(const ShadowLoopInvar* L, uint32_t headerIdx, raw_ostream& Out, bool brief);
-  void describeAsDOT(raw_ostream& Out, std::string& otherpath, bool brief);
+  void describeAsDOT(raw_ostream& Out, bool brief);
   std::string getValueColour(ShadowValue, std::string& textColour, bool plain = false);
   std::string getGraphPath(std::string prefix);
   void describeTreeAsDOT(std::string path);
   virtual bool getSpecialEdgeDescription(ShadowBBInvar* FromBB, ShadowBBInvar* ToBB, raw_ostream& Out) = 0;
   bool blockLiveInAnyScope(ShadowBBInvar* BB);
   virtual void printPathConditions(raw_ostream& Out, ShadowBBInvar* BBI, ShadowBB* BB);
-  void getSavedDotName(bool brief, std::string& Out);
-  void saveDOT2(bool brief);
   void saveDOT();
 
   void printWithCache(const Value* V, raw_ostream& ROS, bool brief = false) {
@@ -1450,6 +2087,7 @@ protected:
   void fixupHeaderPHIs(ShadowBB* BB);
   void emitTerminator(ShadowBB* BB, ShadowInstruction* I, BasicBlock* emitBB);
   bool emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVector<CommittedBlock, 1>::iterator& emitBB);
+  void emitSeekFixups(SmallVector<SeekFixup, 1>& Fixups, BasicBlock* emitBB);
   void emitCall(ShadowBB* BB, ShadowInstruction* I, SmallVector<CommittedBlock, 1>::iterator& emitBB);
   Instruction* emitInst(ShadowBB* BB, ShadowInstruction* I, BasicBlock* emitBB);
   bool synthCommittedPointer(ShadowValue I, SmallVector<CommittedBlock, 1>::iterator emitBB);
@@ -1463,6 +2101,7 @@ protected:
   bool trySynthInst(ShadowInstruction* I, BasicBlock* emitBB, Value*& Result);
   bool trySynthArg(ShadowArg* A, BasicBlock* emitBB, Value*& Result);
   void emitOrSynthInst(ShadowInstruction* I, ShadowBB* BB, SmallVector<CommittedBlock, 1>::iterator& emitBB);
+  void emitValueFacts(ShadowInstruction* I);
   void commitLoopInstructions(const ShadowLoopInvar* ScopeL, uint32_t& i);
   void commitInstructions();
   bool isCommitted() { 
@@ -1475,6 +2114,7 @@ protected:
   Value* getCommittedValueOrBlock(ShadowInstruction* I, uint32_t idx, ConstantInt*& failValue, BasicBlock*& failBlock);
   BasicBlock* getInvokeNormalSuccessor(ShadowInstruction*, bool& toCheckBlock);
   void releaseMemoryPostCommit();
+  void trimPostCommit();
   BasicBlock* createBasicBlock(LLVMContext& Ctx, const Twine& Name, Function* AddF, bool isEntryBlock, bool isFailedBlock);
   BasicBlock* CloneBasicBlockFrom(const BasicBlock* BB,
 				  ValueToValueMapTy& VMap,
@@ -1487,7 +2127,7 @@ protected:
 
   // Function sharing
 
-  void noteDependency(ShadowValue V);
+  void noteDependency(ShadowValue V, int64_t Offset = 0, uint64_t Size = ULONG_MAX);
   void noteMalloc(ShadowInstruction* SI);
   void noteVFSOp();
   void mergeChildDependencies(InlineAttempt* ChildIA);
@@ -1519,17 +2159,18 @@ protected:
   Value* emitAsExpectedCheck(ShadowInstruction* SI, BasicBlock* emitBB);
   SmallVector<CommittedBlock, 1>::iterator emitExitPHIChecks(SmallVector<CommittedBlock, 1>::iterator emitIt, ShadowBB* BB);
   Value* emitMemcpyCheck(ShadowInstruction* SI, BasicBlock* emitBB);
+  Value* emitBatchedThreadChecks(ShadowInstruction* SI, BasicBlock* emitBB, Value* Check);
   SmallVector<CommittedBlock, 1>::iterator emitOrdinaryInstCheck(SmallVector<CommittedBlock, 1>::iterator emitIt, ShadowInstruction* SI);
   SmallVector<CommittedBlock, 1>::iterator emitPathConditionChecks(ShadowBB* BB);
   ShadowValue getPathConditionSV(uint32_t instStackIdx, BasicBlock* instBB, uint32_t instIdx);
   ShadowValue getPathConditionSV(PathCondition& Cond);
   void emitPathConditionCheck(PathCondition& Cond, PathConditionTypes Ty, ShadowBB* BB, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt);
-  void emitPathConditionChecksIn(std::vector<PathCondition>& Conds, PathConditionTypes Ty, ShadowBB* BB, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt);
+  void emitPathConditionChecksIn(SmallVector<PathCondition*, 1>& Conds, PathConditionTypes Ty, ShadowBB* BB, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt);
   void emitPathConditionChecks2(ShadowBB* BB, PathConditions& PC, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& it);
   bool hasSpecialisedCompanion(ShadowBBInvar* BBI);
   void gatherPathConditionEdges(uint32_t bbIdx, uint32_t instIdx, SmallVector<std::pair<Value*, BasicBlock*>, 4>* preds, SmallVector<std::pair<BasicBlock*, IntegrationAttempt*>, 4>* IApreds);
   virtual void noteAsExpectedChecks(ShadowBB* BB);
-  void noteAsExpectedChecksFrom(ShadowBB* BB, std::vector<PathCondition>& PCs, uint32_t stackIdx);
+  void noteAsExpectedChecksFrom(ShadowBB* BB, PathConditions& PC, uint32_t stackIdx);
   bool requiresBreakCode(ShadowInstruction*);
   bool subblockEndsWithSpecialTest(uint32_t idx,
 				   SmallVector<std::pair<BasicBlock*, uint32_t>, 1>::iterator it, 
@@ -1569,10 +2210,10 @@ protected:
   
   // Stat collection and printing:
 
-  void collectAllBlockStats();
-  void collectBlockStats(ShadowBBInvar* BBI, ShadowBB* BB);
+  void collectAllBlockStats(bool countTentative);
+  void collectBlockStats(ShadowBBInvar* BBI, ShadowBB* BB, bool countTentative = false);
   void collectLoopStats(const ShadowLoopInvar*);
-  void collectStats();
+  void collectStats(bool countTentative = false);
   virtual void preCommitStats(bool enabledHere);
 
   void print(raw_ostream& OS) const;
@@ -1589,6 +2230,7 @@ protected:
   }
 
   void dumpMemoryUsage(int indent = 0);
+  uint64_t getShadowMemoryUsage(uint32_t& nValueSets);
 
   void testLoadWalk(LoadInst* LI);
 
@@ -1616,6 +2258,7 @@ public:
 
   PeelIteration* getNextIteration();
   PeelIteration* getOrCreateNextIteration(); 
+  uint64_t getCarriedStateHash();
 
   virtual BasicBlock* getEntryBlock(); 
 
@@ -1624,6 +2267,9 @@ public:
   void checkFinalIteration(); 
   void dropExitingStoreRefs();
   void dropLatchStoreRef();
+  bool getUniqueExitEdge(ShadowBB* BB, uint32_t& Target);
+  void clearFoldedExitStores();
+  uint64_t getPeelCost();
 
   virtual InlineAttempt* getFunctionRoot() {
     return parent->getFunctionRoot();
@@ -1644,6 +2290,7 @@ public:
   virtual bool canDisable(); 
   virtual bool isEnabled(); 
   virtual void setEnabled(bool, bool skipStats); 
+  virtual void invalidateBenefit();
 
   virtual bool isOptimisticPeel(); 
 
@@ -1672,6 +2319,7 @@ public:
   virtual BasicBlock* getSuccessorBB(ShadowBB* BB, uint32_t succIdx, bool& markUnreachable);
   virtual void emitPHINode(ShadowBB* BB, ShadowInstruction* I, BasicBlock* emitBB);
   virtual bool tryEvaluateHeaderPHI(ShadowInstruction* SI, bool& resultValid, ImprovedValSet*& result);
+  virtual bool tryGetLoopInvariantResult(ShadowInstruction* SI, ImprovedValSet*& result);
   virtual void visitExitPHI(ShadowInstructionInvar* UserI, DIVisitor& Visitor);
 
   virtual void getInitialStore(bool inLoopAnalyser);
@@ -1729,6 +2377,16 @@ class PeelAttempt {
    bool integrationGoodnessValid;
 
    std::vector<PeelIteration*> Iterations;
+
+   // Cost of the iterations peeled so far, and whether that exceeded -int-peel-budget
+   // before the loop was shown to terminate.
+   uint64_t peelCost;
+   bool overBudget;
+
+   // Fingerprints of the state each peeled iteration hands to the next, for
+   // -int-peel-cycle-detection, and the iteration that produced each.
+   DenseMap<uint64_t, uint32_t> carriedStates;
+
    std::vector<BasicBlock*> CommitBlocks;
    std::vector<BasicBlock*> CommitFailedBlocks;
    std::vector<Function*> CommitFunctions;
@@ -1747,7 +2405,7 @@ class PeelAttempt {
 
    bool allNonFinalIterationsDoNotExit(); 
 
-   void collectStats(); 
+   void collectStats(bool countTentative); 
    void printHeader(raw_ostream& OS) const; 
    void printDebugHeader(raw_ostream& OS) const {
      printHeader(OS);
@@ -1760,6 +2418,7 @@ class PeelAttempt {
    bool hasChildren(); 
    bool isEnabled(); 
    void setEnabled(bool, bool skipStats); 
+   void invalidateBenefit();
    
    void dumpMemoryUsage(int indent); 
 
@@ -1772,6 +2431,7 @@ class PeelAttempt {
 
    void dropExitingStoreRefs();
    void dropNonterminatedStoreRefs();
+   void foldExitingStores(uint32_t iter);
 
    bool containsTentativeLoads();
 
@@ -1803,6 +2463,8 @@ struct SharingState {
 
   OrdinaryLocalStore* storeAtEntry;
   DenseMap<ShadowValue, ImprovedValSet*> externalDependencies;
+  // The byte ranges of each dependency that were read; if absent, the whole object.
+  DenseMap<ShadowValue, SmallVector<std::pair<uint64_t, uint64_t>, 2> > dependencyRanges;
   SmallPtrSet<ShadowInstruction*, 4> escapingMallocs;
 
 SharingState() : storeAtEntry(0) { }
@@ -1848,10 +2510,18 @@ class InlineAttempt : public IntegrationAttempt {
   bool isPathCondition : 1;
   bool enabled : 1;
   bool isStackTop : 1;
+  bool overContextTimeBudget : 1;
+
+  // Wall-clock seconds spent analysing this context, including its children, and when its
+  // current analysis began; kept by ContextTimer for -int-context-time-budget.
+  double analysisTime;
+  double analysisResumed;
 
   IATargetInfo* targetCallInfo;
 
   SharingState* sharing;
+  // Argument fingerprint under which we are registered in IAsBySignature.
+  unsigned sharingKey;
 
   DominatorTree* DT;
   SmallDenseMap<uint32_t, uint32_t, 8>* blocksReachableOnFailure;
@@ -1860,10 +2530,17 @@ class InlineAttempt : public IntegrationAttempt {
   // Indexes from CLONED instruction/block to replacement PHI node to use in that block.
   DenseMap<std::pair<Instruction*, BasicBlock*>, PHINode*>* PHIForwards;
   DenseSet<PHINode*>* ForwardingPHIs;
+  // Memoised result of failedLoopHasBreaks.
+  DenseMap<const ShadowLoopInvar*, bool>* failedLoopBreaks;
 
   TLLocalStore* backupTlStore;
   DSELocalStore* backupDSEStore;
 
+  // Objects this context's original code may read, used to carry DSE across it if it
+  // is not committed. readsUnknown means it may read anything.
+  bool readsUnknown;
+  DenseSet<ShadowValue> readObjects;
+
   ImprovedValSet* returnValue;
 
   DebugLoc* dbgLoc;
@@ -1896,6 +2573,7 @@ class InlineAttempt : public IntegrationAttempt {
   virtual bool canDisable(); 
   virtual bool isEnabled(); 
   virtual void setEnabled(bool, bool skipStats); 
+  virtual void invalidateBenefit();
 
   virtual bool isOptimisticPeel(); 
 
@@ -1903,6 +2581,11 @@ class InlineAttempt : public IntegrationAttempt {
 
   virtual bool ctxContains(IntegrationAttempt*); 
 
+  // Encoded first_any_arg indices of the non-FP and FP varargs, in order.
+  std::vector<int64_t> nonFPVarargs;
+  std::vector<int64_t> fpVarargs;
+  bool varargTablesBuilt;
+  void buildVarargTables();
   int64_t NonFPArgIdxToArgIdx(int64_t idx);
   int64_t FPArgIdxToArgIdx(int64_t idx);
 
@@ -1949,6 +2632,7 @@ class InlineAttempt : public IntegrationAttempt {
   void dumpSharingState();
   virtual void sharingCleanup();
   bool matchesCallerEnvironment(ShadowInstruction* SI);
+  unsigned getArgsFingerprint();
   InlineAttempt* getWritableCopyFrom(ShadowInstruction* SI);
   void dropReferenceFrom(ShadowInstruction* SI);
 
@@ -1985,6 +2669,7 @@ class InlineAttempt : public IntegrationAttempt {
 			       Value* predV, SmallVector<std::pair<Value*, BasicBlock*>, 4>& newPreds);
   bool isSimpleMergeBlock(uint32_t i);
   BasicBlock::iterator skipMergePHIs(BasicBlock::iterator it);
+  bool failedLoopHasBreaks(const ShadowLoopInvar* LInfo);
   void createForwardingPHIs(ShadowInstructionInvar& OrigSI, Instruction* NewI);
   Value* getLocalFailedValue(Value* V, BasicBlock*);
   Value* tryGetLocalFailedValue(Value* V, BasicBlock*);
@@ -2011,6 +2696,7 @@ class InlineAttempt : public IntegrationAttempt {
 
   virtual uint64_t findSaveSplits();
   void splitCommitHere();
+  void addArgumentAttributes(Function*);
 
   void gatherIndirectUsers();
   InlineAttempt* getStackFrameCtx(int32_t);
@@ -2021,7 +2707,9 @@ class InlineAttempt : public IntegrationAttempt {
   void releaseCommittedChildren();
 
   void postCommitOptimise();
+  void outlineFailedBlocks();
   void finaliseAndCommit(bool inLoopAnalyser);
+  void summariseReads();
   void inheritCommitFunctionCall(bool);
 
   virtual void inheritCommitBlocksAndFunctions(std::vector<BasicBlock*>& NewCBs, std::vector<BasicBlock*>& NewFCBs, std::vector<Function*>& NewFs);
@@ -2145,11 +2833,11 @@ inline ShadowValue getStackAllocationWithIndex(InlineAttempt* IA, uint32_t i) {
 
 inline IntegrationAttempt* ShadowValue::getCtx() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_ARG:
-    return u.A->IA;
+    return getArg()->IA;
   case SHADOWVAL_INST:
-    return u.I->parent->IA;
+    return getInst()->parent->IA;
   default:
     return 0;
   }
@@ -2158,6 +2846,7 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
 
  Constant* extractAggregateMemberAt(Constant* From, int64_t Offset, Type* Target, uint64_t TargetSize, const DataLayout*);
  Constant* constFromBytes(unsigned char*, Type*, const DataLayout*);
+ ShadowValue shadowValFromBytes(unsigned char*, Type*, const DataLayout*);
  bool allowTotalDefnImplicitCast(Type* From, Type* To);
  bool allowTotalDefnImplicitPtrToInt(Type* From, Type* To, const DataLayout*);
  std::string ind(int i);
@@ -2166,7 +2855,9 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  Constant* intFromBytes(const uint64_t*, unsigned, unsigned, llvm::LLVMContext&);
  
  // Implemented in Transforms/Integrator/SimpleVFSEval.cpp, so only usable with -integrator
- bool getFileBytes(std::string& strFileName, uint64_t realFilePos, uint64_t realBytes, std::vector<Constant*>& arrayBytes, LLVMContext& Context, std::string& errors);
+ bool getFileBytes(const std::string& strFileName, uint64_t realFilePos, uint64_t realBytes, ArrayRef<uint8_t>& Bytes, std::string& errors);
+ CachedFile* getCachedFile(const std::string& Filename, std::string& errors);
+ uint64_t getFileSeekOffset(const std::string& Filename, uint64_t pos);
 
  // Implemented in VMCore/AsmWriter.cpp, since that file contains a bunch of useful private classes
  // if LLVM has been patched appropriately; otherwise stubbed out with simple implementations in Print.cpp.
@@ -2205,6 +2896,7 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  bool instructionCounts(Instruction* I);
 
  Function* getCalledFunction(ShadowInstruction*);
+ bool getCalledFunctions(ShadowInstruction*, SmallVector<Function*, 4>&);
 
  int64_t getSpilledVarargAfter(ShadowInstruction* CI, int64_t OldArg);
 
@@ -2229,6 +2921,7 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
 
  void getIVSSubVals(const ImprovedValSetSingle& Src, uint64_t Offset, uint64_t Size, int64_t OffsetAbove, SmallVector<IVSRange, 4>& Dest);
  void getIVSSubVal(const ImprovedValSetSingle& Src, uint64_t Offset, uint64_t Size, ImprovedValSetSingle& Dest);
+ bool getIVSRangeConstantInt(const IVSRange& R, uint64_t& Out);
  void getConstSubVals(ShadowValue FromSV, uint64_t Offset, uint64_t TargetSize, int64_t OffsetAbove, SmallVector<IVSRange, 4>& Dest);
  Constant* valsToConst(SmallVector<IVSRange, 4>& subVals, uint64_t TargetSize, Type* targetType);
  void getConstSubVal(ShadowValue FromSV, uint64_t Offset, uint64_t TargetSize, Type* TargetType, ImprovedValSetSingle& Result);
@@ -2241,18 +2934,20 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  void truncateLeft(ImprovedValSetMulti::MapIt& it, uint64_t n, ImprovedValSetMulti::MapIt& replacementStart);
  bool canTruncate(const ImprovedValSetSingle& S);
 
+ void clearStoreMergeMemo();
+ void clearLoadCaches();
  void readValRangeMultiFrom(uint64_t Offset, uint64_t Size, ImprovedValSet* store, SmallVector<IVSRange, 4>& Results, ImprovedValSet* ignoreBelowStore, uint64_t ASize);
  void readValRangeMulti(ShadowValue& V, uint64_t Offset, uint64_t Size, ShadowBB* ReadBB, SmallVector<IVSRange, 4>& Results);
  void executeMemcpyInst(ShadowInstruction* MemcpySI);
  void executeVaCopyInst(ShadowInstruction* SI);
- void executeAllocInst(ShadowInstruction* SI, AllocData&, Type* AllocType, uint64_t AllocSize, int32_t frame, uint32_t idx);
+ void executeAllocInst(ShadowInstruction* SI, AllocData&, Type* AllocType, uint64_t AllocSize, int32_t frame, uint32_t idx, bool zeroed = false);
  void executeAllocaInst(ShadowInstruction* SI);
  void executeMallocLikeInst(ShadowInstruction* SI);
  void executeReallocInst(ShadowInstruction* SI, Function*);
  void executeFreeInst(ShadowInstruction* SI, Function*);
  void executeCopyInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, ImprovedValSetSingle& SrcPtrSet, uint64_t Size, ShadowInstruction*);
  void executeVaStartInst(ShadowInstruction* SI);
- void executeReadInst(ShadowInstruction* ReadSI, std::string& Filename, uint64_t FileOffset, uint64_t Size);
+ void executeReadInst(ShadowInstruction* ReadSI, const std::string& Filename, uint64_t FileOffset, uint64_t Size);
  void executeUnexpandedCall(ShadowInstruction* SI);
  bool clobberSyscallModLocations(Function* F, ShadowInstruction* SI);
  void executeWriteInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, ImprovedValSetSingle& ValPB, uint64_t PtrSize, ShadowInstruction*);
@@ -2266,6 +2961,9 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
 
  void doBlockFDStoreMerge(ShadowBB* BB);
  void doCallFDStoreMerge(ShadowBB* BB, InlineAttempt* IA);
+ void flushSeek(ShadowInstruction* SI, FDState& FDS, uint32_t FD);
+ void flushAllSeeks(ShadowInstruction* SI);
+ void noteCallSeekFixups(ShadowInstruction* SI);
 
  void initSpecialFunctionsMap(Module& M);
  
@@ -2273,8 +2971,9 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
 
  ShadowValue& getAllocWithIdx(int32_t);
  AllocData& addHeapAlloc(ShadowInstruction*);
+ void releaseHeapSlot(ShadowInstruction*);
+ void markVagueAllocation(ShadowInstruction*);
 
- IntegratorTag* searchFunctions(IntegratorTag* thisTag, std::string&, IntegratorTag*& startAt);
 
  GlobalVariable* getStringArray(std::string& bytes, Module& M, bool addNull=false);
 
@@ -2294,10 +2993,15 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  
  void printPathCondition(PathCondition& PC, PathConditionTypes t, ShadowBB* BB, raw_ostream& Out, bool HTMLEscaped);
  void emitRuntimePrint(BasicBlock* BB, std::string& message, Value* param, Instruction* insertBefore = 0);
+ void emitCheckFailure(BasicBlock* breakBlock, std::string& message, Value* param = 0);
  void escapePercent(std::string&);
+ void setCheckBranchWeights(BranchInst* BI, BasicBlock* failTarget);
 
  void clearAsExpectedChecks(ShadowBB*);
- void noteLLIODependency(std::string&);
+ void noteLLIODependency(const std::string&);
+ void noteCacheDependency(const std::string&);
+ bool isColdBlock(BasicBlock*);
+ bool getFileSha1(std::string& Filename, unsigned char* hash);
 
  const GlobalValue* getUnderlyingGlobal(const GlobalValue* V);
 
@@ -2331,16 +3035,110 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
 
  void TLWalkPathConditions(ShadowBB* BB, bool contextEnabled, bool secondPass);
  void rerunTentativeLoads(ShadowInstruction*, InlineAttempt*, bool inLoopAnalyser);
- void patchReferences(std::vector<std::pair<WeakVH, uint32_t> >& Refs, Value* V);
+ void patchReferences(std::vector<uint32_t>& Refs, Value* V);
  void forwardReferences(Value* Fwd, Module* M);
  Module* getGlobalModule();
  void setAllNeededTop(DSELocalStore*);
+ void setNeededForReads(DSELocalStore*, DenseSet<ShadowValue>&);
  bool IHPFoldIntOp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal>* Ops, SmallVector<uint64_t, 4>& OpInts, ValSetType& ImpType, ImprovedVal& Improved);
  void DeleteDeadInstruction(Instruction *I);
  void createTopOrderingFrom(BasicBlock* BB, std::vector<BasicBlock*>& Result, SmallSet<BasicBlock*, 8>& Visited, LoopInfo* LI, const Loop* MyL);
 
+ unsigned getAnalysisThreads();
+ void parallelFor(uint32_t N, const std::function<void(uint32_t)>& Work);
+
+ // Tasks run by the process-wide worker pool (see Parallel.cpp).
+ // spawn queues a task, which may itself spawn more; wait runs queued tasks, this group's
+ // or others', until all of this group's have finished.
+ class TaskGroup {
+
+   std::atomic<uint32_t> pending;
+
+ public:
+
+   TaskGroup() : pending(0) {}
+   ~TaskGroup() { wait(); }
+
+   void spawn(std::function<void()> Task);
+   void wait();
+   void taskDone();
+
+ };
+
+ // Phases timed by the phase profile written alongside -int-stats-file (see PhaseProfile.cpp).
+ enum LLPEPhase {
+
+   PhaseInterpret,
+   PhaseBenefit,
+   PhaseTL,
+   PhaseDSE,
+   PhaseDIE,
+   PhaseSaveSplit,
+   PhaseCommit,
+   PhasePostCommit,
+   PhaseCount
+
+ };
+
+ // Charges the time until it goes out of scope to Phase, less any other phase timed within it.
+ // Re-entering the phase currently being timed is free, so recursive entry points can use one.
+ class PhaseTimer {
+
+   bool active;
+
+ public:
+
+   PhaseTimer(LLPEPhase Phase);
+   ~PhaseTimer();
+
+ };
+
+ void enablePhaseProfile();
+ void writePhaseProfile(raw_ostream&);
+
+ // The -int-status-file live status (see PhaseProfile.cpp). noteProgress is cheap unless a
+ // status file is due to be rewritten, so it can be called from the progress dots.
+ void enableStatusFile(const std::string& Path, uint32_t IntervalMillis);
+ void noteProgress();
+ void noteContextCommitted();
+ void finishStatusFile();
+
+ // Charges analysis time and instructions evaluated until it goes out of scope to a context,
+ // or a loop analysed in general within it, for the -int-context-profile stack file.
+ class ContextTimer {
+
+   bool active;
+   bool tracked;
+
+ public:
+
+   ContextTimer(IntegrationAttempt* IA, const ShadowLoopInvar* L);
+   ~ContextTimer();
+
+ private:
+
+   InlineAttempt* timedIA;
+
+ };
+
+ // -int-time-budget and -int-context-time-budget: once the run, or the function context
+ // enclosing IA, has spent its budget analysing, no further calls or loops are expanded
+ // within it and loops being peeled fall back to the general loop analysis.
+ void startTimeBudget();
+ bool overTimeBudget(IntegrationAttempt* IA);
+
+ void writeContextProfile();
+
+ // Structural function merging, shared by commit and -llpe-merge-variants (see PostCommit.cpp).
+ uint32_t mergeFunctionList(const std::vector<Function*>&);
+
+ // The -int-report-dir headless report (see Report.cpp).
+ bool reportEnabled();
+ void noteReportContext(IntegrationAttempt* IA);
+
  extern char ihp_workdir[];
  extern bool IHPSaveDOTFiles;
+ void closeDOTTrace();
 
 } // Namespace LLVM
 
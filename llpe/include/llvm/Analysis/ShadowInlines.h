@@ -111,28 +111,91 @@ enum ValSetType {
 
 };
 
+// A ShadowValue is packed into a single word. The pointer kinds keep their tag in the low
+// three bits, which are always clear in the 8-byte aligned Value, ShadowArg, ShadowInstruction
+// and ShadowGV objects. Allocation and FD indices carry their frame and index inline, as do
+// integer constants; the rare 64-bit integer too wide for the inline field is interned in
+// boxedInts and the word holds its index instead. Because every value has exactly one encoding,
+// equality and hashing work on the raw word.
+
+#define SVTAG_OTHER 0
+#define SVTAG_ARG 1
+#define SVTAG_INST 2
+#define SVTAG_GV 3
+#define SVTAG_PTRIDX 4
+#define SVTAG_FDIDX 5
+#define SVTAG_FDIDX64 6
+#define SVTAG_IMM 7
+#define SVTAG_MASK 7
+
+// Sub-tags of SVTAG_IMM, stored in bits 3-5; the payload occupies bits 6-63.
+#define SVIMM_CI8 0
+#define SVIMM_CI16 1
+#define SVIMM_CI32 2
+#define SVIMM_CI64 3
+#define SVIMM_CI64BOXED 4
+#define SVIMM_INVAL 5
+#define SVIMM_EMPTYKEY 6
+#define SVIMM_TOMBSTONEKEY 7
+#define SVIMM_PAYLOADSHIFT 6
+
+// Index kinds: the index is stored in bits 3-34 and the (signed) frame in bits 35-63.
+#define SVIDX_FRAMESHIFT 35
+
 struct ShadowValue {
 
-  ShadowValType t;
-  union {
-    ShadowArg* A;
-    ShadowInstruction* I;
-    ShadowGV* GV;
-    Value* V;
-    struct {
-      int32_t frame;
-      uint32_t idx;
-    } PtrOrFd;
-    uint64_t CI;
-  } u;
-
-ShadowValue() : t(SHADOWVAL_INVAL) { u.V = 0; }
-ShadowValue(ShadowArg* _A) : t(SHADOWVAL_ARG) { u.A = _A; }
-ShadowValue(ShadowInstruction* _I) : t(SHADOWVAL_INST) { u.I = _I; }
-ShadowValue(ShadowGV* _GV) : t(SHADOWVAL_GV) { u.GV = _GV; }
-ShadowValue(Value* _V) : t(SHADOWVAL_OTHER) { u.V = _V; }
-ShadowValue(ShadowValType Ty, int32_t frame, uint32_t idx) : t(Ty) { u.PtrOrFd.frame = frame; u.PtrOrFd.idx = idx; }
-ShadowValue(ShadowValType Ty, uint64_t _CI) : t(Ty) { u.CI = _CI; }
+  uint64_t raw;
+
+  static uint64_t makeImm(uint32_t subTag, uint64_t payload) {
+    return (payload << SVIMM_PAYLOADSHIFT) | (subTag << 3) | SVTAG_IMM;
+  }
+  static uint64_t makeIdx(uint32_t tag, int32_t frame, uint32_t idx) {
+    release_assert(frame >= -(1 << 28) && frame < (1 << 28) && "Frame number too large for ShadowValue");
+    return (((uint64_t)(int64_t)frame) << SVIDX_FRAMESHIFT) | (((uint64_t)idx) << 3) | tag;
+  }
+  static uint64_t makeInt64(uint64_t CI);
+  static ShadowValue fromRaw(uint64_t r) {
+    ShadowValue SV;
+    SV.raw = r;
+    return SV;
+  }
+
+  // Backing store for SVIMM_CI64BOXED values.
+  static std::vector<uint64_t> boxedInts;
+
+ShadowValue() : raw(makeImm(SVIMM_INVAL, 0)) { }
+ShadowValue(ShadowArg* _A) : raw(((uint64_t)_A) | SVTAG_ARG) { }
+ShadowValue(ShadowInstruction* _I) : raw(((uint64_t)_I) | SVTAG_INST) { }
+ShadowValue(ShadowGV* _GV) : raw(((uint64_t)_GV) | SVTAG_GV) { }
+ShadowValue(Value* _V) : raw((uint64_t)_V) { }
+ShadowValue(ShadowValType Ty, int32_t frame, uint32_t idx) {
+    switch(Ty) {
+    case SHADOWVAL_PTRIDX:
+      raw = makeIdx(SVTAG_PTRIDX, frame, idx); break;
+    case SHADOWVAL_FDIDX:
+      raw = makeIdx(SVTAG_FDIDX, frame, idx); break;
+    case SHADOWVAL_FDIDX64:
+      raw = makeIdx(SVTAG_FDIDX64, frame, idx); break;
+    default:
+      release_assert(0 && "Bad index ShadowValue type");
+      raw = makeImm(SVIMM_INVAL, 0);
+    }
+  }
+ShadowValue(ShadowValType Ty, uint64_t _CI) {
+    switch(Ty) {
+    case SHADOWVAL_CI8:
+      raw = makeImm(SVIMM_CI8, (uint8_t)_CI); break;
+    case SHADOWVAL_CI16:
+      raw = makeImm(SVIMM_CI16, (uint16_t)_CI); break;
+    case SHADOWVAL_CI32:
+      raw = makeImm(SVIMM_CI32, (uint32_t)_CI); break;
+    case SHADOWVAL_CI64:
+      raw = makeInt64(_CI); break;
+    default:
+      release_assert(0 && "Bad integer ShadowValue type");
+      raw = makeImm(SVIMM_INVAL, 0);
+    }
+  }
 
   static ShadowValue getPtrIdx(int32_t f, uint32_t i) { return ShadowValue(SHADOWVAL_PTRIDX, f, i); }
   static ShadowValue getFdIdx(uint32_t i) { return ShadowValue(SHADOWVAL_FDIDX, -1, i); }
@@ -143,63 +206,121 @@ ShadowValue(ShadowValType Ty, uint64_t _CI) : t(Ty) { u.CI = _CI; }
   static ShadowValue getInt64(uint64_t i) { return ShadowValue(SHADOWVAL_CI64, i); }
   static ShadowValue getInt(Type*, uint64_t i);
 
+  uint32_t getTag() const {
+    return raw & SVTAG_MASK;
+  }
+  uint32_t getImmTag() const {
+    return (raw >> 3) & 7;
+  }
+
+  ShadowValType getValType() const {
+    switch(getTag()) {
+    case SVTAG_OTHER:
+      return SHADOWVAL_OTHER;
+    case SVTAG_ARG:
+      return SHADOWVAL_ARG;
+    case SVTAG_INST:
+      return SHADOWVAL_INST;
+    case SVTAG_GV:
+      return SHADOWVAL_GV;
+    case SVTAG_PTRIDX:
+      return SHADOWVAL_PTRIDX;
+    case SVTAG_FDIDX:
+      return SHADOWVAL_FDIDX;
+    case SVTAG_FDIDX64:
+      return SHADOWVAL_FDIDX64;
+    default:
+      switch(getImmTag()) {
+      case SVIMM_CI8:
+	return SHADOWVAL_CI8;
+      case SVIMM_CI16:
+	return SHADOWVAL_CI16;
+      case SVIMM_CI32:
+	return SHADOWVAL_CI32;
+      case SVIMM_CI64:
+      case SVIMM_CI64BOXED:
+	return SHADOWVAL_CI64;
+      default:
+	return SHADOWVAL_INVAL;
+      }
+    }
+  }
+
   bool isInval() const {
-    return t == SHADOWVAL_INVAL;
+    return raw == makeImm(SVIMM_INVAL, 0);
   }
   bool isArg() const {
-    return t == SHADOWVAL_ARG;
+    return getTag() == SVTAG_ARG;
   }
   bool isInst() const {
-    return t == SHADOWVAL_INST;
+    return getTag() == SVTAG_INST;
   }
   bool isVal() const {
-    return t == SHADOWVAL_OTHER;
+    return getTag() == SVTAG_OTHER;
   }
   bool isGV() const {
-    return t == SHADOWVAL_GV;
+    return getTag() == SVTAG_GV;
   }
   bool isPtrIdx() const {
-    return t == SHADOWVAL_PTRIDX;
+    return getTag() == SVTAG_PTRIDX;
   }
   bool isFdIdx() const {
-    return t == SHADOWVAL_FDIDX || t == SHADOWVAL_FDIDX64;
+    return getTag() == SVTAG_FDIDX || getTag() == SVTAG_FDIDX64;
   }
   bool isConstantInt() const {
-    return t == SHADOWVAL_CI8 || t == SHADOWVAL_CI16 || t == SHADOWVAL_CI32 || t == SHADOWVAL_CI64;
+    return getTag() == SVTAG_IMM && getImmTag() <= SVIMM_CI64BOXED;
   }
   ShadowArg* getArg() const {
-    return t == SHADOWVAL_ARG ? u.A : 0;
+    return isArg() ? (ShadowArg*)(raw & ~(uint64_t)SVTAG_MASK) : 0;
   }
   ShadowInstruction* getInst() const {
-    return t == SHADOWVAL_INST ? u.I : 0;
+    return isInst() ? (ShadowInstruction*)(raw & ~(uint64_t)SVTAG_MASK) : 0;
   }
   Value* getVal() const {
-    return t == SHADOWVAL_OTHER ? u.V : 0;
+    return isVal() ? (Value*)raw : 0;
   }
   ShadowGV* getGV() const {
-    return t == SHADOWVAL_GV ? u.GV : 0;
+    return isGV() ? (ShadowGV*)(raw & ~(uint64_t)SVTAG_MASK) : 0;
+  }
+  // Of an index kind (PTRIDX, FDIDX, FDIDX64):
+  int32_t getIdxFrame() const {
+    return (int32_t)(((int64_t)raw) >> SVIDX_FRAMESHIFT);
+  }
+  uint32_t getIdx() const {
+    return (uint32_t)(raw >> 3);
+  }
+  // Of a constant int, the value zero-extended (or for a 64-bit int the raw value):
+  uint64_t getCIValue() const {
+    switch(getImmTag()) {
+    case SVIMM_CI64:
+      return (uint64_t)(((int64_t)raw) >> SVIMM_PAYLOADSHIFT);
+    case SVIMM_CI64BOXED:
+      return boxedInts[raw >> SVIMM_PAYLOADSHIFT];
+    default:
+      return raw >> SVIMM_PAYLOADSHIFT;
+    }
   }
   bool getCI(uint64_t& Out) const {
     bool isci = isConstantInt();
     if(isci)
-      Out = u.CI;
+      Out = getCIValue();
     return isci;
   }
   bool getSignedCI(int64_t& Out) const {
     bool isci = isConstantInt();
     if(isci) {
-      switch(t) {
+      switch(getValType()) {
       case SHADOWVAL_CI8:
-	Out = (int8_t)(uint8_t)u.CI;
+	Out = (int8_t)(uint8_t)getCIValue();
 	break;
       case SHADOWVAL_CI16:
-	Out = (int16_t)(uint16_t)u.CI;
+	Out = (int16_t)(uint16_t)getCIValue();
 	break;
       case SHADOWVAL_CI32:
-	Out = (int32_t)(uint32_t)u.CI;
+	Out = (int32_t)(uint32_t)getCIValue();
 	break;
       case SHADOWVAL_CI64:
-	Out = (int64_t)(uint64_t)u.CI;
+	Out = (int64_t)getCIValue();
 	break;
       default:
 	llvm_unreachable("Bad integer type");
@@ -228,9 +349,9 @@ ShadowValue(ShadowValType Ty, uint64_t _CI) : t(Ty) { u.CI = _CI; }
     return getHeapKey();
   }
   int32_t getFd() const {
-    switch(t) {
-    case SHADOWVAL_FDIDX:
-    case SHADOWVAL_FDIDX64:
+    switch(getTag()) {
+    case SVTAG_FDIDX:
+    case SVTAG_FDIDX64:
       return getHeapKey();
     default:
       return -1;
@@ -245,32 +366,7 @@ ShadowValue(ShadowValType Ty, uint64_t _CI) : t(Ty) { u.CI = _CI; }
 };
 
 inline bool operator==(ShadowValue V1, ShadowValue V2) {
-  if(V1.t != V2.t)
-    return false;
-  switch(V1.t) {
-  case SHADOWVAL_INVAL:
-    return true;
-  case SHADOWVAL_ARG:
-    return V1.u.A == V2.u.A;
-  case SHADOWVAL_INST:
-    return V1.u.I == V2.u.I;
-  case SHADOWVAL_GV:
-    return V1.u.GV == V2.u.GV;
-  case SHADOWVAL_OTHER:
-    return V1.u.V == V2.u.V;
-  case SHADOWVAL_PTRIDX:
-  case SHADOWVAL_FDIDX:
-  case SHADOWVAL_FDIDX64:
-    return V1.u.PtrOrFd.frame == V2.u.PtrOrFd.frame && V1.u.PtrOrFd.idx == V2.u.PtrOrFd.idx;
-  case SHADOWVAL_CI8:
-  case SHADOWVAL_CI16:
-  case SHADOWVAL_CI32:
-  case SHADOWVAL_CI64:
-    return V1.u.CI == V2.u.CI;
-  default:
-    release_assert(0 && "Bad SV type");
-    return false;
-  }
+  return V1.raw == V2.raw;
 }
 
 inline bool operator!=(ShadowValue V1, ShadowValue V2) {
@@ -278,31 +374,29 @@ inline bool operator!=(ShadowValue V1, ShadowValue V2) {
 }
 
 inline bool operator<(ShadowValue V1, ShadowValue V2) {
-  if(V1.t != V2.t)
-    return V1.t < V2.t;
-  switch(V1.t) {
+  ShadowValType t1 = V1.getValType(), t2 = V2.getValType();
+  if(t1 != t2)
+    return t1 < t2;
+  switch(t1) {
   case SHADOWVAL_INVAL:
     return false;
   case SHADOWVAL_ARG:
-    return V1.u.A < V2.u.A;
   case SHADOWVAL_INST:
-    return V1.u.I < V2.u.I;
   case SHADOWVAL_GV:
-    return V1.u.GV < V2.u.GV;
   case SHADOWVAL_OTHER:
-    return V1.u.V < V2.u.V;
+    return V1.raw < V2.raw;
   case SHADOWVAL_PTRIDX:
   case SHADOWVAL_FDIDX:
   case SHADOWVAL_FDIDX64:
-    if(V1.u.PtrOrFd.frame == V2.u.PtrOrFd.frame)
-      return V1.u.PtrOrFd.idx < V2.u.PtrOrFd.idx;
+    if(V1.getIdxFrame() == V2.getIdxFrame())
+      return V1.getIdx() < V2.getIdx();
     else
-      return V1.u.PtrOrFd.frame < V2.u.PtrOrFd.frame;
+      return V1.getIdxFrame() < V2.getIdxFrame();
   case SHADOWVAL_CI8:
   case SHADOWVAL_CI16:
   case SHADOWVAL_CI32:
   case SHADOWVAL_CI64:
-    return V1.u.CI < V2.u.CI;
+    return V1.getCIValue() < V2.getCIValue();
   default:
     release_assert(0 && "Bad SV type");
     return false;
@@ -323,47 +417,19 @@ inline bool operator>=(ShadowValue V1, ShadowValue V2) {
 
 // Characteristics for using ShadowValues in hashsets (DenseSet, or as keys in DenseMaps)
 template<> struct DenseMapInfo<ShadowValue> {
-  
-  typedef DenseMapInfo<int> TypeInfo;
-  typedef DenseMapInfo<void*> VoidInfo;
-  typedef DenseMapInfo<std::pair<int, void*> > PairInfo;
 
   static inline ShadowValue getEmptyKey() {
-    return ShadowValue((Value*)VoidInfo::getEmptyKey());
+    return ShadowValue::fromRaw(ShadowValue::makeImm(SVIMM_EMPTYKEY, 0));
   }
 
   static inline ShadowValue getTombstoneKey() {
-    return ShadowValue((Value*)VoidInfo::getTombstoneKey());
+    return ShadowValue::fromRaw(ShadowValue::makeImm(SVIMM_TOMBSTONEKEY, 0));
   }
 
   static unsigned getHashValue(const ShadowValue& V) {
-    void* hashPtr;
-    switch(V.t) {
-    case SHADOWVAL_INVAL:
-      hashPtr = 0; break;
-    case SHADOWVAL_ARG:
-      hashPtr = V.u.A; break;
-    case SHADOWVAL_INST:
-      hashPtr = V.u.I; break;
-    case SHADOWVAL_GV:
-      hashPtr = V.u.GV; break;
-    case SHADOWVAL_OTHER:
-      hashPtr = V.u.V; break;
-    case SHADOWVAL_PTRIDX:
-    case SHADOWVAL_FDIDX:
-    case SHADOWVAL_FDIDX64:
-      // Should work due to the union.
-      hashPtr = V.u.V; break;
-    case SHADOWVAL_CI8:
-    case SHADOWVAL_CI16:
-    case SHADOWVAL_CI32:
-    case SHADOWVAL_CI64:
-      hashPtr = (void*)V.u.CI; break;
-    default:
-      release_assert(0 && "Bad value type");
-      hashPtr = 0;
-    }
-    return PairInfo::getHashValue(std::make_pair((int)V.t, hashPtr));
+    // Mix the high bits down: pointer encodings share their low bits.
+    uint64_t h = V.raw * 0x9E3779B97F4A7C15ULL;
+    return (unsigned)(h >> 32);
   }
 
   static bool isEqual(const ShadowValue& V1, const ShadowValue& V2) {
@@ -379,7 +445,12 @@ template<> struct DenseMapInfo<ShadowValue> {
 // undefined (implied by absence from map)
 // Note Value members may be null (signifying a null pointer) without being Overdef.
 
-#define PBMAX 16
+// Maximum set size before overdefining; set by -int-max-set-size and overridden
+// per function by -int-max-set-size-fn while that function's contexts are analysed.
+extern uint32_t PBMax;
+extern Function* PBMaxFunction;
+void noteSetOverflow();
+void noteSetWidening();
 
 bool functionIsBlacklisted(Function*);
 
@@ -497,14 +568,17 @@ struct ImprovedValSetSingle : public ImprovedValSet {
 
   static bool classof(const ImprovedValSet* IVS) { return !IVS->isMulti; }
 
+  // Overdef and SetType are declared first so they pack into the base class' tail padding
+  // beside isMulti, keeping the whole object (vtable, flags and one inline value) within
+  // 64 bytes.
+  bool Overdef;
   ValSetType SetType;
   SmallVector<ImprovedVal, 1> Values;
-  bool Overdef;
 
- ImprovedValSetSingle() : ImprovedValSet(false), SetType(ValSetTypeUnknown), Overdef(false) { }
- ImprovedValSetSingle(ValSetType T) : ImprovedValSet(false), SetType(T), Overdef(false) { }
- ImprovedValSetSingle(ValSetType T, bool OD) : ImprovedValSet(false), SetType(T), Overdef(OD) { }
- ImprovedValSetSingle(ImprovedVal V, ValSetType T) : ImprovedValSet(false), SetType(T), Overdef(false) {
+ ImprovedValSetSingle() : ImprovedValSet(false), Overdef(false), SetType(ValSetTypeUnknown) { }
+ ImprovedValSetSingle(ValSetType T) : ImprovedValSet(false), Overdef(false), SetType(T) { }
+ ImprovedValSetSingle(ValSetType T, bool OD) : ImprovedValSet(false), Overdef(OD), SetType(T) { }
+ ImprovedValSetSingle(ImprovedVal V, ValSetType T) : ImprovedValSet(false), Overdef(false), SetType(T) {
     Values.push_back(V);
   }
 
@@ -572,7 +646,7 @@ struct ImprovedValSetSingle : public ImprovedValSet {
 
   ImprovedValSetSingle& insert(ImprovedVal V) {
 
-    release_assert(V.V.t != SHADOWVAL_INVAL);
+    release_assert(V.V.getValType() != SHADOWVAL_INVAL);
 
     if(Overdef)
       return *this;
@@ -583,8 +657,11 @@ struct ImprovedValSetSingle : public ImprovedValSet {
 
 	if(it->V == V.V) {
 
-	  if(it->Offset != V.Offset)
+	  // Widen to "any pointer into this object" rather than listing offsets.
+	  if(it->Offset != V.Offset && it->Offset != LLONG_MAX) {
 	    it->Offset = LLONG_MAX;
+	    noteSetWidening();
+	  }
 	  return *this;
 
 	}
@@ -601,8 +678,10 @@ struct ImprovedValSetSingle : public ImprovedValSet {
 
     Values.push_back(V);
 
-    if(Values.size() > PBMAX)
+    if(Values.size() > PBMax) {
+      noteSetOverflow();
       setOverdef();
+    }
     
     return *this;
 
@@ -775,6 +854,14 @@ struct HalfOpenWithMerge {
 
 };
 
+// Multis in the store are already persistent: a partial write to a shared Multi does not copy
+// its Map but allocates a fresh, empty Multi with the shared one as Underlying
+// (see ShadowBB::getWritableStoreFor), so a write after a fork costs one IntervalMap insert.
+// LocStore::simplifyStore folds an overlay back into its base once neither is shared,
+// which keeps the read-side walk down the Underlying chain short, and flattens chains of
+// shared layers that grow past -int-flatten-store-depth anyway.
+// The copy constructor's deep copy is only used for instruction and argument values,
+// which are owned outright (deleteIV) rather than refcounted and so cannot share a base.
 struct ImprovedValSetMulti : public ImprovedValSet {
 
   typedef IntervalMap<uint64_t, ImprovedValSetSingle, IntervalMapImpl::NodeSizer<uint64_t, ImprovedValSetSingle>::LeafSize, HalfOpenNoMerge> MapTy;
@@ -835,6 +922,9 @@ class ShadowBBInvar;
 struct ShadowInstructionInvar {
   
   uint32_t idx;
+  // Side-effect free, and all operands are defined outside the block's natural loop
+  // or are themselves loop invariant: the value is the same in every iteration.
+  bool loopInvariant;
   Instruction* I;
   ShadowBBInvar* parent;
   ImmutableArray<ShadowInstIdx> operandIdxs;
@@ -858,6 +948,9 @@ template<class X> inline X* cast_inst(ShadowInstructionInvar* SII) {
 #define INSTSTATUS_ALIVE 0
 #define INSTSTATUS_DEAD 1
 #define INSTSTATUS_UNUSED_WRITER 2
+// An allocation eliminated along with every instruction that used it, and those users;
+// also a promoted allocation's frees, and a global one's folded writes.
+#define INSTSTATUS_DEAD_OBJECT 4
 
 struct InstArgImprovement {
 
@@ -902,7 +995,14 @@ LocStore(const LocStore& other) : store(other.store) {}
     
   }
 
+  static uintptr_t getHash(const LocStore* a) {
+
+    return (uintptr_t)a->store;
+
+  }
+
   static LocalStoreMap<LocStore, OrdinaryStoreExtraState>* getMapForBlock(ShadowBB*);
+  static bool blockStoreFolded(ShadowBB*);
 
   bool isValid() { return !!store; }
 
@@ -940,9 +1040,21 @@ struct AllocData {
   AllocTestedState allocTested;
   bool isCommitted;
   ShadowValue allocValue;
-  std::vector<std::pair<WeakVH, uint32_t> > PatchRefs;
+  std::vector<uint32_t> PatchRefs;
   Type* allocType;
   Value* committedVal;
+  // A heap allocation to be committed as an alloca in its function's entry block, or
+  // already committed as a constant global (see tryPromoteObjectToStack / ToGlobal).
+  bool stackPromoted;
+  bool globalPromoted;
+  // Carved from an arena, and so listed in LLPEAnalysisPass::arenaObjects.
+  bool arenaMember;
+  // Made by an allocator that never returns null, so null tests need no runtime check.
+  bool neverNull;
+  // Bumped each time the slot is recycled; a slot waiting in freeHeapSlots is marked
+  // free, so a pointer that outlived its allocation trips over it.
+  uint32_t generation;
+  bool isFree;
 
   bool isAvailable();
 
@@ -961,16 +1073,31 @@ enum ThreadLocalState {
 #define RUNTIME_CHECK_READ_LLIOWD 2
 #define RUNTIME_CHECK_READ_MEMCMP 3
 
+// Bits of ShadowInstruction::sideTables, one per InstSideTable in LLPEAnalysisPass.
+#define SIDETABLE_TRACKEDSTORE 1
+#define SIDETABLE_TRACKEDALLOC 2
+#define SIDETABLE_MEMCPYVALUES 4
+#define SIDETABLE_OPENCALL 8
+#define SIDETABLE_READCALL 16
+#define SIDETABLE_SEEKCALL 32
+#define SIDETABLE_SEEKFIXUPS 64
+#define SIDETABLE_CALLSEEKFIXUPS 128
+
 struct ShadowInstruction {
 
-  ShadowBB* parent;
-  ShadowInstructionInvar* invar;
+  // Fields read by whole-block scans (DIE, tentative load counting, commit) come first
+  // so that such a scan touches only the leading 16 bytes of each instruction.
   InstArgImprovement i;
-  Value* committedVal;
   // Of a load, memcpy or realloc, is there no need to check for thread interference?
   unsigned char isThreadLocal;
   unsigned char needsRuntimeCheck;
   unsigned char dieStatus;
+  // Which of the pass's per-instruction side tables hold an entry for this instruction.
+  unsigned char sideTables;
+
+  ShadowBB* parent;
+  ShadowInstructionInvar* invar;
+  Value* committedVal;
   void* typeSpecificData;
 
   void initTypeSpecificData();
@@ -1174,7 +1301,14 @@ DSEMapPointer(const DSEMapPointer& other) : M(other.M), A(other.A) {}
 
   }
 
+  static uintptr_t getHash(const DSEMapPointer* a) {
+
+    return (uintptr_t)a->M;
+
+  }
+
   static LocalStoreMap<DSEMapPointer, DSEStoreExtraState>* getMapForBlock(ShadowBB* BB);
+  static bool blockStoreFolded(ShadowBB* BB) { return false; }
   bool isValid() { return !!M; }
   void checkMergedResult() { }
   DSEMapPointer getReadableCopy();
@@ -1207,16 +1341,44 @@ struct DSEStoreExtraState {
 
 typedef IntervalMap<uint64_t, bool, IntervalMapImpl::NodeSizer<uint64_t, bool>::LeafSize, HalfOpenWithMerge> TLMapTy;
 
+// The bytes of an object that are known good (need no runtime check when read).
+// Most objects are small, so these are kept as a bitmap, one bit per byte, until a range
+// extends beyond TLBitmapBytes; then the set moves into an interval map for good.
+
+const uint64_t TLBitmapBytes = 4096;
+
+class TLGoodBytes {
+
+  SmallVector<uint64_t, 4> Bits;
+  TLMapTy* Ranges;
+
+  void toRanges();
+  TLGoodBytes& operator=(const TLGoodBytes&);
+
+public:
+
+  TLGoodBytes() : Ranges(0) {}
+  TLGoodBytes(const TLGoodBytes& Other);
+  ~TLGoodBytes();
+
+  void insert(uint64_t Start, uint64_t Stop);
+  bool covers(uint64_t Start, uint64_t Stop) const;
+  void intersect(const TLGoodBytes& Other);
+  void clear();
+  void getRanges(SmallVectorImpl<std::pair<uint64_t, uint64_t> >& Out) const;
+
+};
+
 class TLMapPointer;
 extern TLMapPointer TLEmptyMapPtr;
 class TLStoreExtraState;
 
 struct TLMapPointer {
 
-  TLMapTy* M;
+  TLGoodBytes* M;
 
 TLMapPointer() : M(0) {}
-TLMapPointer(TLMapTy* _M) : M(_M) {}
+TLMapPointer(TLGoodBytes* _M) : M(_M) {}
 TLMapPointer(const TLMapPointer& other) : M(other.M) {}
 
   static TLMapPointer& getEmptyStore() {
@@ -1237,7 +1399,14 @@ TLMapPointer(const TLMapPointer& other) : M(other.M) {}
 
   }
 
+  static uintptr_t getHash(const TLMapPointer* a) {
+
+    return (uintptr_t)a->M;
+
+  }
+
   static LocalStoreMap<TLMapPointer, TLStoreExtraState>* getMapForBlock(ShadowBB* BB);
+  static bool blockStoreFolded(ShadowBB* BB) { return false; }
   bool isValid() { return !!M; }
   void checkMergedResult() { }
   TLMapPointer getReadableCopy();
@@ -1265,22 +1434,107 @@ struct TLStoreExtraState {
 
 #include "SharedTree.h"
 
+// FD states refer to interned filenames, so that they are cheap to copy and compare.
+const std::string* internFilename(const std::string&);
+
 struct FDState {
 
-  std::string filename;
+  // Interned (see internFilename); null if the file is unknown.
+  const std::string* filename;
   uint64_t pos;
   bool clean;
+  // The real position lags pos: resolved reads or seeks have left their seek to
+  // the next instruction that uses the position for real (see flushSeek).
+  bool seekPending;
+
+FDState() : filename(0), pos((uint64_t)-1), clean(false), seekPending(false) {}
+FDState(const std::string& fn) : filename(internFilename(fn)), pos(0), clean(false), seekPending(false) {}
+
+  const std::string& getFilename() const;
+
+};
+
+#define FDSTOREPAGESIZE 32
+#define FDSTOREPAGESIZELOG2 5
+
+// A run of FDSTOREPAGESIZE descriptors' states, shared between FD stores as frame pages are
+// shared between store frames.
+struct FDStorePage {
+
+  FDState fds[FDSTOREPAGESIZE];
+  std::atomic<uint32_t> refCount;
+
+FDStorePage() : refCount(1) {}
+FDStorePage(const FDStorePage& Other) : refCount(1) { std::copy(Other.fds, Other.fds + FDSTOREPAGESIZE, fds); }
 
-FDState() : filename(""), pos((uint64_t)-1), clean(false) {}
-FDState(std::string fn) : filename(fn), pos(0), clean(false) {}
-FDState(const FDState& Other) : filename(Other.filename), pos(Other.pos), clean(Other.clean) {}
+  void dropReference() {
+
+    if(!(--refCount))
+      delete this;
+
+  }
 
 };
 
 struct FDStore {
 
-  uint32_t refCount;
-  std::vector<FDState> fds;
+  std::atomic<uint32_t> refCount;
+
+  // Descriptors are grouped into separately refcounted pages, so that a write to one
+  // descriptor of a shared store copies only its page, and merges skip pages that the
+  // incoming stores share. Slots past nFDs hold default states.
+  std::vector<FDStorePage*> pages;
+  uint32_t nFDs;
+
+  uint32_t size() const {
+    return nFDs;
+  }
+
+  const FDState& getFD(uint32_t i) const {
+    return pages[i >> FDSTOREPAGESIZELOG2]->fds[i & (FDSTOREPAGESIZE - 1)];
+  }
+
+  // This store must already be writable.
+  FDStorePage* getWritablePage(uint32_t pageIdx) {
+
+    FDStorePage* P = pages[pageIdx];
+    if(P->refCount == 1)
+      return P;
+
+    ++CoWFDPages;
+    FDStorePage* newPage = new FDStorePage(*P);
+    P->dropReference();
+    return pages[pageIdx] = newPage;
+
+  }
+
+  FDState& getWritableFD(uint32_t i) {
+    return getWritablePage(i >> FDSTOREPAGESIZELOG2)->fds[i & (FDSTOREPAGESIZE - 1)];
+  }
+
+  void resize(uint32_t newSize) {
+
+    uint32_t newPages = (newSize + (FDSTOREPAGESIZE - 1)) >> FDSTOREPAGESIZELOG2;
+
+    for(uint32_t i = newPages, ilim = pages.size(); i < ilim; ++i)
+      pages[i]->dropReference();
+
+    // Reset the tail of the last remaining page.
+    for(uint32_t i = newSize, ilim = std::min(nFDs, newPages << FDSTOREPAGESIZELOG2); i < ilim; ++i)
+      getWritableFD(i) = FDState();
+
+    for(uint32_t i = pages.size(); i < newPages; ++i)
+      pages.push_back(new FDStorePage());
+    pages.resize(newPages);
+    nFDs = newSize;
+
+  }
+
+  void clear() {
+
+    resize(0);
+
+  }
 
   void dropReference() {
 
@@ -1295,13 +1549,26 @@ struct FDStore {
       return this;
 
     release_assert(refCount);
-    refCount--;
-    return new FDStore(*this);
+    ++CoWFDStores;
+    FDStore* newStore = new FDStore(*this);
+    dropReference();
+    return newStore;
 
   }
   
-FDStore() : refCount(1), fds() {}
-FDStore(const FDStore& Other) : refCount(1), fds(Other.fds) {}
+FDStore() : refCount(1), pages(), nFDs(0) {}
+FDStore(const FDStore& Other) : refCount(1), pages(Other.pages), nFDs(Other.nFDs) {
+
+  for(std::vector<FDStorePage*>::iterator it = pages.begin(), itend = pages.end(); it != itend; ++it)
+    (*it)->refCount++;
+
+}
+  ~FDStore() {
+
+    for(std::vector<FDStorePage*>::iterator it = pages.begin(), itend = pages.end(); it != itend; ++it)
+      (*it)->dropReference();
+
+  }
 
 };
 
@@ -1310,7 +1577,7 @@ struct FDGlobalState {
   ShadowInstruction* SI;
   bool isCommitted;
   Value* CommittedVal;
-  std::vector<std::pair<WeakVH, uint32_t> > PatchRefs;
+  std::vector<uint32_t> PatchRefs;
   bool isFifo;
 
   FDGlobalState(ShadowInstruction* _SI, bool _isFifo);
@@ -1348,13 +1615,15 @@ struct ShadowBB {
   
   bool useSpecialVarargMerge;
   bool inAnyLoop;
+  // Set once this block's loop-exit localStore and fdStore references have been merged into the
+  // same block in the following iteration (see PeelAttempt::foldExitingStores).
+  bool exitStoresFolded;
 
-  ~ShadowBB() {
+  // insts and succsAlive belong to the owning context's BBAllocator.
 
-    delete[] &(insts[0]);
-    delete[] succsAlive;
-
-  }
+  // Write succsAlive through here, so the liveness caches of IA and its enclosing loops
+  // are kept up to date.
+  void setSuccAlive(uint32_t i, bool alive);
 
   bool edgeIsDead(ShadowBBInvar* BB2I) {
 
@@ -1430,9 +1699,17 @@ struct FDStoreMerger : public ShadowBBVisitor {
   FDStore* newStore;
 
   SmallVector<ShadowBB*, 4> incomingBlocks;
-  void visit(ShadowBB* BB, void* Ctx, bool mustCopyCtx) { incomingBlocks.push_back(BB); }
+  // If set, incoming blocks from other contexts (loop iterations exiting into it) bring
+  // pending seeks up to date rather than pass them on.
+  IntegrationAttempt* mergeIA;
+FDStoreMerger() : newStore(0), mergeIA(0) {}
+  void visit(ShadowBB* BB, void* Ctx, bool mustCopyCtx) {
+    if(!BB->exitStoresFolded)
+      incomingBlocks.push_back(BB);
+  }
   void doMerge();
   void merge2(FDStore* to, FDStore* from);
+  void flushSeeks(SmallVector<bool, 4>& keepPending);
 
 };
 
@@ -1442,6 +1719,12 @@ inline LocalStoreMap<LocStore, OrdinaryStoreExtraState>* LocStore::getMapForBloc
 
 }
 
+inline bool LocStore::blockStoreFolded(ShadowBB* BB) {
+
+  return BB->exitStoresFolded;
+
+}
+
 struct ShadowLoopInvar {
 
   uint32_t headerIdx;
@@ -1507,9 +1790,9 @@ extern Type* GInt64;
 
 inline const MDNode* ShadowValue::getTBAATag() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_INST:
-    return u.I->invar->I->getMetadata(LLVMContext::MD_tbaa);
+    return getInst()->invar->I->getMetadata(LLVMContext::MD_tbaa);
   default:
     return 0;
   }
@@ -1518,15 +1801,15 @@ inline const MDNode* ShadowValue::getTBAATag() const {
 
 inline Value* ShadowValue::getBareVal() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_ARG:
-    return u.A->invar->A;
+    return getArg()->invar->A;
   case SHADOWVAL_INST:
-    return u.I->invar->I;
+    return getInst()->invar->I;
   case SHADOWVAL_GV:
-    return u.GV->G;
+    return getGV()->G;
   case SHADOWVAL_OTHER:
-    return u.V;
+    return getVal();
   default:
     release_assert(0 && "Bad value type in getBareVal");
     llvm_unreachable("Bad value type in getBareVal");
@@ -1536,9 +1819,9 @@ inline Value* ShadowValue::getBareVal() const {
 
 inline const ShadowLoopInvar* ShadowValue::getScope() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_INST:
-    return u.I->invar->parent->outerScope;
+    return getInst()->invar->parent->outerScope;
   default:
     return 0;
   }
@@ -1547,9 +1830,9 @@ inline const ShadowLoopInvar* ShadowValue::getScope() const {
 
 inline const ShadowLoopInvar* ShadowValue::getNaturalScope() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_INST:
-    return u.I->invar->parent->naturalScope;
+    return getInst()->invar->parent->naturalScope;
   default:
     return 0;
   }
@@ -1566,11 +1849,11 @@ inline bool ShadowValue::isIDObject() const {
 
 inline InstArgImprovement* ShadowValue::getIAI() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_INST:
-    return &(u.I->i);
+    return &(getInst()->i);
   case SHADOWVAL_ARG:
-    return &(u.A->i);      
+    return &(getArg()->i);      
   default:
     return 0;
   }
@@ -1578,13 +1861,13 @@ inline InstArgImprovement* ShadowValue::getIAI() const {
 }
 
 inline LLVMContext& ShadowValue::getLLVMContext() const {
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_INST:
-    return u.I->invar->I->getContext();
+    return getInst()->invar->I->getContext();
   case SHADOWVAL_ARG:
-    return u.A->invar->A->getContext();
+    return getArg()->invar->A->getContext();
   case SHADOWVAL_GV:
-    return u.GV->G->getContext();
+    return getGV()->G->getContext();
   case SHADOWVAL_PTRIDX:
   case SHADOWVAL_FDIDX:
   case SHADOWVAL_FDIDX64:
@@ -1595,17 +1878,17 @@ inline LLVMContext& ShadowValue::getLLVMContext() const {
   case SHADOWVAL_CI64:
     return GInt8->getContext();
   default:
-    return u.V->getContext();
+    return getVal()->getContext();
   }
 }
 
 inline void ShadowValue::setCommittedVal(Value* V) {
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_INST:
-    u.I->committedVal = V;
+    getInst()->committedVal = V;
     break;
   case SHADOWVAL_ARG:
-    u.A->committedVal = V;
+    getArg()->committedVal = V;
     break;
   default:
     release_assert(0 && "Can't replace a value");
@@ -1613,17 +1896,17 @@ inline void ShadowValue::setCommittedVal(Value* V) {
 }
 
 template<class X> inline bool val_is(ShadowValue V) {
-  switch(V.t) {
+  switch(V.getValType()) {
   case SHADOWVAL_OTHER:
-    return isa<X>(V.u.V);
+    return isa<X>(V.getVal());
   case SHADOWVAL_GV:
-    return isa<X>(V.u.GV->G);
+    return isa<X>(V.getGV()->G);
   case SHADOWVAL_INST:
-    return inst_is<X>(V.u.I);
+    return inst_is<X>(V.getInst());
   case SHADOWVAL_ARG: {
-    if(!V.u.A->invar)
+    if(!V.getArg()->invar)
       return false;
-    return isa<X>(V.u.A->invar->A);
+    return isa<X>(V.getArg()->invar->A);
   }
   default:
     release_assert(0 && "Bad value type in val_is");
@@ -1632,15 +1915,15 @@ template<class X> inline bool val_is(ShadowValue V) {
 }
 
 template<class X> inline X* dyn_cast_val(ShadowValue V) {
-  switch(V.t) {
+  switch(V.getValType()) {
   case SHADOWVAL_OTHER:
-    return dyn_cast<X>(V.u.V);
+    return dyn_cast<X>(V.getVal());
   case SHADOWVAL_GV:
-    return dyn_cast<X>(V.u.GV->G);
+    return dyn_cast<X>(V.getGV()->G);
   case SHADOWVAL_ARG:
-    return dyn_cast<X>(V.u.A->invar->A);
+    return dyn_cast<X>(V.getArg()->invar->A);
   case SHADOWVAL_INST:
-    return dyn_cast_inst<X>(V.u.I);
+    return dyn_cast_inst<X>(V.getInst());
   default:
     release_assert(0 && "Bad value type in dyn_cast_val");
     llvm_unreachable("Bad value type in dyn_cast_val");
@@ -1648,15 +1931,15 @@ template<class X> inline X* dyn_cast_val(ShadowValue V) {
 }
 
 template<class X> inline X* cast_val(ShadowValue V) {
-  switch(V.t) {
+  switch(V.getValType()) {
   case SHADOWVAL_OTHER:
-    return cast<X>(V.u.V);
+    return cast<X>(V.getVal());
   case SHADOWVAL_GV:
-    return cast<X>(V.u.GV->G);
+    return cast<X>(V.getGV()->G);
   case SHADOWVAL_ARG:
-    return cast<X>(V.u.A->invar->A);
+    return cast<X>(V.getArg()->invar->A);
   case SHADOWVAL_INST:
-    return cast_inst<X>(V.u.I);
+    return cast_inst<X>(V.getInst());
   default:
     release_assert(0 && "Cast of bad SV");
     llvm_unreachable("Cast of bad SV");
@@ -1666,14 +1949,14 @@ template<class X> inline X* cast_val(ShadowValue V) {
 static Constant* CIToConst(const ShadowValue V) {
 
   Type* CITy = V.getNonPointerType();
-  return ConstantInt::get(CITy, V.u.CI, true);
+  return ConstantInt::get(CITy, V.getCIValue(), true);
 
 }
 
 inline Constant* getSingleConstant(const ShadowValue V) {
 
-  if(V.t == SHADOWVAL_OTHER)
-    return cast<Constant>(V.u.V);  
+  if(V.getValType() == SHADOWVAL_OTHER)
+    return cast<Constant>(V.getVal());  
   else if(V.isConstantInt())
     return CIToConst(V);
   else {
@@ -1738,7 +2021,7 @@ inline ImprovedValSet* getIVSRef(ShadowValue V);
 
 inline bool hasConstReplacement(const ShadowValue SV) {
 
-  switch(SV.t) {
+  switch(SV.getValType()) {
 
   case SHADOWVAL_ARG:
   case SHADOWVAL_INST: 
@@ -1766,7 +2049,7 @@ inline bool hasConstReplacement(const ShadowValue SV) {
 
 inline Constant* getConstReplacement(ShadowValue SV) {
 
-  switch(SV.t) {
+  switch(SV.getValType()) {
 
   case SHADOWVAL_ARG:
   case SHADOWVAL_INST: 
@@ -1807,7 +2090,7 @@ inline bool tryGetConstantSignedInt(ShadowValue SV, int64_t& Out) {
     return true;
 
   ConstantInt* CI;
-  if(SV.isVal() && (CI = dyn_cast<ConstantInt>(SV.u.V))) {
+  if(SV.isVal() && (CI = dyn_cast<ConstantInt>(SV.getVal()))) {
 
     if(CI->getBitWidth() > 64)
       return false;
@@ -1826,7 +2109,7 @@ inline bool tryGetConstantInt(ShadowValue SV, uint64_t& Out) {
     return true;
 
   ConstantInt* CI;
-  if(SV.isVal() && (CI = dyn_cast<ConstantInt>(SV.u.V))) {
+  if(SV.isVal() && (CI = dyn_cast<ConstantInt>(SV.getVal()))) {
 
     if(CI->getBitWidth() > 64)
       return false;
@@ -1844,7 +2127,7 @@ inline bool tryGetConstantIntReplacement(ShadowValue SV, uint64_t& Out) {
   if(tryGetConstantInt(SV, Out))
     return true;
 
-  switch(SV.t) {
+  switch(SV.getValType()) {
 
   case SHADOWVAL_ARG:
   case SHADOWVAL_INST: 
@@ -1867,7 +2150,7 @@ inline void getIVOrSingleVal(ShadowValue V, ImprovedValSet*& IVS, std::pair<ValS
 
   IVS = 0;
 
-  switch(V.t) {
+  switch(V.getValType()) {
 
   case SHADOWVAL_INST:
   case SHADOWVAL_ARG:
@@ -1877,7 +2160,7 @@ inline void getIVOrSingleVal(ShadowValue V, ImprovedValSet*& IVS, std::pair<ValS
     Single = std::make_pair(ValSetTypePB, ImprovedVal(V, 0));
     break;
   case SHADOWVAL_OTHER:
-    Single = getValPB(V.u.V);
+    Single = getValPB(V.getVal());
     break;
   case SHADOWVAL_CI8:
   case SHADOWVAL_CI16:
@@ -1944,7 +2227,7 @@ inline bool IVMatchesVal(ShadowValue V, ImprovedValSet* IV) {
 
 inline bool getImprovedValSetSingle(ShadowValue V, ImprovedValSetSingle& OutPB) {
 
-  switch(V.t) {
+  switch(V.getValType()) {
 
   case SHADOWVAL_INST:
   case SHADOWVAL_ARG:
@@ -1991,11 +2274,11 @@ inline bool getImprovedValSetSingle(ShadowValue V, ImprovedValSetSingle& OutPB)
 
 inline ImprovedValSet* tryGetIVSRef(ShadowValue V) {
 
-  switch(V.t) {
+  switch(V.getValType()) {
   case SHADOWVAL_INST:
-    return V.u.I->i.PB;
+    return V.getInst()->i.PB;
   case SHADOWVAL_ARG:
-    return V.u.A->i.PB;    
+    return V.getArg()->i.PB;    
   default:
     return 0;
   }
@@ -2004,7 +2287,7 @@ inline ImprovedValSet* tryGetIVSRef(ShadowValue V) {
 
 inline ImprovedValSet* getIVSRef(ShadowValue V) {
 
-  release_assert((V.t == SHADOWVAL_INST || V.t == SHADOWVAL_ARG) 
+  release_assert((V.getValType() == SHADOWVAL_INST || V.getValType() == SHADOWVAL_ARG) 
 		 && "getIVSRef only applicable to instructions and arguments");
   
   return tryGetIVSRef(V);
@@ -2014,7 +2297,7 @@ inline ImprovedValSet* getIVSRef(ShadowValue V) {
 // V must have an IVS.
 inline void addValToPB(ShadowValue& V, ImprovedValSetSingle& ResultPB) {
 
-  switch(V.t) {
+  switch(V.getValType()) {
 
   case SHADOWVAL_INST:
   case SHADOWVAL_ARG:
@@ -2053,11 +2336,7 @@ inline void addValToPB(ShadowValue& V, ImprovedValSetSingle& ResultPB) {
 
 }
 
-inline bool getBaseAndOffset(ShadowValue SV, ShadowValue& Base, int64_t& Offset, bool ignoreNull = false) {
-
-  ImprovedValSetSingle SVPB;
-  if(!getImprovedValSetSingle(SV, SVPB))
-    return false;
+inline bool getBaseAndOffset(const ImprovedValSetSingle& SVPB, ShadowValue& Base, int64_t& Offset, bool ignoreNull) {
 
   if(SVPB.SetType != ValSetTypePB || SVPB.Overdef || SVPB.Values.size() == 0)
     return false;
@@ -2098,6 +2377,34 @@ inline bool getBaseAndOffset(ShadowValue SV, ShadowValue& Base, int64_t& Offset,
 
 }
 
+inline bool getBaseAndOffset(ShadowValue SV, ShadowValue& Base, int64_t& Offset, bool ignoreNull = false) {
+
+  // Instructions' and arguments' sets are read where they are rather than copied out, as
+  // string scans and pointer comparisons decompose the same pointers again and again.
+  ImprovedValSet* IV;
+  std::pair<ValSetType, ImprovedVal> Single;
+  getIVOrSingleVal(SV, IV, Single);
+
+  if(SV.isInst() || SV.isArg()) {
+
+    ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(IV);
+    if(!IVS)
+      return false;
+    return getBaseAndOffset(*IVS, Base, Offset, ignoreNull);
+
+  }
+
+  if(Single.first != ValSetTypePB)
+    return false;
+  if(ignoreNull && Single.second.V.isVal() && isa<ConstantPointerNull>(Single.second.V.getVal()))
+    return false;
+
+  Base = Single.second.V;
+  Offset = Single.second.Offset;
+  return true;
+
+}
+
 inline bool getBaseObject(ShadowValue SV, ShadowValue& Base) {
 
   int64_t ign;
@@ -2135,11 +2442,11 @@ inline bool mayBeReplaced(ShadowArg* SA) {
 
 inline bool mayBeReplaced(ShadowValue SV) {
 
-  switch(SV.t) {
+  switch(SV.getValType()) {
   case SHADOWVAL_INST:
-    return mayBeReplaced(SV.u.I);
+    return mayBeReplaced(SV.getInst());
   case SHADOWVAL_ARG:
-    return mayBeReplaced(SV.u.A);
+    return mayBeReplaced(SV.getArg());
   default:
     return false;
   }
@@ -2177,14 +2484,14 @@ inline void setReplacement(ShadowArg* SA, Constant* C) {
 
 inline ShadowValue ShadowValue::stripPointerCasts() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_ARG:
   case SHADOWVAL_GV:
     return *this;
   case SHADOWVAL_INST:
 
-    if(inst_is<CastInst>(u.I)) {
-      ShadowValue Op = u.I->getOperand(0);
+    if(inst_is<CastInst>(getInst())) {
+      ShadowValue Op = getInst()->getOperand(0);
       return Op.stripPointerCasts();
     }
     else {
@@ -2192,7 +2499,7 @@ inline ShadowValue ShadowValue::stripPointerCasts() const {
     }
 
   case SHADOWVAL_OTHER:
-    return u.V->stripPointerCasts();
+    return getVal()->stripPointerCasts();
   default:
     release_assert(0 && "Bad val type in stripPointerCasts");
     llvm_unreachable("Bad val type in stripPointerCasts");
@@ -2202,9 +2509,9 @@ inline ShadowValue ShadowValue::stripPointerCasts() const {
 
 inline bool ShadowValue::isNullOrConst() const {
 
-  if(t == SHADOWVAL_GV)
-    return u.GV->G->isConstant();
-  else if(t == SHADOWVAL_PTRIDX)
+  if(getValType() == SHADOWVAL_GV)
+    return getGV()->G->isConstant();
+  else if(getValType() == SHADOWVAL_PTRIDX)
     return false;
 
   return isa<ConstantPointerNull>(getBareVal());
@@ -2213,9 +2520,9 @@ inline bool ShadowValue::isNullOrConst() const {
 
 inline bool ShadowValue::isNullPointer() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_OTHER:
-    return isa<ConstantPointerNull>(u.V);
+    return isa<ConstantPointerNull>(getVal());
   default:
     return false;
   }
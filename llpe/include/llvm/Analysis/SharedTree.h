@@ -13,20 +13,67 @@
 #define LFV3(x) do {} while(0)
 //#define LFV3(x) x
 
+// Reference counts on shared store components are atomic, as groundwork for
+// sharing maps between analysis threads; nothing touches stores concurrently yet.
+// A holder that sees a count of 1 is the only owner and may write in place;
+// otherwise it copies the object and only then drops its own reference, freeing
+// the original if every other holder let go in the meantime. That tolerates other
+// holders dropping references concurrently, but not two holders breaking the same
+// object at once, which would need a lock.
+typedef std::atomic<uint32_t> StoreRefCount;
+
 template<class, class> class MergeBlockVisitor;
 
 template<class ChildType, class ExtraState> struct SharedTreeNode {
 
-  // These point to SharedTreeNodes or ChildTypes if this is the bottom layer.
-  void* children[HEAPTREEORDER];
-  int refCount;
+  // Children are stored densely: bit i of childMask is set iff child i exists, in which case it is
+  // children[popcount(childMask & ((1 << i) - 1))]. Heap trees are sparse away from the low indices,
+  // so this saves most of the 16 pointer slots per node, and walks visit only live children.
+  // The pointees are SharedTreeNodes, or ChildTypes if this is the bottom layer.
+  void** children;
+  // Structural hash of this subtree, or 0 if not yet computed. Reset whenever the node is written,
+  // which only happens while it is unshared, so shared subtrees keep theirs.
+  uint32_t cachedHash;
+  uint16_t childMask;
+  StoreRefCount refCount;
 
-SharedTreeNode() : refCount(1) {
+SharedTreeNode() : children(0), cachedHash(0), childMask(0), refCount(1) { }
 
-  memset(children, 0, sizeof(void*) * HEAPTREEORDER);
+  ~SharedTreeNode() {
 
-}
+    free(children);
+
+  }
+
+  bool hasChild(uint32_t i) const {
+    return !!(childMask & (1U << i));
+  }
+
+  uint32_t getChildSlot(uint32_t i) const {
+    return __builtin_popcount(childMask & ((1U << i) - 1));
+  }
+
+  uint32_t getNumChildren() const {
+    return __builtin_popcount(childMask);
+  }
+
+  void* getChild(uint32_t i) const {
+    return hasChild(i) ? children[getChildSlot(i)] : 0;
+  }
+
+  // Only valid until the next setChild call.
+  void** getChildPtr(uint32_t i) {
+    return hasChild(i) ? &(children[getChildSlot(i)]) : 0;
+  }
 
+  // The children array's capacity is always getNumChildren() rounded up to a power of two.
+  static uint32_t getChildCapacity(uint32_t n) {
+    return (n & (n - 1)) ? (1U << (32 - __builtin_clz(n))) : n;
+  }
+
+  void setChild(uint32_t i, void* child);
+  uint32_t getHash(uint32_t height);
+  bool structurallyEqual(SharedTreeNode* other, uint32_t height);
   void dropReference(uint32_t idx, uint32_t height, std::vector<ShadowValue>* simplified);
   ChildType* getReadableStoreFor(uint32_t idx, uint32_t height);
   ChildType* getOrCreateStoreFor(uint32_t idx, uint32_t height, bool* isNewStore);
@@ -36,6 +83,93 @@ SharedTreeNode() : refCount(1) {
 
 };
 
+// Set, replace or (if child is null) remove child i.
+template<class ChildType, class ExtraState> 
+void SharedTreeNode<ChildType, ExtraState>::setChild(uint32_t i, void* child) {
+
+  uint32_t slot = getChildSlot(i);
+  uint32_t n = getNumChildren();
+
+  cachedHash = 0;
+
+  if(hasChild(i)) {
+
+    if(child)
+      children[slot] = child;
+    else {
+      memmove(&(children[slot]), &(children[slot + 1]), sizeof(void*) * (n - (slot + 1)));
+      childMask &= ~(1U << i);
+    }
+
+  }
+  else if(child) {
+
+    // Full to a power of two?
+    if(!(n & (n - 1)))
+      children = (void**)realloc(children, sizeof(void*) * (n ? n * 2 : 1));
+
+    memmove(&(children[slot + 1]), &(children[slot]), sizeof(void*) * (n - slot));
+    children[slot] = child;
+    childMask |= (1U << i);
+
+  }
+
+}
+
+template<class ChildType, class ExtraState> 
+uint32_t SharedTreeNode<ChildType, ExtraState>::getHash(uint32_t height) {
+
+  if(cachedHash)
+    return cachedHash;
+
+  size_t H = hash_combine(childMask, height);
+
+  for(uint32_t slot = 0, slotlim = getNumChildren(); slot != slotlim; ++slot) {
+
+    if(height == 0)
+      H = hash_combine(H, ChildType::getHash((ChildType*)children[slot]));
+    else
+      H = hash_combine(H, ((SharedTreeNode*)children[slot])->getHash(height - 1));
+
+  }
+
+  cachedHash = (uint32_t)H;
+  // 0 means not computed.
+  if(!cachedHash)
+    cachedHash = 1;
+
+  return cachedHash;
+
+}
+
+// Do this and other describe the same stores, though they might not share every node?
+// The hashes make the common unequal case cheap.
+template<class ChildType, class ExtraState> 
+bool SharedTreeNode<ChildType, ExtraState>::structurallyEqual(SharedTreeNode* other, uint32_t height) {
+
+  if(this == other)
+    return true;
+
+  if(childMask != other->childMask || getHash(height) != other->getHash(height))
+    return false;
+
+  for(uint32_t slot = 0, slotlim = getNumChildren(); slot != slotlim; ++slot) {
+
+    if(height == 0) {
+      if(!ChildType::EQ((ChildType*)children[slot], (ChildType*)other->children[slot]))
+	return false;
+    }
+    else {
+      if(!((SharedTreeNode*)children[slot])->structurallyEqual((SharedTreeNode*)other->children[slot], height - 1))
+	return false;
+    }
+
+  }
+
+  return true;
+
+}
+
 template<class ChildType, class ExtraState> 
 void SharedTreeNode<ChildType, ExtraState>::dropReference(uint32_t idx, uint32_t height, std::vector<ShadowValue>* simplified) {
 
@@ -46,27 +180,26 @@ void SharedTreeNode<ChildType, ExtraState>::dropReference(uint32_t idx, uint32_t
     // This node goes away! Drop our children.
     if(height == 0) {
 
-      for(uint32_t i = 0; i < HEAPTREEORDER; ++i) {
-	if(children[i]) {
+      for(uint32_t mask = childMask, slot = 0; mask; mask &= (mask - 1), ++slot) {
 
-	  ChildType* child = ((ChildType*)children[i]);
+	uint32_t i = __builtin_ctz(mask);
+	ChildType* child = ((ChildType*)children[slot]);
 	  
-	  if(simplified && child->derefWillAllowSimplify())
-	    simplified->push_back(ShadowValue::getPtrIdx(-1, idx + i));
+	if(simplified && child->derefWillAllowSimplify())
+	  simplified->push_back(ShadowValue::getPtrIdx(-1, idx + i));
 
-	  child->dropReference();
-	  delete child;
+	child->dropReference();
+	delete child;
 
-	}
       }
 
     }
     else {
 
-      for(uint32_t i = 0; i < HEAPTREEORDER; ++i) {
-	if(children[i])
-	  ((SharedTreeNode*)children[i])->dropReference(idx + (i << (height * HEAPTREEORDERLOG2)), 
-							height - 1, simplified);
+      for(uint32_t mask = childMask, slot = 0; mask; mask &= (mask - 1), ++slot) {
+	uint32_t i = __builtin_ctz(mask);
+	((SharedTreeNode*)children[slot])->dropReference(idx + (i << (height * HEAPTREEORDERLOG2)), 
+							  height - 1, simplified);
       }
 
     }
@@ -82,19 +215,21 @@ ChildType* SharedTreeNode<ChildType, ExtraState>::getReadableStoreFor(uint32_t i
 
   uint32_t nextChild = (idx >> (height * HEAPTREEORDERLOG2)) & (HEAPTREEORDER-1);
 
-  if(!children[nextChild])
+  if(!hasChild(nextChild))
     return 0;
 
+  void* child = children[getChildSlot(nextChild)];
+
   if(height == 0) {
 
     // Our children are leaves.
-    return (ChildType*)children[nextChild];
+    return (ChildType*)child;
 
   }
   else {
 
     // Walk further down the tree.
-    return ((SharedTreeNode*)children[nextChild])->getReadableStoreFor(idx, height - 1);
+    return ((SharedTreeNode*)child)->getReadableStoreFor(idx, height - 1);
 
   }
 
@@ -103,28 +238,32 @@ ChildType* SharedTreeNode<ChildType, ExtraState>::getReadableStoreFor(uint32_t i
 template<class ChildType, class ExtraState> ChildType* 
 SharedTreeNode<ChildType, ExtraState>::getOrCreateStoreFor(uint32_t idx, uint32_t height, bool* isNewStore) {
 
-  // This node already known writable.
+  // This node already known writable. The caller is about to write the store we return.
+  cachedHash = 0;
 
   uint32_t nextChild = (idx >> (height * HEAPTREEORDERLOG2)) & (HEAPTREEORDER-1);
   
   if(height == 0) {
     
-    bool mustCreate = *isNewStore = (children[nextChild] == 0);
-    if(mustCreate)
-      children[nextChild] = new ChildType();
-    return (ChildType*)children[nextChild];
+    bool mustCreate = *isNewStore = !hasChild(nextChild);
+    if(mustCreate) {
+      ChildType* newChild = new ChildType();
+      setChild(nextChild, newChild);
+      return newChild;
+    }
+    return (ChildType*)children[getChildSlot(nextChild)];
 
   }
   else {
 
     SharedTreeNode* child;
 
-    if(!children[nextChild])
+    if(!hasChild(nextChild))
       child = new SharedTreeNode();
     else
-      child = ((SharedTreeNode*)children[nextChild])->getWritableNode(height - 1);
+      child = ((SharedTreeNode*)children[getChildSlot(nextChild)])->getWritableNode(height - 1);
 
-    children[nextChild] = child;
+    setChild(nextChild, child);
     return child->getOrCreateStoreFor(idx, height - 1, isNewStore);
 
   }
@@ -138,33 +277,38 @@ SharedTreeNode<ChildType, ExtraState>::getWritableNode(uint32_t height) {
     return this;
 
   // COW break this node.
+  ++CoWTreeNodes;
   SharedTreeNode* newNode = new SharedTreeNode();
 
-  if(height == 0) {
+  uint32_t n = getNumChildren();
+  CoWNodeChildren.add(n);
+  newNode->childMask = childMask;
+  if(n)
+    newNode->children = (void**)malloc(sizeof(void*) * getChildCapacity(n));
 
-    for(uint32_t i = 0; i < HEAPTREEORDER; ++i) {
+  if(height == 0) {
 
-      if(children[i])
-	newNode->children[i] = new ChildType(((ChildType*)children[i])->getReadableCopy());
-      
-    }
+    for(uint32_t slot = 0; slot != n; ++slot)
+      newNode->children[slot] = new ChildType(((ChildType*)children[slot])->getReadableCopy());
 
   }
   else {
 
-    for(uint32_t i = 0; i < HEAPTREEORDER; ++i) {
+    for(uint32_t slot = 0; slot != n; ++slot) {
 
-      if(children[i]) {
-	((SharedTreeNode*)children[i])->refCount++;
-	newNode->children[i] = children[i];
-      }
+      ((SharedTreeNode*)children[slot])->refCount++;
+      newNode->children[slot] = children[slot];
 
     }
 
+    // Same subtrees, so same hash.
+    newNode->cachedHash = cachedHash;
+
   }
 
-  // Drop ref to this node.
-  --refCount;
+  // Drop ref to this node. Other holders may have dropped theirs since we
+  // checked, in which case we are the last and must free it.
+  dropReference(0, height, 0);
 
   return newNode;
 
@@ -230,24 +374,28 @@ void SharedTreeNode<ChildType, ExtraState>
   // if !allOthersClobbered; otherwise intersect the trees.
   // Note the special case that others might contain a null pointer, which describes the empty tree.
 
-  if(allOthersClobbered) {
+  cachedHash = 0;
 
-    for(uint32_t i = 0; i < HEAPTREEORDER; ++i) {
+  if(allOthersClobbered) {
 
-      for(typename SmallVector<SharedTreeNode<ChildType, ExtraState>*, 4>::iterator it = others.begin(), itend = others.end();
-	  it != itend && children[i]; ++it) {
+    // Keep only children present in every other tree.
+    uint32_t keepMask = childMask;
+    for(typename SmallVector<SharedTreeNode<ChildType, ExtraState>*, 4>::iterator it = others.begin(), itend = others.end();
+	it != itend && keepMask; ++it)
+      keepMask &= ((*it) ? (*it)->childMask : 0);
 
-	if((!*it) || !((*it)->children[i])) {
+    for(uint32_t mask = childMask & ~keepMask; mask; mask &= (mask - 1)) {
 
-	  if(height == 0)
-	    delete ((ChildType*)children[i]);
-	  else
-	    ((SharedTreeNode*)children[i])->dropReference(idx + i, height - 1, 0);
-	  children[i] = 0;
-
-	}
+      uint32_t i = __builtin_ctz(mask);
+      void* child = children[getChildSlot(i)];
 
+      if(height == 0) {
+	((ChildType*)child)->dropReference();
+	delete ((ChildType*)child);
       }
+      else
+	((SharedTreeNode*)child)->dropReference(idx + i, height - 1, 0);
+      setChild(i, 0);
 
     }
 
@@ -256,32 +404,34 @@ void SharedTreeNode<ChildType, ExtraState>
 
     // Populate this node with base versions of nodes that are missing but present in any other tree. 
     // Just add blank nodes for now and then the recursion will catch the rest.
-    for(uint32_t i = 0; i < HEAPTREEORDER; ++i) {
+    uint32_t othersMask = 0;
+    for(typename SmallVector<SharedTreeNode<ChildType, ExtraState>*, 4>::iterator it = others.begin(), 
+	  itend = others.end(); it != itend; ++it) {
 
-      for(typename SmallVector<SharedTreeNode<ChildType, ExtraState>*, 4>::iterator it = others.begin(), 
-	    itend = others.end(); it != itend && !children[i]; ++it) {
+      if(*it)
+	othersMask |= (*it)->childMask;
 
-	if((*it) && (*it)->children[i]) {
+    }
 
-	  if(height == 0)
-	    children[i] = new ChildType(ChildType::getEmptyStore().getReadableCopy());
-	  else
-	    children[i] = new SharedTreeNode();
+    for(uint32_t mask = othersMask & ~childMask; mask; mask &= (mask - 1)) {
 
-	}
+      uint32_t i = __builtin_ctz(mask);
 
-      }
+      if(height == 0)
+	setChild(i, new ChildType(ChildType::getEmptyStore().getReadableCopy()));
+      else
+	setChild(i, new SharedTreeNode());
 
     }
 
   }
 
   // OK now merge each child that exists according to the same rules.
+  // No children are added or removed from here on, so slot pointers remain valid.
 
-  for(uint32_t i = 0; i < HEAPTREEORDER; ++i) {
+  for(uint32_t mask = childMask, slot = 0; mask; mask &= (mask - 1), ++slot) {
 
-    if(!children[i])
-      continue;
+    uint32_t i = __builtin_ctz(mask);
 
     // Unique children regardless of whether they're further levels of TreeNode
     // or ChildTypes. In the former case this avoids merges of identical subtrees
@@ -290,15 +440,15 @@ void SharedTreeNode<ChildType, ExtraState>
     SmallVector<void**, 4> incomingPtrs;
     incomingPtrs.reserve(std::distance(others.begin(), others.end()) + 1);
 
-    incomingPtrs.push_back(&(children[i]));
+    incomingPtrs.push_back(&(children[slot]));
 
     for(typename SmallVector<SharedTreeNode<ChildType, ExtraState>*, 4>::iterator it = others.begin(), itend = others.end();
 	it != itend; ++it) {
 
-      if((!*it) || !(*it)->children[i])
+      if(!*it)
 	incomingPtrs.push_back(0);
       else
-	incomingPtrs.push_back(&((*it)->children[i]));
+	incomingPtrs.push_back((*it)->getChildPtr(i));
 
     }
 
@@ -314,7 +464,7 @@ void SharedTreeNode<ChildType, ExtraState>
       // Merge each child value.
       for(SmallVector<void**, 4>::iterator it = incomingPtrs.begin(); it != uniqend; ++it) {
 	
-	if(*it == &(children[i]))
+	if(*it == &(children[slot]))
 	  continue;
 
 	uint64_t ASize = getHeapAllocSize(ShadowValue::getPtrIdx(-1, idx + i));
@@ -326,8 +476,8 @@ void SharedTreeNode<ChildType, ExtraState>
 	  mergeFromStore = (ChildType*)(**it);
 
 	// mergeStores takes care of CoW break if necessary.
-	ChildType::mergeStores(mergeFromStore, (ChildType*)children[i], ASize, visitor);
-	((ChildType*)children[i])->checkMergedResult();
+	ChildType::mergeStores(mergeFromStore, (ChildType*)children[slot], ASize, visitor);
+	((ChildType*)children[slot])->checkMergedResult();
       
       }
 
@@ -341,9 +491,19 @@ void SharedTreeNode<ChildType, ExtraState>
       if(std::distance(incomingPtrs.begin(), uniqend) == 1)
 	continue;
 
+      // Distinct nodes describing the same stores (e.g. both sides of a diamond
+      // that wrote the same values) merge to themselves; skip the CoW break and descent.
+      SharedTreeNode* thisChild = (SharedTreeNode*)children[slot];
+      bool allEqual = true;
+      for(SmallVector<void**, 4>::iterator it = incomingPtrs.begin(); it != uniqend && allEqual; ++it)
+	allEqual = (*it) && thisChild->structurallyEqual((SharedTreeNode*)**it, height - 1);
+
+      if(allEqual)
+	continue;
+
       // Recursively merge this child.
       // CoW break this subtree if necessary.
-      children[i] = ((SharedTreeNode*)children[i])->getWritableNode(height - 1);
+      children[slot] = ((SharedTreeNode*)children[slot])->getWritableNode(height - 1);
 
       uint32_t newIdx = idx | (i << (HEAPTREEORDERLOG2 * height));
       SmallVector<SharedTreeNode*, 4> otherChildren;
@@ -357,7 +517,7 @@ void SharedTreeNode<ChildType, ExtraState>
 
       }
 
-      ((SharedTreeNode*)children[i])->mergeHeaps(otherChildren, allOthersClobbered, height - 1, newIdx, visitor);
+      ((SharedTreeNode*)children[slot])->mergeHeaps(otherChildren, allOthersClobbered, height - 1, newIdx, visitor);
 
     }
 
@@ -371,23 +531,21 @@ template<class ChildType, class ExtraState> void SharedTreeNode<ChildType, Extra
 
   if(height == 0) {
     
-    for(uint32_t i = 0; i < HEAPTREEORDER; ++i) {
-      if(!children[i])
-	continue;
+    for(uint32_t mask = childMask, slot = 0; mask; mask &= (mask - 1), ++slot) {
+      uint32_t i = __builtin_ctz(mask);
       printSV(RSO, getAllocWithIdx(idx + i));
       RSO << ": ";
-      ((ChildType*)children[i])->print(RSO, brief);
+      ((ChildType*)children[slot])->print(RSO, brief);
       RSO << "\n";
     }
 
   }
   else {
   
-    for(uint32_t i = 0; i < HEAPTREEORDER; ++i) {
-      if(!children[i])
-	continue;
+    for(uint32_t mask = childMask, slot = 0; mask; mask &= (mask - 1), ++slot) {
+      uint32_t i = __builtin_ctz(mask);
       uint32_t newIdx = idx | (i << (HEAPTREEORDERLOG2 * height));
-      ((SharedTreeNode*)children[i])->print(RSO, brief, height - 1, newIdx);
+      ((SharedTreeNode*)children[slot])->print(RSO, brief, height - 1, newIdx);
     }
      
   } 
@@ -449,7 +607,7 @@ template<class ChildType, class ExtraState> void SharedTreeRoot<ChildType, Extra
   for(uint32_t i = 0, ilim = (newHeight - height); i != ilim; ++i) {
 
     SharedTreeNode<ChildType, ExtraState>* newNode = new SharedTreeNode<ChildType, ExtraState>();
-    newNode->children[0] = root;
+    newNode->setChild(0, root);
     root = newNode;
 
   }
@@ -521,16 +679,56 @@ template<class ChildType, class ExtraState> void SharedTreeRoot<ChildType, Extra
 
 }
 
+#define FRAMEPAGESIZE 32
+#define FRAMEPAGESIZELOG2 5
+
+// A run of FRAMEPAGESIZE consecutive stack slots, shared between frames like any other store component.
+template<class ChildType> struct SharedFramePage {
+
+  ChildType slots[FRAMEPAGESIZE];
+  StoreRefCount refCount;
+
+SharedFramePage() : refCount(1) { }
+
+};
+
 template<class ChildType, class ExtraState> struct SharedStoreMap {
 
-  std::vector<ChildType> store;
-  uint32_t refCount;
+  typedef SharedFramePage<ChildType> PageType;
+
+  // Slots are grouped into separately refcounted pages so that writing one location
+  // of a shared frame copies only its page rather than every alloca in the frame.
+  // A null page has no valid slots.
+  std::vector<PageType*> pages;
+  uint32_t nSlots;
+  StoreRefCount refCount;
   InlineAttempt* IA;
   bool empty;
 
-SharedStoreMap(InlineAttempt* _IA, uint32_t initSize) : store(initSize), refCount(1), IA(_IA), empty(true) { }
+SharedStoreMap(InlineAttempt* _IA, uint32_t initSize) : pages((initSize + (FRAMEPAGESIZE - 1)) >> FRAMEPAGESIZELOG2, 0), nSlots(initSize), refCount(1), IA(_IA), empty(true) { }
+
+  uint32_t size() const {
+    return nSlots;
+  }
+
+  // Returns null if slot i is out of range or not valid.
+  ChildType* getValidSlot(uint32_t i) {
+
+    if(i >= nSlots)
+      return 0;
+    PageType* P = pages[i >> FRAMEPAGESIZELOG2];
+    if(!P)
+      return 0;
+    ChildType* ret = &(P->slots[i & (FRAMEPAGESIZE - 1)]);
+    return ret->isValid() ? ret : 0;
+
+  }
 
   SharedStoreMap* getWritableStoreMap();
+  PageType* getWritablePage(uint32_t pageIdx);
+  ChildType& getWritableSlot(uint32_t i);
+  void resize(uint32_t newSize);
+  void dropPage(PageType* P, uint32_t stack_depth, uint32_t base, std::vector<ShadowValue>* simplified);
   void dropReference(uint32_t stack_depth, std::vector<ShadowValue>* simplified);
   void clear(uint32_t stack_depth, std::vector<ShadowValue>* simplified);
   SharedStoreMap* getEmptyMap(uint32_t stack_depth);
@@ -546,25 +744,111 @@ template<class ChildType, class ExtraState> SharedStoreMap<ChildType, ExtraState
     return this;
   }
 
-  // COW break: copy the map and either share or copy its entries.
-  LFV3(errs() << "COW break local map " << this << " with " << store.size() << " entries\n");
-  SharedStoreMap* newMap = new SharedStoreMap(IA, store.size());
-
-  uint32_t i = 0;
-  for(typename std::vector<ChildType>::iterator it = store.begin(), it2 = store.end(); it != it2; ++it, ++i) {
-    if(!it->isValid())
-      continue;
-    newMap->store[i] = it->getReadableCopy();
-    newMap->empty = false;
+  // COW break: copy the page list and share every page. Pages are broken individually
+  // when written (getWritablePage).
+  LFV3(errs() << "COW break local map " << this << " with " << nSlots << " entries\n");
+  ++CoWFrames;
+  CoWFramePages.add(pages.size());
+  SharedStoreMap* newMap = new SharedStoreMap(IA, 0);
+  newMap->pages = pages;
+  newMap->nSlots = nSlots;
+  newMap->empty = empty;
+
+  for(typename std::vector<PageType*>::iterator it = pages.begin(), itend = pages.end(); it != itend; ++it) {
+    if(*it)
+      (*it)->refCount++;
   }
 
-  // Drop reference on the existing map (can't destroy it):
-  refCount--;
+  // Drop reference on the existing map, which frees it if every other
+  // holder let go while we were copying.
+  dropReference(0, 0);
   
   return newMap;
 
 }
 
+template<class ChildType, class ExtraState> SharedFramePage<ChildType>* SharedStoreMap<ChildType, ExtraState>::getWritablePage(uint32_t pageIdx) {
+
+  // This map already known writable.
+  PageType* P = pages[pageIdx];
+
+  if(!P)
+    return pages[pageIdx] = new PageType();
+
+  if(P->refCount == 1)
+    return P;
+
+  ++CoWPages;
+  PageType* newPage = new PageType();
+  uint32_t copied = 0;
+  for(uint32_t i = 0; i != FRAMEPAGESIZE; ++i) {
+    if(P->slots[i].isValid()) {
+      newPage->slots[i] = P->slots[i].getReadableCopy();
+      ++copied;
+    }
+  }
+  CoWPageSlots.add(copied);
+
+  dropPage(P, 0, 0, 0);
+
+  return pages[pageIdx] = newPage;
+
+}
+
+template<class ChildType, class ExtraState> ChildType& SharedStoreMap<ChildType, ExtraState>::getWritableSlot(uint32_t i) {
+
+  release_assert(i < nSlots && "Write beyond end of frame");
+  return getWritablePage(i >> FRAMEPAGESIZELOG2)->slots[i & (FRAMEPAGESIZE - 1)];
+
+}
+
+template<class ChildType, class ExtraState> void SharedStoreMap<ChildType, ExtraState>::resize(uint32_t newSize) {
+
+  // This map already known writable.
+  uint32_t newPages = (newSize + (FRAMEPAGESIZE - 1)) >> FRAMEPAGESIZELOG2;
+
+  if(newSize < nSlots) {
+
+    for(uint32_t i = newPages, ilim = pages.size(); i != ilim; ++i) {
+      if(pages[i])
+	dropPage(pages[i], 0, 0, 0);
+    }
+
+    // Clear any valid slots in the tail of the last remaining page.
+    for(uint32_t i = newSize, ilim = std::min(nSlots, newPages << FRAMEPAGESIZELOG2); i != ilim; ++i) {
+      if(getValidSlot(i)) {
+	ChildType& slot = getWritableSlot(i);
+	slot.dropReference();
+	slot = ChildType();
+      }
+    }
+
+  }
+
+  pages.resize(newPages, 0);
+  nSlots = newSize;
+
+}
+
+template<class ChildType, class ExtraState> void SharedStoreMap<ChildType, ExtraState>::dropPage(PageType* P, uint32_t stack_depth, uint32_t base, std::vector<ShadowValue>* simplified) {
+
+  if(!--P->refCount) {
+
+    for(uint32_t i = 0; i != FRAMEPAGESIZE; ++i) {
+      ChildType& slot = P->slots[i];
+      if(!slot.isValid())
+	continue;
+      if(simplified && slot.derefWillAllowSimplify())
+	simplified->push_back(ShadowValue::getPtrIdx(stack_depth, base + i));
+      slot.dropReference();
+    }
+
+    delete P;
+
+  }
+
+}
+
 int32_t getFrameSize(InlineAttempt*);
 bool hasNoCallers(InlineAttempt*);
 
@@ -590,25 +874,22 @@ template<class ChildType, class ExtraState> void SharedStoreMap<ChildType, Extra
 
   release_assert(refCount <= 1 && "clear() against shared map?");
 
-  // Drop references to any maps this points to;
-  uint32_t i = 0;
-  for(typename std::vector<ChildType>::iterator it = store.begin(), itend = store.end(); it != itend; ++it, ++i) {
-    if(!it->isValid())
-      continue;
-    if(simplified && it->derefWillAllowSimplify())
-      simplified->push_back(ShadowValue::getPtrIdx(stack_depth, i));
-    it->dropReference();
+  // Drop references to any pages this points to;
+  for(uint32_t i = 0, ilim = pages.size(); i != ilim; ++i) {
+    if(pages[i])
+      dropPage(pages[i], stack_depth, i << FRAMEPAGESIZELOG2, simplified);
   }
 
-  store.clear();
-  store.resize(allocFrameSize(IA));
+  pages.clear();
+  nSlots = 0;
+  resize(allocFrameSize(IA));
   empty = true;
 
 }
 
 template<class ChildType, class ExtraState> SharedStoreMap<ChildType, ExtraState>* SharedStoreMap<ChildType, ExtraState>::getEmptyMap(uint32_t stack_depth) {
 
-  if(!store.size())
+  if(!nSlots)
     return this;
   else if(refCount == 1) {
     clear(stack_depth, 0);
@@ -616,7 +897,7 @@ template<class ChildType, class ExtraState> SharedStoreMap<ChildType, ExtraState
   }
   else {
     dropReference(stack_depth, 0);
-    return new SharedStoreMap<ChildType, ExtraState>(IA, store.size());
+    return new SharedStoreMap<ChildType, ExtraState>(IA, nSlots);
   }
 
 }
@@ -643,12 +924,15 @@ ShadowValue getStackAllocationWithIndex(InlineAttempt*, uint32_t);
 
 template<class ChildType, class ExtraState> void SharedStoreMap<ChildType, ExtraState>::print(raw_ostream& RSO, bool brief) {
 
-  uint32_t i = 0;
-  for(typename std::vector<ChildType>::iterator it = store.begin(), itend = store.end(); it != itend; ++it, ++i) {
+  for(uint32_t i = 0; i != nSlots; ++i) {
+
+    ChildType* slot = getValidSlot(i);
+    if(!slot)
+      continue;
 
     printSV(RSO, getStackAllocationWithIndex(IA, i));
     RSO << ": ";
-    it->print(RSO, brief);
+    slot->print(RSO, brief);
     RSO << "\n";
 
   }
@@ -665,7 +949,7 @@ template<class ChildType, class ExtraState> struct LocalStoreMap {
   RootType heap;
 
   bool allOthersClobbered;
-  uint32_t refCount;
+  StoreRefCount refCount;
 
   ExtraState es;
 
@@ -679,7 +963,7 @@ LocalStoreMap(uint32_t s) : frames(s), heap(), allOthersClobbered(false), refCou
   bool empty();
   void copyEmptyFrames(SmallVector<SharedStoreMap<ChildType, ExtraState>*, 4>&);
   void copyFramesFrom(const LocalStoreMap<ChildType, ExtraState>&);
-  std::vector<ChildType>& getWritableFrame(int32_t frameNo);
+  FrameType* getWritableFrame(int32_t frameNo);
   void pushStackFrame(InlineAttempt*);
   void popStackFrame();
   ChildType* getReadableStoreFor(const ShadowValue& V);
@@ -693,14 +977,15 @@ ChildType* LocalStoreMap<ChildType, ExtraState>::getOrCreateStoreFor(ShadowValue
   int32_t frameNo = V.getFrameNo();
   if(frameNo != -1) {
 
-    std::vector<ChildType>& frameMap = getWritableFrame(frameNo);
-    frames[frameNo]->empty = false;
+    FrameType* frame = getWritableFrame(frameNo);
+    frame->empty = false;
     int32_t framePos = V.getFramePos();
     release_assert(framePos >= 0 && "Stack entry without an index?");
-    if(frameMap.size() <= (uint32_t)framePos)
-      frameMap.resize(framePos + 1);
-    *isNewStore = !(frameMap[framePos].isValid());
-    return &(frameMap[framePos]);
+    if(frame->size() <= (uint32_t)framePos)
+      frame->resize(framePos + 1);
+    ChildType* ret = &(frame->getWritableSlot(framePos));
+    *isNewStore = !(ret->isValid());
+    return ret;
 
   }
   else {
@@ -718,16 +1003,7 @@ template<class ChildType, class ExtraState> ChildType* LocalStoreMap<ChildType,
     return heap.getReadableStoreFor(V);
   else {
 
-    std::vector<ChildType>& frame = frames[frameNo]->store;
-    uint32_t frameIdx = V.getFramePos();
-    if(frame.size() <= frameIdx)
-      return 0;
-
-    ChildType* ret = &(frame[frameIdx]);
-    if(!ret->isValid())
-      return 0;
-    else
-      return ret;
+    return frames[frameNo]->getValidSlot(V.getFramePos());
 
   }
   
@@ -738,23 +1014,23 @@ template<class ChildType, class ExtraState> LocalStoreMap<ChildType, ExtraState>
   if(refCount == 1)
     return this;
 
+  ++CoWFrameLists;
   LocalStoreMap<ChildType, ExtraState>* newMap = new LocalStoreMap<ChildType, ExtraState>(frames.size());
   newMap->copyFramesFrom(*this);
 
   newMap->allOthersClobbered = allOthersClobbered;
 
-  // Can't destory, as refCount > 1
-  --refCount;
+  // Drop our reference now that the frames have been borrowed.
+  dropReference();
 
   return newMap;
 
 }
 
-template<class ChildType, class ExtraState> std::vector<ChildType>& LocalStoreMap<ChildType, ExtraState>::getWritableFrame(int32_t frameNo) {
+template<class ChildType, class ExtraState> SharedStoreMap<ChildType, ExtraState>* LocalStoreMap<ChildType, ExtraState>::getWritableFrame(int32_t frameNo) {
 
   release_assert(frameNo >= 0 && frameNo < (int32_t)frames.size());
-  frames[frameNo] = frames[frameNo]->getWritableStoreMap();
-  return frames[frameNo]->store;
+  return frames[frameNo] = frames[frameNo]->getWritableStoreMap();
 
 }
 
@@ -789,10 +1065,10 @@ template<class ChildType, class ExtraState> LocalStoreMap<ChildType, ExtraState>
     return this;
   }
   else {
-    // Can't free the map (refcount > 1)
-    --refCount;
+    // Copy frame metadata before dropping our reference, which may free this map.
     LocalStoreMap<ChildType, ExtraState>* newMap = new LocalStoreMap<ChildType, ExtraState>(frames.size());
     newMap->copyEmptyFrames(frames);
+    dropReference();
     return newMap;
   }
 
@@ -899,7 +1175,9 @@ template<class ChildType, class ExtraState> struct MergeBlockVisitor : public Sh
   void mergeHeaps(MapType* toMap, typename SmallVector<MapType*, 4>::iterator fromBegin, typename SmallVector<MapType*, 4>::iterator fromEnd);
   void mergeFlags(MapType* toMap, typename SmallVector<MapType*, 4>::iterator fromBegin, typename SmallVector<MapType*, 4>::iterator fromEnd);
   void visit(ShadowBB* BB, void* Ctx, bool mustCopyCtx) {
-    incomingBlocks.push_back(BB);
+    // Blocks whose exit stores were folded into a later iteration contribute nothing.
+    if(!ChildType::blockStoreFolded(BB))
+      incomingBlocks.push_back(BB);
   }
   void doMerge();
 
@@ -1008,7 +1286,7 @@ void MergeBlockVisitor<ChildType, ExtraState>::
 
     for(uint32_t i = 0; i < tempFramesToRemove; ++i) {
       NodeType* removeNode = thisMap->heap.root;
-      thisMap->heap.root = (NodeType*)thisMap->heap.root->children[0];
+      thisMap->heap.root = (NodeType*)thisMap->heap.root->getChild(0);
       release_assert(removeNode->refCount == 1 && "Removing shared node in post-treemerge cleanup?");
       delete removeNode;
     }
@@ -1038,17 +1316,16 @@ void MergeBlockVisitor<ChildType, ExtraState>::mergeFrames(MapType* toMap, typen
 
   // CoW break stack frame if necessary
   FrameType* mergeToFrame = toMap->frames[idx] = toMap->frames[idx]->getWritableStoreMap();
-  std::vector<ChildType>& mergeToStore = mergeToFrame->store;
 
   InlineAttempt* thisFrameIA = mergeToFrame->IA;
 
   // Merge in each other frame. Note toMap->allOthersClobbered has been set to big-or over all maps already.
+  // Pages shared with the target frame are identical and never need visiting.
   for(typename SmallVector<FrameType*, 4>::iterator it = incomingFrames.begin(); it != uniqend; ++it) {
 
     FrameType* mergeFromFrame = *it;
     if(mergeFromFrame == mergeToFrame)
       continue;
-    std::vector<ChildType>& mergeFromStore = mergeFromFrame->store;
 
     if(toMap->allOthersClobbered) {
       
@@ -1057,17 +1334,26 @@ void MergeBlockVisitor<ChildType, ExtraState>::mergeFrames(MapType* toMap, typen
 
       // Remove any existing mappings in mergeToFrame that do not occur in mergeFromFrame:
 
-      for(uint32_t i = 0, ilim = mergeToStore.size(); i != ilim; ++i) {
+      for(uint32_t i = 0, ilim = mergeToFrame->size(); i != ilim; ++i) {
 
-	if(mergeToStore[i].isValid() && (i >= mergeFromStore.size() || !mergeFromStore[i].isValid())) {
-	  mergeToStore[i].dropReference();
-	  mergeToStore[i] = ChildType();
+	uint32_t page = i >> FRAMEPAGESIZELOG2;
+	if(page < mergeFromFrame->pages.size() && mergeToFrame->pages[page] == mergeFromFrame->pages[page]) {
+	  i |= (FRAMEPAGESIZE - 1);
+	  if(i >= ilim)
+	    break;
+	  continue;
+	}
+
+	if(mergeToFrame->getValidSlot(i) && !mergeFromFrame->getValidSlot(i)) {
+	  ChildType& slot = mergeToFrame->getWritableSlot(i);
+	  slot.dropReference();
+	  slot = ChildType();
 	}
 
       }
 
-      if(mergeToStore.size() > mergeFromStore.size())
-	mergeToStore.resize(mergeFromStore.size());
+      if(mergeToFrame->size() > mergeFromFrame->size())
+	mergeToFrame->resize(mergeFromFrame->size());
 
     }
     else {
@@ -1079,13 +1365,21 @@ void MergeBlockVisitor<ChildType, ExtraState>::mergeFrames(MapType* toMap, typen
       // This will get overwritten below but creates the asymmetry that 
       // x in mergeFromFrame -> x in mergeToFrame.
 
-      if(mergeFromStore.size() > mergeToStore.size())
-	mergeToStore.resize(mergeFromStore.size());
+      if(mergeFromFrame->size() > mergeToFrame->size())
+	mergeToFrame->resize(mergeFromFrame->size());
 
-      for(uint32_t i = 0, ilim = mergeFromStore.size(); i != ilim; ++i) {
+      for(uint32_t i = 0, ilim = mergeFromFrame->size(); i != ilim; ++i) {
+
+	uint32_t page = i >> FRAMEPAGESIZELOG2;
+	if(mergeToFrame->pages[page] == mergeFromFrame->pages[page]) {
+	  i |= (FRAMEPAGESIZE - 1);
+	  if(i >= ilim)
+	    break;
+	  continue;
+	}
 	  
-	if(mergeFromStore[i].isValid() && !mergeToStore[i].isValid()) {
-	  mergeToStore[i] = ChildType::getEmptyStore().getReadableCopy();
+	if(mergeFromFrame->getValidSlot(i) && !mergeToFrame->getValidSlot(i)) {
+	  mergeToFrame->getWritableSlot(i) = ChildType::getEmptyStore().getReadableCopy();
 	  mergeToFrame->empty = false;
 	}
 	
@@ -1099,50 +1393,73 @@ void MergeBlockVisitor<ChildType, ExtraState>::mergeFrames(MapType* toMap, typen
   // Note that in the allOthersClobbered case this only merges in
   // information from locations explicitly mentioned in all incoming frames.
 
-  for(uint32_t i = 0, ilim = mergeToStore.size(); i != ilim; ++i) {
+  for(uint32_t page = 0, pagelim = mergeToFrame->pages.size(); page != pagelim; ++page) {
 
-    if(!mergeToStore[i].isValid())
+    if(!mergeToFrame->pages[page])
       continue;
 
-    ChildType* mergeToLoc = &(mergeToStore[i]);
+    // Page identical in every incoming frame?
+    bool allShared = true;
+    for(typename SmallVector<FrameType*, 4>::iterator incit = incomingFrames.begin(); incit != uniqend && allShared; ++incit) {
+
+      if(*incit == mergeToFrame)
+	continue;
+      allShared = (page < (*incit)->pages.size() && (*incit)->pages[page] == mergeToFrame->pages[page]);
+
+    }
 
-    uint64_t mergeSize = getAllocSize(thisFrameIA, i);
+    if(allShared)
+      continue;
 
-    SmallVector<ChildType*, 4> incomingStores;
+    SharedFramePage<ChildType>* mergeToPage = mergeToFrame->getWritablePage(page);
 
-    for(typename SmallVector<SharedStoreMap<ChildType, ExtraState>*, 4>::iterator incit = incomingFrames.begin(); incit != uniqend; ++incit) {
+    for(uint32_t slot = 0; slot != FRAMEPAGESIZE; ++slot) {
 
-      SharedStoreMap<ChildType, ExtraState>* mergeFromFrame = *incit;
-      if(mergeFromFrame == mergeToFrame)
+      uint32_t i = (page << FRAMEPAGESIZELOG2) + slot;
+      if(i >= mergeToFrame->size())
+	break;
+
+      if(!mergeToPage->slots[slot].isValid())
 	continue;
 
-      ChildType* mergeFromLoc;
+      ChildType* mergeToLoc = &(mergeToPage->slots[slot]);
 
-      if(mergeFromFrame->store.size() > i && mergeFromFrame->store[i].isValid())
-	mergeFromLoc = &(mergeFromFrame->store[i]);
-      else
-	mergeFromLoc = &(ChildType::getEmptyStore());
+      uint64_t mergeSize = getAllocSize(thisFrameIA, i);
 
-      incomingStores.push_back(mergeFromLoc);
+      SmallVector<ChildType*, 4> incomingStores;
 
-    }
+      for(typename SmallVector<SharedStoreMap<ChildType, ExtraState>*, 4>::iterator incit = incomingFrames.begin(); incit != uniqend; ++incit) {
 
-    std::sort(incomingStores.begin(), incomingStores.end(), ChildType::LT);
-    typename SmallVector<ChildType*, 4>::iterator storeuniqend = 
-      std::unique(incomingStores.begin(), incomingStores.end(), ChildType::EQ);
+	SharedStoreMap<ChildType, ExtraState>* mergeFromFrame = *incit;
+	if(mergeFromFrame == mergeToFrame)
+	  continue;
 
-    for(typename SmallVector<ChildType*, 4>::iterator incit = incomingStores.begin(), incitend = incomingStores.end();
-	incit != incitend; ++incit) {
+	ChildType* mergeFromLoc = mergeFromFrame->getValidSlot(i);
+	if(!mergeFromLoc)
+	  mergeFromLoc = &(ChildType::getEmptyStore());
 
-      ChildType* mergeFromLoc = *incit;
+	incomingStores.push_back(mergeFromLoc);
 
-      // Right, merge it->second and mergeFromLoc.
-      ChildType::mergeStores(mergeFromLoc, mergeToLoc, mergeSize, this);
-      mergeToLoc->checkMergedResult();
+      }
 
-    }
+      std::sort(incomingStores.begin(), incomingStores.end(), ChildType::LT);
+      typename SmallVector<ChildType*, 4>::iterator storeuniqend = 
+	std::unique(incomingStores.begin(), incomingStores.end(), ChildType::EQ);
+
+      for(typename SmallVector<ChildType*, 4>::iterator incit = incomingStores.begin(), incitend = incomingStores.end();
+	  incit != incitend; ++incit) {
+
+	ChildType* mergeFromLoc = *incit;
+
+	// Right, merge it->second and mergeFromLoc.
+	ChildType::mergeStores(mergeFromLoc, mergeToLoc, mergeSize, this);
+	mergeToLoc->checkMergedResult();
 
-    ChildType::simplifyStore(mergeToLoc);
+      }
+
+      ChildType::simplifyStore(mergeToLoc);
+
+    }
 
   }
 
@@ -1169,6 +1486,8 @@ void MergeBlockVisitor<ChildType, ExtraState>::doMerge() {
   typename SmallVector<MapType*, 4>::iterator uniqend = std::unique(incomingStores.begin(), incomingStores.end());
 
   MapType* retainMap;
+
+  MergeFanIn.add(std::distance(incomingStores.begin(), uniqend));
   
   if(std::distance(incomingStores.begin(), uniqend) > 1) {
 
@@ -0,0 +1,292 @@
+//===-- LLPEJIT.cpp -------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// An embeddable runtime (see llpe-jit.h) that lets a long-running program specialise
+// itself in-process: at startup, or at whatever trigger point it likes, it passes its
+// live argv and environment, LLPE specialises its own bitcode against them and the files
+// it reads as of now, and MCJIT compiles the result. The program then calls the root
+// through llpe_jit_get.
+//
+// Each specialisation is committed with -int-variant-name, so the JIT compiles only the
+// specialised code and everything else resolves to the running program's own
+// definitions, sharing its state. That needs the program linked with -rdynamic, and its
+// bitcode externalised as scripts/llpe-batch.py does, so that local definitions can be
+// found by name too.
+//
+// llpe_jit_watch polls lliowd, and when it reports that the files the specialisation
+// depended on have changed, specialises again on a background thread and swaps the new
+// code in. Until then the old code's own lliowd checks send it down its unspecialised
+// paths, so it stays correct meanwhile. Old code is never freed, since another thread
+// may still be running it. The options given to llpe_jit_create should include
+// -int-write-llio-conf, and lliowd must be restarted with the config the latest
+// specialisation wrote for its checks to pass; until then it too runs unspecialised.
+//
+// LLPE's options are parsed once per process, so only one llpe_jit can be created, and
+// specialisations are serialised.
+
+#include "llpe-jit.h"
+
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Pass.h"
+#include "llvm/PassManager.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetLibraryInfo.h"
+
+#include <lliowd.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+struct llpe_jit {
+
+  std::string bitcode;
+  std::string root;
+  std::string workdir;
+
+  std::atomic<void*> current;
+  unsigned generation;
+
+  // Compiled specialisations, kept alive while anything might still run them.
+  std::vector<ExecutionEngine*> engines;
+  std::vector<LLVMContext*> contexts;
+
+  std::mutex specialiseLock;
+
+};
+
+static bool jitCreated = false;
+
+static bool writeLines(const std::string& path, char** lines, int n) {
+
+  std::error_code error;
+  raw_fd_ostream Out(path.c_str(), error, sys::fs::F_None);
+  if(error) {
+    errs() << "llpe-jit: failed to open " << path << ": " << error.message() << "\n";
+    return false;
+  }
+
+  for(int i = 0; n < 0 ? lines[i] != 0 : i != n; ++i)
+    Out << lines[i] << "\n";
+
+  return true;
+
+}
+
+// Specialise the root again with the options parsed at creation and swap it in.
+static bool specialise(llpe_jit* J) {
+
+  std::lock_guard<std::mutex> Guard(J->specialiseLock);
+
+  LLVMContext* Context = new LLVMContext();
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(J->bitcode, Err, *Context);
+  if(!M) {
+    Err.print("llpe-jit", errs());
+    delete Context;
+    return false;
+  }
+
+  const PassInfo* PI = PassRegistry::getPassRegistry()->getPassInfo("llpe");
+  if(!PI) {
+    errs() << "llpe-jit: the LLPE driver pass isn't loaded\n";
+    delete Context;
+    return false;
+  }
+
+  {
+    PassManager PM;
+    PM.add(new TargetLibraryInfo(Triple(M->getTargetTriple())));
+    PM.add(new DataLayoutPass());
+    PM.add(PI->createPass());
+    PM.run(*M);
+  }
+
+  std::string variant = J->root + ".llpe.jit";
+  Module* Mp = M.get();
+  if(!Mp->getFunction(variant)) {
+    errs() << "llpe-jit: specialisation produced no " << variant << "\n";
+    delete Context;
+    return false;
+  }
+
+  // Give each generation's code its own name, in case MCJIT looks symbols up globally.
+  std::string generationName;
+  {
+    raw_string_ostream RSO(generationName);
+    RSO << variant << "." << J->generation++;
+  }
+  Mp->getFunction(variant)->setName(generationName);
+
+  std::string error;
+  ExecutionEngine* EE = EngineBuilder(std::move(M)).setErrorStr(&error).setEngineKind(EngineKind::JIT).create();
+  if(!EE) {
+    errs() << "llpe-jit: failed to create the JIT: " << error << "\n";
+    delete Context;
+    return false;
+  }
+
+  void* Fn = (void*)EE->getFunctionAddress(generationName);
+  if(!Fn) {
+    errs() << "llpe-jit: failed to compile " << generationName << "\n";
+    return false;
+  }
+
+  J->engines.push_back(EE);
+  J->contexts.push_back(Context);
+  J->current.store(Fn);
+  return true;
+
+}
+
+extern "C" struct llpe_jit* llpe_jit_create(const char* bitcode, const char* root, const char* const* modules,
+					    const char* const* args, int argc, char** argv, char** envp) {
+
+  if(jitCreated) {
+    errs() << "llpe-jit: only one specialiser per process is supported\n";
+    return 0;
+  }
+  jitCreated = true;
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  // Resolve the specialisation's references to the program's own definitions.
+  sys::DynamicLibrary::LoadLibraryPermanently(0);
+
+  PassRegistry& Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeScalarOpts(Registry);
+  initializeIPO(Registry);
+  initializeAnalysis(Registry);
+  initializeIPA(Registry);
+  initializeTransformUtils(Registry);
+  initializeInstCombine(Registry);
+  initializeTarget(Registry);
+
+  for(const char* const* it = modules; *it; ++it) {
+
+    std::string error;
+    if(sys::DynamicLibrary::LoadLibraryPermanently(*it, &error)) {
+      errs() << "llpe-jit: failed to load " << *it << ": " << error << "\n";
+      return 0;
+    }
+
+  }
+
+  llpe_jit* J = new llpe_jit();
+  J->bitcode = bitcode;
+  J->root = root;
+  J->current.store(0);
+  J->generation = 0;
+
+  char workdir[] = "/tmp/llpe_jit_XXXXXX";
+  if(!mkdtemp(workdir)) {
+    errs() << "llpe-jit: failed to create a temporary directory: " << strerror(errno) << "\n";
+    delete J;
+    return 0;
+  }
+  J->workdir = workdir;
+
+  // Hand the live argv and environment to LLPE as --spec-argv and --spec-env files.
+  std::string argvPath = J->workdir + "/argv";
+  std::string envPath = J->workdir + "/env";
+  if(!(writeLines(argvPath, argv, argc) && writeLines(envPath, envp, -1))) {
+    delete J;
+    return 0;
+  }
+
+  std::vector<std::string> Options;
+  Options.push_back("llpe-jit");
+  Options.push_back("-integrator-accept-all");
+  Options.push_back("-intheuristics-root=" + J->root);
+  Options.push_back("-int-variant-name=" + J->root + ".llpe.jit");
+  Options.push_back("-spec-argv=0,1," + argvPath);
+  Options.push_back("-spec-env=2," + envPath);
+  for(const char* const* it = args; *it; ++it)
+    Options.push_back(*it);
+
+  std::vector<const char*> OptionPtrs;
+  for(std::vector<std::string>::iterator it = Options.begin(), itend = Options.end(); it != itend; ++it)
+    OptionPtrs.push_back(it->c_str());
+
+  cl::ParseCommandLineOptions(OptionPtrs.size(), &OptionPtrs[0], "LLPE JIT\n");
+
+  if(!specialise(J)) {
+    delete J;
+    return 0;
+  }
+
+  return J;
+
+}
+
+extern "C" void* llpe_jit_get(struct llpe_jit* J) {
+
+  return J->current.load();
+
+}
+
+extern "C" void llpe_jit_watch(struct llpe_jit* J, unsigned interval_ms) {
+
+  std::thread Watcher([J, interval_ms]() {
+
+      // Re-specialise once per invalidation: after that, wait for lliowd to vouch for
+      // the files again (i.e. be restarted with the new config) before watching them.
+      bool valid = false;
+
+      while(true) {
+
+	usleep(interval_ms * 1000);
+
+	if(lliowd_ok()) {
+	  valid = true;
+	  continue;
+	}
+
+	// Once told the files changed the client stays failed: start a new handshake,
+	// which will also serve the next specialisation's checks.
+	lliowd_reset();
+
+	if(!valid)
+	  continue;
+	valid = false;
+
+	if(!specialise(J))
+	  errs() << "llpe-jit: re-specialisation failed; keeping the previous code\n";
+
+      }
+
+    });
+
+  Watcher.detach();
+
+}
@@ -0,0 +1,32 @@
+#ifndef LLPE_JIT_H
+#define LLPE_JIT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// In-process specialisation (see LLPEJIT.cpp). The program must be linked with
+// -rdynamic, and bitcode must be its own module, externalised as scripts/llpe-batch.py
+// does, so that the specialised code can use the program's globals and functions.
+
+struct llpe_jit;
+
+// Specialise root in the module at bitcode with respect to the live argv and environment,
+// loading LLPE from the modules named in the null-terminated array modules and passing it
+// the null-terminated options in args. Returns null if specialisation fails.
+struct llpe_jit* llpe_jit_create(const char* bitcode, const char* root, const char* const* modules,
+				 const char* const* args, int argc, char** argv, char** envp);
+
+// The current specialised root, with the original root's type. Safe to call from any
+// thread; code returned earlier stays valid after a re-specialisation.
+void* llpe_jit_get(struct llpe_jit* jit);
+
+// Poll lliowd every interval_ms milliseconds and re-specialise in a background thread
+// whenever it reports that the files the specialisation read have changed.
+void llpe_jit_watch(struct llpe_jit* jit, unsigned interval_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -30,6 +30,8 @@ using namespace llvm;
 
 static void readWholeFile(std::string& path, std::string& out, bool addnewline) {
 
+  noteCacheDependency(path);
+
   ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(path);
   if(std::error_code ec = MB.getError()) {
 
@@ -90,11 +92,15 @@ void LLPEAnalysisPass::loadArgv(Function* F, std::string& path, unsigned argvIdx
   std::string argvtext;
   readWholeFile(path, argvtext, true);
 
-  size_t startidx = 0;
+  // Pack the kept lines, each NUL-terminated, into one string that becomes a single
+  // constant global; argv entries point into it.
+  std::string packed;
+  packed.reserve(argvtext.size());
 
   std::vector<int> lineStarts;
 
-  for(size_t findidx = argvtext.find('\n'); findidx != std::string::npos; findidx = argvtext.find('\n', startidx)) {
+  for(size_t startidx = 0, findidx = argvtext.find('\n'); findidx != std::string::npos;
+      startidx = findidx + 1, findidx = argvtext.find('\n', startidx)) {
 
     bool foundalpha = false;
 
@@ -105,31 +111,27 @@ void LLPEAnalysisPass::loadArgv(Function* F, std::string& path, unsigned argvIdx
 
     }
 
-    bool isUnknown = false;
-    if(!argvtext.compare(startidx, findidx - startidx, "__undef__")) {
+    if(!argvtext.compare(startidx, findidx - startidx, "__undef__"))
       lineStarts.push_back(-1);
-      isUnknown = true;
-    }
+    else if(foundalpha) {
 
-    if((!foundalpha) || isUnknown) {
-
-      argvtext.erase(startidx, (findidx - startidx) + 1);
-      // Start search again from the same index.
-
-    }
-    else {
-
-      argvtext.replace(findidx, 1, 1, '\0');
-      lineStarts.push_back(startidx);
-      
-      startidx = findidx + 1;
+      lineStarts.push_back(packed.size());
+      packed.append(argvtext, startidx, findidx - startidx);
+      packed.push_back('\0');
 
     }
 
   }
 
   argc = lineStarts.size();
-  GlobalVariable* ArgvConsts = getStringArray(argvtext, *(F->getParent()));
+  for(unsigned i = 0; i < argc; ++i) {
+    if(lineStarts[i] == -1)
+      guardArgv.push_back(std::make_pair(false, std::string()));
+    else
+      guardArgv.push_back(std::make_pair(true, std::string(packed.c_str() + lineStarts[i])));
+  }
+
+  GlobalVariable* ArgvConsts = getStringArray(packed, *(F->getParent()));
 
   BasicBlock& EntryBB = F->getEntryBlock();
   BasicBlock::iterator BI = EntryBB.begin();
@@ -177,12 +179,14 @@ Constant* LLPEAnalysisPass::loadEnvironment(Module& M, std::string& path) {
   std::string useenv;
   readWholeFile(path, useenv, true);
 
-  size_t startidx = 0;
+  // As for argv, packed into one string.
+  std::string packed;
+  packed.reserve(useenv.size());
 
   std::vector<size_t> lineStarts;
-  std::vector<bool> lineUnknown;
 
-  for(size_t findidx = useenv.find('\n'); findidx != std::string::npos; findidx = useenv.find('\n', startidx)) {
+  for(size_t startidx = 0, findidx = useenv.find('\n'); findidx != std::string::npos;
+      startidx = findidx + 1, findidx = useenv.find('\n', startidx)) {
 
     bool foundalpha = false;
     bool foundequals = false;
@@ -204,21 +208,20 @@ Constant* LLPEAnalysisPass::loadEnvironment(Module& M, std::string& path) {
 
       }
 
-      useenv.erase(startidx, (findidx - startidx) + 1);
-      // Start search again from the same index.
-
     }
     else {
 
-      useenv.replace(findidx, 1, 1, '\0');
-      lineStarts.push_back(startidx);
-      lineUnknown.push_back(false);
-      startidx = findidx + 1;
+      lineStarts.push_back(packed.size());
+      packed.append(useenv, startidx, findidx - startidx);
+      packed.push_back('\0');
 
     }
 
   }
 
-  return getStringPtrArray(useenv, lineStarts, M);
+  for(std::vector<size_t>::iterator it = lineStarts.begin(), itend = lineStarts.end(); it != itend; ++it)
+    guardEnv.push_back(std::string(packed.c_str() + *it));
+
+  return getStringPtrArray(packed, lineStarts, M);
   
 }
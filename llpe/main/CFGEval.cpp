@@ -26,6 +26,8 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Assembly/Writer.h"
 
+#include <algorithm>
+
 using namespace llvm;
 
 // Implement instruction/block analysis concerning control flow, i.e. determining a block's
@@ -35,6 +37,7 @@ void IntegrationAttempt::setBlockStatus(ShadowBBInvar* BBI, ShadowBBStatus s) {
 
   ShadowBB* BB = getOrCreateBB(BBI);
   BB->status = s;
+  livenessChanged();
     
 }
 
@@ -114,7 +117,7 @@ static bool setEdgeAlive(TerminatorInst* TI, ShadowBB* BB, BasicBlock* Target) {
       // Mark this edge alive
       if(!BB->succsAlive[I])
 	changed = true;
-      BB->succsAlive[I] = true;
+      BB->setSuccAlive(I, true);
 
     }
 
@@ -124,6 +127,26 @@ static bool setEdgeAlive(TerminatorInst* TI, ShadowBB* BB, BasicBlock* Target) {
 
 }
 
+// Could an invoke that isn't specialised as an enabled context throw? Not if its call
+// site or every function it might call is marked nounwind.
+static bool residualInvokeMayUnwind(ShadowInstruction* SI) {
+
+  if(cast_inst<InvokeInst>(SI)->doesNotThrow())
+    return false;
+
+  SmallVector<Function*, 4> Callees;
+  if(!getCalledFunctions(SI, Callees))
+    return true;
+
+  for(SmallVector<Function*, 4>::iterator it = Callees.begin(), itend = Callees.end(); it != itend; ++it) {
+    if(!(*it)->doesNotThrow())
+      return true;
+  }
+
+  return false;
+
+}
+
 // Return true on change.
 bool IntegrationAttempt::tryEvaluateTerminatorInst(ShadowInstruction* SI) {
 
@@ -147,14 +170,17 @@ bool IntegrationAttempt::tryEvaluateTerminatorInst(ShadowInstruction* SI) {
     if(SI->parent->localStore) {
 
       changed |= !SI->parent->succsAlive[0];
-      SI->parent->succsAlive[0] = true;
+      SI->parent->setSuccAlive(0, true);
 
     }      
 
-    if((!IA) || (!IA->isEnabled()) || IA->mayUnwind) {
+    // The exception edge is live only if the call might unwind into it; otherwise the
+    // landing pad and what only it reaches are dead, and the invoke commits as a call.
+    bool unwinds = (IA && IA->isEnabled()) ? IA->mayUnwind : residualInvokeMayUnwind(SI);
+    if(unwinds) {
 
       changed |= !SI->parent->succsAlive[1];
-      SI->parent->succsAlive[1] = true;
+      SI->parent->setSuccAlive(1, true);
 
     }
 
@@ -172,7 +198,7 @@ bool IntegrationAttempt::tryEvaluateTerminatorInst(ShadowInstruction* SI) {
 
     if(BI->isUnconditional()) {
       bool changed = !SI->parent->succsAlive[0];
-      SI->parent->succsAlive[0] = true;
+      SI->parent->setSuccAlive(0, true);
       return changed;
     }
 
@@ -186,7 +212,7 @@ bool IntegrationAttempt::tryEvaluateTerminatorInst(ShadowInstruction* SI) {
   ConstantInt* ConstCondition = dyn_cast_or_null<ConstantInt>(getConstReplacement(Condition));
   if(!ConstCondition) {
 
-    if(Condition.t == SHADOWVAL_INST || Condition.t == SHADOWVAL_ARG) {
+    if(Condition.getValType() == SHADOWVAL_INST || Condition.getValType() == SHADOWVAL_ARG) {
 
       // Switch statements can operate on a ptrtoint operand, of which only ptrtoint(null) is useful:
       if(ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(getIVSRef(Condition))) {
@@ -228,8 +254,12 @@ bool IntegrationAttempt::tryEvaluateTerminatorInst(ShadowInstruction* SI) {
     }
     else {
       SwitchInst* SwI = cast_inst<SwitchInst>(SI);
-      SwitchInst::CaseIt targetidx = SwI->findCaseValue(ConstCondition);
-      takenTarget = targetidx.getCaseSuccessor();
+      if(ConstCondition->getBitWidth() <= 64)
+	takenTarget = pass->getSwitchTarget(SwI, ConstCondition->getLimitedValue());
+      else {
+	SwitchInst::CaseIt targetidx = SwI->findCaseValue(ConstCondition);
+	takenTarget = targetidx.getCaseSuccessor();
+      }
     }
     if(takenTarget) {
       // We know where the instruction is going -- remove this block as a predecessor for its other targets.
@@ -257,8 +287,14 @@ bool IntegrationAttempt::tryEvaluateTerminatorInst(ShadowInstruction* SI) {
 
     for (unsigned i = 0, ilim = IVS->Values.size(); i != ilim; ++i) {
       
-      SwitchInst::CaseIt targetit = Switch->findCaseValue(cast<ConstantInt>(getConstReplacement(IVS->Values[i].V)));
-      BasicBlock* target = targetit.getCaseSuccessor();
+      BasicBlock* target;
+      uint64_t CaseVal;
+      if(tryGetConstantInt(IVS->Values[i].V, CaseVal))
+	target = pass->getSwitchTarget(Switch, CaseVal);
+      else {
+	SwitchInst::CaseIt targetit = Switch->findCaseValue(cast<ConstantInt>(getConstReplacement(IVS->Values[i].V)));
+	target = targetit.getCaseSuccessor();
+      }
       changed |= setEdgeAlive(TI, SI->parent, target);
 
     }
@@ -273,7 +309,7 @@ bool IntegrationAttempt::tryEvaluateTerminatorInst(ShadowInstruction* SI) {
     // Mark outgoing edge alive
     if(!SI->parent->succsAlive[I])
       changed = true;
-    SI->parent->succsAlive[I] = true;
+    SI->parent->setSuccAlive(I, true);
     
   }
 
@@ -281,6 +317,30 @@ bool IntegrationAttempt::tryEvaluateTerminatorInst(ShadowInstruction* SI) {
 
 }
 
+// Find the target for a switch on CaseVal by binary search, rather than findCaseValue's
+// linear scan: state machines switch over many cases and are evaluated every iteration.
+BasicBlock* LLPEAnalysisPass::getSwitchTarget(SwitchInst* SwI, uint64_t CaseVal) {
+
+  std::vector<std::pair<uint64_t, uint32_t> >& Table = switchCaseTables[SwI];
+  if(Table.empty() && SwI->getNumCases()) {
+
+    Table.reserve(SwI->getNumCases());
+    for(SwitchInst::CaseIt it = SwI->case_begin(), itend = SwI->case_end(); it != itend; ++it)
+      Table.push_back(std::make_pair(it.getCaseValue()->getLimitedValue(), it.getSuccessorIndex()));
+    std::sort(Table.begin(), Table.end());
+
+  }
+
+  std::vector<std::pair<uint64_t, uint32_t> >::iterator found = 
+    std::lower_bound(Table.begin(), Table.end(), std::make_pair(CaseVal, (uint32_t)0));
+
+  if(found != Table.end() && found->first == CaseVal)
+    return SwI->getSuccessor(found->second);
+  else
+    return SwI->getDefaultDest();
+
+}
+
 IntegrationAttempt* IntegrationAttempt::getIAForScope(const ShadowLoopInvar* Scope) {
 
   if((!L) || L->contains(Scope))
@@ -0,0 +1,397 @@
+//===-- Cache.cpp ---------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// A content-addressed cache of specialisation results, enabled with -int-cache-dir.
+// Entries are keyed by a SHA1 over the input module's bitcode, LLPE's command line
+// (including any -int-config file) and LLPE's own binary, and record every file the specialisation read together with its hash, so that an
+// entry is only reused if none of those files has changed since.
+
+// The per-context analysis state refers directly to the module's Values and to the
+// global heap numbering, so it is not serialisable on its own; instead we cache the
+// committed result of a whole run, which is what a repeated run would produce anyway.
+
+// For the same reason a run which changes only path conditions, -spec-argv or assumed
+// edges gets a fresh key and is analysed from scratch: the previous context tree has been
+// released by commit (releaseMemoryPostCommit) by the time it could be compared, and the
+// dependency sets kept by noteDependency describe store locations, not the command-line
+// inputs that produced them, so they cannot identify the contexts a changed knob affects.
+
+#include "llvm/Analysis/LLPE.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <algorithm>
+
+#include <openssl/sha.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+static cl::opt<std::string> CacheDir("int-cache-dir", cl::init(""));
+
+static std::string hashToString(unsigned char* hash) {
+
+  std::string ret;
+  raw_string_ostream RSO(ret);
+
+  for(int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+
+    if(hash[i]/16 == 0)
+      RSO << '0';
+    RSO.write_hex(hash[i]);
+
+  }
+
+  RSO.flush();
+  return ret;
+
+}
+
+// Read our own command line, omitting the output filename which does not affect the result.
+static std::string getCommandLineForKey() {
+
+  std::string ret;
+
+  int fd = open("/proc/self/cmdline", O_RDONLY);
+  if(fd == -1)
+    return ret;
+
+  char readbuf[4096];
+  int thisread;
+  while((thisread = read(fd, readbuf, 4096)) > 0)
+    ret.append(readbuf, thisread);
+
+  close(fd);
+
+  std::string filtered;
+  size_t pos = 0;
+  bool first = true;
+  bool skipNext = false;
+
+  while(pos < ret.size()) {
+
+    size_t end = ret.find('\0', pos);
+    if(end == std::string::npos)
+      end = ret.size();
+
+    std::string arg = ret.substr(pos, end - pos);
+    pos = end + 1;
+
+    // Program name
+    if(first) {
+      first = false;
+      continue;
+    }
+
+    if(skipNext) {
+      skipNext = false;
+      continue;
+    }
+
+    if(arg == "-o") {
+      skipNext = true;
+      continue;
+    }
+
+    if(arg.compare(0, 3, "-o=") == 0)
+      continue;
+
+    filtered += arg;
+    filtered += '\0';
+
+  }
+
+  return filtered;
+
+}
+
+// Results also depend on LLPE's own code, so hash the library (or executable) this was
+// loaded from: entries made before an upgrade or rebuild then stop matching.
+static bool hashLLPEBuild(SHA_CTX* hashctx) {
+
+  Dl_info info;
+  if(!dladdr((void*)&hashLLPEBuild, &info) || !info.dli_fname)
+    return false;
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(info.dli_fname);
+  if(!MB)
+    return false;
+
+  return SHA1_Update(hashctx, (*MB)->getBufferStart(), (*MB)->getBufferSize());
+
+}
+
+void LLPEAnalysisPass::computeCacheKey(Module& M) {
+
+  if(CacheDir.empty())
+    return;
+
+  // The key covers every body, so laziness gains nothing when caching.
+  materialiseAllFunctions(M);
+
+  std::string bitcode;
+  {
+    raw_string_ostream RSO(bitcode);
+    WriteBitcodeToFile(&M, RSO);
+  }
+
+  std::string cmdline = getCommandLineForKey();
+  cmdline += configText;
+
+  unsigned char hash[SHA_DIGEST_LENGTH];
+  SHA_CTX hashctx;
+  if(!(SHA1_Init(&hashctx) &&
+       SHA1_Update(&hashctx, bitcode.data(), bitcode.size()) &&
+       SHA1_Update(&hashctx, cmdline.data(), cmdline.size()) &&
+       hashLLPEBuild(&hashctx) &&
+       SHA1_Final(hash, &hashctx))) {
+
+    errs() << "Failed to hash the module or LLPE itself for the specialisation cache; caching disabled\n";
+    return;
+
+  }
+
+  cacheKey = hashToString(hash);
+
+}
+
+void llvm::noteCacheDependency(const std::string& Filename) {
+
+  std::vector<std::string>& deps = GlobalIHP->cacheDependentFiles;
+  if(std::find(deps.begin(), deps.end(), Filename) == deps.end())
+    deps.push_back(Filename);
+
+}
+
+static std::string getCachePath(const std::string& key, const char* suffix) {
+
+  return CacheDir + "/" + key + suffix;
+
+}
+
+// Check every file the cached run depended on still has the recorded hash.
+static bool cacheDepsValid(const std::string& depsPath) {
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(depsPath);
+  if(MB.getError())
+    return false;
+
+  StringRef deps = (*MB)->getBuffer();
+
+  while(!deps.empty()) {
+
+    std::pair<StringRef, StringRef> lineAndRest = deps.split('\n');
+    StringRef line = lineAndRest.first;
+    deps = lineAndRest.second;
+
+    if(line.empty())
+      continue;
+
+    std::pair<StringRef, StringRef> hashAndPath = line.split(' ');
+    std::string path = hashAndPath.second.str();
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    if(!getFileSha1(path, hash))
+      return false;
+
+    if(hashToString(hash) != hashAndPath.first)
+      return false;
+
+  }
+
+  return true;
+
+}
+
+static bool copyFile(const std::string& from, const std::string& to) {
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(from);
+  if(MB.getError())
+    return false;
+
+  std::error_code error;
+  raw_fd_ostream RFO(to.c_str(), error, sys::fs::F_None);
+  if(error)
+    return false;
+
+  RFO << (*MB)->getBuffer();
+  return true;
+
+}
+
+// Replace M's contents with those of From, which is consumed.
+static void replaceModuleContents(Module& M, Module* From) {
+
+  M.dropAllReferences();
+
+  while(!M.alias_empty()) {
+    M.alias_begin()->removeDeadConstantUsers();
+    M.alias_begin()->eraseFromParent();
+  }
+
+  while(!M.empty()) {
+    M.begin()->removeDeadConstantUsers();
+    M.begin()->eraseFromParent();
+  }
+
+  while(!M.global_empty()) {
+    M.global_begin()->removeDeadConstantUsers();
+    M.global_begin()->eraseFromParent();
+  }
+
+  while(!M.named_metadata_empty())
+    M.named_metadata_begin()->eraseFromParent();
+
+  M.getGlobalList().splice(M.global_end(), From->getGlobalList());
+  M.getFunctionList().splice(M.end(), From->getFunctionList());
+  M.getAliasList().splice(M.alias_end(), From->getAliasList());
+
+  for(Module::named_metadata_iterator it = From->named_metadata_begin(),
+	itend = From->named_metadata_end(); it != itend; ++it) {
+
+    NamedMDNode* NewMD = M.getOrInsertNamedMetadata(it->getName());
+    for(unsigned i = 0, ilim = it->getNumOperands(); i != ilim; ++i)
+      NewMD->addOperand(it->getOperand(i));
+
+  }
+
+  M.setModuleInlineAsm(From->getModuleInlineAsm());
+
+  delete From;
+
+}
+
+bool LLPEAnalysisPass::tryLoadFromCache(Module& M) {
+
+  if(cacheKey.empty())
+    return false;
+
+  std::string bcPath = getCachePath(cacheKey, ".bc");
+  std::string depsPath = getCachePath(cacheKey, ".deps");
+
+  if(!(sys::fs::exists(bcPath) && sys::fs::exists(depsPath)))
+    return false;
+
+  if(!cacheDepsValid(depsPath)) {
+
+    errs() << "Specialisation cache entry " << cacheKey << " is stale\n";
+    return false;
+
+  }
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(bcPath);
+  if(std::error_code ec = MB.getError()) {
+
+    errs() << "Failed to load " << bcPath << ": " << ec.message() << "\n";
+    return false;
+
+  }
+
+  ErrorOr<Module*> Cached = parseBitcodeFile(MB->get(), M.getContext());
+  if(std::error_code ec = Cached.getError()) {
+
+    errs() << "Failed to parse " << bcPath << ": " << ec.message() << "\n";
+    return false;
+
+  }
+
+  std::string lliowdPath = getCachePath(cacheKey, ".lliowd");
+  if(!llioConfigFile.empty() && sys::fs::exists(lliowdPath)) {
+
+    if(!copyFile(lliowdPath, llioConfigFile)) {
+
+      errs() << "Failed to restore " << llioConfigFile << " from the specialisation cache\n";
+      delete *Cached;
+      return false;
+
+    }
+
+  }
+
+  replaceModuleContents(M, *Cached);
+  loadedFromCache = true;
+
+  errs() << "Using cached specialisation " << bcPath << "\n";
+  return true;
+
+}
+
+void LLPEAnalysisPass::saveToCache(Module& M) {
+
+  if(cacheKey.empty())
+    return;
+
+  if(!cacheable) {
+
+    errs() << "Not caching this specialisation: it depends on non-repeatable input\n";
+    return;
+
+  }
+
+  if(std::error_code ec = sys::fs::create_directories(CacheDir)) {
+
+    errs() << "Failed to create " << CacheDir << ": " << ec.message() << "\n";
+    return;
+
+  }
+
+  // Write the dependency list last, as its presence marks the entry complete.
+  std::string bcPath = getCachePath(cacheKey, ".bc");
+  std::string depsPath = getCachePath(cacheKey, ".deps");
+
+  {
+    std::error_code error;
+    raw_fd_ostream RFO(bcPath.c_str(), error, sys::fs::F_None);
+    if(error) {
+      errs() << "Failed to open " << bcPath << ": " << error.message() << "\n";
+      return;
+    }
+    WriteBitcodeToFile(&M, RFO);
+  }
+
+  if(!llioConfigFile.empty())
+    copyFile(llioConfigFile, getCachePath(cacheKey, ".lliowd"));
+
+  std::string deps;
+  raw_string_ostream RSO(deps);
+
+  for(std::vector<std::string>::iterator it = cacheDependentFiles.begin(),
+	itend = cacheDependentFiles.end(); it != itend; ++it) {
+
+    SmallVector<char, 256> absPath(it->begin(), it->end());
+    sys::fs::make_absolute(absPath);
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    std::string absPathStr(absPath.data(), absPath.size());
+    if(!getFileSha1(absPathStr, hash)) {
+      errs() << "Not caching this specialisation: failed to hash " << absPathStr << "\n";
+      return;
+    }
+
+    RSO << hashToString(hash) << " " << absPathStr << "\n";
+
+  }
+
+  RSO.flush();
+
+  std::error_code error;
+  raw_fd_ostream RFO(depsPath.c_str(), error, sys::fs::F_None);
+  if(error) {
+    errs() << "Failed to open " << depsPath << ": " << error.message() << "\n";
+    return;
+  }
+
+  RFO << deps;
+
+}
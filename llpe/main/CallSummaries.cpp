@@ -0,0 +1,205 @@
+//===-- CallSummaries.cpp -------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Mod summaries for calls to defined functions that aren't expanded, such as recursive
+// calls off the certain path or callees refused by the inlining heuristics. Ordinarily
+// such a call clobbers every escaped object and all FD state. If instead everything the
+// callee (and anything it calls) writes is either its own stack, a global named
+// directly, or an object reached directly from one of its pointer arguments, the call
+// need only clobber those objects, and objects passed to nocapture arguments don't escape.
+//
+// Summaries are computed once per module, optimistically: every defined function
+// starts out writing nothing, and write sets grow until they stop changing, so
+// recursive functions receive summaries too. A function that uses an indirect call,
+// inline assembly, a declared function that may write memory, or writes through a
+// pointer that isn't resolved as above is marked writesUnknown and is treated as before.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+
+using namespace llvm;
+
+static cl::opt<bool> NoCallSummaries("int-no-call-summaries");
+
+// Returns true if S changed.
+static bool noteWriteThrough(Value* Ptr, CallModSummary& S) {
+
+  if(S.writesUnknown)
+    return false;
+
+  Value* Obj = GetUnderlyingObject(Ptr);
+
+  if(isa<AllocaInst>(Obj))
+    return false;
+
+  if(Argument* A = dyn_cast<Argument>(Obj)) {
+
+    if(S.writesArg[A->getArgNo()])
+      return false;
+    S.writesArg[A->getArgNo()] = true;
+    return true;
+
+  }
+
+  if(GlobalVariable* GV = dyn_cast<GlobalVariable>(Obj))
+    return S.writesGlobals.insert(GV);
+
+  S.writesUnknown = true;
+  return true;
+
+}
+
+static bool noteNestedCall(Instruction* I, Function* Callee, CallModSummary& S, DenseMap<Function*, CallModSummary>& Summaries) {
+
+  if(S.writesUnknown)
+    return false;
+
+  if(Callee && Callee->onlyReadsMemory())
+    return false;
+
+  if(IntrinsicInst* II = dyn_cast<IntrinsicInst>(I)) {
+
+    switch(II->getIntrinsicID()) {
+    case Intrinsic::lifetime_start:
+    case Intrinsic::lifetime_end:
+    case Intrinsic::invariant_start:
+    case Intrinsic::invariant_end:
+      return false;
+    default:
+      break;
+    }
+
+  }
+
+  DenseMap<Function*, CallModSummary>::iterator findit;
+  if((!Callee) || (findit = Summaries.find(Callee)) == Summaries.end()) {
+    S.writesUnknown = true;
+    return true;
+  }
+
+  CallModSummary& CalleeS = findit->second;
+  if(CalleeS.writesUnknown) {
+    S.writesUnknown = true;
+    return true;
+  }
+
+  bool changed = false;
+
+  for(SmallPtrSet<GlobalVariable*, 4>::iterator it = CalleeS.writesGlobals.begin(),
+	itend = CalleeS.writesGlobals.end(); it != itend; ++it)
+    changed |= S.writesGlobals.insert(*it);
+
+  CallInst* CI = dyn_cast<CallInst>(I);
+  InvokeInst* Inv = dyn_cast<InvokeInst>(I);
+  uint32_t nArgs = CI ? CI->getNumArgOperands() : Inv->getNumArgOperands();
+
+  // Varargs are never written through: the callee uses va_start, which is unknown.
+  for(uint32_t i = 0; i != nArgs && i != CalleeS.writesArg.size(); ++i) {
+
+    if(!CalleeS.writesArg[i])
+      continue;
+
+    changed |= noteWriteThrough(CI ? CI->getArgOperand(i) : Inv->getArgOperand(i), S);
+
+  }
+
+  return changed;
+
+}
+
+static bool updateSummary(Function& F, CallModSummary& S, DenseMap<Function*, CallModSummary>& Summaries) {
+
+  bool changed = false;
+
+  for(Function::iterator BI = F.begin(), BE = F.end(); BI != BE && !S.writesUnknown; ++BI) {
+
+    for(BasicBlock::iterator II = BI->begin(), IE = BI->end(); II != IE && !S.writesUnknown; ++II) {
+
+      Instruction* I = II;
+
+      if(StoreInst* StoreI = dyn_cast<StoreInst>(I))
+	changed |= noteWriteThrough(StoreI->getPointerOperand(), S);
+      else if(AtomicRMWInst* RMW = dyn_cast<AtomicRMWInst>(I))
+	changed |= noteWriteThrough(RMW->getPointerOperand(), S);
+      else if(AtomicCmpXchgInst* CX = dyn_cast<AtomicCmpXchgInst>(I))
+	changed |= noteWriteThrough(CX->getPointerOperand(), S);
+      else if(VAArgInst* VA = dyn_cast<VAArgInst>(I))
+	changed |= noteWriteThrough(VA->getPointerOperand(), S);
+      else if(MemIntrinsic* MI = dyn_cast<MemIntrinsic>(I))
+	changed |= noteWriteThrough(MI->getDest(), S);
+      else if(CallInst* CI = dyn_cast<CallInst>(I)) {
+
+	if(isa<InlineAsm>(CI->getCalledValue())) {
+	  S.writesUnknown = true;
+	  changed = true;
+	}
+	else {
+	  changed |= noteNestedCall(CI, CI->getCalledFunction(), S, Summaries);
+	}
+
+      }
+      else if(InvokeInst* Inv = dyn_cast<InvokeInst>(I))
+	changed |= noteNestedCall(Inv, Inv->getCalledFunction(), S, Summaries);
+
+    }
+
+  }
+
+  return changed;
+
+}
+
+void LLPEAnalysisPass::computeCallModSummaries(Module& M) {
+
+  callModSummariesComputed = true;
+
+  if(NoCallSummaries)
+    return;
+
+  // A definition that may be replaced at link time can't be summarised, nor can one whose
+  // body hasn't been read from a lazily loaded module yet.
+  for(Module::iterator it = M.begin(), itend = M.end(); it != itend; ++it) {
+
+    if(it->isDeclaration() || it->mayBeOverridden() || it->isMaterializable())
+      continue;
+
+    CallModSummary& S = callModSummaries[it];
+    S.writesArg.resize(it->arg_size(), false);
+
+  }
+
+  bool changed;
+  do {
+
+    changed = false;
+    for(DenseMap<Function*, CallModSummary>::iterator it = callModSummaries.begin(),
+	  itend = callModSummaries.end(); it != itend; ++it)
+      changed |= updateSummary(*it->first, it->second, callModSummaries);
+
+  } while(changed);
+
+}
+
+const CallModSummary* LLPEAnalysisPass::getCallModSummary(Function* F) {
+
+  if(!callModSummariesComputed)
+    computeCallModSummaries(*F->getParent());
+
+  DenseMap<Function*, CallModSummary>::iterator findit = callModSummaries.find(F);
+  if(findit == callModSummaries.end() || findit->second.writesUnknown)
+    return 0;
+
+  return &findit->second;
+
+}
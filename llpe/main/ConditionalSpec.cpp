@@ -12,9 +12,13 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/Support/MathExtras.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include <fcntl.h>
 
 using namespace llvm;
 
@@ -183,52 +187,98 @@ bool IntegrationAttempt::tryGetAsDefPathValue(ShadowValue V, ShadowBB* UserBlock
 
 }
 
-bool IntegrationAttempt::tryGetPathValueFrom(PathConditions& PC, uint32_t myStackDepth, ShadowValue V, ShadowBB* UserBlock, std::pair<ValSetType, ImprovedVal>& Result, bool asDef) {
+void PathConditions::buildIndex() {
 
-  ShadowInstruction* SI = V.getInst();
-  ShadowArg* SA = V.getArg();
-  if((!SI) && (!SA))
-    return false;
+  byFromBlock.clear();
+  intByInstBlock.clear();
+  asDefByInstBlock.clear();
 
-  std::vector<PathCondition>& PCs = asDef ? PC.AsDefIntPathConditions : PC.IntPathConditions;
+  for(std::vector<PathCondition>::iterator it = IntPathConditions.begin(), itend = IntPathConditions.end(); it != itend; ++it) {
+    byFromBlock[std::make_pair(it->fromStackIdx, it->fromBB)].Int.push_back(&*it);
+    intByInstBlock[std::make_pair(it->instStackIdx, it->instBB)].push_back(&*it);
+  }
 
-  for(std::vector<PathCondition>::iterator it = PCs.begin(), itend = PCs.end(); it != itend; ++it) {
+  for(std::vector<PathCondition>::iterator it = AsDefIntPathConditions.begin(), itend = AsDefIntPathConditions.end(); it != itend; ++it) {
+    byFromBlock[std::make_pair(it->fromStackIdx, it->fromBB)].AsDef.push_back(&*it);
+    asDefByInstBlock[std::make_pair(it->instStackIdx, it->instBB)].push_back(&*it);
+  }
 
-    /* fromStackIdx must equal instStackIdx for this kind of condition */
+  for(std::vector<PathCondition>::iterator it = StringPathConditions.begin(), itend = StringPathConditions.end(); it != itend; ++it)
+    byFromBlock[std::make_pair(it->fromStackIdx, it->fromBB)].String.push_back(&*it);
 
-    if(it->instStackIdx == myStackDepth) {
-      
-      bool match = false;
+  for(std::vector<PathCondition>::iterator it = IntmemPathConditions.begin(), itend = IntmemPathConditions.end(); it != itend; ++it)
+    byFromBlock[std::make_pair(it->fromStackIdx, it->fromBB)].Intmem.push_back(&*it);
 
-      if(SI && 
-	 it->instBB == SI->parent->invar->BB &&
-	 it->instIdx == SI->invar->idx) {
+  for(std::vector<PathCondition>::iterator it = StreamPathConditions.begin(), itend = StreamPathConditions.end(); it != itend; ++it)
+    byFromBlock[std::make_pair(it->fromStackIdx, it->fromBB)].Stream.push_back(&*it);
 
-	if(getFunctionRoot()->DT->dominates(it->fromBB, UserBlock->invar->BB))
-	  match = true;
+  for(std::vector<PathFunc>::iterator it = FuncPathConditions.begin(), itend = FuncPathConditions.end(); it != itend; ++it)
+    byFromBlock[std::make_pair(it->stackIdx, it->BB)].Func.push_back(&*it);
 
-      }
-      else if(SA &&
-	      it->instBB == (BasicBlock*)ULONG_MAX &&
-	      it->instIdx == SA->invar->A->getArgNo()) {
+  indexedConditions = IntPathConditions.size() + AsDefIntPathConditions.size() + StringPathConditions.size() +
+    IntmemPathConditions.size() + StreamPathConditions.size() + FuncPathConditions.size();
 
-	match = true;
+}
 
-      }
+static void checkPathConditionIndex(PathConditions& PC) {
 
-      if(match) {
+  // Conditions are only ever added, so a change in the count means the index is stale.
+  size_t total = PC.IntPathConditions.size() + PC.AsDefIntPathConditions.size() + PC.StringPathConditions.size() +
+    PC.IntmemPathConditions.size() + PC.StreamPathConditions.size() + PC.FuncPathConditions.size();
+  if(total != PC.indexedConditions)
+    PC.buildIndex();
 
-	// Make sure a failed version of the from-block and its successors is created:
-	uint32_t fromBlockIdx = findBlock(UserBlock->IA->invarInfo, it->fromBB);
-	getFunctionRoot()->markBlockAndSuccsFailed(fromBlockIdx, 0);
+}
 
-	Result.first = ValSetTypeScalar;
-	Result.second.V = it->u.val;
-	return true;
-	
-      }
+BlockPathConditions* PathConditions::getFromBlock(uint32_t stackIdx, BasicBlock* BB) {
 
-    }
+  checkPathConditionIndex(*this);
+  DenseMap<BlockKey, BlockPathConditions>::iterator findit = byFromBlock.find(std::make_pair(stackIdx, BB));
+  return findit == byFromBlock.end() ? 0 : &findit->second;
+
+}
+
+SmallVector<PathCondition*, 1>* PathConditions::getForInstBlock(bool asDef, uint32_t stackIdx, BasicBlock* BB) {
+
+  checkPathConditionIndex(*this);
+  DenseMap<BlockKey, SmallVector<PathCondition*, 1> >& Map = asDef ? asDefByInstBlock : intByInstBlock;
+  DenseMap<BlockKey, SmallVector<PathCondition*, 1> >::iterator findit = Map.find(std::make_pair(stackIdx, BB));
+  return findit == Map.end() ? 0 : &findit->second;
+
+}
+
+bool IntegrationAttempt::tryGetPathValueFrom(PathConditions& PC, uint32_t myStackDepth, ShadowValue V, ShadowBB* UserBlock, std::pair<ValSetType, ImprovedVal>& Result, bool asDef) {
+
+  ShadowInstruction* SI = V.getInst();
+  ShadowArg* SA = V.getArg();
+  if((!SI) && (!SA))
+    return false;
+
+  BasicBlock* instBB = SI ? SI->parent->invar->BB : (BasicBlock*)ULONG_MAX;
+  uint32_t instIdx = SI ? SI->invar->idx : SA->invar->A->getArgNo();
+
+  SmallVector<PathCondition*, 1>* PCs = PC.getForInstBlock(asDef, myStackDepth, instBB);
+  if(!PCs)
+    return false;
+
+  for(SmallVector<PathCondition*, 1>::iterator it = PCs->begin(), itend = PCs->end(); it != itend; ++it) {
+
+    /* fromStackIdx must equal instStackIdx for this kind of condition */
+
+    PathCondition* Cond = *it;
+    if(Cond->instIdx != instIdx)
+      continue;
+
+    if(SI && !getFunctionRoot()->DT->dominates(Cond->fromBB, UserBlock->invar->BB))
+      continue;
+
+    // Make sure a failed version of the from-block and its successors is created:
+    uint32_t fromBlockIdx = findBlock(UserBlock->IA->invarInfo, Cond->fromBB);
+    getFunctionRoot()->markBlockAndSuccsFailed(fromBlockIdx, 0);
+
+    Result.first = ValSetTypeScalar;
+    Result.second.V = Cond->u.val;
+    return true;
 
   }
 
@@ -323,9 +373,9 @@ void IntegrationAttempt::applyPathCondition(PathCondition* it, PathConditionType
       pass->fds.push_back(FDGlobalState(0, /* is a fifo */ true));
       /* Pseudo FD is born waiting for a representitive value */
       pass->fds.back().isCommitted = true; 
-      if(FDS->fds.size() <= newId)
-	FDS->fds.resize(newId + 1);
-      FDS->fds[newId] = FDState(std::string(fname));
+      if(FDS->size() <= newId)
+	FDS->resize(newId + 1);
+      FDS->getWritableFD(newId) = FDState(std::string(fname));
 
       ImprovedValSetSingle writeVal;
       writeVal.set(ImprovedVal(ShadowValue::getFdIdx(newId)), ValSetTypeFD);
@@ -341,7 +391,7 @@ void IntegrationAttempt::applyPathCondition(PathCondition* it, PathConditionType
       getImprovedValSetSingle(ShadowValue(it->u.val), writeVal);
 
       // Attribute the effect of the write to first instruction in block:
-      executeWriteInst(0, writePtr, writeVal, GlobalAA->getTypeStoreSize(it->u.val->getType()), &(BB->insts[0]));
+      executeWriteInst(0, writePtr, writeVal, getTypeStoreSize(it->u.val->getType()), &(BB->insts[0]));
 
     }
 
@@ -360,19 +410,19 @@ void llvm::clearAsExpectedChecks(ShadowBB* BB) {
 
 }
 
-void IntegrationAttempt::noteAsExpectedChecksFrom(ShadowBB* BB, std::vector<PathCondition>& PCs, uint32_t stackIdx) {
+void IntegrationAttempt::noteAsExpectedChecksFrom(ShadowBB* BB, PathConditions& PC, uint32_t stackIdx) {
 
-  for(std::vector<PathCondition>::iterator it = PCs.begin(), itend = PCs.end(); it != itend; ++it) {
+  BlockPathConditions* BPC = PC.getFromBlock(stackIdx, BB->invar->BB);
+  if(!BPC)
+    return;
 
-    if(it->fromStackIdx == stackIdx && it->fromBB == BB->invar->BB) {
+  for(SmallVector<PathCondition*, 1>::iterator it = BPC->AsDef.begin(), itend = BPC->AsDef.end(); it != itend; ++it) {
 
-      release_assert(it->fromStackIdx == it->instStackIdx && it->fromBB == it->instBB);
+    release_assert((*it)->fromStackIdx == (*it)->instStackIdx && (*it)->fromBB == (*it)->instBB);
 
-      // This flag indicates the path condition should be checked on definition, rather than
-      // at the top of the block as for conditions that don't always apply.
-      BB->insts[it->instIdx].needsRuntimeCheck = RUNTIME_CHECK_AS_EXPECTED;
-      
-    }
+    // This flag indicates the path condition should be checked on definition, rather than
+    // at the top of the block as for conditions that don't always apply.
+    BB->insts[(*it)->instIdx].needsRuntimeCheck = RUNTIME_CHECK_AS_EXPECTED;
 
   }
 
@@ -381,14 +431,14 @@ void IntegrationAttempt::noteAsExpectedChecksFrom(ShadowBB* BB, std::vector<Path
 void IntegrationAttempt::noteAsExpectedChecks(ShadowBB* BB) {
 
   if(invarInfo->pathConditions)
-    noteAsExpectedChecksFrom(BB, invarInfo->pathConditions->AsDefIntPathConditions, UINT_MAX);
+    noteAsExpectedChecksFrom(BB, *invarInfo->pathConditions, UINT_MAX);
 
 }
 
 void InlineAttempt::noteAsExpectedChecks(ShadowBB* BB) {
 
   if(targetCallInfo)
-    noteAsExpectedChecksFrom(BB, pass->pathConditions.AsDefIntPathConditions, targetCallInfo->targetStackDepth);
+    noteAsExpectedChecksFrom(BB, pass->pathConditions, targetCallInfo->targetStackDepth);
 
   IntegrationAttempt::noteAsExpectedChecks(BB);
 
@@ -412,94 +462,86 @@ void InlineAttempt::applyMemoryPathConditions(ShadowBB* BB, bool inLoopAnalyser,
 
 void IntegrationAttempt::applyMemoryPathConditionsFrom(ShadowBB* BB, PathConditions& PC, uint32_t targetStackDepth, bool inLoopAnalyser, bool inAnyLoop) {
 
-  for(std::vector<PathCondition>::iterator it = PC.StringPathConditions.begin(),
-	itend = PC.StringPathConditions.end(); it != itend; ++it) {
-
-    applyPathCondition(&*it, PathConditionTypeString, BB, targetStackDepth);
+  BlockPathConditions* BPC = PC.getFromBlock(targetStackDepth, BB->invar->BB);
+  if(!BPC)
+    return;
 
-  }
+  for(SmallVector<PathCondition*, 1>::iterator it = BPC->String.begin(), itend = BPC->String.end(); it != itend; ++it)
+    applyPathCondition(*it, PathConditionTypeString, BB, targetStackDepth);
 
-  for(std::vector<PathCondition>::iterator it = PC.IntmemPathConditions.begin(),
-	itend = PC.IntmemPathConditions.end(); it != itend; ++it) {  
+  for(SmallVector<PathCondition*, 1>::iterator it = BPC->Intmem.begin(), itend = BPC->Intmem.end(); it != itend; ++it)
+    applyPathCondition(*it, PathConditionTypeIntmem, BB, targetStackDepth);
 
-    applyPathCondition(&*it, PathConditionTypeIntmem, BB, targetStackDepth);
+  for(SmallVector<PathCondition*, 1>::iterator it = BPC->Stream.begin(), itend = BPC->Stream.end(); it != itend; ++it)
+    applyPathCondition(*it, PathConditionTypeStream, BB, targetStackDepth);
 
-  }
+  for(SmallVector<PathFunc*, 1>::iterator fit = BPC->Func.begin(), fitend = BPC->Func.end(); fit != fitend; ++fit) {
 
-  for(std::vector<PathCondition>::iterator it = PC.StreamPathConditions.begin(),
-	itend = PC.StreamPathConditions.end(); it != itend; ++it) {
+    PathFunc* it = *fit;
 
-    applyPathCondition(&*it, PathConditionTypeStream, BB, targetStackDepth);
+    // Insert a model call that notionally occurs before the block begins.
+    // Notionally its callsite is the first instruction in BB; this is probably not a call
+    // instruction, but since its arguments are pushed in rather than pulled it doesn't matter.
 
-  }
+    if(!it->IA) {
+      InlineAttempt* SymIA = new InlineAttempt(pass, *it->F, &BB->insts[0], this->nesting_depth + 1, true);
+      it->IA = SymIA;
+    }
 
-  for(std::vector<PathFunc>::iterator it = PC.FuncPathConditions.begin(),
-	itend = PC.FuncPathConditions.end(); it != itend; ++it) {
+    for(unsigned i = 0, ilim = it->args.size(); i != ilim; ++i) {
 
-    if(it->stackIdx == targetStackDepth && it->BB == BB->invar->BB) {
+      PathFuncArg& A = it->args[i];
 
-      // Insert a model call that notionally occurs before the block begins.
-      // Notionally its callsite is the first instruction in BB; this is probably not a call
-      // instruction, but since its arguments are pushed in rather than pulled it doesn't matter.
+      ShadowArg* SArg = &(it->IA->argShadows[i]);
+      ShadowValue Op = getPathConditionOperand(A.stackIdx, A.instBB, A.instIdx);
 
-      if(!it->IA) {
-	InlineAttempt* SymIA = new InlineAttempt(pass, *it->F, &BB->insts[0], this->nesting_depth + 1, true);
-	it->IA = SymIA;
+      // Can't use noteIndirectUse since that deals with allocations being used by synthetic
+      // pointers and the similar case of FDs.
+      if(Op.isInst() || Op.isArg()) {
+	std::vector<std::pair<ShadowValue, uint32_t> >& Users = GlobalIHP->indirectDIEUsers[Op];
+	// TODO: figure out what to register the dependency against
+	// when indirectDIEUsers stops being a simple set of used things.
+	// Meanwhile pin Op so that whole-object DIE leaves it alone (see noteObjectUser).
+	if(Users.empty() || !Users.back().first.isInval())
+	  Users.push_back(std::make_pair(ShadowValue(), 0));
       }
 
-      for(unsigned i = 0, ilim = it->args.size(); i != ilim; ++i) {
-
-	PathFuncArg& A = it->args[i];
-
-	ShadowArg* SArg = &(it->IA->argShadows[i]);
-	ShadowValue Op = getPathConditionOperand(A.stackIdx, A.instBB, A.instIdx);
-
-	// Can't use noteIndirectUse since that deals with allocations being used by synthetic
-	// pointers and the similar case of FDs.
-	if(Op.isInst() || Op.isArg()) {
-	  std::vector<std::pair<ShadowValue, uint32_t> >& Users = GlobalIHP->indirectDIEUsers[Op];
-	  // TODO: figure out what to register the dependency against
-	  // when indirectDIEUsers stops being a simple set of used things.
-	}
-    
-	release_assert((!SArg->i.PB) && "Path condition functions shouldn't be reentrant");
+      release_assert((!SArg->i.PB) && "Path condition functions shouldn't be reentrant");
 
-	copyImprovedVal(Op, SArg->i.PB);
+      copyImprovedVal(Op, SArg->i.PB);
 
-      }
-
-      it->IA->activeCaller = &BB->insts[0];
-      it->IA->analyseNoArgs(inLoopAnalyser, inAnyLoop, stack_depth);
+    }
 
-      // This is a bit of a hack -- the whole context is obviously ordained not to
-      // be committed from the start and only exists for its side-effects -- but
-      // path conditions are rare and it's simplest to treat it like we decided to disable
-      // the context after the fact like the normal InlineAttempt analyse path.
-      it->IA->markAllocationsAndFDsCommitted();
-      it->IA->releaseCommittedChildren();
+    it->IA->activeCaller = &BB->insts[0];
+    it->IA->analyseNoArgs(inLoopAnalyser, inAnyLoop, stack_depth);
 
-      doCallStoreMerge(BB, it->IA);
+    // This is a bit of a hack -- the whole context is obviously ordained not to
+    // be committed from the start and only exists for its side-effects -- but
+    // path conditions are rare and it's simplest to treat it like we decided to disable
+    // the context after the fact like the normal InlineAttempt analyse path.
+    it->IA->markAllocationsAndFDsCommitted();
+    it->IA->releaseCommittedChildren();
 
-      if(!inLoopAnalyser) {
+    doCallStoreMerge(BB, it->IA);
 
-	  doTLCallMerge(BB, it->IA);
+    if(!inLoopAnalyser) {
 
-	  // Symbolic function has no effect on DSE: it doesn't register its stores for later
-	  // elimination, and doesn't contribute to eliminating other stores either.
+	doTLCallMerge(BB, it->IA);
 
-	  doDSECallMerge(BB, it->IA);
-	  BB->dseStore->dropReference();
-	  BB->dseStore = it->IA->backupDSEStore;
-	  BB->dseStore->refCount++;
+	// Symbolic function has no effect on DSE: it doesn't register its stores for later
+	// elimination, and doesn't contribute to eliminating other stores either.
 
-	  it->IA->releaseBackupStores();
+	doDSECallMerge(BB, it->IA);
+	BB->dseStore->dropReference();
+	BB->dseStore = it->IA->backupDSEStore;
+	BB->dseStore->refCount++;
 
-      }
-      
-      // Make sure a failed version of this block and its successors is created:
-      getFunctionRoot()->markBlockAndSuccsFailed(BB->invar->idx, 0);
+	it->IA->releaseBackupStores();
 
     }
+    
+    // Make sure a failed version of this block and its successors is created:
+    getFunctionRoot()->markBlockAndSuccsFailed(BB->invar->idx, 0);
 
   }
 
@@ -555,6 +597,7 @@ void InlineAttempt::initFailedBlockCommit() {
     failedBlockMap = 0;
     PHIForwards = 0;
     ForwardingPHIs = 0;
+    failedLoopBreaks = 0;
     return; 
   }
 
@@ -562,6 +605,7 @@ void InlineAttempt::initFailedBlockCommit() {
   failedBlockMap = new ValueToValueMapTy(NextPowerOf2((blocksReachableOnFailure->size() * 3) - 1));
   PHIForwards = new DenseMap<std::pair<Instruction*, BasicBlock*>, PHINode*>();
   ForwardingPHIs = new DenseSet<PHINode*>();
+  failedLoopBreaks = new DenseMap<const ShadowLoopInvar*, bool>();
 
 }
 
@@ -572,49 +616,18 @@ void InlineAttempt::finishFailedBlockCommit() {
   delete failedBlockMap; failedBlockMap = 0;
   delete PHIForwards; PHIForwards = 0;
   delete ForwardingPHIs; ForwardingPHIs = 0;
-
-}
-
-struct matchesFromIdx {
-
-  BasicBlock* BB;
-  uint32_t stackIdx;
-
-  bool operator()(PathCondition& C) { 
-
-    return C.fromBB == BB && C.fromStackIdx == stackIdx; 
-
-  }
-
-  matchesFromIdx(BasicBlock* _BB, uint32_t si) : BB(_BB), stackIdx(si) {}
-
-};
-
-static uint32_t countPathConditionsIn(BasicBlock* BB, uint32_t stackIdx, std::vector<PathCondition>& Conds) {
-
-  matchesFromIdx Pred(BB, stackIdx);
-  return std::count_if(Conds.begin(), Conds.end(), Pred);
+  delete failedLoopBreaks; failedLoopBreaks = 0;
 
 }
 
 static uint32_t countPathConditionsAtBlockStartIn(ShadowBBInvar* BB, uint32_t stackIdx, PathConditions& PCs) {
 
-  BasicBlock* B = BB->BB;
-
-  uint32_t nPCs = countPathConditionsIn(B, stackIdx, PCs.IntPathConditions) +
-    countPathConditionsIn(B, stackIdx, PCs.StringPathConditions) +
-    countPathConditionsIn(B, stackIdx, PCs.IntmemPathConditions);
-
-  for(std::vector<PathFunc>::iterator it = PCs.FuncPathConditions.begin(),
-	itend = PCs.FuncPathConditions.end(); it != itend; ++it) {
+  BlockPathConditions* BPC = PCs.getFromBlock(stackIdx, BB->BB);
+  if(!BPC)
+    return 0;
 
-    if(it->stackIdx == stackIdx && it->BB == BB->BB)
-      ++nPCs;
+  return BPC->Int.size() + BPC->String.size() + BPC->Intmem.size() + BPC->Func.size();
 
-  }
-  
-  return nPCs;
-  
 }
 
 uint32_t LLPEAnalysisPass::countPathConditionsAtBlockStart(ShadowBBInvar* BB, IntegrationAttempt* IA) {
@@ -782,7 +795,7 @@ void IntegrationAttempt::emitPathConditionCheck(PathCondition& Cond, PathConditi
     }
 
     escapePercent(msg);
-    emitRuntimePrint(emitCB.breakBlock, msg, 0);
+    emitCheckFailure(emitCB.breakBlock, msg);
 
     BranchInst::Create(failTarget, emitCB.breakBlock);
     failTarget = emitCB.breakBlock;
@@ -790,29 +803,31 @@ void IntegrationAttempt::emitPathConditionCheck(PathCondition& Cond, PathConditi
   }
   
   release_assert(emitBlockIt->specBlock && failTarget && resultInst);
-  BranchInst::Create(emitBlockIt->specBlock, failTarget, resultInst, emitBlock);
+  BranchInst* checkBI = BranchInst::Create(emitBlockIt->specBlock, failTarget, resultInst, emitBlock);
+  setCheckBranchWeights(checkBI, failTarget);
 
 }
 
-void IntegrationAttempt::emitPathConditionChecksIn(std::vector<PathCondition>& Conds, PathConditionTypes Ty, ShadowBB* BB, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt) {
+void IntegrationAttempt::emitPathConditionChecksIn(SmallVector<PathCondition*, 1>& Conds, PathConditionTypes Ty, ShadowBB* BB, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt) {
 
-  for(std::vector<PathCondition>::iterator it = Conds.begin(), itend = Conds.end(); it != itend; ++it)
-    emitPathConditionCheck(*it, Ty, BB, stackIdx, emitBlockIt);
+  for(SmallVector<PathCondition*, 1>::iterator it = Conds.begin(), itend = Conds.end(); it != itend; ++it)
+    emitPathConditionCheck(**it, Ty, BB, stackIdx, emitBlockIt);
 
 }
 
 void IntegrationAttempt::emitPathConditionChecks2(ShadowBB* BB, PathConditions& PC, uint32_t stackIdx, SmallVector<CommittedBlock, 1>::iterator& emitBlockIt) {
 
-  emitPathConditionChecksIn(PC.IntPathConditions, PathConditionTypeInt, BB, stackIdx, emitBlockIt);
-  emitPathConditionChecksIn(PC.StringPathConditions, PathConditionTypeString, BB, stackIdx, emitBlockIt);
-  emitPathConditionChecksIn(PC.IntmemPathConditions, PathConditionTypeIntmem, BB, stackIdx, emitBlockIt);
+  BlockPathConditions* BPC = PC.getFromBlock(stackIdx, BB->invar->BB);
+  if(!BPC)
+    return;
 
-  for(std::vector<PathFunc>::iterator it = PC.FuncPathConditions.begin(), 
-	itend = PC.FuncPathConditions.end(); it != itend; ++it) {
+  emitPathConditionChecksIn(BPC->Int, PathConditionTypeInt, BB, stackIdx, emitBlockIt);
+  emitPathConditionChecksIn(BPC->String, PathConditionTypeString, BB, stackIdx, emitBlockIt);
+  emitPathConditionChecksIn(BPC->Intmem, PathConditionTypeIntmem, BB, stackIdx, emitBlockIt);
 
-    if(stackIdx != it->stackIdx || BB->invar->BB != it->BB)
-      continue;
+  for(SmallVector<PathFunc*, 1>::iterator fit = BPC->Func.begin(), fitend = BPC->Func.end(); fit != fitend; ++fit) {
 
+    PathFunc* it = *fit;
     CommittedBlock& emitCB = *(emitBlockIt++);
     BasicBlock* emitBlock = emitCB.specBlock;
 
@@ -869,7 +884,7 @@ void IntegrationAttempt::emitPathConditionChecks2(ShadowBB* BB, PathConditions&
 	RSO << msg << "%d\n";
       }
 
-      emitRuntimePrint(emitCB.breakBlock, pasted, VCall);
+      emitCheckFailure(emitCB.breakBlock, pasted, VCall);
 
       BranchInst::Create(failTarget, emitCB.breakBlock);
       failTarget = emitCB.breakBlock;
@@ -878,7 +893,8 @@ void IntegrationAttempt::emitPathConditionChecks2(ShadowBB* BB, PathConditions&
     
     // Branch to next check or to failed block.
     release_assert(emitBlockIt->specBlock && failTarget && VCond);
-    BranchInst::Create(emitBlockIt->specBlock, failTarget, VCond, emitBlock);
+    BranchInst* checkBI = BranchInst::Create(emitBlockIt->specBlock, failTarget, VCond, emitBlock);
+    setCheckBranchWeights(checkBI, failTarget);
 
   }
 
@@ -1515,6 +1531,50 @@ static PHINode* insertMergePHI(ShadowInstructionInvar& SI, SmallVector<std::pair
 
 }
 
+// Are there any breaks in the loop body? These can be due to instruction checks
+// or path conditions but not can't-reach-target conditions.
+// This is the same for every instruction forwarded through the loop, so cache it.
+bool InlineAttempt::failedLoopHasBreaks(const ShadowLoopInvar* LInfo) {
+
+  DenseMap<const ShadowLoopInvar*, bool>::iterator findit = failedLoopBreaks->find(LInfo);
+  if(findit != failedLoopBreaks->end())
+    return findit->second;
+
+  bool loopHasBreaks = false;
+  for(uint32_t j = LInfo->headerIdx, jlim = LInfo->latchIdx + 1; j != jlim && !loopHasBreaks; ++j) {
+
+    ShadowBBInvar* jbbi = getBBInvar(j);
+
+    // Block is broken into pieces due to a mid-block check?
+    if(failedBlocks[j].size() > 1)
+      loopHasBreaks = true;
+
+    // Will there be incoming edges from specialised code due to path conditions?
+    else if(pass->countPathConditionsAtBlockStart(jbbi, this))
+      loopHasBreaks = true;
+
+    // Do invoke instructions within the loop cause break edges on an existing block boundary?
+    else if(isa<InvokeInst>(jbbi->BB->getTerminator())) {
+
+      if(jbbi->naturalScope->contains(getBBInvar(jbbi->succIdxs[0])->naturalScope) &&
+	 hasInvokeBreaks(jbbi->idx, jbbi->succIdxs[0]))
+	loopHasBreaks = true;
+      else if(jbbi->naturalScope->contains(getBBInvar(jbbi->succIdxs[1])->naturalScope) &&
+	      hasInvokeBreaks(jbbi->idx, jbbi->succIdxs[1]))
+	loopHasBreaks = true;
+
+    }
+
+    else if(hasTopOfBlockVFSChecks(jbbi->idx))
+      loopHasBreaks = true;
+
+  }
+
+  (*failedLoopBreaks)[LInfo] = loopHasBreaks;
+  return loopHasBreaks;
+
+}
+
 void InlineAttempt::createForwardingPHIs(ShadowInstructionInvar& OrigSI, Instruction* NewI) {
 
   // OrigSI is an instruction in the function being specialised; NewI is its failed clone.
@@ -1608,38 +1668,7 @@ void InlineAttempt::createForwardingPHIs(ShadowInstructionInvar& OrigSI, Instruc
 	  release_assert(OrigSI.parent->idx <= LInfo->preheaderIdx);
 	  release_assert(OrigSI.parent->idx + predBlocks.size() >= LInfo->latchIdx);
 
-	  // Are there any breaks in the loop body? These can be due to instruction checks
-	  // or path conditions but not can't-reach-target conditions.
-
-	  bool loopHasBreaks = false;
-	  for(uint32_t j = LInfo->headerIdx, jlim = LInfo->latchIdx + 1; j != jlim && !loopHasBreaks; ++j) {
-
-	    ShadowBBInvar* jbbi = getBBInvar(j);
-
-	    // Block is broken into pieces due to a mid-block check?
-	    if(failedBlocks[j].size() > 1)
-	      loopHasBreaks = true;
-
-	    // Will there be incoming edges from specialised code due to path conditions?
-	    else if(pass->countPathConditionsAtBlockStart(jbbi, this))
-	      loopHasBreaks = true;
-
-	    // Do invoke instructions within the loop cause break edges on an existing block boundary?
-	    else if(isa<InvokeInst>(jbbi->BB->getTerminator())) {
-
-	      if(jbbi->naturalScope->contains(getBBInvar(jbbi->succIdxs[0])->naturalScope) &&
-		 hasInvokeBreaks(jbbi->idx, jbbi->succIdxs[0]))
-		loopHasBreaks = true;
-	      else if(jbbi->naturalScope->contains(getBBInvar(jbbi->succIdxs[1])->naturalScope) &&
-		      hasInvokeBreaks(jbbi->idx, jbbi->succIdxs[1]))
-		loopHasBreaks = true;
-
-	    }
-
-	    else if(hasTopOfBlockVFSChecks(jbbi->idx))
-	      loopHasBreaks = true;
-
-	  }
+	  bool loopHasBreaks = failedLoopHasBreaks(LInfo);
 
 	  Instruction* PreheaderInst = predBlocks[LInfo->preheaderIdx - OrigSI.parent->idx].first;
 
@@ -2794,7 +2823,7 @@ IntegrationAttempt::emitExitPHIChecks(SmallVector<CommittedBlock, 1>::iterator e
     }
     
     escapePercent(msg);
-    emitRuntimePrint(emitCB.breakBlock, msg, 0);
+    emitCheckFailure(emitCB.breakBlock, msg);
 
     BranchInst::Create(failTarget, emitCB.breakBlock);
     failTarget = emitCB.breakBlock;
@@ -2802,12 +2831,28 @@ IntegrationAttempt::emitExitPHIChecks(SmallVector<CommittedBlock, 1>::iterator e
   }
 
   release_assert(successTarget && failTarget && prevCheck);
-  BranchInst::Create(successTarget, failTarget, prevCheck, emitBB); 
+  BranchInst* checkBI = BranchInst::Create(successTarget, failTarget, prevCheck, emitBB);
+  setCheckBranchWeights(checkBI, failTarget);
 
   return emitIt;
 
 }
 
+// Get the value of a copied range that is known to be a single integer filling the range.
+bool llvm::getIVSRangeConstantInt(const IVSRange& R, uint64_t& Out) {
+
+  const ImprovedValSetSingle& IVS = R.second;
+  if(IVS.Values.size() != 1 || IVS.SetType != ValSetTypeScalar)
+    return false;
+
+  Type* Ty = IVS.Values[0].V.getNonPointerType();
+  if(!Ty->isIntegerTy() || Ty->getIntegerBitWidth() != (R.first.second - R.first.first) * 8)
+    return false;
+
+  return tryGetConstantInt(IVS.Values[0].V, Out);
+
+}
+
 Value* IntegrationAttempt::emitMemcpyCheck(ShadowInstruction* SI, BasicBlock* emitBB) {
 
   release_assert(GlobalIHP->memcpyValues.count(SI) && GlobalIHP->memcpyValues[SI].size() && "memcpyValues not set for checked copy?");
@@ -2836,6 +2881,46 @@ Value* IntegrationAttempt::emitMemcpyCheck(ShadowInstruction* SI, BasicBlock* em
     Value* OffsetCI = ConstantInt::get(I64, (uint64_t)ThisOffset);
     Value* ElPtr = GetElementPtrInst::Create(writtenPtr, ArrayRef<Value*>(&OffsetCI, 1), "", emitBB);
 
+    // Abutting integer fields (e.g. a copied struct or short string) are checked with
+    // one wide load and compare rather than one per field.
+    uint64_t mergedVal, nextVal;
+    if(GlobalTD->isLittleEndian() && getIVSRangeConstantInt(*it, mergedVal)) {
+
+      uint64_t mergedBytes = it->first.second - it->first.first;
+      SmallVector<IVSRange, 4>::iterator nextit = it + 1;
+
+      while(nextit != itend && 
+	    nextit->first.first == it->first.first + mergedBytes &&
+	    mergedBytes + (nextit->first.second - nextit->first.first) <= 8 &&
+	    getIVSRangeConstantInt(*nextit, nextVal)) {
+
+	mergedVal |= (nextVal << (mergedBytes * 8));
+	mergedBytes += (nextit->first.second - nextit->first.first);
+	++nextit;
+
+      }
+
+      if(nextit != it + 1) {
+
+	Type* MergedTy = Type::getIntNTy(emitBB->getContext(), mergedBytes * 8);
+	Value* MergedPtr = new BitCastInst(ElPtr, PointerType::getUnqual(MergedTy), "", emitBB);
+	// The fields' own alignment doesn't carry over to the wider type.
+	Value* Loaded = new LoadInst(MergedPtr, "", false, 1, emitBB);
+	Value* thisCheck = new ICmpInst(*emitBB, CmpInst::ICMP_EQ, Loaded, 
+					ConstantInt::get(MergedTy, mergedVal), VerboseNames ? "check" : "");
+
+	if(!prevCheck)
+	  prevCheck = thisCheck;
+	else
+	  prevCheck = BinaryOperator::CreateAnd(prevCheck, thisCheck, "", emitBB);
+
+	it = nextit - 1;
+	continue;
+
+      }
+
+    }
+
     Type* TargetType = PointerType::getUnqual(getValueType(it->second.Values[0].V));
     if(ElPtr->getType() != TargetType)
       ElPtr = new BitCastInst(ElPtr, TargetType, "", emitBB);
@@ -2854,6 +2939,70 @@ Value* IntegrationAttempt::emitMemcpyCheck(ShadowInstruction* SI, BasicBlock* em
 
 }
 
+// Thread checks on loads are batched: when a load must be checked, later loads in the same
+// block that need only a thread check are emitted early and checked along with it, up to the
+// next instruction that may write memory or synchronise. Failing the combined check leaves by
+// the first load's failed path, which simply repeats the later loads, so each batch pays for
+// one branch instead of one per load. A load can't move above the first one if its address is
+// only computed in between.
+
+static cl::opt<unsigned> ThreadCheckBatch("int-thread-check-batch", cl::init(8));
+
+static LLPEStat BatchedThreadChecks("batched_thread_checks", "Thread checks folded into an earlier load's check");
+
+static bool isBatchableThreadCheck(ShadowInstruction* SI) {
+
+  LoadInst* LI = dyn_cast_inst<LoadInst>(SI);
+  return LI && (!LI->isVolatile()) && (!SI->hasOrderingConstraint()) &&
+    SI->isThreadLocal == TLS_MUSTCHECK && SI->needsRuntimeCheck == RUNTIME_CHECK_NONE;
+
+}
+
+Value* IntegrationAttempt::emitBatchedThreadChecks(ShadowInstruction* SI, BasicBlock* emitBB, Value* Check) {
+
+  if((!ThreadCheckBatch) || !isBatchableThreadCheck(SI))
+    return Check;
+
+  ShadowBB* BB = SI->parent;
+  uint32_t nBatched = 0;
+
+  for(uint32_t i = SI->invar->idx + 1, ilim = BB->insts.size(); i != ilim && nBatched != ThreadCheckBatch; ++i) {
+
+    ShadowInstruction* NextSI = &BB->insts[i];
+    Instruction* NextI = NextSI->invar->I;
+
+    if(isBatchableThreadCheck(NextSI) && requiresRuntimeCheck(ShadowValue(NextSI), false) && 
+       !willBeDeleted(ShadowValue(NextSI))) {
+
+      const ShadowInstIdx& PtrIdx = NextSI->invar->operandIdxs[0];
+      bool ptrAvailable = PtrIdx.blockIdx != BB->invar->idx || 
+	PtrIdx.instIdx == INVALID_INSTRUCTION_IDX || 
+	PtrIdx.instIdx < SI->invar->idx;
+
+      if(ptrAvailable) {
+
+	emitInst(BB, NextSI, emitBB);
+	Check = BinaryOperator::CreateAnd(Check, emitAsExpectedCheck(NextSI, emitBB), "", emitBB);
+	pass->batchedThreadChecks.insert(NextSI);
+	++nBatched;
+	BatchedThreadChecks.inc(&F);
+	continue;
+
+      }
+
+    }
+
+    if(isa<TerminatorInst>(NextI) || isa<CallInst>(NextI) || isa<InvokeInst>(NextI) ||
+       NextI->mayWriteToMemory() || NextI->mayHaveSideEffects() || 
+       NextSI->hasOrderingConstraint() || NextSI->needsRuntimeCheck != RUNTIME_CHECK_NONE)
+      break;
+
+  }
+
+  return Check;
+
+}
+
 SmallVector<CommittedBlock, 1>::iterator
 IntegrationAttempt::emitOrdinaryInstCheck(SmallVector<CommittedBlock, 1>::iterator emitIt, ShadowInstruction* SI) {
 
@@ -2863,8 +3012,15 @@ IntegrationAttempt::emitOrdinaryInstCheck(SmallVector<CommittedBlock, 1>::iterat
 
   if(inst_is<MemTransferInst>(SI))
     Check = emitMemcpyCheck(SI, emitBB);
+  else if(pass->batchedThreadChecks.erase(SI)) {
+
+    // Already checked with an earlier load; the edge to our own failed path stays
+    // only to keep that block's predecessors as ConditionalSpec expects.
+    Check = ConstantInt::getTrue(emitBB->getContext());
+
+  }
   else
-    Check = emitAsExpectedCheck(SI, emitBB);
+    Check = emitBatchedThreadChecks(SI, emitBB, emitAsExpectedCheck(SI, emitBB));
     
   BasicBlock* successTarget; 
   BasicBlock* failTarget;
@@ -2900,7 +3056,7 @@ IntegrationAttempt::emitOrdinaryInstCheck(SmallVector<CommittedBlock, 1>::iterat
     }
     
     escapePercent(msg);
-    emitRuntimePrint(emitCB.breakBlock, msg, 0);
+    emitCheckFailure(emitCB.breakBlock, msg);
 
     BranchInst::Create(failTarget, emitCB.breakBlock);
     failTarget = emitCB.breakBlock;
@@ -2908,12 +3064,42 @@ IntegrationAttempt::emitOrdinaryInstCheck(SmallVector<CommittedBlock, 1>::iterat
   }
 
   release_assert(successTarget && failTarget && Check);
-  BranchInst::Create(successTarget, failTarget, Check, emitBB);
+  BranchInst* checkBI = BranchInst::Create(successTarget, failTarget, Check, emitBB);
+  setCheckBranchWeights(checkBI, failTarget);
 
   return emitIt;
 
 }
 
+// Weights for a runtime check branch: failing a check should be rare, and telling LLVM so
+// keeps failed blocks and diagnostic prints out of the specialised code's straight-line layout.
+static const uint32_t CheckPassWeight = 2000;
+static const uint32_t CheckFailWeight = 1;
+
+void llvm::setCheckBranchWeights(BranchInst* BI, BasicBlock* failTarget) {
+
+  release_assert(BI->isConditional());
+
+  // Nothing to prefer if both ways lead to the same place.
+  if(BI->getSuccessor(0) == BI->getSuccessor(1))
+    return;
+
+  uint32_t trueWeight, falseWeight;
+  if(BI->getSuccessor(0) == failTarget) {
+    trueWeight = CheckFailWeight;
+    falseWeight = CheckPassWeight;
+  }
+  else {
+    release_assert(BI->getSuccessor(1) == failTarget);
+    trueWeight = CheckPassWeight;
+    falseWeight = CheckFailWeight;
+  }
+
+  MDBuilder MDB(BI->getContext());
+  BI->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(trueWeight, falseWeight));
+
+}
+
 void llvm::escapePercent(std::string& msg) {
 
   // Replace % with %% throughout msg.
@@ -2973,3 +3159,149 @@ void llvm::emitRuntimePrint(BasicBlock* emitBB, std::string& message, Value* par
     CallInst::Create(Printf, ArrayRef<Value*>(args, nParams), "", emitBB);
   
 }
+
+// Report leaving specialised code through breakBlock because a check failed: print message
+// (already escapePercent'd, with param filling any %d) if -int-verbose-path-conditions, and
+// count the failure if -int-count-check-failures.
+void llvm::emitCheckFailure(BasicBlock* breakBlock, std::string& message, Value* param) {
+
+  if(GlobalIHP->verbosePCs)
+    emitRuntimePrint(breakBlock, message, param);
+
+  if(GlobalIHP->countCheckFailures) {
+
+    // Describe the site by the message, less its newline and any parameter slot.
+    std::string desc = message;
+    if(!desc.empty() && desc[desc.size() - 1] == '\n')
+      desc.resize(desc.size() - 1);
+    if(param && desc.size() >= 2 && desc.compare(desc.size() - 2, 2, "%d") == 0)
+      desc.resize(desc.size() - 2);
+
+    size_t pos = 0;
+    while((pos = desc.find("%%", pos)) != std::string::npos)
+      desc.erase(pos++, 1);
+
+    GlobalIHP->emitCheckFailureCounter(breakBlock, desc);
+
+  }
+
+}
+
+// Each site gets its own counter for now, since the number of sites isn't known until
+// commit is finished. The increment isn't atomic: a multithreaded program may lose the
+// odd count, which is a fair price for keeping the failure path cheap.
+void LLPEAnalysisPass::emitCheckFailureCounter(BasicBlock* breakBlock, const std::string& desc) {
+
+  Module* M = getGlobalModule();
+  GlobalVariable* Counter = new GlobalVariable(*M, GInt64, false, GlobalValue::InternalLinkage,
+					       Constant::getNullValue(GInt64), "");
+  checkFailureSites.push_back(std::make_pair(Counter, desc));
+
+  Value* Old = new LoadInst(Counter, "", breakBlock);
+  Value* New = BinaryOperator::CreateAdd(Old, ConstantInt::get(GInt64, 1), "", breakBlock);
+  new StoreInst(New, Counter, breakBlock);
+
+}
+
+// Gather the site counters into one table, __llpe_check_failures, beside a table of site
+// descriptions, and register a destructor that writes "count description" for every site
+// that failed at least once to the file named by $LLPE_CHECK_FAILURES, or else to stderr.
+void LLPEAnalysisPass::emitCheckFailureTable() {
+
+  if(checkFailureSites.empty())
+    return;
+
+  Module* M = getGlobalModule();
+  LLVMContext& Context = M->getContext();
+  uint32_t nSites = checkFailureSites.size();
+
+  ArrayType* CountsTy = ArrayType::get(GInt64, nSites);
+  GlobalVariable* Counts = new GlobalVariable(*M, CountsTy, false, GlobalValue::InternalLinkage,
+					      Constant::getNullValue(CountsTy), "__llpe_check_failures");
+
+  std::vector<Constant*> descs;
+  Constant* Zero64 = ConstantInt::get(GInt64, 0);
+
+  for(uint32_t i = 0; i != nSites; ++i) {
+
+    Constant* gepArgs[] = { Zero64, ConstantInt::get(GInt64, i) };
+    Constant* Slot = ConstantExpr::getInBoundsGetElementPtr(Counts, gepArgs);
+    GlobalVariable* Counter = checkFailureSites[i].first;
+    Counter->replaceAllUsesWith(Slot);
+    Counter->eraseFromParent();
+
+    Constant* DescArray = ConstantDataArray::getString(Context, checkFailureSites[i].second, true);
+    GlobalVariable* DescGlobal = new GlobalVariable(*M, DescArray->getType(), true,
+						    GlobalValue::PrivateLinkage, DescArray);
+    descs.push_back(ConstantExpr::getBitCast(DescGlobal, GInt8Ptr));
+
+  }
+
+  ArrayType* DescsTy = ArrayType::get(GInt8Ptr, nSites);
+  GlobalVariable* Descs = new GlobalVariable(*M, DescsTy, true, GlobalValue::InternalLinkage,
+					     ConstantArray::get(DescsTy, descs), "__llpe_check_failure_sites");
+
+  Type* Void = Type::getVoidTy(Context);
+  Function* DumpF = Function::Create(FunctionType::get(Void, false), GlobalValue::InternalLinkage,
+				     "__llpe_dump_check_failures", M);
+
+  BasicBlock* EntryBB = BasicBlock::Create(Context, "entry", DumpF);
+  BasicBlock* OpenBB = BasicBlock::Create(Context, "open", DumpF);
+  BasicBlock* LoopBB = BasicBlock::Create(Context, "loop", DumpF);
+  BasicBlock* PrintBB = BasicBlock::Create(Context, "print", DumpF);
+  BasicBlock* NextBB = BasicBlock::Create(Context, "next", DumpF);
+  BasicBlock* ExitBB = BasicBlock::Create(Context, "exit", DumpF);
+
+  // entry: path = getenv("LLPE_CHECK_FAILURES"); write to stderr if it isn't set.
+  Constant* GetenvF = M->getOrInsertFunction("getenv", GInt8Ptr, GInt8Ptr, (Type*)0);
+  std::string envName("LLPE_CHECK_FAILURES");
+  Constant* EnvName = ConstantExpr::getBitCast(getStringArray(envName, *M, true), GInt8Ptr);
+  Value* Path = CallInst::Create(GetenvF, EnvName, "path", EntryBB);
+  Value* NoPath = new ICmpInst(*EntryBB, CmpInst::ICMP_EQ, Path, Constant::getNullValue(GInt8Ptr));
+  BranchInst::Create(LoopBB, OpenBB, NoPath, EntryBB);
+
+  // open: fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)
+  FunctionType* OpenTy = FunctionType::get(GInt32, ArrayRef<Type*>(GInt8Ptr), /*vararg=*/true);
+  Constant* OpenF = M->getOrInsertFunction("open", OpenTy);
+  Value* OpenArgs[] = { Path, ConstantInt::get(GInt32, O_WRONLY | O_CREAT | O_APPEND), ConstantInt::get(GInt32, 0644) };
+  Value* OpenFD = CallInst::Create(OpenF, OpenArgs, "fd", OpenBB);
+  BranchInst::Create(LoopBB, OpenBB);
+
+  // loop: for each site, print its count if nonzero.
+  PHINode* FD = PHINode::Create(GInt32, 2, "outfd", LoopBB);
+  FD->addIncoming(ConstantInt::get(GInt32, 2), EntryBB);
+  FD->addIncoming(OpenFD, OpenBB);
+  FD->addIncoming(FD, NextBB);
+  PHINode* Idx = PHINode::Create(GInt64, 3, "i", LoopBB);
+  Idx->addIncoming(Zero64, EntryBB);
+  Idx->addIncoming(Zero64, OpenBB);
+
+  Value* CountGEPArgs[] = { Zero64, Idx };
+  Value* CountPtr = GetElementPtrInst::CreateInBounds(Counts, CountGEPArgs, "", LoopBB);
+  Value* Count = new LoadInst(CountPtr, "count", LoopBB);
+  Value* Failed = new ICmpInst(*LoopBB, CmpInst::ICMP_NE, Count, Zero64);
+  BranchInst::Create(PrintBB, NextBB, Failed, LoopBB);
+
+  // print: dprintf(fd, "%llu %s\n", count, sites[i])
+  FunctionType* DprintfTy = FunctionType::get(GInt32, ArrayRef<Type*>(GInt32), /*vararg=*/true);
+  Constant* DprintfF = M->getOrInsertFunction("dprintf", DprintfTy);
+  std::string format("%llu %s\n");
+  Constant* Format = ConstantExpr::getBitCast(getStringArray(format, *M, true), GInt8Ptr);
+  Value* DescGEPArgs[] = { Zero64, Idx };
+  Value* DescPtr = GetElementPtrInst::CreateInBounds(Descs, DescGEPArgs, "", PrintBB);
+  Value* Desc = new LoadInst(DescPtr, "site", PrintBB);
+  Value* PrintArgs[] = { FD, Format, Count, Desc };
+  CallInst::Create(DprintfF, PrintArgs, "", PrintBB);
+  BranchInst::Create(NextBB, PrintBB);
+
+  // next: ++i, until every site is done.
+  Value* NextIdx = BinaryOperator::CreateAdd(Idx, ConstantInt::get(GInt64, 1), "", NextBB);
+  Idx->addIncoming(NextIdx, NextBB);
+  Value* Done = new ICmpInst(*NextBB, CmpInst::ICMP_EQ, NextIdx, ConstantInt::get(GInt64, nSites));
+  BranchInst::Create(ExitBB, LoopBB, Done, NextBB);
+
+  ReturnInst::Create(Context, ExitBB);
+
+  appendToGlobalDtors(*M, DumpF, 0);
+
+}
@@ -0,0 +1,132 @@
+//===-- Config.cpp --------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// A specialisation configuration file, given with -int-config, as an alternative to
+// spelling out dozens of flags. It is a YAML (or JSON) mapping from option names to a
+// value, or to a list of values for options that may be given repeatedly:
+//
+//   intheuristics-root: main
+//   spec-argv: 0,1,argv_file
+//   int-assume-edge: [ "rpl_fclose,6,8", "fread_unlocked,13,14" ]
+//   int-loop-max: [ "main,for.body,16" ]
+//
+// A -int-serve job may name a further file, read after the server's own -int-config.
+//
+// Each value is handed to the option exactly as if it had been given on the command
+// line, so the format and meaning of every option are unchanged, and setting one both
+// here and on the command line is the usual "may only occur once" error. Only options
+// LLPE reads once its analysis starts are affected; the driver's own options, e.g.
+// -integrator-accept-all, must still be given on the command line.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/YAMLParser.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static cl::opt<std::string> ConfigFile("int-config", cl::init(""));
+
+static void dieConfig(const std::string& Path, const Twine& Msg) {
+
+  errs() << Path << ": " << Msg << "\n";
+  exit(1);
+
+}
+
+static std::string getScalar(const std::string& Path, yaml::Node* N, const char* what) {
+
+  yaml::ScalarNode* SN = dyn_cast_or_null<yaml::ScalarNode>(N);
+  if(!SN)
+    dieConfig(Path, Twine(what) + " must be a plain value");
+
+  SmallString<128> Storage;
+  return SN->getValue(Storage).str();
+
+}
+
+static void setOption(const std::string& Path, StringMap<cl::Option*>& Opts, const std::string& Name, const std::string& Value) {
+
+  StringMap<cl::Option*>::iterator findit = Opts.find(Name);
+  if(findit == Opts.end())
+    dieConfig(Path, "no such option " + Name);
+
+  if(findit->second->addOccurrence(0, Name, Value))
+    exit(1);
+
+}
+
+void LLPEAnalysisPass::loadConfigFile(const std::string& Path) {
+
+  noteCacheDependency(Path);
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(Path);
+  if(std::error_code ec = MB.getError())
+    dieConfig(Path, "failed to load: " + ec.message());
+
+  // Hashed into the cache key alongside the command line it stands in for.
+  configText += (*MB)->getBuffer().str();
+
+  StringMap<cl::Option*> Opts;
+  cl::getRegisteredOptions(Opts);
+
+  SourceMgr SM;
+  yaml::Stream S((*MB)->getBuffer(), SM);
+
+  for(yaml::document_iterator DI = S.begin(), DE = S.end(); DI != DE; ++DI) {
+
+    yaml::Node* Root = DI->getRoot();
+    if(!Root || isa<yaml::NullNode>(Root))
+      continue;
+
+    yaml::MappingNode* Map = dyn_cast<yaml::MappingNode>(Root);
+    if(!Map)
+      dieConfig(Path, "must be a mapping from option names to values");
+
+    for(yaml::MappingNode::iterator it = Map->begin(), itend = Map->end(); it != itend; ++it) {
+
+      std::string Name = getScalar(Path, it->getKey(), "an option name");
+      // Allow names to be written as they are on the command line.
+      while(!Name.empty() && Name[0] == '-')
+	Name.erase(0, 1);
+
+      if(yaml::SequenceNode* Seq = dyn_cast_or_null<yaml::SequenceNode>(it->getValue())) {
+
+	for(yaml::SequenceNode::iterator SI = Seq->begin(), SE = Seq->end(); SI != SE; ++SI)
+	  setOption(Path, Opts, Name, getScalar(Path, &*SI, "each value of a list"));
+
+      }
+      else {
+
+	setOption(Path, Opts, Name, getScalar(Path, it->getValue(), "an option value"));
+
+      }
+
+    }
+
+  }
+
+  if(S.failed())
+    dieConfig(Path, "is not valid YAML or JSON");
+
+}
+
+void LLPEAnalysisPass::loadConfigFiles() {
+
+  if(!ConfigFile.empty())
+    loadConfigFile(ConfigFile);
+  if(!jobConfigFile.empty())
+    loadConfigFile(jobConfigFile);
+
+}
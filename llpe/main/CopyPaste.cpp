@@ -14,6 +14,7 @@
 #include "llvm/IR/Type.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/Support/Host.h"
 
 using namespace llvm;
 
@@ -277,6 +278,20 @@ bool llvm::XXXReadDataFromGlobal(Constant *C, uint64_t ByteOffset,
     // not reached.
   }
 
+  // LLPE: integer data arrays (e.g. file contents) are stored as raw bytes in host order;
+  // slice them directly rather than materialising a ConstantInt per element.
+  if (ConstantDataSequential *CDS = dyn_cast<ConstantDataSequential>(C)) {
+    if (CDS->getElementType()->isIntegerTy() &&
+        (CDS->getElementByteSize() == 1 || TD.isLittleEndian() == sys::IsLittleEndianHost)) {
+      StringRef Data = CDS->getRawDataValues();
+      if (ByteOffset >= Data.size())
+        return true;
+      uint64_t Avail = Data.size() - ByteOffset;
+      memcpy(CurPtr, Data.data() + ByteOffset, std::min((uint64_t)BytesLeft, Avail));
+      return true;
+    }
+  }
+
   if (isa<ConstantArray>(C) || isa<ConstantVector>(C) ||
       isa<ConstantDataSequential>(C)) {
     Type *EltTy = cast<SequentialType>(C->getType())->getElementType();
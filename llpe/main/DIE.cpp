@@ -11,6 +11,8 @@
 
 #include "llvm/Analysis/LLPE.h"
 
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/IntrinsicInst.h"
@@ -18,13 +20,22 @@
 #include "llvm/Analysis/MemoryBuiltins.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/IR/CFG.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
 #include <vector>
 
 using namespace llvm;
 
+static cl::opt<unsigned> StackPromoteLimit("int-stack-promote-limit", cl::init(4096));
+static cl::opt<unsigned> GlobalPromoteLimit("int-global-promote-limit", cl::init(65536));
+
+static LLPEStat DeadObjects("dead_objects", "Allocations eliminated with all their stores");
+static LLPEStat StackPromotedObjects("stack_promoted_objects", "Heap allocations committed as stack allocations");
+static LLPEStat GlobalPromotedObjects("global_promoted_objects", "Heap allocations committed as constant globals");
+
 static uint32_t DIEProgressN = 0;
 const uint32_t DIEProgressLimit = 10000;
 
@@ -35,11 +46,26 @@ static void DIEProgress() {
 
     errs() << ".";
     DIEProgressN = 0;
+    noteProgress();
 
   }
 
 }
 
+// hasSplitInsts scans the whole block, and would otherwise be asked again for every use
+// of every value defined there.
+static bool blockHasSplitInsts(ShadowBB* BB) {
+
+  DenseMap<ShadowBB*, bool>::iterator findit = GlobalIHP->DIEBlockSplits.find(BB);
+  if(findit != GlobalIHP->DIEBlockSplits.end())
+    return findit->second;
+
+  bool splits = BB->IA->hasSplitInsts(BB);
+  GlobalIHP->DIEBlockSplits[BB] = splits;
+  return splits;
+
+}
+
 class llvm::DIVisitor {
 
 public:
@@ -75,8 +101,8 @@ public:
        UserInA->blocksReachableOnFailure->count(UserI->parent->invar->idx)) {
 
       if((!V.isInst()) || 
-	 UserI->parent != V.u.I->parent ||
-	 UserI->parent->IA->hasSplitInsts(UserI->parent)) {
+	 UserI->parent != V.getInst()->parent ||
+	 blockHasSplitInsts(UserI->parent)) {
 
 	maybeLive = true;
 	return;
@@ -439,7 +465,7 @@ static bool _willBeDeleted(ShadowValue V) {
   }
 
   if(isAllocationInstruction(V))
-    return dieStatus == (INSTSTATUS_DEAD | INSTSTATUS_UNUSED_WRITER);
+    return (dieStatus & (INSTSTATUS_DEAD | INSTSTATUS_UNUSED_WRITER)) == (INSTSTATUS_DEAD | INSTSTATUS_UNUSED_WRITER);
   else
     return dieStatus != INSTSTATUS_ALIVE;
 
@@ -633,14 +659,678 @@ bool IntegrationAttempt::valueIsDead(ShadowValue V) {
 
 }
 
+// Whole-object liveness: an allocation that DSE found is never read (its TrackedAlloc
+// died unneeded) can go entirely if every pointer into it is only used to address its
+// own dead stores, to free it, or by instructions that will be replaced anyway.
+// Pointers into the object are those noteIndirectUse recorded against it; anything
+// suspicious, including any use on a path that might fail back to unspecialised code,
+// keeps the whole object alive.
+
+static bool userReachableOnFailure(ShadowInstruction* UserI, IntegrationAttempt* UserIA, uint32_t blockIdx) {
+
+  InlineAttempt* UserInA = UserIA->getFunctionRoot();
+  uint32_t userBlockIdx = UserI ? UserI->parent->invar->idx : blockIdx;
+
+  return UserInA->blocksReachableOnFailure && 
+    UserInA->blocksReachableOnFailure->count(userBlockIdx);
+
+}
+
+class DeadObjectVisitor : public DIVisitor {
+
+  ShadowValue Object;
+  SmallPtrSet<ShadowInstruction*, 8>& Pointers;
+  SmallVector<ShadowInstruction*, 4>& Frees;
+
+public:
+
+  DeadObjectVisitor(ShadowValue _V, ShadowValue _Object, SmallPtrSet<ShadowInstruction*, 8>& _Pointers, SmallVector<ShadowInstruction*, 4>& _Frees) :
+    DIVisitor(_V), Object(_Object), Pointers(_Pointers), Frees(_Frees) { }
+
+  virtual void visit(ShadowInstruction* UserI, IntegrationAttempt* UserIA, uint32_t blockIdx, uint32_t instIdx) {
+
+    if(userReachableOnFailure(UserI, UserIA, blockIdx)) {
+      maybeLive = true;
+      return;
+    }
+
+    // User in a dead block:
+    if(!UserI)
+      return;
+
+    // Checked in its own right.
+    if(Pointers.count(UserI))
+      return;
+
+    if(requiresRuntimeCheck(ShadowValue(UserI), false)) {
+      maybeLive = true;
+      return;
+    }
+
+    if(inst_is<StoreInst>(UserI)) {
+
+      if(V != UserI->getOperand(1) || V == UserI->getOperand(0) || !(UserI->dieStatus & INSTSTATUS_UNUSED_WRITER))
+	maybeLive = true;
+
+    }
+    else if(inst_is<MemIntrinsic>(UserI)) {
+
+      if(V != UserI->getCallArgOperand(0) || V == UserI->getCallArgOperand(1) || !(UserI->dieStatus & INSTSTATUS_UNUSED_WRITER))
+	maybeLive = true;
+
+    }
+    else if(inst_is<CallInst>(UserI) || inst_is<InvokeInst>(UserI)) {
+
+      Function* F = getCalledFunction(UserI);
+      DenseMap<Function*, specialfunctions>::iterator findit;
+      if(UserIA->getInlineAttempt(UserI) || !F ||
+	 (findit = SpecialFunctionMap.find(F)) == SpecialFunctionMap.end() ||
+	 findit->second != SF_FREE ||
+	 GlobalIHP->deallocatorFunctions[F].releasesArena ||
+	 V != UserI->getCallArgOperand(0)) {
+
+	maybeLive = true;
+	return;
+
+      }
+
+      Frees.push_back(UserI);
+
+    }
+    else if(UserIA->willBeReplacedOrDeleted(ShadowValue(UserI))) {
+
+      // Fine unless it will be replaced by a pointer into the object that wasn't recorded.
+      ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(UserI->i.PB);
+      if(IVS && IVS->SetType == ValSetTypePB && IVS->Values.size() == 1 && IVS->Values[0].V == Object)
+	maybeLive = true;
+
+    }
+    else {
+
+      maybeLive = true;
+
+    }
+
+  }
+
+};
+
+static bool isEliminableAllocation(ShadowInstruction* SI) {
+
+  if(inst_is<AllocaInst>(SI))
+    return true;
+
+  if(!inst_is<CallInst>(SI) || SI->parent->IA->getInlineAttempt(SI))
+    return false;
+
+  Function* F = getCalledFunction(SI);
+  if(!F)
+    return false;
+
+  DenseMap<Function*, specialfunctions>::iterator findit = SpecialFunctionMap.find(F);
+  return findit != SpecialFunctionMap.end() && findit->second == SF_MALLOC;
+
+}
+
+static bool tryKillObject(ShadowInstruction* AllocI) {
+
+  if(requiresRuntimeCheck(ShadowValue(AllocI), false))
+    return false;
+
+  ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(AllocI->i.PB);
+  if((!IVS) || IVS->SetType != ValSetTypePB || IVS->Values.size() != 1 || !IVS->Values[0].V.isPtrIdx())
+    return false;
+
+  ShadowValue Object = IVS->Values[0].V;
+  AllocData* AD = AllocI->parent->IA->getAllocData(Object);
+  if(AD->allocValue != ShadowValue(AllocI) || AD->isCommitted || !AD->PatchRefs.empty())
+    return false;
+
+  DenseMap<ShadowValue, std::vector<std::pair<ShadowValue, uint32_t> > >::iterator findit = 
+    GlobalIHP->indirectDIEUsers.find(ShadowValue(AllocI));
+  if(findit == GlobalIHP->indirectDIEUsers.end())
+    return false;
+
+  std::vector<std::pair<ShadowValue, uint32_t> >& Users = findit->second;
+  if((!Users.empty()) && Users.back().first.isInval())
+    return false;
+
+  SmallPtrSet<ShadowInstruction*, 8> Pointers;
+  Pointers.insert(AllocI);
+
+  for(std::vector<std::pair<ShadowValue, uint32_t> >::iterator it = Users.begin(), itend = Users.end(); it != itend; ++it) {
+
+    // Users committed since are either gone or waiting on a PatchRef.
+    IntegrationAttempt* UserIA = (IntegrationAttempt*)GlobalIHP->IAs[it->second];
+    if((!UserIA) || UserIA->isCommitted())
+      continue;
+
+    ShadowInstruction* UserI = it->first.getInst();
+    if(!UserI)
+      return false;
+
+    // No longer points here?
+    ImprovedValSetSingle* UserIVS = dyn_cast_or_null<ImprovedValSetSingle>(UserI->i.PB);
+    if((!UserIVS) || UserIVS->SetType != ValSetTypePB || UserIVS->Values.size() != 1 || UserIVS->Values[0].V != Object)
+      continue;
+
+    // Only plain pointer arithmetic can be dropped with the object.
+    if(inst_is<CallInst>(UserI) || inst_is<InvokeInst>(UserI) || UserI->invar->I->mayHaveSideEffects())
+      return false;
+
+    if(requiresRuntimeCheck(ShadowValue(UserI), false))
+      return false;
+
+    // Pinned by a use outside the def-use graph (see noteObjectUser)?
+    if(GlobalIHP->indirectDIEUsers.count(ShadowValue(UserI)))
+      return false;
+
+    Pointers.insert(UserI);
+
+  }
+
+  SmallVector<ShadowInstruction*, 4> Frees;
+
+  for(SmallPtrSet<ShadowInstruction*, 8>::iterator it = Pointers.begin(), itend = Pointers.end(); it != itend; ++it) {
+
+    DeadObjectVisitor DOV(ShadowValue(*it), Object, Pointers, Frees);
+    (*it)->parent->IA->visitUsers(ShadowValue(*it), DOV);
+    if(DOV.maybeLive)
+      return false;
+
+  }
+
+  AllocI->dieStatus |= (INSTSTATUS_DEAD | INSTSTATUS_UNUSED_WRITER | INSTSTATUS_DEAD_OBJECT);
+
+  for(SmallPtrSet<ShadowInstruction*, 8>::iterator it = Pointers.begin(), itend = Pointers.end(); it != itend; ++it)
+    (*it)->dieStatus |= (INSTSTATUS_DEAD | INSTSTATUS_DEAD_OBJECT);
+
+  for(SmallVector<ShadowInstruction*, 4>::iterator it = Frees.begin(), itend = Frees.end(); it != itend; ++it)
+    (*it)->dieStatus |= (INSTSTATUS_DEAD | INSTSTATUS_UNUSED_WRITER | INSTSTATUS_DEAD_OBJECT);
+
+  DeadObjects.inc(&AllocI->parent->IA->F);
+  return true;
+
+}
+
+// Promoting a live heap object: its pointers are found as for a dead object, but may also
+// be used to read the object, to write through and to be compared. Anything that could
+// let a pointer outlive the promotion (storing it, passing it to a call other than free,
+// returning it) or reach the object through unspecialised code (any use on a path that
+// might fail, which could hand it to the real free) rules it out.
+//
+// Stack promotion: a malloc whose pointers never leave the function that allocates it
+// can be committed as a fixed-size alloca in that function's entry block.
+//
+// Global promotion: if moreover every byte of the object is written by at most one live
+// write, each of a known constant, the object's contents never change from those
+// constants (reading a malloc'd byte before its write may see any value), so it can be
+// committed as a constant global holding them and those writes dropped. Its pointers may
+// then go anywhere within specialised code. Not so for calloc: a read before the write
+// must see zero, not the constant written later.
+//
+// Either way its free calls are dropped.
+
+class PromotedObjectVisitor : public DIVisitor {
+
+  InlineAttempt* AllocRoot;
+  SmallPtrSet<ShadowInstruction*, 8>& Pointers;
+  SmallVector<ShadowInstruction*, 4>& Frees;
+  SmallVector<ShadowInstruction*, 4>& Writers;
+
+public:
+
+  PromotedObjectVisitor(ShadowValue _V, InlineAttempt* _AllocRoot, SmallPtrSet<ShadowInstruction*, 8>& _Pointers, SmallVector<ShadowInstruction*, 4>& _Frees, SmallVector<ShadowInstruction*, 4>& _Writers) :
+    DIVisitor(_V), AllocRoot(_AllocRoot), Pointers(_Pointers), Frees(_Frees), Writers(_Writers) { }
+
+  virtual void visit(ShadowInstruction* UserI, IntegrationAttempt* UserIA, uint32_t blockIdx, uint32_t instIdx) {
+
+    if((AllocRoot && UserIA->getFunctionRoot() != AllocRoot) || userReachableOnFailure(UserI, UserIA, blockIdx)) {
+      maybeLive = true;
+      return;
+    }
+
+    if((!UserI) || Pointers.count(UserI))
+      return;
+
+    if(inst_is<LoadInst>(UserI) || inst_is<ICmpInst>(UserI))
+      return;
+
+    // Writes DSE found are never read don't matter.
+    bool liveWrite = !(UserI->dieStatus & INSTSTATUS_UNUSED_WRITER);
+
+    if(inst_is<StoreInst>(UserI)) {
+
+      if(V == UserI->getOperand(0) || cast_inst<StoreInst>(UserI)->isVolatile())
+	maybeLive = true;
+      else if(liveWrite)
+	Writers.push_back(UserI);
+
+    }
+    else if(inst_is<MemIntrinsic>(UserI)) {
+
+      if(V == UserI->getCallArgOperand(0) && liveWrite)
+	Writers.push_back(UserI);
+
+    }
+    else if(inst_is<CallInst>(UserI) || inst_is<InvokeInst>(UserI)) {
+
+      Function* F = getCalledFunction(UserI);
+      DenseMap<Function*, specialfunctions>::iterator findit;
+      if(UserIA->getInlineAttempt(UserI) || !F) {
+	maybeLive = true;
+	return;
+      }
+
+      // A resolved read into the object is committed as a copy of the file's bytes.
+      if(GlobalIHP->resolvedReadCalls.count(UserI)) {
+
+	if(V != UserI->getCallArgOperand(1) || GlobalIHP->resolvedReadCalls[UserI].isFifo)
+	  maybeLive = true;
+	else if(liveWrite)
+	  Writers.push_back(UserI);
+	return;
+
+      }
+
+      if((findit = SpecialFunctionMap.find(F)) == SpecialFunctionMap.end() ||
+	 findit->second != SF_FREE ||
+	 GlobalIHP->deallocatorFunctions[F].releasesArena ||
+	 V != UserI->getCallArgOperand(0)) {
+
+	maybeLive = true;
+	return;
+
+      }
+
+      Frees.push_back(UserI);
+
+    }
+    else {
+
+      maybeLive = true;
+
+    }
+
+  }
+
+};
+
+// Common conditions for either promotion: a plain call to a non-zeroing allocator making one
+// object (not a vague allocation, which stands for several live ones) of known size.
+static AllocData* getPromotableAllocation(ShadowInstruction* AllocI, uint64_t Limit) {
+
+  if(!inst_is<CallInst>(AllocI))
+    return 0;
+
+  AllocatorFn& Alloc = GlobalIHP->allocatorFunctions[getCalledFunction(AllocI)];
+  if(Alloc.zeroed || Alloc.arenaArg != UINT_MAX)
+    return 0;
+
+  if(requiresRuntimeCheck(ShadowValue(AllocI), false))
+    return 0;
+
+  ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(AllocI->i.PB);
+  if((!IVS) || IVS->SetType != ValSetTypePB || IVS->Values.size() != 1 || !IVS->Values[0].V.isPtrIdx())
+    return 0;
+
+  AllocData* AD = AllocI->parent->IA->getAllocData(IVS->Values[0].V);
+  if(AD->allocValue != ShadowValue(AllocI) || AD->isCommitted || AD->allocVague || !AD->PatchRefs.empty())
+    return 0;
+
+  if(AD->storeSize == ULONG_MAX || AD->storeSize == 0 || AD->storeSize > Limit)
+    return 0;
+
+  return AD;
+
+}
+
+static bool collectPromotedObjectUsers(ShadowInstruction* AllocI, InlineAttempt* AllocRoot, SmallVector<ShadowInstruction*, 4>& Frees, SmallVector<ShadowInstruction*, 4>& Writers) {
+
+  ShadowValue Object = cast<ImprovedValSetSingle>(AllocI->i.PB)->Values[0].V;
+
+  DenseMap<ShadowValue, std::vector<std::pair<ShadowValue, uint32_t> > >::iterator findit = 
+    GlobalIHP->indirectDIEUsers.find(ShadowValue(AllocI));
+  if(findit == GlobalIHP->indirectDIEUsers.end())
+    return false;
+
+  std::vector<std::pair<ShadowValue, uint32_t> >& Users = findit->second;
+  if((!Users.empty()) && Users.back().first.isInval())
+    return false;
+
+  SmallPtrSet<ShadowInstruction*, 8> Pointers;
+  Pointers.insert(AllocI);
+
+  for(std::vector<std::pair<ShadowValue, uint32_t> >::iterator it = Users.begin(), itend = Users.end(); it != itend; ++it) {
+
+    IntegrationAttempt* UserIA = (IntegrationAttempt*)GlobalIHP->IAs[it->second];
+    if((!UserIA) || UserIA->isCommitted())
+      continue;
+
+    ShadowInstruction* UserI = it->first.getInst();
+    if(!UserI)
+      return false;
+
+    ImprovedValSetSingle* UserIVS = dyn_cast_or_null<ImprovedValSetSingle>(UserI->i.PB);
+    if((!UserIVS) || UserIVS->SetType != ValSetTypePB || UserIVS->Values.size() != 1 || UserIVS->Values[0].V != Object)
+      continue;
+
+    if(inst_is<CallInst>(UserI) || inst_is<InvokeInst>(UserI) || UserI->invar->I->mayHaveSideEffects())
+      return false;
+
+    if(GlobalIHP->indirectDIEUsers.count(ShadowValue(UserI)))
+      return false;
+
+    Pointers.insert(UserI);
+
+  }
+
+  for(SmallPtrSet<ShadowInstruction*, 8>::iterator it = Pointers.begin(), itend = Pointers.end(); it != itend; ++it) {
+
+    PromotedObjectVisitor POV(ShadowValue(*it), AllocRoot, Pointers, Frees, Writers);
+    (*it)->parent->IA->visitUsers(ShadowValue(*it), POV);
+    if(POV.maybeLive)
+      return false;
+
+  }
+
+  return true;
+
+}
+
+static void dropPromotedObjectFrees(SmallVector<ShadowInstruction*, 4>& Frees) {
+
+  for(SmallVector<ShadowInstruction*, 4>::iterator it = Frees.begin(), itend = Frees.end(); it != itend; ++it)
+    (*it)->dieStatus |= (INSTSTATUS_DEAD | INSTSTATUS_UNUSED_WRITER | INSTSTATUS_DEAD_OBJECT);
+
+}
+
+static bool tryPromoteObjectToStack(ShadowInstruction* AllocI) {
+
+  AllocData* AD = getPromotableAllocation(AllocI, StackPromoteLimit);
+  if(!AD)
+    return false;
+
+  // Decided afresh each time DIE runs, since the frees' status is too.
+  bool wasPromoted = AD->stackPromoted;
+  AD->stackPromoted = false;
+
+  SmallVector<ShadowInstruction*, 4> Frees;
+  SmallVector<ShadowInstruction*, 4> Writers;
+  if(!collectPromotedObjectUsers(AllocI, AllocI->parent->IA->getFunctionRoot(), Frees, Writers))
+    return false;
+
+  AD->stackPromoted = true;
+  dropPromotedObjectFrees(Frees);
+
+  if(!wasPromoted)
+    StackPromotedObjects.inc(&AllocI->parent->IA->F);
+  return true;
+
+}
+
+namespace {
+
+  // One write's contribution to a global-promoted object's initialiser.
+  struct ObjectInitRange {
+
+    uint64_t Offset;
+    uint64_t Size;
+    Constant* C;
+
+    bool operator<(const ObjectInitRange& Other) const {
+      return Offset < Other.Offset;
+    }
+
+  };
+
+}
+
+static bool getWriteOffset(ShadowValue Ptr, ShadowValue Object, uint64_t& Offset) {
+
+  ShadowValue Base;
+  int64_t Off;
+  if((!getBaseAndConstantOffset(Ptr, Base, Off)) || Base != Object || Off < 0)
+    return false;
+
+  Offset = (uint64_t)Off;
+  return true;
+
+}
+
+static bool getWriteInit(ShadowInstruction* W, ShadowValue Object, ObjectInitRange& R) {
+
+  LLVMContext& Context = W->invar->I->getContext();
+
+  if(inst_is<StoreInst>(W)) {
+
+    Type* ValTy = W->invar->I->getOperand(0)->getType();
+    R.C = getConstReplacement(W->getOperand(0));
+    R.Size = getTypeStoreSize(ValTy);
+
+    // A packed struct field takes its alloc size.
+    if((!R.C) || R.C->getType() != ValTy || R.Size != GlobalTD->getTypeAllocSize(ValTy))
+      return false;
+
+    return getWriteOffset(W->getOperand(1), Object, R.Offset);
+
+  }
+  else if(inst_is<MemSetInst>(W)) {
+
+    ConstantInt* Val = dyn_cast_or_null<ConstantInt>(getConstReplacement(W->getCallArgOperand(1)));
+    ConstantInt* Len = dyn_cast_or_null<ConstantInt>(getConstReplacement(W->getCallArgOperand(2)));
+    if((!Val) || (!Len) || !Len->getLimitedValue())
+      return false;
+
+    R.Size = Len->getLimitedValue();
+    ArrayType* ArrTy = ArrayType::get(Type::getInt8Ty(Context), R.Size);
+    if(Val->isZero())
+      R.C = ConstantAggregateZero::get(ArrTy);
+    else {
+      std::vector<uint8_t> Bytes(R.Size, (uint8_t)Val->getLimitedValue());
+      R.C = ConstantDataArray::get(Context, Bytes);
+    }
+
+    return getWriteOffset(W->getCallArgOperand(0), Object, R.Offset);
+
+  }
+  else if(inst_is<CallInst>(W)) {
+
+    ReadFile& RF = GlobalIHP->resolvedReadCalls[W];
+    if(!RF.readSize)
+      return false;
+
+    ArrayRef<uint8_t> fileBytes;
+    std::string errors;
+    if((!getFileBytes(RF.name, RF.incomingOffset, RF.readSize, fileBytes, errors)) || fileBytes.size() != RF.readSize)
+      return false;
+
+    R.Size = RF.readSize;
+    R.C = ConstantDataArray::get(Context, fileBytes);
+
+    return getWriteOffset(W->getCallArgOperand(1), Object, R.Offset);
+
+  }
+
+  // Other memory intrinsics (copies into the object):
+  return false;
+
+}
+
+// Lay the writes out as a packed struct, zero filling the gaps (as calloc would; for
+// malloc any value will do).
+static Constant* buildObjectInit(std::vector<ObjectInitRange>& Ranges, uint64_t Size, LLVMContext& Context) {
+
+  std::sort(Ranges.begin(), Ranges.end());
+
+  SmallVector<Constant*, 8> Fields;
+  uint64_t Covered = 0;
+
+  for(std::vector<ObjectInitRange>::iterator it = Ranges.begin(), itend = Ranges.end(); it != itend; ++it) {
+
+    // Written twice, or beyond the end?
+    if(it->Offset < Covered || it->Offset + it->Size > Size)
+      return 0;
+
+    if(it->Offset != Covered)
+      Fields.push_back(ConstantAggregateZero::get(ArrayType::get(Type::getInt8Ty(Context), it->Offset - Covered)));
+
+    Fields.push_back(it->C);
+    Covered = it->Offset + it->Size;
+
+  }
+
+  if(Covered != Size)
+    Fields.push_back(ConstantAggregateZero::get(ArrayType::get(Type::getInt8Ty(Context), Size - Covered)));
+
+  return ConstantStruct::getAnon(Context, Fields, /*isPacked=*/true);
+
+}
+
+// Undo an earlier run's promotion before deciding again; nothing can have been committed
+// against it yet.
+static void unpromoteFromGlobal(AllocData* AD) {
+
+  GlobalVariable* G = cast<GlobalVariable>(AD->committedVal->stripPointerCasts());
+  G->removeDeadConstantUsers();
+  release_assert(G->use_empty() && "Global-promoted object already in use?");
+  G->eraseFromParent();
+
+  AD->committedVal = 0;
+  AD->isCommitted = false;
+  AD->globalPromoted = false;
+
+}
+
+static bool tryPromoteObjectToGlobal(ShadowInstruction* AllocI) {
+
+  // Decided afresh each time DIE runs, since the writes' status is too.
+  bool wasPromoted = false;
+  if(ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(AllocI->i.PB)) {
+    if(IVS->SetType == ValSetTypePB && IVS->Values.size() == 1 && IVS->Values[0].V.isPtrIdx()) {
+      AllocData* AD = AllocI->parent->IA->getAllocData(IVS->Values[0].V);
+      if(AD->globalPromoted && AD->allocValue == ShadowValue(AllocI)) {
+	wasPromoted = true;
+	unpromoteFromGlobal(AD);
+      }
+    }
+  }
+
+  AllocData* AD = getPromotableAllocation(AllocI, GlobalPromoteLimit);
+  if(!AD)
+    return false;
+
+  SmallVector<ShadowInstruction*, 4> Frees;
+  SmallVector<ShadowInstruction*, 4> Writers;
+  if(!collectPromotedObjectUsers(AllocI, 0, Frees, Writers))
+    return false;
+
+  ShadowValue Object = cast<ImprovedValSetSingle>(AllocI->i.PB)->Values[0].V;
+
+  std::vector<ObjectInitRange> Ranges;
+  for(SmallVector<ShadowInstruction*, 4>::iterator it = Writers.begin(), itend = Writers.end(); it != itend; ++it) {
+
+    ObjectInitRange R;
+    if(!getWriteInit(*it, Object, R))
+      return false;
+    Ranges.push_back(R);
+
+  }
+
+  Constant* Init = buildObjectInit(Ranges, AD->storeSize, AllocI->invar->I->getContext());
+  if(!Init)
+    return false;
+
+  GlobalVariable* G = new GlobalVariable(*getGlobalModule(), Init->getType(), true, GlobalValue::InternalLinkage, Init, "");
+  // At least as aligned as analysis assumed malloc's results were:
+  G->setAlignment(std::max(16u, GlobalIHP->getMallocAlignment()));
+
+  // Committed now, so that its pointers can be synthesised wherever they are needed.
+  AD->committedVal = ConstantExpr::getBitCast(G, AllocI->getType());
+  AD->isCommitted = true;
+  AD->globalPromoted = true;
+
+  AllocI->dieStatus |= (INSTSTATUS_DEAD | INSTSTATUS_UNUSED_WRITER | INSTSTATUS_DEAD_OBJECT);
+  dropPromotedObjectFrees(Frees);
+
+  for(SmallVector<ShadowInstruction*, 4>::iterator it = Writers.begin(), itend = Writers.end(); it != itend; ++it) {
+
+    // A read's call stays (for its result and file position); only its copy goes.
+    if(inst_is<StoreInst>(*it) || inst_is<MemSetInst>(*it))
+      (*it)->dieStatus |= (INSTSTATUS_DEAD | INSTSTATUS_UNUSED_WRITER | INSTSTATUS_DEAD_OBJECT);
+    else
+      (*it)->dieStatus |= INSTSTATUS_UNUSED_WRITER;
+
+  }
+
+  if(!wasPromoted)
+    GlobalPromotedObjects.inc(&AllocI->parent->IA->F);
+  return true;
+
+}
+
+// Run before ordinary DIE, which would otherwise keep the pointers alive for the sake of
+// the free calls.
+void IntegrationAttempt::killDeadObjects() {
+
+  for(uint32_t i = 0; i != nBBs; ++i) {
+
+    ShadowBB* BB = BBs[i];
+    if(!BB)
+      continue;
+
+    if(BB->invar->naturalScope != L) {
+
+      const ShadowLoopInvar* EnterL = immediateChildLoop(L, BB->invar->naturalScope);
+      if(PeelAttempt* LPA = getPeelAttempt(EnterL)) {
+
+	for(uint32_t k = 0, klim = LPA->Iterations.size(); k != klim; ++k)
+	  LPA->Iterations[k]->killDeadObjects();
+
+      }
+
+      // Skip loop blocks regardless of whether we entered the loop:
+      while(i + 1 != nBBs && ((!BBs[i+1]) || EnterL->contains(BBs[i+1]->invar->naturalScope)))
+	++i;
+      continue;
+
+    }
+
+    for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
+
+      ShadowInstruction* SI = &BB->insts[j];
+      if((SI->dieStatus & INSTSTATUS_DEAD_OBJECT) || !isEliminableAllocation(SI))
+	continue;
+
+      if((SI->dieStatus & INSTSTATUS_UNUSED_WRITER) && tryKillObject(SI))
+	continue;
+
+      if(inst_is<AllocaInst>(SI))
+	continue;
+
+      if(GlobalPromoteLimit && tryPromoteObjectToGlobal(SI))
+	continue;
+
+      if(StackPromoteLimit)
+	tryPromoteObjectToStack(SI);
+
+    }
+
+  }
+
+}
+
 // Try to kill all instructions in this context, and if appropriate, arguments.
 // Everything should be killed in reverse topological order.
 void InlineAttempt::runDIE() {
 
+  PhaseTimer Timer(PhaseDIE);
+
   if(isCommitted())
     return;
 
-  // First try to kill our instructions:
+  // Whole dead objects first, then everything else:
+  killDeadObjects();
   IntegrationAttempt::runDIE();
 
   // Don't eliminate 
@@ -14,8 +14,10 @@
 #include "llvm/IR/Instruction.h"
 
 #include "llvm/Analysis/CFGPrinter.h"
+#include "llvm/Support/Compression.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 #include "llvm/Analysis/LLPE.h"
 
@@ -23,6 +25,7 @@
 #include <sys/types.h>
 
 #include <string>
+#include <string.h>
 
 using namespace llvm;
 
@@ -64,7 +67,7 @@ std::string IntegrationAttempt::getValueColour(ShadowValue SV, std::string& text
   }
 
   if(val_is<CallInst>(SV) || val_is<InvokeInst>(SV)) {
-    if(SV.u.I->typeSpecificData)
+    if(SV.getInst()->typeSpecificData)
       return "yellow";
     else
       return "pink";
@@ -722,32 +725,170 @@ void IntegrationAttempt::describeScopeAsDOT(const ShadowLoopInvar* DescribeL, ui
 
 }
 
-void IntegrationAttempt::getSavedDotName(bool brief, std::string& Out) {
+// Contexts must be described before they commit, since committing leaves them unable to
+// describe themselves, but the GUI only ever looks at a few of them. Rather than a pair of
+// DOT files per context, the descriptions are streamed into one trace file in ihp_workdir,
+// compressed where zlib is available, and read back on demand. The file ends with an index
+// of (sequence number, record offset) pairs, its length and a magic number, so other tools
+// can find a context's record without scanning.
+//
+// Record: uint64_t seq, then the brief and full descriptions, each as uint32_t length,
+// uint32_t stored length and the stored bytes. A stored length less than the length marks
+// a compressed description.
 
-  raw_string_ostream RSO(Out);
-  RSO << ihp_workdir << "/" << SeqNumber;
-  if(brief)
-    RSO << "-brief";
-  RSO << ".dot";
+#define DOT_TRACE_MAGIC 0x54544f4445504c4cULL // "LLPEDOTT"
+
+static raw_fd_ostream* DOTTrace = 0;
+static bool DOTTraceFailed = false;
+static DenseMap<uint64_t, uint64_t> DOTTraceIndex;
+static std::unique_ptr<MemoryBuffer> DOTTraceBuffer;
+
+static std::string getDOTTraceName() {
+
+  std::string Ret;
+  raw_string_ostream RSO(Ret);
+  RSO << ihp_workdir << "/contexts.dottrace";
+  return RSO.str();
 
 }
 
-void IntegrationAttempt::saveDOT2(bool brief) {
+template<class T> static void writeTraceRaw(T Val) {
 
-  std::string filename;
-  getSavedDotName(brief, filename);
-  std::error_code error;
-  raw_fd_ostream RFO(filename.c_str(), error, sys::fs::F_None);
+  DOTTrace->write((const char*)&Val, sizeof(T));
 
-  if(error) {
+}
+
+static void writeTraceString(StringRef Str) {
+
+  SmallVector<char, 4096> Compressed;
+  StringRef Stored = Str;
+  if(zlib::isAvailable() && 
+     zlib::compress(Str, Compressed, zlib::BestSpeedCompression) == zlib::StatusOK &&
+     Compressed.size() < Str.size())
+    Stored = StringRef(Compressed.data(), Compressed.size());
+
+  writeTraceRaw<uint32_t>(Str.size());
+  writeTraceRaw<uint32_t>(Stored.size());
+  DOTTrace->write(Stored.data(), Stored.size());
+
+}
+
+static void appendDOTTrace(uint64_t Seq, StringRef Brief, StringRef Full) {
 
-    errs() << "Failed to open " << filename << ": " << error.message() << "\n";
+  if(DOTTraceFailed)
     return;
 
+  if(!DOTTrace) {
+
+    std::string filename = getDOTTraceName();
+    std::error_code error;
+    DOTTrace = new raw_fd_ostream(filename.c_str(), error, sys::fs::F_None);
+    if(error) {
+
+      errs() << "Failed to open " << filename << ": " << error.message() << "\n";
+      delete DOTTrace;
+      DOTTrace = 0;
+      DOTTraceFailed = true;
+      return;
+
+    }
+
+  }
+
+  DOTTraceIndex[Seq] = DOTTrace->tell();
+  writeTraceRaw<uint64_t>(Seq);
+  writeTraceString(Brief);
+  writeTraceString(Full);
+
+}
+
+void llvm::closeDOTTrace() {
+
+  if(!DOTTrace)
+    return;
+
+  for(DenseMap<uint64_t, uint64_t>::iterator it = DOTTraceIndex.begin(),
+	itend = DOTTraceIndex.end(); it != itend; ++it) {
+
+    writeTraceRaw<uint64_t>(it->first);
+    writeTraceRaw<uint64_t>(it->second);
+
+  }
+
+  writeTraceRaw<uint64_t>(DOTTraceIndex.size());
+  writeTraceRaw<uint64_t>(DOT_TRACE_MAGIC);
+
+  delete DOTTrace;
+  DOTTrace = 0;
+
+}
+
+static bool readTraceString(const char*& Pos, const char* End, bool Keep, raw_ostream& Out) {
+
+  uint32_t Len, StoredLen;
+  if((size_t)(End - Pos) < 2 * sizeof(uint32_t))
+    return false;
+  memcpy(&Len, Pos, sizeof(uint32_t));
+  memcpy(&StoredLen, Pos + sizeof(uint32_t), sizeof(uint32_t));
+  Pos += 2 * sizeof(uint32_t);
+
+  if((size_t)(End - Pos) < StoredLen)
+    return false;
+  StringRef Stored(Pos, StoredLen);
+  Pos += StoredLen;
+
+  if(!Keep)
+    return true;
+
+  if(StoredLen == Len) {
+    Out << Stored;
+    return true;
+  }
+
+  SmallVector<char, 4096> Uncompressed;
+  if(zlib::uncompress(Stored, Uncompressed, Len) != zlib::StatusOK)
+    return false;
+  Out << StringRef(Uncompressed.data(), Uncompressed.size());
+  return true;
+
+}
+
+static bool readDOTTrace(uint64_t Seq, bool brief, raw_ostream& Out) {
+
+  DenseMap<uint64_t, uint64_t>::iterator findit = DOTTraceIndex.find(Seq);
+  if(findit == DOTTraceIndex.end())
+    return false;
+
+  if(!DOTTraceBuffer) {
+
+    // Finish writing before the first read; commit is over by the time the GUI asks.
+    closeDOTTrace();
+
+    std::string filename = getDOTTraceName();
+    ErrorOr<std::unique_ptr<MemoryBuffer> > Buf = MemoryBuffer::getFile(filename);
+    if(!Buf) {
+      errs() << "Failed to read " << filename << ": " << Buf.getError().message() << "\n";
+      return false;
+    }
+    DOTTraceBuffer = std::move(Buf.get());
+
   }
 
-  std::string ignored;
-  describeAsDOT(RFO, ignored, brief);
+  const char* Pos = DOTTraceBuffer->getBufferStart() + findit->second;
+  const char* End = DOTTraceBuffer->getBufferEnd();
+
+  uint64_t RecordSeq;
+  if((size_t)(End - Pos) < sizeof(uint64_t))
+    return false;
+  memcpy(&RecordSeq, Pos, sizeof(uint64_t));
+  Pos += sizeof(uint64_t);
+  release_assert(RecordSeq == Seq && "DOT trace index out of step with its records");
+
+  if(!readTraceString(Pos, End, brief, Out))
+    return false;
+  if(brief)
+    return true;
+  return readTraceString(Pos, End, true, Out);
 
 }
 
@@ -759,8 +900,16 @@ void IntegrationAttempt::saveDOT() {
   if(isCommitted())
     return;
 
-  saveDOT2(true);
-  saveDOT2(false);
+  std::string Brief, Full;
+  {
+    raw_string_ostream RSO(Brief);
+    describeAsDOT(RSO, true);
+  }
+  {
+    raw_string_ostream RSO(Full);
+    describeAsDOT(RSO, false);
+  }
+  appendDOTTrace(SeqNumber, Brief, Full);
 
   for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it)
     it->second->saveDOT();
@@ -779,12 +928,13 @@ void IntegrationAttempt::saveDOT() {
 
 }
 
-void IntegrationAttempt::describeAsDOT(raw_ostream& Out, std::string& othername, bool brief) {
+void IntegrationAttempt::describeAsDOT(raw_ostream& Out, bool brief) {
 
   if(isCommitted()) {
 
-    // Use existing DOT.
-    getSavedDotName(brief, othername);
+    // Use the description saved before commit.
+    if(!readDOTTrace(SeqNumber, brief, Out))
+      Out << "digraph \"Toplevel\" {\n\tlabel = \"No saved description\"\n}\n";
     return;
 
   }
@@ -839,8 +989,7 @@ void IntegrationAttempt::describeTreeAsDOT(std::string path) {
 
   }
 
-  std::string ign;
-  describeAsDOT(os, ign, false);
+  describeAsDOT(os, false);
 
   for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(), it2 = peelChildren.end(); it != it2; ++it) {
 
@@ -18,6 +18,7 @@
 #include "llvm/Analysis/MemoryBuiltins.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/IR/CFG.h"
 #include "llvm/Support/raw_ostream.h"
@@ -28,6 +29,8 @@
 
 using namespace llvm;
 
+static cl::opt<unsigned> ReadSummaryLimit("int-dse-read-summary-limit", cl::init(64));
+
 static uint32_t DSEProgressN = 0;
 const uint32_t DSEProgressLimit = 1000;
 
@@ -38,6 +41,7 @@ static void DSEProgress() {
 
     errs() << ".";
     DSEProgressN = 0;
+    noteProgress();
 
   }
 
@@ -66,6 +70,21 @@ TrackedStore::~TrackedStore() {
 
 }
 
+// One TrackedStore is made per candidate dead store, and most die young, so recycle them
+// through the pass-wide pool as for ImprovedValSetSingles.
+static TrackedStore* newTrackedStore(ShadowInstruction* SI, uint64_t Size) {
+
+  return new (GlobalIHP->TrackedStoreAllocator.Allocate()) TrackedStore(SI, Size);
+
+}
+
+static void deleteTrackedStore(TrackedStore* TS) {
+
+  TS->~TrackedStore();
+  GlobalIHP->TrackedStoreAllocator.Deallocate(TS);
+
+}
+
 bool TrackedStore::canKill() const {
 
   if(isNeeded)
@@ -131,6 +150,7 @@ void llvm::DeleteDeadInstruction(Instruction *I) {
 
     }
     
+    GlobalIHP->forgetPatchPlaceholder(DeadInst);
     DeadInst->eraseFromParent();
 
   } while (!NowDeadInsts.empty());
@@ -166,7 +186,7 @@ void TrackedStore::derefBytes(uint64_t nBytes) {
     if(canKill())
       kill();
 
-    delete this;
+    deleteTrackedStore(this);
 
   }
 
@@ -247,7 +267,8 @@ static bool GCStores(DSEMapTy::iterator argit) {
   argit.erase();
   argit.insert(oldStart, oldStop, newEntry);
 
-  return entry.size() == 0;
+  // entry refers to the erased value now, so test the replacement.
+  return newEntry.size() == 0;
 
 }
 
@@ -261,8 +282,6 @@ DSEMapPointer DSEMapPointer::getReadableCopy() {
     
   for(DSEMapTy::iterator it = M->begin(), itend = M->end(); it != itend;) {
 
-    const DSEMapEntry& oldEntry = it.value();
-
     uint64_t entrySize = (it.stop() - it.start());
 
     if(GCStores(it)) {
@@ -272,17 +291,12 @@ DSEMapPointer DSEMapPointer::getReadableCopy() {
     }
     else {
 
-      DSEMapEntry newEntry;
-	
-      for(DSEMapEntry::const_iterator entryit = oldEntry.begin(); entryit != oldEntry.end(); ++entryit) {
-
-	TrackedStore* thisStore = *entryit;
-	newEntry.push_back(thisStore);
-	thisStore->outstandingBytes += entrySize;
+      // GCStores may have replaced the entry.
+      const DSEMapEntry& keptEntry = it.value();
+      for(DSEMapEntry::const_iterator entryit = keptEntry.begin(); entryit != keptEntry.end(); ++entryit)
+	(*entryit)->outstandingBytes += entrySize;
 
-      }
-
-      newMap->insert(it.start(), it.stop(), newEntry);
+      newMap->insert(it.start(), it.stop(), keptEntry);
 
       ++it;
 
@@ -357,31 +371,32 @@ static void setAllNeeded(DSEMapTy& M) {
 
 }
 
-static void setAllNeeded(DSELocalStore::FrameType& frame) {
+static void setAllNeeded(DSELocalStore::FrameType& frame, bool allocsOnly = false) {
 
-  for(std::vector<DSEMapPointer>::iterator it = frame.store.begin(), itend = frame.store.end();
-      it != itend; ++it) {
+  for(uint32_t i = 0, ilim = frame.size(); i != ilim; ++i) {
 
-    if(it->isValid()) {
-      setAllNeeded(*it->M);
-      if(it->A)
-	it->A->isNeeded = true;
+    if(DSEMapPointer* slot = frame.getValidSlot(i)) {
+      if(!allocsOnly)
+	setAllNeeded(*slot->M);
+      if(slot->A)
+	slot->A->isNeeded = true;
     }
 
   }
 
 }
 
-static void setAllNeeded(DSELocalStore::NodeType* node, uint32_t height) {
+static void setAllNeeded(DSELocalStore::NodeType* node, uint32_t height, bool allocsOnly = false) {
 
   if(height == 0) {
 
-    for(uint32_t i = 0, ilim = HEAPTREEORDER; i != ilim; ++i) {
+    for(uint32_t slot = 0, slotlim = node->getNumChildren(); slot != slotlim; ++slot) {
 
-      DSEMapPointer* child = (DSEMapPointer*)node->children[i];
+      DSEMapPointer* child = (DSEMapPointer*)node->children[slot];
 	
       if(child && child->isValid()) {
-	setAllNeeded(*child->M);
+	if(!allocsOnly)
+	  setAllNeeded(*child->M);
 	if(child->A)
 	  child->A->isNeeded = true;
       }
@@ -391,11 +406,11 @@ static void setAllNeeded(DSELocalStore::NodeType* node, uint32_t height) {
   }
   else {
 
-    for(uint32_t i = 0, ilim = HEAPTREEORDER; i != ilim; ++i) {
+    for(uint32_t slot = 0, slotlim = node->getNumChildren(); slot != slotlim; ++slot) {
 
-      DSELocalStore::NodeType* child = (DSELocalStore::NodeType*)node->children[i];
+      DSELocalStore::NodeType* child = (DSELocalStore::NodeType*)node->children[slot];
       if(child)
-	setAllNeeded(child, height - 1);
+	setAllNeeded(child, height - 1, allocsOnly);
 
     }
 
@@ -418,6 +433,35 @@ void llvm::setAllNeededTop(DSELocalStore* store) {
 
 }
 
+// As setAllNeededTop, but for a call to a context that won't be committed and whose
+// original code reads only Objects: stores to anything else stay tracked across the call.
+// Every allocation is needed regardless, since the call may use a pointer without reading
+// through it.
+void llvm::setNeededForReads(DSELocalStore* store, DenseSet<ShadowValue>& Objects) {
+
+  for(SmallVector<DSELocalStore::FrameType*, 4>::iterator it = store->frames.begin(),
+	itend = store->frames.end(); it != itend; ++it) {
+
+    setAllNeeded(**it, true);
+
+  }
+
+  if(store->heap.height)
+    setAllNeeded(store->heap.root, store->heap.height - 1, true);
+
+  for(DenseSet<ShadowValue>::iterator it = Objects.begin(), itend = Objects.end(); it != itend; ++it) {
+
+    // Objects local to the callee are gone by now.
+    if(it->getFrameNo() >= (int32_t)store->frames.size())
+      continue;
+
+    if(DSEMapPointer* slot = store->getReadableStoreFor(*it))
+      setAllNeeded(*slot->M);
+
+  }
+
+}
+
 void DSEMapPointer::mergeStores(DSEMapPointer* mergeFrom, DSEMapPointer* mergeTo, uint64_t ASize, DSEMerger* Visitor) {
 
   // Just union the two stores together. They can't be the same store.
@@ -638,7 +682,7 @@ void DSEMapPointer::setWriter(int64_t Offset, uint64_t Size, ShadowInstruction*
   }
 
   // Insert the new entry:
-  TrackedStore* newStore = new TrackedStore(SI, Size);
+  TrackedStore* newStore = newTrackedStore(SI, Size);
   DSEMapEntry newEntry;
   newEntry.push_back(newStore);
   M->insert(Offset, End, newEntry);
@@ -738,6 +782,150 @@ void IntegrationAttempt::DSEHandleRead(ShadowValue PtrOp, uint64_t Size, ShadowB
       
 }
 
+// Note the objects PtrOp may read from, returning false if it might read anything. As in
+// DSEHandleRead, null and constant globals don't count.
+static bool addReadObjects(ShadowValue PtrOp, DenseSet<ShadowValue>& Objects) {
+
+  ImprovedValSetSingle IVS;
+  getImprovedValSetSingle(PtrOp, IVS);
+
+  if(IVS.isWhollyUnknown() || IVS.SetType != ValSetTypePB || containsUncertainPointers(IVS))
+    return false;
+
+  for(uint64_t i = 0, ilim = IVS.Values.size(); i != ilim; ++i) {
+
+    if(IVS.Values[i].V.isNullPointer())
+      continue;
+
+    ShadowGV* GV;
+    if((GV = IVS.Values[i].V.getGV()) && GV->G->isConstant())
+      continue;
+
+    Objects.insert(IVS.Values[i].V);
+
+  }
+
+  return true;
+
+}
+
+// Gather the objects this context's original code would read if run unspecialised,
+// including via loop iterations and (already summarised) child calls.
+void IntegrationAttempt::collectReadSummary(DenseSet<ShadowValue>& Objects, bool& Unknown) {
+
+  for(uint32_t i = BBsOffset, ilim = BBsOffset + nBBs; i != ilim && !Unknown; ++i) {
+
+    ShadowBB* BB = getBB(i);
+    if(!BB)
+      continue;
+
+    for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim && !Unknown; ++j) {
+
+      ShadowInstruction* I = &BB->insts[j];
+
+      if(inst_is<LoadInst>(I) || inst_is<AtomicRMWInst>(I) || inst_is<AtomicCmpXchgInst>(I)) {
+
+	Unknown = !addReadObjects(I->getOperand(0), Objects);
+
+      }
+      else if(inst_is<MemIntrinsic>(I)) {
+
+	if(inst_is<MemTransferInst>(I))
+	  Unknown = !addReadObjects(I->getCallArgOperand(1), Objects);
+
+      }
+      else if(inst_is<CallInst>(I) || inst_is<InvokeInst>(I)) {
+
+	if(InlineAttempt* IA = getInlineAttempt(I)) {
+
+	  if(IA->readsUnknown)
+	    Unknown = true;
+	  else
+	    Objects.insert(IA->readObjects.begin(), IA->readObjects.end());
+	  continue;
+
+	}
+
+	// read() only writes to its buffer.
+	if(pass->resolvedReadCalls.count(I))
+	  continue;
+
+	Function* F = getCalledFunction(I);
+	if(!F) {
+	  Unknown = true;
+	  continue;
+	}
+
+	if(F->doesNotAccessMemory())
+	  continue;
+
+	if(IntrinsicInst* II = dyn_cast_inst<IntrinsicInst>(I)) {
+	  if(II->getIntrinsicID() == Intrinsic::lifetime_start || II->getIntrinsicID() == Intrinsic::lifetime_end)
+	    continue;
+	}
+
+	DenseMap<Function*, specialfunctions>::iterator findit = SpecialFunctionMap.find(F);
+	if(findit == SpecialFunctionMap.end()) {
+	  Unknown = true;
+	  continue;
+	}
+
+	switch(findit->second) {
+	case SF_MALLOC:
+	case SF_FREE:
+	case SF_VASTART:
+	case SF_SAMEOBJECT:
+	  break;
+	case SF_REALLOC:
+	  Unknown = !addReadObjects(I->getCallArgOperand(0), Objects);
+	  break;
+	case SF_VACOPY:
+	  Unknown = !addReadObjects(I->getCallArgOperand(1), Objects);
+	  break;
+	default:
+	  Unknown = true;
+	  break;
+	}
+
+      }
+      else if(I->invar->I->mayReadFromMemory()) {
+
+	Unknown = true;
+
+      }
+
+    }
+
+  }
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend && !Unknown; ++it) {
+
+    for(uint32_t i = 0, ilim = it->second->Iterations.size(); i != ilim && !Unknown; ++i)
+      it->second->Iterations[i]->collectReadSummary(Objects, Unknown);
+
+  }
+
+}
+
+// Summarise before our blocks are freed, so that a caller can tell which stores a call to
+// us kills should we not be committed. Data that might be changed by another thread could
+// steer the original code's pointers elsewhere, so it gets no summary.
+void InlineAttempt::summariseReads() {
+
+  readObjects.clear();
+  readsUnknown = (!ReadSummaryLimit) || readsTentativeData;
+
+  if(!readsUnknown)
+    collectReadSummary(readObjects, readsUnknown);
+
+  if(readsUnknown || readObjects.size() > ReadSummaryLimit) {
+    readsUnknown = true;
+    readObjects.clear();
+  }
+
+}
+
 void IntegrationAttempt::DSEHandleWrite(ShadowValue PtrOp, uint64_t Size, ShadowInstruction* Writer, ShadowBB* BB) {
 
   // Occasionally zero-length memset or memcpy instructions get here: these are trivially removed
@@ -760,6 +948,8 @@ void IntegrationAttempt::DSEHandleWrite(ShadowValue PtrOp, uint64_t Size, Shadow
 
 void InlineAttempt::tryKillStores(bool commitDisabledHere, bool disableWrites) {
 
+  PhaseTimer Timer(PhaseDSE);
+
   if(isRootMainCall())
     BBs[0]->dseStore = new DSELocalStore(0);
 
@@ -873,7 +1063,7 @@ void IntegrationAttempt::DSEAnalyseInstruction(ShadowInstruction* I, bool commit
       else if((F = getCalledFunction(I)) && 
 	      (findit = SpecialFunctionMap.find(F)) != SpecialFunctionMap.end()) {
 
-	if(findit->second == SF_FREE) {
+	if(findit->second == SF_FREE && !GlobalIHP->deallocatorFunctions[F].releasesArena) {
 
 	  // Release the map and a tracked alloc reference for this location:
 	  ShadowValue PtrOp = I->getCallArgOperand(0);
@@ -930,7 +1120,7 @@ void IntegrationAttempt::DSEAnalyseInstruction(ShadowInstruction* I, bool commit
 	  for(uint32_t arg = 0, arglim = I->getNumArgOperands(); arg != arglim; ++arg) {
 
 	    // Can't hold a pointer?
-	    if(GlobalAA->getTypeStoreSize(FType->getParamType(arg)) < 8)
+	    if(getTypeStoreSize(FType->getParamType(arg)) < 8)
 	      return;
 
 	    // Known not a pointer?
@@ -977,7 +1167,7 @@ void IntegrationAttempt::DSEAnalyseInstruction(ShadowInstruction* I, bool commit
     // should never be deleted in any case.
 
     ShadowValue Pointer = I->getOperand(0);
-    uint64_t LoadSize = GlobalAA->getTypeStoreSize(I->getType());
+    uint64_t LoadSize = getTypeStoreSize(I->getType());
 
     // If isThreadLocal == TLS_MUSTCHECK then the load will happen for real
     // despite its known value.
@@ -1007,7 +1197,7 @@ void IntegrationAttempt::DSEAnalyseInstruction(ShadowInstruction* I, bool commit
   else if(inst_is<StoreInst>(I)) {
 
     ShadowValue Pointer = I->getOperand(1);
-    uint64_t StoreSize = GlobalAA->getTypeStoreSize(I->invar->I->getOperand(0)->getType());
+    uint64_t StoreSize = getTypeStoreSize(I->invar->I->getOperand(0)->getType());
     DSEHandleWrite(Pointer, StoreSize, I, BB);
 
   }
@@ -1016,6 +1206,8 @@ void IntegrationAttempt::DSEAnalyseInstruction(ShadowInstruction* I, bool commit
 
 void IntegrationAttempt::tryKillStoresInUnboundedLoop(const ShadowLoopInvar* UL, bool commitDisabledHere, bool disableWrites) {
 
+  PhaseTimer Timer(PhaseDSE);
+
   ShadowBB* BB = getBB(UL->headerIdx);
 	
   // Give header its store:
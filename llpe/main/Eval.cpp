@@ -22,15 +22,23 @@
 #include "llvm/Analysis/MemoryDependenceAnalysis.h"
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/IR/DataLayout.h"
 
 #include <string>
+#include <algorithm>
 
 using namespace llvm;
 
+static cl::opt<unsigned> DeadObjectUsers("int-dead-object-users", cl::init(64));
+static cl::opt<bool> NoReuseUnchanged("int-no-reuse-unchanged");
+
+static LLPEStat NeverNullMallocTests("never_null_malloc_tests", "Null tests of allocations that can't fail, folded without a check");
+static LLPEStat ConcreteIntFolds("concrete_int_folds", "Integer instructions folded on the concrete fast path");
+
 namespace llvm {
 
   std::string ind(int i) {
@@ -92,6 +100,9 @@ bool PeelIteration::isOptimisticPeel() {
 
 }
 
+// Sets NewPB to I's existing value, rather than a new one, if the merge leaves it unchanged.
+// The merge is built in the pass' scratch value set, so the revisits of a PHI or select while
+// its block's loop runs to a fixed point, which mostly find nothing new, allocate nothing.
 bool IntegrationAttempt::tryEvaluateMerge(ShadowInstruction* I, ImprovedValSet*& NewPB) {
 
   // The case for a resolved select instruction has already been handled.
@@ -100,7 +111,8 @@ bool IntegrationAttempt::tryEvaluateMerge(ShadowInstruction* I, ImprovedValSet*&
   if(inst_is<SelectInst>(I)) {
 
     Vals.push_back(I->getOperand(1));
-    Vals.push_back(I->getOperand(2));
+    if(I->getOperand(2) != Vals[0])
+      Vals.push_back(I->getOperand(2));
 
   }
   else {
@@ -112,13 +124,58 @@ bool IntegrationAttempt::tryEvaluateMerge(ShadowInstruction* I, ImprovedValSet*&
 
       SmallVector<ShadowValue, 1> predValues;
       getExitPHIOperands(I, i, predValues);
-      Vals.append(predValues.begin(), predValues.end());
+
+      // Merging in the same value twice is a no-op.
+      for(SmallVector<ShadowValue, 1>::iterator it = predValues.begin(), itend = predValues.end(); it != itend; ++it) {
+	if(std::find(Vals.begin(), Vals.end(), *it) == Vals.end())
+	  Vals.push_back(*it);
+      }
 
     }
 
   }
 
-  bool ret = getMergeValue(Vals, NewPB);
+  ImprovedValSetSingle* OldIVS = dyn_cast_or_null<ImprovedValSetSingle>(I->i.PB);
+  if(OldIVS && !OldIVS->isInitialised())
+    OldIVS = 0;
+
+  bool ret = false;
+  bool allSingles = true;
+  for(SmallVector<ShadowValue, 4>::iterator it = Vals.begin(), itend = Vals.end(); it != itend && allSingles; ++it) {
+    if(it->isInst() || it->isArg())
+      allSingles = !isa<ImprovedValSetMulti>(getIVSRef(*it));
+  }
+
+  if(!allSingles)
+    ret = getMergeValue(Vals, NewPB);
+  else if(Vals.size() == 1 && (Vals[0].isInst() || Vals[0].isArg()) && 
+	  cast<ImprovedValSetSingle>(getIVSRef(Vals[0]))->isInitialised()) {
+
+    // Every incoming value is the same: the result is a copy of its value set.
+    ImprovedValSetSingle* InIVS = cast<ImprovedValSetSingle>(getIVSRef(Vals[0]));
+    if(OldIVS && *OldIVS == *InIVS)
+      NewPB = OldIVS;
+    else
+      NewPB = copyIVS(InIVS);
+
+  }
+  else {
+
+    ImprovedValSetSingle& Scratch = pass->mergeScratch;
+    Scratch.Values.clear();
+    Scratch.SetType = ValSetTypeUnknown;
+    Scratch.Overdef = false;
+
+    for(SmallVector<ShadowValue, 4>::iterator it = Vals.begin(), itend = Vals.end(); it != itend && !Scratch.Overdef; ++it)
+      addValToPB(*it, Scratch);
+
+    if(OldIVS && *OldIVS == Scratch)
+      NewPB = OldIVS;
+    else
+      NewPB = copyIVS(&Scratch);
+
+  }
+
   ImprovedValSetSingle* NewIVS;
   if(NewPB && (NewIVS = dyn_cast<ImprovedValSetSingle>(NewPB)) && NewIVS->isWhollyUnknown()) {
 
@@ -141,7 +198,7 @@ bool IntegrationAttempt::getMergeValue(SmallVector<ShadowValue, 4>& Vals, Improv
   bool anyMultis = false;
   for(SmallVector<ShadowValue, 4>::iterator it = Vals.begin(), it2 = Vals.end(); it != it2; ++it) {
 
-    switch(it->t) {
+    switch(it->getValType()) {
     case SHADOWVAL_ARG:
     case SHADOWVAL_INST:
       anyMultis |= isa<ImprovedValSetMulti>(getIVSRef(*it));
@@ -224,6 +281,85 @@ bool IntegrationAttempt::tryEvaluateHeaderPHI(ShadowInstruction* SI, bool& resul
 
 }
 
+bool IntegrationAttempt::tryGetLoopInvariantResult(ShadowInstruction* SI, ImprovedValSet*& result) {
+
+  return false;
+
+}
+
+// Pure instructions whose result depends only on their operands' values.
+static bool isOperandDetermined(Instruction* I) {
+
+  return isa<BinaryOperator>(I) || isa<CastInst>(I) || isa<CmpInst>(I) ||
+    isa<GetElementPtrInst>(I) || isa<SelectInst>(I) ||
+    isa<ExtractValueInst>(I) || isa<InsertValueInst>(I);
+
+}
+
+// Returns true if every operand of SI has the same value in this iteration as
+// SI's counterpart's operands had in Prev.
+static bool operandsUnchanged(ShadowInstruction* SI, PeelIteration* Prev) {
+
+  for(uint32_t i = 0, ilim = SI->invar->operandIdxs.size(); i != ilim; ++i) {
+
+    ShadowInstIdx& SII = SI->invar->operandIdxs[i];
+    // Constants, globals and arguments are the same in every iteration.
+    if(SII.blockIdx == INVALID_BLOCK_IDX)
+      continue;
+
+    ShadowValue Op = SI->getOperand(i);
+    ShadowInstruction* PrevOp = Prev->getInst(SII.blockIdx, SII.instIdx);
+    if((!PrevOp) || Op.isInval() || !PrevOp->i.PB)
+      return false;
+
+    // Defined outside the loop.
+    if(Op.getInst() == PrevOp)
+      continue;
+
+    if(!IVMatchesVal(Op, PrevOp->i.PB))
+      return false;
+
+  }
+
+  return true;
+
+}
+
+// An instruction invariant in this loop evaluates the same way in every iteration,
+// so take the previous iteration's result rather than evaluating it afresh. The same
+// goes for a pure instruction whose operands happen to take the same values as they
+// did last iteration, e.g. anything computed from a flag that settles after the first
+// iteration, unless -int-no-reuse-unchanged is given.
+bool PeelIteration::tryGetLoopInvariantResult(ShadowInstruction* SI, ImprovedValSet*& result) {
+
+  if(iterationCount == 0 || SI->parent->invar->naturalScope != L)
+    return false;
+
+  bool isInvariant = SI->invar->loopInvariant;
+  if((!isInvariant) && !((!NoReuseUnchanged) && isOperandDetermined(SI->invar->I)))
+    return false;
+
+  PeelIteration* Prev = parentPA->Iterations[iterationCount - 1];
+  ShadowBB* PrevBB = Prev->getBB(*SI->parent->invar);
+  if(!PrevBB)
+    return false;
+
+  ImprovedValSet* PrevPB = PrevBB->insts[SI->invar->idx].i.PB;
+  if(!PrevPB)
+    return false;
+
+  if((!isInvariant) && !operandsUnchanged(SI, Prev))
+    return false;
+
+  result = copyIV(PrevPB);
+  if(isInvariant)
+    ++pass->stats.invariantReuses;
+  else
+    ++pass->stats.unchangedReuses;
+  return true;
+
+}
+
 bool PeelIteration::tryEvaluateHeaderPHI(ShadowInstruction* SI, bool& resultValid, ImprovedValSet*& result) {
 
   bool isHeaderPHI = SI->invar->parent->idx == L->headerIdx;
@@ -738,16 +874,16 @@ bool IntegrationAttempt::tryFoldPointerCmp(ShadowInstruction* SI, std::pair<ValS
   bool op0Null = SVNull(op0);
   bool op1Null = SVNull(op1);
 
-  bool op0Fun = (op0.isVal() && isa<Function>(op0.u.V->stripPointerCasts()));
-  bool op1Fun = (op1.isVal() && isa<Function>(op1.u.V->stripPointerCasts()));
+  bool op0Fun = (op0.isVal() && isa<Function>(op0.getVal()->stripPointerCasts()));
+  bool op1Fun = (op1.isVal() && isa<Function>(op1.getVal()->stripPointerCasts()));
 
   bool op0UGO = isGlobalIdentifiedObject(op0);
   bool op1UGO = isGlobalIdentifiedObject(op1);
 
   bool comparingHeapPointer = false;
-  if(op0UGO && op0.isPtrIdx() && op0.u.PtrOrFd.frame == -1)
+  if(op0UGO && op0.isPtrIdx() && op0.getIdxFrame() == -1)
     comparingHeapPointer = true;
-  else if(op1UGO && op1.isPtrIdx() && op1.u.PtrOrFd.frame == -1)
+  else if(op1UGO && op1.isPtrIdx() && op1.getIdxFrame() == -1)
     comparingHeapPointer = true;
 
   // Don't check the types here because we need to accept cases like comparing a ptrtoint'd pointer
@@ -780,7 +916,9 @@ bool IntegrationAttempt::tryFoldPointerCmp(ShadowInstruction* SI, std::pair<ValS
 
       ShadowValue& heapOp = op0Arg == zero ? op1 : op0;
 
-      if(!heapPointerAlreadyTested(heapOp, SI))
+      if(GlobalIHP->heap[heapOp.getHeapKey()].neverNull)
+	++NeverNullMallocTests;
+      else if(!heapPointerAlreadyTested(heapOp, SI))
 	(*needsRuntimeCheck) = RUNTIME_CHECK_AS_EXPECTED;
 
     }
@@ -834,13 +972,13 @@ bool IntegrationAttempt::tryFoldPointerCmp(ShadowInstruction* SI, std::pair<ValS
 
 static bool tryGetNegatedPointer(ShadowValue checkOp, uint64_t& SubOp0, ShadowValue& SubOp1Base, int64_t& SubOp1Offset) {
 
-  if((!checkOp.isInst()) || checkOp.u.I->invar->I->getOpcode() != Instruction::Sub)
+  if((!checkOp.isInst()) || checkOp.getInst()->invar->I->getOpcode() != Instruction::Sub)
     return false;
 
-  if(!tryGetConstantInt(checkOp.u.I->getOperand(0), SubOp0))
+  if(!tryGetConstantInt(checkOp.getInst()->getOperand(0), SubOp0))
     return false;
 
-  ShadowInstruction* SubOp1 = checkOp.u.I->getOperand(1).getInst();
+  ShadowInstruction* SubOp1 = checkOp.getInst()->getOperand(1).getInst();
   if(!SubOp1)
     return false;
 
@@ -1308,9 +1446,9 @@ void IntegrationAttempt::tryEvaluateResult(ShadowInstruction* SI,
 
       if(ImpType == ValSetTypeFD) {
 	if(DestTy->isIntegerTy(32))
-	  Improved.V.t = SHADOWVAL_FDIDX;
+	  Improved.V = ShadowValue::getFdIdx(Improved.V.getIdx());
 	else
-	  Improved.V.t = SHADOWVAL_FDIDX64;
+	  Improved.V = ShadowValue::getFdIdx64(Improved.V.getIdx());
       }
 
       return;
@@ -1469,7 +1607,7 @@ void IntegrationAttempt::tryEvaluateResult(ShadowInstruction* SI,
     }
 
     release_assert(Ops[0].second.V.isVal());
-    Constant* Agg = cast<Constant>(Ops[0].second.V.u.V);
+    Constant* Agg = cast<Constant>(Ops[0].second.V.getVal());
     Constant* Ext = ConstantFoldExtractValueInstruction(Agg, cast<ExtractValueInst>(SI->invar->I)->getIndices());
     if(Ext) {
       ImpType = ValSetTypeScalar;
@@ -1658,10 +1796,10 @@ bool IntegrationAttempt::tryEvaluateOrdinaryInst(ShadowInstruction* SI, Improved
 
   ShadowValue OpV = SI->getOperand(OpIdx);
 
-  switch(OpV.t) {
+  switch(OpV.getValType()) {
   case SHADOWVAL_OTHER:
     
-    Ops[OpIdx] = getValPB(OpV.u.V);
+    Ops[OpIdx] = getValPB(OpV.getVal());
     return tryEvaluateOrdinaryInst(SI, NewPB, Ops, OpIdx+1);
 
   case SHADOWVAL_GV:
@@ -1900,7 +2038,7 @@ bool IntegrationAttempt::tryEvaluateMultiInst(ShadowInstruction* SI, ImprovedVal
     return tryEvaluateMultiCmp(SI, NewIV);
 
   unsigned opcode = SI->invar->I->getOpcode();
-  int64_t resSize = (int64_t)GlobalAA->getTypeStoreSize(SI->getType());
+  int64_t resSize = (int64_t)getTypeStoreSize(SI->getType());
 
   switch(opcode) {
     
@@ -1986,7 +2124,7 @@ bool IntegrationAttempt::tryEvaluateMultiInst(ShadowInstruction* SI, ImprovedVal
       }
       else if(!ComplexValuesInRange) {
 	
-	if(overdefInRange || setProduct > PBMAX) {
+	if(overdefInRange || setProduct > PBMax) {
 	  NewIV = newOverdefIVS();
 	  return true;
 	}
@@ -2221,14 +2359,439 @@ bool IntegrationAttempt::tryEvaluateMultiInst(ShadowInstruction* SI, ImprovedVal
 
 }
 
+// Get the distinct integers an operand may take, sorted, if it is a known set of them.
+static bool getSortedIntSet(ShadowValue OpV, SmallVector<uint64_t, 16>& Out) {
+
+  uint64_t OpInt;
+  if(OpV.getCI(OpInt)) {
+    Out.push_back(OpInt);
+    return true;
+  }
+
+  if(OpV.getValType() != SHADOWVAL_INST && OpV.getValType() != SHADOWVAL_ARG)
+    return false;
+
+  ImprovedValSetSingle* IVS = dyn_cast<ImprovedValSetSingle>(getIVSRef(OpV));
+  if((!IVS) || IVS->isWhollyUnknown() || IVS->SetType != ValSetTypeScalar)
+    return false;
+
+  for(uint32_t i = 0, ilim = IVS->Values.size(); i != ilim; ++i) {
+
+    if(!tryGetConstantInt(IVS->Values[i].V, OpInt))
+      return false;
+    Out.push_back(OpInt);
+
+  }
+
+  std::sort(Out.begin(), Out.end());
+  Out.erase(std::unique(Out.begin(), Out.end()), Out.end());
+  return true;
+
+}
+
+// Compare two sets of integers for (in)equality with one merge of the sorted sets,
+// rather than folding every pair of values as tryEvaluateOrdinaryInst would.
+static bool tryEvaluateIntSetEquality(ShadowInstruction* SI, ImprovedValSetSingle& NewPB) {
+
+  ICmpInst* CI = dyn_cast_inst<ICmpInst>(SI);
+  if((!CI) || !CI->isEquality())
+    return false;
+
+  SmallVector<uint64_t, 16> LHS, RHS;
+  if(!(getSortedIntSet(SI->getOperand(0), LHS) && getSortedIntSet(SI->getOperand(1), RHS)))
+    return false;
+
+  // Small sets are as cheap to do pairwise.
+  if(LHS.size() * RHS.size() <= 4)
+    return false;
+
+  bool mayBeEqual = false;
+  for(uint32_t i = 0, j = 0; i != LHS.size() && j != RHS.size() && !mayBeEqual;) {
+
+    if(LHS[i] == RHS[j])
+      mayBeEqual = true;
+    else if(LHS[i] < RHS[j])
+      ++i;
+    else
+      ++j;
+
+  }
+
+  LLVMContext& LLC = SI->invar->I->getContext();
+  bool isEQ = CI->getPredicate() == CmpInst::ICMP_EQ;
+
+  if(mayBeEqual)
+    NewPB.mergeOne(ValSetTypeScalar, ImprovedVal(ShadowValue(isEQ ? ConstantInt::getTrue(LLC) : ConstantInt::getFalse(LLC))));
+
+  // Some pair must differ, since at least one set has several members.
+  NewPB.mergeOne(ValSetTypeScalar, ImprovedVal(ShadowValue(isEQ ? ConstantInt::getFalse(LLC) : ConstantInt::getTrue(LLC))));
+
+  return true;
+
+}
+
+// Vector values are evaluated a lane at a time, each lane being a byte range of the value
+// as a multi describes it. That way vectors only partly known, or holding pointers or FDs,
+// can still have lanes extracted, inserted, shuffled and operated on.
+
+static bool getVectorLaneSize(Type* Ty, uint64_t& LaneSize) {
+
+  VectorType* VTy = dyn_cast<VectorType>(Ty);
+  if(!VTy)
+    return false;
+
+  uint64_t LaneBits = GlobalTD->getTypeSizeInBits(VTy->getElementType());
+  if(LaneBits % 8)
+    return false;
+
+  LaneSize = LaneBits / 8;
+  return true;
+
+}
+
+static void getVectorLane(ShadowValue V, uint64_t Start, Type* LaneTy, ImprovedValSetSingle& Out) {
+
+  uint64_t Size = getTypeStoreSize(LaneTy);
+
+  if(ImprovedValSetMulti* IVM = dyn_cast_or_null<ImprovedValSetMulti>(tryGetIVSRef(V))) {
+
+    SmallVector<IVSRange, 4> SubVals;
+    uint64_t Covered = Start;
+
+    for(ImprovedValSetMulti::MapIt it = IVM->Map.begin(), itend = IVM->Map.end(); 
+	it != itend && it.start() < Start + Size; ++it) {
+
+      if(it.stop() <= Start)
+	continue;
+      if(it.start() > Covered)
+	break;
+
+      const ImprovedValSetSingle& IVS = it.value();
+
+      if(it.start() == Start && it.stop() == Start + Size) {
+
+	Out = IVS;
+	if(Out.isWhollyUnknown() || !Out.coerceToType(LaneTy, Size, 0))
+	  Out.setOverdef();
+	return;
+
+      }
+
+      // Otherwise the lane can only be assembled from concrete bytes.
+      if(IVS.isWhollyUnknown() || IVS.SetType != ValSetTypeScalar || IVS.Values.size() != 1)
+	break;
+
+      uint64_t First = std::max(Start, it.start());
+      uint64_t Last = std::min(Start + Size, it.stop());
+      getConstSubVals(IVS.Values[0].V, First - it.start(), Last - First, ((int64_t)it.start()) - ((int64_t)Start), SubVals);
+      Covered = Last;
+
+    }
+
+    Constant* LaneC = 0;
+    if(Covered == Start + Size)
+      LaneC = valsToConst(SubVals, Size, LaneTy);
+
+    if(LaneC) {
+      std::pair<ValSetType, ImprovedVal> LanePB = getValPB(LaneC);
+      Out.set(LanePB.second, LanePB.first);
+    }
+    else {
+      Out.setOverdef();
+    }
+
+    return;
+
+  }
+
+  ImprovedValSetSingle IVS;
+  if(getImprovedValSetSingle(V, IVS) && (!IVS.isWhollyUnknown()) && IVS.SetType == ValSetTypeScalar && IVS.Values.size() == 1)
+    getConstSubVal(IVS.Values[0].V, Start, Size, LaneTy, Out);
+  else
+    Out.setOverdef();
+
+}
+
+// Lanes that are all constants make an ordinary constant vector; otherwise make a multi.
+static ImprovedValSet* makeVectorValue(VectorType* VTy, uint64_t LaneSize, SmallVector<ImprovedValSetSingle, 8>& Lanes) {
+
+  Type* LaneTy = VTy->getElementType();
+  SmallVector<Constant*, 8> LaneConsts;
+  bool allConstant = true;
+  bool anyKnown = false;
+
+  for(SmallVector<ImprovedValSetSingle, 8>::iterator it = Lanes.begin(), itend = Lanes.end(); it != itend; ++it) {
+
+    if(!it->isInitialised())
+      it->setOverdef();
+
+    if(it->isWhollyUnknown()) {
+      allConstant = false;
+      continue;
+    }
+
+    anyKnown = true;
+
+    if(allConstant && it->SetType == ValSetTypeScalar && it->Values.size() == 1) {
+      Constant* C = getSingleConstant(it->Values[0].V);
+      if(C->getType() == LaneTy) {
+	LaneConsts.push_back(C);
+	continue;
+      }
+    }
+
+    allConstant = false;
+
+  }
+
+  if(!anyKnown)
+    return newOverdefIVS();
+
+  if(allConstant) {
+
+    std::pair<ValSetType, ImprovedVal> VecPB = getValPB(ConstantVector::get(LaneConsts));
+    ImprovedValSetSingle* NewIVS = newIVS();
+    NewIVS->set(VecPB.second, VecPB.first);
+    return NewIVS;
+
+  }
+
+  ImprovedValSetMulti* NewIVM = new ImprovedValSetMulti(getTypeStoreSize(VTy));
+  for(uint32_t i = 0, ilim = Lanes.size(); i != ilim; ++i)
+    NewIVM->Map.insert(i * LaneSize, (i + 1) * LaneSize, Lanes[i]);
+
+  return NewIVM;
+
+}
+
+static bool shouldEvaluateAsVector(ShadowInstruction* SI) {
+
+  unsigned opcode = SI->invar->I->getOpcode();
+  bool buildsLanes = opcode == Instruction::InsertElement || opcode == Instruction::ShuffleVector;
+
+  if(!(buildsLanes || opcode == Instruction::ExtractElement || 
+       (Instruction::isBinaryOp(opcode) && SI->getType()->isVectorTy())))
+    return false;
+
+  for(uint32_t i = 0, ilim = buildsLanes ? 2 : SI->getNumOperands(); i != ilim; ++i) {
+
+    ShadowValue OpV = SI->getOperand(i);
+    ImprovedValSet* IV = tryGetIVSRef(OpV);
+
+    // Everything else is left to the constant folder.
+    if(IV && isa<ImprovedValSetMulti>(IV))
+      return true;
+
+    if(buildsLanes) {
+
+      if(OpV.isGV())
+	return true;
+      if(ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(IV)) {
+	if((!IVS->isWhollyUnknown()) && IVS->SetType != ValSetTypeScalar)
+	  return true;
+      }
+
+    }
+
+  }
+
+  return false;
+
+}
+
+static bool tryEvaluateVectorInst(ShadowInstruction* SI, ImprovedValSet*& NewPB) {
+
+  if(!shouldEvaluateAsVector(SI))
+    return false;
+
+  unsigned opcode = SI->invar->I->getOpcode();
+  uint64_t LaneSize;
+
+  if(opcode == Instruction::ExtractElement) {
+
+    Type* VecTy = SI->invar->I->getOperand(0)->getType();
+    ConstantInt* Idx = dyn_cast_or_null<ConstantInt>(getConstReplacement(SI->getOperand(1)));
+    if((!Idx) || !getVectorLaneSize(VecTy, LaneSize) || Idx->getZExtValue() >= VecTy->getVectorNumElements()) {
+      NewPB = newOverdefIVS();
+      return true;
+    }
+
+    ImprovedValSetSingle* NewIVS = newIVS();
+    getVectorLane(SI->getOperand(0), Idx->getZExtValue() * LaneSize, VecTy->getVectorElementType(), *NewIVS);
+    NewPB = NewIVS;
+    return true;
+
+  }
+
+  VectorType* VTy = cast<VectorType>(SI->getType());
+  if(!getVectorLaneSize(VTy, LaneSize)) {
+    NewPB = newOverdefIVS();
+    return true;
+  }
+
+  Type* LaneTy = VTy->getElementType();
+  uint32_t nLanes = VTy->getNumElements();
+  SmallVector<ImprovedValSetSingle, 8> Lanes(nLanes);
+
+  if(opcode == Instruction::InsertElement) {
+
+    ConstantInt* Idx = dyn_cast_or_null<ConstantInt>(getConstReplacement(SI->getOperand(2)));
+
+    for(uint32_t i = 0; i != nLanes; ++i) {
+
+      if(!Idx)
+	Lanes[i].setOverdef();
+      else if(Idx->getZExtValue() == i) {
+	if(!getImprovedValSetSingle(SI->getOperand(1), Lanes[i]))
+	  Lanes[i].setOverdef();
+      }
+      else
+	getVectorLane(SI->getOperand(0), i * LaneSize, LaneTy, Lanes[i]);
+
+    }
+
+  }
+  else if(opcode == Instruction::ShuffleVector) {
+
+    Constant* Mask = cast<Constant>(SI->invar->I->getOperand(2));
+    uint32_t nInLanes = SI->invar->I->getOperand(0)->getType()->getVectorNumElements();
+
+    for(uint32_t i = 0; i != nLanes; ++i) {
+
+      int InLane = ShuffleVectorInst::getMaskValue(Mask, i);
+      if(InLane < 0)
+	Lanes[i].set(ImprovedVal(ShadowValue(UndefValue::get(LaneTy))), ValSetTypeScalar);
+      else if((uint32_t)InLane < nInLanes)
+	getVectorLane(SI->getOperand(0), InLane * LaneSize, LaneTy, Lanes[i]);
+      else
+	getVectorLane(SI->getOperand(1), (InLane - nInLanes) * LaneSize, LaneTy, Lanes[i]);
+
+    }
+
+  }
+  else {
+
+    // Lane-wise binary operator:
+    for(uint32_t i = 0; i != nLanes; ++i) {
+
+      ImprovedValSetSingle LHS, RHS;
+      getVectorLane(SI->getOperand(0), i * LaneSize, LaneTy, LHS);
+      getVectorLane(SI->getOperand(1), i * LaneSize, LaneTy, RHS);
+
+      if(LHS.isWhollyUnknown() || RHS.isWhollyUnknown() || LHS.SetType != ValSetTypeScalar || RHS.SetType != ValSetTypeScalar ||
+	 LHS.Values.size() != 1 || RHS.Values.size() != 1) {
+	Lanes[i].setOverdef();
+	continue;
+      }
+
+      Constant* Result = ConstantExpr::get(opcode, getSingleConstant(LHS.Values[0].V), getSingleConstant(RHS.Values[0].V));
+      if(ConstantExpr* CE = dyn_cast<ConstantExpr>(Result))
+	Result = ConstantFoldConstantExpression(CE, GlobalTD);
+
+      if((!Result) || isa<ConstantExpr>(Result))
+	Lanes[i].setOverdef();
+      else {
+	std::pair<ValSetType, ImprovedVal> LanePB = getValPB(Result);
+	Lanes[i].set(LanePB.second, LanePB.first);
+      }
+
+    }
+
+  }
+
+  NewPB = makeVectorValue(VTy, LaneSize, Lanes);
+  return true;
+
+}
+
+// Get OpV as a single known integer of up to 64 bits, with the ShadowValue holding it.
+static bool getConcreteIntOperand(ShadowValue OpV, ShadowValue& IntV, uint64_t& Out) {
+
+  switch(OpV.getValType()) {
+
+  case SHADOWVAL_ARG:
+  case SHADOWVAL_INST:
+    {
+      ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(getIVSRef(OpV));
+      if((!IVS) || IVS->Overdef || IVS->SetType != ValSetTypeScalar || IVS->Values.size() != 1)
+	return false;
+      IntV = IVS->Values[0].V;
+      break;
+    }
+  default:
+    IntV = OpV;
+    break;
+
+  }
+
+  return tryGetConstantInt(IntV, Out);
+
+}
+
+// Much of a run, in start-up code especially, computes integer operations on operands
+// that are all single known values. Fold those straight away: none of the special cases
+// for pointers, FDs, sets or path conditions below can apply, and they would come to the
+// same IHPFoldIntOp call at the end of tryEvaluateResult.
+static bool tryEvaluateConcreteIntInst(ShadowInstruction* SI, ImprovedValSet*& NewPB) {
+
+  Instruction* I = SI->invar->I;
+  if(!I->getType()->isIntegerTy())
+    return false;
+
+  switch(I->getOpcode()) {
+  case Instruction::ZExt:
+  case Instruction::SExt:
+  case Instruction::Trunc:
+  case Instruction::ICmp:
+    break;
+  default:
+    if(!isa<BinaryOperator>(I))
+      return false;
+    break;
+  }
+
+  std::pair<ValSetType, ImprovedVal> Ops[2];
+  SmallVector<uint64_t, 4> OpInts;
+
+  for(uint32_t i = 0, ilim = SI->getNumOperands(); i != ilim; ++i) {
+
+    uint64_t OpInt;
+    ShadowValue IntV;
+    if(!getConcreteIntOperand(SI->getOperand(i), IntV, OpInt))
+      return false;
+
+    Ops[i] = std::make_pair(ValSetTypeScalar, ImprovedVal(IntV));
+    OpInts.push_back(OpInt);
+
+  }
+
+  ValSetType ImpType;
+  ImprovedVal Improved;
+  if(!IHPFoldIntOp(SI, Ops, OpInts, ImpType, Improved))
+    return false;
+
+  ImprovedValSetSingle* NewIVS = newIVS();
+  NewIVS->set(Improved, ImpType);
+  NewPB = NewIVS;
+  ++ConcreteIntFolds;
+  return true;
+
+}
+
 bool IntegrationAttempt::tryEvaluateOrdinaryInst(ShadowInstruction* SI, ImprovedValSet*& NewPB) {
 
+  if(tryEvaluateConcreteIntInst(SI, NewPB))
+    return true;
+
+  if(tryEvaluateVectorInst(SI, NewPB))
+    return true;
+
   bool anyMultis = false;
 
   for(uint32_t i = 0, ilim = SI->getNumOperands(); i != ilim && !anyMultis; ++i) {
     
     ShadowValue OpV = SI->getOperand(i);
-    switch(OpV.t) {
+    switch(OpV.getValType()) {
     case SHADOWVAL_INST:
     case SHADOWVAL_ARG:
       anyMultis |= isa<ImprovedValSetMulti>(getIVSRef(OpV));
@@ -2245,6 +2808,8 @@ bool IntegrationAttempt::tryEvaluateOrdinaryInst(ShadowInstruction* SI, Improved
   else {
     ImprovedValSetSingle* NewIVS = newIVS();
     NewPB = NewIVS;
+    if(tryEvaluateIntSetEquality(SI, *NewIVS))
+      return true;
     std::pair<ValSetType, ImprovedVal> Ops[SI->getNumOperands()];
     return tryEvaluateOrdinaryInst(SI, *NewIVS, Ops, 0);
   }
@@ -2355,6 +2920,25 @@ static bool willUseIndirectly(ImprovedValSet* IV) {
 
 }
 
+// Record V as pointing into an allocation, for DIE's whole-object liveness. An invalid
+// entry at the end pins the allocation: too many users to track, or a use outside the
+// def-use graph such as a path condition argument.
+static void noteObjectUser(std::vector<std::pair<ShadowValue, uint32_t> >& Users, ShadowValue V) {
+
+  if((!Users.empty()) && Users.back().first.isInval())
+    return;
+
+  std::pair<ShadowValue, uint32_t> User(V, V.getCtx()->SeqNumber);
+  if(std::find(Users.begin(), Users.end(), User) != Users.end())
+    return;
+
+  if(Users.size() >= DeadObjectUsers)
+    Users.push_back(std::make_pair(ShadowValue(), 0));
+  else
+    Users.push_back(User);
+
+}
+
 void IntegrationAttempt::noteIndirectUse(ShadowValue V, ImprovedValSet* NewPB) {
 
   if(willUseIndirectly(NewPB)) {
@@ -2365,7 +2949,7 @@ void IntegrationAttempt::noteIndirectUse(ShadowValue V, ImprovedValSet* NewPB) {
       AllocData* AD = getAllocData(NewIVS->Values[0].V);
       if(AD->allocValue.isInst() && !AD->isCommitted) {
 	std::vector<std::pair<ShadowValue, uint32_t> >& Users = GlobalIHP->indirectDIEUsers[AD->allocValue];
-	//Users.push_back(std::make_pair(V, V.getCtx()->SeqNumber));
+	noteObjectUser(Users, V);
       }
 
     }
@@ -2400,7 +2984,10 @@ bool IntegrationAttempt::tryEvaluate(ShadowValue V, bool inLoopAnalyser, bool& l
   bool NewPBValid;
 
   ShadowInstruction* SI = V.getInst();
-  NewPBValid = getNewPB(SI, NewPB, loadedVararg);
+  if((!inLoopAnalyser) && tryGetLoopInvariantResult(SI, NewPB))
+    NewPBValid = true;
+  else
+    NewPBValid = getNewPB(SI, NewPB, loadedVararg);
 
   // AFAIK only void calls can be rejected this way.
   if(!NewPB)
@@ -2408,6 +2995,10 @@ bool IntegrationAttempt::tryEvaluate(ShadowValue V, bool inLoopAnalyser, bool& l
 
   release_assert(NewPBValid);
 
+  // A merge that found nothing new hands back the existing value itself.
+  if(NewPB == OldPB && OldPBValid)
+    return false;
+
   // Check if there is a path condition defining the instruction,
   // as opposed to one defining an /argument/, which is checked elsewhere.
   {
@@ -2480,15 +3071,15 @@ bool IntegrationAttempt::tryEvaluate(ShadowValue V, bool inLoopAnalyser, bool& l
 
 Type* ShadowValue::getNonPointerType() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_ARG:
-    return u.A->getType();
+    return getArg()->getType();
   case SHADOWVAL_INST:
-    return u.I->getType();
+    return getInst()->getType();
   case SHADOWVAL_GV:
-    return u.GV->G->getType();
+    return getGV()->G->getType();
   case SHADOWVAL_OTHER:
-    return u.V->getType();
+    return getVal()->getType();
   case SHADOWVAL_FDIDX:
     return GInt32;
   case SHADOWVAL_FDIDX64:
@@ -2511,7 +3102,7 @@ Type* ShadowValue::getNonPointerType() const {
 
 Type* IntegrationAttempt::getValueType(ShadowValue V) {
 
-  switch(V.t) {
+  switch(V.getValType()) {
   case SHADOWVAL_PTRIDX:
     {
       AllocData* AD = getAllocData(V);
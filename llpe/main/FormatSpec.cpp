@@ -0,0 +1,323 @@
+//===-- FormatSpec.cpp ----------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Specialisation of residual printf and fprintf calls, enabled with
+// -int-fold-format-strings. After commit, a call whose format string is constant has
+// every plain conversion (no flags, width or precision) whose argument is now a constant
+// string, character or integer printed into the format string itself, leaving only the
+// conversions that still need their argument. A call left printing constant text and whose
+// result is unused becomes a puts or fputs call, or goes away if it prints nothing.
+//
+// This is most useful with -int-never-inline=printf (etc), so that LLPE doesn't analyse
+// the library's formatting code at all: the call stays residual and its format string is
+// folded here. Calls using %n, '*' widths or positional arguments are left alone.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/ADT/APInt.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <string.h>
+
+using namespace llvm;
+
+static cl::opt<bool> FoldFormatStrings("int-fold-format-strings");
+
+static void appendEscaped(std::string& Fmt, StringRef Text) {
+
+  for(StringRef::iterator it = Text.begin(), itend = Text.end(); it != itend; ++it) {
+    if(*it == '%')
+      Fmt += '%';
+    Fmt += *it;
+  }
+
+}
+
+// Print the constant Arg as conversion Conv with length modifier Len, or return false.
+static bool foldIntConversion(Value* Arg, char Conv, StringRef Len, std::string& Out) {
+
+  ConstantInt* CI = dyn_cast<ConstantInt>(Arg);
+  if(!CI)
+    return false;
+
+  unsigned argBits = CI->getBitWidth();
+  unsigned bits;
+  if(Len == "hh")
+    bits = 8;
+  else if(Len == "h")
+    bits = 16;
+  else if(Len == "")
+    bits = 32;
+  else if(Len == "l" || Len == "ll" || Len == "j" || Len == "z" || Len == "t")
+    bits = argBits;
+  else
+    return false;
+
+  if(bits > argBits)
+    return false;
+
+  APInt Val = CI->getValue().trunc(bits);
+  SmallString<24> Str;
+
+  switch(Conv) {
+  case 'd': case 'i':
+    Val.toString(Str, 10, true);
+    break;
+  case 'u':
+    Val.toString(Str, 10, false);
+    break;
+  case 'o':
+    Val.toString(Str, 8, false);
+    break;
+  case 'x':
+    Val.toString(Str, 16, false);
+    Out += StringRef(Str).lower();
+    return true;
+  case 'X':
+    Val.toString(Str, 16, false);
+    Out += StringRef(Str).upper();
+    return true;
+  default:
+    return false;
+  }
+
+  Out += Str.str();
+  return true;
+
+}
+
+static Constant* getFormatConstant(Module& M, const std::string& Str, Type* PtrTy) {
+
+  Constant* Init = ConstantDataArray::getString(M.getContext(), Str);
+  GlobalVariable* GV = new GlobalVariable(M, Init->getType(), true, GlobalValue::PrivateLinkage, Init, "spec_fmt");
+  GV->setUnnamedAddr(true);
+
+  Constant* Zero = ConstantInt::get(Type::getInt64Ty(M.getContext()), 0);
+  Constant* Idxs[2] = { Zero, Zero };
+  Constant* Ptr = ConstantExpr::getInBoundsGetElementPtr(GV, Idxs);
+  return ConstantExpr::getBitCast(Ptr, PtrTy);
+
+}
+
+// Returns true if CI was rewritten or deleted.
+static bool foldFormatCall(CallInst* CI) {
+
+  Function* Callee = CI->getCalledFunction();
+  if((!Callee) || !Callee->isVarArg())
+    return false;
+
+  unsigned fmtIdx;
+  if(Callee->getName() == "printf")
+    fmtIdx = 0;
+  else if(Callee->getName() == "fprintf")
+    fmtIdx = 1;
+  else
+    return false;
+
+  if(CI->getNumArgOperands() <= fmtIdx)
+    return false;
+
+  StringRef Fmt;
+  if(!getConstantStringInfo(CI->getArgOperand(fmtIdx), Fmt))
+    return false;
+
+  // NewFmt is the residual format string, Text the output if no conversions remain.
+  std::string NewFmt, Text;
+  SmallVector<Value*, 8> ResidualArgs;
+  for(unsigned i = 0; i <= fmtIdx; ++i)
+    ResidualArgs.push_back(CI->getArgOperand(i));
+
+  unsigned nextArg = fmtIdx + 1;
+  bool folded = false;
+  bool residualConversions = false;
+
+  for(size_t i = 0, ilim = Fmt.size(); i != ilim; ++i) {
+
+    if(Fmt[i] != '%') {
+      appendEscaped(NewFmt, Fmt.substr(i, 1));
+      Text += Fmt[i];
+      continue;
+    }
+
+    size_t start = i++;
+    size_t flagsStart = i;
+    while(i != ilim && strchr("-+ #0123456789.", Fmt[i]))
+      ++i;
+    bool plain = i == flagsStart;
+
+    size_t lenStart = i;
+    while(i != ilim && strchr("hljztL", Fmt[i]))
+      ++i;
+    if(i == ilim)
+      return false;
+
+    StringRef Len = Fmt.slice(lenStart, i);
+    char Conv = Fmt[i];
+    StringRef Spec = Fmt.slice(start, i + 1);
+
+    if(Conv == '%') {
+      NewFmt += "%%";
+      Text += '%';
+      continue;
+    }
+
+    // Positional arguments, '*' and %n all defeat folding.
+    if(!strchr("diouxXcsfFeEgGaAp", Conv))
+      return false;
+
+    if(nextArg == CI->getNumArgOperands())
+      return false;
+    Value* Arg = CI->getArgOperand(nextArg++);
+
+    std::string FoldedText;
+    bool canFold = false;
+    if(plain) {
+
+      if(Conv == 's' && Len.empty()) {
+	StringRef Str;
+	if(getConstantStringInfo(Arg, Str)) {
+	  FoldedText = Str.str();
+	  canFold = true;
+	}
+      }
+      else if(Conv == 'c' && Len.empty()) {
+	// Printing a NUL can't be expressed in a format string.
+	ConstantInt* C = dyn_cast<ConstantInt>(Arg);
+	if(C && (C->getZExtValue() & 0xff)) {
+	  FoldedText = std::string(1, (char)(C->getZExtValue() & 0xff));
+	  canFold = true;
+	}
+      }
+      else {
+	canFold = foldIntConversion(Arg, Conv, Len, FoldedText);
+      }
+
+    }
+
+    if(canFold) {
+      appendEscaped(NewFmt, FoldedText);
+      Text += FoldedText;
+      folded = true;
+    }
+    else {
+      NewFmt += Spec.str();
+      ResidualArgs.push_back(Arg);
+      residualConversions = true;
+    }
+
+  }
+
+  // Ignore any excess arguments, as printf does.
+
+  bool textOnly = !residualConversions;
+  bool unused = CI->use_empty();
+
+  if(!folded && !(textOnly && unused))
+    return false;
+
+  Module& M = *CI->getParent()->getParent()->getParent();
+  LLVMContext& Ctx = M.getContext();
+  Type* FmtTy = CI->getArgOperand(fmtIdx)->getType();
+
+  if(textOnly && unused) {
+
+    if(Text.empty()) {
+      CI->eraseFromParent();
+      return true;
+    }
+
+    if(fmtIdx == 0 && Text[Text.size() - 1] == '\n') {
+
+      Constant* Puts = M.getOrInsertFunction("puts", Type::getInt32Ty(Ctx), FmtTy, NULL);
+      Value* Str = getFormatConstant(M, Text.substr(0, Text.size() - 1), FmtTy);
+      CallInst::Create(Puts, Str, "", CI);
+      CI->eraseFromParent();
+      return true;
+
+    }
+    else if(fmtIdx == 1) {
+
+      Value* Stream = CI->getArgOperand(0);
+      Constant* FPuts = M.getOrInsertFunction("fputs", Type::getInt32Ty(Ctx), FmtTy, Stream->getType(), NULL);
+      Value* Args[2] = { getFormatConstant(M, Text, FmtTy), Stream };
+      CallInst::Create(FPuts, ArrayRef<Value*>(Args), "", CI);
+      CI->eraseFromParent();
+      return true;
+
+    }
+
+    // A printf with no trailing newline stays a printf.
+
+  }
+
+  if(!folded)
+    return false;
+
+  ResidualArgs[fmtIdx] = getFormatConstant(M, NewFmt, FmtTy);
+  CallInst* NewCI = CallInst::Create(CI->getCalledValue(), ResidualArgs, "", CI);
+  NewCI->setCallingConv(CI->getCallingConv());
+  NewCI->setAttributes(CI->getAttributes());
+  NewCI->takeName(CI);
+  CI->replaceAllUsesWith(NewCI);
+  CI->eraseFromParent();
+  return true;
+
+}
+
+static void foldFormatStringsIn(Function* F, uint64_t& folded) {
+
+  std::vector<CallInst*> Calls;
+
+  for(Function::iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+
+    for(BasicBlock::iterator II = BI->begin(), IE = BI->end(); II != IE; ++II) {
+
+      if(CallInst* CI = dyn_cast<CallInst>(II))
+	Calls.push_back(CI);
+
+    }
+
+  }
+
+  for(std::vector<CallInst*>::iterator it = Calls.begin(), itend = Calls.end(); it != itend; ++it) {
+
+    if(foldFormatCall(*it))
+      ++folded;
+
+  }
+
+}
+
+void LLPEAnalysisPass::foldFormatStrings() {
+
+  if(!FoldFormatStrings)
+    return;
+
+  if(RootIA->CommitF)
+    foldFormatStringsIn(RootIA->CommitF, stats.foldedFormatCalls);
+
+  for(std::vector<WeakVH>::iterator it = splitCommitFunctions.begin(), itend = splitCommitFunctions.end(); it != itend; ++it) {
+
+    Function* F = cast_or_null<Function>(*it);
+    if((!F) || F->isDeclaration() || F == RootIA->CommitF)
+      continue;
+
+    foldFormatStringsIn(F, stats.foldedFormatCalls);
+
+  }
+
+}
@@ -10,9 +10,16 @@
 #include "llvm/Analysis/LLPE.h"
 #include "llvm/IR/Function.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+
+#include <algorithm>
 
 using namespace llvm;
 
+// Calls that found an existing specialisation to share, and those that didn't:
+static LLPEStat SharingHits("sharing_hits", "Shared function hits");
+static LLPEStat SharingMisses("sharing_misses", "Shared function misses");
+
 void InlineAttempt::clearExternalDependencies() {
 
   for(DenseMap<ShadowValue, ImprovedValSet*>::iterator it = sharing->externalDependencies.begin(), 
@@ -23,6 +30,7 @@ void InlineAttempt::clearExternalDependencies() {
   }
    
   sharing->externalDependencies.clear();
+  sharing->dependencyRanges.clear();
 
 }
 
@@ -142,6 +150,7 @@ void InlineAttempt::sharingCleanup() {
     if(findit != sharing->externalDependencies.end()) {
       findit->second->dropReference();
       sharing->externalDependencies.erase(findit);
+      sharing->dependencyRanges.erase(ShadowValue(*it));
     }
 
   }
@@ -161,9 +170,12 @@ void IntegrationAttempt::noteVFSOp() {
 
 }
 
-// This function depends on V, where V is a memory object.
-// 
-void IntegrationAttempt::noteDependency(ShadowValue V) {
+// Past this many distinct ranges, depend on the whole object.
+#define MAX_DEPENDENCY_RANGES 8
+
+// This function depends on the bytes of V at Offset, where V is a memory object.
+// Offset LLONG_MAX or Size ULONG_MAX means it depends on the whole object.
+void IntegrationAttempt::noteDependency(ShadowValue V, int64_t Offset, uint64_t Size) {
 
   if(!pass->enableSharing)
     return;
@@ -185,10 +197,32 @@ void IntegrationAttempt::noteDependency(ShadowValue V) {
 
   std::pair<DenseMap<ShadowValue, ImprovedValSet*>::iterator, bool> it = Root->sharing->externalDependencies.insert(std::make_pair(V, (ImprovedValSet*)0));
 
-  // Already registered?
-  if(!it.second)
+  bool wholeObject = Offset < 0 || Offset == LLONG_MAX || Size == ULONG_MAX;
+
+  // Already registered? Then widen the ranges read, unless it depends on the whole object already.
+  if(!it.second) {
+
+    DenseMap<ShadowValue, SmallVector<std::pair<uint64_t, uint64_t>, 2> >::iterator rangeit = 
+      Root->sharing->dependencyRanges.find(V);
+    if(rangeit == Root->sharing->dependencyRanges.end())
+      return;
+
+    SmallVector<std::pair<uint64_t, uint64_t>, 2>& Ranges = rangeit->second;
+    if(wholeObject || Ranges.size() == MAX_DEPENDENCY_RANGES) {
+      Root->sharing->dependencyRanges.erase(rangeit);
+      return;
+    }
+
+    std::pair<uint64_t, uint64_t> Range((uint64_t)Offset, Size);
+    if(std::find(Ranges.begin(), Ranges.end(), Range) == Ranges.end())
+      Ranges.push_back(Range);
     return;
 
+  }
+
+  if(!wholeObject)
+    Root->sharing->dependencyRanges[V].push_back(std::make_pair((uint64_t)Offset, Size));
+
   // When sharing is enabled the base store is only used for initialisers. Therefore
   // this must be the most up-to-date value at function entry.
 
@@ -224,7 +258,16 @@ void IntegrationAttempt::mergeChildDependencies(InlineAttempt* ChildIA) {
 
     // Note this might record a different dependency to our child if this function or a sibling
     // has altered a relevant location since we entered this function.
-    noteDependency(it->first);
+    DenseMap<ShadowValue, SmallVector<std::pair<uint64_t, uint64_t>, 2> >::iterator rangeit = 
+      ChildIA->sharing->dependencyRanges.find(it->first);
+    if(rangeit == ChildIA->sharing->dependencyRanges.end()) {
+      noteDependency(it->first);
+      continue;
+    }
+
+    for(SmallVector<std::pair<uint64_t, uint64_t>, 2>::iterator rit = rangeit->second.begin(),
+	  ritend = rangeit->second.end(); rit != ritend; ++rit)
+      noteDependency(it->first, (int64_t)rit->first, rit->second);
       
   }
     
@@ -238,6 +281,36 @@ void IntegrationAttempt::mergeChildDependencies(InlineAttempt* ChildIA) {
 }
 
 
+static bool rangesEqual(ShadowValue& Obj, SmallVector<std::pair<uint64_t, uint64_t>, 2>& Ranges, ImprovedValSet* Store1, ImprovedValSet* Store2, ShadowBB* BB) {
+
+  uint64_t ASize = BB->getAllocSize(Obj);
+
+  for(SmallVector<std::pair<uint64_t, uint64_t>, 2>::iterator it = Ranges.begin(),
+	itend = Ranges.end(); it != itend; ++it) {
+
+    if(ASize == ULONG_MAX || it->first >= ASize || it->second > ASize - it->first)
+      return false;
+
+    SmallVector<IVSRange, 4> Vals1, Vals2;
+    readValRangeMultiFrom(it->first, it->second, Store1, Vals1, 0, ASize);
+    readValRangeMultiFrom(it->first, it->second, Store2, Vals2, 0, ASize);
+
+    if(Vals1.size() != Vals2.size())
+      return false;
+
+    for(uint32_t i = 0, ilim = Vals1.size(); i != ilim; ++i) {
+
+      if(Vals1[i].first != Vals2[i].first || Vals1[i].second != Vals2[i].second)
+	return false;
+
+    }
+
+  }
+
+  return true;
+
+}
+
 // Check incoming arguments and memory locations last seen for this IA match those at callsite SI.
 bool InlineAttempt::matchesCallerEnvironment(ShadowInstruction* SI) {
 
@@ -272,7 +345,17 @@ bool InlineAttempt::matchesCallerEnvironment(ShadowInstruction* SI) {
     if(!callsiteStore)
       return false;
 
-    if(!IVsEqualShallow(callsiteStore->store, it->second))
+    if(IVsEqualShallow(callsiteStore->store, it->second))
+      continue;
+
+    // Otherwise it's enough that the bytes we read are the same.
+    DenseMap<ShadowValue, SmallVector<std::pair<uint64_t, uint64_t>, 2> >::iterator rangeit = 
+      sharing->dependencyRanges.find(it->first);
+    if(rangeit == sharing->dependencyRanges.end())
+      return false;
+
+    ShadowValue Obj = it->first;
+    if(!rangesEqual(Obj, rangeit->second, callsiteStore->store, it->second, SI->parent))
       return false;
 
   }
@@ -282,12 +365,69 @@ bool InlineAttempt::matchesCallerEnvironment(ShadowInstruction* SI) {
 }
 
 
+// Sharable IAs are indexed by a fingerprint of their arguments which is equal whenever
+// matchesCallerEnvironment's argument check could succeed: single-valued sets hash their
+// type and value; anything else (overdef, multi-valued, aggregate) hashes to zero.
+// Memory dependencies still have to be checked per candidate, as each candidate depends
+// on different locations.
+
+static unsigned fingerprintVal(ValSetType T, const ImprovedVal& V) {
+
+  return (unsigned)hash_combine((int)T, DenseMapInfo<ShadowValue>::getHashValue(V.V), V.Offset);
+
+}
+
+static unsigned fingerprintIV(ImprovedValSet* IV) {
+
+  ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(IV);
+  if((!IVS) || IVS->Overdef || IVS->Values.size() != 1)
+    return 0;
+
+  return fingerprintVal(IVS->SetType, IVS->Values[0]);
+
+}
+
+static unsigned fingerprintOperand(ShadowValue V) {
+
+  ImprovedValSet* IV = 0;
+  std::pair<ValSetType, ImprovedVal> Single;
+  getIVOrSingleVal(V, IV, Single);
+
+  if(IV)
+    return fingerprintIV(IV);
+  if(Single.first == ValSetTypeOverdef)
+    return 0;
+  return fingerprintVal(Single.first, Single.second);
+
+}
+
+static unsigned getCallArgsFingerprint(ShadowInstruction* SI) {
+
+  hash_code H = hash_value(SI->getNumArgOperands());
+  for(uint32_t i = 0, ilim = SI->getNumArgOperands(); i != ilim; ++i)
+    H = hash_combine(H, fingerprintOperand(SI->getCallArgOperand(i)));
+
+  return (unsigned)H;
+
+}
+
+unsigned InlineAttempt::getArgsFingerprint() {
+
+  hash_code H = hash_value((uint32_t)argShadows.size());
+  for(uint32_t i = 0, ilim = argShadows.size(); i != ilim; ++i)
+    H = hash_combine(H, fingerprintIV(argShadows[i].i.PB));
+
+  return (unsigned)H;
+
+}
+
 void LLPEAnalysisPass::addSharableFunction(InlineAttempt* IA) {
   
   if(!enableSharing)
     return;
 
-  IAsByFunction[&IA->F].push_back(IA);
+  IA->sharingKey = IA->getArgsFingerprint();
+  IAsBySignature[std::make_pair(&IA->F, IA->sharingKey)].push_back(IA);
   IA->registeredSharable = true;
 
 }
@@ -297,7 +437,7 @@ void LLPEAnalysisPass::removeSharableFunction(InlineAttempt* IA) {
   if(!enableSharing)
     return;
 
-  std::vector<InlineAttempt*>& IAs = IAsByFunction[&IA->F];
+  std::vector<InlineAttempt*>& IAs = IAsBySignature[std::make_pair(&IA->F, IA->sharingKey)];
   std::vector<InlineAttempt*>::iterator findit = std::find(IAs.begin(), IAs.end(), IA);
   release_assert(findit != IAs.end() && "Function unshared twice?");
   IAs.erase(findit);
@@ -305,6 +445,20 @@ void LLPEAnalysisPass::removeSharableFunction(InlineAttempt* IA) {
 
 }
 
+// IA has been re-run, perhaps against different arguments: move it to the right bucket.
+void LLPEAnalysisPass::refreshSharableFunction(InlineAttempt* IA) {
+
+  if(!enableSharing)
+    return;
+
+  if(IA->getArgsFingerprint() == IA->sharingKey)
+    return;
+
+  removeSharableFunction(IA);
+  addSharableFunction(IA);
+
+}
+
 InlineAttempt* LLPEAnalysisPass::findIAMatching(ShadowInstruction* SI) {
 
   if(!enableSharing)
@@ -312,9 +466,12 @@ InlineAttempt* LLPEAnalysisPass::findIAMatching(ShadowInstruction* SI) {
   
   Function* FCalled = getCalledFunction(SI);
 
-  DenseMap<Function*, std::vector<InlineAttempt*> >::iterator findit = IAsByFunction.find(FCalled);
-  if(findit == IAsByFunction.end())
+  DenseMap<std::pair<Function*, unsigned>, std::vector<InlineAttempt*> >::iterator findit = 
+    IAsBySignature.find(std::make_pair(FCalled, getCallArgsFingerprint(SI)));
+  if(findit == IAsBySignature.end()) {
+    SharingMisses.inc(FCalled);
     return 0;
+  }
 
   std::vector<InlineAttempt*>& candidates = findit->second;
   for(std::vector<InlineAttempt*>::iterator it = candidates.begin(), 
@@ -327,11 +484,13 @@ InlineAttempt* LLPEAnalysisPass::findIAMatching(ShadowInstruction* SI) {
     if((*it)->matchesCallerEnvironment(SI)) {
       (*it)->Callers.push_back(SI);
       (*it)->uniqueParent = 0;
+      SharingHits.inc(FCalled);
       return *it;
     }
 
   }
 
+  SharingMisses.inc(FCalled);
   return 0;
 
 }
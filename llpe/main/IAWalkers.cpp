@@ -19,6 +19,71 @@
 
 using namespace llvm;
 
+//// Pooled walker state:
+
+static std::vector<IAWalkerState*> freeWalkerStates;
+
+IAWalkerState* IAWalker::acquireState() {
+
+  if(freeWalkerStates.empty())
+    return new IAWalkerState();
+
+  IAWalkerState* ret = freeWalkerStates.back();
+  freeWalkerStates.pop_back();
+  return ret;
+
+}
+
+void IAWalker::releaseState(IAWalkerState* S) {
+
+  S->clear();
+  freeWalkerStates.push_back(S);
+
+}
+
+bool IAWalker::markVisited(WLItem wl) {
+
+  ShadowBB* BB = wl.second;
+
+  uint32_t bit;
+  if(wl.first == 0)
+    bit = 0;
+  else if(wl.first == BB->insts.size())
+    bit = 1;
+  else
+    return State->otherVisited.insert(wl).second;
+
+  IntegrationAttempt* IA = BB->IA;
+  if(IA != lastVisitedIA) {
+
+    std::pair<DenseMap<IntegrationAttempt*, uint32_t>::iterator, bool> it = 
+      State->blockSetIdx.insert(std::make_pair(IA, State->blockSetsUsed));
+
+    if(it.second) {
+
+      // Reuse a bitset left from an earlier walk if there is one.
+      if(State->blockSetsUsed == State->blockSets.size())
+	State->blockSets.push_back(BitVector());
+      BitVector& NewSet = State->blockSets[State->blockSetsUsed++];
+      NewSet.clear();
+      NewSet.resize(IA->nBBs * 2);
+
+    }
+
+    lastVisitedIA = IA;
+    lastVisitedSet = &State->blockSets[it.first->second];
+
+  }
+
+  uint32_t idx = ((BB->invar->idx - IA->BBsOffset) * 2) + bit;
+  if(lastVisitedSet->test(idx))
+    return false;
+
+  lastVisitedSet->set(idx);
+  return true;
+
+}
+
 //// Implement the backward walker:
 
 BackwardIAWalker::BackwardIAWalker(uint32_t instIdx, ShadowBB* BB, bool skipFirst, void* initialCtx, DenseSet<WLItem>* AlreadyVisited, bool doIgnoreEdges) : IAWalker(initialCtx, doIgnoreEdges) {
@@ -30,11 +95,13 @@ BackwardIAWalker::BackwardIAWalker(uint32_t instIdx, ShadowBB* BB, bool skipFirs
   
   WLItem firstItem = makeWL(instIdx, BB);
 
-  if(AlreadyVisited)
-    Visited = *AlreadyVisited;
+  if(AlreadyVisited) {
+    for(DenseSet<WLItem>::iterator it = AlreadyVisited->begin(), itend = AlreadyVisited->end(); it != itend; ++it)
+      markVisited(*it);
+  }
 
   PList->push_back(std::make_pair(firstItem, initialCtx));
-  Visited.insert(firstItem);
+  markVisited(firstItem);
 
 }
 
@@ -228,7 +295,7 @@ void IAWalker::queueWalkFrom(uint32_t idx, ShadowBB* BB, void* Ctx, bool shouldC
 
   WLItem wl = makeWL(idx, BB);
 
-  if(Visited.insert(wl).second) {
+  if(markVisited(wl)) {
     if(shouldCopyContext) {
       Ctx = copyContext(Ctx);
       Contexts.push_back(Ctx);
@@ -373,7 +440,7 @@ ForwardIAWalker::ForwardIAWalker(uint32_t idx, ShadowBB* BB, bool skipFirst, voi
 
   WLItem firstWL = makeWL(idx, BB);
 
-  Visited.insert(firstWL);
+  markVisited(firstWL);
   PList->push_back(std::make_pair(firstWL, initialCtx));
   
 }
@@ -13,13 +13,204 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 using namespace llvm;
 
 const uint32_t eliminatedInstructionPoints = 2;
 const uint32_t extraInstructionPoints = 1;
 
+// Leave a loop rolled if unrolling it would leave more than this many times the loop body's
+// instruction count in residual code (0 = no limit).
+static cl::opt<unsigned> MaxUnrollGrowth("int-max-unroll-growth", cl::init(0));
+
+// A runtime profile of the original program: lines of "function count" (per-symbol samples,
+// as perf report gives) or "function block count" (block execution counts, as from an
+// instrumented build), with # comments. Instructions eliminated in a block then earn their
+// time bonus in proportion to the block's count relative to the profile's mean, capped at
+// -int-profile-max-weight, rather than once per context whether the code is hot or never
+// runs. The code size penalty is unchanged.
+static cl::opt<std::string> ProfileFile("int-profile", cl::init(""));
+static cl::opt<unsigned> ProfileMaxWeight("int-profile-max-weight", cl::init(16));
+
+namespace {
+
+struct RuntimeProfile {
+
+  bool loaded;
+  StringMap<uint64_t> functionCounts;
+  StringMap<StringMap<uint64_t> > blockCounts;
+  double meanFunctionCount;
+  double meanBlockCount;
+
+RuntimeProfile() : loaded(false), meanFunctionCount(0), meanBlockCount(0) {}
+
+};
+
+}
+
+static RuntimeProfile Profile;
+
+static void loadRuntimeProfile() {
+
+  Profile.loaded = true;
+
+  std::string path = ProfileFile;
+  noteCacheDependency(path);
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(path);
+  if(std::error_code ec = MB.getError()) {
+
+    errs() << "Failed to load profile " << path << ": " << ec.message() << "\n";
+    exit(1);
+
+  }
+
+  uint64_t functionTotal = 0, blockTotal = 0, nBlocks = 0;
+  StringRef data = (*MB)->getBuffer();
+
+  while(!data.empty()) {
+
+    std::pair<StringRef, StringRef> lineAndRest = data.split('\n');
+    StringRef line = lineAndRest.first.trim();
+    data = lineAndRest.second;
+
+    if(line.empty() || line[0] == '#')
+      continue;
+
+    SmallVector<StringRef, 3> fields;
+    line.split(fields, " ", -1, false);
+
+    uint64_t count;
+    if((fields.size() != 2 && fields.size() != 3) || fields.back().getAsInteger(10, count)) {
+
+      errs() << "Bad profile line in " << path << ": " << line << "\n";
+      exit(1);
+
+    }
+
+    if(fields.size() == 2) {
+      Profile.functionCounts[fields[0]] += count;
+      functionTotal += count;
+    }
+    else {
+      Profile.blockCounts[fields[0]][fields[1]] += count;
+      blockTotal += count;
+      ++nBlocks;
+    }
+
+  }
+
+  if(!Profile.functionCounts.empty())
+    Profile.meanFunctionCount = ((double)functionTotal) / Profile.functionCounts.size();
+  if(nBlocks)
+    Profile.meanBlockCount = ((double)blockTotal) / nBlocks;
+
+}
+
+// Get BB's count relative to the profile's mean, or return false if the profile doesn't
+// mention its function.
+static bool getProfileWeight(BasicBlock* BB, double& weight) {
+
+  if(!Profile.loaded)
+    loadRuntimeProfile();
+
+  StringRef FName = BB->getParent()->getName();
+
+  StringMap<StringMap<uint64_t> >::iterator blockit = Profile.blockCounts.find(FName);
+  if(blockit != Profile.blockCounts.end()) {
+
+    StringMap<uint64_t>::iterator findit = blockit->second.find(BB->getName());
+    uint64_t count = findit == blockit->second.end() ? 0 : findit->second;
+    weight = Profile.meanBlockCount ? count / Profile.meanBlockCount : 0;
+
+  }
+  else {
+
+    StringMap<uint64_t>::iterator findit = Profile.functionCounts.find(FName);
+    if(findit == Profile.functionCounts.end())
+      return false;
+    weight = Profile.meanFunctionCount ? findit->second / Profile.meanFunctionCount : 0;
+
+  }
+
+  return true;
+
+}
+
+// Scale points earned in BB by its hotness, or leave them alone if the profile doesn't
+// mention its function.
+static int64_t weightByProfile(BasicBlock* BB, int64_t points) {
+
+  if(ProfileFile.empty() || !points)
+    return points;
+
+  double weight;
+  if(!getProfileWeight(BB, weight))
+    return points;
+
+  if(weight > ProfileMaxWeight)
+    weight = ProfileMaxWeight;
+
+  return (int64_t)((points * weight) + 0.5);
+
+}
+
+// Blocks of each function from which it may return (normally or by unwinding).
+static DenseMap<Function*, DenseSet<BasicBlock*> > returningBlocks;
+
+static DenseSet<BasicBlock*>& getReturningBlocks(Function* F) {
+
+  std::pair<DenseMap<Function*, DenseSet<BasicBlock*> >::iterator, bool> it = 
+    returningBlocks.insert(std::make_pair(F, DenseSet<BasicBlock*>()));
+  DenseSet<BasicBlock*>& Result = it.first->second;
+  if(!it.second)
+    return Result;
+
+  SmallVector<BasicBlock*, 16> Worklist;
+  for(Function::iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+
+    TerminatorInst* TI = BI->getTerminator();
+    if(isa<ReturnInst>(TI) || isa<ResumeInst>(TI)) {
+      Result.insert(BI);
+      Worklist.push_back(BI);
+    }
+
+  }
+
+  while(!Worklist.empty()) {
+
+    BasicBlock* BB = Worklist.pop_back_val();
+    for(pred_iterator PI = pred_begin(BB), PE = pred_end(BB); PI != PE; ++PI) {
+
+      if(Result.insert(*PI).second)
+	Worklist.push_back(*PI);
+
+    }
+
+  }
+
+  return Result;
+
+}
+
+// Is BB unlikely to run? With -int-profile, if it runs less often than the profile's
+// mean; otherwise if its function can return but BB can no longer reach a return, as on
+// error paths that end in exit or abort.
+bool llvm::isColdBlock(BasicBlock* BB) {
+
+  double weight;
+  if((!ProfileFile.empty()) && getProfileWeight(BB, weight))
+    return weight < 1;
+
+  DenseSet<BasicBlock*>& Returning = getReturningBlocks(BB->getParent());
+  return (!Returning.empty()) && !Returning.count(BB);
+
+}
+
 static uint32_t intBenefitProgressN = 0;
 const uint32_t intBenefitProgressLimit = 1000;
 
@@ -30,6 +221,7 @@ static void intBenefitProgress() {
 
     errs() << ".";
     intBenefitProgressN = 0;
+    noteProgress();
 
   }
 
@@ -78,18 +270,18 @@ int64_t IntegrationAttempt::getResidualInstructions() {
 
 }
 
-static void findResidualFunctionsInConst(DenseSet<Function*>& ElimFunctions, Constant* C) {
+static void findResidualFunctionsInConst(std::vector<Function*>& Refs, Constant* C) {
 
   if(Function* F = dyn_cast<Function>(C)) {
 
-    ElimFunctions.erase(F);
+    Refs.push_back(F);
 
   }
   else if(ConstantExpr* CE = dyn_cast<ConstantExpr>(C)) {
 
     for(ConstantExpr::op_iterator it = CE->op_begin(), it2 = CE->op_end(); it != it2; ++it) {
 
-      findResidualFunctionsInConst(ElimFunctions, cast<Constant>(*it));
+      findResidualFunctionsInConst(Refs, cast<Constant>(*it));
       
     }
 
@@ -106,41 +298,47 @@ void InlineAttempt::findResidualFunctions(DenseSet<Function*>& ElimFunctions, De
 
 void IntegrationAttempt::findResidualFunctions(DenseSet<Function*>& ElimFunctions, DenseMap<Function*, unsigned>& TotalResidualInsts) {
 
-  for(uint32_t i = 0; i < nBBs; ++i) {
+  if(!ownResidualFunctionsValid) {
 
-    ShadowBB* BB = BBs[i];
-    if(!BB)
-      continue;
+    ownResidualFunctions.clear();
 
-    const ShadowLoopInvar* BBL = BB->invar->outerScope;
-    if(L != BBL)
-      continue;
+    for(uint32_t i = 0; i < nBBs; ++i) {
 
-    for(uint32_t j = 0; j < BB->insts.size(); ++j) {
+      ShadowBB* BB = BBs[i];
+      if(!BB)
+	continue;
 
-      ShadowInstruction* I = &(BB->insts[j]);
+      const ShadowLoopInvar* BBL = BB->invar->outerScope;
+      if(L != BBL)
+	continue;
 
-      if(inst_is<CallInst>(I) || inst_is<InvokeInst>(I)) {
+      for(uint32_t j = 0; j < BB->insts.size(); ++j) {
 
-	Function* F = getCalledFunction(I);
-	if(F) {
+	ShadowInstruction* I = &(BB->insts[j]);
 
-	  if(getInlineAttempt(I))
-	    ElimFunctions.erase(F);
+	if(inst_is<CallInst>(I) || inst_is<InvokeInst>(I)) {
 
-	}
-	// Else the caller is unresolved: we'll eliminate all possibly-called functions
-	// because they're used in a live instruction somewhere.
+	  Function* F = getCalledFunction(I);
+	  if(F) {
 
-      }
-      else {
+	    if(getInlineAttempt(I))
+	      ownResidualFunctions.push_back(F);
 
-	for(Instruction::op_iterator opit = I->invar->I->op_begin(), opend = I->invar->I->op_end(); opit != opend; ++opit) {
+	  }
+	  // Else the caller is unresolved: we'll eliminate all possibly-called functions
+	  // because they're used in a live instruction somewhere.
+
+	}
+	else {
 
-	  if(Constant* C = dyn_cast<Constant>(opit)) {
+	  for(Instruction::op_iterator opit = I->invar->I->op_begin(), opend = I->invar->I->op_end(); opit != opend; ++opit) {
 
-	    findResidualFunctionsInConst(ElimFunctions, C);
+	    if(Constant* C = dyn_cast<Constant>(opit)) {
+
+	      findResidualFunctionsInConst(ownResidualFunctions, C);
 	    
+	    }
+
 	  }
 
 	}
@@ -149,8 +347,13 @@ void IntegrationAttempt::findResidualFunctions(DenseSet<Function*>& ElimFunction
 
     }
 
+    ownResidualFunctionsValid = true;
+
   }
 
+  for(std::vector<Function*>::iterator it = ownResidualFunctions.begin(), itend = ownResidualFunctions.end(); it != itend; ++it)
+    ElimFunctions.erase(*it);
+
   for(IAIterator it = child_calls_begin(this), it2 = child_calls_end(this); it != it2; ++it) {
 
     it->second->findResidualFunctions(ElimFunctions, TotalResidualInsts);
@@ -170,6 +373,40 @@ void IntegrationAttempt::findResidualFunctions(DenseSet<Function*>& ElimFunction
 
 }
 
+// The benefit figures are kept bottom-up: each context's goodness and residual instruction
+// count are computed once from its children's, so after a child is toggled only the
+// contexts above it need recomputing, and the next findProfitableIntegration or
+// getResidualInstructions from the root walks that path rather than the whole tree.
+void IntegrationAttempt::invalidateBenefit() {
+
+  integrationGoodnessValid = false;
+  residualInstructions = -1;
+
+}
+
+void InlineAttempt::invalidateBenefit() {
+
+  IntegrationAttempt::invalidateBenefit();
+  for(SmallVector<ShadowInstruction*, 1>::iterator it = Callers.begin(), itend = Callers.end(); it != itend; ++it)
+    (*it)->parent->IA->invalidateBenefit();
+
+}
+
+void PeelIteration::invalidateBenefit() {
+
+  IntegrationAttempt::invalidateBenefit();
+  parentPA->invalidateBenefit();
+
+}
+
+void PeelAttempt::invalidateBenefit() {
+
+  integrationGoodnessValid = false;
+  residualInstructions = -1;
+  parent->invalidateBenefit();
+
+}
+
 void PeelAttempt::findProfitableIntegration() {
 
   if(integrationGoodnessValid)
@@ -187,6 +424,26 @@ void PeelAttempt::findProfitableIntegration() {
     // Overall, not profitable to peel this loop.
     setEnabled(false, true);
 
+  }
+  else if(MaxUnrollGrowth && Iterations.size() > 1) {
+
+    // Many near-identical unrolled copies are slower than the loop once they no longer
+    // fit in the I-cache, whatever they save in executed instructions.
+    int64_t unrolledSize = 0;
+    bool anyCheckedReads = false;
+    for(unsigned i = 0; i < Iterations.size(); ++i) {
+      unrolledSize += Iterations[i]->getResidualInstructions();
+      anyCheckedReads |= Iterations[i]->containsCheckedReads;
+    }
+
+    int64_t loopSize = Iterations[0]->getTotalInstructionsIncludingLoops();
+    if((!anyCheckedReads) && unrolledSize > loopSize * MaxUnrollGrowth) {
+
+      setEnabled(false, true);
+      ++GlobalIHP->stats.unrollGrowthLoops;
+
+    }
+
   }
 
   integrationGoodnessValid = true;
@@ -260,16 +517,20 @@ void IntegrationAttempt::findProfitableIntegration() {
 
     if(L == BBL) {
 
+      int64_t blockBonus = 0;
+
       for(uint32_t j = 0; j < BB->insts.size(); ++j) {
 
 	ShadowInstruction* I = &(BB->insts[j]);
-	if(willBeReplacedOrDeleted(ShadowValue(I))) {
-	  totalIntegrationGoodness += eliminatedInstructionPoints;
-	  timeBonus += eliminatedInstructionPoints;
-	}
+	if(willBeReplacedOrDeleted(ShadowValue(I)))
+	  blockBonus += eliminatedInstructionPoints;
 
       }
 
+      blockBonus = weightByProfile(BB->invar->BB, blockBonus);
+      totalIntegrationGoodness += blockBonus;
+      timeBonus += blockBonus;
+
     }
 
   }
@@ -284,6 +545,8 @@ void IntegrationAttempt::findProfitableIntegration() {
 
 void InlineAttempt::findProfitableIntegration() {
 
+  PhaseTimer Timer(PhaseBenefit);
+
   if(isModel) {
 
     setEnabled(false, true);
@@ -303,11 +566,23 @@ void InlineAttempt::findProfitableIntegration() {
 
 }
 
-void IntegrationAttempt::collectBlockStats(ShadowBBInvar* BBI, ShadowBB* BB) {
+// countTentative: also count towards checkedInstructionsHere the instructions of BB that
+// are checked because their result might be invalidated by the concurrent action of other
+// threads in the same address space. Instructions with SI->needsRuntimeCheck set are
+// checked to implement a path condition or other check and so are not included.
+void IntegrationAttempt::collectBlockStats(ShadowBBInvar* BBI, ShadowBB* BB, bool countTentative) {
 
   uint32_t i = 0;
   
   for(BasicBlock::iterator BI = BBI->BB->begin(), BE = BBI->BB->end(); BI != BE; ++BI, ++i) {
+
+    if(countTentative) {
+
+      ShadowInstruction* SI = &BB->insts[i];
+      if(requiresRuntimeCheck2(ShadowValue(SI), false) && SI->needsRuntimeCheck == RUNTIME_CHECK_NONE)
+	++checkedInstructionsHere;
+
+    }
       
     const ShadowLoopInvar* BBL = BBI->naturalScope;
     if(L != BBL && ((!L) || L->contains(BBL))) {
@@ -386,10 +661,21 @@ void IntegrationAttempt::collectLoopStats(const ShadowLoopInvar* LoopI) {
 
 }
 
-void IntegrationAttempt::collectAllBlockStats() {
+void IntegrationAttempt::collectAllBlockStats(bool countTentative) {
 
   for(uint32_t i = 0; i < nBBs; ++i) {
-    collectBlockStats(&(invarInfo->BBs[i + BBsOffset]), BBs[i]);
+
+    ShadowBBInvar* BBI = &(invarInfo->BBs[i + BBsOffset]);
+
+    // Blocks of a terminated child loop count their checks in its iterations instead.
+    bool countHere = countTentative && BBs[i];
+    if(countHere && BBI->naturalScope != L) {
+      PeelAttempt* LPA = getPeelAttempt(immediateChildLoop(L, BBI->naturalScope));
+      countHere = !(LPA && LPA->isTerminated());
+    }
+
+    collectBlockStats(BBI, BBs[i], countHere);
+
   }
 
 }
@@ -410,28 +696,53 @@ void PeelIteration::collectAllLoopStats() {
 
 }
 
-void PeelAttempt::collectStats() {
+void PeelAttempt::collectStats(bool countTentative) {
+
+  // Only terminated loops' iterations have their checks counted separately.
+  countTentative = countTentative && isTerminated();
 
   for(std::vector<PeelIteration*>::iterator it = Iterations.begin(), it2 = Iterations.end(); it != it2; ++it)
-    (*it)->collectStats();
+    (*it)->collectStats(countTentative);
 
 }
 
-void IntegrationAttempt::collectStats() {
+// countTentative: also count the instructions needing thread checks, here and
+// in checkedInstructionsChildren, along with the other statistics, rather than
+// walking the tree again for them.
+void IntegrationAttempt::collectStats(bool countTentative) {
+
+  // Committed contexts' figures are final, and their instructions may have been trimmed.
+  if(commitState == COMMIT_FREED)
+    return;
+
+  countTentative = countTentative && !isCommitted();
 
   improvedInstructions = 0;
   improvableInstructions = 0;
   improvableInstructionsIncludingLoops = 0;
 
-  collectAllBlockStats();
+  collectAllBlockStats(countTentative);
   collectAllLoopStats();
 
+  if(countTentative)
+    checkedInstructionsChildren = checkedInstructionsHere;
+
   for(IAIterator it = child_calls_begin(this), it2 = child_calls_end(this); it != it2; ++it) {
     if(!it->second->isCommitted())
-      it->second->collectStats();
+      it->second->collectStats(countTentative);
+    if(countTentative)
+      checkedInstructionsChildren += it->second->checkedInstructionsChildren;
   }
 
-  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::const_iterator it = peelChildren.begin(), it2 = peelChildren.end(); it != it2; ++it)
-    it->second->collectStats();
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::const_iterator it = peelChildren.begin(), it2 = peelChildren.end(); it != it2; ++it) {
+
+    it->second->collectStats(countTentative);
+
+    if(countTentative && it->second->isTerminated()) {
+      for(uint32_t i = 0, ilim = it->second->Iterations.size(); i != ilim; ++i)
+	checkedInstructionsChildren += it->second->Iterations[i]->checkedInstructionsChildren;
+    }
+
+  }
 
 }
@@ -9,6 +9,122 @@
 
 #include "llvm/Analysis/LLPE.h"
 
+using namespace llvm;
+
+// Fast paths for integers of up to 64 bits, which are the only ones that can be held
+// inline in a ShadowValue. Operands arrive zero-extended from their bit width.
+
+static inline uint64_t truncInt(uint64_t V, uint32_t BitWidth) {
+
+  return BitWidth == 64 ? V : V & ((((uint64_t)1) << BitWidth) - 1);
+
+}
+
+static inline int64_t sextInt(uint64_t V, uint32_t BitWidth) {
+
+  return ((int64_t)(V << (64 - BitWidth))) >> (64 - BitWidth);
+
+}
+
+static bool foldIntCmp(unsigned Pred, uint64_t C1, uint64_t C2, uint32_t BitWidth) {
+
+  switch(Pred) {
+  case CmpInst::ICMP_EQ:
+    return C1 == C2;
+  case CmpInst::ICMP_NE:
+    return C1 != C2;
+  case CmpInst::ICMP_UGT:
+    return C1 > C2;
+  case CmpInst::ICMP_UGE:
+    return C1 >= C2;
+  case CmpInst::ICMP_ULT:
+    return C1 < C2;
+  case CmpInst::ICMP_ULE:
+    return C1 <= C2;
+  case CmpInst::ICMP_SGT:
+    return sextInt(C1, BitWidth) > sextInt(C2, BitWidth);
+  case CmpInst::ICMP_SGE:
+    return sextInt(C1, BitWidth) >= sextInt(C2, BitWidth);
+  case CmpInst::ICMP_SLT:
+    return sextInt(C1, BitWidth) < sextInt(C2, BitWidth);
+  case CmpInst::ICMP_SLE:
+    return sextInt(C1, BitWidth) <= sextInt(C2, BitWidth);
+  default:
+    release_assert(0 && "Bad icmp predicate");
+    return false;
+  }
+
+}
+
+static bool foldIntBinop(ShadowInstruction* SI, unsigned Opcode, uint64_t C1, uint64_t C2, uint32_t BitWidth, ImprovedVal& Improved) {
+
+  Type* Ty = SI->getType();
+  uint64_t Result;
+
+  switch(Opcode) {
+  default:
+    return false;
+  case Instruction::Add:
+    Result = C1 + C2;
+    break;
+  case Instruction::Sub:
+    Result = C1 - C2;
+    break;
+  case Instruction::Mul:
+    Result = C1 * C2;
+    break;
+  case Instruction::UDiv:
+    assert(C2 != 0 && "Div by zero not handled yet");
+    Result = C1 / C2;
+    break;
+  case Instruction::URem:
+    assert(C2 != 0 && "Div by zero not handled yet");
+    Result = C1 % C2;
+    break;
+  case Instruction::SDiv:
+  case Instruction::SRem: {
+    assert(C2 != 0 && "Div by zero not handled yet");
+    int64_t S1 = sextInt(C1, BitWidth);
+    int64_t S2 = sextInt(C2, BitWidth);
+    if(S2 == -1 && S1 == sextInt(((uint64_t)1) << (BitWidth - 1), BitWidth)) {
+      // MIN_INT / -1 and MIN_INT % -1 -> undef
+      Improved = ImprovedVal(ShadowValue(UndefValue::get(Ty)));
+      return true;
+    }
+    Result = (uint64_t)(Opcode == Instruction::SDiv ? S1 / S2 : S1 % S2);
+    break;
+  }
+  case Instruction::And:
+    Result = C1 & C2;
+    break;
+  case Instruction::Or:
+    Result = C1 | C2;
+    break;
+  case Instruction::Xor:
+    Result = C1 ^ C2;
+    break;
+  case Instruction::Shl:
+  case Instruction::LShr:
+  case Instruction::AShr:
+    if(C2 >= BitWidth) {
+      // too big shift is undef
+      Improved = ImprovedVal(ShadowValue(UndefValue::get(Ty)));
+      return true;
+    }
+    if(Opcode == Instruction::Shl)
+      Result = C1 << C2;
+    else if(Opcode == Instruction::LShr)
+      Result = C1 >> C2;
+    else
+      Result = (uint64_t)(sextInt(C1, BitWidth) >> C2);
+    break;
+  }
+
+  Improved = ImprovedVal(ShadowValue::getInt(Ty, truncInt(Result, BitWidth)));
+  return true;
+
+}
+
 bool llvm::IHPFoldIntOp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal>* Ops, SmallVector<uint64_t, 4>& OpInts, ValSetType& ImpType, ImprovedVal& Improved) {
 
   ImpType = ValSetTypeScalar;
@@ -23,6 +139,29 @@ bool llvm::IHPFoldIntOp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal
     Type* DestTy = SI->getType();
     uint32_t DestBitWidth = cast<IntegerType>(DestTy)->getBitWidth();
     IntegerType* SourceTy = cast<IntegerType>(Ops[0].second.V.getNonPointerType());
+
+    if(DestBitWidth <= 64 && SourceTy->getBitWidth() <= 64) {
+
+      switch (SI->invar->I->getOpcode()) {
+
+      default:
+	return false;
+      case Instruction::ZExt:
+	Improved = ImprovedVal(ShadowValue::getInt(DestTy, OpInts[0]));
+	break;
+      case Instruction::SExt:
+	Improved = ImprovedVal(ShadowValue::getInt(DestTy, truncInt(sextInt(OpInts[0], SourceTy->getBitWidth()), DestBitWidth)));
+	break;
+      case Instruction::Trunc:
+	Improved = ImprovedVal(ShadowValue::getInt(DestTy, truncInt(OpInts[0], DestBitWidth)));
+	break;
+
+      }
+
+      return true;
+
+    }
+
     APInt SourceAP(SourceTy->getBitWidth(), OpInts[0]);
       
     switch (SI->invar->I->getOpcode()) {
@@ -46,9 +185,27 @@ bool llvm::IHPFoldIntOp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal
   }
   else if(OpInts.size() == 2) {
 
-    const APInt C1V(cast<IntegerType>(SI->getOperand(0).getNonPointerType())->getBitWidth(), OpInts[0]);
+    Instruction* I = SI->invar->I;
+    uint32_t BitWidth = cast<IntegerType>(SI->getOperand(0).getNonPointerType())->getBitWidth();
+
+    if(BitWidth <= 64 && BitWidth == cast<IntegerType>(SI->getOperand(1).getNonPointerType())->getBitWidth()) {
+
+      if(ICmpInst* CI = dyn_cast<ICmpInst>(I)) {
+
+	if(!SI->getType()->isIntegerTy(1))
+	  return false;
+	Improved = ImprovedVal(ShadowValue::getInt(SI->getType(), foldIntCmp(CI->getPredicate(), OpInts[0], OpInts[1], BitWidth)));
+	return true;
+
+      }
+
+      return foldIntBinop(SI, I->getOpcode(), OpInts[0], OpInts[1], BitWidth, Improved);
+
+    }
+
+    const APInt C1V(BitWidth, OpInts[0]);
     const APInt C2V(cast<IntegerType>(SI->getOperand(1).getNonPointerType())->getBitWidth(), OpInts[1]);
-    switch (SI->invar->I->getOpcode()) {
+    switch (I->getOpcode()) {
     default:
       return false;
     case Instruction::Add:     
@@ -121,6 +278,16 @@ bool llvm::IHPFoldIntOp(ShadowInstruction* SI, std::pair<ValSetType, ImprovedVal
 
   }
 
+  else if(OpInts.size() == 3) {
+
+    if(SI->invar->I->getOpcode() != Instruction::Select)
+      return false;
+
+    Improved = OpInts[0] ? Ops[1].second : Ops[2].second;
+    return true;
+
+  }
+
   return false;
 
 }
@@ -17,6 +17,8 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Operator.h"
 
+#include <algorithm>
+
 using namespace llvm;
 
 namespace llvm {
@@ -146,8 +148,7 @@ std::pair<ValSetType, ImprovedVal> llvm::getValPB(Value* V) {
 		  return std::make_pair(ValSetTypeUnknown, ShadowValue());
 		else
 		  return std::make_pair(ValSetTypeScalar, 
-					ImprovedVal(ShadowValue(ConstantInt::get(Type::getInt64Ty(CE->getContext()),
-										 Op1.second.Offset - Op2.second.Offset))));
+					ImprovedVal(ShadowValue::getInt64(Op1.second.Offset - Op2.second.Offset)));
 	      
 	      }
 	      // Else can't subtract 2 pointers with differing bases
@@ -189,7 +190,7 @@ std::pair<ValSetType, ImprovedVal> llvm::getValPB(Value* V) {
 	if(!Op1.second.V.isGV())
 	  break;
 
-	uint64_t GlobalAlign = Op1.second.V.u.GV->G->getAlignment();
+	uint64_t GlobalAlign = Op1.second.V.getGV()->G->getAlignment();
 	if(GlobalAlign == 0 || GlobalAlign == 1)
 	  break;
 
@@ -302,6 +303,47 @@ static Function* getReplacementFunction(ShadowValue CCalledV) {
 
 }
 
+// Gather every function SI might call, ignoring null, for a callee given as a set
+// of functions (at most PBMax of them, as for any value set). Returns false if the
+// callee might be anything else.
+bool llvm::getCalledFunctions(ShadowInstruction* SI, SmallVector<Function*, 4>& Result) {
+
+  ShadowValue Op;
+
+  if(inst_is<CallInst>(SI))
+    Op = SI->getOperandFromEnd(1);
+  else if(inst_is<InvokeInst>(SI))
+    Op = SI->getOperandFromEnd(3);
+  else
+    release_assert(0 && "getCalledFunctions called on non-call, non-invoke inst");
+
+  if(Op.isInval())
+    return false;
+
+  ImprovedValSetSingle PB;
+  if((!getImprovedValSetSingle(Op.stripPointerCasts(), PB)) || PB.Overdef || PB.Values.empty())
+    return false;
+
+  for(unsigned i = 0; i < PB.Values.size(); ++i) {
+
+    Constant* ThisVal = dyn_cast_or_null<Constant>(PB.Values[i].V.getVal());
+    if(!ThisVal)
+      return false;
+    if(ThisVal->isNullValue())
+      continue;
+
+    Function* F = dyn_cast<Function>(ThisVal->stripPointerCasts());
+    if(!F)
+      return false;
+    if(std::find(Result.begin(), Result.end(), F) == Result.end())
+      Result.push_back(F);
+
+  }
+
+  return !Result.empty();
+
+}
+
 Function* llvm::getCalledFunction(ShadowInstruction* SI) {
 
   ShadowValue Op;
@@ -427,3 +469,20 @@ const DataLayout* llvm::GlobalTD;
 AliasAnalysis* llvm::GlobalAA;
 TargetLibraryInfo* llvm::GlobalTLI;
 LLPEAnalysisPass* llvm::GlobalIHP;
+
+static DenseMap<Type*, uint64_t> typeStoreSizes;
+
+uint64_t llvm::getTypeStoreSize(Type* Ty) {
+
+  std::pair<DenseMap<Type*, uint64_t>::iterator, bool> it = typeStoreSizes.insert(std::make_pair(Ty, 0));
+  if(it.second)
+    it.first->second = GlobalTD->getTypeStoreSize(Ty);
+  return it.first->second;
+
+}
+
+void llvm::resetTypeStoreSizes() {
+
+  typeStoreSizes.clear();
+
+}
@@ -24,7 +24,11 @@
 #include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/CommandLine.h"
 
+#include <algorithm>
+#include <functional>
+#include <map>
 #include <memory>
 
 using namespace llvm;
@@ -42,17 +46,23 @@ static void checkIVSNull(ImprovedValSetSingle& IVS) {
 
 ImprovedValSetMulti::ImprovedValSetMulti(uint64_t ASize) : ImprovedValSet(true), Map(GlobalIHP->IMapAllocator), MapRefCount(1), Underlying(0), CoveredBytes(0), AllocSize(ASize) { }
 
+static LLPEHistogram MultiCopyEntries("multi_copy_entries", "Entries per multi store map copied on write");
+
 ImprovedValSetMulti::ImprovedValSetMulti(const ImprovedValSetMulti& other) : ImprovedValSet(true), Map(GlobalIHP->IMapAllocator), MapRefCount(1), Underlying(other.Underlying), CoveredBytes(other.CoveredBytes), AllocSize(other.AllocSize) {
 
   if(Underlying)
     Underlying = Underlying->getReadableCopy();
 
+  uint64_t entries = 0;
   for(ImprovedValSetMulti::ConstMapIt it = other.Map.begin(), itend = other.Map.end(); it != itend; ++it) {
 
     Map.insert(it.start(), it.stop(), *it);
+    ++entries;
 
   }
 
+  MultiCopyEntries.add(entries);
+
 }
 
 // Only declare multis equal when the topmost map is trivially equal.
@@ -89,9 +99,9 @@ void PartialVal::initByteArray(uint64_t nbytes) {
 
   if(!partialValidBuf) {
 
-    partialValidBuf = new bool[nbytes];
-    for(uint64_t i = 0; i < nbytes; ++i)
-      partialValidBuf[i] = false;
+    uint64_t nwords = getValidWords(nbytes);
+    partialValidBuf = new uint64_t[nwords];
+    memset(partialValidBuf, 0, nwords * sizeof(uint64_t));
 
   }
 
@@ -132,8 +142,9 @@ PartialVal& PartialVal::operator=(const PartialVal& Other) {
 
   if(Other.partialValidBuf) {
 
-    partialValidBuf = new bool[Other.partialBufBytes];
-    memcpy(partialValidBuf, Other.partialValidBuf, Other.partialBufBytes);
+    uint64_t nwords = getValidWords(Other.partialBufBytes);
+    partialValidBuf = new uint64_t[nwords];
+    memcpy(partialValidBuf, Other.partialValidBuf, nwords * sizeof(uint64_t));
     
   }
 
@@ -163,18 +174,52 @@ PartialVal::~PartialVal() {
 
 }
 
-bool* PartialVal::getValidArray(uint64_t nbytes) {
+// Bits [lo, hi) of a word, hi <= 64.
+static inline uint64_t bitRange(uint32_t lo, uint32_t hi) {
+
+  uint64_t below = (hi == 64) ? ~((uint64_t)0) : ((((uint64_t)1) << hi) - 1);
+  return below & ~((((uint64_t)1) << lo) - 1);
+
+}
+
+static void setBits(uint64_t* words, uint64_t from, uint64_t to) {
+
+  while(from < to) {
+
+    uint32_t lo = from % 64;
+    uint32_t hi = (uint32_t)std::min((uint64_t)64, lo + (to - from));
+    words[from / 64] |= bitRange(lo, hi);
+    from += (hi - lo);
 
-  if(!partialValidBuf) {
-    partialValidBuf = new bool[nbytes];
-    partialBufBytes = nbytes;
   }
 
-  return partialValidBuf;
+}
+
+void PartialVal::setValidBytes(uint64_t from, uint64_t to) {
+
+  setBits(partialValidBuf, from, to);
 
 }
 
-static uint64_t markPaddingBytes(bool* pvb, Type* Ty, DataLayout* TD) {
+bool PartialVal::allBytesValid(uint64_t from, uint64_t to) const {
+
+  while(from < to) {
+
+    uint32_t lo = from % 64;
+    uint32_t hi = (uint32_t)std::min((uint64_t)64, lo + (to - from));
+    uint64_t mask = bitRange(lo, hi);
+    if((partialValidBuf[from / 64] & mask) != mask)
+      return false;
+    from += (hi - lo);
+
+  }
+
+  return true;
+
+}
+
+// pvb is a validity bitmap (see PartialVal::partialValidBuf); base is the byte offset of Ty within it.
+static uint64_t markPaddingBytes(uint64_t* pvb, uint64_t base, Type* Ty, DataLayout* TD) {
   
   uint64_t marked = 0;
 
@@ -189,14 +234,13 @@ static uint64_t markPaddingBytes(bool* pvb, Type* Ty, DataLayout* TD) {
     uint64_t EIdx = 0;
     for(StructType::element_iterator EI = STy->element_begin(), EE = STy->element_end(); EI != EE; ++EI, ++EIdx) {
 
-      marked += markPaddingBytes(&(pvb[SL->getElementOffset(EIdx)]), *EI, TD);
+      marked += markPaddingBytes(pvb, base + SL->getElementOffset(EIdx), *EI, TD);
       uint64_t ThisEStart = SL->getElementOffset(EIdx);
       uint64_t ESize = (TD->getTypeSizeInBits(*EI) + 7) / 8;
       uint64_t NextEStart = (EIdx + 1 == STy->getNumElements()) ? SL->getSizeInBytes() : SL->getElementOffset(EIdx + 1);
-      for(uint64_t i = ThisEStart + ESize; i < NextEStart; ++i, ++marked) {
-	
-	pvb[i] = true;
-
+      if(ThisEStart + ESize < NextEStart) {
+	setBits(pvb, base + ThisEStart + ESize, base + NextEStart);
+	marked += NextEStart - (ThisEStart + ESize);
       }
 
     }
@@ -211,7 +255,7 @@ static uint64_t markPaddingBytes(bool* pvb, Type* Ty, DataLayout* TD) {
     uint64_t Offset = 0;
     for(uint64_t i = 0; i < ECount; ++i, Offset += ESize) {
 
-      marked += markPaddingBytes(&(pvb[Offset]), EType, TD);
+      marked += markPaddingBytes(pvb, base + Offset, EType, TD);
 
     }
 
@@ -308,32 +352,33 @@ bool PartialVal::combineWith(PartialVal& Other, uint64_t FirstDef, uint64_t Firs
   assert(FirstDef < partialBufBytes);
   assert(FirstNotDef <= partialBufBytes);
 
-  // Avoid rewriting bytes which have already been defined
-  for(uint64_t i = 0; i < (FirstNotDef - FirstDef); ++i) {
-    if(partialValidBuf[FirstDef + i]) {
-      continue;
-    }
-    else {
-      ((unsigned char*)partialBuf)[FirstDef + i] = tempBuf[i]; 
-    }
-  }
+  // Avoid rewriting bytes which have already been defined.
+  // Work through the validity bitmap a word (64 bytes) at a time.
+  unsigned char* buf = (unsigned char*)partialBuf;
+  for(uint64_t i = FirstDef; i < FirstNotDef;) {
 
-  loadFinished = true;
-  // Meaning of the predicate: stop at the boundary, or bail out if there's no more setting to do
-  // and there's no hope we've finished.
-  for(uint64_t i = 0; i < LoadSize && (loadFinished || i < FirstNotDef); ++i) {
+    uint32_t lo = i % 64;
+    uint32_t hi = (uint32_t)std::min((uint64_t)64, lo + (FirstNotDef - i));
+    uint64_t mask = bitRange(lo, hi);
+    uint64_t valid = partialValidBuf[i / 64] & mask;
 
-    if(i >= FirstDef && i < FirstNotDef) {
-      partialValidBuf[i] = true;
+    if(!valid) {
+      memcpy(&(buf[i]), &(tempBuf[i - FirstDef]), hi - lo);
     }
-    else {
-      if(!partialValidBuf[i]) {
-	loadFinished = false;
+    else if(valid != mask) {
+      for(uint64_t notValid = mask & ~valid; notValid; notValid &= (notValid - 1)) {
+	uint64_t j = (i - lo) + __builtin_ctzll(notValid);
+	buf[j] = tempBuf[j - FirstDef];
       }
     }
 
+    i += (hi - lo);
+
   }
 
+  setValidBytes(FirstDef, FirstNotDef);
+  loadFinished = allBytesValid(0, LoadSize);
+
   return true;
 
 }
@@ -387,10 +432,10 @@ Constant* llvm::PVToConst(PartialVal& PV, raw_string_ostream* RSO, uint64_t Size
   }
 
   // Finally build it from bytes.
-  std::unique_ptr<std::string> error(RSO ? new std::string() : 0);
-  if(!PV.convertToBytes(Size, GlobalTD, error.get())) {
+  std::string error;
+  if(!PV.convertToBytes(Size, GlobalTD, RSO ? &error : 0)) {
     if(RSO)
-      *RSO << *error;
+      *RSO << error;
     return 0;
   }
 
@@ -418,8 +463,9 @@ bool IntegrationAttempt::tryResolveLoadFromVararg(ShadowInstruction* LoadI, Impr
     ImprovedVal& IV = PtrPB.Values[0];
     if(IV.getVaArgType() != ImprovedVal::va_baseptr) {
     
+      // Varargs belong to the function, so skip any loop contexts in between.
       ShadowInstruction* PtrI = IV.V.getInst();
-      PtrI->parent->IA->getVarArg(IV.Offset, Result);
+      PtrI->parent->IA->getFunctionRoot()->getVarArg(IV.Offset, Result);
       //LPDEBUG("va_arg " << itcache(IV.V) << " " << IV.Offset << " yielded " << printPB(Result) << "\n");
     
       return true;
@@ -442,9 +488,9 @@ bool IntegrationAttempt::tryResolveLoadFromConstant(ShadowInstruction* LoadI, Im
     
     if(GV->isConstant()) {
 
-      uint64_t LoadSize = GlobalAA->getTypeStoreSize(LoadI->getType());
+      uint64_t LoadSize = getTypeStoreSize(LoadI->getType());
       Type* FromType = GV->getInitializer()->getType();
-      uint64_t FromSize = GlobalAA->getTypeStoreSize(FromType);
+      uint64_t FromSize = getTypeStoreSize(FromType);
 
       if(Ptr.Offset < 0 || Ptr.Offset + LoadSize > FromSize) {
 	Result.setOverdef();
@@ -493,9 +539,286 @@ static bool shouldMultiload(ImprovedValSetSingle& PB) {
 
 }
 
+// How many stores a read visited, for the histograms in readValRangeFrom and the multiload
+// budget: reads walk down Underlying chains until the range is covered, and multi reads can
+// visit a layer once per gap.
+static uint64_t readStoresVisited;
+
+// Loads through a pointer with several targets (e.g. walking a table of pointers in a loop)
+// tend to re-read the same targets from the same stores. Such a load gives up and becomes
+// overdef once it has visited -int-multiload-budget stores in total (0 = no limit), and its
+// result is cached keyed on the load type, the targets and each target's store. As for the
+// merge memo, each entry holds a reference to every store in its key, which keeps them
+// from being written in place, so a pointer match is a content match. That only works for
+// Multi stores; Singles are copied rather than shared, so a load from any target with a
+// Single store (or none at all) isn't cached, but those are cheap to read anyway.
+
+static cl::opt<unsigned> MultiloadBudget("int-multiload-budget", cl::init(0));
+static cl::opt<unsigned> MultiloadCacheSize("int-multiload-cache-size", cl::init(1024));
+
+static LLPEStat MultiloadCacheHits("multiload_cache_hits", "Multi-target loads found in the cache");
+static LLPEStat MultiloadCacheMisses("multiload_cache_misses", "Multi-target loads not found in the cache");
+static LLPEStat MultiloadBudgetOverdefs("multiload_budget_overdefs", "Multi-target loads over budget");
+
+typedef std::pair<Type*, std::vector<std::pair<ImprovedVal, ImprovedValSet*> > > MultiloadKey;
+static std::map<MultiloadKey, ImprovedValSetSingle> multiloadCache;
+
+// Fill in Key for a load from LIPB's targets, returning false if it can't be cached.
+// Targets that can't contribute (null, undef, constants) are keyed with no store.
+static bool getMultiloadKey(ShadowInstruction* LI, const ImprovedValSetSingle& LIPB, MultiloadKey& Key) {
+
+  Key.first = LI->getType();
+  Key.second.clear();
+
+  uint32_t numStores = 0;
+
+  for(uint32_t i = 0, ilim = LIPB.Values.size(); i != ilim; ++i) {
+
+    ShadowValue Base = LIPB.Values[i].V;
+    ImprovedValSet* Store = 0;
+
+    bool isConst = false;
+    if(Value* V = Base.getVal())
+      isConst = isa<ConstantPointerNull>(V) || isa<UndefValue>(V);
+    if(ShadowGV* G = Base.getGV())
+      isConst = G->G->isConstant();
+
+    if(!isConst) {
+
+      LocStore* LS = LI->parent->getReadableStoreFor(Base);
+      if((!LS) || !isa<ImprovedValSetMulti>(LS->store))
+	return false;
+      Store = LS->store;
+      ++numStores;
+
+    }
+
+    Key.second.push_back(std::make_pair(LIPB.Values[i], Store));
+
+  }
+
+  // Loads with one target answer from the store directly.
+  return numStores >= 2;
+
+}
+
+static bool lookupMultiload(ShadowInstruction* LI, const MultiloadKey& Key, ImprovedValSetSingle& Result) {
+
+  std::map<MultiloadKey, ImprovedValSetSingle>::iterator findit = multiloadCache.find(Key);
+  if(findit == multiloadCache.end()) {
+    ++MultiloadCacheMisses;
+    return false;
+  }
+
+  ++MultiloadCacheHits;
+  Result = findit->second;
+
+  // Redo the thread-locality test and dependencies a read would have noted.
+  for(uint32_t i = 0, ilim = Key.second.size(); i != ilim; ++i) {
+
+    if(!Key.second[i].second)
+      continue;
+
+    ShadowValue Base = Key.second[i].first.V;
+    if(!LI->parent->localStore->es.threadLocalObjects.count(Base))
+      LI->isThreadLocal = TLS_MUSTCHECK;
+    if(!Result.isWhollyUnknown())
+      LI->parent->IA->noteDependency(Base);
+
+  }
+
+  return true;
+
+}
+
+static void storeMultiload(MultiloadKey& Key, const ImprovedValSetSingle& Result) {
+
+  if(multiloadCache.size() >= MultiloadCacheSize)
+    clearLoadCaches();
+
+  for(uint32_t i = 0, ilim = Key.second.size(); i != ilim; ++i) {
+
+    if(ImprovedValSet* IVS = Key.second[i].second)
+      IVS->getReadableCopy();
+
+  }
+
+  multiloadCache[Key] = Result;
+
+}
+
+// Loads through a single known pointer (e.g. struct fields reloaded inside a loop) are
+// cached in the same way, keyed on the target's Multi store and then the offset and type
+// loaded. Here the store is effectively a version number for the object: the cache holds one
+// reference per store, so it can't change in place without first going through
+// getWritableStoreFor, which evicts it. That drops the cache's reference, so writing to an
+// object that has been loaded from still happens in place when nothing else shares the store.
+
+static cl::opt<unsigned> LoadCacheSize("int-load-cache-size", cl::init(4096));
+
+static LLPEStat LoadCacheHits("load_cache_hits", "Single-target loads found in the cache");
+static LLPEStat LoadCacheMisses("load_cache_misses", "Single-target loads not found in the cache");
+static LLPEStat LoadCacheEvictions("load_cache_evictions", "Stores evicted from the load cache by a write");
+
+struct LoadCacheEntry {
+
+  int64_t Offset;
+  Type* LoadType;
+  ImprovedValSetSingle Result;
+
+};
+
+static DenseMap<ImprovedValSet*, SmallVector<LoadCacheEntry, 4> > loadCache;
+static uint32_t loadCacheEntries;
+
+void llvm::clearLoadCaches() {
+
+  for(std::map<MultiloadKey, ImprovedValSetSingle>::iterator it = multiloadCache.begin(),
+	itend = multiloadCache.end(); it != itend; ++it) {
+
+    for(uint32_t i = 0, ilim = it->first.second.size(); i != ilim; ++i) {
+
+      if(ImprovedValSet* IVS = it->first.second[i].second)
+	IVS->dropReference();
+
+    }
+
+  }
+
+  multiloadCache.clear();
+
+  for(DenseMap<ImprovedValSet*, SmallVector<LoadCacheEntry, 4> >::iterator it = loadCache.begin(),
+	itend = loadCache.end(); it != itend; ++it)
+    it->first->dropReference();
+
+  loadCache.clear();
+  loadCacheEntries = 0;
+
+}
+
+static void evictLoadCache(ImprovedValSet* IVS) {
+
+  DenseMap<ImprovedValSet*, SmallVector<LoadCacheEntry, 4> >::iterator findit = loadCache.find(IVS);
+  if(findit == loadCache.end())
+    return;
+
+  loadCacheEntries -= findit->second.size();
+  loadCache.erase(findit);
+  ++LoadCacheEvictions;
+
+  IVS->dropReference();
+
+}
+
+// Returns the store a load from Target would be cached against, or null if it can't be.
+static ImprovedValSet* getLoadCacheStore(ShadowInstruction* LI, const ImprovedVal& Target) {
+
+  if(Target.V.isNullPointer())
+    return 0;
+
+  if(Value* V = Target.V.getVal()) {
+    if(isa<UndefValue>(V))
+      return 0;
+  }
+
+  if(ShadowGV* G = Target.V.getGV()) {
+    if(G->G->isConstant())
+      return 0;
+  }
+
+  LocStore* LS = LI->parent->getReadableStoreFor(Target.V);
+  if((!LS) || !isa<ImprovedValSetMulti>(LS->store))
+    return 0;
+
+  return LS->store;
+
+}
+
+static bool lookupLoadCache(ShadowInstruction* LI, ImprovedValSet* Store, const ImprovedVal& Target, ImprovedValSetSingle& Result) {
+
+  DenseMap<ImprovedValSet*, SmallVector<LoadCacheEntry, 4> >::iterator findit = loadCache.find(Store);
+  if(findit != loadCache.end()) {
+
+    for(SmallVector<LoadCacheEntry, 4>::iterator it = findit->second.begin(),
+	  itend = findit->second.end(); it != itend; ++it) {
+
+      if(it->Offset != Target.Offset || it->LoadType != LI->getType())
+	continue;
+
+      ++LoadCacheHits;
+      Result = it->Result;
+
+      if(!LI->parent->localStore->es.threadLocalObjects.count(Target.V))
+	LI->isThreadLocal = TLS_MUSTCHECK;
+      if(!Result.isWhollyUnknown())
+	LI->parent->IA->noteDependency(Target.V, Target.Offset, getTypeStoreSize(LI->getType()));
+
+      return true;
+
+    }
+
+  }
+
+  ++LoadCacheMisses;
+  return false;
+
+}
+
+static void storeLoadCache(Type* LoadType, ImprovedValSet* Store, const ImprovedVal& Target, const ImprovedValSetSingle& Result) {
+
+  if(loadCacheEntries >= LoadCacheSize)
+    clearLoadCaches();
+
+  std::pair<DenseMap<ImprovedValSet*, SmallVector<LoadCacheEntry, 4> >::iterator, bool> ins =
+    loadCache.insert(std::make_pair(Store, SmallVector<LoadCacheEntry, 4>()));
+  if(ins.second)
+    Store->getReadableCopy();
+
+  LoadCacheEntry NewEntry;
+  NewEntry.Offset = Target.Offset;
+  NewEntry.LoadType = LoadType;
+  NewEntry.Result = Result;
+  ins.first->second.push_back(NewEntry);
+  ++loadCacheEntries;
+
+}
+
+// A store through a single certain pointer leaves exactly its value at that offset, so a
+// later load of the same type (the usual field write followed by a read) can be answered
+// without searching the object's extents. Enter it in the load cache as though it had been
+// read; the next write to the object evicts it as usual.
+
+static cl::opt<bool> NoStoreHints("int-no-store-hints");
+
+static LLPEStat StoreHints("store_hints", "Stores entered in the load cache for later loads");
+
+static void noteExactStore(ShadowInstruction* WriteSI, LocStore* Store, const ImprovedVal& Target, const ImprovedValSetSingle& Val) {
+
+  if(NoStoreHints || !LoadCacheSize || !inst_is<StoreInst>(WriteSI))
+    return;
+
+  if(!isa<ImprovedValSetMulti>(Store->store))
+    return;
+
+  if(Val.isWhollyUnknown() || (Val.SetType != ValSetTypeScalar && Val.SetType != ValSetTypePB))
+    return;
+
+  Type* StoreType = WriteSI->invar->I->getOperand(0)->getType();
+  uint64_t StoreSize = getTypeStoreSize(StoreType);
+
+  // Match what a load of StoreType would produce after coercion.
+  ImprovedValSetSingle Result(Val);
+  if(!Result.coerceToType(StoreType, StoreSize, 0))
+    return;
+
+  storeLoadCache(StoreType, Store->store, Target, Result);
+  ++StoreHints;
+
+}
+
 static bool tryMultiload(ShadowInstruction* LI, ImprovedValSet*& NewIV, std::string* report) {
 
-  uint64_t LoadSize = GlobalAA->getTypeStoreSize(LI->getType());
+  uint64_t LoadSize = getTypeStoreSize(LI->getType());
 
   // We already know that LI's IVSet is made up entirely of nulls and definite pointers.
   ImprovedValSetSingle* NewPB = newIVS();
@@ -508,6 +831,20 @@ static bool tryMultiload(ShadowInstruction* LI, ImprovedValSet*& NewIV, std::str
 
   LI->isThreadLocal = TLS_NEVERCHECK;
 
+  // Verbose reports need the individual reads, so don't use the caches for them.
+  MultiloadKey Key;
+  bool useCache = MultiloadCacheSize && !report && getMultiloadKey(LI, LIPB, Key);
+  if(useCache && lookupMultiload(LI, Key, *NewPB))
+    return true;
+
+  ImprovedValSet* SingleStore = 0;
+  if(LoadCacheSize && !report && LIPB.Values.size() == 1)
+    SingleStore = getLoadCacheStore(LI, LIPB.Values[0]);
+  if(SingleStore && lookupLoadCache(LI, SingleStore, LIPB.Values[0], *NewPB))
+    return true;
+
+  uint64_t visited = 0;
+
   for(uint32_t i = 0, ilim = LIPB.Values.size(); i != ilim && !NewPB->Overdef; ++i) {
 
     if(Value* V = LIPB.Values[i].V.getVal()) {
@@ -523,18 +860,21 @@ static bool tryMultiload(ShadowInstruction* LI, ImprovedValSet*& NewIV, std::str
     if(!LI->parent->localStore->es.threadLocalObjects.count(LIPB.Values[i].V))
       LI->isThreadLocal = TLS_MUSTCHECK;
 
-    std::unique_ptr<std::string> ThisError(RSO.get() ? new std::string() : 0);
+    std::string ThisErrorStr;
+    std::string* ThisError = RSO.get() ? &ThisErrorStr : 0;
     ImprovedValSetSingle ThisPB;
     ImprovedValSetMulti* ThisMulti = 0;
 
     // Permit readValRange to allocate and return a multi if appropriate (i.e. if it finds the desired
     // range includes a non-scalar value)
-    readValRange(LIPB.Values[i].V, LIPB.Values[i].Offset, LoadSize, LI->parent, ThisPB, LIPB.Values.size() == 1 ? &ThisMulti : 0, ThisError.get());
+    readStoresVisited = 0;
+    readValRange(LIPB.Values[i].V, LIPB.Values[i].Offset, LoadSize, LI->parent, ThisPB, LIPB.Values.size() == 1 ? &ThisMulti : 0, ThisError);
+    visited += readStoresVisited;
 
     // Sharing now contingent on this object!
     if(ThisMulti || !ThisPB.isWhollyUnknown()) {
 
-      LI->parent->IA->noteDependency(LIPB.Values[i].V);
+      LI->parent->IA->noteDependency(LIPB.Values[i].V, LIPB.Values[i].Offset, LoadSize);
 
     }
 
@@ -547,7 +887,7 @@ static bool tryMultiload(ShadowInstruction* LI, ImprovedValSet*& NewIV, std::str
     }
 
     if(!ThisPB.isWhollyUnknown()) {
-      if(!ThisPB.coerceToType(LI->getType(), LoadSize, ThisError.get())) {
+      if(!ThisPB.coerceToType(LI->getType(), LoadSize, ThisError)) {
 	NewPB->setOverdef();
       }
       else {
@@ -558,6 +898,11 @@ static bool tryMultiload(ShadowInstruction* LI, ImprovedValSet*& NewIV, std::str
       NewPB->merge(ThisPB);
     }
 
+    if(MultiloadBudget && visited > MultiloadBudget && !NewPB->Overdef && i + 1 != ilim) {
+      NewPB->setOverdef();
+      ++MultiloadBudgetOverdefs;
+    }
+
     if(RSO.get()) {
 
       if(ThisPB.Overdef) {
@@ -577,6 +922,13 @@ static bool tryMultiload(ShadowInstruction* LI, ImprovedValSet*& NewIV, std::str
 
   }
 
+  // Reading may have simplified the targets' stores, so key the result on what they are now.
+  if(useCache && NewPB->isInitialised() && getMultiloadKey(LI, LIPB, Key))
+    storeMultiload(Key, *NewPB);
+
+  if(SingleStore && NewPB->isInitialised() && (SingleStore = getLoadCacheStore(LI, LIPB.Values[0])))
+    storeLoadCache(LI->getType(), SingleStore, LIPB.Values[0], *NewPB);
+
   return NewPB->isInitialised();
 
 }
@@ -585,7 +937,10 @@ static bool tryMultiload(ShadowInstruction* LI, ImprovedValSet*& NewIV, std::str
 bool IntegrationAttempt::tryForwardLoadPB(ShadowInstruction* LI, ImprovedValSet*& NewPB, bool& loadedVararg) {
 
   ImprovedValSetSingle ConstResult;
-  std::unique_ptr<std::string> error(pass->verboseOverdef ? new std::string() : 0);
+  // Failure reasons are only formatted for -int-verbose-overdef; otherwise error is null
+  // and the readers below skip building them.
+  std::string errorStr;
+  std::string* error = pass->verboseOverdef ? &errorStr : 0;
 
   if(tryResolveLoadFromVararg(LI, NewPB))
     return true;
@@ -596,7 +951,7 @@ bool IntegrationAttempt::tryForwardLoadPB(ShadowInstruction* LI, ImprovedValSet*
   getImprovedValSetSingle(LI->getOperand(0), LoadPtrPB);
   if(shouldMultiload(LoadPtrPB)) {
 
-    ret = tryMultiload(LI, NewPB, error.get());
+    ret = tryMultiload(LI, NewPB, error);
     if(ImprovedValSetSingle* NewIVS = dyn_cast<ImprovedValSetSingle>(NewPB)) {
 
       if(NewIVS->SetType == ValSetTypeVarArg)
@@ -615,7 +970,7 @@ bool IntegrationAttempt::tryForwardLoadPB(ShadowInstruction* LI, ImprovedValSet*
 
     // Load from a vague pointer -> Overdef.
     ret = true;
-    if(error.get()) {
+    if(error) {
       raw_string_ostream RSO(*error);
       RSO << "Load vague ";
       printPB(RSO, LoadPtrPB, true);
@@ -632,8 +987,13 @@ bool IntegrationAttempt::tryForwardLoadPB(ShadowInstruction* LI, ImprovedValSet*
 
   }
 
-  if(error.get())
-    pass->optimisticForwardStatus[LI] = *error;
+  // Don't leave a previous iteration's reason behind if this attempt gave none.
+  if(error) {
+    if(error->empty())
+      pass->optimisticForwardStatus.erase(LI);
+    else
+      pass->optimisticForwardStatus[LI] = *error;
+  }
    
   return ret;
 
@@ -641,27 +1001,28 @@ bool IntegrationAttempt::tryForwardLoadPB(ShadowInstruction* LI, ImprovedValSet*
 
 int32_t ShadowValue::getHeapKey() const {
 
-  switch(t) {
+  switch(getValType()) {
 
   case SHADOWVAL_GV:
-    release_assert(!u.GV->G->isConstant());
-    return u.GV->allocIdx;
+    release_assert(!getGV()->G->isConstant());
+    release_assert(getGV()->allocIdx != -1 && "Unreferenced global without a heap slot");
+    return getGV()->allocIdx;
   case SHADOWVAL_OTHER:
     {
-      Function* KeyF = cast<Function>(u.V);
+      Function* KeyF = cast<Function>(getVal());
       SpecialLocationDescriptor& sd = GlobalIHP->specialLocations[KeyF];
       return sd.heapIdx;
     }
   case SHADOWVAL_ARG:
-    release_assert((u.A->IA->isRootMainCall()) && "getHeapKey on arg other than root argv?");
-    return GlobalIHP->argStores[u.A->invar->A->getArgNo()].heapIdx;
+    release_assert((getArg()->IA->isRootMainCall()) && "getHeapKey on arg other than root argv?");
+    return GlobalIHP->argStores[getArg()->invar->A->getArgNo()].heapIdx;
   case SHADOWVAL_INST:
     release_assert(0 && "Unsafe reference to heap key of instruction");
     llvm_unreachable("Unsafe reference to heap key of instruction");
   case SHADOWVAL_PTRIDX:
   case SHADOWVAL_FDIDX:
   case SHADOWVAL_FDIDX64:
-    return u.PtrOrFd.idx;
+    return getIdx();
   default:
     return -1;
 
@@ -671,13 +1032,13 @@ int32_t ShadowValue::getHeapKey() const {
 
 uint64_t ShadowValue::getAllocSize(OrdinaryLocalStore* M) const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_PTRIDX:
     return getAllocData(M)->storeSize;
   case SHADOWVAL_GV:
-    return u.GV->storeSize;
+    return getGV()->storeSize;
   case SHADOWVAL_OTHER:
-    return GlobalIHP->specialLocations[cast<Function>(u.V)].storeSize;
+    return GlobalIHP->specialLocations[cast<Function>(getVal())].storeSize;
   case SHADOWVAL_ARG:
     // Arg objects currently of unknown size
     return ULONG_MAX;
@@ -703,18 +1064,18 @@ uint64_t llvm::getAllocSize(InlineAttempt* IA, uint32_t idx) {
 
 uint64_t ShadowValue::getAllocSize(IntegrationAttempt* IA) const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_PTRIDX:
-    if(u.PtrOrFd.frame == -1)
+    if(getIdxFrame() == -1)
       return getAllocSize((OrdinaryLocalStore*)0);
     else {
       uint32_t i;
       InlineAttempt* InA;
-      release_assert(u.PtrOrFd.frame <= IA->stack_depth);
+      release_assert(getIdxFrame() <= IA->stack_depth);
       for(i = 0, InA = IA->getFunctionRoot(); 
-	  u.PtrOrFd.frame < InA->stack_depth; 
+	  getIdxFrame() < InA->stack_depth; 
 	  ++i, InA = InA->activeCaller->parent->IA->getFunctionRoot()) { }
-      return InA->localAllocas[u.PtrOrFd.idx].storeSize;
+      return InA->localAllocas[getIdx()].storeSize;
     }
   default:
     return getAllocSize((OrdinaryLocalStore*)0);
@@ -733,7 +1094,7 @@ int32_t ShadowValue::getFrameNo() const {
 
   release_assert((!isInst()) && "Unsafe reference to alloc instruction");
   if(isPtrIdx())
-    return u.PtrOrFd.frame;
+    return getIdxFrame();
   else
     return -1;
 
@@ -784,13 +1145,13 @@ LocStore* ShadowBB::getWritableStoreFor(ShadowValue& V, int64_t Offset, uint64_t
 
   if(V.isVal()) {
 
-    if(isa<UndefValue>(V.u.V))
+    if(isa<UndefValue>(V.getVal()))
       return 0;
 
   }
   else if(V.isGV()) {
 
-    if(V.u.GV->G->isConstant())
+    if(V.getGV()->G->isConstant())
       return 0;
 
   }
@@ -837,6 +1198,11 @@ LocStore* ShadowBB::getWritableStoreFor(ShadowValue& V, int64_t Offset, uint64_t
     LFV3(errs() << "Use existing store " << ret->store << "\n");
 
   }
+
+  // Loads cached against this store still hold it; let go before deciding whether it
+  // can be written in place.
+  if(isa<ImprovedValSetMulti>(ret->store))
+    evictLoadCache(ret->store);
   
   // There was already an entry in the local map or base store.
 
@@ -913,13 +1279,8 @@ bool llvm::addIVToPartialVal(const ImprovedVal& IV, ValSetType SetType, uint64_t
     uint8_t SplatVal = (uint8_t)(cast<ConstantInt>(DefC)->getLimitedValue());
     NewPV = PartialVal::getByteArray(Size);
     
-    uint8_t* buffer = (uint8_t*)NewPV.partialBuf;
-    bool* validBuf = (bool*)NewPV.partialValidBuf;
-    
-    for(uint64_t i = 0; i < Size; ++i) {
-      buffer[i] = SplatVal;
-      validBuf[i] = true;
-    }
+    memset(NewPV.partialBuf, SplatVal, Size);
+    NewPV.setValidBytes(0, Size);
 
     NewPV.loadFinished = true;
   }
@@ -941,8 +1302,13 @@ bool llvm::addIVSToPartialVal(const ImprovedValSetSingle& IVS, uint64_t IVSOffse
 
 }
 
+static LLPEHistogram ReadDepth("read_depth", "Store layers walked per read");
+static LLPEHistogram MultiReadVisits("multi_read_visits", "Stores visited per multi read");
+
 void llvm::readValRangeFrom(ShadowValue& V, uint64_t Offset, uint64_t Size, ShadowBB* ReadBB, ImprovedValSet* store, ImprovedValSetSingle& Result, PartialVal*& ResultPV, bool& shouldTryMulti, std::string* error) {
 
+  ++readStoresVisited;
+
   const ImprovedValSetSingle* IVS = dyn_cast<ImprovedValSetSingle>(store);
   uint64_t IVSSize = ReadBB->getAllocSize(V);
   ImprovedValSetMulti* IVM;
@@ -980,6 +1346,15 @@ void llvm::readValRangeFrom(ShadowValue& V, uint64_t Offset, uint64_t Size, Shad
 	return;
       }
       
+      // A splat answers any read of up to 8 bytes directly; wider reads need the bytes anyway.
+      if(IVS->SetType == ValSetTypeScalarSplat && IVS->Values.size() == 1 && Size && Size <= 8) {
+	uint8_t SplatVal = (uint8_t)(cast<ConstantInt>(getSingleConstant(IVS->Values[0].V))->getLimitedValue());
+	APInt Splat = APInt::getSplat(Size * 8, APInt(8, SplatVal));
+	Result.set(ImprovedVal(ShadowValue(ConstantInt::get(V.getLLVMContext(), Splat))), ValSetTypeScalar);
+	LFV3(errs() << "Read from splat\n");
+	return;
+      }
+
       // Otherwise we need to extract a sub-value: only works on constants:
       
       bool rejectHere = IVS->isWhollyUnknown() || (IVS->SetType != ValSetTypeScalar && IVS->SetType != ValSetTypeScalarSplat);
@@ -1155,7 +1530,9 @@ void llvm::readValRange(ShadowValue& V, int64_t Offset, uint64_t Size, ShadowBB*
 
   LocStore::simplifyStore(firstStore);
   
+  readStoresVisited = 0;
   readValRangeFrom(V, Offset, Size, ReadBB, firstStore->store, Result, ResultPV, shouldTryMulti, error);
+  ReadDepth.add(readStoresVisited);
 
   if(ResultPV) {
 
@@ -1255,7 +1632,7 @@ bool ImprovedValSetSingle::coerceToType(Type* Target, uint64_t TargetSize, std::
 
     if(isa<UndefValue>(FromC)) {
 
-      Values[i].V.u.V = UndefValue::get(Target);
+      Values[i].V = ShadowValue(UndefValue::get(Target));
       if(Target->isPointerTy())
 	SetType = ValSetTypePB;
       else
@@ -1287,7 +1664,7 @@ bool ImprovedValSetSingle::coerceToType(Type* Target, uint64_t TargetSize, std::
 
     }
 
-    Values[i].V = ShadowValue(constFromBytes((unsigned char*)PV.partialBuf, Target, GlobalTD));
+    Values[i].V = shadowValFromBytes((unsigned char*)PV.partialBuf, Target, GlobalTD);
 
   }
 
@@ -1335,7 +1712,7 @@ void llvm::executeStoreInst(ShadowInstruction* StoreSI) {
   // Get written location:
   ShadowBB* StoreBB = StoreSI->parent;
   ShadowValue Ptr = StoreSI->getOperand(1);
-  uint64_t PtrSize = GlobalAA->getTypeStoreSize(StoreSI->invar->I->getOperand(0)->getType());
+  uint64_t PtrSize = getTypeStoreSize(StoreSI->invar->I->getOperand(0)->getType());
 
   ImprovedValSetSingle PtrSet;
   release_assert(getImprovedValSetSingle(Ptr, PtrSet) && "Write through uninitialised PB?");
@@ -1415,12 +1792,29 @@ void llvm::executeMemsetInst(ShadowInstruction* MemsetSI) {
   
 }
 
+// An atomic operation through pointers that are all known to be thread-local objects can't
+// interact with another thread, so tentative load analysis treats it like a plain access.
+// tryForwardLoadPB refines this on the paths that read the old value.
+static ThreadLocalState getAtomicThreadLocality(ShadowInstruction* SI, ImprovedValSetSingle& PtrSet) {
+
+  if(PtrSet.isWhollyUnknown())
+    return TLS_MUSTCHECK;
+
+  for(uint32_t i = 0, ilim = PtrSet.Values.size(); i != ilim; ++i) {
+
+    if(!SI->parent->localStore->es.threadLocalObjects.count(PtrSet.Values[i].V))
+      return TLS_MUSTCHECK;
+
+  }
+
+  return TLS_NEVERCHECK;
+
+}
+
 bool llvm::executeAtomicRMW(ShadowInstruction* SI, ImprovedValSet*& OldPB, bool& loadedVararg) {
   
   bool ret;
 
-  SI->isThreadLocal = TLS_NEVERCHECK;
-
   OldPB = newOverdefIVS();
 
   ShadowValue Ptr = SI->getOperand(0);
@@ -1429,6 +1823,8 @@ bool llvm::executeAtomicRMW(ShadowInstruction* SI, ImprovedValSet*& OldPB, bool&
   if(!(PtrSet.isWhollyUnknown() || PtrSet.SetType == ValSetTypePB))
     PtrSet.setOverdef();
 
+  SI->isThreadLocal = getAtomicThreadLocality(SI, PtrSet);
+
   ShadowValue Val = SI->getOperand(1);
   valueEscaped(Val, SI->parent);
 
@@ -1548,7 +1944,6 @@ bool llvm::executeCmpXchg(ShadowInstruction* SI, ImprovedValSet*& OldPB, bool& l
 
   bool ret;
 
-  SI->isThreadLocal = TLS_NEVERCHECK;
   OldPB = newOverdefIVS();
 
   ShadowValue Ptr = SI->getOperand(0);
@@ -1557,6 +1952,8 @@ bool llvm::executeCmpXchg(ShadowInstruction* SI, ImprovedValSet*& OldPB, bool& l
   if(!(PtrSet.isWhollyUnknown() || PtrSet.SetType == ValSetTypePB))
     PtrSet.setOverdef();
 
+  SI->isThreadLocal = getAtomicThreadLocality(SI, PtrSet);
+
   uint64_t WriteSize = SI->getOperand(2).getValSize();
 
   if(PtrSet.isWhollyUnknown()) {
@@ -1622,7 +2019,7 @@ bool llvm::executeCmpXchg(ShadowInstruction* SI, ImprovedValSet*& OldPB, bool& l
 
 uint64_t ShadowValue::getValSize() const {
 
-  switch(t) {
+  switch(getValType()) {
 
   case SHADOWVAL_FDIDX:
     return 4;
@@ -1632,7 +2029,7 @@ uint64_t ShadowValue::getValSize() const {
     return GlobalTD->getPointerSize();
   default:
     Type* SrcTy = getNonPointerType();
-    return GlobalAA->getTypeStoreSize(SrcTy);
+    return getTypeStoreSize(SrcTy);
 
   }
 
@@ -1722,7 +2119,7 @@ void llvm::getConstSubVals(ShadowValue FromSV, uint64_t Offset, uint64_t TargetS
 
   release_assert(FromSV.isVal() || FromSV.isConstantInt());
 
-  uint64_t FromSize = GlobalAA->getTypeStoreSize(FromSV.getNonPointerType());
+  uint64_t FromSize = getTypeStoreSize(FromSV.getNonPointerType());
 
   if(Offset == 0 && TargetSize == FromSize) {
     AddIVSSV(0, TargetSize, FromSV);
@@ -1818,7 +2215,7 @@ void llvm::getConstSubVals(ShadowValue FromSV, uint64_t Offset, uint64_t TargetS
 
       // Read a partial on the left:
       Constant* StartC = CS->getAggregateElement(StartE);
-      uint64_t StartCSize = GlobalAA->getTypeStoreSize(StartC->getType());
+      uint64_t StartCSize = getTypeStoreSize(StartC->getType());
       uint64_t ThisReadSize;
 
       if(EndE == StartE)
@@ -1843,7 +2240,7 @@ void llvm::getConstSubVals(ShadowValue FromSV, uint64_t Offset, uint64_t TargetS
     for(;StartE < EndE; ++StartE) {
 
       Constant* E = CS->getAggregateElement(StartE);
-      uint64_t ESize = GlobalAA->getTypeStoreSize(E->getType());
+      uint64_t ESize = getTypeStoreSize(E->getType());
       uint64_t ThisOff = SL->getElementOffset(StartE);
       AddIVSConst(ThisOff, ESize, E);
 
@@ -1883,15 +2280,14 @@ void llvm::getConstSubVals(ShadowValue FromSV, uint64_t Offset, uint64_t TargetS
     SmallVector<uint8_t, 16> Buffer(TargetSize);
     if(XXXReadDataFromGlobal(FromC, Offset, Buffer.data(), TargetSize, *GlobalTD)) {
 
-      Constant* SubC;
       if(TargetSize <= 8) {
 	Type* Target = Type::getIntNTy(FromC->getContext(), TargetSize * 8);
-	SubC = constFromBytes((uint8_t*)Buffer.data(), Target, GlobalTD);
+	AddIVSSV(Offset, TargetSize, shadowValFromBytes((uint8_t*)Buffer.data(), Target, GlobalTD));
+      }
+      else {
+	Constant* SubC = ConstantDataArray::get(FromC->getContext(), ArrayRef<uint8_t>(Buffer));
+	AddIVSConst(Offset, TargetSize, SubC);
       }
-      else
-	SubC = ConstantDataArray::get(FromC->getContext(), ArrayRef<uint8_t>(Buffer));
-
-      AddIVSConst(Offset, TargetSize, SubC);
       
     }
     else {
@@ -1904,34 +2300,52 @@ void llvm::getConstSubVals(ShadowValue FromSV, uint64_t Offset, uint64_t TargetS
   
 }
 
-Constant* llvm::valsToConst(SmallVector<IVSRange, 4>& subVals, uint64_t TargetSize, Type* targetType) {
-
-  if(subVals.size() == 0)
-    return 0;
+// Write the bytes of several known sub-values into buffer, which must be TargetSize long.
+static bool valsToBytes(SmallVector<IVSRange, 4>& subVals, SmallVector<uint8_t, 16>& buffer) {
 
   for(SmallVector<IVSRange, 4>::iterator it = subVals.begin(), itend = subVals.end();
       it != itend; ++it) {
 
-    if(it->second.isWhollyUnknown())
-      return 0;
+    uint8_t* ReadPtr = &(buffer.data()[it->first.first]);
+    if(!XXXReadDataFromGlobal(getSingleConstant(it->second.Values[0].V), 0, ReadPtr, it->first.second - it->first.first, *GlobalTD))
+      return false;
 
   }
 
-  if(subVals.size() == 1)
-    return getSingleConstant(subVals[0].second.Values[0].V);
+  return true;
 
-  // Otherwise attempt a big synthesis from bytes.
-  SmallVector<uint8_t, 16> buffer(TargetSize);
+}
+
+static bool anyValWhollyUnknown(SmallVector<IVSRange, 4>& subVals) {
 
   for(SmallVector<IVSRange, 4>::iterator it = subVals.begin(), itend = subVals.end();
       it != itend; ++it) {
 
-    uint8_t* ReadPtr = &(buffer.data()[it->first.first]);
-    if(!XXXReadDataFromGlobal(getSingleConstant(it->second.Values[0].V), 0, ReadPtr, it->first.second - it->first.first, *GlobalTD))
-      return 0;
+    if(it->second.isWhollyUnknown())
+      return true;
 
   }
 
+  return false;
+
+}
+
+Constant* llvm::valsToConst(SmallVector<IVSRange, 4>& subVals, uint64_t TargetSize, Type* targetType) {
+
+  if(subVals.size() == 0)
+    return 0;
+
+  if(anyValWhollyUnknown(subVals))
+    return 0;
+
+  if(subVals.size() == 1)
+    return getSingleConstant(subVals[0].second.Values[0].V);
+
+  // Otherwise attempt a big synthesis from bytes.
+  SmallVector<uint8_t, 16> buffer(TargetSize);
+  if(!valsToBytes(subVals, buffer))
+    return 0;
+
   LLVMContext& Ctx = subVals[0].second.Values[0].V.getLLVMContext();
 
   if(!targetType) {
@@ -1954,6 +2368,21 @@ void llvm::getConstSubVal(ShadowValue FromSV, uint64_t Offset, uint64_t TargetSi
 
   if(subVals.size() != 1) {
 
+    // Integers assembled from several pieces can be kept inline rather than as a ConstantInt.
+    if(subVals.size() != 0 && TargetSize <= 8 && (TargetType ? TargetType->isIntegerTy() : (TargetSize == 1 || TargetSize == 2 || TargetSize == 4 || TargetSize == 8)) &&
+       !anyValWhollyUnknown(subVals)) {
+
+      SmallVector<uint8_t, 16> buffer(TargetSize);
+      if(valsToBytes(subVals, buffer)) {
+
+	Type* IntType = TargetType ? TargetType : Type::getIntNTy(subVals[0].second.Values[0].V.getLLVMContext(), TargetSize * 8);
+	Result.mergeOne(ValSetTypeScalar, ImprovedVal(shadowValFromBytes(buffer.data(), IntType, GlobalTD)));
+	return;
+
+      }
+
+    }
+
     if(Constant* C = valsToConst(subVals, TargetSize, TargetType)) {
 
       std::pair<ValSetType, ImprovedVal> V = getValPB(C);
@@ -2269,7 +2698,7 @@ void llvm::truncateLeft(ImprovedValSetMulti::MapIt& it, uint64_t n, ImprovedValS
   }
 
   Constant* C = getSingleConstant(S.Values[0].V);
-  uint64_t CSize = GlobalAA->getTypeStoreSize(C->getType());
+  uint64_t CSize = getTypeStoreSize(C->getType());
   truncateConstVal(it, CSize - n, n, firstPtr);
 
 }
@@ -2285,6 +2714,8 @@ bool llvm::canTruncate(const ImprovedValSetSingle& S) {
 
 void llvm::readValRangeMultiFrom(uint64_t Offset, uint64_t Size, ImprovedValSet* store, SmallVector<IVSRange, 4>& Results, ImprovedValSet* ignoreBelowStore, uint64_t ASize) {
 
+  ++readStoresVisited;
+
   if(!store) {
     
     Value* UD = UndefValue::get(Type::getIntNTy(GInt8->getContext(), Size));
@@ -2457,7 +2888,9 @@ void llvm::readValRangeMulti(ShadowValue& V, uint64_t Offset, uint64_t Size, Sha
     LFV3(errs() << "Starting at local store\n");
   }
 
+  readStoresVisited = 0;
   readValRangeMultiFrom(Offset, Size, firstStore->store, Results, 0, ReadBB->getAllocSize(V));
+  MultiReadVisits.add(readStoresVisited);
 
 }
 
@@ -2499,14 +2932,19 @@ void llvm::executeVaCopyInst(ShadowInstruction* SI) {
 
 }
 
-void llvm::executeAllocInst(ShadowInstruction* SI, AllocData& AD, Type* AllocType, uint64_t AllocSize, int32_t frame, uint32_t idx) {
+void llvm::executeAllocInst(ShadowInstruction* SI, AllocData& AD, Type* AllocType, uint64_t AllocSize, int32_t frame, uint32_t idx, bool zeroed) {
 
   // Represent the store by a big undef value at the start, or if !AllocType (implying AllocSize
-  // == ULONG_MAX, unknown size), start with a big Overdef.
+  // == ULONG_MAX, unknown size), start with a big Overdef. Zeroed memory is one zero splat
+  // however large it is, so sparse writes into it only ever split that extent.
  
   ImprovedValSetSingle* initVal;
 
-  if(AllocType) {
+  if(AllocType && zeroed) {
+    Constant* Zero = Constant::getNullValue(Type::getInt8Ty(SI->invar->I->getContext()));
+    initVal = new ImprovedValSetSingle(ImprovedVal(ShadowValue(Zero), AllocSize), ValSetTypeScalarSplat);
+  }
+  else if(AllocType) {
     Constant* Undef = UndefValue::get(AllocType);
     ImprovedVal IV(ShadowValue(Undef), 0);
     initVal = new ImprovedValSetSingle(IV, ValSetTypeScalar);
@@ -2540,7 +2978,7 @@ void llvm::executeAllocInst(ShadowInstruction* SI, AllocData& AD, Type* AllocTyp
 
 }
 
-static void markVagueAllocation(ShadowInstruction* SI) {
+void llvm::markVagueAllocation(ShadowInstruction* SI) {
 
   ImprovedValSetSingle* IVS = cast<ImprovedValSetSingle>(SI->i.PB);
   release_assert(SI->i.PB && isa<ImprovedValSetSingle>(SI->i.PB) && IVS->SetType == ValSetTypePB);
@@ -2585,12 +3023,35 @@ void llvm::executeAllocaInst(ShadowInstruction* SI) {
   AllocData& AD = parentIA->localAllocas.back();
   AD.allocIdx = allocIdx;
   
-  executeAllocInst(SI, AD, allocType, allocType ? GlobalAA->getTypeStoreSize(allocType) : ULONG_MAX, parentIA->stack_depth, allocIdx);
+  executeAllocInst(SI, AD, allocType, allocType ? getTypeStoreSize(allocType) : ULONG_MAX, parentIA->stack_depth, allocIdx);
 
 }
 
+static LLPEStat HeapSlotsRecycled("heap_slots_recycled", "Heap slots reused after their allocation's context was discarded");
+
 AllocData& llvm::addHeapAlloc(ShadowInstruction* SI) {
 
+  std::vector<uint32_t>& freeSlots = GlobalIHP->freeHeapSlots;
+
+  // Reuse the lowest free slot, so that heap stores stay as shallow as the number of
+  // live objects needs rather than the number ever allocated.
+  if(!freeSlots.empty()) {
+
+    std::pop_heap(freeSlots.begin(), freeSlots.end(), std::greater<uint32_t>());
+    uint32_t allocIdx = freeSlots.back();
+    freeSlots.pop_back();
+
+    AllocData& AD = GlobalIHP->heap[allocIdx];
+    release_assert(AD.isFree && "Heap slot in use on the free list?");
+    uint32_t generation = AD.generation + 1;
+    AD = AllocData();
+    AD.allocIdx = allocIdx;
+    AD.generation = generation;
+    ++HeapSlotsRecycled;
+    return AD;
+
+  }
+
   uint32_t allocIdx = GlobalIHP->heap.size();
   GlobalIHP->heap.push_back(AllocData());
   GlobalIHP->heap.back().allocIdx = allocIdx;
@@ -2598,6 +3059,44 @@ AllocData& llvm::addHeapAlloc(ShadowInstruction* SI) {
 
 }
 
+// SI, in a context being freed without ever being committed, may be a heap allocation
+// whose slot can now be reused. The context's stores, and any value derived from the
+// object, go with it, so nothing the analysis goes on to use can reach the slot. Objects
+// carved from arenas are still listed under their arena, and with function sharing a
+// shared context may have recorded the allocation as escaping, so those are kept.
+void llvm::releaseHeapSlot(ShadowInstruction* SI) {
+
+  LLPEAnalysisPass* pass = GlobalIHP;
+  if(!pass->recyclingHeapSlots || pass->enableSharing)
+    return;
+
+  ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(SI->i.PB);
+  if(!IVS || IVS->SetType != ValSetTypePB || IVS->Values.size() != 1)
+    return;
+
+  ShadowValue& Base = IVS->Values[0].V;
+  if(!Base.isPtrIdx() || Base.getIdxFrame() != -1)
+    return;
+
+  AllocData& AD = pass->heap[Base.getIdx()];
+  if(AD.isFree || AD.allocValue != ShadowValue(SI) || AD.isCommitted || AD.arenaMember)
+    return;
+
+  pass->arenaObjects.erase(Base);
+  pass->indirectDIEUsers.erase(Base);
+  pass->synthForwardBases.erase(Base);
+
+  uint32_t generation = AD.generation;
+  AD = AllocData();
+  AD.allocIdx = Base.getIdx();
+  AD.generation = generation;
+  AD.isFree = true;
+
+  pass->freeHeapSlots.push_back(Base.getIdx());
+  std::push_heap(pass->freeHeapSlots.begin(), pass->freeHeapSlots.end(), std::greater<uint32_t>());
+
+}
+
 static void executeMallocInst2(ShadowInstruction* SI, AllocatorFn& param) {
 
   if(SI->i.PB) {
@@ -2610,6 +3109,18 @@ static void executeMallocInst2(ShadowInstruction* SI, AllocatorFn& param) {
     AllocSize = param.allocSize;
   else
     AllocSize = cast_or_null<ConstantInt>(getConstReplacement(SI->getCallArgOperand(param.sizeArg)));
+
+  if(AllocSize && param.countArg != UINT_MAX) {
+
+    ConstantInt* Count = cast_or_null<ConstantInt>(getConstReplacement(SI->getCallArgOperand(param.countArg)));
+    if(Count) {
+      uint64_t Total = Count->getLimitedValue() * AllocSize->getLimitedValue();
+      AllocSize = ConstantInt::get(AllocSize->getType(), Total);
+    }
+    else
+      AllocSize = 0;
+
+  }
   Type* allocType = 0;
   if(AllocSize)
     allocType = ArrayType::get(Type::getInt8Ty(SI->invar->I->getContext()), AllocSize->getLimitedValue());
@@ -2617,7 +3128,21 @@ static void executeMallocInst2(ShadowInstruction* SI, AllocatorFn& param) {
   SI->parent->IA->noteMalloc(SI);
 
   AllocData& AD = addHeapAlloc(SI);
-  executeAllocInst(SI, AD, allocType, AllocSize ? AllocSize->getLimitedValue() : ULONG_MAX, -1, GlobalIHP->heap.size() - 1);
+  executeAllocInst(SI, AD, allocType, AllocSize ? AllocSize->getLimitedValue() : ULONG_MAX, -1, AD.allocIdx, param.zeroed);
+  AD.neverNull = param.neverFails;
+
+  // Each object carved from an arena gets its own heap slot like any other allocation;
+  // remember which arena it came from so releasing the arena releases it too.
+  if(param.arenaArg != UINT_MAX) {
+
+    ShadowValue Arena;
+    int64_t ArenaOffset;
+    if(getBaseAndConstantOffset(SI->getCallArgOperand(param.arenaArg), Arena, ArenaOffset) && !Arena.isNullPointer()) {
+      AD.arenaMember = true;
+      GlobalIHP->arenaObjects[Arena].push_back(AD.allocIdx);
+    }
+
+  }
   
 }
 
@@ -2628,10 +3153,40 @@ void llvm::executeMallocLikeInst(ShadowInstruction* SI) {
 
 }
 
+// Mark every object carved from the arena De.arg points to as deallocated, as a free of each
+// would. If the arena isn't known, nothing is released, as for a free of an unknown pointer.
+static void executeArenaRelease(ShadowInstruction* SI, DeallocatorFn& De) {
+
+  ShadowValue Arena;
+  int64_t ArenaOffset;
+  if(!getBaseAndConstantOffset(SI->getCallArgOperand(De.arg), Arena, ArenaOffset))
+    return;
+
+  DenseMap<ShadowValue, std::vector<uint32_t> >::iterator findit = GlobalIHP->arenaObjects.find(Arena);
+  if(findit == GlobalIHP->arenaObjects.end())
+    return;
+
+  ImprovedValSetSingle TagIVS;
+  TagIVS.SetType = ValSetTypeDeallocated;
+
+  for(std::vector<uint32_t>::iterator it = findit->second.begin(), itend = findit->second.end(); it != itend; ++it) {
+
+    ImprovedValSetSingle ObjIVS(ImprovedVal(ShadowValue::getPtrIdx(-1, *it), 0), ValSetTypePB);
+    executeWriteInst(0, ObjIVS, TagIVS, SI->parent->getAllocSize(ObjIVS.Values[0].V), SI);
+
+  }
+
+}
+
 void llvm::executeFreeInst(ShadowInstruction* SI, Function* FreeF) {
 
   DeallocatorFn& De = GlobalIHP->deallocatorFunctions[FreeF];
 
+  if(De.releasesArena) {
+    executeArenaRelease(SI, De);
+    return;
+  }
+
   ShadowInstruction* FreedPtr = SI->getCallArgOperand(De.arg).getInst();
   if(!FreedPtr)
     return;
@@ -2668,7 +3223,7 @@ void llvm::executeReallocInst(ShadowInstruction* SI, Function* F) {
     SI->parent->IA->noteMalloc(SI);
 
     AllocData& AD = addHeapAlloc(SI);
-    executeAllocInst(SI, AD, allocType, AllocSize ? AllocSize->getLimitedValue() : ULONG_MAX, -1, GlobalIHP->heap.size() - 1);
+    executeAllocInst(SI, AD, allocType, AllocSize ? AllocSize->getLimitedValue() : ULONG_MAX, -1, AD.allocIdx);
 
   }
   else {
@@ -2742,6 +3297,59 @@ void llvm::writeExtents(SmallVector<IVSRange, 4>& copyValues, ShadowValue& Ptr,
 
 }
 
+static LLPEStat SharedCopies("shared_copies", "Whole-object copies made by sharing the source store");
+
+// Make Ptr's store in BB the given store (already referenced for it), like writeExtents
+// writing the whole object.
+static void shareStore(ImprovedValSet* Shared, ShadowValue& Ptr, ShadowBB* BB) {
+
+  LocStore* Store = BB->getWritableStoreFor(Ptr, 0, ULONG_MAX, true);
+  release_assert(Store && "Non-writable location in shareStore?");
+
+  LFV3(errs() << "Copy shares store " << Shared << ", replacing " << Store->store << "\n");
+
+  Store->store->dropReference();
+  Store->store = Shared;
+  checkStore(Store->store, Ptr);
+  ++SharedCopies;
+
+}
+
+static LLPEStat SharedGrowingCopies("shared_growing_copies", "Copies into a larger object (e.g. realloc) layered over the source store");
+
+// Ptr is larger than the Multi store Shared describes, as when realloc grows a buffer: give
+// it a new Multi layered over Shared, holding only what Ptr already had beyond CopySize.
+// Reads below CopySize then fall through to the shared layers, as for any other Underlying
+// store, instead of each extent being copied into Ptr's map.
+static void shareStoreBelow(ImprovedValSetMulti* Shared, ShadowValue& Ptr, uint64_t CopySize, uint64_t DestSize, ShadowBB* BB) {
+
+  SmallVector<IVSRange, 4> Tail;
+  readValRangeMulti(Ptr, CopySize, DestSize - CopySize, BB, Tail);
+
+  ImprovedValSetMulti* NewStore = new ImprovedValSetMulti(DestSize);
+  NewStore->Underlying = Shared->getReadableCopy();
+
+  ImprovedValSetMulti::MapIt insertit = NewStore->Map.end();
+  for(SmallVector<IVSRange, 4>::iterator it = Tail.begin(), itend = Tail.end(); it != itend; ++it) {
+
+    insertit.insert(it->first.first, it->first.second, it->second);
+    insertit = NewStore->Map.end();
+    NewStore->CoveredBytes += (it->first.second - it->first.first);
+
+  }
+
+  LocStore* Store = BB->getWritableStoreFor(Ptr, 0, ULONG_MAX, true);
+  release_assert(Store && "Non-writable location in shareStoreBelow?");
+
+  LFV3(errs() << "Copy layers " << NewStore << " over " << Shared << ", replacing " << Store->store << "\n");
+
+  Store->store->dropReference();
+  Store->store = NewStore;
+  checkStore(Store->store, Ptr);
+  ++SharedGrowingCopies;
+
+}
+
 void llvm::executeCopyInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, ImprovedValSetSingle& SrcPtrSet, uint64_t Size, ShadowInstruction* CopySI) {
 
   ShadowBB* BB = CopySI->parent;
@@ -2810,7 +3418,7 @@ void llvm::executeCopyInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, Impro
     return;
 
   // Now dependent on the source location's value.
-  BB->IA->noteDependency(SrcPtrSet.Values[0].V);
+  BB->IA->noteDependency(SrcPtrSet.Values[0].V, SrcPtrSet.Values[0].Offset, Size);
 
   CopySI->isThreadLocal = 
     BB->localStore->es.threadLocalObjects.count(SrcPtrSet.Values[0].V) ? 
@@ -2830,8 +3438,30 @@ void llvm::executeCopyInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, Impro
     
   }
 
-  // OK now blow a hole in the local map for that value and write this list of extents into the gap:
-  writeExtents(copyValues, PtrSet.Values[0].V, PtrSet.Values[0].Offset, Size, BB);
+  uint64_t DestSize = BB->getAllocSize(PtrSet.Values[0].V);
+  LocStore* SrcStore;
+
+  if(PtrSet.Values[0].Offset == 0 && SrcPtrSet.Values[0].Offset == 0 &&
+     Size == BB->getAllocSize(SrcPtrSet.Values[0].V) && Size <= DestSize && DestSize != ULONG_MAX &&
+     (SrcStore = BB->getReadableStoreFor(SrcPtrSet.Values[0].V)) &&
+     (Size == DestSize || isa<ImprovedValSetMulti>(SrcStore->store))) {
+
+    // Whole object to the start of an object at least as big: rather than rebuilding the
+    // source's extents in the destination, share its store outright, or layer over it if
+    // the destination is bigger. The extents read above are still needed to check the copy
+    // (TL) and synthesise it and to propagate the flags below.
+    if(Size == DestSize)
+      shareStore(SrcStore->store->getReadableCopy(), PtrSet.Values[0].V, BB);
+    else
+      shareStoreBelow(cast<ImprovedValSetMulti>(SrcStore->store), PtrSet.Values[0].V, Size, DestSize, BB);
+
+  }
+  else {
+
+    // OK now blow a hole in the local map for that value and write this list of extents into the gap:
+    writeExtents(copyValues, PtrSet.Values[0].V, PtrSet.Values[0].Offset, Size, BB);
+
+  }
 
   for(SmallVector<IVSRange, 4>::iterator it = copyValues.begin(),
 	itend = copyValues.end(); it != itend; ++it) {
@@ -2883,7 +3513,7 @@ void llvm::executeVaStartInst(ShadowInstruction* SI) {
 
 }
 
-void llvm::executeReadInst(ShadowInstruction* ReadSI, std::string& Filename, uint64_t FileOffset, uint64_t Size) {
+void llvm::executeReadInst(ShadowInstruction* ReadSI, const std::string& Filename, uint64_t FileOffset, uint64_t Size) {
 
   LFV3(errs() << "Start read inst\n");
 
@@ -2902,12 +3532,11 @@ void llvm::executeReadInst(ShadowInstruction* ReadSI, std::string& Filename, uin
   }
   else {
 
-    std::vector<Constant*> constBytes;
+    ArrayRef<uint8_t> fileBytes;
     std::string errors;
     LLVMContext& Context = Ptr.getLLVMContext();
-    if(getFileBytes(Filename, FileOffset, Size, constBytes, Context,  errors)) {
-      ArrayType* ArrType = ArrayType::get(IntegerType::get(Context, 8), constBytes.size());
-      Constant* ByteArray = ConstantArray::get(ArrType, constBytes);
+    if(getFileBytes(Filename, FileOffset, Size, fileBytes, errors)) {
+      Constant* ByteArray = ConstantDataArray::get(Context, fileBytes);
       WriteIVS = ImprovedValSetSingle(ImprovedVal(ByteArray, 0), ValSetTypeScalar);
     }
 
@@ -2923,6 +3552,8 @@ void llvm::initSpecialFunctionsMap(Module& M) {
 
   if(Function* F1 = M.getFunction("malloc"))
     SpecialFunctionMap[F1] = SF_MALLOC;  
+  if(Function* F1 = M.getFunction("calloc"))
+    SpecialFunctionMap[F1] = SF_MALLOC;
   if(Function* F2 = M.getFunction("realloc"))
     SpecialFunctionMap[F2] = SF_REALLOC;
   if(Function* F3 = M.getFunction("free"))
@@ -3022,13 +3653,13 @@ static void visitReachableObjects(const ImprovedValSetSingle& Ptr, ShadowBB* BB,
 
     const ShadowValue& ThisPtr = Ptr.Values[i].V;
 
-    switch(ThisPtr.t) {
+    switch(ThisPtr.getValType()) {
     case SHADOWVAL_GV:
-      if(ThisPtr.u.GV->G->isConstant())
+      if(ThisPtr.getGV()->G->isConstant())
 	continue;
       break;
     case SHADOWVAL_OTHER:
-      release_assert(ThisPtr.isNullPointer() || isa<UndefValue>(ThisPtr.u.V) || isFunction(ThisPtr.u.V));
+      release_assert(ThisPtr.isNullPointer() || isa<UndefValue>(ThisPtr.getVal()) || isFunction(ThisPtr.getVal()));
       continue;
     default:
       break;
@@ -3069,24 +3700,24 @@ struct ReachesAllPointersVisitor : public ReachableObjectVisitor {
 
 };
 
-static bool reachesAllPointers(const ImprovedValSetSingle& Ptr, ShadowBB* BB, bool ignoreOldObjects) {
-
-  ReachesAllPointersVisitor V(ignoreOldObjects);
-  visitReachableObjects(Ptr, BB, V);
-  return V.mayReachAll;
+// Flagging objects reachable from a pointer as may-alias-old or thread-global, and checking
+// whether an unknown pointer is reachable (in which case every object is flagged), are
+// done in one walk of the reachable graph rather than a full walk for the check followed by
+// a second for the flags. The walk has to continue through objects already flagged, since
+// an unknown pointer might only be reachable through one; flagging anything found beyond them
+// that wasn't already flagged is conservative. If an unknown pointer turns up part way, the
+// flags applied so far are a subset of flagging every object.
 
-}
+struct SetMAOVisitor : public ReachesAllPointersVisitor {
 
-struct SetMAOVisitor : public ReachableObjectVisitor {
+  SetMAOVisitor() : ReachesAllPointersVisitor(true) { }
 
   virtual bool visitObject(const ShadowValue& Obj, ShadowBB* BB) { 
 
-    // Don't explore objects reachable this way, it's already known MAO
-    if(!BB->localStore->es.noAliasOldObjects.count(Obj))
-      return false;
-
-    BB->localStore = BB->localStore->getWritableFrameList();
-    BB->localStore->es.noAliasOldObjects.erase(Obj);
+    if(BB->localStore->es.noAliasOldObjects.count(Obj)) {
+      BB->localStore = BB->localStore->getWritableFrameList();
+      BB->localStore->es.noAliasOldObjects.erase(Obj);
+    }
 
     return true;
 
@@ -3096,14 +3727,12 @@ struct SetMAOVisitor : public ReachableObjectVisitor {
 
 static void setObjectsMayAliasOld(const ImprovedValSetSingle& Ptr, ShadowBB* BB) {
 
-  if(reachesAllPointers(Ptr, BB, true)) {
-    BB->setAllObjectsMayAliasOld();
-    return;
-  }
-  
   SetMAOVisitor V;
   visitReachableObjects(Ptr, BB, V);
 
+  if(V.mayReachAll)
+    BB->setAllObjectsMayAliasOld();
+
 }
 
 static void setValueMayAliasOld(ShadowValue V, ShadowBB* BB) {
@@ -3124,16 +3753,16 @@ static void setValueMayAliasOld(ShadowValue V, ShadowBB* BB) {
 
 }
 
-struct SetTGVisitor : public ReachableObjectVisitor {
+struct SetTGVisitor : public ReachesAllPointersVisitor {
+
+  SetTGVisitor() : ReachesAllPointersVisitor(false) { }
 
   virtual bool visitObject(const ShadowValue& Obj, ShadowBB* BB) { 
 
-    // Don't explore objects reachable this way
-    if(!BB->localStore->es.threadLocalObjects.count(Obj))
-      return false;
-    
-    BB->localStore = BB->localStore->getWritableFrameList();
-    BB->localStore->es.threadLocalObjects.erase(Obj);
+    if(BB->localStore->es.threadLocalObjects.count(Obj)) {
+      BB->localStore = BB->localStore->getWritableFrameList();
+      BB->localStore->es.threadLocalObjects.erase(Obj);
+    }
 
     return true;
 
@@ -3143,14 +3772,12 @@ struct SetTGVisitor : public ReachableObjectVisitor {
 
 static void setObjectsThreadGlobal(const ImprovedValSetSingle& Ptr, ShadowBB* BB) {
 
-  if(reachesAllPointers(Ptr, BB, false)) {
-    BB->setAllObjectsThreadGlobal();
-    return;
-  }
-  
   SetTGVisitor V;
   visitReachableObjects(Ptr, BB, V);
 
+  if(V.mayReachAll)
+    BB->setAllObjectsThreadGlobal();
+
 }
 
 
@@ -3200,8 +3827,21 @@ bool llvm::clobberSyscallModLocations(Function* F, ShadowInstruction* SI) {
 	Details[i].Location->getLocation(ShadowValue(SI), ClobberV, ClobberSize);
       }
       else {
+
+	// A -int-modref-file entry naming an argument the call doesn't have.
+	if(Details[i].Location->argIndex >= SI->getNumArgOperands() ||
+	   (Details[i].Location->sizeArgScale && Details[i].Location->sizeArgIndex >= SI->getNumArgOperands()))
+	  return false;
+
 	ClobberV = SI->getCallArgOperand(Details[i].Location->argIndex);
 	ClobberSize = Details[i].Location->argSize;
+	if(Details[i].Location->sizeArgScale) {
+	  if(tryGetConstantInt(SI->getCallArgOperand(Details[i].Location->sizeArgIndex), ClobberSize))
+	    ClobberSize *= Details[i].Location->sizeArgScale;
+	  else
+	    ClobberSize = AliasAnalysis::UnknownSize;
+	}
+
       }
 
       if(ClobberV.isInval())
@@ -3224,14 +3864,13 @@ bool llvm::clobberSyscallModLocations(Function* F, ShadowInstruction* SI) {
       // Optimistic locks have no effect here and are accounted for in the
       // tentative loads phase.
 
-      SmallDenseMap<CallInst*, std::vector<GlobalVariable*>, 4>::iterator findit =
-	GlobalIHP->lockDomains.find(CI);
-      if(findit != GlobalIHP->lockDomains.end()) {
+      std::vector<GlobalVariable*>* Domain = GlobalIHP->getLockDomain(SI);
+      if(Domain) {
 
 	ImprovedValSetSingle OD(ValSetTypeUnknown, true);
 
-	for(std::vector<GlobalVariable*>::iterator it = findit->second.begin(),
-	      itend = findit->second.end(); it != itend; ++it) {
+	for(std::vector<GlobalVariable*>::iterator it = Domain->begin(),
+	      itend = Domain->end(); it != itend; ++it) {
 
 	  ShadowGV* SGV = &GlobalIHP->shadowGlobals[GlobalIHP->getShadowGlobalIndex(*it)];
 	  ShadowValue ClobberV(SGV);
@@ -3271,6 +3910,102 @@ bool llvm::clobberSyscallModLocations(Function* F, ShadowInstruction* SI) {
 
 }
 
+static void executeSummarisedCall(ShadowInstruction* SI, ArrayRef<Function*> Callees, const CallModSummary* Summary) {
+
+  ImprovedValSetSingle OD(ValSetTypeUnknown, true);
+
+  for(SmallPtrSet<GlobalVariable*, 4>::const_iterator it = Summary->writesGlobals.begin(),
+	itend = Summary->writesGlobals.end(); it != itend; ++it) {
+
+    ShadowGV* SGV = &GlobalIHP->shadowGlobals[GlobalIHP->getShadowGlobalIndex(*it)];
+    ImprovedValSetSingle ClobberIVS;
+    ClobberIVS.set(ImprovedVal(ShadowValue(SGV), LLONG_MAX), ValSetTypePB);
+    executeWriteInst(0, ClobberIVS, OD, AliasAnalysis::UnknownSize, SI);
+
+  }
+
+  for(uint32_t i = 0, ilim = SI->getNumArgOperands(); i != ilim; ++i) {
+
+    ShadowValue Op = SI->getCallArgOperand(i);
+
+    if(i < Summary->writesArg.size() && Summary->writesArg[i]) {
+
+      // The callee may write anywhere in any object the argument might point to.
+      ImprovedValSetSingle ClobberIVS;
+      getImprovedValSetSingle(Op, ClobberIVS);
+      if(ClobberIVS.SetType != ValSetTypePB || !ClobberIVS.isInitialised())
+	ClobberIVS.setOverdef();
+      for(uint32_t j = 0, jlim = ClobberIVS.Values.size(); j != jlim; ++j)
+	ClobberIVS.Values[j].Offset = LLONG_MAX;
+
+      executeWriteInst(&Op, ClobberIVS, OD, AliasAnalysis::UnknownSize, SI);
+
+    }
+
+    // Arguments no callee captures stay unescaped.
+    bool mayCapture = false;
+    for(uint32_t j = 0, jlim = Callees.size(); j != jlim && !mayCapture; ++j)
+      mayCapture = !Callees[j]->doesNotCapture(i + 1);
+
+    if(mayCapture) {
+
+      valueEscaped(Op, SI->parent);
+      setValueMayAliasOld(Op, SI->parent);
+      setValueThreadGlobal(Op, SI->parent);
+
+    }
+
+  }
+
+}
+
+// If every function SI might call is summarised (see CallSummaries.cpp) or only
+// reads memory, clobber the union of what they write.
+static bool executeMultiTargetCall(ShadowInstruction* SI) {
+
+  SmallVector<Function*, 4> Callees;
+  if(!getCalledFunctions(SI, Callees))
+    return false;
+
+  CallModSummary Merged;
+  Merged.writesArg.resize(SI->getNumArgOperands(), false);
+  bool mayThrow = false;
+
+  for(SmallVector<Function*, 4>::iterator it = Callees.begin(), itend = Callees.end(); it != itend; ++it) {
+
+    Function* F = *it;
+    if(SpecialFunctionMap.count(F) || GlobalIHP->specialLocations.count(F))
+      return false;
+
+    if(!F->doesNotThrow())
+      mayThrow = true;
+
+    if(F->onlyReadsMemory())
+      continue;
+
+    const CallModSummary* Summary = GlobalIHP->getCallModSummary(F);
+    if(!Summary)
+      return false;
+
+    for(SmallPtrSet<GlobalVariable*, 4>::const_iterator GI = Summary->writesGlobals.begin(),
+	  GE = Summary->writesGlobals.end(); GI != GE; ++GI)
+      Merged.writesGlobals.insert(*GI);
+
+    for(uint32_t i = 0, ilim = std::min(Merged.writesArg.size(), Summary->writesArg.size()); i != ilim; ++i) {
+      if(Summary->writesArg[i])
+	Merged.writesArg[i] = true;
+    }
+
+  }
+
+  if(mayThrow && !inst_is<InvokeInst>(SI))
+    SI->parent->IA->mayUnwind = true;
+
+  executeSummarisedCall(SI, Callees, &Merged);
+  return true;
+
+}
+
 void llvm::executeUnexpandedCall(ShadowInstruction* SI) {
 
   if(MemIntrinsic* MI = dyn_cast_inst<MemIntrinsic>(SI)) {
@@ -3356,8 +4091,9 @@ void llvm::executeUnexpandedCall(ShadowInstruction* SI) {
     if(F->onlyReadsMemory())
       return;
 
-    // The function might cause unwinding if it isn't explicitly annotated to the contrary:
-    if(!F->doesNotThrow())
+    // The function might cause unwinding if it isn't explicitly annotated to the contrary.
+    // An invoke's unwinding goes to its landing pad, which is live if so.
+    if(!F->doesNotThrow() && !inst_is<InvokeInst>(SI))
       SI->parent->IA->mayUnwind = true;
 
     // Do selective clobbering for annotated syscalls:
@@ -3365,6 +4101,13 @@ void llvm::executeUnexpandedCall(ShadowInstruction* SI) {
     if(clobberSyscallModLocations(F, SI))
       return;
 
+    // Clobber only what an unexpanded defined function is known to write:
+
+    if(const CallModSummary* Summary = GlobalIHP->getCallModSummary(F)) {
+      executeSummarisedCall(SI, F, Summary);
+      return;
+    }
+
   }
   else {
 
@@ -3373,6 +4116,10 @@ void llvm::executeUnexpandedCall(ShadowInstruction* SI) {
       deleteIV(SI->i.PB);
     SI->i.PB = newOverdefIVS();
 
+    // An indirect call to one of a few known functions writes no more than they do.
+    if(executeMultiTargetCall(SI))
+      return;
+
   }
 
   bool clobbersMemory = true;
@@ -3396,8 +4143,9 @@ void llvm::executeUnexpandedCall(ShadowInstruction* SI) {
     ImprovedValSetSingle OD(ValSetTypeUnknown, true);
     executeWriteInst(0, OD, OD, AliasAnalysis::UnknownSize, SI);
     // Functions that clobber FD state happen to be the same.
+    flushAllSeeks(SI);
     FDStore* FDS = SI->parent->getWritableFDStore();
-    FDS->fds.clear();
+    FDS->clear();
     
   }
     
@@ -3439,21 +4187,86 @@ void ShadowBB::setAllObjectsThreadGlobal() {
 
 void ShadowBB::clobberAllExcept(DenseSet<ShadowValue>& Save, bool verbose) {
 
+  typedef SharedFramePage<LocStore> PageType;
+
+  // Stack objects are already partitioned into refcounted frame pages. Where every valid
+  // slot of a page is spared the page itself is carried over to the clobbered store,
+  // so the cost is in the objects spared and not the size of the frames.
+  DenseMap<std::pair<uint32_t, uint32_t>, uint32_t> sparedPerPage;
+
+  for(DenseSet<ShadowValue>::iterator it = Save.begin(), itend = Save.end(); it != itend; ++it) {
+
+    int32_t frameNo = it->getFrameNo();
+    if(frameNo != -1 && localStore->getReadableStoreFor(*it))
+      ++sparedPerPage[std::make_pair((uint32_t)frameNo, (uint32_t)it->getFramePos() >> FRAMEPAGESIZELOG2)];
+
+  }
+
+  SmallVector<std::pair<std::pair<uint32_t, uint32_t>, PageType*>, 4> keepPages;
+  DenseSet<std::pair<uint32_t, uint32_t> > keepPageSet;
+
+  for(DenseMap<std::pair<uint32_t, uint32_t>, uint32_t>::iterator it = sparedPerPage.begin(),
+	itend = sparedPerPage.end(); it != itend; ++it) {
+
+    PageType* P = localStore->frames[it->first.first]->pages[it->first.second];
+    uint32_t valid = 0;
+    for(uint32_t i = 0; i != FRAMEPAGESIZE; ++i) {
+      if(P->slots[i].isValid())
+	++valid;
+    }
+
+    if(valid == it->second) {
+      // Hold the page while the old frame is dropped.
+      P->refCount++;
+      keepPages.push_back(std::make_pair(it->first, P));
+      keepPageSet.insert(it->first);
+    }
+
+  }
+
   std::vector<std::pair<ShadowValue, ImprovedValSet*> > SaveVals;
 
   for(DenseSet<ShadowValue>::iterator it = Save.begin(), itend = Save.end(); it != itend; ++it) {
 
+    if(verbose)
+      errs() << "Sparing " << itcache(*it) << "\n";
+
+    int32_t frameNo = it->getFrameNo();
+    if(frameNo != -1 && keepPageSet.count(std::make_pair((uint32_t)frameNo, (uint32_t)it->getFramePos() >> FRAMEPAGESIZELOG2)))
+      continue;
+
     LocStore* CurrentVal = getReadableStoreFor(*it);
     if(!CurrentVal)
       CurrentVal = &LocStore::getEmptyStore();
     SaveVals.push_back(std::make_pair(*it, CurrentVal->store->getReadableCopy()));
-    if(verbose)
-      errs() << "Sparing " << itcache(*it) << "\n";
     
   }
 
+  // A shared store is replaced by a new map rather than cleared; it is no less true
+  // afterwards which objects are unescaped or thread-local, so keep that as the in-place
+  // clear does.
+  bool keepExtraState = localStore->refCount > 1;
+  OrdinaryStoreExtraState savedES;
+  if(keepExtraState)
+    savedES.copyFrom(localStore->es);
+
   localStore = localStore->getEmptyMap();
   localStore->allOthersClobbered = true;
+  if(keepExtraState)
+    localStore->es.copyFrom(savedES);
+
+  for(SmallVector<std::pair<std::pair<uint32_t, uint32_t>, PageType*>, 4>::iterator it = keepPages.begin(),
+	itend = keepPages.end(); it != itend; ++it) {
+
+    OrdinaryLocalStore::FrameType* frame = localStore->getWritableFrame(it->first.first);
+    uint32_t pageIdx = it->first.second;
+    if(frame->pages.size() <= pageIdx)
+      frame->resize((pageIdx + 1) << FRAMEPAGESIZELOG2);
+    release_assert(!frame->pages[pageIdx] && "Clobbered frame still has pages?");
+    frame->pages[pageIdx] = it->second;
+    frame->empty = false;
+
+  }
 
   for(std::vector<std::pair<ShadowValue, ImprovedValSet*> >::iterator it = SaveVals.begin(),
 	itend = SaveVals.end(); it != itend; ++it) {
@@ -3561,7 +4374,7 @@ void IntegrationAttempt::inheritDiagnosticsFrom(IntegrationAttempt* Other) {
 
 static bool isVagueAllocation(ShadowValue V, ShadowBB* CtxBB) {
 
-  switch(V.t) {
+  switch(V.getValType()) {
 
   case SHADOWVAL_ARG:
   case SHADOWVAL_OTHER:
@@ -3621,6 +4434,7 @@ void llvm::executeWriteInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, Impr
 
     replaceRangeWithPB(Store->store, ValPB, (uint64_t)PtrSet.Values[0].Offset, PtrSize);
     checkStore(Store->store, PtrSet.Values[0].V);
+    noteExactStore(WriteSI, Store, PtrSet.Values[0], ValPB);
  
   }
   else {
@@ -3788,13 +4602,13 @@ static void scalarSplatToScalar(ImprovedValSetSingle& IVS, Type* targetType) {
   for(uint32_t i = 0, ilim = IVS.Values.size(); i != ilim; ++i) {
 
     PartialVal PV(ValSetTypeScalarSplat, IVS.Values[i]);
-    Constant* PVC = PVToConst(PV, 0, GlobalTD->getTypeStoreSize(targetType), targetType->getContext());
+    Constant* PVC = PVToConst(PV, 0, getTypeStoreSize(targetType), targetType->getContext());
     IVS.Values[i] = ImprovedVal(ShadowValue(PVC));
 
   }
 
   IVS.SetType = ValSetTypeScalar;
-  IVS.coerceToType(targetType, GlobalTD->getTypeStoreSize(targetType), 0);
+  IVS.coerceToType(targetType, getTypeStoreSize(targetType), 0);
 
 }
 
@@ -3875,11 +4689,42 @@ static void mergeValues(ImprovedValSetSingle& consumeVal, ImprovedValSetSingle&
 
 }
 
+// Memo of Multi-vs-Multi store merges. Block-end merges often meet the same pair of
+// shared stores repeatedly (e.g. one predecessor's store against each of several forks that
+// left it untouched), so we remember the result keyed on the two input stores and the
+// parameters mergeValues depends on. Each entry holds a reference to both inputs and to the
+// result: that keeps all three alive, and since none is then writable in place it also keeps
+// their contents fixed for as long as the entry exists, so a pointer match is a content match.
+
+static cl::opt<unsigned> MergeMemoSize("int-merge-memo-size", cl::init(4096));
+
+typedef std::pair<std::pair<ImprovedValSet*, ImprovedValSet*>, std::pair<uint64_t, unsigned> > MergeMemoKey;
+static DenseMap<MergeMemoKey, ImprovedValSetMulti*> mergeMemo;
+
+static LLPEStat StoreMerges("store_merges", "Differing location stores merged");
+
+void llvm::clearStoreMergeMemo() {
+
+  for(DenseMap<MergeMemoKey, ImprovedValSetMulti*>::iterator it = mergeMemo.begin(),
+	itend = mergeMemo.end(); it != itend; ++it) {
+
+    it->first.first.first->dropReference();
+    it->first.first.second->dropReference();
+    it->second->dropReference();
+
+  }
+
+  mergeMemo.clear();
+
+}
+
 void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uint64_t ASize, OrdinaryMerger* Visitor) {
 
   if(mergeFromStore->store == mergeToStore->store)
     return;
 
+  ++StoreMerges;
+
   if(ImprovedValSetSingle* IVS = dyn_cast<ImprovedValSetSingle>(mergeToStore->store)) {
 
     LFV3(errs() << "Merge in store " << mergeFromStore << " -> " << mergeToStore << "\n");
@@ -3912,6 +4757,38 @@ void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uin
 
   }
 
+  bool useMemo = MergeMemoSize &&
+    isa<ImprovedValSetMulti>(mergeToStore->store) &&
+    isa<ImprovedValSetMulti>(mergeFromStore->store);
+  MergeMemoKey memoKey;
+
+  if(useMemo) {
+
+    memoKey = std::make_pair(std::make_pair(mergeToStore->store, mergeFromStore->store),
+			     std::make_pair(ASize, (PBMax << 1) | (Visitor->useVarargMerge ? 1 : 0)));
+
+    DenseMap<MergeMemoKey, ImprovedValSetMulti*>::iterator findit = mergeMemo.find(memoKey);
+    if(findit != mergeMemo.end()) {
+
+      LFV3(errs() << "Merge result found in memo: " << findit->second << "\n");
+      ++GlobalIHP->stats.storeMergeMemoHits;
+      mergeToStore->store->dropReference();
+      mergeToStore->store = findit->second->getReadableCopy();
+      return;
+
+    }
+
+    ++GlobalIHP->stats.storeMergeMemoMisses;
+
+    if(mergeMemo.size() >= MergeMemoSize)
+      clearStoreMergeMemo();
+
+    // Take the entry's references to the inputs now, so the target is not reused in place below.
+    mergeToStore->store->getReadableCopy();
+    mergeFromStore->store->getReadableCopy();
+
+  }
+
   // Get an IVS list for each side that contains gaps where there is a common ancestor:
   ImprovedValSet *LHSAncestor, *RHSAncestor;
   {
@@ -4110,11 +4987,50 @@ void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uin
 
     mergeToStore->store = newStore;
 
+    if(useMemo)
+      mergeMemo[memoKey] = cast<ImprovedValSetMulti>(newStore->getReadableCopy());
+
+  }
+
+}
+
+// Chains of Multis deeper than this are flattened when next simplified; 0 never flattens.
+static cl::opt<unsigned> FlattenStoreDepth("int-flatten-store-depth", cl::init(32));
+
+static LLPEStat StoreFlattens("store_flattens", "Deep multi store chains flattened");
+
+// Replace LS's store with a single Multi holding everything its chain defines. The layers
+// are left as they are, since other blocks may still share them; LS just drops its reference.
+static void flattenStore(LocStore* LS) {
+
+  ImprovedValSetMulti* IVM = cast<ImprovedValSetMulti>(LS->store);
+  uint64_t ASize = IVM->AllocSize;
+
+  SmallVector<IVSRange, 4> Vals;
+  readValRangeMultiFrom(0, ASize, IVM, Vals, 0, ASize);
+
+  ImprovedValSetMulti* newStore = new ImprovedValSetMulti(ASize);
+  ImprovedValSetMulti::MapIt insertit = newStore->Map.end();
+  for(SmallVector<IVSRange, 4>::iterator it = Vals.begin(), itend = Vals.end(); it != itend; ++it) {
+
+    insertit.insert(it->first.first, it->first.second, it->second);
+    insertit = newStore->Map.end();
+    newStore->CoveredBytes += (it->first.second - it->first.first);
+
   }
 
+  LFV3(errs() << "Flatten deep store " << IVM << " -> " << newStore << "\n");
+
+  IVM->dropReference();
+  LS->store = newStore;
+  ++StoreFlattens;
+
 }
 
 // If store merging has left a common base store with only single reference, merge down.
+// Layers that are shared can't be folded like that, so a chain that has nonetheless grown
+// past -int-flatten-store-depth is flattened instead: each read from it walks the whole chain,
+// while flattening costs one walk and a copy of the extents now visible.
 void LocStore::simplifyStore(LocStore* LS) {
 
   ImprovedValSetMulti* IVM;
@@ -4149,6 +5065,19 @@ void LocStore::simplifyStore(LocStore* LS) {
 
   }
 
+  if(!FlattenStoreDepth)
+    return;
+
+  uint32_t depth = 0;
+  for(ImprovedValSet* IVS = LS->store; IVS && isa<ImprovedValSetMulti>(IVS); IVS = cast<ImprovedValSetMulti>(IVS)->Underlying) {
+
+    if(++depth > FlattenStoreDepth) {
+      flattenStore(LS);
+      return;
+    }
+
+  }
+
 }
 
 static bool sizeLT(const DenseSet<ShadowValue>* a, const DenseSet<ShadowValue>* b) {
@@ -4401,10 +5330,12 @@ bool PeelIteration::ctxContains(IntegrationAttempt* IA) {
 AllocData* ShadowValue::getAllocData(OrdinaryLocalStore* Map) const {
 
   release_assert(isPtrIdx());
-  if(u.PtrOrFd.frame == -1)
-    return &GlobalIHP->heap[u.PtrOrFd.idx];
+  if(getIdxFrame() == -1) {
+    release_assert(!GlobalIHP->heap[getIdx()].isFree && "Pointer to a recycled heap slot");
+    return &GlobalIHP->heap[getIdx()];
+  }
   else
-    return &Map->frames[u.PtrOrFd.frame]->IA->localAllocas[u.PtrOrFd.idx];
+    return &Map->frames[getIdxFrame()]->IA->localAllocas[getIdx()];
 
 }
 
@@ -4412,10 +5343,12 @@ AllocData* IntegrationAttempt::getAllocData(ShadowValue V) {
 
   release_assert(V.isPtrIdx());
   
-  if(V.u.PtrOrFd.frame == -1)
-    return &GlobalIHP->heap[V.u.PtrOrFd.idx];
+  if(V.getIdxFrame() == -1) {
+    release_assert(!GlobalIHP->heap[V.getIdx()].isFree && "Pointer to a recycled heap slot");
+    return &GlobalIHP->heap[V.getIdx()];
+  }
   else
-    return &getFunctionRoot()->getStackFrameCtx(V.u.PtrOrFd.frame)->localAllocas[V.u.PtrOrFd.idx];
+    return &getFunctionRoot()->getStackFrameCtx(V.getIdxFrame())->localAllocas[V.getIdx()];
 
 }
 
@@ -4423,7 +5356,7 @@ ShadowInstruction* IntegrationAttempt::getAllocInst(ShadowValue V) {
 
   AllocData* AD = getAllocData(V);
   release_assert(!AD->isCommitted);
-  return AD->allocValue.u.I;
+  return AD->allocValue.getInst();
 
 }
 
@@ -37,6 +37,19 @@
 
 using namespace llvm;
 
+static cl::opt<unsigned> PeelBudget("int-peel-budget", cl::init(0));
+// Free a terminated loop's peeled iterations as soon as they're found not worth committing,
+// and analyse the loop in general instead, as for an unpeeled loop. Saves holding them until
+// the enclosing function context commits, at the price of the more precise state the
+// peeled loop would have given the code after it.
+static cl::opt<bool> DiscardDisabledLoops("int-discard-disabled-loops");
+static cl::opt<unsigned> LoopWidenAfter("int-loop-widen-after", cl::init(0));
+// Let the heap objects allocated by loop peels freed that way give their slots back, for
+// later allocations to reuse, so that heap stores stay shallow in long allocating loops.
+static cl::opt<bool> RecycleHeapSlots("int-recycle-heap-slots");
+
+static LLPEStat VFSCallsModelled("vfs_calls", "VFS call evaluations");
+
 int nLoopsWritten = 0;
 
 bool InlineAttempt::analyseWithArgs(ShadowInstruction* SI, bool inLoopAnalyser, bool inAnyLoop, uint32_t parent_stack_depth) {
@@ -70,8 +83,19 @@ bool InlineAttempt::analyseWithArgs(ShadowInstruction* SI, bool inLoopAnalyser,
 bool InlineAttempt::analyseNoArgs(bool inLoopAnalyser, bool inAnyLoop, uint32_t parent_stack_depth) {
 
   uint32_t new_stack_depth = (invarInfo->frameSize == -1) ? parent_stack_depth : parent_stack_depth + 1;
+
+  // Apply any per-function set size limit while analysing this context.
+  uint32_t oldPBMax = PBMax;
+  Function* oldPBMaxFunction = PBMaxFunction;
+  DenseMap<Function*, uint32_t>::iterator findit = pass->maxSetSizes.find(&F);
+  PBMax = (findit == pass->maxSetSizes.end()) ? pass->defaultMaxSetSize : findit->second;
+  PBMaxFunction = &F;
+
   bool ret = analyse(inLoopAnalyser, inAnyLoop, new_stack_depth);
 
+  PBMax = oldPBMax;
+  PBMaxFunction = oldPBMaxFunction;
+
   returnValue = 0;
 
   if(!F.getFunctionType()->getReturnType()->isVoidTy()) {
@@ -86,6 +110,8 @@ bool InlineAttempt::analyseNoArgs(bool inLoopAnalyser, bool inAnyLoop, uint32_t
 
 static void initialiseStore(ShadowBB* BB) {
 
+  GlobalIHP->globalStoresInitialised = true;
+
   for(uint32_t i = 0, ilim = GlobalIHP->heap.size(); i != ilim; ++i) {
 
     AllocData& AD = GlobalIHP->heap[i];
@@ -204,6 +230,8 @@ void PeelIteration::getInitialStore(bool inLoopAnalyser) {
 
 bool IntegrationAttempt::analyse(bool inLoopAnalyser, bool inAnyLoop, uint32_t new_stack_depth) {
 
+  ContextTimer Timer(this, L);
+
   stack_depth = new_stack_depth;
 
   bool anyChange = false;
@@ -239,6 +267,7 @@ bool PeelAttempt::analyse(uint32_t parent_stack_depth, bool& readsTentativeData,
   stack_depth = parent_stack_depth;
 
   readsTentativeData = false;
+  carriedStates.clear();
 
   for(PeelIteration* PI = Iterations[0]; PI; PI = PI->getOrCreateNextIteration()) {
 
@@ -247,10 +276,36 @@ bool PeelAttempt::analyse(uint32_t parent_stack_depth, bool& readsTentativeData,
     readsTentativeData |= PI->readsTentativeData;
     containsCheckedReads |= PI->containsCheckedReads;
 
+    if(PI->iterationCount >= 2)
+      foldExitingStores(PI->iterationCount - 1);
+
+    if(overTimeBudget(parent)) {
+
+      LPDEBUG("Won't peel loop " << getLName() << " further: out of analysis time\n");
+      overBudget = true;
+      break;
+
+    }
+
+    if(PeelBudget != 0) {
+
+      peelCost += PI->getPeelCost();
+      if(peelCost > PeelBudget) {
+
+	LPDEBUG("Won't peel loop " << getLName() << " further: cost " << peelCost << " exceeds budget\n");
+	overBudget = true;
+	break;
+
+      }
+
+    }
+
   }
 
   Iterations.back()->checkFinalIteration();
-  if(!isTerminated())
+  if(isTerminated())
+    overBudget = false;
+  else
     dropNonterminatedStoreRefs();
  
   return anyChange;
@@ -375,9 +430,15 @@ bool IntegrationAttempt::analyseBlock(uint32_t& blockIdx, bool inLoopAnalyser, b
     // By construction of our top-ordering, must be a loop entry block.
     release_assert(BBL && "Walked into root context?");
 
+    // Seeks are only left pending along paths that are analysed once, and a loop
+    // might not be peeled, or kept if it is: bring file positions up to date on entry.
+    if(ShadowBB* PHBB = getBB(BBL->preheaderIdx))
+      flushAllSeeks(&PHBB->insts.back());
+
     // Now explore the loop, if possible.
     // At the moment can't ever happen inside the loop analyser.
     PeelAttempt* LPA = 0;
+    bool discardLPA = false;
     if((!inLoopAnalyser) && (LPA = getOrCreatePeelAttempt(BBL))) {
 
       // Give the preheader an extra reference in case we need that store
@@ -396,7 +457,13 @@ bool IntegrationAttempt::analyseBlock(uint32_t& blockIdx, bool inLoopAnalyser, b
       if(LPA->isTerminated()) {
 
 	LPA->findProfitableIntegration();
-	if(!LPA->isEnabled()) {
+	if(!LPA->isEnabled() && DiscardDisabledLoops) {
+
+	  ++pass->stats.discardedLoops;
+	  discardLPA = true;
+
+	}
+	else if(!LPA->isEnabled()) {
 
 	  // The preheader already has a copy of the TL and DSE stores
 	  // in case the loop didn't terminate -- give it to each exiting block.
@@ -443,6 +510,23 @@ bool IntegrationAttempt::analyseBlock(uint32_t& blockIdx, bool inLoopAnalyser, b
 
       }
 
+      if(LPA->overBudget)
+	++pass->stats.overBudgetLoops;
+
+      if(LPA->overBudget || discardLPA) {
+
+	// The loop is left to the general analysis below, so nothing will consult
+	// the peels again; free them now rather than after commit, along with the
+	// heap slots of the objects they allocated.
+	peelChildren.erase(BBL);
+	pass->recyclingHeapSlots = RecycleHeapSlots;
+	delete LPA;
+	pass->recyclingHeapSlots = false;
+	LPA = 0;
+	livenessChanged();
+
+      }
+
     }
 
     // Analyse for invariants if we didn't establish that the loop terminates.
@@ -557,6 +641,8 @@ bool IntegrationAttempt::analyseBlock(uint32_t& blockIdx, bool inLoopAnalyser, b
 
 bool IntegrationAttempt::analyseInstruction(ShadowInstruction* SI, bool inLoopAnalyser, bool inAnyLoop, bool& loadedVarargsHere, bool& bail) {
 
+  ++pass->instructionsEvaluated;
+
   ShadowInstructionInvar* SII = SI->invar;
   Instruction* I = SII->I;
 
@@ -590,7 +676,13 @@ bool IntegrationAttempt::analyseInstruction(ShadowInstruction* SI, bool inLoopAn
 
       if(tryPromoteOpenCall(SI))
 	return false;
-      if(tryResolveVFSCall(SI))
+      if(tryResolveVFSCall(SI, inLoopAnalyser)) {
+	VFSCallsModelled.inc(&F);
+	return false;
+      }
+      if(tryModelStringCall(SI))
+	return false;
+      if(tryRunNativeCall(SI))
 	return false;
       
       bool isExpanded = analyseExpandableCall(SI, changed, inLoopAnalyser, inAnyLoop);
@@ -738,6 +830,8 @@ void IntegrationAttempt::releaseLatchStores(const ShadowLoopInvar* L) {
 // either in our call or a parent call.
 bool IntegrationAttempt::analyseLoop(const ShadowLoopInvar* L, bool nestedLoop) {
 
+  ContextTimer Timer(this, L);
+
   bool anyChange = true;
   bool firstIter = true;
   bool everChanged = false;
@@ -749,10 +843,23 @@ bool IntegrationAttempt::analyseLoop(const ShadowLoopInvar* L, bool nestedLoop)
 
   LFV3(errs() << "Loop " << L->getHeader()->getName() << " refcount at entry: " << PHBB->localStore->refCount << "\n");
 
+  // Widening below lowers the set size limit for the rest of this loop's analysis only.
+  uint32_t oldPBMax = PBMax;
+
   // Stop iterating if we show that the latch edge died!
   while(anyChange && (firstIter || !edgeIsDead(getBBInvar(L->latchIdx), HBB->invar))) {
     
     ++iters;
+    ++pass->stats.loopAnalysisRounds;
+
+    // Widen: once the loop has had -int-loop-widen-after rounds to settle, any value or
+    // store set that is still growing goes straight to overdef (or a pointer of unknown
+    // offset) instead of gaining one element per round until it reaches PBMax.
+    if(LoopWidenAfter != 0 && iters == LoopWidenAfter + 1 && PBMax > 1) {
+      LFV3(errs() << "Loop " << L->getHeader()->getName() << " widened after " << LoopWidenAfter << " rounds\n");
+      PBMax = 1;
+      ++pass->stats.widenedLoops;
+    }
 
     // Give the preheader store an extra reference to ensure it is never modified.
     // This ref corresponds to ph retaining its reference (h has already been given one by ph's successor code).
@@ -855,6 +962,8 @@ bool IntegrationAttempt::analyseLoop(const ShadowLoopInvar* L, bool nestedLoop)
   if(edgeIsDead(getBBInvar(L->latchIdx), HBB->invar))
     release_assert(iters == 1 && "Loop analysis found the latch dead but not first time around?");
 
+  PBMax = oldPBMax;
+
   // Release the preheader store that was held for merging in each iteration:
   PHBB->derefStores();
 
@@ -974,10 +1083,13 @@ void IntegrationAttempt::execute(uint32_t new_stack_depth) {
 
 	// Run each individual iteration
 
-	for(std::vector<PeelIteration*>::iterator it = LPA->Iterations.begin(), 
-	      itend = LPA->Iterations.end(); it != itend; ++it) {
+	for(uint32_t j = 0, jlim = LPA->Iterations.size(); j != jlim; ++j) {
 
-	  (*it)->execute(stack_depth);
+	  // Flags left by the original analysis would hide this run's exit stores.
+	  LPA->Iterations[j]->clearFoldedExitStores();
+	  LPA->Iterations[j]->execute(stack_depth);
+	  if(j >= 2)
+	    LPA->foldExitingStores(j - 1);
 
 	}
 
@@ -0,0 +1,66 @@
+//===-- MergeVariants.cpp -------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// -llpe-merge-variants, run by scripts/llpe-batch.py over the linked variants, merges
+// functions that are identical up to renaming, as commit does for one run's split
+// functions (see mergeIdenticalFunctions), but across the separately specialised
+// variants: those specialised for configurations that agree about some part of the
+// program commit the same residual function once each. Only local functions that are
+// only called directly are merged, which in an externalised batch module are exactly
+// those the variants committed.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/Pass.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace llvm {
+
+class LLPEMergeVariantsPass : public ModulePass {
+public:
+
+  static char ID;
+  LLPEMergeVariantsPass() : ModulePass(ID) {}
+
+  bool runOnModule(Module& M);
+
+};
+
+}
+
+using namespace llvm;
+
+static RegisterPass<LLPEMergeVariantsPass> X("llpe-merge-variants", "Merge identical residual functions across LLPE variants",
+					    false /* Only looks at CFG */,
+					    false /* Analysis Pass */);
+
+char LLPEMergeVariantsPass::ID = 0;
+
+bool LLPEMergeVariantsPass::runOnModule(Module& M) {
+
+  std::vector<Function*> Fs;
+
+  for(Module::iterator it = M.begin(), itend = M.end(); it != itend; ++it) {
+
+    if(it->isDeclaration() || (!it->hasLocalLinkage()) || it->hasAddressTaken())
+      continue;
+
+    Fs.push_back(it);
+
+  }
+
+  uint32_t nMerged = mergeFunctionList(Fs);
+  if(nMerged)
+    errs() << "Merged " << nMerged << " functions shared between variants\n";
+
+  return nMerged != 0;
+
+}
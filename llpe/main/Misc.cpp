@@ -16,6 +16,7 @@
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IntrinsicInst.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/ADT/SmallSet.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/DenseMap.h"
@@ -34,12 +35,16 @@
 #include "llvm/Support/Debug.h"
 #include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/ValueSymbolTable.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
 #include <sstream>
 #include <string>
 #include <algorithm>
 
+#include <stdio.h>
 #include <stdlib.h>
 
 #include <openssl/sha.h>
@@ -53,6 +58,8 @@ char LLPEAnalysisPass::ID = 0;
 
 static cl::opt<std::string> GraphOutputDirectory("intgraphs-dir", cl::init(""));
 static cl::opt<std::string> RootFunctionName("intheuristics-root", cl::init("main"));
+static cl::opt<std::string> VariantName("int-variant-name", cl::init(""));
+static cl::opt<bool> GuardedClone("int-guarded-clone");
 static cl::opt<std::string> EnvFileAndIdx("spec-env", cl::init(""));
 static cl::opt<std::string> ArgvFileAndIdxs("spec-argv", cl::init(""));
 static cl::opt<unsigned> MallocAlignment("int-malloc-alignment", cl::init(1));
@@ -66,6 +73,8 @@ static cl::list<std::string> ExpandCallsLoops("int-expand-loop-calls", cl::ZeroO
 static cl::list<std::string> IgnoreLoopsWithChildren("int-ignore-loop-children", cl::ZeroOrMore);
 static cl::list<std::string> AlwaysExploreFunctions("int-always-explore", cl::ZeroOrMore);
 static cl::list<std::string> LoopMaxIters("int-loop-max", cl::ZeroOrMore);
+static cl::opt<unsigned> MaxSetSize("int-max-set-size", cl::init(16));
+static cl::list<std::string> MaxSetSizeFunctions("int-max-set-size-fn", cl::ZeroOrMore);
 static cl::list<std::string> IgnoreBlocks("int-ignore-block", cl::ZeroOrMore);
 static cl::list<std::string> PathConditionsInt("int-path-condition-int", cl::ZeroOrMore);
 static cl::list<std::string> PathConditionsFptr("int-path-condition-fptr", cl::ZeroOrMore);
@@ -73,14 +82,25 @@ static cl::list<std::string> PathConditionsString("int-path-condition-str", cl::
 static cl::list<std::string> PathConditionsIntmem("int-path-condition-intmem", cl::ZeroOrMore);
 static cl::list<std::string> PathConditionsFptrmem("int-path-condition-fptrmem", cl::ZeroOrMore);
 static cl::list<std::string> PathConditionsFunc("int-path-condition-func", cl::ZeroOrMore);
+// Assume an FD stored at a location delivers the bytes of a recorded trace file, e.g. a request
+// captured from a socket: read, recv and recvfrom on it resolve against the trace and are checked
+// with memcmp at runtime.
 static cl::list<std::string> PathConditionsStream("int-path-condition-stream", cl::ZeroOrMore);
 static cl::list<std::string> PathConditionsGlobalInit("int-path-condition-global-unmodified", cl::ZeroOrMore);
 static cl::opt<bool> SkipBenefitAnalysis("skip-benefit-analysis");
 static cl::opt<bool> SkipDIE("skip-int-die");
 static cl::opt<bool> SkipTL("skip-check-elim");
 static cl::opt<unsigned> MaxContexts("int-stop-after", cl::init(0));
+// The percentage of the -int-stop-after budget that contexts entered from cold blocks
+// (see isColdBlock) may use; the rest is kept for the code that is likely to run.
+static cl::opt<unsigned> ColdContextShare("int-cold-context-share", cl::init(100));
+static cl::opt<unsigned> SummariseLoopsAfter("int-summarise-loops-after", cl::init(0));
+// Stop peeling a loop once an iteration hands the next the same PHI values, store and FD
+// state as an earlier one did, as a state machine or polling loop cycling back would.
+static cl::opt<bool> PeelCycleDetection("int-peel-cycle-detection");
+static cl::opt<unsigned> MemoryBudgetMB("int-memory-budget", cl::init(0));
 static cl::opt<bool> VerboseOverdef("int-verbose-overdef");
-static cl::opt<bool> EnableFunctionSharing("int-enable-sharing");
+static cl::opt<bool> EnableFunctionSharing("int-enable-sharing", cl::init(true));
 static cl::opt<bool> VerboseFunctionSharing("int-verbose-sharing");
 static cl::opt<bool> UseGlobalInitialisers("int-use-global-initialisers");
 static cl::list<std::string> SpecialLocations("int-special-location", cl::ZeroOrMore);
@@ -89,17 +109,36 @@ static cl::list<std::string> YieldFunctions("int-yield-function", cl::ZeroOrMore
 static cl::list<std::string> TargetStack("int-target-stack", cl::ZeroOrMore);
 static cl::list<std::string> SimpleVolatiles("int-simple-volatile-load", cl::ZeroOrMore);
 static cl::list<std::string> LockDomains("int-lock-domain", cl::ZeroOrMore);
+static cl::list<std::string> MutexDomains("int-mutex-domain", cl::ZeroOrMore);
 static cl::list<std::string> PessimisticLocks("int-pessimistic-lock", cl::ZeroOrMore);
 static cl::opt<bool> DumpDSE("int-dump-dse");
 static cl::opt<bool> DumpTL("int-dump-tl");
 static cl::list<std::string> ForceNoAliasArgs("int-force-noalias-arg", cl::ZeroOrMore);
 static cl::list<std::string> VarAllocators("int-allocator-fn", cl::ZeroOrMore);
 static cl::list<std::string> ConstAllocators("int-allocator-fn-const", cl::ZeroOrMore);
+// fn,arenaArg,sizeArg[,releaseFn,releaseArenaArg]: fn carves objects from the arena its
+// arenaArg points to, and releaseFn (if given) releases all of them at once.
+static cl::list<std::string> ArenaAllocators("int-arena-allocator-fn", cl::ZeroOrMore);
+// Allocators, already known through the options above or as malloc or calloc, that abort
+// rather than return null (xmalloc and the like): tests of what they return need no checks.
+static cl::list<std::string> NeverFailingAllocators("int-allocator-never-fails", cl::ZeroOrMore);
 static cl::opt<bool> VerbosePathConditions("int-verbose-path-conditions");
+// Count check failures per site at runtime, much more cheaply than printing them;
+// the counts are written at exit to $LLPE_CHECK_FAILURES, or stderr.
+static cl::opt<bool> CountCheckFailures("int-count-check-failures");
 static cl::opt<std::string> LLIOPreludeFn("int-prelude-fn", cl::init(""));
 static cl::opt<int> LLIOPreludeStackIdx("int-prelude-stackidx", cl::init(-1));
+// Emit no lliowd_init call at all: the first lliowd_ok check makes the handshake itself,
+// so runs that never reach a file-dependent check never talk to the daemon.
+static cl::opt<bool> LLIOLazyInit("int-lazy-lliowd-init");
 static cl::opt<std::string> LLIOConfFile("int-write-llio-conf", cl::init(""));
 static cl::opt<std::string> StatsFile("int-stats-file", cl::init(""));
+// Keep a JSON description of how far along the run is here, for watching long runs.
+static cl::opt<std::string> StatusFile("int-status-file", cl::init(""));
+static cl::opt<unsigned> StatusInterval("int-status-interval", cl::init(1000));
+// With the GUI, drop committed contexts' per-instruction values instead of keeping them
+// until exit (see releaseMemoryPostCommit).
+static cl::opt<bool> TrimCommitted("int-trim-committed");
 static cl::list<std::string> NeverInline("int-never-inline", cl::ZeroOrMore);
 static cl::opt<bool> SingleThreaded("int-single-threaded");
 static cl::opt<bool> OmitChecks("int-omit-checks");
@@ -111,6 +150,45 @@ static RegisterPass<LLPEAnalysisPass> X("llpe-analysis", "LLPE Analysis",
 						 false /* Only looks at CFG */,
 						 true /* Analysis Pass */);
 
+uint32_t llvm::PBMax = 16;
+// Function whose context is currently being analysed, for attributing set overflows.
+Function* llvm::PBMaxFunction = 0;
+
+void llvm::noteSetOverflow() {
+
+  ++GlobalIHP->stats.setOverflows;
+  if(PBMaxFunction)
+    ++GlobalIHP->stats.setOverflowsByFunction[PBMaxFunction];
+
+}
+
+void llvm::noteSetWidening() {
+
+  ++GlobalIHP->stats.setWidenings;
+
+}
+
+static uint64_t mixStructuralId(uint64_t H, uint64_t V) {
+
+  // FNV-1a over V's bytes: stable across runs and hosts, unlike pointers or hash seeds.
+  for(uint32_t i = 0; i != 8; ++i) {
+    H ^= (V >> (i * 8)) & 0xff;
+    H *= 1099511628211ULL;
+  }
+  return H;
+
+}
+
+static uint64_t mixStructuralId(uint64_t H, StringRef S) {
+
+  for(StringRef::iterator it = S.begin(), itend = S.end(); it != itend; ++it) {
+    H ^= (uint8_t)*it;
+    H *= 1099511628211ULL;
+  }
+  return H;
+
+}
+
 InlineAttempt::InlineAttempt(LLPEAnalysisPass* Pass, Function& F, 
 			     ShadowInstruction* _CI, int depth,
 			     bool pathCond) : 
@@ -121,6 +199,7 @@ InlineAttempt::InlineAttempt(LLPEAnalysisPass* Pass, Function& F,
   Pass->IAs.push_back(this);
 
   sharing = 0;
+  sharingKey = 0;
   enabled = true;
   isModel = false;
   isPathCondition = pathCond;
@@ -135,8 +214,13 @@ InlineAttempt::InlineAttempt(LLPEAnalysisPass* Pass, Function& F,
   integrationGoodnessValid = false;
   backupTlStore = 0;
   backupDSEStore = 0;
+  readsUnknown = true;
   isStackTop = false;
-  DT = pass->DTs[&F];
+  overContextTimeBudget = false;
+  analysisTime = 0;
+  analysisResumed = 0;
+  varargTablesBuilt = false;
+  DT = pass->getDT(F);
   if(_CI) {
     Callers.push_back(_CI);
     uniqueParent = _CI->parent->IA;
@@ -145,6 +229,13 @@ InlineAttempt::InlineAttempt(LLPEAnalysisPass* Pass, Function& F,
     uniqueParent = 0;
   }
 
+  // Path condition models share their notional call site, so the function name is mixed in too.
+  structuralId = mixStructuralId(_CI ? _CI->parent->IA->structuralId : 14695981039346656037ULL, F.getName());
+  if(_CI) {
+    structuralId = mixStructuralId(structuralId, _CI->parent->invar->idx);
+    structuralId = mixStructuralId(structuralId, _CI->invar->idx);
+  }
+
   prepareShadows();
 
 }
@@ -159,13 +250,15 @@ PeelIteration::PeelIteration(LLPEAnalysisPass* Pass, IntegrationAttempt* P, Peel
 { 
   SeqNumber = Pass->IAs.size();
   Pass->IAs.push_back(this);
+  structuralId = mixStructuralId(mixStructuralId(P->structuralId, PP->L->headerIdx), iter);
   prepareShadows();
 }
 
 PeelAttempt::PeelAttempt(LLPEAnalysisPass* Pass, IntegrationAttempt* P, Function& _F, 
 			 const ShadowLoopInvar* _L, int depth) 
   : pass(Pass), parent(P), F(_F), residualInstructions(-1), nesting_depth(depth), stack_depth(0), 
-    enabled(true), L(_L), totalIntegrationGoodness(0), integrationGoodnessValid(false)
+    enabled(true), L(_L), totalIntegrationGoodness(0), integrationGoodnessValid(false), peelCost(0),
+    overBudget(false)
 {
 
   SeqNumber = Pass->IAs.size();
@@ -175,6 +268,45 @@ PeelAttempt::PeelAttempt(LLPEAnalysisPass* Pass, IntegrationAttempt* P, Function
 
 }
 
+// Free SI's value and drop any global side-table entries keyed on it, so that a later
+// instruction allocated at the same address doesn't inherit them. Tracked stores and
+// allocations may outlive SI in DSE maps; flagging them committed stops DSE from touching SI.
+static void releaseInstruction(ShadowInstruction* SI) {
+
+  LLPEAnalysisPass* pass = GlobalIHP;
+
+  if(SI->i.PB) {
+    releaseHeapSlot(SI);
+    deleteIV(SI->i.PB);
+  }
+
+  {
+    DenseMap<ShadowInstruction*, TrackedStore*>::iterator findit = pass->trackedStores.find(SI);
+    if(findit != pass->trackedStores.end()) {
+      findit->second->isCommitted = true;
+      pass->trackedStores.erase(findit);
+    }
+  }
+
+  {
+    DenseMap<ShadowInstruction*, TrackedAlloc*>::iterator findit = pass->trackedAllocs.find(SI);
+    if(findit != pass->trackedAllocs.end()) {
+      findit->second->isCommitted = true;
+      pass->trackedAllocs.erase(findit);
+    }
+  }
+
+  pass->indirectDIEUsers.erase(SI);
+  pass->memcpyValues.erase(SI);
+  pass->forwardableOpenCalls.erase(SI);
+  pass->resolvedReadCalls.erase(SI);
+  pass->resolvedSeekCalls.erase(SI);
+  pass->seekFixups.erase(SI);
+  pass->callSeekFixups.erase(SI);
+  pass->optimisticForwardStatus.erase(SI);
+
+}
+
 IntegrationAttempt::~IntegrationAttempt() {
 
   // !BBs indicates we've already been cleaned up (but not deallocated yet).
@@ -197,14 +329,11 @@ IntegrationAttempt::~IntegrationAttempt() {
 
       ShadowBB* BB = BBs[i];
 
-      for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
-
-	if(BB->insts[j].i.PB)
-	  deleteIV(BB->insts[j].i.PB);
-
-      }
+      for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j)
+	releaseInstruction(&BB->insts[j]);
 
-      delete BB;
+      // Storage is reclaimed along with BBAllocator.
+      BB->~ShadowBB();
 
     }
 
@@ -228,6 +357,9 @@ InlineAttempt::~InlineAttempt() {
 
   delete[] &(argShadows[0]);
 
+  if(DT)
+    pass->releaseDT(F);
+
 }
 
 void InlineAttempt::dropReferenceFrom(ShadowInstruction* SI) {
@@ -279,6 +411,7 @@ static void mainPhaseProgress() {
 
     errs() << ".";
     mainPhaseProgressN = 0;
+    noteProgress();
 
   }
 
@@ -331,7 +464,7 @@ bool IntegrationAttempt::edgeIsDead(ShadowBBInvar* BB1I, ShadowBBInvar* BB2I) {
 
 }
 
-bool IntegrationAttempt::edgeIsDeadRising(ShadowBBInvar& BB1I, ShadowBBInvar& BB2I, bool ignoreThisScope) {
+bool IntegrationAttempt::edgeIsDeadRisingUncached(ShadowBBInvar& BB1I, ShadowBBInvar& BB2I, bool ignoreThisScope) {
 
   if((!ignoreThisScope) && edgeIsDead(&BB1I, &BB2I))
     return true;
@@ -360,7 +493,7 @@ bool IntegrationAttempt::edgeIsDeadRising(ShadowBBInvar& BB1I, ShadowBBInvar& BB
 
 }
 
-bool IntegrationAttempt::blockIsDeadRising(ShadowBBInvar& BBI) {
+bool IntegrationAttempt::blockIsDeadRisingUncached(ShadowBBInvar& BBI) {
 
   if(getBB(BBI))
     return false;
@@ -389,13 +522,98 @@ bool IntegrationAttempt::blockIsDeadRising(ShadowBBInvar& BBI) {
 
 }
 
+bool IntegrationAttempt::edgeIsDeadRising(ShadowBBInvar& BB1I, ShadowBBInvar& BB2I, bool ignoreThisScope) {
+
+  uint64_t Key = (((uint64_t)BB1I.idx) << 33) | (((uint64_t)BB2I.idx) << 1) | (ignoreThisScope ? 1 : 0);
+
+  DenseMap<uint64_t, bool>::iterator findit = deadEdgeCache.find(Key);
+  if(findit != deadEdgeCache.end())
+    return findit->second;
+
+  bool dead = edgeIsDeadRisingUncached(BB1I, BB2I, ignoreThisScope);
+  deadEdgeCache[Key] = dead;
+  return dead;
+
+}
+
+bool IntegrationAttempt::blockIsDeadRising(ShadowBBInvar& BBI) {
+
+  uint32_t Idx = BBI.idx - BBsOffset;
+  if(BBI.idx < BBsOffset || Idx >= nBBs)
+    return blockIsDeadRisingUncached(BBI);
+
+  if(deadBlockKnown.empty()) {
+    deadBlockKnown.resize(nBBs);
+    deadBlockCache.resize(nBBs);
+  }
+  else if(deadBlockKnown.test(Idx))
+    return deadBlockCache.test(Idx);
+
+  bool dead = blockIsDeadRisingUncached(BBI);
+  deadBlockKnown.set(Idx);
+  if(dead)
+    deadBlockCache.set(Idx);
+  return dead;
+
+}
+
+// Something changed the blocks, edges or iterations that this context's liveness answers
+// are drawn from. The rising queries look down through peeled loops but not into calls,
+// so the contexts that may have cached answers depending on this one are this and its
+// enclosing loop iterations, up to the function root.
+void IntegrationAttempt::livenessChanged() {
+
+  for(IntegrationAttempt* IA = this;; IA = IA->getUniqueParent()) {
+
+    // Emptied rather than reset, so this is cheap when called for every block status change.
+    IA->deadEdgeCache.clear();
+    IA->deadBlockKnown.clear();
+    IA->deadBlockCache.clear();
+
+    if(IA == IA->getFunctionRoot())
+      break;
+
+  }
+
+}
+
+static bool peelHeaderLess(PeelAttempt* A, PeelAttempt* B) {
+
+  return A->L->headerIdx < B->L->headerIdx;
+
+}
+
+// peelChildren is keyed by pointer, so its order varies from run to run. Walks whose order
+// shows in the output, such as those deciding commit and splitting, use this instead.
+void IntegrationAttempt::getOrderedPeelChildren(SmallVectorImpl<PeelAttempt*>& Out) {
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it)
+    Out.push_back(it->second);
+
+  std::sort(Out.begin(), Out.end(), peelHeaderLess);
+
+}
+
+void ShadowBB::setSuccAlive(uint32_t i, bool alive) {
+
+  if(succsAlive[i] == alive)
+    return;
+
+  succsAlive[i] = alive;
+  IA->livenessChanged();
+
+}
+
 static const char* blacklistedFnNames[] = {
   
    "malloc" ,  "free" ,
+   "calloc" ,
    "realloc" ,  "ioctl" ,
    "gettimeofday" ,  "clock_gettime" ,
    "time" ,
    "open" ,  "read" ,
+   "pread" ,  "pread64" ,
    "llseek" ,  "lseek" ,
    "lseek64" ,  "close" ,
    "write" , 
@@ -433,6 +651,7 @@ static const char* blacklistedFnNames[] = {
    "sigprocmask" ,
    "unlink" ,
    "__getdents64" ,
+   "getdents64" ,
    "brk" ,
    "getpid" ,
    "kill" ,
@@ -500,6 +719,22 @@ bool IntegrationAttempt::shouldInlineFunction(ShadowInstruction* SI, Function* F
 
 }
 
+static bool contextBudgetExhausted(LLPEAnalysisPass* pass, ShadowBB* BB) {
+
+  if(MaxContexts == 0)
+    return false;
+
+  if(pass->IAs.size() > MaxContexts)
+    return true;
+
+  if(ColdContextShare < 100 && 
+     pass->IAs.size() > (((uint64_t)MaxContexts) * ColdContextShare) / 100)
+    return BB && isColdBlock(BB->invar->BB);
+
+  return false;
+
+}
+
 bool IntegrationAttempt::callCanExpand(ShadowInstruction* SI, InlineAttempt*& Result) {
 
   if(InlineAttempt* IA = getInlineAttempt(SI)) {
@@ -509,7 +744,10 @@ bool IntegrationAttempt::callCanExpand(ShadowInstruction* SI, InlineAttempt*& Re
 
   Result = 0;
   
-  if(MaxContexts != 0 && pass->IAs.size() > MaxContexts)
+  if(contextBudgetExhausted(pass, SI->parent))
+    return false;
+
+  if(pass->overMemoryBudget() || overTimeBudget(this))
     return false;
 
   Function* FCalled = getCalledFunction(SI);
@@ -542,6 +780,8 @@ bool IntegrationAttempt::callCanExpand(ShadowInstruction* SI, InlineAttempt*& Re
     return false;
   }
 
+  pass->materialiseFunction(*FCalled);
+
   return true;
 
 }
@@ -633,8 +873,12 @@ void IntegrationAttempt::releaseMemoryPostCommit() {
   if(commitState == COMMIT_FREED)
     return;
 
+  noteReportContext(this);
+
   // For the time being, retain all data if the user will inspect it.
   if(IHPSaveDOTFiles) {
+    if(TrimCommitted)
+      trimPostCommit();
     commitState = COMMIT_FREED;
     return;
   }
@@ -671,35 +915,11 @@ void IntegrationAttempt::releaseMemoryPostCommit() {
 
       for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
 
-	ShadowInstruction* SI = &BB->insts[j];
-	if(SI->i.PB)
-	  deleteIV(SI->i.PB);
-
-	{
-	  DenseMap<ShadowInstruction*, TrackedStore*>::iterator findit = pass->trackedStores.find(SI);
-	  if(findit != pass->trackedStores.end()) {
-	    findit->second->isCommitted = true;
-	    pass->trackedStores.erase(findit);
-	  }
-	}
-
-	{
-	  DenseMap<ShadowInstruction*, TrackedAlloc*>::iterator findit = pass->trackedAllocs.find(SI);
-	  if(findit != pass->trackedAllocs.end()) {
-	    findit->second->isCommitted = true;
-	    pass->trackedAllocs.erase(findit);
-	  }
-	}
-
-	pass->indirectDIEUsers.erase(SI);
-	pass->memcpyValues.erase(SI);
-	pass->forwardableOpenCalls.erase(SI);
-	pass->resolvedReadCalls.erase(SI);
-	pass->resolvedSeekCalls.erase(SI);
+	releaseInstruction(&BB->insts[j]);
 
       }
 
-      delete BB;
+      BB->~ShadowBB();
       
     }
 
@@ -707,19 +927,78 @@ void IntegrationAttempt::releaseMemoryPostCommit() {
 
   delete[] BBs;
   BBs = 0;
+  BBAllocator.Reset();
+  deadEdgeCache.clear();
+  deadBlockKnown.clear();
+  deadBlockCache.clear();
+
+  // The dominator tree is only needed during analysis.
+  InlineAttempt* Root = getFunctionRoot();
+  if(Root == this && Root->DT) {
+    pass->releaseDT(F);
+    Root->DT = 0;
+  }
 
   commitState = COMMIT_FREED;
 
 }
 
+// The GUI needs a committed context's place in the tree, which is kept in its call
+// instructions, its statistics, which no longer change, and its DOT description, which
+// saveDOT wrote to the trace file before commit. Everything else, chiefly the values and
+// side-table entries of its instructions, can go, leaving a context little bigger than
+// its blocks' skeleton.
+void IntegrationAttempt::trimPostCommit() {
+
+  if(commitState == COMMIT_FREED)
+    return;
+
+  for(IAIterator it = child_calls_begin(this),
+	itend = child_calls_end(this); it != itend; ++it)
+    it->second->releaseMemoryPostCommit();
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it) {
+
+    for(uint32_t i = 0, ilim = it->second->Iterations.size(); i != ilim; ++i)
+      it->second->Iterations[i]->releaseMemoryPostCommit();
+
+  }
+
+  for(uint32_t i = BBsOffset, ilim = BBsOffset + nBBs; i != ilim; ++i) {
+
+    ShadowBB* BB = getBB(i);
+    if(!BB)
+      continue;
+
+    for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
+
+      releaseInstruction(&BB->insts[j]);
+      BB->insts[j].i.PB = 0;
+
+    }
+
+  }
+
+  InlineAttempt* Root = getFunctionRoot();
+  if(Root == this && Root->DT) {
+    pass->releaseDT(F);
+    Root->DT = 0;
+  }
+
+}
+
 void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
 
-  countTentativeInstructions();
-  collectStats();
+  // Count the instructions that need thread checks in the same walk.
+  collectStats(/* countTentative = */ true);
 	
   // This call will disable the context if it's not a good idea.
   findProfitableIntegration();
 
+  // Whether or not we're committed, a caller that isn't may need to know what we read.
+  summariseReads();
+
   if(isEnabled()) {
 
     // The TL and DSE stores were backed up to deal with the possibility
@@ -729,7 +1008,7 @@ void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
     // Create residual blocks for disabled loops
     prepareCommitCall();
 
-    if(!StatsFile.empty())
+    if(!StatsFile.empty() || reportEnabled())
       preCommitStats(true);
 
     // Note any tests that require failed blocks.
@@ -739,6 +1018,7 @@ void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
     findSaveSplits();
 
     runDIE();
+    pass->DIEBlockSplits.clear();
 
     // Save a DOT representation if need be, for the GUI to use.
     saveDOT();
@@ -759,6 +1039,21 @@ void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
     // committed without canonical value.
     markAllocationsAndFDsCommitted();
 
+    // The original call will run, needing the file positions it was entered with
+    // (see noteCallSeekFixups), and leaving them right for our caller to carry on from.
+    if(activeCaller && !inLoopAnalyser) {
+
+      if(pass->callSeekFixups.count(activeCaller))
+	activeCaller->parent->IA->noteVFSOp();
+
+      ShadowBB* CallerBB = activeCaller->parent;
+      for(uint32_t i = 0, ilim = CallerBB->fdStore ? CallerBB->fdStore->size() : 0; i != ilim; ++i) {
+	if(CallerBB->fdStore->getFD(i).seekPending)
+	  CallerBB->getWritableFDStore()->getWritableFD(i).seekPending = false;
+      }
+
+    }
+
     commitState = COMMIT_DONE;
 
     // Child contexts may have generated code that we no longer care
@@ -769,15 +1064,27 @@ void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
     // for the fact that the stage will not be committed.
     rerunTentativeLoads(activeCaller, this, inLoopAnalyser);
 
-    // For now this is simply a barrier to DSE.
-    setAllNeededTop(backupDSEStore);
-    backupDSEStore->dropReference();
-    if(activeCaller->parent->dseStore) {
-      activeCaller->parent->dseStore = activeCaller->parent->dseStore->getEmptyMap();
-      activeCaller->parent->dseStore->allOthersClobbered = true;
+    // The original code will run instead: stores it may read are needed, and the rest
+    // carry on from before the call. Without a summary this is a barrier to DSE.
+    if(!readsUnknown) {
+      setNeededForReads(backupDSEStore, readObjects);
+      if(activeCaller->parent->dseStore) {
+	activeCaller->parent->dseStore->dropReference();
+	activeCaller->parent->dseStore = backupDSEStore;
+      }
+      else
+	backupDSEStore->dropReference();
+    }
+    else {
+      setAllNeededTop(backupDSEStore);
+      backupDSEStore->dropReference();
+      if(activeCaller->parent->dseStore) {
+	activeCaller->parent->dseStore = activeCaller->parent->dseStore->getEmptyMap();
+	activeCaller->parent->dseStore->allOthersClobbered = true;
+      }
     }
 
-    if(!StatsFile.empty())
+    if(!StatsFile.empty() || reportEnabled())
       preCommitStats(true);
 
   }
@@ -807,17 +1114,25 @@ bool IntegrationAttempt::analyseExpandableCall(ShadowInstruction* SI, bool& chan
       // to justify sharing the function node.
       IA->active = true;
 
+      noteCallSeekFixups(SI);
+
       changed |= IA->analyseWithArgs(SI, inLoopAnalyser, inAnyLoop, stack_depth);
       readsTentativeData |= IA->readsTentativeData;
       containsCheckedReads |= IA->containsCheckedReads;
       
+      // An invoked context's unwinding stops at our landing pad, which resumes it if need be.
+      bool couldUnwind = mayUnwind;
       inheritDiagnosticsFrom(IA);
+      if(inst_is<InvokeInst>(SI))
+	mayUnwind = couldUnwind;
       mergeChildDependencies(IA);
 
       if(created && !IA->isUnsharable())
 	pass->addSharableFunction(IA);
       else if(IA->registeredSharable && IA->isUnsharable())
 	pass->removeSharableFunction(IA);
+      else if(IA->registeredSharable)
+	pass->refreshSharableFunction(IA);
      
       IA->active = false;
 
@@ -847,6 +1162,8 @@ bool IntegrationAttempt::analyseExpandableCall(ShadowInstruction* SI, bool& chan
     }
     else {
 
+      // A shared context's code can't carry this path's pending seeks.
+      flushAllSeeks(SI);
       IA->executeCall(stack_depth);
 
     }
@@ -861,7 +1178,7 @@ void PeelIteration::dropExitingStoreRef(uint32_t fromIdx, uint32_t toIdx) {
 
   ShadowBB* BB = getBB(fromIdx);
   ShadowBBInvar* toBBI = getBBInvar(toIdx);
-  if(BB && (!edgeIsDead(BB->invar, toBBI)) && !shouldIgnoreEdge(BB->invar, toBBI)) {
+  if(BB && (!BB->exitStoresFolded) && (!edgeIsDead(BB->invar, toBBI)) && !shouldIgnoreEdge(BB->invar, toBBI)) {
 
     if(BB->invar->naturalScope != L) {
 
@@ -934,6 +1251,97 @@ void PeelAttempt::dropNonterminatedStoreRefs() {
 
 }
 
+// Return true if BB has exactly one live edge leaving this loop, setting Target to its destination.
+bool PeelIteration::getUniqueExitEdge(ShadowBB* BB, uint32_t& Target) {
+
+  uint32_t exitingEdges = 0;
+
+  for(uint32_t i = 0, ilim = BB->invar->succIdxs.size(); i != ilim; ++i) {
+
+    if(!BB->succsAlive[i])
+      continue;
+
+    ShadowBBInvar* SuccBBI = getBBInvar(BB->invar->succIdxs[i]);
+    if(SuccBBI->naturalScope && L->contains(SuccBBI->naturalScope))
+      continue;
+
+    if(shouldIgnoreEdge(BB->invar, SuccBBI))
+      return false;
+
+    ++exitingEdges;
+    Target = BB->invar->succIdxs[i];
+
+  }
+
+  return exitingEdges == 1;
+
+}
+
+// Each iteration's exiting blocks hold a store reference per live exit edge, which would
+// otherwise stay alive until the exit blocks are analysed after the whole loop. Where a block
+// exits to the same place in iterations iter - 1 and iter, merge the earlier store into the
+// later one now, as the exit block would, and mark the earlier block so store mergers skip it.
+// The caller must already have entered iteration iter + 1, so that iter's latch store has been
+// handed on and the exit edge owns the only remaining reference to each store merged here.
+// Only the ordinary and FD stores are folded: the TL and DSE stores are recomputed by later
+// passes that walk every iteration again.
+void PeelAttempt::foldExitingStores(uint32_t iter) {
+
+  PeelIteration* FromPI = Iterations[iter - 1];
+  PeelIteration* ToPI = Iterations[iter];
+
+  for(std::vector<uint32_t>::const_iterator it = L->exitingBlocks.begin(),
+	itend = L->exitingBlocks.end(); it != itend; ++it) {
+
+    ShadowBBInvar* BBI = ToPI->getBBInvar(*it);
+
+    // Exits from a child loop leave from each of its iterations; leave those alone.
+    if(BBI->naturalScope != L)
+      continue;
+
+    ShadowBB* FromBB = FromPI->getBB(*BBI);
+    ShadowBB* ToBB = ToPI->getBB(*BBI);
+    if((!FromBB) || (!ToBB) || FromBB->exitStoresFolded)
+      continue;
+
+    uint32_t FromTarget, ToTarget;
+    if((!FromPI->getUniqueExitEdge(FromBB, FromTarget)) ||
+       (!ToPI->getUniqueExitEdge(ToBB, ToTarget)) ||
+       FromTarget != ToTarget)
+      continue;
+
+    ShadowBBInvar* TargetBBI = ToPI->getBBInvar(ToTarget);
+    ShadowBB* TargetBB = ToPI->getIAForScope(TargetBBI->naturalScope)->getBB(*TargetBBI);
+
+    OrdinaryMerger V(ToPI, TargetBB && TargetBB->useSpecialVarargMerge);
+    V.visit(FromBB, 0, false);
+    V.visit(ToBB, 0, false);
+    V.doMerge();
+    ToBB->localStore = V.newMap;
+
+    FDStoreMerger V2;
+    V2.visit(FromBB, 0, false);
+    V2.visit(ToBB, 0, false);
+    V2.doMerge();
+    ToBB->fdStore = V2.newStore;
+
+    FromBB->exitStoresFolded = true;
+
+  }
+
+}
+
+void PeelIteration::clearFoldedExitStores() {
+
+  for(uint32_t i = 0; i != nBBs; ++i) {
+
+    if(BBs[i])
+      BBs[i]->exitStoresFolded = false;
+
+  }
+
+}
+
 void PeelIteration::checkFinalIteration() {
 
   // Check whether we now have evidence the loop terminates this time around
@@ -945,6 +1353,7 @@ void PeelIteration::checkFinalIteration() {
   if(edgeIsDead(LatchBB, HeaderBB) || pass->assumeEndsAfter(&F, getBBInvar(L->headerIdx)->BB, iterationCount)) {
 
     iterStatus = IterationStatusFinal;
+    parent->livenessChanged();
 
   }
 
@@ -975,11 +1384,28 @@ PeelIteration* PeelAttempt::getOrCreateIteration(unsigned iter) {
 
   PeelIteration* NewIter = new PeelIteration(pass, parent, this, F, iter, nesting_depth);
   Iterations.push_back(NewIter);
+  parent->livenessChanged();
     
   return NewIter;
 
 }
 
+// The instructions analysed in this iteration, charged against -int-peel-budget.
+uint64_t PeelIteration::getPeelCost() {
+
+  uint64_t cost = 0;
+
+  for(uint32_t i = 0; i != nBBs; ++i) {
+
+    if(BBs[i])
+      cost += BBs[i]->insts.size();
+
+  }
+
+  return cost;
+
+}
+
 PeelIteration* PeelIteration::getNextIteration() {
 
   return parentPA->getIteration(this->iterationCount + 1);
@@ -1003,11 +1429,147 @@ bool PeelIteration::allExitEdgesDead() {
 
 }
 
+// Content hashes of value sets and stores, for -int-peel-cycle-detection. Two equal states
+// always hash alike; a collision only stops peeling early, leaving a loop to the general
+// analysis as -int-summarise-loops-after would, so no equality check backs them up.
+
+static hash_code hashIV(ImprovedValSet* IV);
+
+static hash_code hashIVS(const ImprovedValSetSingle& IVS) {
+
+  if(IVS.Overdef)
+    return hash_combine((int)IVS.SetType, true);
+
+  // The values are a set: combine them without regard to order.
+  size_t valsHash = 0;
+  for(SmallVector<ImprovedVal, 1>::const_iterator it = IVS.Values.begin(), itend = IVS.Values.end(); it != itend; ++it)
+    valsHash ^= hash_combine(DenseMapInfo<ShadowValue>::getHashValue(it->V), it->Offset);
+
+  return hash_combine((int)IVS.SetType, IVS.Values.size(), valsHash);
+
+}
+
+static hash_code hashIV(ImprovedValSet* IV) {
+
+  if(!IV)
+    return hash_value(0);
+
+  if(ImprovedValSetSingle* IVS = dyn_cast<ImprovedValSetSingle>(IV))
+    return hashIVS(*IVS);
+
+  ImprovedValSetMulti* IVM = cast<ImprovedValSetMulti>(IV);
+  hash_code H = hash_value(IVM->AllocSize);
+  for(ImprovedValSetMulti::ConstMapIt it = IVM->Map.begin(), itend = IVM->Map.end(); it != itend; ++it)
+    H = hash_combine(H, it.start(), it.stop(), hashIVS(it.value()));
+
+  return hash_combine(H, hashIV(IVM->Underlying));
+
+}
+
+static hash_code hashHeapNode(SharedTreeNode<LocStore, OrdinaryStoreExtraState>* Node, uint32_t height) {
+
+  hash_code H = hash_value(Node->childMask);
+
+  for(uint32_t slot = 0, slotlim = Node->getNumChildren(); slot != slotlim; ++slot) {
+
+    if(height == 0)
+      H = hash_combine(H, hashIV(((LocStore*)Node->children[slot])->store));
+    else
+      H = hash_combine(H, hashHeapNode((SharedTreeNode<LocStore, OrdinaryStoreExtraState>*)Node->children[slot], height - 1));
+
+  }
+
+  return H;
+
+}
+
+static hash_code hashStore(OrdinaryLocalStore* Store) {
+
+  hash_code H = hash_combine(Store->allOthersClobbered, Store->heap.height);
+  if(Store->heap.root)
+    H = hash_combine(H, hashHeapNode(Store->heap.root, Store->heap.height - 1));
+
+  for(uint32_t i = 0, ilim = Store->frames.size(); i != ilim; ++i) {
+
+    SharedStoreMap<LocStore, OrdinaryStoreExtraState>* Frame = Store->frames[i];
+    if(!Frame)
+      continue;
+
+    H = hash_combine(H, i, Frame->size());
+    for(uint32_t j = 0, jlim = Frame->size(); j != jlim; ++j) {
+      if(LocStore* LS = Frame->getValidSlot(j))
+	H = hash_combine(H, j, hashIV(LS->store));
+    }
+
+  }
+
+  return H;
+
+}
+
+static hash_code hashFDStore(FDStore* Store) {
+
+  hash_code H = hash_value(Store->size());
+  for(uint32_t i = 0, ilim = Store->size(); i != ilim; ++i) {
+    const FDState& FD = Store->getFD(i);
+    H = hash_combine(H, FD.filename, FD.pos, FD.clean, FD.seekPending);
+  }
+
+  return H;
+
+}
+
+// Fingerprint the state this iteration hands to the next: the values its latch passes to
+// the header PHIs, and the latch's store and FD state. If two iterations hand on the same
+// state, every iteration after the first would repeat the span between them.
+uint64_t PeelIteration::getCarriedStateHash() {
+
+  ShadowBB* LatchBB = getBB(parentPA->L->latchIdx);
+  ShadowBB* HeaderBB = getBB(parentPA->L->headerIdx);
+  BasicBlock* LatchBlock = LatchBB->invar->BB;
+
+  hash_code H = hashStore(LatchBB->localStore);
+  if(LatchBB->fdStore)
+    H = hash_combine(H, hashFDStore(LatchBB->fdStore));
+
+  for(uint32_t i = 0, ilim = HeaderBB->insts.size(); i != ilim; ++i) {
+
+    ShadowInstruction* SI = &HeaderBB->insts[i];
+    PHINode* PN = dyn_cast_inst<PHINode>(SI);
+    if(!PN)
+      break;
+
+    int predIdx = PN->getBasicBlockIndex(LatchBlock);
+    ShadowInstIdx& SII = SI->invar->operandIdxs[predIdx];
+    // Values from outside the loop are the same in every iteration.
+    if(SII.blockIdx == INVALID_BLOCK_IDX)
+      continue;
+
+    ImprovedValSet* IV = 0;
+    std::pair<ValSetType, ImprovedVal> Single;
+    getIVOrSingleVal(ShadowValue(getInst(SII.blockIdx, SII.instIdx)), IV, Single);
+    if(IV)
+      H = hash_combine(H, hashIV(IV));
+    else
+      H = hash_combine(H, (int)Single.first, DenseMapInfo<ShadowValue>::getHashValue(Single.second.V), Single.second.Offset);
+
+  }
+
+  return (uint64_t)(size_t)H;
+
+}
+
 PeelIteration* PeelIteration::getOrCreateNextIteration() {
 
-  if(PeelIteration* Existing = getNextIteration())
+  if(PeelIteration* Existing = getNextIteration()) {
+
+    // Re-analysing: note this iteration's state afresh for the iterations still to come.
+    if(PeelCycleDetection && !edgeIsDead(getBBInvar(parentPA->L->latchIdx), getBBInvar(parentPA->L->headerIdx)))
+      parentPA->carriedStates[getCarriedStateHash()] = iterationCount;
     return Existing;
 
+  }
+
   if(iterStatus == IterationStatusFinal) {
     LPDEBUG("Loop known to exit: will not create next iteration\n");
     return 0;
@@ -1042,22 +1604,48 @@ PeelIteration* PeelIteration::getOrCreateNextIteration() {
     return 0;
       
   }
-  /*
-  else if(iterationCount > 1000) {
+  else if(SummariseLoopsAfter != 0 && iterationCount + 1 >= SummariseLoopsAfter) {
 
-    LPDEBUG("Won't peel loop " << getLName() << ": max iterations 1000\n");
+    // Rather than peel a long-running loop one context per iteration, leave it
+    // unterminated: the caller then analyses it once to a fixed point and keeps
+    // a residual loop, whose store effects summarise every remaining iteration.
+    LPDEBUG("Won't peel loop " << getLName() << ": summarising after " << SummariseLoopsAfter << " iterations\n");
+    if(iterStatus != IterationStatusNonFinal)
+      ++pass->stats.summarisedLoops;
+    iterStatus = IterationStatusNonFinal;
+    parent->livenessChanged();
     return 0;
 
   }
-  */
 
-  //errs() << "Peel loop " << getLName() << "\n";
+  else if(PeelCycleDetection) {
 
-  iterStatus = IterationStatusNonFinal;
-  LPDEBUG("Loop known to iterate: creating next iteration\n");
-  return parentPA->getOrCreateIteration(this->iterationCount + 1);
+    std::pair<DenseMap<uint64_t, uint32_t>::iterator, bool> Ins = 
+      parentPA->carriedStates.insert(std::make_pair(getCarriedStateHash(), iterationCount));
 
-}
+    if(!Ins.second) {
+
+      // Handing on a state already seen: peeling would go round the same iterations
+      // for ever, so stop here and keep a residual loop, as when summarising.
+      LPDEBUG("Won't peel loop " << getLName() << ": iteration " << iterationCount << " repeats the state after iteration " << Ins.first->second << "\n");
+      if(iterStatus != IterationStatusNonFinal)
+	++pass->stats.cycledLoops;
+      iterStatus = IterationStatusNonFinal;
+      parent->livenessChanged();
+      return 0;
+
+    }
+
+  }
+
+  //errs() << "Peel loop " << getLName() << "\n";
+
+  iterStatus = IterationStatusNonFinal;
+  parent->livenessChanged();
+  LPDEBUG("Loop known to iterate: creating next iteration\n");
+  return parentPA->getOrCreateIteration(this->iterationCount + 1);
+
+}
 
 PeelAttempt* IntegrationAttempt::getPeelAttempt(const ShadowLoopInvar* L) {
 
@@ -1077,12 +1665,16 @@ PeelAttempt* IntegrationAttempt::getOrCreatePeelAttempt(const ShadowLoopInvar* N
   if(PeelAttempt* PA = getPeelAttempt(NewL))
     return PA;
 
-  if(MaxContexts != 0 && pass->IAs.size() > MaxContexts)
-    return 0;
- 
   // Preheaders only have one successor (the header), so this is enough.
   
   ShadowBB* preheaderBB = getBB(NewL->preheaderIdx);
+
+  if(contextBudgetExhausted(pass, preheaderBB))
+    return 0;
+
+  if(pass->overMemoryBudget() || overTimeBudget(this))
+    return 0;
+ 
   if(!blockAssumedToExecute(preheaderBB)) {
    
     LPDEBUG("Will not expand loop " << getBBInvar(NewL->headerIdx)->BB->getName() << " because the preheader is not certain/assumed to execute\n");
@@ -1093,6 +1685,7 @@ PeelAttempt* IntegrationAttempt::getOrCreatePeelAttempt(const ShadowLoopInvar* N
   LPDEBUG("Inlining loop with header " << getBBInvar(NewL->headerIdx)->BB->getName() << "\n");
   PeelAttempt* LPA = new PeelAttempt(pass, this, F, NewL, nesting_depth + 1);
   peelChildren[NewL] = LPA;
+  livenessChanged();
 
   return LPA;
 
@@ -1156,15 +1749,15 @@ bool InlineAttempt::isRootMainCall() {
 
 bool llvm::isGlobalIdentifiedObject(ShadowValue V) {
   
-  switch(V.t) {
+  switch(V.getValType()) {
   case SHADOWVAL_PTRIDX:
     return true;
   case SHADOWVAL_ARG:
-    return V.u.A->IA->isRootMainCall();
+    return V.getArg()->IA->isRootMainCall();
   case SHADOWVAL_GV:
     return true;
   case SHADOWVAL_OTHER:
-    return isIdentifiedObject(V.u.V);
+    return isIdentifiedObject(V.getVal());
   case SHADOWVAL_CI8:
   case SHADOWVAL_CI16:
   case SHADOWVAL_CI32:
@@ -1454,10 +2047,117 @@ IntegratorTag* PeelAttempt::createTag(IntegratorTag* parent) {
 
 }
 
+static uint64_t getResidentBytes() {
+
+  int fd = open("/proc/self/statm", O_RDONLY);
+  if(fd == -1)
+    return 0;
+
+  char buf[128];
+  int nread = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if(nread <= 0)
+    return 0;
+  buf[nread] = '\0';
+
+  // Fields are total size then resident size, in pages.
+  unsigned long long totalPages, residentPages;
+  if(sscanf(buf, "%llu %llu", &totalPages, &residentPages) != 2)
+    return 0;
+
+  return ((uint64_t)residentPages) * sysconf(_SC_PAGESIZE);
+
+}
+
+// Once over budget we stop creating contexts, as -int-stop-after does, and commit
+// whatever has been explored. Reading the RSS costs a syscall, so only sample it
+// every so often.
+// The globals that other threads may have written by the time lock call SI returns: those
+// given for the call itself with -int-lock-domain, or else those guarded by the mutex it
+// takes, when that is a known global named with -int-mutex-domain. Null if the call isn't
+// confined to a domain, in which case it must be taken to expose every shared object.
+std::vector<GlobalVariable*>* LLPEAnalysisPass::getLockDomain(ShadowInstruction* SI) {
+
+  CallInst* CI = dyn_cast_inst<CallInst>(SI);
+  if(!CI)
+    return 0;
+
+  SmallDenseMap<CallInst*, std::vector<GlobalVariable*>, 4>::iterator findit = lockDomains.find(CI);
+  if(findit != lockDomains.end())
+    return &findit->second;
+
+  if(mutexDomains.empty() || !SI->getNumArgOperands())
+    return 0;
+
+  std::pair<ValSetType, ImprovedVal> Mutex;
+  if((!tryGetUniqueIV(SI->getCallArgOperand(0), Mutex)) || Mutex.first != ValSetTypePB)
+    return 0;
+
+  ShadowGV* MutexGV = Mutex.second.V.getGV();
+  if(!MutexGV)
+    return 0;
+
+  DenseMap<GlobalVariable*, std::vector<GlobalVariable*> >::iterator mutexit = mutexDomains.find(MutexGV->G);
+  if(mutexit == mutexDomains.end())
+    return 0;
+
+  return &mutexit->second;
+
+}
+
+bool LLPEAnalysisPass::overMemoryBudget() {
+
+  if(MemoryBudgetMB == 0)
+    return false;
+
+  if(memoryBudgetExceeded)
+    return true;
+
+  if((memoryBudgetQueries++ % 256) != 0)
+    return false;
+
+  uint64_t resident = getResidentBytes();
+  if(resident > ((uint64_t)MemoryBudgetMB) * 1024 * 1024) {
+
+    errs() << "Memory budget of " << MemoryBudgetMB << "MB exceeded (" << (resident / (1024 * 1024)) << "MB resident): no further contexts will be explored\n";
+    memoryBudgetExceeded = true;
+
+  }
+
+  return memoryBudgetExceeded;
+
+}
+
+uint64_t IntegrationAttempt::getShadowMemoryUsage(uint32_t& nValueSets) {
+
+  nValueSets = 0;
+  if(!BBs)
+    return 0;
+
+  for(uint32_t i = 0; i < nBBs; ++i) {
+
+    if(!BBs[i])
+      continue;
+
+    for(uint32_t j = 0, jlim = BBs[i]->insts.size(); j != jlim; ++j) {
+      if(BBs[i]->insts[j].i.PB)
+	++nValueSets;
+    }
+
+  }
+
+  return BBAllocator.getTotalMemory() + (nBBs * sizeof(ShadowBB*));
+
+}
+
 void IntegrationAttempt::dumpMemoryUsage(int indent) {
 
+  uint32_t nValueSets;
+  uint64_t shadowBytes = getShadowMemoryUsage(nValueSets);
+
   errs() << ind(indent);
   describeBrief(errs());
+  errs() << ": " << shadowBytes << " bytes of shadows, " << nValueSets << " value sets\n";
 
   for(IAIterator II = child_calls_begin(this), IE = child_calls_end(this); II != IE; II++) {
     II->second->dumpMemoryUsage(indent+2);
@@ -1509,38 +2209,126 @@ std::string PeelAttempt::getShortHeader() {
 
 }
 
-IntegratorTag* llvm::searchFunctions(IntegratorTag* thisTag, std::string& search, IntegratorTag*& startAt) {
+ContextSearchIndex::ContextSearchIndex(IntegratorTag* Root) {
 
-  if(startAt == thisTag) {
-    
-    startAt = 0;
+  addTag(Root);
+
+}
+
+void ContextSearchIndex::addTag(IntegratorTag* Tag) {
+
+  if(Tag->type == IntegratorTypeIA) {
+
+    IntegrationAttempt* IA = (IntegrationAttempt*)Tag->ptr;
+    uint32_t Pos = Order.size();
+    Order.push_back(Tag);
+    Positions[Tag] = Pos;
+    ByFunction[IA->F.getName()].push_back(Pos);
 
   }
-  else if(!startAt) {
-    
-    if(thisTag->type == IntegratorTypeIA) {
 
-      IntegrationAttempt* IA = (IntegrationAttempt*)thisTag->ptr;
+  for(std::vector<IntegratorTag*>::iterator it = Tag->children.begin(), 
+	itend = Tag->children.end(); it != itend; ++it)
+    addTag(*it);
 
-      if(IA->getShortHeader().find(search) != std::string::npos) {
-      
-	return thisTag;
+}
+
+// A query is a list of space-separated terms, all of which a context must match:
+//
+//   residual>N      more than N instructions left after specialisation
+//   instructions>N  more than N instructions in all
+//   checks          has checked instructions of its own
+//   anything else   a substring of the specialised function's name
+void ContextSearchIndex::runQuery(const std::string& Query) {
+
+  std::vector<std::string> Names;
+  int64_t minResidual = -1, minTotal = -1;
+  bool needChecks = false;
+
+  SmallVector<StringRef, 4> Terms;
+  StringRef(Query).split(Terms, " ", -1, false);
+
+  for(SmallVector<StringRef, 4>::iterator it = Terms.begin(), itend = Terms.end(); it != itend; ++it) {
+
+    StringRef Term = *it;
+    if(Term.startswith("residual>") && !Term.substr(9).getAsInteger(10, minResidual))
+      continue;
+    if(Term.startswith("instructions>") && !Term.substr(13).getAsInteger(10, minTotal))
+      continue;
+    if(Term == "checks") {
+      needChecks = true;
+      continue;
+    }
+    Names.push_back(Term.str());
+
+  }
+
+  LastMatches.clear();
+
+  for(StringMap<std::vector<uint32_t> >::iterator it = ByFunction.begin(), itend = ByFunction.end(); it != itend; ++it) {
+
+    bool nameMatches = true;
+    for(std::vector<std::string>::iterator nameit = Names.begin(), nameend = Names.end(); nameit != nameend && nameMatches; ++nameit)
+      nameMatches = it->first().find(*nameit) != StringRef::npos;
+
+    if(!nameMatches)
+      continue;
+
+    for(std::vector<uint32_t>::iterator posit = it->second.begin(), posend = it->second.end(); posit != posend; ++posit) {
+
+      IntegrationAttempt* IA = (IntegrationAttempt*)Order[*posit]->ptr;
+
+      if(needChecks && !IA->checkedInstructionsHere)
+	continue;
+
+      if(minResidual != -1 || minTotal != -1) {
+
+	if(!IA->isEnabled())
+	  continue;
+	int64_t Total = IA->getTotalInstructions();
+	if(minTotal != -1 && Total <= minTotal)
+	  continue;
+	if(minResidual != -1 && Total - (int64_t)IA->getElimdInstructions() <= minResidual)
+	  continue;
 
       }
 
+      LastMatches.push_back(*posit);
+
     }
 
   }
 
-  for(std::vector<IntegratorTag*>::iterator it = thisTag->children.begin(), 
-	itend = thisTag->children.end(); it != itend; ++it) {
+  std::sort(LastMatches.begin(), LastMatches.end());
+  LastQuery = Query;
+
+}
+
+IntegratorTag* ContextSearchIndex::findNext(const std::string& Query, IntegratorTag* After) {
+
+  if(Query.empty())
+    return 0;
+
+  if(Query != LastQuery)
+    runQuery(Query);
+
+  std::vector<uint32_t>::iterator it;
+  if(!After)
+    it = LastMatches.begin();
+  else {
 
-    if(IntegratorTag* SubRes = searchFunctions(*it, search, startAt))
-      return SubRes;
+    DenseMap<IntegratorTag*, uint32_t>::iterator findit = Positions.find(After);
+    if(findit == Positions.end())
+      it = LastMatches.begin();
+    else
+      it = std::upper_bound(LastMatches.begin(), LastMatches.end(), findit->second);
 
   }
 
-  return 0;
+  if(it == LastMatches.end())
+    return 0;
+
+  return Order[*it];
 
 }
 
@@ -1758,6 +2546,22 @@ Constant* llvm::constFromBytes(unsigned char* Bytes, Type* Ty, const DataLayout*
 
 }
 
+// As constFromBytes, but integers that fit a ShadowValue are returned inline
+// rather than as ConstantInts, which the LLVMContext would keep forever.
+ShadowValue llvm::shadowValFromBytes(unsigned char* Bytes, Type* Ty, const DataLayout* TD) {
+
+  if(Ty->isIntegerTy(8) || Ty->isIntegerTy(16) || Ty->isIntegerTy(32) || Ty->isIntegerTy(64)) {
+
+    uint64_t IntVal = 0;
+    memcpy(&IntVal, Bytes, TD->getTypeStoreSize(Ty));
+    return ShadowValue::getInt(Ty, IntVal);
+
+  }
+
+  return ShadowValue(constFromBytes(Bytes, Ty, TD));
+
+}
+
 void LLPEAnalysisPass::print(raw_ostream &OS, const Module* M) const {
   RootIA->print(OS);
 }
@@ -1800,198 +2604,490 @@ namespace llvm {
 
 }
 
-static bool getFileSha1(std::string& Filename, unsigned char* hash) {
+bool llvm::getFileSha1(std::string& Filename, unsigned char* hash) {
 
-  SHA_CTX hashctx;
-  if(!SHA1_Init(&hashctx)) {
+  std::string errors;
+  CachedFile* CF = getCachedFile(Filename, errors);
+  if(!CF) {
 
-    errs() << "SHA1_Init\n";
+    errs() << errors << "\n";
     return false;
 
   }
-	
-  int filefd = open(Filename.c_str(), O_RDONLY);
-  if(filefd == -1) {
-	  
-    errs() << "Cannot open " << Filename << "\n";
-    return false;
+
+  if(!CF->hashed) {
+
+    StringRef data = CF->contents->getBuffer();
+    if(!SHA1((const unsigned char*)data.data(), data.size(), CF->sha1)) {
+
+      errs() << "SHA1 failed for " << Filename << "\n";
+      return false;
+
+    }
+
+    CF->hashed = true;
+
+  }
+
+  memcpy(hash, CF->sha1, SHA_DIGEST_LENGTH);
+  return true;
+
+}
+
+static time_t getFileMtime(std::string& filename) {
+
+  struct stat st;
+  int ret = ::stat(filename.c_str(), &st);
+  if(ret == -1) {
+
+    errs() << "Failed to stat " << filename << "\n";
+    return 0;
+
+  }
+
+  return st.st_mtime;
+  
+}
+
+void LLPEAnalysisPass::writeLliowdConfig() {
+
+  raw_ostream* Outp;
+  std::unique_ptr<raw_fd_ostream> Fdp;
+
+  if(llioConfigFile.empty()) {
+
+    errs() << "No config file specified, writing to stdout\n";
+    Outp = &outs();
+
+  }
+  else {
+
+    std::error_code openerror;
+    Fdp.reset(new raw_fd_ostream(llioConfigFile.c_str(), openerror, sys::fs::F_None));
+    if(openerror) {
+
+      errs() << "Failed to open " << llioConfigFile << ", using stdout: " << openerror.message() << "\n";
+      Fdp.reset();
+      Outp = &outs();
+
+    }
+    else {
+
+      Outp = Fdp.get();
+
+    }
+
+  }
+
+  raw_ostream& Out = *Outp;
+
+  // Hash the dependent files in parallel. Loading them touches the shared file cache,
+  // so do that first on this thread; each hash then only writes its own CachedFile.
+  std::vector<CachedFile*> toHash;
+  for(std::vector<std::string>::iterator it = llioDependentFiles.begin(),
+	itend = llioDependentFiles.end(); it != itend; ++it) {
+
+    std::string errors;
+    CachedFile* CF = getCachedFile(*it, errors);
+    if(CF && !CF->hashed)
+      toHash.push_back(CF);
+
+  }
+
+  parallelFor(toHash.size(), [&](uint32_t i) {
+
+      StringRef data = toHash[i]->contents->getBuffer();
+      if(SHA1((const unsigned char*)data.data(), data.size(), toHash[i]->sha1))
+	toHash[i]->hashed = true;
+
+    });
+
+  for(std::vector<std::string>::iterator it = llioDependentFiles.begin(),
+	itend = llioDependentFiles.end(); it != itend; ++it) {
+
+    SmallVector<char, 256> relPath;
+    for(unsigned i = 0, ilim = it->size(); i != ilim; ++i)
+      relPath.push_back((*it)[i]);
+
+    llvm::sys::fs::make_absolute(relPath);
+
+    StringRef printPath(relPath.data(), relPath.size());
+
+    Out << "\t" << printPath << " " << getFileMtime(*it) << " ";
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+
+    if(getFileSha1(*it, hash)) {
+
+      for(int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+
+	if(hash[i]/16 == 0)
+	  Out << '0';
+	Out.write_hex(hash[i]);
+
+      }
+
+      Out << "\n";
+
+    }
+
+  }
+
+}
+
+void LLPEAnalysisPass::commit() {
+
+  PhaseTimer Timer(PhaseCommit);
+
+  if(!(omitChecks || llioDependentFiles.empty())) {
+
+    writeLliowdConfig();
+
+    BasicBlock* preludeBlock = 0;
+
+    if(llioPreludeStackIdx == -1) {
+
+      Function* writePreludeFn = llioPreludeFn;
+      if(llioPreludeFn == &RootIA->F)
+	writePreludeFn = RootIA->CommitF;
+
+      if(writePreludeFn)
+	preludeBlock = &writePreludeFn->getEntryBlock();
+
+    }
+
+    // Add an lliowd_init() prelude to the beginning of the requested function:
+    if(preludeBlock) {
+
+      BasicBlock::iterator it = preludeBlock->begin();
+      while(it != preludeBlock->end() && isa<AllocaInst>(it))
+	++it;
+
+      Type* Void = Type::getVoidTy(preludeBlock->getContext());
+      Constant* WDInit = getGlobalModule()->getOrInsertFunction("lliowd_init", Void, NULL);
+      CallInst::Create(WDInit, ArrayRef<Value*>(), "", it);
+
+    }
+
+  }
+
+  emitCheckFailureTable();
+
+  foldFormatStrings();
+  mergeIdenticalFunctions();
+  shareResidualFunctions(*getGlobalModule());
+  splitCommitFunctions.clear();
+
+  if(!StatsFile.empty() || reportEnabled())
+    postCommitStats();
+
+  if(!StatsFile.empty()) {
+
+    std::error_code error;
+    raw_fd_ostream RFO(StatsFile.c_str(), error, sys::fs::F_None);
+    if(error)
+      errs() << "Failed to open " << StatsFile << ": " << error.message() << "\n";
+    else
+      stats.print(RFO);
+
+    // The same figures for scripts, with the per-function breakdown as both JSON and a table.
+    std::string jsonFile = StatsFile + ".json";
+    raw_fd_ostream JFO(jsonFile.c_str(), error, sys::fs::F_None);
+    if(error)
+      errs() << "Failed to open " << jsonFile << ": " << error.message() << "\n";
+    else
+      stats.printJSON(JFO);
+
+    std::string csvFile = StatsFile + ".functions.csv";
+    raw_fd_ostream CFO(csvFile.c_str(), error, sys::fs::F_None);
+    if(error)
+      errs() << "Failed to open " << csvFile << ": " << error.message() << "\n";
+    else
+      stats.printFunctionCSV(CFO);
+
+  }
+
+  // Saving to the cache is the last thing commit does, and isn't worth separating out:
+  // write the phase profile now.
+  if(!StatsFile.empty()) {
+
+    std::string profileFile = StatsFile + ".phases.json";
+    std::error_code error;
+    raw_fd_ostream RFO(profileFile.c_str(), error, sys::fs::F_None);
+    if(error)
+      errs() << "Failed to open " << profileFile << ": " << error.message() << "\n";
+    else
+      writePhaseProfile(RFO);
 
   }
-	
-  char readbuf[4096];
-  int thisread;
 
-  while((thisread = read(filefd, readbuf, 4096)) > 0) {
+  if(!VariantName.empty()) {
 
-    if(!SHA1_Update(&hashctx, readbuf, thisread)) {
+    commitAsVariant(*getGlobalModule());
 
-      errs() << "SHA1_Update\n";
-      return false;
+  }
+  else if(guardOriginal) {
 
-    }
+    commitGuardedClone(*getGlobalModule());
 
   }
+  else {
 
-  if(thisread == -1) {
+    RootIA->F.replaceAllUsesWith(RootIA->CommitF);
 
-    errs() << "Read failed for " << Filename << "\n";
-    close(filefd);
-    return false;
+    // Also exchange names so that external users will use this new version:
+    std::string oldFName;
+    {
+      raw_string_ostream RSO(oldFName);
+      RSO << RootIA->F.getName() << ".old";
+    }
+
+    RootIA->CommitF->takeName(&(RootIA->F));
+    RootIA->F.setName(oldFName);
 
   }
 
-  if(!SHA1_Final(hash, &hashctx)) {
+  saveToCache(*getGlobalModule());
+  writePartitionedOutput(*getGlobalModule());
+  writeReport();
 
-    errs() << "SHA1_Final\n";
-    close(filefd);
-    return false;;
+  finishStatusFile();
 
-  }
+  errs() << "\n";
 
-  close(filefd);
-  return true;
+  finishServedJob();
 
 }
 
-static time_t getFileMtime(std::string& filename) {
+void LLPEAnalysisPass::noteInputDefinitions(Module& M) {
 
-  struct stat st;
-  int ret = ::stat(filename.c_str(), &st);
-  if(ret == -1) {
+  for(Module::iterator it = M.begin(), itend = M.end(); it != itend; ++it) {
+    if(it->hasName() && !it->isDeclaration())
+      inputDefinitions.push_back(it->getName().str());
+  }
 
-    errs() << "Failed to stat " << filename << "\n";
-    return 0;
+  for(Module::global_iterator it = M.global_begin(), itend = M.global_end(); it != itend; ++it) {
+    if(it->hasName() && !it->isDeclaration())
+      inputDefinitions.push_back(it->getName().str());
+  }
 
+  for(Module::alias_iterator it = M.alias_begin(), itend = M.alias_end(); it != itend; ++it) {
+    if(it->hasName())
+      inputDefinitions.push_back(it->getName().str());
   }
 
-  return st.st_mtime;
-  
 }
 
-void LLPEAnalysisPass::writeLliowdConfig() {
+// With -int-variant-name the root is left alone and the specialisation is committed
+// under the given name, and every named definition the input module had becomes a
+// declaration. What remains is just this variant's code, which can be linked with the
+// input and with other variants specialised from it (see scripts/llpe-batch.py). Local
+// definitions are made hidden externals, which only link if the input was externalised
+// the same way; unnamed ones can't be referred to from outside, so they keep their copy.
+void LLPEAnalysisPass::commitAsVariant(Module& M) {
+
+  Function* CommitF = RootIA->CommitF;
+  CommitF->setName(VariantName);
+  if(CommitF->getName() != VariantName) {
+    errs() << "-int-variant-name: " << VariantName << " is already defined\n";
+    exit(1);
+  }
 
-  raw_ostream* Outp;
-  std::unique_ptr<raw_fd_ostream> Fdp;
+  CommitF->setLinkage(GlobalValue::ExternalLinkage);
 
-  if(llioConfigFile.empty()) {
+  for(std::vector<std::string>::iterator it = inputDefinitions.begin(),
+	itend = inputDefinitions.end(); it != itend; ++it) {
 
-    errs() << "No config file specified, writing to stdout\n";
-    Outp = &outs();
+    GlobalValue* GV = M.getNamedValue(*it);
+    if((!GV) || GV->isDeclaration())
+      continue;
 
-  }
-  else {
+    if(GlobalAlias* GA = dyn_cast<GlobalAlias>(GV)) {
 
-    std::error_code openerror;
-    Fdp.reset(new raw_fd_ostream(llioConfigFile.c_str(), openerror, sys::fs::F_None));
-    if(openerror) {
+      // Aliases can't be declarations: use a declaration of the same type instead.
+      GlobalValue* Decl;
+      if(FunctionType* FT = dyn_cast<FunctionType>(GA->getType()->getElementType()))
+	Decl = Function::Create(FT, GlobalValue::ExternalLinkage, "", &M);
+      else
+	Decl = new GlobalVariable(M, GA->getType()->getElementType(), false, GlobalValue::ExternalLinkage, 0, "");
 
-      errs() << "Failed to open " << llioConfigFile << ", using stdout: " << openerror.message() << "\n";
-      Fdp.reset();
-      Outp = &outs();
+      GA->replaceAllUsesWith(Decl);
+      Decl->takeName(GA);
+      GA->eraseFromParent();
+      GV = Decl;
+
+    }
+    else if(Function* F = dyn_cast<Function>(GV)) {
+
+      F->deleteBody();
 
     }
     else {
 
-      Outp = Fdp.get();
+      cast<GlobalVariable>(GV)->setInitializer(0);
 
     }
 
+    if(GV->hasLocalLinkage())
+      GV->setVisibility(GlobalValue::HiddenVisibility);
+    GV->setLinkage(GlobalValue::ExternalLinkage);
+
   }
 
-  raw_ostream& Out = *Outp;
+}
 
-  for(std::vector<std::string>::iterator it = llioDependentFiles.begin(),
-	itend = llioDependentFiles.end(); it != itend; ++it) {
+// With -int-guarded-clone the specialisation is kept beside an untouched copy of the
+// root, and a new function taking the root's name and uses checks once, at entry, that
+// the live argc, argv, environment and (if the specialisation read files) lliowd agree
+// with what was assumed, calling the specialisation if so and the copy otherwise. Those
+// facts needn't be checked again inside the specialisation, and the original code need
+// not be reachable from it. lliowd is still checked at each read, since files may change
+// while the program runs. Ignored with -int-variant-name.
+void LLPEAnalysisPass::prepareGuardedClone(Function& F) {
 
-    SmallVector<char, 256> relPath;
-    for(unsigned i = 0, ilim = it->size(); i != ilim; ++i)
-      relPath.push_back((*it)[i]);
+  if((!GuardedClone) || !VariantName.empty())
+    return;
 
-    llvm::sys::fs::make_absolute(relPath);
+  ValueToValueMapTy VMap;
+  guardOriginal = CloneFunction(&F, VMap, false);
+  guardOriginal->setLinkage(GlobalValue::InternalLinkage);
+  F.getParent()->getFunctionList().push_back(guardOriginal);
+  guardOriginal->setName(F.getName() + ".llpe.orig");
 
-    StringRef printPath(relPath.data(), relPath.size());
+}
 
-    Out << "\t" << printPath << " " << getFileMtime(*it) << " ";
+static Value* getGuardString(const std::string& Str, Module& M) {
 
-    unsigned char hash[SHA_DIGEST_LENGTH];
+  std::string Bytes = Str;
+  GlobalVariable* G = getStringArray(Bytes, M, true);
+  Constant* Zero = ConstantInt::get(Type::getInt64Ty(M.getContext()), 0);
+  Constant* Idxs[2] = { Zero, Zero };
+  return ConstantExpr::getGetElementPtr(G, Idxs, 2);
 
-    if(getFileSha1(*it, hash)) {
+}
 
-      for(int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+// Load Array[Idx], a char*, in BB.
+static Value* loadGuardEntry(Value* Array, uint64_t Idx, BasicBlock* BB) {
 
-	if(hash[i]/16 == 0)
-	  Out << '0';
-	Out.write_hex(hash[i]);
+  Constant* IdxC = ConstantInt::get(Type::getInt64Ty(BB->getContext()), Idx);
+  Instruction* Ptr = GetElementPtrInst::Create(Array, IdxC, "", BB);
+  return new LoadInst(Ptr, "", BB);
 
-      }
+}
 
-      Out << "\n";
+namespace {
+
+  // Builds the guard as a chain of tests, each failing to Slow.
+  struct GuardBuilder {
 
+    Function* Guard;
+    BasicBlock* Cur;
+    BasicBlock* Slow;
+
+    GuardBuilder(Function* G, BasicBlock* S) : Guard(G), Slow(S) {
+      Cur = BasicBlock::Create(G->getContext(), "guard", G);
     }
 
-  }
+    void require(Value* Cond) {
+      BasicBlock* Next = BasicBlock::Create(Guard->getContext(), "guard", Guard);
+      BranchInst::Create(Next, Slow, Cond, Cur);
+      Cur = Next;
+    }
+
+  };
 
 }
 
-void LLPEAnalysisPass::commit() {
+void LLPEAnalysisPass::commitGuardedClone(Module& M) {
 
-  if(!(omitChecks || llioDependentFiles.empty())) {
+  Function& F = RootIA->F;
+  Function* Spec = RootIA->CommitF;
+  LLVMContext& Ctx = M.getContext();
+  Type* Int32 = Type::getInt32Ty(Ctx);
+  Type* BytePtr = Type::getInt8PtrTy(Ctx);
 
-    writeLliowdConfig();
+  std::string Name = F.getName();
+  F.setName(Name + ".old");
+  Spec->setName(Name + ".llpe.spec");
 
-    BasicBlock* preludeBlock = 0;
+  Function* Guard = Function::Create(F.getFunctionType(), F.getLinkage(), Name, &M);
+  Guard->copyAttributesFrom(&F);
+  F.replaceAllUsesWith(Guard);
 
-    if(llioPreludeStackIdx == -1) {
+  std::vector<Value*> Args;
+  for(Function::arg_iterator it = Guard->arg_begin(), itend = Guard->arg_end(); it != itend; ++it)
+    Args.push_back(it);
 
-      Function* writePreludeFn = llioPreludeFn;
-      if(llioPreludeFn == &RootIA->F)
-	writePreludeFn = RootIA->CommitF;
+  BasicBlock* Slow = BasicBlock::Create(Ctx, "slow");
+  GuardBuilder B(Guard, Slow);
 
-      if(writePreludeFn)
-	preludeBlock = &writePreludeFn->getEntryBlock();
+  Type* StrcmpArgTys[2] = { BytePtr, BytePtr };
+  FunctionType* StrcmpType = FunctionType::get(Int32, ArrayRef<Type*>(StrcmpArgTys, 2), false);
+  Constant* Strcmp = M.getOrInsertFunction("strcmp", StrcmpType);
 
-    }
+  if(guardArgcIdx != -1) {
 
-    // Add an lliowd_init() prelude to the beginning of the requested function:
-    if(preludeBlock) {
+    Value* Argc = Args[guardArgcIdx];
+    Constant* Expected = ConstantInt::get(Argc->getType(), guardArgv.size());
+    B.require(new ICmpInst(*B.Cur, CmpInst::ICMP_EQ, Argc, Expected, ""));
 
-      BasicBlock::iterator it = preludeBlock->begin();
-      while(it != preludeBlock->end() && isa<AllocaInst>(it))
-	++it;
+    for(uint32_t i = 0, ilim = guardArgv.size(); i != ilim; ++i) {
 
-      Type* Void = Type::getVoidTy(preludeBlock->getContext());
-      Constant* WDInit = getGlobalModule()->getOrInsertFunction("lliowd_init", Void, NULL);
-      CallInst::Create(WDInit, ArrayRef<Value*>(), "", it);
+      if(!guardArgv[i].first)
+	continue;
+
+      Value* Arg = loadGuardEntry(Args[guardArgvIdx], i, B.Cur);
+      Value* CmpArgs[2] = { Arg, getGuardString(guardArgv[i].second, M) };
+      CallInst* Cmp = CallInst::Create(Strcmp, ArrayRef<Value*>(CmpArgs, 2), "", B.Cur);
+      B.require(new ICmpInst(*B.Cur, CmpInst::ICMP_EQ, Cmp, Constant::getNullValue(Int32), ""));
 
     }
 
   }
 
-  if(!StatsFile.empty()) {
+  if(guardEnvIdx != -1) {
+
+    // The whole environment, in order, as the specialisation saw it.
+    Value* Envp = Args[guardEnvIdx];
+    for(uint32_t i = 0, ilim = guardEnv.size(); i != ilim; ++i) {
+
+      Value* Entry = loadGuardEntry(Envp, i, B.Cur);
+      B.require(new ICmpInst(*B.Cur, CmpInst::ICMP_NE, Entry, Constant::getNullValue(BytePtr), ""));
+      Value* CmpArgs[2] = { Entry, getGuardString(guardEnv[i], M) };
+      CallInst* Cmp = CallInst::Create(Strcmp, ArrayRef<Value*>(CmpArgs, 2), "", B.Cur);
+      B.require(new ICmpInst(*B.Cur, CmpInst::ICMP_EQ, Cmp, Constant::getNullValue(Int32), ""));
+
+    }
+
+    Value* End = loadGuardEntry(Envp, guardEnv.size(), B.Cur);
+    B.require(new ICmpInst(*B.Cur, CmpInst::ICMP_EQ, End, Constant::getNullValue(BytePtr), ""));
 
-    postCommitStats();
-    
-    std::error_code error;
-    raw_fd_ostream RFO(StatsFile.c_str(), error, sys::fs::F_None);
-    if(error)
-      errs() << "Failed to open " << StatsFile << ": " << error.message() << "\n";
-    else
-      stats.print(RFO);
   }
 
-  RootIA->F.replaceAllUsesWith(RootIA->CommitF);
+  if(!(omitChecks || llioDependentFiles.empty())) {
+
+    Constant* CheckFn = M.getOrInsertFunction("lliowd_ok", Int32, NULL);
+    CallInst* Check = CallInst::Create(CheckFn, ArrayRef<Value*>(), "", B.Cur);
+    B.require(new ICmpInst(*B.Cur, CmpInst::ICMP_NE, Check, Constant::getNullValue(Int32), ""));
 
-  // Also exchange names so that external users will use this new version:
-  std::string oldFName;
-  {
-    raw_string_ostream RSO(oldFName);
-    RSO << RootIA->F.getName() << ".old";
   }
 
-  RootIA->CommitF->takeName(&(RootIA->F));
-  RootIA->F.setName(oldFName);
+  Guard->getBasicBlockList().push_back(Slow);
 
-  errs() << "\n";
+  BasicBlock* Blocks[2] = { B.Cur, Slow };
+  Function* Targets[2] = { Spec, guardOriginal };
+  B.Cur->setName("fast");
+
+  for(uint32_t i = 0; i != 2; ++i) {
+
+    CallInst* Call = CallInst::Create(Targets[i], Args, "", Blocks[i]);
+    Call->setCallingConv(Targets[i]->getCallingConv());
+    if(Call->getType()->isVoidTy())
+      ReturnInst::Create(Ctx, Blocks[i]);
+    else
+      ReturnInst::Create(Ctx, Call, Blocks[i]);
+
+  }
 
 }
 
@@ -2037,6 +3133,13 @@ static bool parseIntCommaString(const std::string& str, long& idx, std::string&
 
 }
 
+// Block names are in the function's symbol table, so there is no need to walk the blocks.
+static BasicBlock* lookupBlock(Function* F, StringRef Name) {
+
+  return dyn_cast_or_null<BasicBlock>(F->getValueSymbolTable().lookup(Name));
+
+}
+
 static void parseFB(const char* paramName, const std::string& arg, Module& M, Function*& F, BasicBlock*& BB1) {
 
   std::string FName, BB1Name;
@@ -2055,16 +3158,7 @@ static void parseFB(const char* paramName, const std::string& arg, Module& M, Fu
     exit(1);
   }
 
-  BB1 = 0;
-
-  for(Function::iterator FI = F->begin(), FE = F->end(); FI != FE; ++FI) {
-
-    if(FI->getName() == BB1Name) {
-      BB1 = FI;
-      break;
-    }
-
-  }
+  BB1 = lookupBlock(F, BB1Name);
 
   if(!BB1) {
     errs() << "No such block " << BB1Name << " in " << FName << "\n";
@@ -2095,16 +3189,8 @@ static void parseFBB(const char* paramName, const std::string& arg, Module& M, F
     exit(1);
   }
 
-  BB1 = BB2 = 0;
-
-  for(Function::iterator FI = F->begin(), FE = F->end(); FI != FE; ++FI) {
-
-    if(FI->getName() == BB1Name)
-      BB1 = FI;
-    if(FI->getName() == BB2Name)
-      BB2 = FI;
-
-  }
+  BB1 = lookupBlock(F, BB1Name);
+  BB2 = lookupBlock(F, BB2Name);
 
   if(!BB1) {
     errs() << "No such block " << BB1Name << " in " << FName << "\n";
@@ -2139,14 +3225,7 @@ static void parseFBI(const char* paramName, const std::string& arg, Module& M, F
     exit(1);
   }
 
-  BB = 0;
-
-  for(Function::iterator FI = F->begin(), FE = F->end(); FI != FE; ++FI) {
-
-    if(FI->getName() == BBName)
-      BB = FI;
-
-  }
+  BB = lookupBlock(F, BBName);
 
   if(!BB) {
     errs() << "No such block " << BBName << " in " << FName << "\n";
@@ -2235,10 +3314,8 @@ uint32_t llvm::findBlock(ShadowFunctionInvar* SFI, BasicBlock* BB) {
 
 static BasicBlock* findBlockRaw(Function* F, std::string& name) {
 
-  for(Function::iterator FI = F->begin(), FE = F->end(); FI != FE; ++FI) {
-    if(((BasicBlock*)FI)->getName() == name)
-      return FI;
-  }
+  if(BasicBlock* BB = lookupBlock(F, name))
+    return BB;
 
   errs() << "Block " << name << " not found\n";
   exit(1);
@@ -2258,6 +3335,7 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
     CHECK_ARG(idx, argConstants);
     Constant* Env = loadEnvironment(*(F.getParent()), EnvFile);
+    guardEnvIdx = idx;
     argConstants[idx] = Env;
 
   }
@@ -2275,6 +3353,8 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
     unsigned argc;
     loadArgv(&F, ArgvFile, argvIdx, argc);
+    guardArgcIdx = argcIdx;
+    guardArgvIdx = argvIdx;
     CHECK_ARG(argcIdx, argConstants);
     argConstants[argcIdx] = ConstantInt::get(Type::getInt32Ty(F.getContext()), argc);
     argvIdxOut = argvIdx;
@@ -2311,7 +3391,23 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
       Type* StrTy = Type::getInt8PtrTy(F.getContext());
       Type* ElemTy = ArgTyP->getElementType();
       
-      if(ArgTyP == StrTy) {
+      if(Param.size() > 1 && Param[0] == '@') {
+
+	// A pointer to a known global, e.g. a library's configuration object.
+	GlobalVariable* GV = F.getParent()->getGlobalVariable(Param.substr(1), true);
+	if(!GV) {
+
+	  errs() << "Couldn't find a global named " << Param.substr(1) << "\n";
+	  exit(1);
+
+	}
+	ensureGlobalAllocation(GV);
+
+	CHECK_ARG(idx, argConstants);
+	argConstants[idx] = ConstantExpr::getBitCast(GV, ArgTy);
+
+      }
+      else if(ArgTyP == StrTy) {
 
 	Constant* Str = ConstantDataArray::getString(F.getContext(), Param);
 	Constant* GStr = new GlobalVariable(Str->getType(), true, GlobalValue::InternalLinkage, Str, "specstr");
@@ -2346,10 +3442,16 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 	CHECK_ARG(idx, argConstants);
 	argConstants[idx] = Found;
 
+      }
+      else if(Param == "0") {
+
+	CHECK_ARG(idx, argConstants);
+	argConstants[idx] = Constant::getNullValue(ArgTyP);
+
       }
       else {
 
-	errs() << "Setting pointers other than char* not supported yet\n";
+	errs() << "Pointers other than char* and function pointers must be 0 or name a global (@name)\n";
 	exit(1);
 
       }
@@ -2464,6 +3566,37 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   }
 
+  this->defaultMaxSetSize = MaxSetSize;
+  PBMax = MaxSetSize;
+
+  for(cl::list<std::string>::const_iterator ArgI = MaxSetSizeFunctions.begin(), ArgE = MaxSetSizeFunctions.end(); ArgI != ArgE; ++ArgI) {
+
+    size_t comma = ArgI->rfind(',');
+    if(comma == std::string::npos) {
+      errs() << "--int-max-set-size-fn must have the form fname,int\n";
+      exit(1);
+    }
+
+    std::string FName = ArgI->substr(0, comma);
+    std::string IStr = ArgI->substr(comma + 1);
+
+    Function* SizeF = F.getParent()->getFunction(FName);
+    if(!SizeF) {
+      errs() << "No such function " << FName << "\n";
+      exit(1);
+    }
+
+    char* IdxEndPtr;
+    long Size = strtol(IStr.c_str(), &IdxEndPtr, 10);
+    if(IdxEndPtr - IStr.c_str() != (int64_t)IStr.size() || Size <= 0) {
+      errs() << "Couldn't parse " << IStr << " as a positive integer\n";
+      exit(1);
+    }
+
+    maxSetSizes[SizeF] = (uint32_t)Size;
+
+  }
+
   for(cl::list<std::string>::const_iterator ArgI = SpecialLocations.begin(), ArgE = SpecialLocations.end(); ArgI != ArgE; ++ArgI) {
 
     std::istringstream istr(*ArgI);
@@ -2649,6 +3782,47 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 	exit(1);
 
       }
+      ensureGlobalAllocation(GV);
+      thisDomain.push_back(GV);
+
+    }
+
+  }
+
+  for(cl::list<std::string>::iterator it = MutexDomains.begin(),
+	itend = MutexDomains.end(); it != itend; ++it) {
+
+    std::istringstream istr(*it);
+    std::string mutexName;
+    std::getline(istr, mutexName, ',');
+
+    GlobalVariable* MutexGV = F.getParent()->getGlobalVariable(mutexName, true);
+    if(mutexName.empty() || istr.eof()) {
+      errs() << "int-mutex-domain: usage: mutex,global1,...,globaln\n";
+      exit(1);
+    }
+    if(!MutexGV) {
+      errs() << "Global not found: " << mutexName << "\n";
+      exit(1);
+    }
+    ensureGlobalAllocation(MutexGV);
+
+    std::vector<GlobalVariable*>& thisDomain = mutexDomains[MutexGV];
+
+    while(!istr.eof()) {
+
+      std::string thisGlobal;
+      std::getline(istr, thisGlobal, ',');
+      if(thisGlobal.empty())
+	continue;
+      GlobalVariable* GV = F.getParent()->getGlobalVariable(thisGlobal, true);
+      if(!GV) {
+
+	errs() << "Global not found: " << thisGlobal << "\n";
+	exit(1);
+
+      }
+      ensureGlobalAllocation(GV);
       thisDomain.push_back(GV);
 
     }
@@ -2726,6 +3900,50 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   }
 
+  for(cl::list<std::string>::iterator it = ArenaAllocators.begin(),
+	itend = ArenaAllocators.end(); it != itend; ++it) {
+
+    std::string fName, arenaIdxStr, sizeIdxStr, releaseName, releaseIdxStr;
+
+    std::istringstream istr(*it);
+    std::getline(istr, fName, ',');
+    std::getline(istr, arenaIdxStr, ',');
+    std::getline(istr, sizeIdxStr, ',');
+    std::getline(istr, releaseName, ',');
+    std::getline(istr, releaseIdxStr, ',');
+
+    Function* allocF = F.getParent()->getFunction(fName);
+    if(!allocF) {
+
+      errs() << "-int-arena-allocator-fn: must specify a function\n";
+      exit(1);
+
+    }
+
+    uint32_t arenaParam = getInteger(arenaIdxStr, "int-arena-allocator-fn second param");
+    uint32_t sizeParam = getInteger(sizeIdxStr, "int-arena-allocator-fn third param");
+
+    allocatorFunctions[allocF] = AllocatorFn::getArenaCarve(arenaParam, sizeParam);
+    SpecialFunctionMap[allocF] = SF_MALLOC;
+
+    if(!releaseName.empty()) {
+
+      Function* releaseF = F.getParent()->getFunction(releaseName);
+      if(!releaseF) {
+
+	errs() << "-int-arena-allocator-fn: bad release function " << releaseName << "\n";
+	exit(1);
+
+      }
+
+      uint32_t releaseArg = getInteger(releaseIdxStr, "int-arena-allocator-fn fifth param");
+      deallocatorFunctions[releaseF] = DeallocatorFn(releaseArg, /* releasesArena = */ true);
+      SpecialFunctionMap[releaseF] = SF_FREE;
+
+    }
+
+  }
+
   for(cl::list<std::string>::iterator it = ConstAllocators.begin(),
 	itend = ConstAllocators.end(); it != itend; ++it) {
 
@@ -2821,6 +4039,8 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   if(Function* libcMalloc = F.getParent()->getFunction("malloc"))
     allocatorFunctions[libcMalloc] = AllocatorFn::getVariableSize(0);
+  if(Function* libcCalloc = F.getParent()->getFunction("calloc"))
+    allocatorFunctions[libcCalloc] = AllocatorFn::getZeroedArray(0, 1);
   if(Function* libcFree = F.getParent()->getFunction("free"))
     deallocatorFunctions[libcFree] = DeallocatorFn(0);
   if(Function* libcRealloc = F.getParent()->getFunction("realloc")) {
@@ -2828,10 +4048,27 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
     reallocatorFunctions[libcRealloc] = ReallocatorFn(0, 1);
   }
 
+  for(cl::list<std::string>::iterator it = NeverFailingAllocators.begin(),
+	itend = NeverFailingAllocators.end(); it != itend; ++it) {
+
+    Function* allocF = F.getParent()->getFunction(*it);
+    SmallDenseMap<Function*, AllocatorFn, 4>::iterator findit = allocF ? allocatorFunctions.find(allocF) : allocatorFunctions.end();
+    if(findit == allocatorFunctions.end()) {
+
+      errs() << "-int-allocator-never-fails: " << *it << " is not an allocator function\n";
+      exit(1);
+
+    }
+
+    findit->second.neverFails = true;
+
+  }
+
   this->verboseOverdef = VerboseOverdef;
   this->enableSharing = EnableFunctionSharing;
   this->verboseSharing = VerboseFunctionSharing;
   this->verbosePCs = VerbosePathConditions;
+  this->countCheckFailures = CountCheckFailures;
   this->programSingleThreaded = SingleThreaded;
   this->useGlobalInitialisers = UseGlobalInitialisers;
   this->omitChecks = OmitChecks;
@@ -2859,6 +4096,13 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
   }
 
+  if(LLIOLazyInit) {
+
+    this->llioPreludeStackIdx = -1;
+    this->llioPreludeFn = 0;
+
+  }
+
   this->llioConfigFile = LLIOConfFile;
   this->emitFakeDebug = EmitFakeDebug;
 
@@ -2879,6 +4123,9 @@ unsigned LLPEAnalysisPass::getMallocAlignment() {
 
 }
 
+// These passes stay serial rather than using parallelFor: DSE and TL stores pass from a
+// call site into its callee and back, so no subtree is independent of its caller, and all
+// contexts share the global heap table and the IVS allocator.
 void LLPEAnalysisPass::runDSEAndDIE() {
 
   errs() << "Killing memory instructions";
@@ -2892,9 +4139,14 @@ void LLPEAnalysisPass::runDSEAndDIE() {
   errs() << "\nKilling other instructions";
   
   RootIA->runDIE();
+  DIEBlockSplits.clear();
   
   errs() << "\n";
 
+  // These results reflect every context's current enablement.
+  togglesSinceDIE.clear();
+  mustRecomputeDIE = false;
+
 }
 
 static Type* getIntTypeAtOffset(Type* Ty, uint64_t Offset) {
@@ -2952,6 +4204,7 @@ int64_t LLPEAnalysisPass::parsePCInst(BasicBlock* bb, Module* M, std::string& in
       exit(1);
 
     }
+    ensureGlobalAllocation(GV);
     return (int64_t)getShadowGlobalIndex(GV);
   }
   else
@@ -3122,6 +4375,8 @@ void LLPEAnalysisPass::parsePathConditions(cl::list<std::string>& L, PathConditi
 	  errs() << "No such global value: " << assumeStr << "\n";
 	  exit(1);
 	}
+	if(GlobalVariable* GV = dyn_cast<GlobalVariable>(assumeC))
+	  ensureGlobalAllocation(GV);
 
 	if(Offset != 0) {
 	  
@@ -3201,8 +4456,9 @@ static bool getAllocSitesFrom(Value* V, std::vector<Value*>& sites, DenseSet<Val
   }
   else if(Argument* A = dyn_cast<Argument>(V)) {
 
+    // Callers whose bodies haven't been read yet aren't among F's uses.
     Function* F = A->getParent();
-    if(F->hasAddressTaken(0)) {
+    if(F->hasAddressTaken(0) || GlobalIHP->lazyModule) {
 
       sites.clear();
       return false;
@@ -3587,17 +4843,39 @@ char llvm::ihp_workdir[] = "/tmp/ihp_XXXXXX";
 
 bool LLPEAnalysisPass::runOnModule(Module& M) {
 
+  // Each served job's worker carries on from here, with its own working directory.
+  serveJobs();
+
   if(!mkdtemp(ihp_workdir)) {
     errs() << "Failed to create " << ihp_workdir << "\n";
     exit(1);
   }
 
+  // Before anything reads an option the files might set.
+  loadConfigFiles();
+
   TD = &getAnalysisIfAvailable<DataLayoutPass>()->getDataLayout();
   GlobalTD = TD;
   AA = &getAnalysis<AliasAnalysis>();
   GlobalAA = AA;
+  resetTypeStoreSizes();
   GlobalTLI = getAnalysisIfAvailable<TargetLibraryInfo>();
   GlobalIHP = this;
+
+  if(!StatsFile.empty())
+    enablePhaseProfile();
+  if(!StatusFile.empty())
+    enableStatusFile(StatusFile, StatusInterval);
+
+  for(Module::iterator it = M.begin(), itend = M.end(); it != itend && !lazyModule; ++it)
+    lazyModule = it->isMaterializable();
+
+  // Must hash the module before we start adding globals to it.
+  computeCacheKey(M);
+
+  if(!VariantName.empty())
+    noteInputDefinitions(M);
+
   GInt8Ptr = Type::getInt8PtrTy(M.getContext());
   GInt8 = Type::getInt8Ty(M.getContext());
   GInt16 = Type::getInt16Ty(M.getContext());
@@ -3608,16 +4886,6 @@ bool LLPEAnalysisPass::runOnModule(Module& M) {
 
   initMRInfo(&M);
   
-  for(Module::iterator MI = M.begin(), ME = M.end(); MI != ME; MI++) {
-
-    if(!MI->isDeclaration()) {
-      DominatorTree* NewDT = new DominatorTree();
-      NewDT->recalculate(*MI);
-      DTs[MI] = NewDT;
-    }
-
-  }
-
   Function* FoundF = M.getFunction(RootFunctionName);
   if((!FoundF) || FoundF->isDeclaration()) {
 
@@ -3627,6 +4895,7 @@ bool LLPEAnalysisPass::runOnModule(Module& M) {
   }
 
   Function& F = *FoundF;
+  materialiseFunction(F);
 
   // Mark realloc as an identified object if the function is defined:
   if(Function* Realloc = M.getFunction("realloc")) {
@@ -3639,13 +4908,21 @@ bool LLPEAnalysisPass::runOnModule(Module& M) {
 
   std::vector<Constant*> argConstants(F.arg_size(), 0);
   uint32_t argvIdx = 0xffffffff;
+  // Before parseArgs writes the assumed argv into the root's entry block:
+  prepareGuardedClone(F);
   parseArgs(F, argConstants, argvIdx);
 
-  populateGVCaches(&M);
+  if(tryLoadFromCache(M)) {
+    // The driver won't commit, so a served job's output has to be written now.
+    finishServedJob();
+    return true;
+  }
+
   initSpecialFunctionsMap(M);
   // Last parameter: reserve extra GV slots for the constants that path condition parsing will produce.
   initShadowGlobals(M, PathConditionsString.size());
   initBlacklistedFunctions(M);
+  initStringModels(M);
 
   InlineAttempt* IA = new InlineAttempt(this, F, 0, 0);
   if(targetCallStack.size()) {
@@ -3694,18 +4971,39 @@ bool LLPEAnalysisPass::runOnModule(Module& M) {
   RootIA = IA;
 
   errs() << "Interpreting";
-  IA->analyse();
-  IA->finaliseAndCommit(false);
-  fixNonLocalUses();
+  {
+    PhaseTimer Timer(PhaseInterpret);
+    startTimeBudget();
+    IA->analyse();
+    checkpoint("interpreted");
+    clearStoreMergeMemo();
+    clearLoadCaches();
+    IA->finaliseAndCommit(false);
+  }
+  // Analysis is done, so read the bodies it never reached: they are written out as they
+  // were, and commit's whole-module passes need complete use lists.
+  materialiseAllFunctions(M);
+  // Committed functions can't be streamed out as they are finished: this patches the
+  // placeholders they hold for allocations and FDs committed elsewhere, which are only
+  // all known now, and later callers may still share or call them.
+  {
+    PhaseTimer Timer(PhaseCommit);
+    fixNonLocalUses();
+  }
+  writeContextProfile();
   errs() << "\n";
   
   if(IHPSaveDOTFiles) {
 
+    closeDOTTrace();
+
     // Function sharing is now decided, and hence the graph structure, so create
     // graph tags for the GUI.
     rootTag = RootIA->createTag(0);
 
   }
+
+  checkpoint("analysed");
     
   return false;
 
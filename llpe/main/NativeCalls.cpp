@@ -0,0 +1,464 @@
+//===-- NativeCalls.cpp ---------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// -int-native-calls runs calls to self-contained functions natively instead of
+// interpreting them, when all of their inputs are known: a hash or checksum over a
+// known buffer, or a table builder, can otherwise take millions of interpreted steps.
+//
+// A function qualifies if neither it nor anything it calls touches memory other than its
+// own stack, constant globals and what its pointer arguments point to: no calls to
+// declared functions other than memory intrinsics and intrinsics that don't access
+// memory, no indirect calls, inline assembly, varargs or exception handling. At a call,
+// every integer argument must be known, and every pointer argument must be null or
+// point into a constant global or a thread-local object whose bytes are all known
+// scalars. Those objects are copied to native buffers and the function is run on them
+// by the NativeCallRunner; the call gets its integer result, and the bytes it changed in
+// objects its call summary says it may write (see CallSummaries.cpp) are written back to
+// the store. The call itself stays in the specialised program, which recomputes the
+// same result.
+//
+// LLPE doesn't link a JIT itself, since it is loaded into opt, so the runner comes from
+// a module loaded after it into the llpe tool (see native/NativeRunner.cpp):
+//
+//   llpe -load LLVMLLPEMain.so -load LLVMLLPEDriver.so -load LLVMLLPENative.so -int-native-calls ...
+//
+// The function runs in-process: one that doesn't terminate or crashes takes LLPE with it.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/Analysis/LLPECopyPaste.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+#include <stdlib.h>
+#include <string.h>
+
+using namespace llvm;
+
+static cl::opt<bool> NativeCalls("int-native-calls");
+static cl::opt<unsigned> NativeCallMaxBytes("int-native-call-max-bytes", cl::init(1 << 20));
+
+static LLPEStat NativeCallsRun("native_calls", "Calls run natively");
+static LLPEStat NativeCallBytesWritten("native_call_bytes_written", "Bytes written back by native calls");
+
+NativeCallRunner* llvm::GlobalNativeCallRunner = 0;
+
+namespace {
+
+// An object passed to a native call, and its native copy.
+struct NativeObject {
+
+  ShadowValue Base;
+  uint64_t Size;
+  unsigned char* Buf;
+  unsigned char* Orig;
+  bool isConstGlobal;
+  bool mayWrite;
+
+};
+
+}
+
+static bool isNativeIntrinsic(Function* F) {
+
+  switch(F->getIntrinsicID()) {
+  case Intrinsic::memcpy:
+  case Intrinsic::memmove:
+  case Intrinsic::memset:
+  case Intrinsic::lifetime_start:
+  case Intrinsic::lifetime_end:
+    return true;
+  default:
+    return F->doesNotAccessMemory();
+  }
+
+}
+
+// Constant operands may name globals inside constant expressions, and those globals'
+// initialisers must be plain data too, since the runner compiles them along with F.
+static bool isNativeConstant(Constant* C, SmallPtrSet<Constant*, 16>& Seen) {
+
+  if(!Seen.insert(C).second)
+    return true;
+
+  if(GlobalVariable* GV = dyn_cast<GlobalVariable>(C)) {
+    if(!(GV->isConstant() && GV->hasDefinitiveInitializer()))
+      return false;
+    return isNativeConstant(GV->getInitializer(), Seen);
+  }
+
+  if(isa<GlobalValue>(C))
+    return false;
+
+  for(User::op_iterator it = C->op_begin(), itend = C->op_end(); it != itend; ++it) {
+    if(!isNativeConstant(cast<Constant>(*it), Seen))
+      return false;
+  }
+
+  return true;
+
+}
+
+// Check F's own body, queueing the defined functions it calls.
+static bool isNativeBody(Function* F, SmallVector<Function*, 8>& Worklist) {
+
+  if(F->isDeclaration() || F->isMaterializable() || F->mayBeOverridden() || F->isVarArg())
+    return false;
+
+  if(functionIsBlacklisted(F) || SpecialFunctionMap.count(F) || GlobalIHP->specialLocations.count(F) ||
+     GlobalIHP->allocatorFunctions.count(F) || GlobalIHP->yieldFunctions.count(F))
+    return false;
+
+  SmallPtrSet<Constant*, 16> Seen;
+
+  for(Function::iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+
+    for(BasicBlock::iterator II = BI->begin(), IE = BI->end(); II != IE; ++II) {
+
+      Instruction* I = II;
+
+      if(isa<InvokeInst>(I) || isa<LandingPadInst>(I) || isa<ResumeInst>(I) || isa<VAArgInst>(I))
+	return false;
+
+      Function* Callee = 0;
+
+      if(CallInst* CI = dyn_cast<CallInst>(I)) {
+
+	if(CI->isInlineAsm())
+	  return false;
+
+	Callee = CI->getCalledFunction();
+	if(!Callee)
+	  return false;
+
+	if(Callee->isIntrinsic()) {
+	  if(!isNativeIntrinsic(Callee))
+	    return false;
+	}
+	else
+	  Worklist.push_back(Callee);
+
+      }
+
+      for(User::op_iterator it = I->op_begin(), itend = I->op_end(); it != itend; ++it) {
+
+	// Function addresses are only allowed as the callee.
+	if(*it == Callee)
+	  continue;
+
+	if(Constant* C = dyn_cast<Constant>(*it)) {
+	  if(!isNativeConstant(C, Seen))
+	    return false;
+	}
+
+      }
+
+    }
+
+  }
+
+  return true;
+
+}
+
+bool LLPEAnalysisPass::isNativeFunction(Function* F) {
+
+  DenseMap<Function*, bool>::iterator findit = nativeFunctions.find(F);
+  if(findit != nativeFunctions.end())
+    return findit->second;
+
+  // F qualifies if everything it reaches does, recursion included.
+  bool ok = true;
+  SmallPtrSet<Function*, 16> Visited;
+  SmallVector<Function*, 8> Worklist;
+  Worklist.push_back(F);
+
+  while(ok && !Worklist.empty()) {
+
+    Function* G = Worklist.pop_back_val();
+    if(!Visited.insert(G).second)
+      continue;
+
+    DenseMap<Function*, bool>::iterator knownit = nativeFunctions.find(G);
+    if(knownit != nativeFunctions.end())
+      ok = knownit->second;
+    else
+      ok = isNativeBody(G, Worklist);
+
+  }
+
+  // A summary is needed to know which arguments' objects to write back.
+  if(ok) {
+    const CallModSummary* S = getCallModSummary(F);
+    ok = S && S->writesGlobals.empty();
+  }
+
+  nativeFunctions[F] = ok;
+  return ok;
+
+}
+
+static bool isNativeType(Type* Ty) {
+
+  if(Ty->isPointerTy())
+    return true;
+  if(IntegerType* IT = dyn_cast<IntegerType>(Ty))
+    return IT->getBitWidth() <= 64;
+  return false;
+
+}
+
+// Copy an object's bytes to Buf, failing unless every one of them is known.
+static bool readNativeObject(NativeObject& O, ShadowBB* BB) {
+
+  if(O.isConstGlobal)
+    return XXXReadDataFromGlobal(O.Base.getGV()->G->getInitializer(), 0, O.Buf, O.Size, *GlobalTD);
+
+  SmallVector<IVSRange, 4> Results;
+  readValRangeMulti(O.Base, 0, O.Size, BB, Results);
+
+  // The ranges come back in order; any gap would leave bytes the call reads unknown.
+  uint64_t Covered = 0;
+
+  for(SmallVector<IVSRange, 4>::iterator it = Results.begin(), itend = Results.end(); it != itend; ++it) {
+
+    uint64_t First = it->first.first, Len = it->first.second - it->first.first;
+    ImprovedValSetSingle& IVS = it->second;
+
+    if(First != Covered || it->first.second > O.Size)
+      return false;
+    Covered = it->first.second;
+
+    if(IVS.Overdef || IVS.SetType != ValSetTypeScalar || IVS.Values.size() != 1)
+      return false;
+
+    uint64_t Val;
+    if(Len <= 8 && tryGetConstantInt(IVS.Values[0].V, Val)) {
+      // Inline integers needn't be materialised as Constants.
+      for(uint64_t i = 0; i != Len; ++i)
+	O.Buf[First + i] = (unsigned char)(Val >> (i * 8));
+      continue;
+    }
+
+    Constant* C = dyn_cast_or_null<Constant>(IVS.Values[0].V.getVal());
+    if(!C || !XXXReadDataFromGlobal(C, 0, O.Buf + First, Len, *GlobalTD))
+      return false;
+
+  }
+
+  return Covered == O.Size;
+
+}
+
+// Write back the span of bytes the call changed, as one byte array.
+static void writeNativeObject(NativeObject& O, ShadowBB* BB) {
+
+  uint64_t First = 0, Last = O.Size;
+  while(First != O.Size && O.Buf[First] == O.Orig[First])
+    ++First;
+  if(First == O.Size)
+    return;
+  while(O.Buf[Last - 1] == O.Orig[Last - 1])
+    --Last;
+
+  ArrayRef<uint8_t> Bytes(O.Buf + First, Last - First);
+  Constant* C = ConstantDataArray::get(BB->invar->BB->getContext(), Bytes);
+  ImprovedValSetSingle V(ImprovedVal(ShadowValue(C)), ValSetTypeScalar);
+
+  // Not an exact store: DSE mustn't think the call's writes are dead.
+  LocStore* Store = BB->getWritableStoreFor(O.Base, First, Last - First, true);
+  if(!Store)
+    return;
+  replaceRangeWithPB(Store->store, V, First, Last - First);
+
+  NativeCallBytesWritten += Last - First;
+
+}
+
+static void freeNativeObjects(SmallVector<NativeObject, 4>& Objects) {
+
+  for(SmallVector<NativeObject, 4>::iterator it = Objects.begin(), itend = Objects.end(); it != itend; ++it) {
+    free(it->Buf);
+    free(it->Orig);
+  }
+
+}
+
+static bool prepareNativeObjects(SmallVector<NativeObject, 4>& Objects, ShadowBB* BB) {
+
+  uint64_t total = 0;
+  for(SmallVector<NativeObject, 4>::iterator it = Objects.begin(), itend = Objects.end(); it != itend; ++it) {
+
+    total += it->Size;
+    if(total > NativeCallMaxBytes)
+      return false;
+
+    // calloc's alignment suits any scalar the function might load.
+    it->Buf = (unsigned char*)calloc(std::max(it->Size, (uint64_t)1), 1);
+    if(!readNativeObject(*it, BB))
+      return false;
+
+    if(it->mayWrite) {
+      it->Orig = (unsigned char*)malloc(std::max(it->Size, (uint64_t)1));
+      memcpy(it->Orig, it->Buf, it->Size);
+    }
+
+  }
+
+  return true;
+
+}
+
+bool IntegrationAttempt::tryRunNativeCall(ShadowInstruction* SI) {
+
+  if(!NativeCalls)
+    return false;
+
+  if(!GlobalNativeCallRunner) {
+    errs() << "-int-native-calls needs a native call runner; load LLVMLLPENative.so into the llpe tool\n";
+    exit(1);
+  }
+
+  Function* Called = getCalledFunction(SI);
+  if(!Called || !inst_is<CallInst>(SI))
+    return false;
+
+  // Once a call has been expanded keep expanding it, so its context stays consistent.
+  if(getInlineAttempt(SI))
+    return false;
+
+  FunctionType* FTy = Called->getFunctionType();
+  Type* RetTy = FTy->getReturnType();
+  if(!(RetTy->isVoidTy() || (RetTy->isIntegerTy() && isNativeType(RetTy))))
+    return false;
+  for(uint32_t i = 0, ilim = FTy->getNumParams(); i != ilim; ++i) {
+    if(!isNativeType(FTy->getParamType(i)))
+      return false;
+  }
+
+  if(!pass->isNativeFunction(Called))
+    return false;
+
+  const CallModSummary* Summary = pass->getCallModSummary(Called);
+  ShadowBB* BB = SI->parent;
+
+  SmallVector<NativeObject, 4> Objects;
+  // For pointer arguments, the object index and offset; integers are ready in Args.
+  std::vector<uint64_t> Args(FTy->getNumParams(), 0);
+  SmallVector<std::pair<int32_t, int64_t>, 4> ArgObjects(FTy->getNumParams(), std::make_pair(-1, 0));
+
+  for(uint32_t i = 0, ilim = FTy->getNumParams(); i != ilim; ++i) {
+
+    ShadowValue Arg = SI->getCallArgOperand(i);
+
+    if(!FTy->getParamType(i)->isPointerTy()) {
+      if(!tryGetConstantIntReplacement(Arg, Args[i]))
+	return false;
+      continue;
+    }
+
+    ShadowValue Base;
+    int64_t Offset;
+    if(!getBaseAndConstantOffset(Arg, Base, Offset))
+      return false;
+
+    if(Base.isNullPointer()) {
+      if(Offset)
+	return false;
+      continue;
+    }
+
+    // As for the string models, only memory whose loads never need a runtime check.
+    bool isConstGlobal = false;
+    if(ShadowGV* G = Base.getGV()) {
+      if(G->G->isConstant()) {
+	if(!G->G->hasDefinitiveInitializer())
+	  return false;
+	isConstGlobal = true;
+      }
+    }
+
+    if(!isConstGlobal && !BB->localStore->es.threadLocalObjects.count(Base))
+      return false;
+
+    uint32_t j = 0;
+    for(uint32_t jlim = Objects.size(); j != jlim && Objects[j].Base != Base; ++j) { }
+
+    if(j == Objects.size()) {
+
+      NativeObject O;
+      O.Base = Base;
+      O.Size = isConstGlobal ? getTypeStoreSize(Base.getGV()->G->getInitializer()->getType()) : BB->getAllocSize(Base);
+      O.Buf = 0;
+      O.Orig = 0;
+      O.isConstGlobal = isConstGlobal;
+      O.mayWrite = false;
+      Objects.push_back(O);
+
+    }
+
+    if(Offset < 0 || (uint64_t)Offset > Objects[j].Size)
+      return false;
+
+    Objects[j].mayWrite |= (!isConstGlobal) && Summary->writesArg[i];
+    ArgObjects[i] = std::make_pair((int32_t)j, Offset);
+
+  }
+
+  if(!prepareNativeObjects(Objects, BB)) {
+    freeNativeObjects(Objects);
+    return false;
+  }
+
+  for(uint32_t i = 0, ilim = ArgObjects.size(); i != ilim; ++i) {
+    if(ArgObjects[i].first != -1)
+      Args[i] = (uint64_t)(uintptr_t)(Objects[ArgObjects[i].first].Buf + ArgObjects[i].second);
+  }
+
+  uint64_t Ret;
+  if(!GlobalNativeCallRunner->run(Called, Args, Ret)) {
+    freeNativeObjects(Objects);
+    return false;
+  }
+
+  for(SmallVector<NativeObject, 4>::iterator it = Objects.begin(), itend = Objects.end(); it != itend; ++it) {
+
+    if(!it->isConstGlobal)
+      noteDependency(it->Base);
+    if(it->mayWrite)
+      writeNativeObject(*it, BB);
+
+  }
+
+  freeNativeObjects(Objects);
+
+  if(!RetTy->isVoidTy()) {
+
+    if(SI->i.PB)
+      deleteIV(SI->i.PB);
+
+    ImprovedValSetSingle* NewIVS = newIVS();
+    NewIVS->set(ImprovedVal(ShadowValue(ConstantInt::get(RetTy, Ret))), ValSetTypeScalar);
+    SI->i.PB = NewIVS;
+
+  }
+
+  NativeCallsRun.inc(&F);
+  return true;
+
+}
@@ -10,9 +10,67 @@
 #include "llvm/Analysis/LLPE.h"
 
 #include "llvm/IR/Function.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MathExtras.h"
+
+#include <algorithm>
 
 using namespace llvm;
 
+std::vector<LLPEStat*>& llvm::getRegisteredStats() {
+
+  static std::vector<LLPEStat*> stats;
+  return stats;
+
+}
+
+LLPEStat::LLPEStat(const char* _name, const char* _desc) : name(_name), desc(_desc), value(0) {
+
+  getRegisteredStats().push_back(this);
+
+}
+
+LLPEStat llvm::CoWFrameLists("cow_frame_lists", "Store frame lists copied on write");
+LLPEStat llvm::CoWFrames("cow_frames", "Store frames copied on write");
+LLPEStat llvm::CoWPages("cow_pages", "Store frame pages copied on write");
+LLPEStat llvm::CoWTreeNodes("cow_tree_nodes", "Shared tree nodes copied on write");
+LLPEStat llvm::CoWFDStores("cow_fd_stores", "FD stores copied on write");
+LLPEStat llvm::CoWFDPages("cow_fd_pages", "FD store pages copied on write");
+
+bool LLPEHistogram::enabled = false;
+
+static cl::opt<bool, true> StoreHistograms("int-store-histograms", cl::location(LLPEHistogram::enabled));
+
+std::vector<LLPEHistogram*>& llvm::getRegisteredHistograms() {
+
+  static std::vector<LLPEHistogram*> histograms;
+  return histograms;
+
+}
+
+LLPEHistogram::LLPEHistogram(const char* _name, const char* _desc) : name(_name), desc(_desc), count(0), sum(0), max(0) {
+
+  memset(buckets, 0, sizeof(buckets));
+  getRegisteredHistograms().push_back(this);
+
+}
+
+void LLPEHistogram::record(uint64_t v) {
+
+  ++count;
+  sum += v;
+  if(v > max)
+    max = v;
+  ++buckets[v ? Log2_64(v) + 1 : 0];
+
+}
+
+LLPEHistogram llvm::CoWFramePages("cow_frame_pages", "Pages shared per store frame copied on write");
+LLPEHistogram llvm::CoWPageSlots("cow_page_slots", "Slots copied per store frame page copied on write");
+LLPEHistogram llvm::CoWNodeChildren("cow_node_children", "Children per shared tree node copied on write");
+LLPEHistogram llvm::MergeFanIn("merge_fan_in", "Distinct incoming stores per block merge");
+
 void InlineAttempt::preCommitStats(bool enabledHere) {
 
   ++GlobalIHP->stats.dynamicFunctions;
@@ -32,22 +90,24 @@ void IntegrationAttempt::preCommitStats(bool enabledHere) {
   if(isCommitted())
     return;
 
-  ++GlobalIHP->stats.dynamicContexts;
+  ContextStats S;
+
+  ++S.contexts;
   if(!enabledHere)
-    ++GlobalIHP->stats.disabledContexts;
+    ++S.disabledContexts;
 
   for(uint32_t i = 0; i < nBBs; ++i) {
 
     if(!BBs[i])
       continue;
 
-    ++GlobalIHP->stats.dynamicBlocks;
-    GlobalIHP->stats.dynamicInsts += BBs[i]->insts.size();
+    ++S.blocks;
+    S.insts += BBs[i]->insts.size();
     
     if(!enabledHere)
       continue;
 
-    GlobalIHP->stats.condChecks += GlobalIHP->countPathConditionsAtBlockStart(BBs[i]->invar, this);
+    S.condChecks += GlobalIHP->countPathConditionsAtBlockStart(BBs[i]->invar, this);
 
     bool hasUniqueSucc = false;
     for(uint32_t j = 0, jlim = BBs[i]->invar->succIdxs.size(); j != jlim; ++j) {
@@ -78,7 +138,7 @@ void IntegrationAttempt::preCommitStats(bool enabledHere) {
 	
 	BranchInst* BI;
 	if(hasUniqueSucc && ((!(BI = dyn_cast_inst<BranchInst>(&SI))) || BI->isConditional()))
-	  ++GlobalIHP->stats.resolvedBranches;
+	  ++S.resolvedBranches;
 
       }
       else {
@@ -87,39 +147,39 @@ void IntegrationAttempt::preCommitStats(bool enabledHere) {
 	if(IVS && IVS->Values.size() == 1) {
 
 	  if(IVS->SetType == ValSetTypeScalar)
-	    ++GlobalIHP->stats.constantInstructions;
+	    ++S.constantInstructions;
 	  else if(IVS->SetType == ValSetTypePB)
-	    ++GlobalIHP->stats.pointerInstructions;
+	    ++S.pointerInstructions;
 
 	}
 	else if(IVS && !IVS->isWhollyUnknown()) {
 
-	  ++GlobalIHP->stats.setInstructions;
+	  ++S.setInstructions;
 
 	}
 	else {
 
-	  ++GlobalIHP->stats.unknownInstructions;
+	  ++S.unknownInstructions;
 
 	}
 
 	if(SI.dieStatus)
-	  ++GlobalIHP->stats.deadInstructions;
+	  ++S.deadInstructions;
 
 	if(SI.readsMemoryDirectly()) {
 	  if(SI.isThreadLocal == TLS_MUSTCHECK)
-	    ++GlobalIHP->stats.threadChecks;
+	    ++S.threadChecks;
 	}
 
 	if(SI.needsRuntimeCheck == RUNTIME_CHECK_READ_MEMCMP || SI.needsRuntimeCheck == RUNTIME_CHECK_READ_LLIOWD)
-	  ++GlobalIHP->stats.fileChecks;
+	  ++S.fileChecks;
 
 	if(SI.needsRuntimeCheck == RUNTIME_CHECK_AS_EXPECTED) {
 
 	  if(inst_is<ICmpInst>(&SI) && (isHeapPointer(SI.getOperand(0)) || isHeapPointer(SI.getOperand(1))))
-	    ++GlobalIHP->stats.mallocChecks;
+	    ++S.mallocChecks;
 	  else
-	    ++GlobalIHP->stats.condChecks;
+	    ++S.condChecks;
 
 	}
 
@@ -129,6 +189,8 @@ void IntegrationAttempt::preCommitStats(bool enabledHere) {
 
   }
 
+  GlobalIHP->stats.addContext(&F, S);
+
   for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it) {
     
     it->second->preCommitStats(enabledHere && it->second->isEnabled());
@@ -164,3 +226,352 @@ void LLPEAnalysisPass::postCommitStats() {
   }
 
 }
+
+void GlobalStats::addContext(Function* F, const ContextStats& S) {
+
+  dynamicContexts += S.contexts;
+  disabledContexts += S.disabledContexts;
+  dynamicBlocks += S.blocks;
+  dynamicInsts += S.insts;
+  resolvedBranches += S.resolvedBranches;
+  constantInstructions += S.constantInstructions;
+  pointerInstructions += S.pointerInstructions;
+  setInstructions += S.setInstructions;
+  unknownInstructions += S.unknownInstructions;
+  deadInstructions += S.deadInstructions;
+  mallocChecks += S.mallocChecks;
+  fileChecks += S.fileChecks;
+  threadChecks += S.threadChecks;
+  condChecks += S.condChecks;
+
+  ContextStats& FS = byFunction[F];
+  FS.contexts += S.contexts;
+  FS.disabledContexts += S.disabledContexts;
+  FS.blocks += S.blocks;
+  FS.insts += S.insts;
+  FS.resolvedBranches += S.resolvedBranches;
+  FS.constantInstructions += S.constantInstructions;
+  FS.pointerInstructions += S.pointerInstructions;
+  FS.setInstructions += S.setInstructions;
+  FS.unknownInstructions += S.unknownInstructions;
+  FS.deadInstructions += S.deadInstructions;
+  FS.mallocChecks += S.mallocChecks;
+  FS.fileChecks += S.fileChecks;
+  FS.threadChecks += S.threadChecks;
+  FS.condChecks += S.condChecks;
+
+}
+
+// The fixed statistics, in the order printed, with their text labels and JSON keys.
+namespace {
+
+struct FixedStat {
+
+  const char* label;
+  const char* key;
+  uint64_t GlobalStats::* field;
+
+};
+
+struct ContextStatField {
+
+  const char* key;
+  uint64_t ContextStats::* field;
+
+};
+
+}
+
+static const FixedStat fixedStats[] = {
+
+  { "Dynamic functions", "dynamic_functions", &GlobalStats::dynamicFunctions },
+  { "Dynamic contexts", "dynamic_contexts", &GlobalStats::dynamicContexts },
+  { "Dynamic blocks", "dynamic_blocks", &GlobalStats::dynamicBlocks },
+  { "Dynamic instructions", "dynamic_instructions", &GlobalStats::dynamicInsts },
+  { "Disabled contexts", "disabled_contexts", &GlobalStats::disabledContexts },
+  { "Resolved branches", "resolved_branches", &GlobalStats::resolvedBranches },
+  { "Constant instructions", "constant_instructions", &GlobalStats::constantInstructions },
+  { "Pointer instructions", "pointer_instructions", &GlobalStats::pointerInstructions },
+  { "Set instructions", "set_instructions", &GlobalStats::setInstructions },
+  { "Unknown instructions", "unknown_instructions", &GlobalStats::unknownInstructions },
+  { "Dead instructions", "dead_instructions", &GlobalStats::deadInstructions },
+  { "Residual blocks", "residual_blocks", &GlobalStats::residualBlocks },
+  { "Residual instructons", "residual_instructions", &GlobalStats::residualInstructions },
+  { "Malloc checks", "malloc_checks", &GlobalStats::mallocChecks },
+  { "File checks", "file_checks", &GlobalStats::fileChecks },
+  { "Thread checks", "thread_checks", &GlobalStats::threadChecks },
+  { "Cond checks", "cond_checks", &GlobalStats::condChecks },
+  { "Set overflows", "set_overflows", &GlobalStats::setOverflows },
+  { "Set widenings", "set_widenings", &GlobalStats::setWidenings },
+  { "Store merge memo hits", "store_merge_memo_hits", &GlobalStats::storeMergeMemoHits },
+  { "Store merge memo misses", "store_merge_memo_misses", &GlobalStats::storeMergeMemoMisses },
+  { "Summarised loops", "summarised_loops", &GlobalStats::summarisedLoops },
+  { "Loops cut short at a repeated state", "cycled_loops", &GlobalStats::cycledLoops },
+  { "Over-budget loops", "over_budget_loops", &GlobalStats::overBudgetLoops },
+  { "Discarded disabled loops", "discarded_loops", &GlobalStats::discardedLoops },
+  { "Loop analysis rounds", "loop_analysis_rounds", &GlobalStats::loopAnalysisRounds },
+  { "Widened loops", "widened_loops", &GlobalStats::widenedLoops },
+  { "Invariant results reused", "invariant_reuses", &GlobalStats::invariantReuses },
+  { "Unchanged results reused", "unchanged_reuses", &GlobalStats::unchangedReuses },
+  { "Merged functions", "merged_functions", &GlobalStats::mergedFunctions },
+  { "Folded format calls", "folded_format_calls", &GlobalStats::foldedFormatCalls },
+  { "Loops left rolled for code size", "unroll_growth_loops", &GlobalStats::unrollGrowthLoops }
+
+};
+
+static const ContextStatField contextStatFields[] = {
+
+  { "contexts", &ContextStats::contexts },
+  { "disabled_contexts", &ContextStats::disabledContexts },
+  { "blocks", &ContextStats::blocks },
+  { "instructions", &ContextStats::insts },
+  { "resolved_branches", &ContextStats::resolvedBranches },
+  { "constant_instructions", &ContextStats::constantInstructions },
+  { "pointer_instructions", &ContextStats::pointerInstructions },
+  { "set_instructions", &ContextStats::setInstructions },
+  { "unknown_instructions", &ContextStats::unknownInstructions },
+  { "dead_instructions", &ContextStats::deadInstructions },
+  { "malloc_checks", &ContextStats::mallocChecks },
+  { "file_checks", &ContextStats::fileChecks },
+  { "thread_checks", &ContextStats::threadChecks },
+  { "cond_checks", &ContextStats::condChecks }
+
+};
+
+#define NFIXEDSTATS (sizeof(fixedStats) / sizeof(fixedStats[0]))
+#define NCONTEXTSTATFIELDS (sizeof(contextStatFields) / sizeof(contextStatFields[0]))
+
+// "0", "1", "2-3", "4-7" and so on.
+static std::string getBucketLabel(uint32_t i) {
+
+  std::string label;
+  raw_string_ostream RSO(label);
+  if(i <= 1)
+    RSO << i;
+  else if(i == 64)
+    RSO << (1ULL << 63) << "-";
+  else
+    RSO << (1ULL << (i - 1)) << "-" << ((1ULL << i) - 1);
+  return RSO.str();
+
+}
+
+void GlobalStats::print(raw_ostream& Out) {
+
+  for(uint32_t i = 0; i != NFIXEDSTATS; ++i)
+    Out << fixedStats[i].label << ": " << this->*(fixedStats[i].field) << "\n";
+
+  std::vector<LLPEStat*>& registered = getRegisteredStats();
+  for(std::vector<LLPEStat*>::iterator it = registered.begin(), itend = registered.end(); it != itend; ++it)
+    Out << (*it)->desc << ": " << (*it)->value << "\n";
+
+  for(DenseMap<Function*, uint64_t>::iterator it = setOverflowsByFunction.begin(),
+	itend = setOverflowsByFunction.end(); it != itend; ++it)
+    Out << "Set overflows in " << it->first->getName() << ": " << it->second << "\n";
+
+  if(!LLPEHistogram::enabled)
+    return;
+
+  std::vector<LLPEHistogram*>& histograms = getRegisteredHistograms();
+  for(std::vector<LLPEHistogram*>::iterator it = histograms.begin(), itend = histograms.end(); it != itend; ++it) {
+
+    LLPEHistogram* H = *it;
+    Out << H->desc << ": " << H->count << " samples";
+    if(!H->count) {
+      Out << "\n";
+      continue;
+    }
+
+    Out << ", mean " << format("%.2f", (double)H->sum / H->count) << ", max " << H->max << "\n";
+    for(uint32_t i = 0; i != 65; ++i) {
+      if(H->buckets[i])
+	Out << "  " << getBucketLabel(i) << ": " << H->buckets[i] << "\n";
+    }
+
+  }
+
+}
+
+static bool functionNameLess(Function* F1, Function* F2) {
+
+  return F1->getName() < F2->getName();
+
+}
+
+// Every function with something to report, by name so the output is stable between runs.
+static void getReportedFunctions(GlobalStats& S, std::vector<Function*>& Out) {
+
+  DenseSet<Function*> seen;
+
+  for(DenseMap<Function*, ContextStats>::iterator it = S.byFunction.begin(),
+	itend = S.byFunction.end(); it != itend; ++it)
+    seen.insert(it->first);
+
+  for(DenseMap<Function*, uint64_t>::iterator it = S.setOverflowsByFunction.begin(),
+	itend = S.setOverflowsByFunction.end(); it != itend; ++it)
+    seen.insert(it->first);
+
+  std::vector<LLPEStat*>& registered = getRegisteredStats();
+  for(std::vector<LLPEStat*>::iterator it = registered.begin(), itend = registered.end(); it != itend; ++it) {
+
+    for(DenseMap<Function*, uint64_t>::iterator FI = (*it)->byFunction.begin(),
+	  FE = (*it)->byFunction.end(); FI != FE; ++FI)
+      seen.insert(FI->first);
+
+  }
+
+  Out.insert(Out.end(), seen.begin(), seen.end());
+  std::sort(Out.begin(), Out.end(), functionNameLess);
+
+}
+
+static uint64_t lookupCount(DenseMap<Function*, uint64_t>& Map, Function* F) {
+
+  DenseMap<Function*, uint64_t>::iterator findit = Map.find(F);
+  return findit == Map.end() ? 0 : findit->second;
+
+}
+
+static void printJSONString(raw_ostream& Out, StringRef Str) {
+
+  Out << '"';
+  for(StringRef::iterator it = Str.begin(), itend = Str.end(); it != itend; ++it) {
+
+    if(*it == '"' || *it == '\\')
+      Out << '\\' << *it;
+    else if((unsigned char)*it < 0x20)
+      Out << format("\\u%04x", (unsigned)(unsigned char)*it);
+    else
+      Out << *it;
+
+  }
+  Out << '"';
+
+}
+
+void GlobalStats::printJSON(raw_ostream& Out) {
+
+  std::vector<LLPEStat*>& registered = getRegisteredStats();
+
+  Out << "{\n  \"totals\": {\n";
+
+  for(uint32_t i = 0; i != NFIXEDSTATS; ++i)
+    Out << "    \"" << fixedStats[i].key << "\": " << this->*(fixedStats[i].field)
+	<< ((i + 1 == NFIXEDSTATS && registered.empty()) ? "\n" : ",\n");
+
+  for(uint32_t i = 0, ilim = registered.size(); i != ilim; ++i)
+    Out << "    \"" << registered[i]->name << "\": " << registered[i]->value
+	<< (i + 1 == ilim ? "\n" : ",\n");
+
+  Out << "  },\n  \"functions\": {\n";
+
+  std::vector<Function*> functions;
+  getReportedFunctions(*this, functions);
+
+  for(uint32_t i = 0, ilim = functions.size(); i != ilim; ++i) {
+
+    Function* F = functions[i];
+    ContextStats& FS = byFunction[F];
+
+    Out << "    ";
+    printJSONString(Out, F->getName());
+    Out << ": { ";
+
+    for(uint32_t j = 0; j != NCONTEXTSTATFIELDS; ++j)
+      Out << "\"" << contextStatFields[j].key << "\": " << FS.*(contextStatFields[j].field) << ", ";
+
+    Out << "\"set_overflows\": " << lookupCount(setOverflowsByFunction, F);
+
+    for(std::vector<LLPEStat*>::iterator it = registered.begin(), itend = registered.end(); it != itend; ++it) {
+
+      if(!(*it)->byFunction.empty())
+	Out << ", \"" << (*it)->name << "\": " << lookupCount((*it)->byFunction, F);
+
+    }
+
+    Out << (i + 1 == ilim ? " }\n" : " },\n");
+
+  }
+
+  Out << "  }";
+
+  if(LLPEHistogram::enabled) {
+
+    std::vector<LLPEHistogram*>& histograms = getRegisteredHistograms();
+
+    Out << ",\n  \"histograms\": {\n";
+
+    for(uint32_t i = 0, ilim = histograms.size(); i != ilim; ++i) {
+
+      LLPEHistogram* H = histograms[i];
+      Out << "    \"" << H->name << "\": { \"count\": " << H->count << ", \"sum\": " << H->sum
+	  << ", \"max\": " << H->max << ", \"buckets\": {";
+
+      bool first = true;
+      for(uint32_t j = 0; j != 65; ++j) {
+
+	if(!H->buckets[j])
+	  continue;
+	Out << (first ? " " : ", ") << "\"" << getBucketLabel(j) << "\": " << H->buckets[j];
+	first = false;
+
+      }
+
+      Out << (first ? "} }" : " } }") << (i + 1 == ilim ? "\n" : ",\n");
+
+    }
+
+    Out << "  }";
+
+  }
+
+  Out << "\n}\n";
+
+}
+
+// The per-function breakdown as a table, one row per function, for spreadsheets and the like.
+void GlobalStats::printFunctionCSV(raw_ostream& Out) {
+
+  std::vector<LLPEStat*> perFunction;
+  std::vector<LLPEStat*>& registered = getRegisteredStats();
+  for(std::vector<LLPEStat*>::iterator it = registered.begin(), itend = registered.end(); it != itend; ++it) {
+    if(!(*it)->byFunction.empty())
+      perFunction.push_back(*it);
+  }
+
+  Out << "function";
+  for(uint32_t j = 0; j != NCONTEXTSTATFIELDS; ++j)
+    Out << "," << contextStatFields[j].key;
+  Out << ",set_overflows";
+  for(std::vector<LLPEStat*>::iterator it = perFunction.begin(), itend = perFunction.end(); it != itend; ++it)
+    Out << "," << (*it)->name;
+  Out << "\n";
+
+  std::vector<Function*> functions;
+  getReportedFunctions(*this, functions);
+
+  for(std::vector<Function*>::iterator it = functions.begin(), itend = functions.end(); it != itend; ++it) {
+
+    Function* F = *it;
+    ContextStats& FS = byFunction[F];
+
+    // Quote the name, doubling any quotes within it.
+    Out << '"';
+    StringRef Name = F->getName();
+    for(StringRef::iterator NI = Name.begin(), NE = Name.end(); NI != NE; ++NI) {
+      if(*NI == '"')
+	Out << '"';
+      Out << *NI;
+    }
+    Out << '"';
+
+    for(uint32_t j = 0; j != NCONTEXTSTATFIELDS; ++j)
+      Out << "," << FS.*(contextStatFields[j].field);
+    Out << "," << lookupCount(setOverflowsByFunction, F);
+    for(std::vector<LLPEStat*>::iterator SI = perFunction.begin(), SE = perFunction.end(); SI != SE; ++SI)
+      Out << "," << lookupCount((*SI)->byFunction, F);
+    Out << "\n";
+
+  }
+
+}
@@ -0,0 +1,301 @@
+//===-- Parallel.cpp ------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// The worker pool for work in LLPE that acts on independent items. At present its only
+// user is the SHA1 hashing of the files named in the lliowd config (see Misc.cpp), so
+// that is all -int-analysis-threads / -int-threads speeds up. Interpretation, and so
+// the analysis proper, remains single-threaded: contexts share the global heap table,
+// the IVS allocator and the context list, and sibling calls depend on each other's
+// stores, so only work that reads the module and writes to per-item result slots
+// belongs here.
+//
+// There is one pool per process, started on first use with -int-threads workers
+// (counting the thread that waits; 0 means one per hardware thread), so that any
+// later user reuses the same threads rather than starting its own. Each worker has its
+// own deque of tasks: it takes the newest of its own, for locality with the task that
+// spawned them, and when it has none steals the oldest of another's. Threads outside
+// the pool queue their tasks on a shared deque and help run tasks while they wait.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace llvm;
+
+static cl::opt<unsigned> AnalysisThreads("int-analysis-threads", cl::init(1),
+					 cl::desc("Threads for hashing the files named in the lliowd config (0: one per hardware thread). Analysis itself is single-threaded."));
+static cl::alias AnalysisThreadsAlias("int-threads", cl::desc("Alias for -int-analysis-threads"), cl::aliasopt(AnalysisThreads));
+
+unsigned llvm::getAnalysisThreads() {
+
+  if(AnalysisThreads == 0) {
+    unsigned hw = std::thread::hardware_concurrency();
+    return hw ? hw : 1;
+  }
+
+  return AnalysisThreads;
+
+}
+
+namespace {
+
+struct PoolTask {
+
+  std::function<void()> Fn;
+  TaskGroup* Group;
+
+};
+
+struct TaskDeque {
+
+  std::mutex lock;
+  std::deque<PoolTask> tasks;
+
+};
+
+class TaskPool {
+
+  // Deque 0 is shared by the threads outside the pool; worker i owns deque i.
+  std::vector<std::unique_ptr<TaskDeque> > deques;
+  std::vector<std::thread> workers;
+
+  std::mutex sleepLock;
+  std::condition_variable wake;
+  std::atomic<uint32_t> queued;
+  bool stopping;
+
+  bool takeFrom(uint32_t i, bool newest, PoolTask& Out);
+  bool findTask(uint32_t self, PoolTask& Out);
+  void workerMain(uint32_t self);
+
+public:
+
+  TaskPool(uint32_t nThreads);
+  ~TaskPool();
+
+  uint32_t size() const { return deques.size(); }
+  void push(PoolTask T);
+  bool runOne();
+  void waitForWork(const std::atomic<uint32_t>& pending);
+  void groupDone();
+
+};
+
+}
+
+// The deque this thread owns, or 0 for threads outside the pool.
+static thread_local uint32_t thisWorker = 0;
+
+TaskPool::TaskPool(uint32_t nThreads) : queued(0), stopping(false) {
+
+  for(uint32_t i = 0; i != nThreads; ++i)
+    deques.push_back(std::unique_ptr<TaskDeque>(new TaskDeque()));
+
+  for(uint32_t i = 1; i != nThreads; ++i)
+    workers.push_back(std::thread([this, i]() { workerMain(i); }));
+
+}
+
+TaskPool::~TaskPool() {
+
+  {
+    std::lock_guard<std::mutex> Guard(sleepLock);
+    stopping = true;
+  }
+  wake.notify_all();
+
+  for(std::vector<std::thread>::iterator it = workers.begin(), itend = workers.end(); it != itend; ++it)
+    it->join();
+
+}
+
+void TaskPool::push(PoolTask T) {
+
+  // Counted before it is published, so a thief that takes it at once can't take queued
+  // below zero.
+  {
+    std::lock_guard<std::mutex> Guard(sleepLock);
+    ++queued;
+  }
+
+  TaskDeque& D = *deques[thisWorker];
+  {
+    std::lock_guard<std::mutex> Guard(D.lock);
+    D.tasks.push_back(std::move(T));
+  }
+
+  // Workers and waiting groups sleep on the same condition, and a waiter whose group
+  // has finished won't take the task, so wake them all.
+  wake.notify_all();
+
+}
+
+bool TaskPool::takeFrom(uint32_t i, bool newest, PoolTask& Out) {
+
+  TaskDeque& D = *deques[i];
+  std::lock_guard<std::mutex> Guard(D.lock);
+  if(D.tasks.empty())
+    return false;
+
+  if(newest) {
+    Out = std::move(D.tasks.back());
+    D.tasks.pop_back();
+  }
+  else {
+    Out = std::move(D.tasks.front());
+    D.tasks.pop_front();
+  }
+
+  --queued;
+  return true;
+
+}
+
+bool TaskPool::findTask(uint32_t self, PoolTask& Out) {
+
+  if(takeFrom(self, true, Out))
+    return true;
+
+  for(uint32_t i = 1, ilim = deques.size(); i != ilim; ++i) {
+    if(takeFrom((self + i) % ilim, false, Out))
+      return true;
+  }
+
+  return false;
+
+}
+
+bool TaskPool::runOne() {
+
+  PoolTask T;
+  if(!findTask(thisWorker, T))
+    return false;
+
+  T.Fn();
+  T.Group->taskDone();
+  return true;
+
+}
+
+// Sleep until there is something to run or the group counting pending has finished.
+void TaskPool::waitForWork(const std::atomic<uint32_t>& pending) {
+
+  std::unique_lock<std::mutex> Guard(sleepLock);
+  wake.wait(Guard, [this, &pending]() { return stopping || queued != 0 || pending == 0; });
+
+}
+
+void TaskPool::groupDone() {
+
+  // Taking the lock orders this against a waiter that has just seen pending nonzero.
+  {
+    std::lock_guard<std::mutex> Guard(sleepLock);
+  }
+  wake.notify_all();
+
+}
+
+void TaskPool::workerMain(uint32_t self) {
+
+  thisWorker = self;
+
+  while(1) {
+
+    if(runOne())
+      continue;
+
+    std::unique_lock<std::mutex> Guard(sleepLock);
+    wake.wait(Guard, [this]() { return stopping || queued != 0; });
+    if(stopping)
+      return;
+
+  }
+
+}
+
+static TaskPool& getTaskPool() {
+
+  // Sized on first use, after the command line has been read.
+  static TaskPool Pool(getAnalysisThreads());
+  return Pool;
+
+}
+
+void TaskGroup::spawn(std::function<void()> Task) {
+
+  ++pending;
+
+  TaskPool& Pool = getTaskPool();
+  if(Pool.size() <= 1) {
+    Task();
+    taskDone();
+    return;
+  }
+
+  PoolTask T;
+  T.Fn = std::move(Task);
+  T.Group = this;
+  Pool.push(std::move(T));
+
+}
+
+void TaskGroup::taskDone() {
+
+  if(--pending == 0)
+    getTaskPool().groupDone();
+
+}
+
+void TaskGroup::wait() {
+
+  TaskPool& Pool = getTaskPool();
+  while(pending) {
+
+    // Run anything queued, so a waiting task lends its thread rather than sitting on it.
+    if(!Pool.runOne())
+      Pool.waitForWork(pending);
+
+  }
+
+}
+
+void llvm::parallelFor(uint32_t N, const std::function<void(uint32_t)>& Work) {
+
+  uint32_t nThreads = getAnalysisThreads();
+  if(nThreads > N)
+    nThreads = N;
+
+  if(nThreads <= 1) {
+    for(uint32_t i = 0; i != N; ++i)
+      Work(i);
+    return;
+  }
+
+  // Workers claim items one at a time, since per-item cost varies wildly
+  // (e.g. a dominator tree for main vs. a tiny wrapper function).
+  std::atomic<uint32_t> nextItem(0);
+
+  auto worker = [&]() {
+    for(uint32_t i = nextItem++; i < N; i = nextItem++)
+      Work(i);
+  };
+
+  TaskGroup Group;
+  for(uint32_t i = 1; i != nThreads; ++i)
+    Group.spawn(worker);
+
+  // The calling thread takes a share too.
+  worker();
+  Group.wait();
+
+}
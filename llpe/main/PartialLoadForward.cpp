@@ -111,67 +111,52 @@ Constant* llvm::intFromBytes(const uint64_t* data, unsigned data_length, unsigne
 
 }
 
-int64_t InlineAttempt::NonFPArgIdxToArgIdx(int64_t idx) {
+// Number the varargs of each kind once, so that each va_arg step is an array index
+// rather than a walk over the call's arguments.
+void InlineAttempt::buildVarargTables() {
+
+  varargTablesBuilt = true;
 
   // All callers must have the same operand count, so Callers[0] is ok.
-  for(unsigned i = F.getFunctionType()->getNumParams(); i < Callers[0]->getNumArgOperands(); ++i) {
+  ImmutableCallSite ICS(Callers[0]->invar->I);
+  unsigned nParams = F.getFunctionType()->getNumParams();
 
-    ImmutableCallSite ICS(Callers[0]->invar->I);
+  for(unsigned i = nParams; i < Callers[0]->getNumArgOperands(); ++i) {
 
     Type* T = ICS.getArgument(i)->getType();
-    if(T->isPointerTy() || T->isIntegerTy()) {
-
-      if(idx == 0)
-	return ImprovedVal::first_any_arg + (i - F.getFunctionType()->getNumParams());
-      else
-	--idx;
-
-    }
-    else if(T->isFloatingPointTy()) {
-
-      continue;
-
-    }
-    else {
+    int64_t anyIdx = ImprovedVal::first_any_arg + (i - nParams);
 
+    if(T->isPointerTy() || T->isIntegerTy())
+      nonFPVarargs.push_back(anyIdx);
+    else if(T->isFloatingPointTy())
+      fpVarargs.push_back(anyIdx);
+    else
       release_assert(0 && "Unhandled vararg type");
 
-    }
-
   }
 
-  return ImprovedVal::not_va_arg;
-
 }
 
-int64_t InlineAttempt::FPArgIdxToArgIdx(int64_t idx) {
-  
-  for(unsigned i = F.getFunctionType()->getNumParams(); i < Callers[0]->getNumArgOperands(); ++i) {
-
-    ImmutableCallSite ICS(Callers[0]->invar->I);
-
-    Type* T = ICS.getArgument(i)->getType();
-    if(T->isPointerTy() || T->isIntegerTy()) {
+int64_t InlineAttempt::NonFPArgIdxToArgIdx(int64_t idx) {
 
-      continue;
+  if(!varargTablesBuilt)
+    buildVarargTables();
 
-    }
-    else if(T->isFloatingPointTy()) {
+  if(idx < 0 || ((uint64_t)idx) >= nonFPVarargs.size())
+    return ImprovedVal::not_va_arg;
 
-      if(idx == 0)
-	return ImprovedVal::first_any_arg + (i - F.getFunctionType()->getNumParams());
-      else
-	--idx;
+  return nonFPVarargs[idx];
 
-    }
-    else {
+}
 
-      release_assert(0 && "Unhandled vararg type");
+int64_t InlineAttempt::FPArgIdxToArgIdx(int64_t idx) {
 
-    }
+  if(!varargTablesBuilt)
+    buildVarargTables();
 
-  }
+  if(idx < 0 || ((uint64_t)idx) >= fpVarargs.size())
+    return ImprovedVal::not_va_arg;
 
-  return ImprovedVal::not_va_arg;
+  return fpVarargs[idx];
 
 }
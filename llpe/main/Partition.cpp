@@ -0,0 +1,188 @@
+//===-- Partition.cpp -----------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// With -int-partition-output=N, commit also writes the residual program as N modules,
+// PREFIX.0.bc to PREFIX.N-1.bc (PREFIX is given by -int-partition-prefix), that can be
+// optimised and code-generated in parallel and linked back together. The module opt
+// writes is unaffected.
+//
+// Each defined function goes to the partition with the fewest instructions so far,
+// largest first, so the root specialisation and each split function (see SaveSplit.cpp)
+// are balanced across the partitions. Global variables and aliases are defined in
+// partition 0. Local definitions are made external with hidden visibility so that
+// partitions can refer to each other, and functions with discardable linkage become
+// weak_odr so that the copy a partition defines survives even if unused there. Other
+// partitions declare what they don't define, though constant globals keep their
+// initialisers as available_externally for the optimiser's benefit.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalAlias.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+static cl::opt<unsigned> PartitionOutput("int-partition-output", cl::init(0));
+static cl::opt<std::string> PartitionPrefix("int-partition-prefix", cl::init("llpe-part"));
+
+static void externalise(GlobalValue* GV) {
+
+  if(!GV->hasName())
+    GV->setName("llpe.part");
+
+  if(GV->hasLocalLinkage()) {
+    GV->setLinkage(GlobalValue::ExternalLinkage);
+    GV->setVisibility(GlobalValue::HiddenVisibility);
+  }
+  else if(GV->hasLinkOnceLinkage() && !GV->isDeclaration()) {
+    GV->setLinkage(GlobalValue::WeakODRLinkage);
+  }
+
+}
+
+static uint64_t countInstructions(Function* F) {
+
+  uint64_t n = 0;
+  for(Function::iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI)
+    n += BI->size();
+  return n;
+
+}
+
+static bool sizeGreater(const std::pair<uint64_t, std::string>& A, const std::pair<uint64_t, std::string>& B) {
+
+  return A.first > B.first;
+
+}
+
+// Make Part keep only the definitions assigned to partition Idx.
+static void stripPartition(Module& Part, unsigned Idx, StringMap<unsigned>& Owners) {
+
+  for(Module::iterator it = Part.begin(), itend = Part.end(); it != itend; ++it) {
+
+    if(it->isDeclaration() || it->hasAvailableExternallyLinkage())
+      continue;
+
+    if(Owners.lookup(it->getName()) != Idx)
+      it->deleteBody();
+
+  }
+
+  if(Idx == 0)
+    return;
+
+  for(Module::global_iterator it = Part.global_begin(), itend = Part.global_end(); it != itend; ++it) {
+
+    if(it->isDeclaration() || it->hasAvailableExternallyLinkage())
+      continue;
+
+    if(it->isConstant() && !it->isWeakForLinker())
+      it->setLinkage(GlobalValue::AvailableExternallyLinkage);
+    else {
+      it->setInitializer(0);
+      it->setLinkage(GlobalValue::ExternalLinkage);
+    }
+
+  }
+
+  // Replace aliases with declarations of the name they define.
+  std::vector<GlobalAlias*> Aliases;
+  for(Module::alias_iterator it = Part.alias_begin(), itend = Part.alias_end(); it != itend; ++it)
+    Aliases.push_back(it);
+
+  for(std::vector<GlobalAlias*>::iterator it = Aliases.begin(), itend = Aliases.end(); it != itend; ++it) {
+
+    GlobalAlias* GA = *it;
+    PointerType* PTy = GA->getType();
+    GlobalValue* Decl;
+
+    if(FunctionType* FTy = dyn_cast<FunctionType>(PTy->getElementType()))
+      Decl = Function::Create(FTy, GlobalValue::ExternalLinkage, "", &Part);
+    else
+      Decl = new GlobalVariable(Part, PTy->getElementType(), false, GlobalValue::ExternalLinkage, 0, "",
+				0, GlobalVariable::NotThreadLocal, PTy->getAddressSpace());
+
+    Decl->setVisibility(GA->getVisibility());
+    Decl->takeName(GA);
+    GA->replaceAllUsesWith(Decl);
+    GA->eraseFromParent();
+
+  }
+
+}
+
+void LLPEAnalysisPass::writePartitionedOutput(Module& M) {
+
+  if(PartitionOutput == 0)
+    return;
+
+  Module* Base = CloneModule(&M);
+
+  for(Module::iterator it = Base->begin(), itend = Base->end(); it != itend; ++it)
+    externalise(it);
+  for(Module::global_iterator it = Base->global_begin(), itend = Base->global_end(); it != itend; ++it)
+    externalise(it);
+  for(Module::alias_iterator it = Base->alias_begin(), itend = Base->alias_end(); it != itend; ++it)
+    externalise(it);
+
+  std::vector<std::pair<uint64_t, std::string> > Sizes;
+  for(Module::iterator it = Base->begin(), itend = Base->end(); it != itend; ++it) {
+
+    if(!(it->isDeclaration() || it->hasAvailableExternallyLinkage()))
+      Sizes.push_back(std::make_pair(countInstructions(it), it->getName().str()));
+
+  }
+
+  std::stable_sort(Sizes.begin(), Sizes.end(), sizeGreater);
+
+  std::vector<uint64_t> Loads(PartitionOutput, 0);
+  StringMap<unsigned> Owners;
+
+  for(std::vector<std::pair<uint64_t, std::string> >::iterator it = Sizes.begin(), itend = Sizes.end(); it != itend; ++it) {
+
+    unsigned Idx = std::min_element(Loads.begin(), Loads.end()) - Loads.begin();
+    Loads[Idx] += it->first;
+    Owners[it->second] = Idx;
+
+  }
+
+  for(unsigned i = 0; i != PartitionOutput; ++i) {
+
+    Module* Part = CloneModule(Base);
+    stripPartition(*Part, i, Owners);
+
+    std::string Filename;
+    {
+      raw_string_ostream RSO(Filename);
+      RSO << PartitionPrefix << "." << i << ".bc";
+    }
+
+    std::error_code error;
+    raw_fd_ostream Out(Filename.c_str(), error, sys::fs::F_None);
+    if(error)
+      errs() << "Failed to open " << Filename << ": " << error.message() << "\n";
+    else
+      WriteBitcodeToFile(Part, Out);
+
+    delete Part;
+
+  }
+
+  delete Base;
+
+}
@@ -0,0 +1,232 @@
+//===-- PathSplit.cpp -----------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// An optional preparation pass, -llpe-split-paths, run before -llpe-analysis, that
+// duplicates the join block of small diamonds into one of its two predecessors. Where
+// LLPE can't resolve the branch that opens the diamond, it analyses each copy of the join
+// with that path's own store and PHI values instead of their merge, so e.g. a branch on a
+// PHI in the join can still be resolved on each side. The duplicated code is bounded per
+// function by -int-split-path-budget instructions, and each join considered by
+// -int-split-path-max-block. Joins that don't use their PHIs are left alone, as are any
+// whose duplication would disturb the loop-simplified form LLPE depends on.
+
+#include "llvm/Pass.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+using namespace llvm;
+
+static cl::opt<unsigned> SplitPathBudget("int-split-path-budget", cl::init(64));
+static cl::opt<unsigned> SplitPathMaxBlock("int-split-path-max-block", cl::init(8));
+
+namespace llvm {
+
+class LLPESplitPathsPass : public FunctionPass {
+public:
+
+  static char ID;
+  LLPESplitPathsPass() : FunctionPass(ID) {}
+
+  bool runOnFunction(Function& F);
+
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<LoopInfo>();
+  }
+
+};
+
+}
+
+static RegisterPass<LLPESplitPathsPass> X("llpe-split-paths", "Duplicate small diamond joins for LLPE",
+					 false /* Only looks at CFG */,
+					 false /* Analysis Pass */);
+
+char LLPESplitPathsPass::ID = 0;
+
+// Returns the number of instructions duplicating BB would cost, or 0 if it shouldn't be.
+static unsigned getSplitCost(BasicBlock* BB, LoopInfo& LI) {
+
+  if(BB == &BB->getParent()->getEntryBlock() || BB->isLandingPad() || BB->hasAddressTaken())
+    return 0;
+
+  BasicBlock* Pred1 = 0;
+  BasicBlock* Pred2 = 0;
+  for(pred_iterator PI = pred_begin(BB), PE = pred_end(BB); PI != PE; ++PI) {
+
+    if(!Pred1)
+      Pred1 = *PI;
+    else if(!Pred2)
+      Pred2 = *PI;
+    else
+      return 0;
+
+  }
+
+  if((!Pred2) || Pred1 == Pred2)
+    return 0;
+
+  BranchInst* BI1 = dyn_cast<BranchInst>(Pred1->getTerminator());
+  BranchInst* BI2 = dyn_cast<BranchInst>(Pred2->getTerminator());
+  if((!BI1) || (!BI2) || BI1->isConditional() || BI2->isConditional())
+    return 0;
+
+  // Stay within a single loop, and don't create another latch or preheader.
+  Loop* L = LI.getLoopFor(BB);
+  if(LI.isLoopHeader(BB) || LI.getLoopFor(Pred1) != L || LI.getLoopFor(Pred2) != L)
+    return 0;
+
+  // Keep the single return block -mergereturn made.
+  TerminatorInst* TI = BB->getTerminator();
+  if(!(isa<BranchInst>(TI) || isa<SwitchInst>(TI) || isa<UnreachableInst>(TI)))
+    return 0;
+
+  for(succ_iterator SI = succ_begin(BB), SE = succ_end(BB); SI != SE; ++SI) {
+    if(LI.isLoopHeader(*SI))
+      return 0;
+  }
+
+  unsigned cost = 0;
+  bool usesPHIs = false;
+
+  for(BasicBlock::iterator II = BB->getFirstNonPHI(), IE = BB->end(); II != IE; ++II) {
+
+    if(isa<DbgInfoIntrinsic>(II))
+      continue;
+
+    if(CallInst* CI = dyn_cast<CallInst>(II)) {
+      if(CI->cannotDuplicate())
+	return 0;
+    }
+
+    for(User::op_iterator OI = II->op_begin(), OE = II->op_end(); OI != OE; ++OI) {
+
+      if(PHINode* PN = dyn_cast<PHINode>(*OI)) {
+	if(PN->getParent() == BB)
+	  usesPHIs = true;
+      }
+
+    }
+
+    ++cost;
+
+  }
+
+  if((!usesPHIs) || cost > SplitPathMaxBlock)
+    return 0;
+
+  return cost;
+
+}
+
+// Give BB's second predecessor its own copy of BB.
+static void splitJoin(BasicBlock* BB, LoopInfo& LI) {
+
+  pred_iterator PI = pred_begin(BB);
+  ++PI;
+  BasicBlock* Pred = *PI;
+
+  ValueToValueMapTy VMap;
+  BasicBlock* Clone = CloneBasicBlock(BB, VMap, ".split", BB->getParent());
+  if(Loop* L = LI.getLoopFor(BB))
+    L->addBasicBlockToLoop(Clone, LI.getBase());
+
+  // On the new path the PHIs take Pred's values.
+  for(BasicBlock::iterator II = BB->begin(); PHINode* PN = dyn_cast<PHINode>(II); ++II) {
+
+    PHINode* ClonePN = cast<PHINode>(VMap[PN]);
+    VMap[PN] = PN->getIncomingValueForBlock(Pred);
+    ClonePN->eraseFromParent();
+
+  }
+
+  for(BasicBlock::iterator II = Clone->begin(), IE = Clone->end(); II != IE; ++II)
+    RemapInstruction(II, VMap, RF_IgnoreMissingEntries);
+
+  for(BasicBlock::iterator II = BB->begin(); PHINode* PN = dyn_cast<PHINode>(II); ++II)
+    PN->removeIncomingValue(Pred, false);
+
+  Pred->getTerminator()->replaceUsesOfWith(BB, Clone);
+
+  // Successors gain an edge from the clone carrying the same values as BB's edge;
+  // the SSA repair below then substitutes the clone's own values.
+  for(succ_iterator SI = succ_begin(Clone), SE = succ_end(Clone); SI != SE; ++SI) {
+
+    for(BasicBlock::iterator II = SI->begin(); PHINode* PN = dyn_cast<PHINode>(II); ++II)
+      PN->addIncoming(PN->getIncomingValueForBlock(BB), Clone);
+
+  }
+
+  // Values defined in BB and used elsewhere now have a definition on each path.
+  for(BasicBlock::iterator II = BB->begin(), IE = BB->end(); II != IE; ++II) {
+
+    Instruction* I = II;
+    Value* CloneV = VMap[I];
+
+    SmallVector<Use*, 8> OutsideUses;
+    for(Value::use_iterator UI = I->use_begin(), UE = I->use_end(); UI != UE; ++UI) {
+
+      Instruction* User = cast<Instruction>(UI->getUser());
+      BasicBlock* UseBB = User->getParent();
+      if(PHINode* PN = dyn_cast<PHINode>(User))
+	UseBB = PN->getIncomingBlock(*UI);
+      // Successors' PHIs have an entry for the clone to fix as well.
+      if(UseBB != BB && (UseBB != Clone || isa<PHINode>(User)))
+	OutsideUses.push_back(&*UI);
+
+    }
+
+    if(OutsideUses.empty())
+      continue;
+
+    SSAUpdater Updater;
+    Updater.Initialize(I->getType(), I->getName());
+    Updater.AddAvailableValue(BB, I);
+    Updater.AddAvailableValue(Clone, CloneV);
+
+    for(SmallVector<Use*, 8>::iterator it = OutsideUses.begin(), itend = OutsideUses.end(); it != itend; ++it)
+      Updater.RewriteUse(**it);
+
+  }
+
+}
+
+bool LLPESplitPathsPass::runOnFunction(Function& F) {
+
+  LoopInfo& LI = getAnalysis<LoopInfo>();
+
+  unsigned budget = SplitPathBudget;
+  std::vector<BasicBlock*> Joins;
+
+  for(Function::iterator BI = F.begin(), BE = F.end(); BI != BE; ++BI)
+    Joins.push_back(BI);
+
+  bool changed = false;
+
+  for(std::vector<BasicBlock*>::iterator it = Joins.begin(), itend = Joins.end(); it != itend && budget; ++it) {
+
+    unsigned cost = getSplitCost(*it, LI);
+    if((!cost) || cost > budget)
+      continue;
+
+    splitJoin(*it, LI);
+    budget -= cost;
+    changed = true;
+
+  }
+
+  return changed;
+
+}
@@ -0,0 +1,530 @@
+//===-- PhaseProfile.cpp --------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Accounts LLPE's run time, memory and value set allocations to its phases.
+// The phases interleave -- a context's benefit analysis, DIE and commit run
+// as soon as interpretation of it finishes, and TL and DSE rerun over loops
+// and disabled contexts -- so each phase is charged only for the time it is
+// innermost, and the JSON written next to -int-stats-file gives totals per
+// phase plus the run overall. The per-instruction TL and DSE updates made
+// during interpretation are counted as interpretation: timing each one would
+// cost more than the work itself.
+//
+// Separately, -int-context-profile attributes interpretation time and
+// instructions evaluated to the context nesting (function calls, peeled
+// loop iterations named by their header, and loops analysed in general),
+// written as folded stacks that flame graph tools accept directly.
+//
+// -int-status-file keeps a small JSON file up to date while LLPE runs, so
+// that a long or runaway specialisation can be watched (or killed) from
+// outside: the current phase, contexts created, the innermost context being
+// analysed and its nesting depth and pending edges, and memory use. It is
+// rewritten at most every -int-status-interval milliseconds, from the
+// progress dots and phase and context switches, by writing a temporary and
+// renaming it over the old one so readers never see a partial file.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/IR/Function.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+static cl::opt<std::string> ContextProfileFile("int-context-profile", cl::init(""));
+static cl::opt<unsigned> TimeBudget("int-time-budget", cl::init(0));
+static cl::opt<unsigned> ContextTimeBudget("int-context-time-budget", cl::init(0));
+
+namespace {
+
+struct PhaseSample {
+
+  double wall;
+  double cpu;
+  uint64_t maxRSS;
+  uint64_t valueSets;
+
+};
+
+struct PhaseTotals {
+
+  double wall;
+  double cpu;
+  uint64_t entries;
+  uint64_t valueSets;
+  // Growth of the process's peak RSS while this phase was innermost,
+  // and the peak as of the last time it finished.
+  uint64_t rssGrowth;
+  uint64_t peakRSS;
+
+};
+
+}
+
+static bool profileEnabled = false;
+static PhaseSample profileStart;
+static PhaseSample lastSwitch;
+static PhaseTotals totals[PhaseCount];
+static std::vector<LLPEPhase> phaseStack;
+
+static const char* phaseNames[PhaseCount] = {
+
+  "interpret",
+  "benefit",
+  "tl",
+  "dse",
+  "die",
+  "savesplit",
+  "commit",
+  "postcommit"
+
+};
+
+static double getWallTime() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+
+}
+
+static void takeSample(PhaseSample& S) {
+
+  S.wall = getWallTime();
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  S.cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + ((ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+  S.maxRSS = ((uint64_t)ru.ru_maxrss) * 1024;
+
+  S.valueSets = GlobalIHP ? GlobalIHP->IVSAllocations : 0;
+
+}
+
+// Charge everything since the last phase switch to the innermost phase.
+static void chargeInnermost(const PhaseSample& Now) {
+
+  if(!phaseStack.empty()) {
+
+    PhaseTotals& T = totals[phaseStack.back()];
+    T.wall += Now.wall - lastSwitch.wall;
+    T.cpu += Now.cpu - lastSwitch.cpu;
+    T.valueSets += Now.valueSets - lastSwitch.valueSets;
+    T.rssGrowth += Now.maxRSS - lastSwitch.maxRSS;
+
+  }
+
+  lastSwitch = Now;
+
+}
+
+void llvm::enablePhaseProfile() {
+
+  if(profileEnabled)
+    return;
+
+  profileEnabled = true;
+  takeSample(profileStart);
+  lastSwitch = profileStart;
+
+}
+
+PhaseTimer::PhaseTimer(LLPEPhase Phase) {
+
+  active = profileEnabled && (phaseStack.empty() || phaseStack.back() != Phase);
+  if(!active)
+    return;
+
+  PhaseSample Now;
+  takeSample(Now);
+  chargeInnermost(Now);
+
+  phaseStack.push_back(Phase);
+  ++totals[Phase].entries;
+
+  noteProgress();
+
+}
+
+PhaseTimer::~PhaseTimer() {
+
+  if(!active)
+    return;
+
+  PhaseSample Now;
+  takeSample(Now);
+  chargeInnermost(Now);
+
+  totals[phaseStack.back()].peakRSS = Now.maxRSS;
+  phaseStack.pop_back();
+
+}
+
+static void printPhaseJSON(raw_ostream& Out, double wall, double cpu, uint64_t valueSets, uint64_t rssGrowth, uint64_t peakRSS, const uint64_t* entries) {
+
+  Out << "{ \"wall_seconds\": " << format("%.6f", wall)
+      << ", \"cpu_seconds\": " << format("%.6f", cpu);
+  if(entries)
+    Out << ", \"entries\": " << *entries;
+  Out << ", \"value_sets_allocated\": " << valueSets
+      << ", \"peak_rss_growth_bytes\": " << rssGrowth
+      << ", \"peak_rss_bytes\": " << peakRSS << " }";
+
+}
+
+void llvm::writePhaseProfile(raw_ostream& Out) {
+
+  if(!profileEnabled)
+    return;
+
+  // Phases still running (the commit that writes this, for instance) are charged up to now.
+  PhaseSample Now;
+  takeSample(Now);
+  chargeInnermost(Now);
+
+  Out << "{\n  \"phases\": {\n";
+
+  for(uint32_t i = 0; i != PhaseCount; ++i) {
+
+    PhaseTotals& T = totals[i];
+    uint64_t peak = T.peakRSS;
+    for(std::vector<LLPEPhase>::iterator it = phaseStack.begin(), itend = phaseStack.end(); it != itend; ++it)
+      if(*it == (LLPEPhase)i)
+	peak = Now.maxRSS;
+
+    Out << "    \"" << phaseNames[i] << "\": ";
+    printPhaseJSON(Out, T.wall, T.cpu, T.valueSets, T.rssGrowth, peak, &T.entries);
+    Out << (i + 1 == PhaseCount ? "\n" : ",\n");
+
+  }
+
+  Out << "  },\n  \"overall\": ";
+  printPhaseJSON(Out, Now.wall - profileStart.wall, Now.cpu - profileStart.cpu,
+		 Now.valueSets - profileStart.valueSets, Now.maxRSS - profileStart.maxRSS, Now.maxRSS, 0);
+  Out << "\n}\n";
+
+}
+
+// The status file.
+
+static std::string statusFile;
+static double statusInterval;
+static double nextStatusWrite;
+static bool statusFinished = false;
+static uint64_t contextsCommitted = 0;
+// Contexts currently being analysed, innermost last.
+static std::vector<IntegrationAttempt*> statusContexts;
+
+static uint64_t getCurrentRSS() {
+
+  // Resident pages are the second field of statm.
+  FILE* f = fopen("/proc/self/statm", "r");
+  if(!f)
+    return 0;
+
+  unsigned long long size, resident;
+  int read = fscanf(f, "%llu %llu", &size, &resident);
+  fclose(f);
+
+  if(read != 2)
+    return 0;
+  return resident * (uint64_t)sysconf(_SC_PAGESIZE);
+
+}
+
+static void writeStatusFile() {
+
+  PhaseSample Now;
+  takeSample(Now);
+
+  std::string tempFile = statusFile + ".tmp";
+  std::error_code error;
+  {
+    raw_fd_ostream Out(tempFile.c_str(), error, sys::fs::F_None);
+    if(error) {
+      errs() << "Failed to open " << tempFile << ": " << error.message() << "\n";
+      statusFile.clear();
+      return;
+    }
+
+    const char* phase;
+    if(statusFinished)
+      phase = "finished";
+    else if(phaseStack.empty())
+      phase = "setup";
+    else
+      phase = phaseNames[phaseStack.back()];
+
+    uint64_t liveContexts = 0;
+    for(std::vector<void*>::iterator it = GlobalIHP->IAs.begin(), itend = GlobalIHP->IAs.end(); it != itend; ++it)
+      if(*it)
+	++liveContexts;
+
+    Out << "{\n  \"pid\": " << getpid()
+	<< ",\n  \"phase\": \"" << phase << "\""
+	<< ",\n  \"elapsed_seconds\": " << format("%.3f", Now.wall - profileStart.wall)
+	<< ",\n  \"cpu_seconds\": " << format("%.3f", Now.cpu - profileStart.cpu)
+	<< ",\n  \"rss_bytes\": " << getCurrentRSS()
+	<< ",\n  \"peak_rss_bytes\": " << Now.maxRSS
+	<< ",\n  \"contexts_created\": " << GlobalIHP->IAs.size()
+	<< ",\n  \"contexts_live\": " << liveContexts
+	<< ",\n  \"contexts_committed\": " << contextsCommitted
+	<< ",\n  \"instructions_evaluated\": " << GlobalIHP->instructionsEvaluated
+	<< ",\n  \"value_sets_allocated\": " << Now.valueSets
+	<< ",\n  \"context_depth\": " << statusContexts.size();
+
+    if(!statusContexts.empty()) {
+      IntegrationAttempt* IA = statusContexts.back();
+      Out << ",\n  \"innermost_context\": \"" << IA->F.getName() << " #" << IA->SeqNumber << "\""
+	  << ",\n  \"pending_edges\": " << IA->pendingEdges;
+    }
+
+    // How long the remaining phases will take can't be known while interpretation is
+    // still discovering contexts. Once committing, the live contexts are the work left,
+    // so extrapolate from the commit time spent per context so far.
+    Out << ",\n  \"eta_seconds\": ";
+    if(statusFinished)
+      Out << "0";
+    else if((!phaseStack.empty()) && phaseStack.back() == PhaseCommit && contextsCommitted && liveContexts >= contextsCommitted) {
+      double commitWall = totals[PhaseCommit].wall + (Now.wall - lastSwitch.wall);
+      Out << format("%.1f", (commitWall / contextsCommitted) * (liveContexts - contextsCommitted));
+    }
+    else
+      Out << "null";
+
+    Out << "\n}\n";
+  }
+
+  if(std::error_code renameError = sys::fs::rename(tempFile, statusFile))
+    errs() << "Failed to rename " << tempFile << ": " << renameError.message() << "\n";
+
+  nextStatusWrite = Now.wall + statusInterval;
+
+}
+
+void llvm::enableStatusFile(const std::string& Path, uint32_t IntervalMillis) {
+
+  // The phase is part of the status.
+  enablePhaseProfile();
+
+  statusFile = Path;
+  statusInterval = IntervalMillis / 1000.0;
+  nextStatusWrite = 0;
+
+}
+
+void llvm::noteProgress() {
+
+  if(statusFile.empty())
+    return;
+
+  if(getWallTime() < nextStatusWrite)
+    return;
+
+  writeStatusFile();
+
+}
+
+void llvm::noteContextCommitted() {
+
+  ++contextsCommitted;
+  noteProgress();
+
+}
+
+void llvm::finishStatusFile() {
+
+  if(statusFile.empty())
+    return;
+
+  statusFinished = true;
+  writeStatusFile();
+
+}
+
+// The context profile. Every iteration of a peeled loop shares a frame name, so
+// they merge into one entry per stack as a flame graph would want.
+
+namespace {
+
+struct ContextTotals {
+
+  double wall;
+  uint64_t insts;
+
+  ContextTotals() : wall(0), insts(0) { }
+
+};
+
+}
+
+static std::vector<std::string> contextStack;
+static StringMap<ContextTotals> contextTotals;
+static double contextLastWall;
+static uint64_t contextLastInsts;
+
+static void chargeInnermostContext() {
+
+  double now = getWallTime();
+  uint64_t insts = GlobalIHP->instructionsEvaluated;
+
+  if(!contextStack.empty()) {
+
+    ContextTotals& T = contextTotals[contextStack.back()];
+    T.wall += now - contextLastWall;
+    T.insts += insts - contextLastInsts;
+
+  }
+
+  contextLastWall = now;
+  contextLastInsts = insts;
+
+}
+
+ContextTimer::ContextTimer(IntegrationAttempt* IA, const ShadowLoopInvar* L) {
+
+  // A function context's own analyse, not that of a loop within it, times the context.
+  timedIA = 0;
+  if((ContextTimeBudget || reportEnabled()) && IA->getFunctionRoot() == IA && L == IA->L) {
+    timedIA = IA->getFunctionRoot();
+    timedIA->analysisResumed = getWallTime();
+  }
+
+  tracked = !statusFile.empty();
+  if(tracked) {
+    statusContexts.push_back(IA);
+    noteProgress();
+  }
+
+  active = !ContextProfileFile.empty();
+  if(!active)
+    return;
+
+  chargeInnermostContext();
+
+  std::string frame;
+  {
+    raw_string_ostream RSO(frame);
+    if(!contextStack.empty())
+      RSO << contextStack.back() << ";";
+    RSO << IA->F.getName();
+    if(L) {
+      RSO << ":" << IA->getBBInvar(L->headerIdx)->BB->getName();
+      if(L != IA->L)
+	RSO << "(general)";
+    }
+  }
+
+  contextStack.push_back(frame);
+
+}
+
+ContextTimer::~ContextTimer() {
+
+  if(timedIA) {
+    timedIA->analysisTime += getWallTime() - timedIA->analysisResumed;
+    timedIA->analysisResumed = 0;
+  }
+
+  if(tracked)
+    statusContexts.pop_back();
+
+  if(!active)
+    return;
+
+  chargeInnermostContext();
+  contextStack.pop_back();
+
+}
+
+static double timeBudgetStart;
+static bool timeBudgetExceeded = false;
+
+void llvm::startTimeBudget() {
+
+  timeBudgetStart = getWallTime();
+
+}
+
+bool llvm::overTimeBudget(IntegrationAttempt* IA) {
+
+  if(timeBudgetExceeded)
+    return true;
+
+  if((!TimeBudget) && !ContextTimeBudget)
+    return false;
+
+  double now = getWallTime();
+
+  if(TimeBudget && now - timeBudgetStart > TimeBudget) {
+
+    errs() << "Time budget of " << TimeBudget << "s exceeded: no further contexts will be explored\n";
+    timeBudgetExceeded = true;
+    return true;
+
+  }
+
+  // The root is limited only by -int-time-budget.
+  InlineAttempt* Root = IA->getFunctionRoot();
+  if((!ContextTimeBudget) || Root->Callers.empty())
+    return false;
+
+  if(Root->overContextTimeBudget)
+    return true;
+
+  double spent = Root->analysisTime;
+  if(Root->analysisResumed)
+    spent += now - Root->analysisResumed;
+
+  if(spent > ContextTimeBudget) {
+
+    errs() << "Context " << Root->F.getName() << " / " << Root->SeqNumber << " exceeded its time budget of " << ContextTimeBudget << "s: no further contexts will be explored within it\n";
+    Root->overContextTimeBudget = true;
+    return true;
+
+  }
+
+  return false;
+
+}
+
+// Write self time in microseconds to the named file, and instructions evaluated to the
+// same name with .insts appended, one "frame;frame;frame count" line per stack.
+void llvm::writeContextProfile() {
+
+  if(ContextProfileFile.empty())
+    return;
+
+  std::string instsFile = ContextProfileFile + ".insts";
+
+  std::error_code timeError, instsError;
+  raw_fd_ostream TimeOut(ContextProfileFile.c_str(), timeError, sys::fs::F_None);
+  raw_fd_ostream InstsOut(instsFile.c_str(), instsError, sys::fs::F_None);
+  if(timeError || instsError) {
+    errs() << "Failed to open " << ContextProfileFile << " or " << instsFile << "\n";
+    return;
+  }
+
+  for(StringMap<ContextTotals>::iterator it = contextTotals.begin(), itend = contextTotals.end(); it != itend; ++it) {
+
+    uint64_t micros = (uint64_t)(it->second.wall * 1e6);
+    if(micros)
+      TimeOut << it->first() << " " << micros << "\n";
+    if(it->second.insts)
+      InstsOut << it->first() << " " << it->second.insts << "\n";
+
+  }
+
+}
@@ -9,16 +9,41 @@
 
 #include "llvm/Analysis/LLPE.h"
 
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
-
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/STLExtras.h"
+
+#include "llvm/Transforms/Utils/CodeExtractor.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
 
+#include <map>
+
 using namespace llvm;
 
 static cl::opt<bool> SkipPostCommit("int-skip-post-commit");
+static cl::opt<bool> PlainBlockLayout("int-plain-block-layout");
+static cl::opt<bool> OutlineFailedBlocks("int-outline-failed-blocks");
+static cl::opt<unsigned> OutlineFailedMinInsts("int-outline-failed-min-insts", cl::init(32));
+
+static LLPEStat OutlinedFailedRegions("outlined_failed_regions", "Failed-block regions moved out to cold functions");
+static LLPEStat OutlinedFailedInsts("outlined_failed_insts", "Instructions in failed-block regions moved out to cold functions");
+
+// Fold runs of residual write() calls of constant data to the same FD into one call.
+static cl::opt<bool> MergeWrites("int-merge-writes");
+
+static LLPEStat MergedWrites("merged_writes", "Residual write() calls folded into the one before them");
 
 // TODO at some point: fold this stuff into the save procedure.
 
@@ -62,12 +87,340 @@ static BasicBlock* getChainNext(BasicBlock* BB) {
 
 }
 
+// Blocks between a check and a repeat of it that some load in the repeat might see a
+// different value through; more than this and the repeat is kept.
+static cl::opt<unsigned> RepeatCheckRegionLimit("int-repeat-check-region-limit", cl::init(64));
+
+static LLPEStat FoldedRepeatChecks("folded_repeat_checks", "Residual branches folded because they repeat a dominating check");
+static LLPEStat SimplifiedPHIs("simplified_phis", "Residual PHIs with a single value removed");
+
+static bool blockMayWrite(BasicBlock* BB, BasicBlock::iterator from, BasicBlock::iterator to) {
+
+  for(; from != to; ++from) {
+    if(from->mayWriteToMemory())
+      return true;
+  }
+
+  return false;
+
+}
+
+// Might memory seen by load L (in BB) differ from that seen by earlier load PL (in
+// dominating block PBB)? Any write, call or fence on a path between them counts; other
+// threads' writes can only become visible at those too. The blocks between are found by
+// walking back from BB, stopping at PBB.
+static bool mayWriteBetween(LoadInst* PL, LoadInst* L) {
+
+  BasicBlock* PBB = PL->getParent();
+  BasicBlock* BB = L->getParent();
+
+  if(blockMayWrite(BB, BB->begin(), L))
+    return true;
+
+  SmallPtrSet<BasicBlock*, 16> Seen;
+  SmallVector<BasicBlock*, 16> Worklist;
+  Worklist.push_back(BB);
+
+  while(!Worklist.empty()) {
+
+    BasicBlock* Cur = Worklist.pop_back_val();
+
+    for(pred_iterator PI = pred_begin(Cur), PE = pred_end(Cur); PI != PE; ++PI) {
+
+      BasicBlock* Pred = *PI;
+      if(!Seen.insert(Pred).second)
+	continue;
+
+      if(Seen.size() > RepeatCheckRegionLimit)
+	return true;
+
+      if(Pred == PBB) {
+	BasicBlock::iterator afterPL(PL);
+	if(blockMayWrite(PBB, ++afterPL, PBB->end()))
+	  return true;
+	continue;
+      }
+
+      // BB reached again round a loop: all of it lies between.
+      if(blockMayWrite(Pred, Pred->begin(), Pred->end()))
+	return true;
+
+      Worklist.push_back(Pred);
+
+    }
+
+  }
+
+  return false;
+
+}
+
+// Commit emits each context's checks separately, and each context reloads what it checks,
+// so a function specialised several times in a row, or a check repeated in child contexts
+// and later loop iterations, often branches on the same test again before anything could
+// change it. Operands are the same if they are the same value, or loads of the same
+// pointer with nothing between that might write.
+static bool sameCheckOperand(Value* PV, Value* V) {
+
+  if(PV == V)
+    return true;
+
+  LoadInst* PL = dyn_cast<LoadInst>(PV);
+  LoadInst* L = dyn_cast<LoadInst>(V);
+  if((!PL) || (!L) || !(PL->isSimple() && L->isSimple()))
+    return false;
+
+  if(PL->getType() != L->getType() || PL->getPointerOperand() != L->getPointerOperand())
+    return false;
+
+  return !mayWriteBetween(PL, L);
+
+}
+
+static bool sameCheck(Value* PCond, Value* Cond) {
+
+  if(PCond == Cond)
+    return true;
+
+  ICmpInst* PCmp = dyn_cast<ICmpInst>(PCond);
+  ICmpInst* Cmp = dyn_cast<ICmpInst>(Cond);
+  if((!PCmp) || (!Cmp))
+    return false;
+
+  if(PCmp->isIdenticalTo(Cmp))
+    return true;
+
+  return PCmp->getPredicate() == Cmp->getPredicate() &&
+    sameCheckOperand(PCmp->getOperand(0), Cmp->getOperand(0)) &&
+    sameCheckOperand(PCmp->getOperand(1), Cmp->getOperand(1));
+
+}
+
+// Find whether every path to BB already took a branch on the same test, and if so which
+// way: walk up BB's dominators looking for a conditional branch one of whose edges
+// dominates BB.
+static bool getDominatingCheck(BasicBlock* BB, Value* Cond, DominatorTree& DT, bool& Taken) {
+
+  DomTreeNode* Node = DT.getNode(BB);
+  if(!Node)
+    return false;
+
+  for(unsigned i = 0; i != 16; ++i) {
+
+    Node = Node->getIDom();
+    if(!Node)
+      return false;
+
+    BasicBlock* Dom = Node->getBlock();
+    BranchInst* PBI = dyn_cast_or_null<BranchInst>(Dom->getTerminator());
+    if((!PBI) || !PBI->isConditional() || PBI->getSuccessor(0) == PBI->getSuccessor(1))
+      continue;
+
+    int32_t takenIdx = -1;
+    for(uint32_t j = 0; j != 2 && takenIdx == -1; ++j) {
+      if(DT.dominates(BasicBlockEdge(Dom, PBI->getSuccessor(j)), BB))
+	takenIdx = j;
+    }
+
+    if(takenIdx == -1)
+      continue;
+
+    if(sameCheck(PBI->getCondition(), Cond)) {
+      Taken = takenIdx == 0;
+      return true;
+    }
+
+  }
+
+  return false;
+
+}
+
+// Removing the untaken edge only narrows the paths to each block, so DT's dominance facts
+// still hold for the blocks folded after this one.
+static void foldRepeatedCheck(BasicBlock* BB, DominatorTree& DT) {
+
+  BranchInst* BI = dyn_cast_or_null<BranchInst>(BB->getTerminator());
+  if((!BI) || !BI->isConditional() || isa<Constant>(BI->getCondition()))
+    return;
+
+  bool Taken;
+  if(!getDominatingCheck(BB, BI->getCondition(), DT, Taken))
+    return;
+
+  BasicBlock* Target = BI->getSuccessor(Taken ? 0 : 1);
+  BasicBlock* Untaken = BI->getSuccessor(Taken ? 1 : 0);
+  if(Target != Untaken)
+    Untaken->removePredecessor(BB);
+
+  BranchInst::Create(Target, BI);
+  BI->eraseFromParent();
+  ++FoldedRepeatChecks;
+
+}
+
+// Merging paths where commit couldn't tell values apart, particularly the failed paths'
+// PHIs, leaves PHIs whose incoming values are all the same.
+static void simplifyPHIs(BasicBlock* BB) {
+
+  for(BasicBlock::iterator II = BB->begin(); PHINode* PN = dyn_cast<PHINode>(II);) {
+
+    ++II;
+
+    Value* V = PN->hasConstantValue();
+    // An instruction used on every edge need not dominate the PHI unless there's only one.
+    if((!V) || (isa<Instruction>(V) && PN->getNumIncomingValues() != 1))
+      continue;
+
+    PN->replaceAllUsesWith(V);
+    PN->eraseFromParent();
+    ++SimplifiedPHIs;
+
+  }
+
+}
+
+// Is CI a write() of Len bytes of constant data whose result nobody looks at? A write
+// that isn't checked can't tell a short write of the merged buffer from short writes of
+// its parts, so only those are merged.
+static bool getConstantWrite(CallInst* CI, Value*& FD, StringRef& Bytes) {
+
+  Function* F = CI->getCalledFunction();
+  if((!F) || F->getName() != "write" || CI->getNumArgOperands() != 3 || !CI->use_empty())
+    return false;
+
+  ConstantInt* Len = dyn_cast<ConstantInt>(CI->getArgOperand(2));
+  if(!Len)
+    return false;
+
+  StringRef Str;
+  if((!getConstantStringInfo(CI->getArgOperand(1), Str, 0, false)) || Str.size() < Len->getLimitedValue())
+    return false;
+
+  FD = CI->getArgOperand(0);
+  Bytes = Str.substr(0, Len->getLimitedValue());
+  return true;
+
+}
+
+// Could moving a write from after I to before it be seen? Any other call might read the
+// FD, write elsewhere or not return; plain computation and memory accesses can't.
+static bool isWriteBarrier(Instruction* I) {
+
+  if(isa<DbgInfoIntrinsic>(I))
+    return false;
+
+  if(IntrinsicInst* II = dyn_cast<IntrinsicInst>(I)) {
+    if(II->getIntrinsicID() == Intrinsic::lifetime_start || II->getIntrinsicID() == Intrinsic::lifetime_end)
+      return false;
+  }
+
+  if(isa<CallInst>(I) || isa<InvokeInst>(I) || isa<FenceInst>(I) ||
+     isa<AtomicCmpXchgInst>(I) || isa<AtomicRMWInst>(I))
+    return true;
+
+  if(LoadInst* LI = dyn_cast<LoadInst>(I))
+    return !LI->isUnordered();
+  if(StoreInst* SI = dyn_cast<StoreInst>(I))
+    return !SI->isUnordered();
+
+  return false;
+
+}
+
+// Give the first of Run the bytes of all of them, and delete the rest.
+static void flushMergedWrites(SmallVector<CallInst*, 4>& Run, std::string& Bytes) {
+
+  if(Run.size() > 1) {
+
+    CallInst* First = Run[0];
+    LLVMContext& Ctx = First->getContext();
+    Constant* Init = ConstantDataArray::get(Ctx, ArrayRef<uint8_t>((const uint8_t*)Bytes.data(), Bytes.size()));
+    GlobalVariable* G = new GlobalVariable(*First->getParent()->getParent()->getParent(), Init->getType(), true,
+					   GlobalValue::PrivateLinkage, Init, "merged_write");
+    G->setUnnamedAddr(true);
+
+    First->setArgOperand(1, ConstantExpr::getPointerCast(G, First->getArgOperand(1)->getType()));
+    First->setArgOperand(2, ConstantInt::get(First->getArgOperand(2)->getType(), Bytes.size()));
+
+    for(SmallVector<CallInst*, 4>::iterator it = Run.begin() + 1, itend = Run.end(); it != itend; ++it)
+      (*it)->eraseFromParent();
+
+    MergedWrites += (Run.size() - 1);
+
+  }
+
+  Run.clear();
+  Bytes.clear();
+
+}
+
+// Output loops that analysis unrolled leave a write() per iteration, each a syscall at
+// runtime; where their data is known and nothing between them could notice, make one.
+static void mergeWrites(BasicBlock* BB) {
+
+  SmallVector<CallInst*, 4> Run;
+  std::string Bytes;
+  Value* RunFD = 0;
+
+  for(BasicBlock::iterator II = BB->begin(), IE = BB->end(); II != IE;) {
+
+    Instruction* I = II++;
+
+    Value* FD;
+    StringRef WriteBytes;
+    if(CallInst* CI = dyn_cast<CallInst>(I)) {
+
+      if(getConstantWrite(CI, FD, WriteBytes)) {
+
+	if(Run.empty() || FD != RunFD)
+	  flushMergedWrites(Run, Bytes);
+
+	Run.push_back(CI);
+	Bytes.append(WriteBytes.begin(), WriteBytes.end());
+	RunFD = FD;
+	continue;
+
+      }
+
+    }
+
+    if(isWriteBarrier(I))
+      flushMergedWrites(Run, Bytes);
+
+  }
+
+  flushMergedWrites(Run, Bytes);
+
+}
+
 template<class T, class Callback> void postCommitOptimiseBlocks(T itstart, T itend, Callback& CB, Function::iterator& firstFailedBlock) {
 
+  // Drop branches that repeat a check already made on the way to their block, and PHIs
+  // left with a single value. Both can leave dead comparisons for the step below.
+  // Blocks left unreachable are cleaned up by the usual downstream optimisation.
+
   // Zap any instructions we've created that are trivially dead.
   // TODO: improve DIE to catch more cases like this before synthesis, or adopt
   // on-demand synthesis to similar effect.
 
+  if(itstart != itend) {
+
+    DominatorTree DT;
+    DT.recalculate(*((BasicBlock*)itstart)->getParent());
+    for(T it = itstart; it != itend; ++it)
+      foldRepeatedCheck(it, DT);
+
+  }
+
+  for(T it = itstart; it != itend; ++it)
+    simplifyPHIs(it);
+
+  if(MergeWrites) {
+    for(T it = itstart; it != itend; ++it)
+      mergeWrites(it);
+  }
+
   std::vector<Instruction*> Del;
 
   for(T it = itstart; it != itend; ++it) {
@@ -87,6 +440,34 @@ template<class T, class Callback> void postCommitOptimiseBlocks(T itstart, T ite
 
   Del.clear();
 
+  // Remove blocks that only forward to their successor, which commit leaves on many
+  // edges and which otherwise took a -jump-threading run to clean up. This rewrites the
+  // predecessors to branch straight to the successor, merging PHI entries as needed,
+  // and can leave longer chains for the step below.
+
+  std::vector<BasicBlock*> Forwarders;
+
+  for(T it = itstart; it != itend; ++it) {
+
+    BasicBlock* BB = it;
+    BranchInst* BI = dyn_cast_or_null<BranchInst>(BB->getTerminator());
+    if(BI && BI->isUnconditional() && BB->getFirstNonPHIOrDbg() == BI && BB != &BB->getParent()->getEntryBlock() && !BB->hasAddressTaken())
+      Forwarders.push_back(BB);
+
+  }
+
+  for(std::vector<BasicBlock*>::iterator fit = Forwarders.begin(), fend = Forwarders.end(); fit != fend; ++fit) {
+
+    BasicBlock* BB = *fit;
+    bool wasFirstFailed = Function::iterator(BB) == firstFailedBlock;
+    Function::iterator nextBlock = BB;
+    ++nextBlock;
+
+    if(TryToSimplifyUncondBranchFromEmptyBlock(BB) && wasFirstFailed)
+      firstFailedBlock = nextBlock;
+
+  }
+
   // Now coalesce any long chains of BBs.
 
   std::vector<std::vector<BasicBlock*> > Chains;
@@ -232,10 +613,49 @@ struct DerefAdaptor {
 
 };
 
+// As createTopOrderingFrom, but visit BB's successors coldest first, so that the hottest
+// follows BB in the reversed order and the likely path is laid out as fall-throughs.
+// Blocks commit didn't weigh are taken to be as hot as the block branching to them.
+static void createHotTopOrderingFrom(BasicBlock* BB, double weight, std::vector<BasicBlock*>& Result, SmallSet<BasicBlock*, 8>& Visited) {
+
+  if(!Visited.insert(BB).second)
+    return;
+
+  ValueMap<BasicBlock*, double>& Weights = GlobalIHP->committedBlockWeights;
+  SmallVector<std::pair<double, BasicBlock*>, 4> Succs;
+
+  for(succ_iterator SI = succ_begin(BB), SE = succ_end(BB); SI != SE; ++SI) {
+
+    ValueMap<BasicBlock*, double>::iterator findit = Weights.find(*SI);
+    Succs.push_back(std::make_pair(findit == Weights.end() ? weight : findit->second, *SI));
+
+  }
+
+  std::stable_sort(Succs.begin(), Succs.end(), less_first());
+
+  for(SmallVector<std::pair<double, BasicBlock*>, 4>::iterator it = Succs.begin(), itend = Succs.end(); it != itend; ++it)
+    createHotTopOrderingFrom(it->second, it->first, Result, Visited);
+
+  Result.push_back(BB);
+
+}
+
+static void forgetBlockWeights(Function* F) {
+
+  for(Function::iterator it = F->begin(), itend = F->end(); it != itend; ++it)
+    GlobalIHP->committedBlockWeights.erase(it);
+
+}
+
 void InlineAttempt::postCommitOptimise() {
 
-  if(SkipPostCommit)
+  PhaseTimer Timer(PhasePostCommit);
+
+  if(SkipPostCommit) {
+    if(CommitF)
+      forgetBlockWeights(CommitF);
     return;
+  }
 
   if(CommitF) {
     
@@ -251,7 +671,10 @@ void InlineAttempt::postCommitOptimise() {
 
       BasicBlock* firstBlock = &CommitF->getEntryBlock();
       std::vector<BasicBlock*> Ordered;
-      createTopOrderingFrom(firstBlock, Ordered, Visited, 0, 0);
+      if(PlainBlockLayout)
+	createTopOrderingFrom(firstBlock, Ordered, Visited, 0, 0);
+      else
+	createHotTopOrderingFrom(firstBlock, 1.0, Ordered, Visited);
       std::reverse(Ordered.begin(), Ordered.end());
 
       Function::BasicBlockListType& BBL = CommitF->getBasicBlockList();
@@ -271,6 +694,9 @@ void InlineAttempt::postCommitOptimise() {
 
     }
 
+    forgetBlockWeights(CommitF);
+    outlineFailedBlocks();
+
   }
   else {
 
@@ -280,3 +706,360 @@ void InlineAttempt::postCommitOptimise() {
   }
    
 }
+
+// Can BB be moved into an outlined function? Not if it needs this function's frame, and
+// not if CodeExtractor can't move it.
+static bool canOutlineBlock(BasicBlock* BB) {
+
+  if(BB->isLandingPad() || BB->hasAddressTaken())
+    return false;
+
+  for(BasicBlock::iterator it = BB->begin(), itend = BB->end(); it != itend; ++it) {
+
+    if(isa<AllocaInst>(it) || isa<InvokeInst>(it))
+      return false;
+
+    CallInst* CI = dyn_cast<CallInst>(it);
+    if(!CI)
+      continue;
+
+    if(CI->canReturnTwice() || CI->isMustTailCall())
+      return false;
+
+    if(IntrinsicInst* II = dyn_cast<IntrinsicInst>(CI)) {
+
+      switch(II->getIntrinsicID()) {
+      case Intrinsic::vastart:
+      case Intrinsic::stacksave:
+      case Intrinsic::stackrestore:
+      case Intrinsic::frameaddress:
+      case Intrinsic::returnaddress:
+	return false;
+      default:
+	break;
+      }
+
+    }
+
+  }
+
+  return true;
+
+}
+
+// Gather the failed blocks Header dominates into Region, keeping only those entered from
+// within it, so that it is single-entry as CodeExtractor requires.
+static void getFailedRegion(DomTreeNode* Header, SmallPtrSet<BasicBlock*, 16>& Outlinable,
+			    SmallPtrSet<BasicBlock*, 16>& Taken, SmallVector<BasicBlock*, 16>& Region) {
+
+  SmallPtrSet<BasicBlock*, 16> InRegion;
+  SmallVector<DomTreeNode*, 16> Worklist;
+  Worklist.push_back(Header);
+
+  while(!Worklist.empty()) {
+
+    DomTreeNode* N = Worklist.pop_back_val();
+    BasicBlock* BB = N->getBlock();
+    if(!Outlinable.count(BB) || Taken.count(BB))
+      continue;
+
+    InRegion.insert(BB);
+    Worklist.append(N->begin(), N->end());
+
+  }
+
+  // Dropping a block entered from outside can leave its successors entered from outside.
+  bool changed = true;
+  while(changed) {
+
+    SmallVector<BasicBlock*, 4> Entered;
+
+    for(SmallPtrSet<BasicBlock*, 16>::iterator it = InRegion.begin(), itend = InRegion.end(); it != itend; ++it) {
+
+      BasicBlock* BB = *it;
+      if(BB == Header->getBlock())
+	continue;
+
+      for(pred_iterator PI = pred_begin(BB), PE = pred_end(BB); PI != PE; ++PI) {
+	if(!InRegion.count(*PI)) {
+	  Entered.push_back(BB);
+	  break;
+	}
+      }
+
+    }
+
+    for(SmallVector<BasicBlock*, 4>::iterator it = Entered.begin(), itend = Entered.end(); it != itend; ++it)
+      InRegion.erase(*it);
+
+    changed = !Entered.empty();
+
+  }
+
+  // CodeExtractor gives each exit one incoming edge from the call, so it can't keep apart
+  // a PHI's values from two blocks of the region.
+  for(SmallPtrSet<BasicBlock*, 16>::iterator it = InRegion.begin(), itend = InRegion.end(); it != itend; ++it) {
+
+    for(succ_iterator SI = succ_begin(*it), SE = succ_end(*it); SI != SE; ++SI) {
+
+      BasicBlock* Exit = *SI;
+      if(InRegion.count(Exit) || !isa<PHINode>(Exit->begin()))
+	continue;
+
+      SmallPtrSet<BasicBlock*, 4> RegionPreds;
+      for(pred_iterator PI = pred_begin(Exit), PE = pred_end(Exit); PI != PE; ++PI) {
+	if(InRegion.count(*PI))
+	  RegionPreds.insert(*PI);
+      }
+
+      if(RegionPreds.size() > 1)
+	return;
+
+    }
+
+  }
+
+  // Header first, as CodeExtractor expects; the rest in function order.
+  Region.push_back(Header->getBlock());
+  Function* F = Header->getBlock()->getParent();
+  for(Function::iterator it = F->begin(), itend = F->end(); it != itend; ++it) {
+    if(&*it != Header->getBlock() && InRegion.count(it))
+      Region.push_back(it);
+  }
+
+}
+
+// Failed blocks are the unspecialised code run after a check fails, and can be as big as
+// the specialised code they back up. Move the regions of them that are entered in one
+// place out to cold, non-inlinable functions, so the specialised function stays small
+// enough to inline and its hot path stays dense. Live values go in as arguments and out
+// through pointers, and the call branches on to wherever the region left to.
+void InlineAttempt::outlineFailedBlocks() {
+
+  if(!OutlineFailedBlocks || firstFailedBlock == CommitF->end())
+    return;
+
+  SmallPtrSet<BasicBlock*, 16> Outlinable;
+  for(Function::iterator it = firstFailedBlock, itend = CommitF->end(); it != itend; ++it) {
+    if(canOutlineBlock(it))
+      Outlinable.insert(it);
+  }
+
+  if(Outlinable.empty())
+    return;
+
+  DominatorTree DT;
+  DT.recalculate(*CommitF);
+
+  // Visit dominators first, so each region is as big as it can be. Regions found from the
+  // same tree stay valid as the others are extracted, since none enters another but at
+  // its header.
+  SmallPtrSet<BasicBlock*, 16> Taken;
+  std::vector<SmallVector<BasicBlock*, 16> > Regions;
+
+  for(df_iterator<DomTreeNode*> it = df_begin(DT.getRootNode()), itend = df_end(DT.getRootNode()); it != itend; ++it) {
+
+    BasicBlock* BB = it->getBlock();
+    if(!Outlinable.count(BB) || Taken.count(BB))
+      continue;
+
+    SmallVector<BasicBlock*, 16> Region;
+    getFailedRegion(*it, Outlinable, Taken, Region);
+    if(Region.empty())
+      continue;
+
+    uint32_t insts = 0;
+    for(SmallVector<BasicBlock*, 16>::iterator regit = Region.begin(), regend = Region.end(); regit != regend; ++regit)
+      insts += (*regit)->size();
+
+    if(insts < OutlineFailedMinInsts)
+      continue;
+
+    Taken.insert(Region.begin(), Region.end());
+    Regions.push_back(Region);
+
+  }
+
+  // Extraction adds its call blocks in among the failed blocks; they still start after the
+  // last specialised block.
+  Function::iterator lastSpecBlock = firstFailedBlock;
+  --lastSpecBlock;
+
+  for(std::vector<SmallVector<BasicBlock*, 16> >::iterator it = Regions.begin(), itend = Regions.end(); it != itend; ++it) {
+
+    CodeExtractor CE(*it);
+    if(!CE.isEligible())
+      continue;
+
+    uint32_t insts = 0;
+    for(SmallVector<BasicBlock*, 16>::iterator regit = it->begin(), regend = it->end(); regit != regend; ++regit)
+      insts += (*regit)->size();
+
+    Function* Outlined = CE.extractCodeRegion();
+    if(!Outlined)
+      continue;
+
+    Outlined->addFnAttr(Attribute::Cold);
+    Outlined->addFnAttr(Attribute::NoInline);
+
+    ++OutlinedFailedRegions;
+    OutlinedFailedInsts += insts;
+
+  }
+
+  firstFailedBlock = lastSpecBlock;
+  ++firstFailedBlock;
+
+}
+
+// When function sharing fails, for example because one irrelevant dependency differs, we can
+// commit many identical copies of a specialised function. Find split functions that are
+// identical up to renaming of their arguments, blocks and instructions, and keep one of each.
+
+static hash_code hashFunctionShape(Function* F) {
+
+  hash_code H = hash_combine(F->getFunctionType(), F->size());
+
+  for(Function::iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+
+    H = hash_combine(H, BI->size());
+    for(BasicBlock::iterator II = BI->begin(), IE = BI->end(); II != IE; ++II)
+      H = hash_combine(H, II->getOpcode(), II->getType(), II->getNumOperands());
+
+  }
+
+  return H;
+
+}
+
+static bool valuesCorrespond(Value* V1, Value* V2, DenseMap<Value*, Value*>& Map) {
+
+  if(V1 == V2)
+    return true;
+
+  DenseMap<Value*, Value*>::iterator it = Map.find(V2);
+  return it != Map.end() && it->second == V1;
+
+}
+
+// Can F2 be replaced by F1?
+static bool functionsIdentical(Function* F1, Function* F2) {
+
+  if(F1->getFunctionType() != F2->getFunctionType() || F1->getAttributes() != F2->getAttributes() ||
+     F1->getCallingConv() != F2->getCallingConv() || F1->hasGC() != F2->hasGC() ||
+     F1->getSection() != F2->getSection() || F1->getAlignment() != F2->getAlignment() ||
+     F1->size() != F2->size())
+    return false;
+
+  // Map F2's values to F1's; a call from F2 to itself matches one from F1 to itself.
+  DenseMap<Value*, Value*> Map;
+  Map[F2] = F1;
+
+  for(Function::arg_iterator A1 = F1->arg_begin(), A2 = F2->arg_begin(), AE = F1->arg_end(); A1 != AE; ++A1, ++A2)
+    Map[&*A2] = &*A1;
+
+  // Instructions may use values defined later, so map everything before comparing operands.
+  for(Function::iterator B1 = F1->begin(), B2 = F2->begin(), BE = F1->end(); B1 != BE; ++B1, ++B2) {
+
+    if(B1->size() != B2->size())
+      return false;
+    Map[&*B2] = &*B1;
+
+    for(BasicBlock::iterator I1 = B1->begin(), I2 = B2->begin(), IE = B1->end(); I1 != IE; ++I1, ++I2) {
+
+      if(!I1->isSameOperationAs(&*I2))
+	return false;
+      Map[&*I2] = &*I1;
+
+    }
+
+  }
+
+  for(inst_iterator I1 = inst_begin(F1), I2 = inst_begin(F2), IE = inst_end(F1); I1 != IE; ++I1, ++I2) {
+
+    for(uint32_t i = 0, ilim = I1->getNumOperands(); i != ilim; ++i) {
+
+      if(!valuesCorrespond(I1->getOperand(i), I2->getOperand(i), Map))
+	return false;
+
+    }
+
+    if(PHINode* PN1 = dyn_cast<PHINode>(&*I1)) {
+
+      PHINode* PN2 = cast<PHINode>(&*I2);
+      for(uint32_t i = 0, ilim = PN1->getNumIncomingValues(); i != ilim; ++i) {
+
+	if(!valuesCorrespond(PN1->getIncomingBlock(i), PN2->getIncomingBlock(i), Map))
+	  return false;
+
+      }
+
+    }
+
+  }
+
+  return true;
+
+}
+
+// Merge each of Fs into an earlier member identical to it, returning the number erased.
+// The caller must only offer functions that are called directly, since merging others
+// would change the result of comparing their addresses.
+uint32_t llvm::mergeFunctionList(const std::vector<Function*>& Fs) {
+
+  std::map<size_t, SmallVector<Function*, 2> > Buckets;
+  uint32_t nMerged = 0;
+
+  for(std::vector<Function*>::const_iterator it = Fs.begin(), itend = Fs.end(); it != itend; ++it) {
+
+    Function* F = *it;
+    SmallVector<Function*, 2>& Candidates = Buckets[hashFunctionShape(F)];
+
+    bool merged = false;
+    for(SmallVector<Function*, 2>::iterator candit = Candidates.begin(), 
+	  candend = Candidates.end(); candit != candend && !merged; ++candit) {
+
+      if(functionsIdentical(*candit, F)) {
+
+	F->replaceAllUsesWith(*candit);
+	F->eraseFromParent();
+	++nMerged;
+	merged = true;
+
+      }
+
+    }
+
+    if(!merged)
+      Candidates.push_back(F);
+
+  }
+
+  return nMerged;
+
+}
+
+void LLPEAnalysisPass::mergeIdenticalFunctions() {
+
+  if(SkipPostCommit)
+    return;
+
+  std::vector<Function*> Fs;
+
+  for(std::vector<WeakVH>::iterator it = splitCommitFunctions.begin(), itend = splitCommitFunctions.end(); it != itend; ++it) {
+
+    // Discarded along with its context?
+    Function* F = cast_or_null<Function>(*it);
+    if((!F) || F->isDeclaration())
+      continue;
+
+    if((!F->hasLocalLinkage()) || F->hasAddressTaken() || F == RootIA->CommitF)
+      continue;
+
+    Fs.push_back(F);
+
+  }
+
+  stats.mergedFunctions += mergeFunctionList(Fs);
+
+}
@@ -19,36 +19,66 @@
 #include "llvm/IR/Module.h"
 #include "llvm/Analysis/MemoryDependenceAnalysis.h"
 #include "llvm/Assembly/Writer.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/FormattedStream.h"
 
 using namespace llvm;
 
+// Rendering one instruction costs about as much as rendering its whole function (the
+// printer numbers every value in the function each time), so text is cached a function
+// at a time. Only the most recently printed -int-text-cache-functions are kept, so that
+// verbose diagnostics that touch every function don't hold the whole module's text.
+static cl::opt<unsigned> TextCacheFunctions("int-text-cache-functions", cl::init(64));
+
 DenseMap<const Value*, std::string>& LLPEAnalysisPass::getFunctionCache(const Function* F, bool brief) {
 
-  DenseMap<const Function*, DenseMap<const Value*, std::string>* >& Map = brief ? briefFunctionTextCache : functionTextCache;
-  DenseMap<const Function*, DenseMap<const Value*, std::string>* >::iterator FI = Map.find(F);
-  
-  if(FI == Map.end()) {
-    DenseMap<const Value*, std::string>* FullMap = functionTextCache[F] = new DenseMap<const Value*, std::string>();
-    DenseMap<const Value*, std::string>* BriefMap = briefFunctionTextCache[F] = new DenseMap<const Value*, std::string>();
-    getInstructionsText(persistPrinter, F, *FullMap, *BriefMap);
-    return brief ? *BriefMap : *FullMap;
+  DenseMap<const Function*, FunctionTextCache*>::iterator FI = functionTextCache.find(F);
+  FunctionTextCache* Cache;
+
+  if(FI == functionTextCache.end()) {
+
+    if(TextCacheFunctions && functionTextCache.size() >= TextCacheFunctions) {
+
+      const Function* Evict = functionTextLRU.back();
+      functionTextLRU.pop_back();
+      DenseMap<const Function*, FunctionTextCache*>::iterator EvictIt = functionTextCache.find(Evict);
+      delete EvictIt->second;
+      functionTextCache.erase(EvictIt);
+
+    }
+
+    Cache = functionTextCache[F] = new FunctionTextCache();
+    getInstructionsText(persistPrinter, F, Cache->Full, Cache->Brief);
+    functionTextLRU.push_front(F);
+    Cache->LRUPos = functionTextLRU.begin();
+
   }
   else {
-    return *(FI->second);
+
+    Cache = FI->second;
+    functionTextLRU.splice(functionTextLRU.begin(), functionTextLRU, Cache->LRUPos);
+
   }
 
+  return brief ? Cache->Brief : Cache->Full;
+
 }
 
 void LLPEAnalysisPass::populateGVCaches(const Module* M) {
 
   getGVText(persistPrinter, M, GVCache, GVCacheBrief);
+  GVCachePopulated = true;
 
 }
 
+// Like the function caches, built the first time something is printed: printing every
+// global up front is a large share of start-up on big modules, and most runs print none.
 DenseMap<const GlobalVariable*, std::string>& LLPEAnalysisPass::getGVCache(bool brief) {
 
+  if(!GVCachePopulated)
+    populateGVCaches(getGlobalModule());
+
   return brief ? GVCacheBrief : GVCache;
 
 }
@@ -103,7 +133,7 @@ void LLPEAnalysisPass::printValue(raw_ostream& Stream, ShadowValue V, bool brief
     Stream << "NULL";
   }
   else if(V.isConstantInt()) {
-    Stream << (*V.getNonPointerType()) << " " << V.u.CI;
+    Stream << (*V.getNonPointerType()) << " " << V.getCIValue();
   }
   else if(Value* V2 = V.getVal()) {
     printValue(Stream, V2, brief);
@@ -120,16 +150,16 @@ void LLPEAnalysisPass::printValue(raw_ostream& Stream, ShadowValue V, bool brief
     printValue(Stream, GV->G, brief);
   }
   else if(V.isPtrIdx()) {
-    if(V.u.PtrOrFd.frame == -1)
-      Stream << "G/H alloc " << V.u.PtrOrFd.idx;
+    if(V.getIdxFrame() == -1)
+      Stream << "G/H alloc " << V.getIdx();
     else
-      Stream << "S alloc " << V.u.PtrOrFd.frame << " / " << V.u.PtrOrFd.idx;
+      Stream << "S alloc " << V.getIdxFrame() << " / " << V.getIdx();
   }
   else if(V.isFdIdx()) {
     Stream << "FD ";
-    if(V.t == SHADOWVAL_FDIDX64)
+    if(V.getValType() == SHADOWVAL_FDIDX64)
       Stream << "[64] ";
-    Stream << V.u.PtrOrFd.idx;
+    Stream << V.getIdx();
   }
 
 }
@@ -0,0 +1,250 @@
+//===-- Report.cpp --------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// A headless report of a specialisation run, enabled with -int-report-dir=DIR, for
+// triaging big runs without the GUI. Each context is summarised as it is released after
+// commit, so this works with -integrator-accept-all, when contexts aren't kept for the
+// GUI. At the end of commit DIR is filled with:
+//
+//   index.html          a static viewer, needing nothing but a browser
+//   summary.js          the run's GlobalStats, as for -int-stats-file's JSON
+//   pages/ORDER-N.js    page N of the contexts, sorted by ORDER: residual instructions
+//                       ("residual") or wall-clock analysis time ("time")
+//
+// Pages are scripts rather than JSON so that the viewer can load them on demand from a
+// file:// URL; each calls llpeReportPage(order, index, rows).
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+static cl::opt<std::string> ReportDir("int-report-dir");
+static cl::opt<unsigned> ReportPageSize("int-report-page-size", cl::init(500));
+
+namespace {
+
+struct ReportContext {
+
+  uint64_t seq;
+  int64_t parent;
+  std::string header;
+  std::string function;
+  int64_t instructions;
+  int64_t residual;
+  double time;
+  uint32_t checks;
+  bool enabled;
+
+};
+
+}
+
+static std::vector<ReportContext> reportContexts;
+
+bool llvm::reportEnabled() {
+
+  return !ReportDir.empty();
+
+}
+
+void llvm::noteReportContext(IntegrationAttempt* IA) {
+
+  if(ReportDir.empty())
+    return;
+
+  reportContexts.resize(reportContexts.size() + 1);
+  ReportContext& R = reportContexts.back();
+
+  IntegrationAttempt* Parent = IA->getUniqueParent();
+  R.seq = IA->SeqNumber;
+  R.parent = Parent ? (int64_t)Parent->SeqNumber : -1;
+  R.header = IA->getShortHeader();
+  R.function = IA->F.getName();
+  R.instructions = IA->getTotalInstructions();
+  R.residual = R.instructions - IA->getElimdInstructions();
+  R.time = IA->analysisTime;
+  R.checks = IA->checkedInstructionsHere;
+  R.enabled = IA->isEnabled();
+
+}
+
+static void printReportString(raw_ostream& Out, StringRef Str) {
+
+  Out << '"';
+  for(StringRef::iterator it = Str.begin(), itend = Str.end(); it != itend; ++it) {
+
+    // '<' too, so that a header can't end the script element it's loaded into.
+    if(*it == '"' || *it == '\\')
+      Out << '\\' << *it;
+    else if((unsigned char)*it < 0x20 || *it == '<')
+      Out << format("\\u%04x", (unsigned)(unsigned char)*it);
+    else
+      Out << *it;
+
+  }
+  Out << '"';
+
+}
+
+static bool residualGreater(const ReportContext* A, const ReportContext* B) {
+
+  return A->residual > B->residual;
+
+}
+
+static bool timeGreater(const ReportContext* A, const ReportContext* B) {
+
+  return A->time > B->time;
+
+}
+
+static bool openReportFile(const std::string& Name, std::unique_ptr<raw_fd_ostream>& Out) {
+
+  std::string Path = ReportDir + "/" + Name;
+  std::error_code error;
+  Out.reset(new raw_fd_ostream(Path.c_str(), error, sys::fs::F_None));
+  if(error) {
+    errs() << "Failed to open " << Path << ": " << error.message() << "\n";
+    return false;
+  }
+  return true;
+
+}
+
+static uint32_t writeReportPages(const char* Order, std::vector<const ReportContext*>& Sorted) {
+
+  uint32_t pageSize = std::max(ReportPageSize.getValue(), 1u);
+  uint32_t nPages = 0;
+
+  for(uint32_t start = 0, end = Sorted.size(); start < end || !nPages; start += pageSize, ++nPages) {
+
+    std::string Name;
+    {
+      raw_string_ostream RSO(Name);
+      RSO << "pages/" << Order << "-" << nPages << ".js";
+    }
+
+    std::unique_ptr<raw_fd_ostream> Out;
+    if(!openReportFile(Name, Out))
+      return 0;
+
+    *Out << "llpeReportPage(\"" << Order << "\", " << nPages << ", [\n";
+
+    for(uint32_t i = start, ilim = std::min(start + pageSize, end); i < ilim; ++i) {
+
+      const ReportContext& R = *Sorted[i];
+      *Out << "  [" << R.seq << ", " << R.parent << ", ";
+      printReportString(*Out, R.header);
+      *Out << ", ";
+      printReportString(*Out, R.function);
+      *Out << ", " << R.instructions << ", " << R.residual << ", " << format("%.6f", R.time) << ", "
+	   << R.checks << ", " << (R.enabled ? "true" : "false") << "]" << (i + 1 == ilim ? "\n" : ",\n");
+
+    }
+
+    *Out << "]);\n";
+
+  }
+
+  return nPages;
+
+}
+
+static const char* reportViewer =
+  "<!DOCTYPE html>\n"
+  "<html><head><meta charset=\"utf-8\"><title>LLPE report</title>\n"
+  "<style>\n"
+  "body { font-family: sans-serif; margin: 1em; }\n"
+  "table { border-collapse: collapse; }\n"
+  "td, th { border: 1px solid #ccc; padding: 2px 6px; text-align: right; }\n"
+  "td.name { text-align: left; }\n"
+  "tr.disabled { color: #999; }\n"
+  "#totals { float: right; margin-left: 2em; }\n"
+  "</style></head><body>\n"
+  "<table id=\"totals\"></table>\n"
+  "<p>Sort by <select id=\"order\"><option value=\"residual\">residual instructions</option>"
+  "<option value=\"time\">analysis time</option></select>\n"
+  "<button id=\"prev\">&lt;</button> page <span id=\"pageno\"></span> of <span id=\"pages\"></span> "
+  "<button id=\"next\">&gt;</button></p>\n"
+  "<table id=\"contexts\"><thead><tr><th>Seq</th><th>Parent</th><th>Context</th><th>Function</th>"
+  "<th>Instructions</th><th>Residual</th><th>Time (s)</th><th>Checks</th></tr></thead><tbody></tbody></table>\n"
+  "<script src=\"summary.js\"></script>\n"
+  "<script>\n"
+  "var order = 'residual', page = 0, loaded = {};\n"
+  "function cell(row, text, cls) { var td = row.insertCell(-1); td.textContent = text; if(cls) td.className = cls; }\n"
+  "function llpeReportPage(o, n, rows) { loaded[o + n] = rows; if(o == order && n == page) show(rows); }\n"
+  "function show(rows) {\n"
+  "  var body = document.querySelector('#contexts tbody');\n"
+  "  body.innerHTML = '';\n"
+  "  rows.forEach(function(r) {\n"
+  "    var row = body.insertRow(-1);\n"
+  "    if(!r[8]) row.className = 'disabled';\n"
+  "    cell(row, r[0]); cell(row, r[1] < 0 ? '' : r[1]); cell(row, r[2], 'name'); cell(row, r[3], 'name');\n"
+  "    cell(row, r[4]); cell(row, r[5]); cell(row, r[6].toFixed(3)); cell(row, r[7]);\n"
+  "  });\n"
+  "  document.getElementById('pageno').textContent = page + 1;\n"
+  "}\n"
+  "function load() {\n"
+  "  if(loaded[order + page]) { show(loaded[order + page]); return; }\n"
+  "  var s = document.createElement('script');\n"
+  "  s.src = 'pages/' + order + '-' + page + '.js';\n"
+  "  document.body.appendChild(s);\n"
+  "}\n"
+  "var totals = document.getElementById('totals');\n"
+  "for(var k in llpeReportSummary.totals) { var row = totals.insertRow(-1); cell(row, k, 'name'); cell(row, llpeReportSummary.totals[k]); }\n"
+  "document.getElementById('pages').textContent = llpeReportPages;\n"
+  "document.getElementById('order').onchange = function() { order = this.value; page = 0; load(); };\n"
+  "document.getElementById('prev').onclick = function() { if(page > 0) { --page; load(); } };\n"
+  "document.getElementById('next').onclick = function() { if(page + 1 < llpeReportPages) { ++page; load(); } };\n"
+  "load();\n"
+  "</script></body></html>\n";
+
+void LLPEAnalysisPass::writeReport() {
+
+  if(ReportDir.empty())
+    return;
+
+  if(std::error_code error = sys::fs::create_directories(ReportDir + "/pages")) {
+    errs() << "Failed to create " << ReportDir << "/pages: " << error.message() << "\n";
+    return;
+  }
+
+  std::vector<const ReportContext*> Sorted;
+  Sorted.reserve(reportContexts.size());
+  for(std::vector<ReportContext>::iterator it = reportContexts.begin(), itend = reportContexts.end(); it != itend; ++it)
+    Sorted.push_back(&*it);
+
+  std::stable_sort(Sorted.begin(), Sorted.end(), residualGreater);
+  uint32_t nPages = writeReportPages("residual", Sorted);
+
+  std::stable_sort(Sorted.begin(), Sorted.end(), timeGreater);
+  writeReportPages("time", Sorted);
+
+  std::unique_ptr<raw_fd_ostream> Out;
+  if(openReportFile("summary.js", Out)) {
+
+    *Out << "var llpeReportPages = " << nPages << ";\nvar llpeReportSummary = ";
+    stats.printJSON(*Out);
+    *Out << ";\n";
+
+  }
+
+  if(openReportFile("index.html", Out))
+    *Out << reportViewer;
+
+  reportContexts.clear();
+
+}
@@ -13,6 +13,7 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Attributes.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/LLPE.h"
 #include "llvm/Analysis/LLPECopyPaste.h"
@@ -21,14 +22,27 @@
 #include "llvm/Transforms/Utils/UnrollLoop.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
 #include "llvm/IR/DIBuilder.h"
 
+#include <algorithm>
+
 #include <unistd.h>
 #include <stdlib.h>
 
 using namespace llvm;
 
 cl::opt<bool> VerboseNames("int-verbose-names");
+static cl::opt<bool> EmitValueFacts("int-emit-value-facts");
+// Name committed blocks, split functions and file data after the contexts' structural
+// positions rather than their creation order, so that unrelated changes to what is explored
+// elsewhere don't rename everything, and output can be compared and cached across runs.
+static cl::opt<bool> DeterministicNames("int-deterministic-names");
+static cl::opt<unsigned> ValueFactsMaxSet("int-value-facts-max-set", cl::init(16));
+
+static LLPEStat RangesEmitted("value_fact_ranges", "Loads given !range from their value sets");
+static LLPEStat AssumesEmitted("value_fact_assumes", "llvm.assume calls emitted for known bits");
+static LLPEStat InvokesAsCalls("invokes_as_calls", "Invokes committed as calls because they can't unwind");
 
 static uint32_t SaveProgressN = 0;
 const uint32_t SaveProgressLimit = 1000;
@@ -40,6 +54,7 @@ static void SaveProgress() {
 
     errs() << ".";
     SaveProgressN = 0;
+    noteProgress();
 
   }
 
@@ -95,7 +110,7 @@ void IntegrationAttempt::prepareCommit() {
 	  ShadowBBInvar* BBI = BB->invar;
 	  for(uint32_t j = 0, jlim = BBI->succIdxs.size(); j != jlim; ++j) {
 
-	    BB->succsAlive[j] = !edgeIsDeadRising(*BBI, *getBBInvar(BBI->succIdxs[j]), true);
+	    BB->setSuccAlive(j, !edgeIsDeadRising(*BBI, *getBBInvar(BBI->succIdxs[j]), true));
 
 	  }
 
@@ -122,7 +137,12 @@ std::string InlineAttempt::getCommittedBlockPrefix() {
   std::string ret;
   {
     raw_string_ostream RSO(ret);
-    RSO << F.getName() << "-" << SeqNumber << " ";
+    RSO << F.getName() << "-";
+    if(DeterministicNames)
+      RSO << format_hex_no_prefix(structuralId, 16);
+    else
+      RSO << SeqNumber;
+    RSO << " ";
   }
   return ret;
 
@@ -133,7 +153,12 @@ std::string PeelIteration::getCommittedBlockPrefix() {
   std::string ret;
   {
     raw_string_ostream RSO(ret);
-    RSO << F.getName() << "-L" << getLName() << "-I" << iterationCount << "-" << SeqNumber << " ";
+    RSO << F.getName() << "-L" << getLName() << "-I" << iterationCount << "-";
+    if(DeterministicNames)
+      RSO << format_hex_no_prefix(structuralId, 16);
+    else
+      RSO << SeqNumber;
+    RSO << " ";
   }
   return ret;
 
@@ -251,8 +276,28 @@ BasicBlock* IntegrationAttempt::createBasicBlock(LLVMContext& Ctx, const Twine&
 
 }
 
+// The expected share of its function's runs in which the context being committed runs,
+// relative to the block that calls it, for postCommitOptimise's block layout.
+static double commitContextWeight = 1.0;
+
+// A block that certainly runs whenever its context does is as hot as the context; one
+// that may not run is taken to run half the time, and a cold one (see isColdBlock)
+// rarely.
+static double getCommitWeight(ShadowBB* BB) {
+
+  double weight = commitContextWeight;
+  if(BB->status != BBSTATUS_CERTAIN && BB->status != BBSTATUS_ASSUMED)
+    weight *= 0.5;
+  if(isColdBlock(BB->invar->BB))
+    weight *= 0.1;
+  return weight;
+
+}
+
 void InlineAttempt::commitCFG() {
 
+  PhaseTimer Timer(PhaseCommit);
+
   if(isCommitted())
     return;
 
@@ -362,7 +407,7 @@ void IntegrationAttempt::commitCFG() {
 
     for(uint32_t k = 0; k < nCondsHere; ++k) {
 
-      if(pass->verbosePCs) {
+      if(pass->reportsCheckFailures()) {
 
 	// The previous block will contain a path condition check: give it a break block that will
 	// sit on the edge from specialised to unspecialised code.
@@ -393,7 +438,7 @@ void IntegrationAttempt::commitCFG() {
     // Create one extra top block if there's a special check at the beginning
     if(BB->insts[0].needsRuntimeCheck == RUNTIME_CHECK_READ_LLIOWD && !pass->omitChecks) {
 
-      if(pass->verbosePCs || requiresBreakCode(&BB->insts[0])) {
+      if(pass->reportsCheckFailures() || requiresBreakCode(&BB->insts[0])) {
 	
 	std::string BreakName;
 	if(VerboseNames)
@@ -430,7 +475,11 @@ void IntegrationAttempt::commitCFG() {
 	if(IA->isEnabled()) {
 
 	  IA->activeCaller = SI;
+
+	  double savedWeight = commitContextWeight;
+	  commitContextWeight = IA->commitsOutOfLine() ? 1.0 : getCommitWeight(BB);
 	  IA->commitCFG();
+	  commitContextWeight = savedWeight;
 
 	  std::string Pref;
 	  if(VerboseNames)
@@ -480,7 +529,7 @@ void IntegrationAttempt::commitCFG() {
 
 	if(j != 0) {
 
-	  if(pass->verbosePCs || requiresBreakCode(SI)) {
+	  if(pass->reportsCheckFailures() || requiresBreakCode(SI)) {
 
 	    BasicBlock* breakBlock = createBasicBlock(F.getContext(), VerboseNames ? StringRef(Name) + ".vfsbreak" : "", CF, false, true);
 	    BB->committedBlocks.back().breakBlock = breakBlock;
@@ -507,7 +556,7 @@ void IntegrationAttempt::commitCFG() {
 
 	BasicBlock* breakBlock = 0;
 
-	if(pass->verbosePCs) {
+	if(pass->reportsCheckFailures()) {
 	
 	  // The previous block will break due to a tentative load. Give it a break block.
 	  // For most kinds of break this should belong to the old subblock;
@@ -531,36 +580,44 @@ void IntegrationAttempt::commitCFG() {
 
     // If the block has ignored edges outgoing, it will branch direct to unspecialised code.
     // Make a break block for that purpose.
-    if(pass->verbosePCs && hasLiveIgnoredEdges(BB)) {
+    if(pass->reportsCheckFailures() && hasLiveIgnoredEdges(BB)) {
 
       BB->committedBlocks.back().breakBlock = 
 	createBasicBlock(F.getContext(), VerboseNames ? StringRef(Name) + ".directbreak" : "", CF, false, true);
 
     }
 
+    if(CF) {
+
+      double weight = getCommitWeight(BB);
+      for(SmallVector<CommittedBlock, 1>::iterator it = BB->committedBlocks.begin(), itend = BB->committedBlocks.end(); it != itend; ++it)
+	pass->committedBlockWeights[it->specBlock] = weight;
+
+    }
+
   }
 
 }
 
 Value* IntegrationAttempt::getCommittedValue(ShadowValue SV) {
 
-  switch(SV.t) {
+  switch(SV.getValType()) {
   case SHADOWVAL_OTHER:
-    return SV.u.V;
+    return SV.getVal();
   case SHADOWVAL_GV:
-    return SV.u.GV->G;
+    return SV.getGV()->G;
   case SHADOWVAL_INST: 
     {
-      release_assert(SV.u.I->committedVal && "Instruction depends on uncommitted instruction");
-      return SV.u.I->committedVal;
+      release_assert(SV.getInst()->committedVal && "Instruction depends on uncommitted instruction");
+      return SV.getInst()->committedVal;
     }
   case SHADOWVAL_ARG:
     {
       // It can be valid to find a root function argument without committed value
       // as they are pseudo-allocations that will be patched in later.
-      release_assert((SV.u.A->committedVal || SV.u.A->IA->isRootMainCall()) && 
+      release_assert((SV.getArg()->committedVal || SV.getArg()->IA->isRootMainCall()) && 
 		     "Instruction depends on uncommitted instruction");
-      return SV.u.A->committedVal;
+      return SV.getArg()->committedVal;
     }
   case SHADOWVAL_PTRIDX:
     {
@@ -570,7 +627,7 @@ Value* IntegrationAttempt::getCommittedValue(ShadowValue SV) {
   case SHADOWVAL_FDIDX:
   case SHADOWVAL_FDIDX64:
     {
-      FDGlobalState& FDS = pass->fds[SV.u.PtrOrFd.idx];
+      FDGlobalState& FDS = pass->fds[SV.getIdx()];
       return FDS.CommittedVal;
     }
   case SHADOWVAL_CI8:
@@ -947,7 +1004,7 @@ Value* IntegrationAttempt::getCommittedValueOrBlock(ShadowInstruction* I, uint32
 	  
       ShadowBBInvar* TargetBBI = getBBInvar(I->invar->operandIdxs[idx].blockIdx);
 
-      if(pass->verbosePCs && shouldIgnoreEdge(BB->invar, TargetBBI) && !isExceptionEdge(BB->invar, TargetBBI)) {
+      if(pass->reportsCheckFailures() && shouldIgnoreEdge(BB->invar, TargetBBI) && !isExceptionEdge(BB->invar, TargetBBI)) {
 
 	if(inst_is<SwitchInst>(I)) {
 
@@ -1149,7 +1206,7 @@ void IntegrationAttempt::emitTerminator(ShadowBB* BB, ShadowInstruction* I, Basi
       }
 
       escapePercent(msg);
-      emitRuntimePrint(breakBlock, msg, 0);
+      emitCheckFailure(breakBlock, msg);
 
       if(breakSuccessors.size() == 1) {
 
@@ -1186,25 +1243,89 @@ void IntegrationAttempt::emitTerminator(ShadowBB* BB, ShadowInstruction* I, Basi
 
 }
 
-static GlobalVariable* getFileBytesGlobal(ReadFile& RF) {
+// Residual reads share one constant global per region of the file covered by overlapping
+// or abutting reads, rather than each getting a private copy of its bytes. The regions are
+// found from every resolved read of the file the first time any of them is committed.
+static std::vector<FileBytesRegion>& getFileRegions(const std::string& Filename) {
+
+  StringMap<std::vector<FileBytesRegion> >::iterator findit = GlobalIHP->fileBytesRegions.find(Filename);
+  if(findit != GlobalIHP->fileBytesRegions.end())
+    return findit->second;
 
-  // Create a memcpy from a constant, since someone is still using the read data.
-  std::vector<Constant*> constBytes;
-  std::string errors;
-  LLVMContext& Context = GInt8->getContext();
-  if(!getFileBytes(RF.name, RF.incomingOffset, RF.readSize, constBytes, Context, errors)) {
+  std::vector<std::pair<uint64_t, uint64_t> > extents;
+  for(DenseMap<ShadowInstruction*, ReadFile>::iterator it = GlobalIHP->resolvedReadCalls.begin(),
+	itend = GlobalIHP->resolvedReadCalls.end(); it != itend; ++it) {
 
-    errs() << "Failed to read file " << RF.name << " in commit\n";
-    exit(1);
+    if(it->second.name == Filename)
+      extents.push_back(std::make_pair(it->second.incomingOffset, 
+				       it->second.incomingOffset + it->second.readSize));
 
   }
 
-  ArrayType* ArrType = ArrayType::get(IntegerType::get(Context, 8), constBytes.size());
-  Constant* ByteArray = ConstantArray::get(ArrType, constBytes);
+  std::sort(extents.begin(), extents.end());
 
-  // Create a const global for the array:
+  std::vector<FileBytesRegion>& regions = GlobalIHP->fileBytesRegions[Filename];
+  for(std::vector<std::pair<uint64_t, uint64_t> >::iterator it = extents.begin(), 
+	itend = extents.end(); it != itend; ++it) {
 
-  return new GlobalVariable(*getGlobalModule(), ArrType, true, GlobalValue::InternalLinkage, ByteArray, "");
+    if(regions.size() && it->first <= regions.back().end) {
+      if(it->second > regions.back().end)
+	regions.back().end = it->second;
+    }
+    else {
+      regions.push_back(FileBytesRegion(it->first, it->second));
+    }
+
+  }
+
+  return regions;
+
+}
+
+// Get a pointer to RF's data, for a memcpy or memcmp from a constant.
+static Constant* getFileBytesGlobal(ReadFile& RF) {
+
+  std::vector<FileBytesRegion>& regions = getFileRegions(RF.name);
+
+  FileBytesRegion* region = 0;
+  for(std::vector<FileBytesRegion>::iterator it = regions.begin(), itend = regions.end(); it != itend && !region; ++it) {
+    if(it->start <= RF.incomingOffset && RF.incomingOffset + RF.readSize <= it->end)
+      region = &*it;
+  }
+
+  release_assert(region && "Read not covered by its file's regions?");
+
+  if(!region->G) {
+
+    ArrayRef<uint8_t> fileBytes;
+    std::string errors;
+    LLVMContext& Context = GInt8->getContext();
+    if((!getFileBytes(RF.name, region->start, region->end - region->start, fileBytes, errors)) ||
+       fileBytes.size() != region->end - region->start) {
+
+      errs() << "Failed to read file " << RF.name << " in commit\n";
+      exit(1);
+
+    }
+
+    Constant* ByteArray = ConstantDataArray::get(Context, fileBytes);
+    ArrayType* ArrType = cast<ArrayType>(ByteArray->getType());
+
+    // Create a const global for the array:
+
+    std::string Name;
+    if(DeterministicNames) {
+      raw_string_ostream RSO(Name);
+      RSO << "llpe.file." << RF.name << "." << region->start;
+    }
+
+    region->G = new GlobalVariable(*getGlobalModule(), ArrType, true, GlobalValue::InternalLinkage, ByteArray, Name);
+
+  }
+
+  Constant* Idxs[2] = { Constant::getNullValue(GInt64), 
+			ConstantInt::get(GInt64, RF.incomingOffset - region->start) };
+  return ConstantExpr::getGetElementPtr(region->G, Idxs, 2);
 
 }
 
@@ -1239,6 +1360,41 @@ static void emitSeekTo(Value* FD, uint64_t Offset, BasicBlock* emitBB) {
 
 }
 
+// Emit the seeks that flushSeek found due, for FDs that will be open at runtime.
+void IntegrationAttempt::emitSeekFixups(SmallVector<SeekFixup, 1>& Fixups, BasicBlock* emitBB) {
+
+  for(SmallVector<SeekFixup, 1>::iterator it = Fixups.begin(), itend = Fixups.end(); it != itend; ++it) {
+
+    ShadowValue FDV = ShadowValue::getFdIdx(it->FD);
+
+    // Deferred reads and seeks of an FD with no committed value seek for themselves.
+    if(!FDV.objectAvailable())
+      continue;
+
+    Value* FD = pass->fds[it->FD].CommittedVal;
+    if(!FD) {
+
+      Value* True = ConstantInt::getTrue(emitBB->getContext());
+      Value* UD = UndefValue::get(getValueType(FDV));
+      Instruction* Fwd = SelectInst::Create(True, UD, UD, "", emitBB);
+      addPatchRequest(FDV, Fwd, 1);
+      FD = Fwd;
+
+    }
+
+    emitSeekTo(FD, getFileSeekOffset(*it->filename, it->pos), emitBB);
+
+  }
+
+}
+
+// True if a resolved read or seek left its seek to a fix-up that won't be emitted.
+static bool deferredSeekUnavailable(uint32_t FD) {
+
+  return FD != (uint32_t)-1 && !ShadowValue::getFdIdx(FD).objectAvailable();
+
+}
+
 bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVector<CommittedBlock, 1>::iterator& emitBBIter) {
 
   BasicBlock* emitBB = emitBBIter->specBlock;
@@ -1267,6 +1423,8 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 	  // that the results are the way we expect.
 
 	  CallInst* readInst = cast<CallInst>(emitInst(BB, I, emitBB));
+	  if(it->second.prefixRead)
+	    readInst->setArgOperand(2, ConstantInt::get(readInst->getArgOperand(2)->getType(), it->second.readSize));
 
 	  Value* readBuffer = readInst->getArgOperand(1);
 	  if(readBuffer->getType() != GInt8Ptr)
@@ -1287,6 +1445,12 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 	  Constant* Zero32 = Constant::getNullValue(GInt32);
 	  CheckTest = new ICmpInst(*emitBB, CmpInst::ICMP_NE, ReadMemcmp, Zero32);
 
+	  // A socket may deliver less than we asked for, leaving the rest of the buffer stale:
+	  // the read must also have returned exactly as much as the recorded stream did.
+	  Constant* ExpectedLength = ConstantInt::get(readInst->getType(), it->second.readSize);
+	  Value* LengthTest = new ICmpInst(*emitBB, CmpInst::ICMP_NE, readInst, ExpectedLength);
+	  CheckTest = BinaryOperator::CreateOr(CheckTest, LengthTest, "", emitBB);
+
 	  DenseMap<ShadowInstruction*, TrackedStore*>::iterator findit = pass->trackedStores.find(I);
 	  if(findit != pass->trackedStores.end()) {
 
@@ -1307,12 +1471,12 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 
 	  // Seek to the right position in the break block:
 	  emitSeekTo(getCommittedValue(I->getCallArgOperand(0)), 
-		     it->second.incomingOffset, breakBlock);
+		     getFileSeekOffset(it->second.name, it->second.incomingOffset), breakBlock);
 
 	}
       
-	// Print failure notice if building a verbose specialisation:
-	if(pass->verbosePCs) {
+	// Report the failure if building a verbose or counting specialisation:
+	if(pass->reportsCheckFailures()) {
 	
 	  std::string message;
 	  {
@@ -1320,7 +1484,7 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 	    RSO << "Denied permission to use specialised files reading " << it->second.name << " in " << emitBB->getName() << "\n";
 	  }
 	
-	  emitRuntimePrint(breakBlock, message, 0);
+	  emitCheckFailure(breakBlock, message);
 	
 	}
       
@@ -1335,13 +1499,15 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
       
 	if(breakBlock != emitBB) {
 
-	  BranchInst::Create(breakBlock, successTarget, CheckTest, emitBB);
+	  BranchInst* checkBI = BranchInst::Create(breakBlock, successTarget, CheckTest, emitBB);
+	  setCheckBranchWeights(checkBI, breakBlock);
 	  BranchInst::Create(failTarget, breakBlock);
 
 	}
 	else {
 
-	  BranchInst::Create(failTarget, successTarget, CheckTest, emitBB);
+	  BranchInst* checkBI = BranchInst::Create(failTarget, successTarget, CheckTest, emitBB);
+	  setCheckBranchWeights(checkBI, failTarget);
 
 	}
       
@@ -1352,27 +1518,30 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 
       // Insert a seek call if that turns out to be necessary (i.e. if that FD may be subsequently
       // used without an intervening SEEK_SET)
-      if(it->second.needsSeek) {
+      if(it->second.needsSeek || deferredSeekUnavailable(it->second.seekDeferredFD)) {
 	
 	emitSeekTo(getCommittedValue(I->getCallArgOperand(0)), 
-		   it->second.incomingOffset + it->second.readSize, emitBB);
+		   getFileSeekOffset(it->second.name, it->second.incomingOffset + it->second.readSize), emitBB);
 	  
       }
 
       /* If it's a read from a fifo then the copy was emitted *before* the check. */
 
+      // Unchecked, a read of a known stdin prefix must still take those bytes off the
+      // stream, for the unspecialised reads that follow.
+      if(it->second.prefixRead && pass->omitChecks) {
+	CallInst* readInst = cast<CallInst>(emitInst(BB, I, emitBB));
+	readInst->setArgOperand(2, ConstantInt::get(readInst->getArgOperand(2)->getType(), it->second.readSize));
+      }
+
       if(it->second.readSize > 0 && 
 	 (!(it->second.isFifo && !pass->omitChecks)) && 
 	 !(I->dieStatus & INSTSTATUS_UNUSED_WRITER)) {
 	
-	GlobalVariable *ArrayGlobal = getFileBytesGlobal(it->second);
+	Constant* CopySource = getFileBytesGlobal(it->second);
 
 	Type* Int64Ty = IntegerType::get(Context, 64);
 	Type* VoidPtrTy = Type::getInt8PtrTy(Context);
-
-	Constant* ZeroIdx = ConstantInt::get(Int64Ty, 0);
-	Constant* Idxs[2] = {ZeroIdx, ZeroIdx};
-	Constant* CopySource = ConstantExpr::getGetElementPtr(ArrayGlobal, Idxs, 2);
       
 	Constant* MemcpySize = ConstantInt::get(Int64Ty, it->second.readSize);
 
@@ -1415,7 +1584,8 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
     DenseMap<ShadowInstruction*, SeekFile>::iterator it = pass->resolvedSeekCalls.find(I);
     if(it != pass->resolvedSeekCalls.end()) {
 
-      if(!it->second.MayDelete)
+      if(!(it->second.MayDelete || it->second.seekDeferredFD != (uint32_t)-1) ||
+	 deferredSeekUnavailable(it->second.seekDeferredFD))
 	emitInst(BB, I, emitBB);
 
       return true;
@@ -1426,12 +1596,14 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 
   Function* CalledF = getCalledFunction(I);
 
+  bool isMmap = CalledF->getName() == "mmap" || CalledF->getName() == "mmap64";
+
   if((!pass->omitChecks) && I->needsRuntimeCheck == RUNTIME_CHECK_READ_LLIOWD && 
-     (CalledF->getName() == "stat" || CalledF->getName() == "fstat")) {
+     (CalledF->getName() == "stat" || CalledF->getName() == "fstat" || isMmap)) {
 
     LLVMContext& Context = emitBB->getContext();
 
-    // Emit an lliowd_ok check, and if it fails branch to the real stat instruction.
+    // Emit an lliowd_ok check, and if it fails branch to the real stat or mmap instruction.
     Type* Int32Ty = IntegerType::get(Context, 32);
     Constant* CheckFn = F.getParent()->getOrInsertFunction("lliowd_ok", Int32Ty, NULL);
     Value* CheckResult = CallInst::Create(CheckFn, ArrayRef<Value*>(), VerboseNames ? "readcheck" : "", emitBB);
@@ -1441,16 +1613,16 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
 
     BasicBlock* failTarget = getFunctionRoot()->getSubBlockForInst(BB->invar->idx, I->invar->idx);
 
-    // Print failure notice if building a verbose specialisation:
-    if(pass->verbosePCs) {
+    // Report the failure if building a verbose or counting specialisation:
+    if(pass->reportsCheckFailures()) {
 
       std::string message;
       {
 	raw_string_ostream RSO(message);
-	RSO << "Denied permission to use specialised files on (f)stat in " << emitBB->getName() << "\n";
+	RSO << "Denied permission to use specialised files on " << CalledF->getName() << " in " << emitBB->getName() << "\n";
       }
 
-      emitRuntimePrint(emitBBIter->breakBlock, message, 0);
+      emitCheckFailure(emitBBIter->breakBlock, message);
 
       BranchInst::Create(failTarget, emitBBIter->breakBlock);
       failTarget = emitBBIter->breakBlock;
@@ -1463,7 +1635,12 @@ bool IntegrationAttempt::emitVFSCall(ShadowBB* BB, ShadowInstruction* I, SmallVe
     BasicBlock* successTarget = emitBBIter->specBlock;
     
     release_assert(successTarget && failTarget && CheckTest);
-    BranchInst::Create(failTarget, successTarget, CheckTest, emitBB);
+    BranchInst* checkBI = BranchInst::Create(failTarget, successTarget, CheckTest, emitBB);
+    setCheckBranchWeights(checkBI, failTarget);
+
+    // The specialised code still reads the real mapping, so create it.
+    if(isMmap)
+      emitInst(BB, I, successTarget);
 
     return true;
     
@@ -1604,6 +1781,7 @@ void IntegrationAttempt::emitCall(ShadowBB* BB, ShadowInstruction* I, SmallVecto
 	  if(inst_is<InvokeInst>(I)) {
 	    // Invoke that becomes a call because it cannot throw
 	    BranchInst::Create(invokeNormalDest, emitBB);
+	    ++InvokesAsCalls;
 	  }
 
 	}
@@ -1678,7 +1856,8 @@ void IntegrationAttempt::emitCall(ShadowBB* BB, ShadowInstruction* I, SmallVecto
 	  }
 
 	  release_assert(successTarget && failTarget && CallFailed);
-	  BranchInst::Create(successTarget, failTarget, CallFailed, emitBB);
+	  BranchInst* checkBI = BranchInst::Create(successTarget, failTarget, CallFailed, emitBB);
+	  setCheckBranchWeights(checkBI, failTarget);
 
 	}
 
@@ -1749,6 +1928,13 @@ void IntegrationAttempt::emitCall(ShadowBB* BB, ShadowInstruction* I, SmallVecto
     }
 
   }
+
+  // The original call runs instead of an uncommitted context.
+  {
+    InstSideTable<SmallVector<SeekFixup, 1>, SIDETABLE_CALLSEEKFIXUPS>::iterator it = pass->callSeekFixups.find(I);
+    if(it != pass->callSeekFixups.end())
+      emitSeekFixups(it->second, emitBB);
+  }
   
   if(emitVFSCall(BB, I, emitBBIter))
     return;
@@ -1776,7 +1962,18 @@ void IntegrationAttempt::emitCall(ShadowBB* BB, ShadowInstruction* I, SmallVecto
   // Unexpanded call, emit it as a normal instruction.
   Instruction* NewI = emitInst(BB, I, emitBB);
 
-  if(InvokeInst* NewInvoke = dyn_cast<InvokeInst>(NewI)) {
+  if(inst_is<InvokeInst>(I) && isa<CallInst>(NewI)) {
+
+    // Emitted as a call because it can't unwind (see emitInst): continue to the normal
+    // successor, or to the check of its result.
+    bool advanceIter;
+    BranchInst::Create(getInvokeNormalSuccessor(I, advanceIter), emitBB);
+    if(advanceIter)
+      ++emitBBIter;
+    ++InvokesAsCalls;
+
+  }
+  else if(InvokeInst* NewInvoke = dyn_cast<InvokeInst>(NewI)) {
 
     // If an invoke with a disabled IA was emitted, its return value may need to be checked;
     // in this case it should branch to another subblock of the same BB rather than its usual
@@ -1816,10 +2013,80 @@ static void checkEmittedInst(Instruction* I) {
 
 }
 
+// Commit a malloc whose object never outlives the function as a fixed-size entry-block
+// alloca, so that loop iterations and repeated calls reuse one slot.
+static Instruction* emitStackPromotedAlloc(ShadowInstruction* I, AllocData* AD, BasicBlock* emitBB) {
+
+  LLVMContext& Context = emitBB->getContext();
+  BasicBlock& Entry = emitBB->getParent()->getEntryBlock();
+
+  AllocaInst* AI = new AllocaInst(Type::getInt8Ty(Context), ConstantInt::get(Type::getInt64Ty(Context), AD->storeSize), VerboseNames ? "stackpromoted" : "");
+  // At least as aligned as analysis assumed malloc's results were:
+  AI->setAlignment(std::max(16u, GlobalIHP->getMallocAlignment()));
+
+  Instruction* newI = AI;
+  if(AI->getType() != I->getType()) {
+    newI = new BitCastInst(AI, I->getType(), VerboseNames ? "stackpromotedcast" : "");
+    Entry.getInstList().push_front(newI);
+  }
+  Entry.getInstList().push_front(AI);
+
+  return newI;
+
+}
+
 Instruction* IntegrationAttempt::emitInst(ShadowBB* BB, ShadowInstruction* I, BasicBlock* emitBB) {
 
-  // Clone all attributes:
-  Instruction* newI = I->invar->I->clone();
+  // Is it an allocation instruction?
+  ShadowValue Base;
+  AllocData* AD;
+  if(!(getBaseObject(ShadowValue(I), Base) && 
+       Base.isPtrIdx() && 
+       (AD = getAllocData(Base)) && 
+       AD->allocValue.getInst() == I))
+    AD = 0;
+
+  if(AD && AD->stackPromoted) {
+
+    Instruction* newI = emitStackPromotedAlloc(I, AD, emitBB);
+    I->committedVal = newI;
+    AD->committedVal = newI;
+    AD->isCommitted = true;
+    pass->committedHeapAllocations[newI] = Base.getHeapKey();
+    return newI;
+
+  }
+
+  // Clone all attributes. An invoke whose exception edge is dead becomes a call, keeping
+  // its arguments and callee but not the blocks, which are the last two operands.
+  Instruction* newI;
+  uint32_t nOperands = I->getNumOperands();
+  if(InvokeInst* II = dyn_cast_inst<InvokeInst>(I)) {
+
+    if(!BB->succsAlive[1]) {
+
+      SmallVector<Value*, 8> Args(II->op_begin(), II->op_begin() + II->getNumArgOperands());
+      CallInst* CI = CallInst::Create(II->getCalledValue(), Args);
+      CI->setCallingConv(II->getCallingConv());
+      CI->setAttributes(II->getAttributes());
+      CI->setDebugLoc(II->getDebugLoc());
+      newI = CI;
+      nOperands -= 2;
+
+    }
+    else {
+
+      newI = II->clone();
+
+    }
+
+  }
+  else {
+
+    newI = I->invar->I->clone();
+
+  }
+
   I->committedVal = newI;
   emitBB->getInstList().push_back(cast<Instruction>(newI));
 
@@ -1831,7 +2098,7 @@ Instruction* IntegrationAttempt::emitInst(ShadowBB* BB, ShadowInstruction* I, Ba
 
   // Normal instruction: no BB arguments apart from invoke instructions, 
   // and all args have been committed already.
-  for(uint32_t i = 0; i < I->getNumOperands(); ++i) {
+  for(uint32_t i = 0; i < nOperands; ++i) {
 
     ConstantInt* ignFailValue = 0;
     BasicBlock* failBlock = 0;
@@ -1857,12 +2124,7 @@ Instruction* IntegrationAttempt::emitInst(ShadowBB* BB, ShadowInstruction* I, Ba
   }
    
   // If it's an allocation instruction, record the committed instruction.
-  ShadowValue Base;
-  AllocData* AD;
-  if(getBaseObject(ShadowValue(I), Base) && 
-     Base.isPtrIdx() && 
-     (AD = getAllocData(Base)) && 
-     AD->allocValue.u.I == I) {
+  if(AD) {
 
     AD->committedVal = newI;
     AD->isCommitted = true;
@@ -2012,7 +2274,20 @@ bool IntegrationAttempt::synthCommittedPointer(ShadowValue* I, Type* targetType,
   }
   else {
 
+    if(emitBB != GlobalIHP->synthPointerBlock) {
+      GlobalIHP->synthPointers.clear();
+      GlobalIHP->synthForwardBases.clear();
+      GlobalIHP->synthPointerBlock = emitBB;
+    }
+
     Value* BaseI = getCommittedValue(Base);
+    if(!BaseI) {
+
+      Value* Fwd = GlobalIHP->synthForwardBases.lookup(Base);
+      if(Fwd && isa<Instruction>(Fwd) && cast<Instruction>(Fwd)->getParent() == emitBB)
+	BaseI = Fwd;
+
+    }
     if(!BaseI) {
 
       // Base has not been committed yet. Create a trivial select instruction that will be populated
@@ -2023,6 +2298,21 @@ bool IntegrationAttempt::synthCommittedPointer(ShadowValue* I, Type* targetType,
       Value* UD = UndefValue::get(getValueType(Base));      
       BaseI = SelectInst::Create(True, UD, UD, "", emitBB);
       addPatchRequest(Base, cast<Instruction>(BaseI), 1);
+      GlobalIHP->synthForwardBases[Base] = BaseI;
+
+    }
+
+    // Reuse the pointer if this block has already built it from the same base.
+    std::pair<std::pair<Value*, int64_t>, Type*> Key(std::make_pair(BaseI, Offset), targetType);
+    DenseMap<std::pair<std::pair<Value*, int64_t>, Type*>, std::pair<WeakVH, WeakVH> >::iterator findit =
+      GlobalIHP->synthPointers.find(Key);
+    if(findit != GlobalIHP->synthPointers.end() && findit->second.first == BaseI) {
+
+      Value* Cached = findit->second.second;
+      if(Cached && isa<Instruction>(Cached) && cast<Instruction>(Cached)->getParent() == emitBB) {
+	Result = Cached;
+	return true;
+      }
 
     }
 
@@ -2035,45 +2325,52 @@ bool IntegrationAttempt::synthCommittedPointer(ShadowValue* I, Type* targetType,
 	Result = BaseI;
       else
 	Result = CastInst::CreatePointerCast(BaseI, targetType, VerboseNames ? "synthcast" : "", emitBB);
-      return true;
 
     }
+    else {
 
-    // 2. Pointer to an array or struct with a member at the right offset?
-    SmallVector<Value*, 4> GEPIdxs;
-    Type* InTy = BaseI->getType();
-    release_assert(isa<PointerType>(InTy));
-    InTy = cast<PointerType>(InTy)->getElementType();
-    if(Type* ElTy = XXXFindElementAtOffset(InTy, Offset, GEPIdxs, GlobalTD)) {
+      // 2. Pointer to an array or struct with a member at the right offset?
+      SmallVector<Value*, 4> GEPIdxs;
+      Type* InTy = BaseI->getType();
+      release_assert(isa<PointerType>(InTy));
+      InTy = cast<PointerType>(InTy)->getElementType();
+      if(Type* ElTy = XXXFindElementAtOffset(InTy, Offset, GEPIdxs, GlobalTD)) {
 
-      Result = GetElementPtrInst::Create(BaseI, GEPIdxs, VerboseNames ? "synthgep" : "", emitBB);
-      if((!isa<PointerType>(targetType)) || ElTy != cast<PointerType>(targetType)->getElementType())
-	Result = CastInst::CreatePointerCast(Result, targetType, VerboseNames ? "synthcastback" : "", emitBB);
-      return true;
+	Result = GetElementPtrInst::Create(BaseI, GEPIdxs, VerboseNames ? "synthgep" : "", emitBB);
+	if((!isa<PointerType>(targetType)) || ElTy != cast<PointerType>(targetType)->getElementType())
+	  Result = CastInst::CreatePointerCast(Result, targetType, VerboseNames ? "synthcastback" : "", emitBB);
 
-    }
+      }
+      else {
 
-    // OK, use i8 offset.
+	// OK, use i8 offset.
 
-    // Get byte ptr:
-    Value* CastI;
-    if(BaseI->getType() != Int8Ptr)
-      CastI = new BitCastInst(BaseI, Int8Ptr, VerboseNames ? "synthcast" : "", emitBB);
-    else
-      CastI = BaseI;
+	// Get byte ptr:
+	Value* CastI;
+	if(BaseI->getType() != Int8Ptr)
+	  CastI = new BitCastInst(BaseI, Int8Ptr, VerboseNames ? "synthcast" : "", emitBB);
+	else
+	  CastI = BaseI;
 
-    // Offset:
-    Constant* OffsetC = ConstantInt::get(Type::getInt64Ty(emitBB->getContext()), (uint64_t)Offset, true);
-    Value* OffsetI = GetElementPtrInst::Create(CastI, OffsetC, VerboseNames ? "synthgep" : "", emitBB);
+	// Offset:
+	Constant* OffsetC = ConstantInt::get(Type::getInt64Ty(emitBB->getContext()), (uint64_t)Offset, true);
+	Value* OffsetI = GetElementPtrInst::Create(CastI, OffsetC, VerboseNames ? "synthgep" : "", emitBB);
+
+	// Cast back:
+	if(targetType == Int8Ptr) {
+	  Result = (OffsetI);
+	}
+	else {
+	  Result = (CastInst::CreatePointerCast(OffsetI, targetType, VerboseNames ? "synthcastback" : "", emitBB));
+	}
+
+      }
 
-    // Cast back:
-    if(targetType == Int8Ptr) {
-      Result = (OffsetI);
-    }
-    else {
-      Result = (CastInst::CreatePointerCast(OffsetI, targetType, VerboseNames ? "synthcastback" : "", emitBB));
     }
 
+    if(Result != BaseI)
+      GlobalIHP->synthPointers[Key] = std::make_pair(WeakVH(BaseI), WeakVH(Result));
+
   }
 
   return true;
@@ -2085,7 +2382,7 @@ bool IntegrationAttempt::canSynthVal(ShadowValue* I, ValSetType Ty, const Improv
   if(Ty == ValSetTypeScalar)
     return true;
   else if(Ty == ValSetTypeFD) {
-    return ((!I) || (!I->isInst()) || (I->u.I != pass->fds[IV.V.u.PtrOrFd.idx].SI)) 
+    return ((!I) || (!I->isInst()) || (I->getInst() != pass->fds[IV.V.getIdx()].SI)) 
       && IV.V.objectAvailable();
   }
   else if(Ty == ValSetTypePB) {
@@ -2111,7 +2408,7 @@ Value* IntegrationAttempt::trySynthVal(ShadowValue* I, Type* targetType, ValSetT
     
     if(canSynthVal(I, Ty, IV)) {
       
-      FDGlobalState& FDS = pass->fds[IV.V.u.PtrOrFd.idx];
+      FDGlobalState& FDS = pass->fds[IV.V.getIdx()];
       if(!FDS.CommittedVal) {
 
 	Value* True = ConstantInt::getTrue(emitBB->getContext());
@@ -2170,7 +2467,7 @@ void IntegrationAttempt::emitChunk(ShadowInstruction* I, BasicBlock* emitBB, Sma
 
   // Create pointer that should be written through:
   Type* targetType;
-  if(chunkSize == 1 && GlobalAA->getTypeStoreSize(getValueType(chunkBegin->second.Values[0].V)) <= 8)
+  if(chunkSize == 1 && getTypeStoreSize(getValueType(chunkBegin->second.Values[0].V)) <= 8)
     targetType = PointerType::getUnqual(getValueType(chunkBegin->second.Values[0].V));
   else
     targetType = BytePtr;
@@ -2188,15 +2485,19 @@ void IntegrationAttempt::emitChunk(ShadowInstruction* I, BasicBlock* emitBB, Sma
     ImprovedVal& IV = chunkBegin->second.Values[0];
     ShadowValue IVal(I);
     Value* newVal = trySynthVal(&IVal, getValueType(IV.V), chunkBegin->second.SetType, IV, emitBB);
-    uint64_t elSize = GlobalAA->getTypeStoreSize(newVal->getType());
+    uint64_t elSize = getTypeStoreSize(newVal->getType());
 
     if(elSize > 8) {
 
       release_assert(isa<Constant>(newVal));
 
-      // Emit memcpy from single constant.
-      GlobalVariable* CopyFrom = new GlobalVariable(*getGlobalModule(), newVal->getType(), 
-						    true, GlobalValue::InternalLinkage, cast<Constant>(newVal));
+      // Emit memcpy from single constant, sharing one global per distinct value.
+      GlobalVariable*& CopyFrom = GlobalIHP->memcpySourceGlobals[cast<Constant>(newVal)];
+      if(!CopyFrom) {
+	CopyFrom = new GlobalVariable(*getGlobalModule(), newVal->getType(), 
+				      true, GlobalValue::InternalLinkage, cast<Constant>(newVal));
+	CopyFrom->setUnnamedAddr(true);
+      }
       Constant* CopyFromPtr = ConstantExpr::getBitCast(CopyFrom, BytePtr);
       newInstructions.push_back(emitMemcpyInst(targetPtrSynth, CopyFromPtr, elSize, emitBB));
 
@@ -2212,6 +2513,45 @@ void IntegrationAttempt::emitChunk(ShadowInstruction* I, BasicBlock* emitBB, Sma
   }
   else {
 
+    // Abutting integer fields that fit in a word (e.g. a short string or a small struct)
+    // are written with one wide store, as emitMemcpyCheck checks them with one wide load.
+    uint64_t mergedVal, nextVal;
+    uint64_t mergedBytes = 0;
+    if(GlobalTD->isLittleEndian() && getIVSRangeConstantInt(*chunkBegin, mergedVal)) {
+
+      mergedBytes = chunkBegin->first.second - chunkBegin->first.first;
+      for(SmallVector<IVSRange, 4>::iterator it = chunkBegin + 1; it != chunkEnd; ++it) {
+
+	uint64_t nextBytes = it->first.second - it->first.first;
+	if(it->first.first != chunkBegin->first.first + mergedBytes ||
+	   mergedBytes + nextBytes > 8 ||
+	   !getIVSRangeConstantInt(*it, nextVal)) {
+	  mergedBytes = 0;
+	  break;
+	}
+
+	if(nextBytes < 8)
+	  nextVal &= ((((uint64_t)1) << (nextBytes * 8)) - 1);
+	mergedVal |= (nextVal << (mergedBytes * 8));
+	mergedBytes += nextBytes;
+
+      }
+
+    }
+
+    if(mergedBytes) {
+
+      if(mergedBytes < 8)
+	mergedVal &= ((((uint64_t)1) << (mergedBytes * 8)) - 1);
+
+      Type* MergedTy = Type::getIntNTy(emitBB->getContext(), mergedBytes * 8);
+      Value* MergedPtr = new BitCastInst(targetPtrSynth, PointerType::getUnqual(MergedTy), "", emitBB);
+      // The fields' own alignment doesn't carry over to the wider type.
+      newInstructions.push_back(new StoreInst(ConstantInt::get(MergedTy, mergedVal), MergedPtr, false, 1, emitBB));
+      return;
+
+    }
+
     // Emit as memcpy-from-packed-struct.
     SmallVector<Type*, 4> Types;
     SmallVector<Constant*, 4> Copy;
@@ -2230,8 +2570,14 @@ void IntegrationAttempt::emitChunk(ShadowInstruction* I, BasicBlock* emitBB, Sma
 
     StructType* SType = StructType::get(emitBB->getContext(), Types, /*isPacked=*/true);
     Constant* CS = ConstantStruct::get(SType, Copy);
-    GlobalVariable* GCS = new GlobalVariable(*getGlobalModule(), SType, 
-					     true, GlobalValue::InternalLinkage, CS);
+    // Share the source between copies of the same values, e.g. a struct initialised
+    // afresh on each iteration of an unrolled loop.
+    GlobalVariable*& GCS = GlobalIHP->memcpySourceGlobals[CS];
+    if(!GCS) {
+      GCS = new GlobalVariable(*getGlobalModule(), SType, 
+			       true, GlobalValue::InternalLinkage, CS);
+      GCS->setUnnamedAddr(true);
+    }
     Constant* GCSPtr = ConstantExpr::getBitCast(GCS, BytePtr);
 
     newInstructions.push_back(emitMemcpyInst(targetPtrSynth, GCSPtr, lastOffset - chunkBegin->first.first, emitBB));
@@ -2384,14 +2730,39 @@ static bool isPureCall(ShadowInstruction* SI) {
 
 void IntegrationAttempt::emitOrSynthInst(ShadowInstruction* I, ShadowBB* BB, SmallVector<CommittedBlock, 1>::iterator& emitBB) {
 
+  // Part of an allocation eliminated whole, free calls included (see killDeadObjects).
+  if(I->dieStatus & INSTSTATUS_DEAD_OBJECT) {
+
+    // An allocation promoted to a global already has its committed address.
+    ShadowValue Base;
+    AllocData* AD;
+    if(getBaseObject(ShadowValue(I), Base) && 
+       Base.isPtrIdx() && 
+       (AD = getAllocData(Base)) && 
+       AD->globalPromoted &&
+       AD->allocValue.getInst() == I)
+      I->committedVal = AD->committedVal;
+
+    return;
+
+  }
+
+  {
+    InstSideTable<SmallVector<SeekFixup, 1>, SIDETABLE_SEEKFIXUPS>::iterator it = pass->seekFixups.find(I);
+    if(it != pass->seekFixups.end())
+      emitSeekFixups(it->second, emitBB->specBlock);
+  }
+
   bool useCallPath = (inst_is<CallInst>(I) || inst_is<InvokeInst>(I)) && 
     (!inst_is<MemIntrinsic>(I)) && 
     !isPureCall(I);
 
   if(useCallPath) {
     emitCall(BB, I, emitBB);
-    if(I->committedVal)
+    if(I->committedVal) {
+      emitValueFacts(I);
       return;
+    }
     // Else fall through to fill in a committed value:
   }
 
@@ -2428,8 +2799,103 @@ void IntegrationAttempt::emitOrSynthInst(ShadowInstruction* I, ShadowBB* BB, Sma
     emitPHINode(BB, I, emitBB->specBlock);
   else if(inst_is<TerminatorInst>(I))
     emitTerminator(BB, I, emitBB->specBlock);
-  else
+  else {
     emitInst(BB, I, emitBB->specBlock);
+    emitValueFacts(I);
+  }
+
+}
+
+// With -int-emit-value-facts, pass on what analysis knows about a residual integer that
+// it could only narrow to a small set of values: loads get !range metadata covering the
+// set, and other instructions an llvm.assume of the bits all of the set agree on, which
+// is the form known-bits analysis picks up. Neither costs anything at runtime, but an
+// assume keeps its subject alive, so this is off by default.
+void IntegrationAttempt::emitValueFacts(ShadowInstruction* I) {
+
+  if(!EmitValueFacts)
+    return;
+
+  Instruction* newI = dyn_cast_or_null<Instruction>(I->committedVal);
+  if((!newI) || !newI->getParent() || isa<PHINode>(newI) || isa<TerminatorInst>(newI))
+    return;
+
+  IntegerType* Ty = dyn_cast<IntegerType>(newI->getType());
+  if((!Ty) || Ty->getBitWidth() > 64)
+    return;
+
+  ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(I->i.PB);
+  if((!IVS) || IVS->Overdef || IVS->SetType != ValSetTypeScalar ||
+     IVS->Values.size() < 2 || IVS->Values.size() > ValueFactsMaxSet)
+    return;
+
+  uint32_t Bits = Ty->getBitWidth();
+  uint64_t WidthMask = Bits == 64 ? ~(uint64_t)0 : (((uint64_t)1 << Bits) - 1);
+
+  std::vector<uint64_t> Vals;
+  for(SmallVector<ImprovedVal, 1>::iterator it = IVS->Values.begin(), itend = IVS->Values.end(); it != itend; ++it) {
+    uint64_t V;
+    if(!tryGetConstantInt(it->V, V))
+      return;
+    Vals.push_back(V & WidthMask);
+  }
+
+  if(LoadInst* LI = dyn_cast<LoadInst>(newI)) {
+
+    if(LI->getMetadata(LLVMContext::MD_range))
+      return;
+
+    // !range wants disjoint, non-adjacent half-open intervals in order, and not the full set.
+    std::sort(Vals.begin(), Vals.end());
+    Vals.erase(std::unique(Vals.begin(), Vals.end()), Vals.end());
+
+    // A set containing both ends would make the first and last intervals adjacent.
+    if(Vals.front() == 0 && Vals.back() == WidthMask)
+      return;
+
+    SmallVector<Metadata*, 8> Ranges;
+    for(uint32_t i = 0, ilim = Vals.size(); i != ilim;) {
+
+      uint32_t j = i + 1;
+      while(j != ilim && Vals[j] == Vals[j - 1] + 1)
+	++j;
+
+      APInt Lo(Bits, Vals[i]), Hi(Bits, (Vals[j - 1] + 1) & WidthMask);
+      if(Lo == Hi)
+	return;
+      Ranges.push_back(ConstantAsMetadata::get(ConstantInt::get(Ty, Lo)));
+      Ranges.push_back(ConstantAsMetadata::get(ConstantInt::get(Ty, Hi)));
+      i = j;
+
+    }
+
+    LI->setMetadata(LLVMContext::MD_range, MDNode::get(LI->getContext(), Ranges));
+    RangesEmitted.inc(&F);
+    return;
+
+  }
+
+  uint64_t Differ = 0;
+  for(std::vector<uint64_t>::iterator it = Vals.begin(), itend = Vals.end(); it != itend; ++it)
+    Differ |= (*it ^ Vals[0]);
+
+  uint64_t Mask = ~Differ & WidthMask;
+  if(!Mask)
+    return;
+
+  Function* Assume = Intrinsic::getDeclaration(getGlobalModule(), Intrinsic::assume);
+  Instruction* And = BinaryOperator::CreateAnd(newI, ConstantInt::get(Ty, Mask));
+  Instruction* Cmp = new ICmpInst(CmpInst::ICMP_EQ, And, ConstantInt::get(Ty, Vals[0] & Mask));
+  Instruction* Call = CallInst::Create(Assume, ArrayRef<Value*>(Cmp));
+
+  BasicBlock::iterator Next(newI);
+  ++Next;
+  BasicBlock::InstListType& Insts = newI->getParent()->getInstList();
+  Insts.insert(Next, And);
+  Insts.insert(Next, Cmp);
+  Insts.insert(Next, Call);
+
+  AssumesEmitted.inc(&F);
 
 }
 
@@ -2545,8 +3011,12 @@ void IntegrationAttempt::commitLoopInstructions(const ShadowLoopInvar* ScopeL, u
     for(; j < BB->insts.size(); ++j) {
 
       ShadowInstruction* I = &(BB->insts[j]);
-      I->committedVal = 0;
-      emitOrSynthInst(I, BB, emitBlockIt);
+
+      // Loads batched into an earlier thread check have been emitted already.
+      if(!pass->batchedThreadChecks.count(I)) {
+	I->committedVal = 0;
+	emitOrSynthInst(I, BB, emitBlockIt);
+      }
 
       // This only emits "check as expected" checks: simple comparisons that ensure a value
       // determined during specialisation matches the real value.
@@ -2581,6 +3051,8 @@ static void applyLocToBlocks(const DebugLoc& loc, const std::vector<BasicBlock*>
 
 void InlineAttempt::commitArgsAndInstructions() {
 
+  PhaseTimer Timer(PhaseCommit);
+
   if(isCommitted()) {
 
     // Patch arguments up, if needed.
@@ -2710,6 +3182,7 @@ void InlineAttempt::commitArgsAndInstructions() {
 void IntegrationAttempt::commitInstructions() {
 
   SaveProgress();
+  noteContextCommitted();
   
   if((!L) && getFunctionRoot()->isRootMainCall()) {
 
@@ -2761,6 +3234,8 @@ static void unregisterCommittedAllocations(BasicBlock* BB) {
   for(BasicBlock::iterator BI = BB->begin(), BE = BB->end(); BI != BE; ++BI) {
 
     Instruction* I = BI;
+    GlobalIHP->forgetPatchPlaceholder(I);
+
     {
       DenseMap<Value*, uint32_t>::iterator findit = GlobalIHP->committedHeapAllocations.find(I);
       if(findit != GlobalIHP->committedHeapAllocations.end()) {
@@ -10,23 +10,45 @@
 #include "llvm/Analysis/LLPE.h"
 #include "llvm/IR/Function.h"
 #include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/IR/Attributes.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
+
+#include <algorithm>
 
 using namespace llvm;
 
-void llvm::patchReferences(std::vector<std::pair<WeakVH, uint32_t> >& Refs, Value* V) {
+// Cost model for choosing where to split committed code. Downstream passes are superlinear
+// in function size, and in block count, PHI count and values live across blocks more than
+// in plain instructions, so each of those can be weighted on top of the per-instruction cost.
+static cl::opt<unsigned> SplitThreshold("int-split-threshold", cl::init(50000));
+static cl::opt<unsigned> SplitBlockCost("int-split-block-cost", cl::init(0));
+static cl::opt<unsigned> SplitPHICost("int-split-phi-cost", cl::init(0));
+static cl::opt<unsigned> SplitLiveAcrossCost("int-split-live-across-cost", cl::init(0));
+static cl::opt<bool> EmitArgAttributes("int-emit-arg-attributes");
+
+static LLPEStat ArgsNonNull("arg_attr_nonnull", "Split function arguments marked nonnull");
+static LLPEStat ArgsDereferenceable("arg_attr_dereferenceable", "Split function arguments marked dereferenceable");
+static LLPEStat ArgsAligned("arg_attr_align", "Split function arguments marked align");
+
+void llvm::patchReferences(std::vector<uint32_t>& Refs, Value* V) {
 
-  for(std::vector<std::pair<WeakVH, uint32_t> >::iterator it = Refs.begin(),
-	itend = Refs.end(); it != itend; ++it) {
+  for(std::vector<uint32_t>::iterator it = Refs.begin(), itend = Refs.end(); it != itend; ++it) {
 
-    // Value must have gone away due to e.g. discarding a previously committed function.
-    if(!it->first)
+    std::pair<Instruction*, uint32_t>& Req = GlobalIHP->patchRequests[*it];
+
+    // Placeholder must have gone away due to e.g. discarding a previously committed function.
+    if(!Req.first)
       continue;
 
-    release_assert(isa<SelectInst>(it->first));
+    Instruction* I = Req.first;
+    release_assert(isa<SelectInst>(I));
 
-    Instruction* I = cast<Instruction>(it->first);
+    GlobalIHP->patchPlaceholders.erase(I);
+    Req.first = 0;
 
-    I->setOperand(it->second, V);
+    I->setOperand(Req.second, V);
     // Note this would be unsafe if any of the patch recipients were listed more than
     // once in patch lists.
     if(Value* V = SimplifyInstruction(I)) {
@@ -40,6 +62,20 @@ void llvm::patchReferences(std::vector<std::pair<WeakVH, uint32_t> >& Refs, Valu
 
 }
 
+void LLPEAnalysisPass::forgetPatchPlaceholder(Instruction* I) {
+
+  if(patchPlaceholders.empty())
+    return;
+
+  DenseMap<Instruction*, uint32_t>::iterator findit = patchPlaceholders.find(I);
+  if(findit == patchPlaceholders.end())
+    return;
+
+  patchRequests[findit->second].first = 0;
+  patchPlaceholders.erase(findit);
+
+}
+
 static Instruction* getInsertLocation(Value* V) {
 
   if(Instruction* I = dyn_cast<Instruction>(V)) {
@@ -161,6 +197,12 @@ void InlineAttempt::fixNonLocalStackUses() {
 
   for(std::vector<AllocData>::iterator it = localAllocas.begin(),
 	itend = localAllocas.end(); it != itend; ++it) {
+
+    // Eliminated along with its users?
+    if(!it->committedVal) {
+      release_assert(it->PatchRefs.empty());
+      continue;
+    }
     
     patchReferences(it->PatchRefs, it->committedVal);
     forwardReferences(it->committedVal, F.getParent());
@@ -179,9 +221,11 @@ void LLPEAnalysisPass::fixNonLocalUses() {
     if(!it->allocValue.isInst())
       continue;
 
+    // Allocations eliminated along with all their users leave nothing to patch.
     if(!it->committedVal) {
 
-      errs() << "Warning: heap allocation " << it->allocIdx << " not committed\n";
+      if(!it->PatchRefs.empty())
+	errs() << "Warning: heap allocation " << it->allocIdx << " not committed\n";
       continue;
 
     }
@@ -207,19 +251,25 @@ void LLPEAnalysisPass::fixNonLocalUses() {
     forwardReferences(it->CommittedVal, getGlobalModule());
 
   }
+
+  // Everything owed a value has it now; the rest was never committed.
+  patchRequests.clear();
+  patchPlaceholders.clear();
   
 }
 
 void IntegrationAttempt::inheritCommitFunction() {
 
-  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
-        itend = peelChildren.end(); it != itend; ++it) {
+  SmallVector<PeelAttempt*, 4> Loops;
+  getOrderedPeelChildren(Loops);
 
-    if((!it->second->isEnabled()) || !it->second->isTerminated())
+  for(SmallVector<PeelAttempt*, 4>::iterator it = Loops.begin(), itend = Loops.end(); it != itend; ++it) {
+
+    if((!(*it)->isEnabled()) || !(*it)->isTerminated())
       continue;
 
-    for(std::vector<PeelIteration*>::iterator iterit = it->second->Iterations.begin(),
-	  iteritend = it->second->Iterations.end(); iterit != iteritend; ++iterit)
+    for(std::vector<PeelIteration*>::iterator iterit = (*it)->Iterations.begin(),
+	  iteritend = (*it)->Iterations.end(); iterit != iteritend; ++iterit)
       (*iterit)->inheritCommitFunction();
     
   }
@@ -252,9 +302,35 @@ void InlineAttempt::inheritCommitFunctionCall(bool onlyAdd) {
 
 }
 
-// Try to split a specialised program up into chunks of around 10,000 instructions.
-// That's large enough that the inliner won't be appetised to reverse our work, and also will hopefully
-// not hinder optimisation too much.
+// Try to split a specialised program up into chunks costing around SplitThreshold (by default,
+// 50,000 instructions). That's large enough that the inliner won't be appetised to reverse our work,
+// and also will hopefully not hinder optimisation too much.
+// residualInstructionsHere holds the cost, which is the residual instruction count under the default weights.
+
+static uint64_t getResidualInstructionCost(ShadowInstruction* SI) {
+
+  uint64_t cost = 1;
+
+  if(SplitPHICost && inst_is<PHINode>(SI))
+    cost += SplitPHICost;
+
+  if(SplitLiveAcrossCost) {
+
+    ShadowInstructionInvar* SII = SI->invar;
+    for(uint32_t i = 0, ilim = SII->userIdxs.size(); i != ilim; ++i) {
+
+      if(SII->userIdxs[i].blockIdx != SII->parent->idx) {
+	cost += SplitLiveAcrossCost;
+	break;
+      }
+
+    }
+
+  }
+
+  return cost;
+
+}
 
 uint64_t IntegrationAttempt::findSaveSplits() {
 
@@ -286,23 +362,27 @@ uint64_t IntegrationAttempt::findSaveSplits() {
     if(!BB)
       continue;
 
+    residualInstructionsHere += SplitBlockCost;
+
     for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
 
       if(!willBeReplacedWithConstantOrDeleted(ShadowValue(&BB->insts[j])))
-	++residualInstructionsHere;
+	residualInstructionsHere += getResidualInstructionCost(&BB->insts[j]);
 
     }
     
   }
 
-  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
-	itend = peelChildren.end(); it != itend; ++it) {
+  SmallVector<PeelAttempt*, 4> Loops;
+  getOrderedPeelChildren(Loops);
+
+  for(SmallVector<PeelAttempt*, 4>::iterator it = Loops.begin(), itend = Loops.end(); it != itend; ++it) {
 
-    if((!it->second->isEnabled()) || !it->second->isTerminated())
+    if((!(*it)->isEnabled()) || !(*it)->isTerminated())
       continue;
 
-    for(std::vector<PeelIteration*>::iterator iterit = it->second->Iterations.begin(),
-	  iteritend = it->second->Iterations.end(); iterit != iteritend; ++iterit)
+    for(std::vector<PeelIteration*>::iterator iterit = (*it)->Iterations.begin(),
+	  iteritend = (*it)->Iterations.end(); iterit != iteritend; ++iterit)
       residualInstructionsHere += (*iterit)->findSaveSplits();
 
   }
@@ -322,13 +402,15 @@ uint64_t IntegrationAttempt::findSaveSplits() {
 
 void IntegrationAttempt::addPatchRequest(ShadowValue Needed, Instruction* PatchI, uint32_t PatchOp) {
 
-  std::pair<WeakVH, uint32_t> PRQ(WeakVH(PatchI), PatchOp);
+  uint32_t PRQ = pass->patchRequests.size();
+  pass->patchRequests.push_back(std::make_pair(PatchI, PatchOp));
+  pass->patchPlaceholders[PatchI] = PRQ;
 
-  switch(Needed.t) {
+  switch(Needed.getValType()) {
 
   case SHADOWVAL_ARG: {
-    release_assert(Needed.u.A->IA->isRootMainCall());
-    ArgStore& AS = GlobalIHP->argStores[Needed.u.A->invar->A->getArgNo()];
+    release_assert(Needed.getArg()->IA->isRootMainCall());
+    ArgStore& AS = GlobalIHP->argStores[Needed.getArg()->invar->A->getArgNo()];
     AS.PatchRefs.push_back(PRQ);
     break;
   }
@@ -355,6 +437,82 @@ void IntegrationAttempt::addPatchRequest(ShadowValue Needed, Instruction* PatchI
 
 }
 
+// With -int-emit-arg-attributes, tell downstream passes what the analysis knew about the
+// objects a split function's pointer arguments refer to. Only globals and allocations in
+// caller frames are used: both outlive the call, whereas a heap object might be freed
+// during it, or have failed to allocate. noalias is never given, since the objects may
+// also be reached through memory or other globals, which the analysis can't rule out here.
+void InlineAttempt::addArgumentAttributes(Function* NewF) {
+
+  // With several callers the arguments' values are only those the callers agree about.
+  if(isShared())
+    return;
+
+  LLVMContext& Ctx = NewF->getContext();
+
+  Function::arg_iterator AI = NewF->arg_begin();
+  for(uint32_t i = 0, ilim = argShadows.size(); i != ilim; ++i, ++AI) {
+
+    ShadowArg& SA = argShadows[i];
+
+    // Dead arguments are passed as undef.
+    if((!SA.getType()->isPointerTy()) || SA.dieStatus != INSTSTATUS_ALIVE)
+      continue;
+
+    ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(SA.i.PB);
+    if((!IVS) || IVS->Overdef || IVS->SetType != ValSetTypePB || IVS->Values.empty())
+      continue;
+
+    uint64_t Deref = ULONG_MAX;
+    uint64_t Align = UINT_MAX;
+
+    for(SmallVector<ImprovedVal, 1>::iterator it = IVS->Values.begin(), itend = IVS->Values.end(); it != itend; ++it) {
+
+      ShadowValue& Base = it->V;
+      bool isGlobal = Base.isGV();
+      if((!isGlobal) && !(Base.isPtrIdx() && Base.getFrameNo() != -1)) {
+	Deref = 0;
+	break;
+      }
+
+      uint64_t Size = Base.getAllocSize(this);
+      if(it->Offset == LLONG_MAX || it->Offset < 0 || Size == ULONG_MAX || (uint64_t)it->Offset >= Size) {
+	Deref = 0;
+	break;
+      }
+
+      Deref = std::min(Deref, Size - (uint64_t)it->Offset);
+
+      // Only explicit global alignment is known; an alloca's may change as it's committed.
+      uint64_t ObjAlign = isGlobal ? Base.getGV()->G->getAlignment() : 0;
+      if(ObjAlign && it->Offset)
+	ObjAlign = MinAlign(ObjAlign, it->Offset);
+      Align = std::min(Align, ObjAlign);
+
+    }
+
+    if(!Deref)
+      continue;
+
+    AttrBuilder B;
+    B.addAttribute(Attribute::NonNull);
+    B.addDereferenceableAttr(Deref);
+    ++ArgsNonNull;
+    ++ArgsDereferenceable;
+
+    if(Align && Align != UINT_MAX && isPowerOf2_64(Align) && Align <= Value::MaximumAlignment) {
+      B.addAlignmentAttr(Align);
+      ++ArgsAligned;
+    }
+
+    AI->addAttr(AttributeSet::get(Ctx, AI->getArgNo() + 1, B));
+
+  }
+
+}
+
+// Split functions are still built one at a time: they share the module's LLVMContext, whose
+// constant and type uniquing tables and use lists are not safe to mutate from several threads.
 void InlineAttempt::splitCommitHere() {
 
   residualInstructionsHere = 1;
@@ -374,6 +532,9 @@ void InlineAttempt::splitCommitHere() {
   CommitF = cloneEmptyFunction(&F, LT, Name, hasFailedReturnPath() && !isRootMainCall());
   firstFailedBlock = CommitF->end();
 
+  if(EmitArgAttributes && !isRootMainCall())
+    addArgumentAttributes(CommitF);
+
   Function::BasicBlockListType& BBL = CommitF->getBasicBlockList();
   
   for(std::vector<BasicBlock*>::iterator it = CommitBlocks.begin(), 
@@ -396,6 +557,7 @@ void InlineAttempt::splitCommitHere() {
   CommitBlocks.clear();
   CommitFailedBlocks.clear();
   CommitFunctions.push_back(CommitF);
+  pass->splitCommitFunctions.push_back(WeakVH(CommitF));
 
   residualInstructionsHere = 1;
 
@@ -403,16 +565,16 @@ void InlineAttempt::splitCommitHere() {
 
 }
 
-#define SPLIT_THRESHOLD 50000
-
 uint64_t InlineAttempt::findSaveSplits() {
 
+  PhaseTimer Timer(PhaseSaveSplit);
+
   if(isCommitted())
     return residualInstructionsHere;
   
   uint64_t residuals;
 
-  if(mustCommitOutOfLine() || (residuals = IntegrationAttempt::findSaveSplits()) > SPLIT_THRESHOLD) {
+  if(mustCommitOutOfLine() || (residuals = IntegrationAttempt::findSaveSplits()) > SplitThreshold) {
     splitCommitHere();
     return 1;
   }
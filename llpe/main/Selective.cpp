@@ -61,12 +61,30 @@ void IntegrationAttempt::resetDeadInstructions() {
 
 }
 
+// DSE and DIE results can't be recomputed for just the toggled context: stores pass from caller
+// to callee and back, so its enablement can change what is dead anywhere before or after it.
+// But toggling a context and then changing one's mind is the common case when tuning a
+// specialisation, so track each toggle against the state the last run saw; when every context
+// is back as it was, the existing results still stand.
+void LLPEAnalysisPass::noteContextToggled(void* Ctx, bool wasEnabled) {
+
+  std::pair<DenseMap<void*, bool>::iterator, bool> ins = togglesSinceDIE.insert(std::make_pair(Ctx, wasEnabled));
+  if(!ins.second) {
+
+    // Toggled twice since the last run: back to how it was.
+    togglesSinceDIE.erase(ins.first);
+
+  }
+
+  mustRecomputeDIE = !togglesSinceDIE.empty();
+
+}
+
 void LLPEAnalysisPass::rerunDSEAndDIE() {
 
   if(mustRecomputeDIE) {
     RootIA->resetDeadArgsAndInstructions();
     runDSEAndDIE();
-    mustRecomputeDIE = false;
   }
 
 }
@@ -105,13 +123,18 @@ void InlineAttempt::setEnabled(bool en, bool skipStats) {
   if(isPathCondition)
     return;
 
-  if(enabled != en)
-    pass->mustRecomputeDIE = true;    
+  if(enabled == en)
+    return;
+
+  pass->noteContextToggled(this, enabled);
 
   enabled = en;
 
-  if(!skipStats)
-    pass->getRoot()->collectStats();
+  // The parent's goodness counted ours only if we were enabled. The instruction statistics
+  // don't depend on whether anything is, so they no longer need recollecting from the root.
+  IntegrationAttempt* Parent = Callers[0]->parent->IA;
+  Parent->ownResidualFunctionsValid = false;
+  Parent->invalidateBenefit();
 
 }
 
@@ -123,11 +146,15 @@ void PeelIteration::setEnabled(bool en, bool skipStats) {
 
 void PeelAttempt::setEnabled(bool en, bool skipStats) {
 
-  if(en != enabled)
-    pass->mustRecomputeDIE = true;
+  if(en == enabled)
+    return;
+
+  pass->noteContextToggled(this, enabled);
 
   enabled = en;
 
+  parent->invalidateBenefit();
+
 }
 
 bool InlineAttempt::commitsOutOfLine() {
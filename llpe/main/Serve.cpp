@@ -0,0 +1,311 @@
+//===-- Serve.cpp ---------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// A fork server, enabled with -int-serve=SOCKET, for specialising the same module many
+// times with different inputs without loading it each time. The opt process loads the
+// module and brings up LLPE's analyses as usual, then instead of specialising it listens
+// on a Unix socket. Each connection sends one line,
+//
+//   CONFIG<tab>OUTPUT
+//
+// and the server forks a worker, whose copy-on-write image of the module is the clone
+// the job works on: it reads CONFIG as a further -int-config file (see Config.cpp),
+// specialises and commits as a normal run would, writes the result as bitcode to
+// OUTPUT and exits. The reply is "ok" or "failed" once the worker has finished, so jobs
+// can run concurrently. A line reading "quit" stops the server.
+//
+// Any passes after LLPE in the opt pipeline don't run for served jobs, and the driver
+// must be run with -integrator-accept-all. scripts/llpe-client.py submits a job.
+//
+// The server does no analysis of its own before forking: the function invariants
+// number globals in the shadow heap, whose layout depends on the job's options (e.g.
+// how many string path conditions it has), so they can't be prepared once for all jobs.
+//
+// The same server keeps checkpoints of a long run, with -int-checkpoint=PREFIX. At the
+// end of interpretation and again once analysis and per-context commit are done, LLPE
+// forks a server holding its state as of then, listening on PREFIX.interpreted and
+// PREFIX.analysed, and carries on. If the run later dies, or only commit-side options
+// need changing, a job sent to a checkpoint resumes from there instead of from scratch.
+// Its CONFIG may be empty, and can only usefully set options read after that point,
+// e.g. for commit, and not ones already given. The checkpoints are copy-on-write images
+// of the run, so they cost memory as the run goes on changing its state. They last until
+// sent "quit", or until no job has arrived for -int-checkpoint-timeout seconds (default
+// an hour; 0 for no limit). A checkpoint closes the fds it inherited from opt, so callers
+// waiting for EOF on the run's pipes aren't held up by it, and logs to PREFIX.Name.log.
+//
+// Checkpoints only help with a run that fails or needs redoing from a known point while
+// the machine and its job stay up. They live in memory in the same cgroup as the run, so
+// they add to its footprint, and they die with it on an OOM kill of the job, a killed job
+// or a reboot: they cannot recover from those.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/IR/Module.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+static cl::opt<std::string> ServeSocket("int-serve", cl::init(""));
+static cl::opt<std::string> CheckpointPrefix("int-checkpoint", cl::init(""));
+static cl::opt<unsigned> CheckpointTimeout("int-checkpoint-timeout", cl::init(3600));
+
+static void writeAll(int fd, const char* str) {
+
+  size_t len = strlen(str);
+  while(len) {
+
+    ssize_t written = write(fd, str, len);
+    if(written <= 0) {
+      if(written == -1 && errno == EINTR)
+	continue;
+      return;
+    }
+
+    str += written;
+    len -= written;
+
+  }
+
+}
+
+static bool readLine(int fd, std::string& line) {
+
+  char c;
+  while(line.size() < 4096) {
+
+    ssize_t thisread = read(fd, &c, 1);
+    if(thisread == -1 && errno == EINTR)
+      continue;
+    if(thisread <= 0)
+      return false;
+    if(c == '\n')
+      return true;
+    line.push_back(c);
+
+  }
+
+  return false;
+
+}
+
+// Listen on Socket for jobs until told to quit or, if IdleTimeout is nonzero, until no job
+// has arrived for that many seconds, returning only in a worker, with the job's CONFIG
+// (empty for none) and OUTPUT.
+static void runServer(const std::string& Socket, const char* Option, unsigned IdleTimeout, std::string& Config, std::string& Output) {
+
+  struct sockaddr_un addr;
+  if(Socket.size() >= sizeof(addr.sun_path)) {
+    errs() << Option << ": socket path " << Socket << " is too long\n";
+    exit(1);
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, Socket.c_str());
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(Socket.c_str());
+  if(sock == -1 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(sock, 16) == -1) {
+    errs() << Option << ": failed to listen on " << Socket << ": " << strerror(errno) << "\n";
+    exit(1);
+  }
+
+  // Reap the per-job supervisors automatically.
+  signal(SIGCHLD, SIG_IGN);
+
+  errs() << "Serving specialisation jobs on " << Socket << "\n";
+
+  while(1) {
+
+    if(IdleTimeout) {
+
+      struct pollfd pfd;
+      pfd.fd = sock;
+      pfd.events = POLLIN;
+      int ready = poll(&pfd, 1, IdleTimeout * 1000);
+      if(ready == -1 && errno == EINTR)
+	continue;
+      if(ready == 0) {
+	errs() << Option << ": no jobs for " << IdleTimeout << " seconds, exiting\n";
+	close(sock);
+	unlink(Socket.c_str());
+	exit(0);
+      }
+
+    }
+
+    int conn = accept(sock, 0, 0);
+    if(conn == -1) {
+      if(errno == EINTR)
+	continue;
+      errs() << Option << ": accept failed: " << strerror(errno) << "\n";
+      exit(1);
+    }
+
+    std::string line;
+    if(!readLine(conn, line)) {
+      close(conn);
+      continue;
+    }
+
+    if(line == "quit") {
+      writeAll(conn, "ok\n");
+      close(conn);
+      close(sock);
+      unlink(Socket.c_str());
+      exit(0);
+    }
+
+    size_t tab = line.find('\t');
+    if(tab == std::string::npos || tab == line.size() - 1) {
+      writeAll(conn, "failed: expected CONFIG<tab>OUTPUT\n");
+      close(conn);
+      continue;
+    }
+
+    // The supervisor waits for the worker so it can report how the job went, leaving
+    // the server free to accept the next one.
+    pid_t supervisor = fork();
+    if(supervisor == -1) {
+      writeAll(conn, "failed: fork\n");
+      close(conn);
+      continue;
+    }
+
+    if(supervisor) {
+      close(conn);
+      continue;
+    }
+
+    close(sock);
+    signal(SIGCHLD, SIG_DFL);
+
+    pid_t worker = fork();
+    if(worker == 0) {
+
+      close(conn);
+      Config = line.substr(0, tab);
+      Output = line.substr(tab + 1);
+      return;
+
+    }
+
+    int status = 0;
+    bool ok = false;
+    if(worker != -1) {
+      while(waitpid(worker, &status, 0) == -1 && errno == EINTR) { }
+      ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    writeAll(conn, ok ? "ok\n" : "failed\n");
+    close(conn);
+    _exit(0);
+
+  }
+
+}
+
+// With -int-serve, returns only in a worker, with jobConfigFile and jobOutputFile set.
+void LLPEAnalysisPass::serveJobs() {
+
+  if(ServeSocket.empty())
+    return;
+
+  runServer(ServeSocket, "-int-serve", 0, jobConfigFile, jobOutputFile);
+
+}
+
+// Take a checkpoint at the end of phase Name: fork a server that holds the analysis as it
+// stands and listens on PREFIX.Name, while this process carries on as usual. A job sent to
+// it resumes from here in a worker, reading CONFIG, if given, as a further -int-config file
+// before continuing, and writes its result to OUTPUT as a -int-serve job would. Workers take
+// no checkpoints of their own.
+void LLPEAnalysisPass::checkpoint(const char* Name) {
+
+  if(CheckpointPrefix.empty() || !jobOutputFile.empty())
+    return;
+
+  pid_t server = fork();
+  if(server == -1) {
+    errs() << "-int-checkpoint: fork failed: " << strerror(errno) << "; no checkpoint after " << Name << "\n";
+    return;
+  }
+
+  if(server)
+    return;
+
+  // Outlive this run, and keep its terminal's signals away.
+  setsid();
+
+  // Let go of opt's stdin, stdout, stderr and anything else it had open, so that whoever
+  // waits for the run's pipes to close isn't kept waiting for the checkpoint too.
+  std::string Socket = CheckpointPrefix + "." + Name;
+  std::string Log = Socket + ".log";
+  int nullfd = open("/dev/null", O_RDONLY);
+  int logfd = open(Log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(logfd == -1)
+    logfd = open("/dev/null", O_WRONLY);
+  errs().flush();
+  outs().flush();
+  dup2(nullfd, 0);
+  dup2(logfd, 1);
+  dup2(logfd, 2);
+  long maxfd = sysconf(_SC_OPEN_MAX);
+  if(maxfd == -1 || maxfd > 65536)
+    maxfd = 65536;
+  for(long fd = 3; fd < maxfd; ++fd)
+    close(fd);
+
+  std::string config;
+  runServer(Socket, "-int-checkpoint", CheckpointTimeout, config, jobOutputFile);
+
+  if(!config.empty())
+    loadConfigFile(config);
+
+}
+
+// Called at the end of commit in a worker. opt writes its output file only once the
+// whole pipeline has run, which it can't in a worker, so save the result here.
+void LLPEAnalysisPass::finishServedJob() {
+
+  if(jobOutputFile.empty())
+    return;
+
+  std::error_code error;
+  raw_fd_ostream Out(jobOutputFile.c_str(), error, sys::fs::F_None);
+  if(error) {
+    errs() << "Failed to open " << jobOutputFile << ": " << error.message() << "\n";
+    exit(1);
+  }
+
+  WriteBitcodeToFile(getGlobalModule(), Out);
+  Out.close();
+  if(Out.has_error()) {
+    Out.clear_error();
+    errs() << "Failed to write " << jobOutputFile << "\n";
+    exit(1);
+  }
+
+  releaseMemory();
+  exit(0);
+
+}
@@ -66,6 +66,38 @@ static void ignoreChildLoops(SmallSet<BasicBlock*, 1>& headers, const Loop* L) {
   
 }
 
+static bool isLoopInvariant(ShadowFunctionInvar* FInfo, ShadowInstructionInvar* SII) {
+
+  Instruction* I = SII->I;
+
+  // Only instructions that compute a pure function of their operands; in particular not
+  // PHIs, loads, calls or allocations.
+  if(!(isa<BinaryOperator>(I) || isa<CastInst>(I) || isa<GetElementPtrInst>(I) || isa<CmpInst>(I) ||
+       isa<SelectInst>(I) || isa<ExtractValueInst>(I) || isa<InsertValueInst>(I)))
+    return false;
+
+  const ShadowLoopInvar* L = SII->parent->naturalScope;
+
+  for(uint32_t i = 0, ilim = SII->operandIdxs.size(); i != ilim; ++i) {
+
+    ShadowInstIdx& Op = SII->operandIdxs[i];
+    if(Op.blockIdx == INVALID_BLOCK_IDX)
+      continue;
+
+    ShadowBBInvar& OpBB = FInfo->BBs[Op.blockIdx];
+    if(OpBB.naturalScope && L->contains(OpBB.naturalScope)) {
+
+      if(OpBB.naturalScope != L || Op.instIdx == INVALID_INSTRUCTION_IDX || !OpBB.insts[Op.instIdx].loopInvariant)
+	return false;
+
+    }
+
+  }
+
+  return true;
+
+}
+
 ShadowLoopInvar* LLPEAnalysisPass::getLoopInfo(ShadowFunctionInvar* FInfo,
 							DenseMap<BasicBlock*, uint32_t>& BBIndices, 
 							const Loop* L,
@@ -169,27 +201,55 @@ void LLPEAnalysisPass::initShadowGlobals(Module& M, uint32_t extraSlots) {
   for(Module::global_iterator it = M.global_begin(), itend = M.global_end(); it != itend; ++it, ++i) {
 
     if(it->isConstant()) {
-      shadowGlobals[i].storeSize = GlobalAA->getTypeStoreSize(shadowGlobals[i].G->getType());
+      shadowGlobals[i].storeSize = getTypeStoreSize(shadowGlobals[i].G->getType());
+      continue;
+    }
+
+    shadowGlobals[i].storeSize = getTypeStoreSize(it->getType()->getElementType());
+
+    // A mutable global that nothing in the module refers to can only be reached through
+    // a fact given on the command line (a --spec-param pointer, a path condition, a mutex
+    // domain), since everything else that yields a global does so from a Constant and so
+    // a use. Rather than give each a heap slot and an entry in every store, which for
+    // modules with large unused static data dominates start-up, the parser calls
+    // ensureGlobalAllocation for the ones it names. Others never get a slot.
+    // Bodies not yet read from a lazily loaded module don't show up as uses, so there
+    // every mutable global needs its slot.
+    it->removeDeadConstantUsers();
+    if(it->use_empty() && !lazyModule) {
+      shadowGlobals[i].allocIdx = -1;
       continue;
     }
 
-    shadowGlobals[i].allocIdx = (int32_t)heap.size();
+    createGlobalAllocation(i);
+
+  }
+
+}
+
+void LLPEAnalysisPass::createGlobalAllocation(uint32_t i) {
+
+  shadowGlobals[i].allocIdx = (int32_t)heap.size();
     
-    heap.push_back(AllocData());
-    AllocData& AD = heap.back();
-    AD.allocIdx = heap.size() - 1;
-    AD.storeSize = GlobalAA->getTypeStoreSize(it->getType()->getElementType());
-    AD.isCommitted = true;
-    AD.allocValue = ShadowValue(&(shadowGlobals[i]));
-    AD.allocType = shadowGlobals[i].G->getType();
+  heap.push_back(AllocData());
+  AllocData& AD = heap.back();
+  AD.allocIdx = heap.size() - 1;
+  AD.storeSize = shadowGlobals[i].storeSize;
+  AD.isCommitted = true;
+  AD.allocValue = ShadowValue(&(shadowGlobals[i]));
+  AD.allocType = shadowGlobals[i].G->getType();
 
-    //errs() << "Init store for " << *it << " -> ";
-    //printPB(errs(), *Init);
-    //errs() << "\n";
+}
 
-    shadowGlobals[i].storeSize = AD.storeSize;
+void LLPEAnalysisPass::ensureGlobalAllocation(GlobalVariable* GV) {
 
-  }
+  uint32_t i = getShadowGlobalIndex(GV);
+  if(GV->isConstant() || shadowGlobals[i].allocIdx != -1)
+    return;
+
+  // Too late: stores made since wouldn't know its initial value.
+  release_assert(!globalStoresInitialised && "Unreferenced global named after analysis began");
+  createGlobalAllocation(i);
 
 }
 
@@ -216,12 +276,90 @@ static const GlobalVariable* getGlobalVar(const Value* V) {
 
 }
 
+// Most functions in a large module are never entered, so dominator trees are built on
+// demand, and freed once no uncommitted context of the function needs one.
+DominatorTree* LLPEAnalysisPass::getDT(Function& F) {
+
+  std::pair<DominatorTree*, uint32_t>& Entry = DTs[&F];
+  if(!Entry.first) {
+    Entry.first = new DominatorTree();
+    Entry.first->recalculate(F);
+  }
+
+  ++Entry.second;
+  return Entry.first;
+
+}
+
+void LLPEAnalysisPass::releaseDT(Function& F) {
+
+  DenseMap<Function*, std::pair<DominatorTree*, uint32_t> >::iterator findit = DTs.find(&F);
+  release_assert(findit != DTs.end() && findit->second.second && "Releasing unheld dominator tree");
+
+  if(!--findit->second.second) {
+    delete findit->second.first;
+    DTs.erase(findit);
+  }
+
+}
+
+namespace {
+
+  // Hands out consecutive slices of one allocation.
+  template<class T> class InvarPool {
+
+    T* next;
+
+  public:
+
+    InvarPool(size_t n) : next(new T[n]) { }
+
+    ImmutableArray<T> take(size_t n) {
+      ImmutableArray<T> ret(next, n);
+      next += n;
+      return ret;
+    }
+
+  };
+
+}
+
+// In a lazily loaded module a function's body is only read from the bitcode when the
+// specialiser first needs it; until then the function is neither a declaration nor has blocks.
+void LLPEAnalysisPass::materialiseFunction(Function& F) {
+
+  if(!F.isMaterializable())
+    return;
+
+  if(std::error_code error = F.materialize()) {
+    errs() << "Failed to read the body of " << F.getName() << ": " << error.message() << "\n";
+    exit(1);
+  }
+
+}
+
+void LLPEAnalysisPass::materialiseAllFunctions(Module& M) {
+
+  if(!lazyModule)
+    return;
+
+  if(std::error_code error = M.materializeAll()) {
+    errs() << "Failed to read the module's remaining function bodies: " << error.message() << "\n";
+    exit(1);
+  }
+
+  lazyModule = false;
+
+}
+
 ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
   DenseMap<Function*, ShadowFunctionInvar*>::iterator findit = functionInfo.find(&F);
   if(findit != functionInfo.end())
     return findit->second;
 
+  materialiseFunction(F);
+
   // Beware! This LoopInfo instance and whatever Loop objects come from it are only alive until
   // the next call to getAnalysis. Therefore the ShadowLoopInvar objects we make here
   // must mirror all information we're interested in from the Loops.
@@ -260,6 +398,39 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
   }
 
+  // Size every block, instruction and argument's index arrays first, so that each kind
+  // comes from a single allocation per function rather than several per instruction.
+  size_t nInsts = 0, nBlockIdxs = 0, nInstIdxs = 0;
+
+  for(uint32_t i = 0; i < TopOrderedBlocks.size(); ++i) {
+
+    BasicBlock* BB = TopOrderedBlocks[i];
+    nInsts += BB->size();
+    nBlockIdxs += std::distance(succ_begin(BB), succ_end(BB)) + std::distance(pred_begin(BB), pred_end(BB));
+
+    for(BasicBlock::iterator BI = BB->begin(), BE = BB->end(); BI != BE; ++BI) {
+
+      if(PHINode* PN = dyn_cast<PHINode>(BI)) {
+	nInstIdxs += PN->getNumIncomingValues();
+	nBlockIdxs += PN->getNumIncomingValues();
+      }
+      else {
+	nInstIdxs += BI->getNumOperands();
+      }
+
+      nInstIdxs += std::distance(BI->use_begin(), BI->use_end());
+
+    }
+
+  }
+
+  for(Function::arg_iterator AI = F.arg_begin(), AE = F.arg_end(); AI != AE; ++AI)
+    nInstIdxs += std::distance(AI->use_begin(), AI->use_end());
+
+  InvarPool<ShadowInstructionInvar> InstPool(nInsts);
+  InvarPool<uint32_t> BlockIdxPool(nBlockIdxs);
+  InvarPool<ShadowInstIdx> InstIdxPool(nInstIdxs);
+
   ShadowBBInvar* FShadowBlocks = new ShadowBBInvar[TopOrderedBlocks.size()];
 
   for(uint32_t i = 0; i < TopOrderedBlocks.size(); ++i) {
@@ -280,7 +451,7 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
     succ_iterator SI = succ_begin(BB), SE = succ_end(BB);
     uint32_t succSize = std::distance(SI, SE);
-    SBB.succIdxs = ImmutableArray<uint32_t>(new uint32_t[succSize], succSize);
+    SBB.succIdxs = BlockIdxPool.take(succSize);
 
     for(uint32_t j = 0; SI != SE; ++SI, ++j) {
 
@@ -292,7 +463,7 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
     pred_iterator PI = pred_begin(BB), PE = pred_end(BB);
     uint32_t predSize = std::distance(PI, PE);
-    SBB.predIdxs = ImmutableArray<uint32_t>(new uint32_t[predSize], predSize);
+    SBB.predIdxs = BlockIdxPool.take(predSize);
     
     for(uint32_t j = 0; PI != PE; ++PI, ++j) {
 
@@ -311,26 +482,27 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
     }
 
     // Find instruction def/use indices:
-    ShadowInstructionInvar* insts = new ShadowInstructionInvar[BB->size()];
+    SBB.insts = InstPool.take(BB->size());
 
     BasicBlock::iterator BI = BB->begin(), BE = BB->end();
     for(uint32_t j = 0; BI != BE; ++BI, ++j) {
 
       Instruction* I = BI;
-      ShadowInstructionInvar& SI = insts[j];
+      ShadowInstructionInvar& SI = SBB.insts[j];
 
       SI.idx = j;
+      SI.loopInvariant = false;
       SI.parent = &SBB;
       SI.I = I;
       
       // Get operands indices:
       uint32_t NumOperands;
-      ShadowInstIdx* operandIdxs;
       if(PHINode* PN = dyn_cast<PHINode>(I)) {
 
 	NumOperands = PN->getNumIncomingValues();
-	operandIdxs = new ShadowInstIdx[NumOperands];
-	uint32_t* incomingBBs = new uint32_t[NumOperands];
+	SI.operandIdxs = InstIdxPool.take(NumOperands);
+	SI.operandBBs = BlockIdxPool.take(NumOperands);
+	ImmutableArray<ShadowInstIdx>& operandIdxs = SI.operandIdxs;
 
 	for(unsigned k = 0, kend = PN->getNumIncomingValues(); k != kend; ++k) {
 
@@ -340,17 +512,16 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 	    operandIdxs[k] = ShadowInstIdx(INVALID_BLOCK_IDX, getShadowGlobalIndex(OpGV));
 	  else
 	    operandIdxs[k] = ShadowInstIdx();
-	  incomingBBs[k] = BBIndices[PN->getIncomingBlock(k)];
+	  SI.operandBBs[k] = BBIndices[PN->getIncomingBlock(k)];
 
 	}
 
-	SI.operandBBs = ImmutableArray<uint32_t>(incomingBBs, NumOperands);
-
       }
       else {
 
 	NumOperands = I->getNumOperands();
-	operandIdxs = new ShadowInstIdx[NumOperands];
+	SI.operandIdxs = InstIdxPool.take(NumOperands);
+	ImmutableArray<ShadowInstIdx>& operandIdxs = SI.operandIdxs;
 
 	for(unsigned k = 0, kend = I->getNumOperands(); k != kend; ++k) {
 	  
@@ -367,12 +538,11 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
       }
 
-      SI.operandIdxs = ImmutableArray<ShadowInstIdx>(operandIdxs, NumOperands);
-
       // Get user indices:
       unsigned nUsers = std::distance(I->use_begin(), I->use_end());
 
-      ShadowInstIdx* userIdxs = new ShadowInstIdx[nUsers];
+      SI.userIdxs = InstIdxPool.take(nUsers);
+      ImmutableArray<ShadowInstIdx>& userIdxs = SI.userIdxs;
 
       Instruction::use_iterator UI;
       unsigned k;
@@ -391,12 +561,8 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
       }
 
-      SI.userIdxs = ImmutableArray<ShadowInstIdx>(userIdxs, nUsers);
-
     }
 
-    SBB.insts = ImmutableArray<ShadowInstructionInvar>(insts, BB->size());
-
   }
 
   RetInfo.BBs = ImmutableArray<ShadowBBInvar>(FShadowBlocks, TopOrderedBlocks.size());
@@ -417,7 +583,8 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
     Argument::use_iterator UI = A->use_begin(), UE = A->use_end();
 
     uint32_t nUsers = std::distance(UI, UE);
-    ShadowInstIdx* Users = new ShadowInstIdx[nUsers];
+    SArg.userIdxs = InstIdxPool.take(nUsers);
+    ImmutableArray<ShadowInstIdx>& Users = SArg.userIdxs;
 
     for(; UI != UE; ++UI, ++j) {
 
@@ -435,8 +602,6 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
     }
 
-    SArg.userIdxs = ImmutableArray<ShadowInstIdx>(Users, nUsers);
-
   }
 
   RetInfo.Args = ImmutableArray<ShadowArgInvar>(Args, F.arg_size());
@@ -445,13 +610,28 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
   // all loops consist of that block + L->getBlocks().size() further, contiguous blocks,
   // making is-in-loop easy to compute.
 
-  DominatorTree* thisDT = DTs[&F];
+  DominatorTree* thisDT = getDT(F);
 
   for(LoopInfo::iterator it = LI->begin(), it2 = LI->end(); it != it2; ++it) {
     ShadowLoopInvar* newL = getLoopInfo(&RetInfo, BBIndices, *it, thisDT, 0);
     RetInfo.TopLevelLoops.push_back(newL);
   }
 
+  releaseDT(F);
+
+  // With loop scopes known, find the instructions that are invariant in their natural loop.
+  // Blocks are top-ordered, so operands within the loop are classified before their users.
+  for(uint32_t i = 0, ilim = RetInfo.BBs.size(); i != ilim; ++i) {
+
+    ShadowBBInvar& SBB = RetInfo.BBs[i];
+    if(!SBB.naturalScope)
+      continue;
+
+    for(uint32_t j = 0, jlim = SBB.insts.size(); j != jlim; ++j)
+      SBB.insts[j].loopInvariant = isLoopInvariant(&RetInfo, &SBB.insts[j]);
+
+  }
+
   // Count alloca instructions at the start of the function; this will control how
   // large the std::vector that represents the frame will be initialised.
   RetInfo.frameSize = 0;
@@ -581,28 +761,32 @@ ShadowBB* IntegrationAttempt::getUniqueBBRising(ShadowBBInvar* BBI) {
 ShadowBB* IntegrationAttempt::createBB(uint32_t blockIdx) {
 
   release_assert((!BBs[blockIdx - BBsOffset]) && "Creating block for the second time");
-  ShadowBB* newBB = new ShadowBB();
+  ShadowBB* newBB = new (BBAllocator.Allocate<ShadowBB>()) ShadowBB();
   newBB->invar = &(invarInfo->BBs[blockIdx]);
-  newBB->succsAlive = new bool[newBB->invar->succIdxs.size()];
+  newBB->succsAlive = BBAllocator.Allocate<bool>(newBB->invar->succIdxs.size());
   for(unsigned i = 0, ilim = newBB->invar->succIdxs.size(); i != ilim; ++i)
     newBB->succsAlive[i] = false;
   newBB->status = BBSTATUS_UNKNOWN;
   newBB->IA = this;
 
-  ShadowInstruction* insts = new ShadowInstruction[newBB->invar->insts.size()];
+  ShadowInstruction* insts = BBAllocator.Allocate<ShadowInstruction>(newBB->invar->insts.size());
   for(uint32_t i = 0, ilim = newBB->invar->insts.size(); i != ilim; ++i) {
+    new (&(insts[i])) ShadowInstruction();
     insts[i].invar = &(newBB->invar->insts[i]);
     insts[i].parent = newBB;
     insts[i].dieStatus = 0;
+    insts[i].sideTables = 0;
     insts[i].isThreadLocal = TLS_MUSTCHECK;
     insts[i].needsRuntimeCheck = RUNTIME_CHECK_NONE;
     insts[i].typeSpecificData = 0;
   }
   newBB->insts = ImmutableArray<ShadowInstruction>(insts, newBB->invar->insts.size());
   newBB->useSpecialVarargMerge = false;
+  newBB->exitStoresFolded = false;
   newBB->localStore = 0;
 
   BBs[blockIdx - BBsOffset] = newBB;
+  livenessChanged();
   return newBB;
 
 }
@@ -678,6 +862,26 @@ ShadowInstruction* IntegrationAttempt::getInst(ShadowInstructionInvar* SII) {
 
 }
 
+std::vector<uint64_t> ShadowValue::boxedInts;
+static DenseMap<uint64_t, uint32_t> boxedIntIndices;
+
+// Encode a 64-bit integer, interning it if it doesn't fit the inline payload.
+uint64_t ShadowValue::makeInt64(uint64_t CI) {
+
+  int64_t signedCI = (int64_t)CI;
+  int64_t limit = ((int64_t)1) << (63 - SVIMM_PAYLOADSHIFT);
+  if(signedCI >= -limit && signedCI < limit)
+    return makeImm(SVIMM_CI64, CI);
+
+  std::pair<DenseMap<uint64_t, uint32_t>::iterator, bool> it =
+    boxedIntIndices.insert(std::make_pair(CI, (uint32_t)boxedInts.size()));
+  if(it.second)
+    boxedInts.push_back(CI);
+
+  return makeImm(SVIMM_CI64BOXED, it.first->second);
+
+}
+
 ShadowValue ShadowValue::getInt(Type* CIT, uint64_t CIVal) {
 
   if(CIT->isIntegerTy(8))
@@ -756,7 +960,7 @@ void IntegrationAttempt::copyLoopExitingDeadEdges(PeelAttempt* LPA) {
       
       for(uint32_t j = 0; j < BB->invar->succIdxs.size(); ++j) {
 	if(BB->invar->succIdxs[j] == E.second)
-	  BB->succsAlive[j] = !dead;
+	  BB->setSuccAlive(j, !dead);
       }
       
     }
@@ -799,10 +1003,10 @@ bool FDGlobalState::isAvailable() {
 
 bool ShadowValue::objectAvailable() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_OTHER: 
     {
-      if(Function* F = dyn_cast<Function>(u.V))
+      if(Function* F = dyn_cast<Function>(getVal()))
 	return !GlobalIHP->specialLocations.count(F);
       else
 	return true;
@@ -811,15 +1015,15 @@ bool ShadowValue::objectAvailable() const {
   case SHADOWVAL_ARG:
     return true;
   case SHADOWVAL_INST:
-    if(u.I->parent->IA->getFunctionRoot()->isPathCondition)
+    if(getInst()->parent->IA->getFunctionRoot()->isPathCondition)
       return false;
-    if(!u.I->parent->IA->allAncestorsEnabled())
+    if(!getInst()->parent->IA->allAncestorsEnabled())
       return false;
     return true;
   case SHADOWVAL_PTRIDX:
     // Stack-allocated members are necessarily available from any context
     // that can conceivably reach them.
-    if(u.PtrOrFd.frame != -1)
+    if(getIdxFrame() != -1)
       return true;
     else {
       AllocData* AD = getAllocData((OrdinaryLocalStore*)0);
@@ -0,0 +1,293 @@
+//===-- SharedFunctions.cpp -----------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// With -int-shared-function-dir=DIR, residual functions that other specialisation runs
+// are likely to commit identically -- split functions specialising library internals
+// against the same facts, say -- are moved out of the residual program into DIR, one
+// module each, and the program calls them by a name derived from their content. Linking
+// a batch of tools against DIR's modules (e.g. llvm-link DIR/*.bc into a shared object)
+// then compiles and ships each shared function once.
+//
+// The key is a SHA1 of the function as a standalone module. That is the function
+// specialised, its abstract inputs and the values it depends on, all as they affected
+// the residual code; a module holding a function with a given name always defines the
+// same code. As with -int-cache-dir, the analysis that produced a function can't be kept
+// across runs (see Cache.cpp), so this saves code generation and size but not LLPE's
+// own time.
+//
+// Only split functions that are called directly and refer to nothing local to this
+// module, other than unnamed_addr constants that can be copied along, are shared.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <openssl/sha.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+static cl::opt<std::string> SharedFunctionDir("int-shared-function-dir", cl::init(""));
+
+static LLPEStat ReusedSharedFunctions("reused_shared_functions", "Split residual functions found in -int-shared-function-dir already");
+static LLPEStat WrittenSharedFunctions("written_shared_functions", "Split residual functions added to -int-shared-function-dir");
+
+// Find the globals that F refers to, in order of first use so that the shared module and
+// so its key are the same each time, failing if any must stay in this module.
+static bool collectSharedRefs(Constant* C, SmallSetVector<GlobalValue*, 8>& Refs, SmallPtrSet<Constant*, 16>& Seen);
+
+static bool collectSharedRefs(Value* V, SmallSetVector<GlobalValue*, 8>& Refs, SmallPtrSet<Constant*, 16>& Seen) {
+
+  Constant* C = dyn_cast<Constant>(V);
+  if((!C) || !Seen.insert(C).second)
+    return true;
+
+  return collectSharedRefs(C, Refs, Seen);
+
+}
+
+static bool collectSharedRefs(Constant* C, SmallSetVector<GlobalValue*, 8>& Refs, SmallPtrSet<Constant*, 16>& Seen) {
+
+  if(GlobalValue* GV = dyn_cast<GlobalValue>(C)) {
+
+    Refs.insert(GV);
+
+    if(!GV->hasLocalLinkage())
+      return GV->hasName();
+
+    // Local, so it must be a constant we can copy, and so must anything its initialiser uses.
+    GlobalVariable* GVar = dyn_cast<GlobalVariable>(GV);
+    if((!GVar) || (!GVar->isConstant()) || (!GVar->hasUnnamedAddr()) || !GVar->hasInitializer())
+      return false;
+
+    return collectSharedRefs(GVar->getInitializer(), Refs, Seen);
+
+  }
+
+  for(uint32_t i = 0, ilim = C->getNumOperands(); i != ilim; ++i) {
+
+    if(!collectSharedRefs(C->getOperand(i), Refs, Seen))
+      return false;
+
+  }
+
+  return true;
+
+}
+
+// Build a module holding only a copy of F, named NewName, and whatever it refers to.
+static Module* buildSharedModule(Function* F, const SmallSetVector<GlobalValue*, 8>& Refs, const std::string& NewName) {
+
+  Module* M = F->getParent();
+  Module* Shared = new Module("llpe.shared", M->getContext());
+  Shared->setDataLayout(M->getDataLayout());
+  Shared->setTargetTriple(M->getTargetTriple());
+
+  ValueToValueMapTy VMap;
+
+  std::vector<GlobalVariable*> Copied;
+  uint32_t nCopied = 0;
+
+  for(SmallSetVector<GlobalValue*, 8>::const_iterator it = Refs.begin(), itend = Refs.end(); it != itend; ++it) {
+
+    GlobalValue* GV = *it;
+    GlobalValue* NewGV;
+
+    if(Function* RefF = dyn_cast<Function>(GV)) {
+
+      Function* NewF = Function::Create(RefF->getFunctionType(), GlobalValue::ExternalLinkage, RefF->getName(), Shared);
+      NewF->copyAttributesFrom(RefF);
+      NewGV = NewF;
+
+    }
+    else {
+
+      // Aliases are declared as globals of their type.
+      PointerType* PTy = GV->getType();
+      GlobalVariable* GVar = dyn_cast<GlobalVariable>(GV);
+      bool isConstant = GVar && GVar->isConstant();
+
+      if(GV->hasLocalLinkage()) {
+
+	std::string CopyName;
+	{
+	  raw_string_ostream RSO(CopyName);
+	  RSO << NewName << ".c" << nCopied++;
+	}
+
+	GlobalVariable* NewVar = new GlobalVariable(*Shared, PTy->getElementType(), true, GlobalValue::PrivateLinkage, 0, CopyName);
+	NewVar->copyAttributesFrom(GVar);
+	NewVar->setLinkage(GlobalValue::PrivateLinkage);
+	Copied.push_back(GVar);
+	NewGV = NewVar;
+
+      }
+      else {
+
+	NewGV = new GlobalVariable(*Shared, PTy->getElementType(), isConstant, GlobalValue::ExternalLinkage, 0, GV->getName(),
+				   0, GlobalVariable::NotThreadLocal, PTy->getAddressSpace());
+
+      }
+
+    }
+
+    VMap[GV] = NewGV;
+
+  }
+
+  Function* NewF = Function::Create(F->getFunctionType(), GlobalValue::ExternalLinkage, NewName, Shared);
+  NewF->copyAttributesFrom(F);
+  NewF->setLinkage(GlobalValue::ExternalLinkage);
+  NewF->setVisibility(GlobalValue::DefaultVisibility);
+
+  Function::arg_iterator NewArg = NewF->arg_begin();
+  for(Function::arg_iterator it = F->arg_begin(), itend = F->arg_end(); it != itend; ++it, ++NewArg)
+    VMap[it] = NewArg;
+
+  for(std::vector<GlobalVariable*>::iterator it = Copied.begin(), itend = Copied.end(); it != itend; ++it)
+    cast<GlobalVariable>(VMap[*it])->setInitializer(cast<Constant>(MapValue((*it)->getInitializer(), VMap)));
+
+  SmallVector<ReturnInst*, 4> Returns;
+  CloneFunctionInto(NewF, F, VMap, true, Returns);
+
+  // Debug locations differ between otherwise identical copies.
+  for(inst_iterator it = inst_begin(NewF), itend = inst_end(NewF); it != itend; ++it) {
+
+    SmallVector<std::pair<unsigned, MDNode*>, 4> MDs;
+    it->getAllMetadata(MDs);
+    for(SmallVector<std::pair<unsigned, MDNode*>, 4>::iterator MDit = MDs.begin(), MDend = MDs.end(); MDit != MDend; ++MDit)
+      it->setMetadata(MDit->first, 0);
+
+  }
+
+  return Shared;
+
+}
+
+static std::string getSharedKey(Module* Shared) {
+
+  std::string Text;
+  {
+    raw_string_ostream RSO(Text);
+    Shared->print(RSO, 0);
+  }
+
+  unsigned char hash[SHA_DIGEST_LENGTH];
+  SHA1((const unsigned char*)Text.data(), Text.size(), hash);
+
+  std::string Key;
+  raw_string_ostream RSO(Key);
+  for(int i = 0; i < SHA_DIGEST_LENGTH; ++i)
+    RSO << format("%02x", (unsigned)hash[i]);
+  return RSO.str();
+
+}
+
+void LLPEAnalysisPass::shareResidualFunctions(Module& M) {
+
+  if(SharedFunctionDir.empty())
+    return;
+
+  if(std::error_code error = sys::fs::create_directories(SharedFunctionDir)) {
+    errs() << "Failed to create " << SharedFunctionDir << ": " << error.message() << "\n";
+    return;
+  }
+
+  for(std::vector<WeakVH>::iterator it = splitCommitFunctions.begin(), itend = splitCommitFunctions.end(); it != itend; ++it) {
+
+    Function* F = cast_or_null<Function>(*it);
+    if((!F) || F->isDeclaration())
+      continue;
+
+    if((!F->hasLocalLinkage()) || F->hasAddressTaken() || F == RootIA->CommitF)
+      continue;
+
+    SmallSetVector<GlobalValue*, 8> Refs;
+    SmallPtrSet<Constant*, 16> Seen;
+    bool shareable = true;
+
+    for(inst_iterator II = inst_begin(F), IE = inst_end(F); II != IE && shareable; ++II) {
+
+      for(uint32_t i = 0, ilim = II->getNumOperands(); i != ilim && shareable; ++i)
+	shareable = collectSharedRefs(II->getOperand(i), Refs, Seen);
+
+    }
+
+    // A call to itself would need remapping to the shared name; let it be.
+    if((!shareable) || Refs.count(F))
+      continue;
+
+    // Name the copy for hashing, then for real once the key is known.
+    Module* Shared = buildSharedModule(F, Refs, "llpe.shared");
+    std::string Name = "llpe.shared." + getSharedKey(Shared);
+
+    std::string Path = SharedFunctionDir + "/" + Name + ".bc";
+    if(sys::fs::exists(Path)) {
+
+      ++ReusedSharedFunctions;
+
+    }
+    else {
+
+      delete Shared;
+      Shared = buildSharedModule(F, Refs, Name);
+
+      // Write to a temporary and rename so concurrent runs never see a partial module.
+      std::string TempPath = Path + ".tmp" + itostr(getpid());
+      std::error_code error;
+      {
+	raw_fd_ostream Out(TempPath.c_str(), error, sys::fs::F_None);
+	if(!error)
+	  WriteBitcodeToFile(Shared, Out);
+      }
+
+      if(error || sys::fs::rename(TempPath, Path)) {
+	errs() << "Failed to write " << Path << "\n";
+	delete Shared;
+	continue;
+      }
+
+      ++WrittenSharedFunctions;
+
+    }
+
+    delete Shared;
+
+    // Identical functions that weren't merged at commit share a key; the first claims it.
+    if(Function* Existing = M.getFunction(Name)) {
+
+      F->replaceAllUsesWith(Existing);
+      F->eraseFromParent();
+
+    }
+    else {
+
+      F->deleteBody();
+      F->setName(Name);
+      F->setLinkage(GlobalValue::ExternalLinkage);
+      F->setVisibility(GlobalValue::DefaultVisibility);
+
+    }
+
+  }
+
+}
@@ -0,0 +1,385 @@
+//===- StringOps.cpp ------------------------------------------------------===//
+//
+// The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Models of libc string functions (strlen, strcmp, strchr, memchr) evaluated directly
+// against the shadow store, so that e.g. configuration parsing doesn't have to interpret
+// their byte loops one instruction and one context at a time. A model only answers when
+// every byte it needs is known, and only from memory whose loads would never need a
+// runtime check (constant globals and thread-local objects, as for memcpy); otherwise the
+// call is interpreted or treated as an unexpanded call as usual.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <algorithm>
+#include <sstream>
+#include <string.h>
+
+using namespace llvm;
+
+static cl::opt<bool> NoStringModels("int-no-string-models");
+static cl::list<std::string> ExtraStringModels("int-string-model", cl::ZeroOrMore);
+static cl::opt<unsigned> StringModelLimit("int-string-model-limit", cl::init(65536));
+
+static LLPEStat StringCallsModelled("string_calls", "String function calls modelled");
+
+namespace {
+
+// A string argument being scanned one byte at a time.
+struct StringCursor {
+
+  ShadowValue Base;
+  int64_t Offset;
+  Constant* ConstInit;
+  // The initialiser's bytes, when it is a plain byte array (e.g. the packed argv and
+  // environment strings), so scans needn't extract them one at a time.
+  StringRef ConstBytes;
+
+};
+
+}
+
+static bool initCursor(ShadowValue Ptr, ShadowBB* BB, StringCursor& C) {
+
+  if(!getBaseAndConstantOffset(Ptr, C.Base, C.Offset))
+    return false;
+
+  if(C.Base.isNullPointer() || C.Offset < 0)
+    return false;
+
+  C.ConstInit = 0;
+  C.ConstBytes = StringRef();
+
+  if(ShadowGV* G = C.Base.getGV()) {
+
+    if(G->G->isConstant()) {
+      if(!G->G->hasDefinitiveInitializer())
+	return false;
+      C.ConstInit = G->G->getInitializer();
+      if(ConstantDataSequential* CDS = dyn_cast<ConstantDataSequential>(C.ConstInit)) {
+	if(CDS->getElementType()->isIntegerTy(8))
+	  C.ConstBytes = CDS->getRawDataValues();
+      }
+      return true;
+    }
+
+  }
+
+  // As for memcpy, loads from a thread-local object never need checking; anything else
+  // might, and a model has no way to emit the check.
+  if(!BB->localStore->es.threadLocalObjects.count(C.Base))
+    return false;
+
+  BB->IA->noteDependency(C.Base);
+  return true;
+
+}
+
+static bool readByte(StringCursor& C, uint64_t Idx, ShadowBB* BB, uint8_t& Out) {
+
+  int64_t Offset = C.Offset + (int64_t)Idx;
+
+  if(C.ConstBytes.data()) {
+    if((uint64_t)Offset >= C.ConstBytes.size())
+      return false;
+    Out = (uint8_t)C.ConstBytes[Offset];
+    return true;
+  }
+
+  Type* byteType = Type::getInt8Ty(BB->invar->BB->getContext());
+
+  ImprovedValSetSingle byte;
+
+  if(C.ConstInit) {
+    if((uint64_t)Offset >= getTypeStoreSize(C.ConstInit->getType()))
+      return false;
+    getConstSubVal(ShadowValue(C.ConstInit), Offset, 1, byteType, byte);
+  }
+  else {
+    if((uint64_t)Offset >= BB->getAllocSize(C.Base))
+      return false;
+    readValRange(C.Base, Offset, 1, BB, byte, 0, 0);
+  }
+
+  if(byte.Overdef || byte.SetType != ValSetTypeScalar || byte.Values.size() != 1)
+    return false;
+
+  byte.coerceToType(byteType, 1, 0);
+
+  uint64_t Val;
+  if(!tryGetConstantInt(byte.Values[0].V, Val))
+    return false;
+
+  Out = (uint8_t)Val;
+  return true;
+
+}
+
+// Find the first byte equal to Target, stopping at a NUL unless stopAtNul is false, and
+// within Limit bytes. Found is false if the scan stopped first.
+static bool scanForByte(StringCursor& C, uint8_t Target, bool stopAtNul, uint64_t Limit, ShadowBB* BB, bool& Found, uint64_t& FoundIdx) {
+
+  if(C.ConstBytes.data()) {
+
+    // The same answers as the loop below, searching the whole span at once.
+    uint64_t Size = C.ConstBytes.size();
+    uint64_t Avail = (uint64_t)C.Offset < Size ? Size - C.Offset : 0;
+    uint64_t N = std::min(Limit, Avail);
+    const char* Start = C.ConstBytes.data() + C.Offset;
+
+    const char* Hit = (const char*)memchr(Start, Target, N);
+    uint64_t HitIdx = Hit ? (uint64_t)(Hit - Start) : N;
+
+    if(stopAtNul && memchr(Start, 0, HitIdx)) {
+      Found = false;
+      return true;
+    }
+
+    if(Hit) {
+      Found = true;
+      FoundIdx = HitIdx;
+      return true;
+    }
+
+    // Ran off the end of the object before the limit.
+    if(N != Limit)
+      return false;
+
+  }
+  else {
+
+    for(uint64_t i = 0; i != Limit; ++i) {
+
+      uint8_t Byte;
+      if(!readByte(C, i, BB, Byte))
+	return false;
+
+      if(Byte == Target) {
+	Found = true;
+	FoundIdx = i;
+	return true;
+      }
+
+      if(stopAtNul && !Byte) {
+	Found = false;
+	return true;
+      }
+
+    }
+
+  }
+
+  // Hit the limit: for memchr that means not found; for the string functions, give up.
+  if(stopAtNul)
+    return false;
+
+  Found = false;
+  return true;
+
+}
+
+static void setResult(ShadowInstruction* SI, const ImprovedValSetSingle& Result) {
+
+  if(SI->i.PB)
+    deleteIV(SI->i.PB);
+
+  ImprovedValSetSingle* NewIVS = newIVS();
+  *NewIVS = Result;
+  SI->i.PB = NewIVS;
+
+}
+
+static void setFoundPointer(ShadowInstruction* SI, StringCursor& C, bool Found, uint64_t Idx) {
+
+  ImprovedValSetSingle Result;
+
+  if(Found) {
+    Result.set(ImprovedVal(C.Base, C.Offset + (int64_t)Idx), ValSetTypePB);
+  }
+  else {
+    Constant* Null = Constant::getNullValue(SI->getType());
+    std::pair<ValSetType, ImprovedVal> NullPB = getValPB(Null);
+    Result.set(NullPB.second, NullPB.first);
+  }
+
+  setResult(SI, Result);
+
+}
+
+bool IntegrationAttempt::tryModelStringCall(ShadowInstruction* SI) {
+
+  Function* Called = getCalledFunction(SI);
+  if(!Called)
+    return false;
+
+  SmallDenseMap<Function*, StringModelKind, 4>::iterator findit = pass->stringModels.find(Called);
+  if(findit == pass->stringModels.end())
+    return false;
+
+  // Once a call has been expanded keep expanding it, so its context stays consistent.
+  if(getInlineAttempt(SI))
+    return false;
+
+  ShadowBB* BB = SI->parent;
+
+  StringCursor C;
+  if(!initCursor(SI->getCallArgOperand(0), BB, C))
+    return false;
+
+  switch(findit->second) {
+
+  case SM_STRLEN:
+    {
+
+      bool Found;
+      uint64_t Len;
+      if(!scanForByte(C, 0, true, StringModelLimit, BB, Found, Len))
+	return false;
+
+      ImprovedValSetSingle Result;
+      Result.set(ImprovedVal(ShadowValue(ConstantInt::get(SI->getType(), Len))), ValSetTypeScalar);
+      setResult(SI, Result);
+      break;
+
+    }
+
+  case SM_STRCMP:
+    {
+
+      StringCursor C2;
+      if(!initCursor(SI->getCallArgOperand(1), BB, C2))
+	return false;
+
+      int Diff = 0;
+      uint64_t i = 0;
+      for(; i != StringModelLimit; ++i) {
+
+	uint8_t B1, B2;
+	if(!(readByte(C, i, BB, B1) && readByte(C2, i, BB, B2)))
+	  return false;
+
+	if(B1 != B2) {
+	  Diff = (int)B1 - (int)B2;
+	  break;
+	}
+
+	if(!B1)
+	  break;
+
+      }
+
+      if(i == StringModelLimit)
+	return false;
+
+      ImprovedValSetSingle Result;
+      Result.set(ImprovedVal(ShadowValue(ConstantInt::getSigned(SI->getType(), Diff))), ValSetTypeScalar);
+      setResult(SI, Result);
+      break;
+
+    }
+
+  case SM_STRCHR:
+  case SM_MEMCHR:
+    {
+
+      uint64_t Target;
+      if(!tryGetConstantIntReplacement(SI->getCallArgOperand(1), Target))
+	return false;
+
+      uint64_t Limit = StringModelLimit;
+      bool isMemchr = findit->second == SM_MEMCHR;
+      if(isMemchr) {
+	uint64_t N;
+	if(!tryGetConstantIntReplacement(SI->getCallArgOperand(2), N) || N > StringModelLimit)
+	  return false;
+	Limit = N;
+      }
+
+      // strchr(s, 0) finds the terminator itself.
+      bool Found;
+      uint64_t Idx;
+      if(!scanForByte(C, (uint8_t)Target, !isMemchr, Limit, BB, Found, Idx))
+	return false;
+
+      setFoundPointer(SI, C, Found, Idx);
+      break;
+
+    }
+
+  }
+
+  StringCallsModelled.inc(&F);
+  return true;
+
+}
+
+// Models for the libc names, plus any named with -int-string-model fn,kind for
+// functions that behave the same under another name.
+void LLPEAnalysisPass::initStringModels(Module& M) {
+
+  if(NoStringModels)
+    return;
+
+  static const struct {
+
+    const char* name;
+    StringModelKind kind;
+
+  } libcModels[] = {
+
+    { "strlen", SM_STRLEN },
+    { "strcmp", SM_STRCMP },
+    { "strchr", SM_STRCHR },
+    { "memchr", SM_MEMCHR }
+
+  };
+
+  for(uint32_t i = 0; i != sizeof(libcModels) / sizeof(libcModels[0]); ++i) {
+
+    if(Function* F = M.getFunction(libcModels[i].name))
+      stringModels[F] = libcModels[i].kind;
+
+  }
+
+  for(cl::list<std::string>::iterator it = ExtraStringModels.begin(), itend = ExtraStringModels.end(); it != itend; ++it) {
+
+    std::string fName, kindName;
+
+    std::istringstream istr(*it);
+    std::getline(istr, fName, ',');
+    std::getline(istr, kindName, ',');
+
+    Function* F = M.getFunction(fName);
+    if(!F) {
+      errs() << "-int-string-model: no such function " << fName << "\n";
+      exit(1);
+    }
+
+    uint32_t i = 0;
+    for(; i != sizeof(libcModels) / sizeof(libcModels[0]); ++i) {
+      if(kindName == libcModels[i].name)
+	break;
+    }
+
+    if(i == sizeof(libcModels) / sizeof(libcModels[0])) {
+      errs() << "-int-string-model: kind must be one of strlen, strcmp, strchr or memchr\n";
+      exit(1);
+    }
+
+    stringModels[F] = libcModels[i].kind;
+
+  }
+
+}
@@ -36,68 +36,274 @@ static void TLProgress() {
 
     errs() << ".";
     TLProgressN = 0;
+    noteProgress();
 
   }
 
 }
 
 static TLMapTy::Allocator TLMapAllocator;
-static TLMapTy TLEmptyMap(TLMapAllocator);
+static TLGoodBytes TLEmptyMap;
 TLMapPointer llvm::TLEmptyMapPtr(&TLEmptyMap);
 
-TLLocalStore* TLMapPointer::getMapForBlock(ShadowBB* BB) {
+// The bits of Word (covering bytes Word*64 onwards) that fall within [Start, Stop).
+static uint64_t wordMask(uint64_t Word, uint64_t Start, uint64_t Stop) {
 
-  return BB->tlStore;
+  uint64_t WordStart = Word * 64;
+  uint64_t Lo = Start > WordStart ? Start - WordStart : 0;
+  uint64_t Hi = Stop < WordStart + 64 ? Stop - WordStart : 64;
+
+  uint64_t Mask = Hi == 64 ? ~(uint64_t)0 : (((uint64_t)1) << Hi) - 1;
+  return Mask & ~((((uint64_t)1) << Lo) - 1);
 
 }
 
-TLMapPointer TLMapPointer::getReadableCopy() {
+TLGoodBytes::TLGoodBytes(const TLGoodBytes& Other) : Bits(Other.Bits), Ranges(0) {
 
-  TLMapTy* newMap = new TLMapTy(TLMapAllocator);
-  for(TLMapTy::iterator it = M->begin(), itend = M->end(); it != itend; ++it)
-    newMap->insert(it.start(), it.stop(), *it);
+  if(Other.Ranges) {
 
-  return TLMapPointer(newMap);
+    Ranges = new TLMapTy(TLMapAllocator);
+    for(TLMapTy::iterator it = Other.Ranges->begin(), itend = Other.Ranges->end(); it != itend; ++it)
+      Ranges->insert(it.start(), it.stop(), true);
+
+  }
 
 }
 
-void TLMapPointer::dropReference() {
+TLGoodBytes::~TLGoodBytes() {
 
-  delete M;
-  M = 0;
+  delete Ranges;
 
 }
 
-void TLMapPointer::mergeStores(TLMapPointer* mergeFrom, TLMapPointer* mergeTo, uint64_t ASize, TLMerger* Visitor) {
+void TLGoodBytes::getRanges(SmallVectorImpl<std::pair<uint64_t, uint64_t> >& Out) const {
+
+  if(Ranges) {
+
+    for(TLMapTy::iterator it = Ranges->begin(), itend = Ranges->end(); it != itend; ++it)
+      Out.push_back(std::make_pair(it.start(), it.stop()));
+    return;
 
-  // Intersect the sets per byte. The values are just booleans, so overwriting without erasing is fine.
+  }
 
-  SmallVector<std::pair<uint64_t, uint64_t>, 4> keepRanges;
+  bool inRange = false;
+  uint64_t RangeStart = 0;
 
-  for(TLMapTy::iterator it = mergeFrom->M->begin(), itend = mergeFrom->M->end();
-      it != itend; ++it) {
+  for(uint64_t i = 0, ilim = Bits.size(); i != ilim; ++i) {
 
-    for(TLMapTy::iterator toit = mergeTo->M->find(it.start()), toitend = mergeTo->M->end();
-	toit != toitend && toit.start() < it.stop(); ++toit) {
+    uint64_t W = Bits[i];
 
-      uint64_t keepStart = std::max(toit.start(), it.start());
-      uint64_t keepStop = std::min(toit.stop(), it.stop());
-      keepRanges.push_back(std::make_pair(keepStart, keepStop));
+    // Skip words that continue the current state.
+    if(W == (inRange ? ~(uint64_t)0 : 0))
+      continue;
+
+    for(uint64_t j = 0; j != 64; ++j) {
+
+      bool Set = !!(W & (((uint64_t)1) << j));
+      if(Set == inRange)
+	continue;
+
+      if(Set)
+	RangeStart = (i * 64) + j;
+      else
+	Out.push_back(std::make_pair(RangeStart, (i * 64) + j));
+      inRange = Set;
 
     }
 
   }
 
-  mergeTo->M->clear();
-  for(SmallVector<std::pair<uint64_t, uint64_t>, 4>::iterator it = keepRanges.begin(),
-	itend = keepRanges.end(); it != itend; ++it) {
+  if(inRange)
+    Out.push_back(std::make_pair(RangeStart, Bits.size() * 64));
+
+}
+
+void TLGoodBytes::toRanges() {
+
+  SmallVector<std::pair<uint64_t, uint64_t>, 4> Existing;
+  getRanges(Existing);
+
+  Bits.clear();
+  Ranges = new TLMapTy(TLMapAllocator);
+
+  for(SmallVector<std::pair<uint64_t, uint64_t>, 4>::iterator it = Existing.begin(),
+	itend = Existing.end(); it != itend; ++it)
+    Ranges->insert(it->first, it->second, true);
+
+}
+
+void TLGoodBytes::insert(uint64_t Start, uint64_t Stop) {
+
+  if(Stop <= Start)
+    return;
+
+  if((!Ranges) && Stop > TLBitmapBytes)
+    toRanges();
+
+  if(!Ranges) {
+
+    uint64_t LastWord = (Stop - 1) / 64;
+    if(Bits.size() <= LastWord)
+      Bits.resize(LastWord + 1, 0);
+
+    for(uint64_t i = Start / 64; i <= LastWord; ++i)
+      Bits[i] |= wordMask(i, Start, Stop);
+
+    return;
+
+  }
+
+  // The interval map can't take overlapping inserts, so fill only the gaps.
+
+  SmallVector<std::pair<uint64_t, uint64_t>, 1> addRanges;
 
-    mergeTo->M->insert(it->first, it->second, true);
+  TLMapTy::iterator it = Ranges->find(Start), itend = Ranges->end();
+
+  if(it == itend || it.start() >= Stop) {
+
+    addRanges.push_back(std::make_pair(Start, Stop));
+
+  }
+  else {
+
+    // Gap at left?
+
+    if(it.start() > Start)
+      addRanges.push_back(std::make_pair(Start, it.start()));
+
+    for(; it != itend && it.start() < Stop; ++it) {
+    
+      // Gap to the right of this extent?
+      if(it.stop() < Stop) {
+
+	TLMapTy::iterator nextit = it;
+	++nextit;
+
+	uint64_t gapend;
+	if(nextit == itend)
+	  gapend = Stop;
+	else
+	  gapend = std::min(Stop, nextit.start());
+
+	if(it.stop() != gapend)
+	  addRanges.push_back(std::make_pair(it.stop(), gapend));
+
+      }
+
+    }
+
+  }
+
+  for(SmallVector<std::pair<uint64_t, uint64_t>, 1>::iterator it = addRanges.begin(),
+	itend = addRanges.end(); it != itend; ++it) {
+
+    Ranges->insert(it->first, it->second, true);
 
   }
 
 }
 
+bool TLGoodBytes::covers(uint64_t Start, uint64_t Stop) const {
+
+  // A range that wraps (e.g. from a negative offset) is never covered.
+  if(Stop <= Start)
+    return Stop == Start;
+
+  if(Ranges) {
+
+    TLMapTy::iterator it = Ranges->find(Start);
+    return it != Ranges->end() && it.start() <= Start && it.stop() >= Stop;
+
+  }
+
+  if(Stop > Bits.size() * 64)
+    return false;
+
+  for(uint64_t i = Start / 64, ilim = (Stop - 1) / 64; i <= ilim; ++i) {
+
+    uint64_t Mask = wordMask(i, Start, Stop);
+    if((Bits[i] & Mask) != Mask)
+      return false;
+
+  }
+
+  return true;
+
+}
+
+void TLGoodBytes::clear() {
+
+  Bits.clear();
+  delete Ranges;
+  Ranges = 0;
+
+}
+
+void TLGoodBytes::intersect(const TLGoodBytes& Other) {
+
+  if((!Ranges) && !Other.Ranges) {
+
+    if(Bits.size() > Other.Bits.size())
+      Bits.resize(Other.Bits.size());
+    for(uint64_t i = 0, ilim = Bits.size(); i != ilim; ++i)
+      Bits[i] &= Other.Bits[i];
+    return;
+
+  }
+
+  // Intersect the two range lists, then rebuild. The result may fit a bitmap again.
+
+  SmallVector<std::pair<uint64_t, uint64_t>, 4> These, Those, keepRanges;
+  getRanges(These);
+  Other.getRanges(Those);
+
+  for(uint32_t i = 0, j = 0; i != These.size() && j != Those.size();) {
+
+    uint64_t keepStart = std::max(These[i].first, Those[j].first);
+    uint64_t keepStop = std::min(These[i].second, Those[j].second);
+    if(keepStart < keepStop)
+      keepRanges.push_back(std::make_pair(keepStart, keepStop));
+
+    if(These[i].second < Those[j].second)
+      ++i;
+    else
+      ++j;
+
+  }
+
+  clear();
+  for(SmallVector<std::pair<uint64_t, uint64_t>, 4>::iterator it = keepRanges.begin(),
+	itend = keepRanges.end(); it != itend; ++it)
+    insert(it->first, it->second);
+
+}
+
+TLLocalStore* TLMapPointer::getMapForBlock(ShadowBB* BB) {
+
+  return BB->tlStore;
+
+}
+
+TLMapPointer TLMapPointer::getReadableCopy() {
+
+  return TLMapPointer(new TLGoodBytes(*M));
+
+}
+
+void TLMapPointer::dropReference() {
+
+  delete M;
+  M = 0;
+
+}
+
+void TLMapPointer::mergeStores(TLMapPointer* mergeFrom, TLMapPointer* mergeTo, uint64_t ASize, TLMerger* Visitor) {
+
+  // Intersect the sets per byte.
+  mergeTo->M->intersect(*mergeFrom->M);
+
+}
+
 TLMapPointer* ShadowBB::getWritableTLStore(ShadowValue O) {
 
   tlStore = tlStore->getWritableFrameList();
@@ -105,7 +311,7 @@ TLMapPointer* ShadowBB::getWritableTLStore(ShadowValue O) {
   TLMapPointer* ret = tlStore->getOrCreateStoreFor(O, &isNewStore);
 
   if(isNewStore)
-    ret->M = new TLMapTy(TLMapAllocator);
+    ret->M = new TLGoodBytes();
 
   return ret;
 
@@ -151,72 +357,19 @@ static void markGoodBytes(ShadowValue GoodPtr, uint64_t Len, bool contextEnabled
   if(PtrTarget.first != ValSetTypePB)
     return;
 
-  if(PtrTarget.second.V.isGV() &&  PtrTarget.second.V.u.GV->G->isConstant())
+  if(PtrTarget.second.V.isGV() &&  PtrTarget.second.V.getGV()->G->isConstant())
     return;
 
-  SmallVector<std::pair<uint64_t, uint64_t>, 1> addRanges;
-
   TLMapPointer* store = BB->tlStore->getReadableStoreFor(PtrTarget.second.V);
   uint64_t start = PtrTarget.second.Offset + Offset;
   uint64_t stop = PtrTarget.second.Offset + Offset + Len;
 
-  if(!store) {
-   
-    addRanges.push_back(std::make_pair(start, stop));
-
-  }
-  else {
-
-    TLMapTy::iterator it = store->M->find(start), itend = store->M->end();
-
-    if(it == itend || it.start() >= stop) {
-
-      addRanges.push_back(std::make_pair(start, stop));
-
-    }
-    else {
-
-      // Gap at left?
-
-      if(it.start() > start)
-	addRanges.push_back(std::make_pair(start, it.start()));
-
-      for(; it != itend && it.start() < stop; ++it) {
-    
-	// Gap to the right of this extent?
-	if(it.stop() < stop) {
-
-	  TLMapTy::iterator nextit = it;
-	  ++nextit;
-
-	  uint64_t gapend;
-	  if(nextit == itend)
-	    gapend = stop;
-	  else
-	    gapend = std::min(stop, nextit.start());
-
-	  if(it.stop() != gapend)
-	    addRanges.push_back(std::make_pair(it.stop(), gapend));
-
-	}
-
-      }
-
-    }
-
-  }
-  
-  if(!addRanges.empty()) {
-
-    TLMapPointer* writeStore = BB->getWritableTLStore(PtrTarget.second.V);
-    for(SmallVector<std::pair<uint64_t, uint64_t>, 1>::iterator it = addRanges.begin(),
-	  itend = addRanges.end(); it != itend; ++it) {
-
-      writeStore->M->insert(it->first, it->second, true);
-
-    }
+  // Already known good? Then don't take a writable copy.
+  if(store && store->M->covers(start, stop))
+    return;
 
-  }
+  TLMapPointer* writeStore = BB->getWritableTLStore(PtrTarget.second.V);
+  writeStore->M->insert(start, stop);
 
 }
 
@@ -226,7 +379,7 @@ static void walkPathCondition(PathConditionTypes Ty, PathCondition& Cond, bool c
   uint64_t Len = 0;
   switch(Ty) {
   case PathConditionTypeIntmem:
-    Len = GlobalAA->getTypeStoreSize(Cond.u.val->getType());
+    Len = getTypeStoreSize(Cond.u.val->getType());
     break;
   case PathConditionTypeString:
     Len = cast<ConstantDataArray>(Cond.u.val)->getNumElements();
@@ -240,16 +393,10 @@ static void walkPathCondition(PathConditionTypes Ty, PathCondition& Cond, bool c
 
 }
 
-static void walkPathConditions(PathConditionTypes Ty, std::vector<PathCondition>& Conds, bool contextEnabled, ShadowBB* BB, uint32_t stackDepth) {
+static void walkPathConditions(PathConditionTypes Ty, SmallVector<PathCondition*, 1>& Conds, bool contextEnabled, ShadowBB* BB) {
 
-  for(std::vector<PathCondition>::iterator it = Conds.begin(), itend = Conds.end(); it != itend; ++it) {
-
-    if(stackDepth != it->fromStackIdx || BB->invar->BB != it->fromBB)
-      continue;
-
-    walkPathCondition(Ty, *it, contextEnabled, BB);
-
-  }
+  for(SmallVector<PathCondition*, 1>::iterator it = Conds.begin(), itend = Conds.end(); it != itend; ++it)
+    walkPathCondition(Ty, **it, contextEnabled, BB);
 
 }
 
@@ -265,10 +412,10 @@ void llvm::doTLCallMerge(ShadowBB* BB, InlineAttempt* IA) {
 
 static void walkPathConditionsIn(PathConditions& PC, uint32_t stackIdx, ShadowBB* BB, bool contextEnabled, bool secondPass) {
 
-  walkPathConditions(PathConditionTypeIntmem, PC.IntmemPathConditions, 
-		     contextEnabled, BB, stackIdx);
-  walkPathConditions(PathConditionTypeString, PC.StringPathConditions, 
-		     contextEnabled, BB, stackIdx);
+  if(BlockPathConditions* BPC = PC.getFromBlock(stackIdx, BB->invar->BB)) {
+    walkPathConditions(PathConditionTypeIntmem, BPC->Intmem, contextEnabled, BB);
+    walkPathConditions(PathConditionTypeString, BPC->String, contextEnabled, BB);
+  }
 
   for(std::vector<PathFunc>::iterator it = PC.FuncPathConditions.begin(),
 	itend = PC.FuncPathConditions.end(); it != itend; ++it) {
@@ -310,6 +457,45 @@ static void walkCopyInst(ShadowValue CopyFrom, ShadowValue CopyTo, ShadowValue L
 }
 
 
+// Only an operation with acquire semantics can make other threads' earlier writes visible to
+// this one, so only those need to make every object tentative. A release or monotonic operation
+// merely publishes our own writes (compare pthread_unlock) and leaves the rest of memory as it was.
+static bool orderingAcquires(AtomicOrdering O) {
+
+  return O == Acquire || O == AcquireRelease || O == SequentiallyConsistent;
+
+}
+
+static bool mayAcquire(ShadowInstruction* SI) {
+
+  switch(SI->invar->I->getOpcode()) {
+
+  case Instruction::Load:
+    return orderingAcquires(cast_inst<LoadInst>(SI)->getOrdering());
+  case Instruction::AtomicRMW:
+    return orderingAcquires(cast_inst<AtomicRMWInst>(SI)->getOrdering());
+  case Instruction::AtomicCmpXchg:
+    {
+      auto cmpx = cast_inst<AtomicCmpXchgInst>(SI);
+      return orderingAcquires(cmpx->getSuccessOrdering()) || orderingAcquires(cmpx->getFailureOrdering());
+    }
+  case Instruction::Fence:
+    return orderingAcquires(cast_inst<FenceInst>(SI)->getOrdering());
+  default:
+    return true;
+
+  }
+
+}
+
+// Does ordered or atomic SI synchronise with another thread? Not if the main phase proved it
+// only touches thread-local objects (TLS_NEVERCHECK), in which case it is a plain access.
+static bool mayCreateSyncEdge(ShadowInstruction* SI) {
+
+  return SI->isThreadLocal != TLS_NEVERCHECK && mayAcquire(SI) && !SI->parent->IA->pass->atomicOpIsSimple(SI->invar->I);
+
+}
+
 static void updateTLStore(ShadowInstruction* SI, bool contextEnabled) {
 
   if(inst_is<AllocaInst>(SI)) {
@@ -317,15 +503,17 @@ static void updateTLStore(ShadowInstruction* SI, bool contextEnabled) {
     ShadowValue SV(SI);
     ShadowValue Base;
     getBaseObject(SV, Base);
-    markGoodBytes(ShadowValue(SI), SI->parent->IA->getFunctionRoot()->localAllocas[Base.u.PtrOrFd.idx].storeSize, contextEnabled, SI->parent);
+    markGoodBytes(ShadowValue(SI), SI->parent->IA->getFunctionRoot()->localAllocas[Base.getIdx()].storeSize, contextEnabled, SI->parent);
 
   }
   else if(LoadInst* LI = dyn_cast_inst<LoadInst>(SI)) {
 
-    if((LI->isVolatile() || SI->hasOrderingConstraint()) && !SI->parent->IA->pass->atomicOpIsSimple(LI))
+    if(LI->isVolatile() && !SI->parent->IA->pass->atomicOpIsSimple(LI))
+      markAllObjectsTentative(SI, SI->parent);
+    else if(SI->hasOrderingConstraint() && mayCreateSyncEdge(SI))
       markAllObjectsTentative(SI, SI->parent);
     else
-      markGoodBytes(SI->getOperand(0), GlobalAA->getTypeStoreSize(LI->getType()), contextEnabled, SI->parent);
+      markGoodBytes(SI->getOperand(0), getTypeStoreSize(LI->getType()), contextEnabled, SI->parent);
 
   }
   else if(StoreInst* StoreI = dyn_cast_inst<StoreInst>(SI)) {
@@ -335,21 +523,22 @@ static void updateTLStore(ShadowInstruction* SI, bool contextEnabled) {
     //if(StoreI->isVolatile())
     //markAllObjectsTentative(SI, SI->parent);
     //else
-    markGoodBytes(SI->getOperand(1), GlobalAA->getTypeStoreSize(StoreI->getValueOperand()->getType()), contextEnabled, SI->parent);
+    markGoodBytes(SI->getOperand(1), getTypeStoreSize(StoreI->getValueOperand()->getType()), contextEnabled, SI->parent);
 
   }
   else if(SI->readsMemoryDirectly() && SI->hasOrderingConstraint()) {
 
     // Might create a synchronisation edge:
-    if(SI->isThreadLocal == TLS_MUSTCHECK && !SI->parent->IA->pass->atomicOpIsSimple(SI->invar->I))
+    if(mayCreateSyncEdge(SI))
       markAllObjectsTentative(SI, SI->parent);
     else
-      markGoodBytes(SI->getOperand(0), GlobalAA->getTypeStoreSize(SI->getType()), contextEnabled, SI->parent);
+      markGoodBytes(SI->getOperand(0), getTypeStoreSize(SI->getType()), contextEnabled, SI->parent);
 
   }
   else if(inst_is<FenceInst>(SI)) {
 
-    markAllObjectsTentative(SI, SI->parent);
+    if(mayAcquire(SI))
+      markAllObjectsTentative(SI, SI->parent);
 
   }
   else if(inst_is<CallInst>(SI) || inst_is<InvokeInst>(SI)) {
@@ -396,7 +585,7 @@ static void updateTLStore(ShadowInstruction* SI, bool contextEnabled) {
 	    ShadowValue Base;
 	    getBaseObject(SV, Base);
 
-	    markGoodBytes(SV, GlobalIHP->heap[Base.u.PtrOrFd.idx].storeSize, contextEnabled, SI->parent);
+	    markGoodBytes(SV, GlobalIHP->heap[Base.getIdx()].storeSize, contextEnabled, SI->parent);
 
 	  }
 
@@ -416,13 +605,14 @@ static void updateTLStore(ShadowInstruction* SI, bool contextEnabled) {
 
 	}
 	
-	SmallDenseMap<CallInst*, std::vector<GlobalVariable*>, 4>::iterator findit =
-	  GlobalIHP->lockDomains.find(CallI);
+	std::vector<GlobalVariable*>* Domain = GlobalIHP->getLockDomain(SI);
 
-	if(findit != GlobalIHP->lockDomains.end()) {
+	if(Domain) {
 
-	  for(std::vector<GlobalVariable*>::iterator it = findit->second.begin(),
-		itend = findit->second.end(); it != itend; ++it) {
+	  // Other threads may only have written the lock's own domain; objects that never
+	  // escaped this thread stay TLS_NEVERCHECK from the main phase regardless.
+	  for(std::vector<GlobalVariable*>::iterator it = Domain->begin(),
+		itend = Domain->end(); it != itend; ++it) {
 
 	    ShadowGV* SGV = &GlobalIHP->shadowGlobals[GlobalIHP->getShadowGlobalIndex(*it)];
 	    ShadowValue SV(SGV);
@@ -455,7 +645,7 @@ static bool shouldCheckRead(ImprovedVal& Ptr, uint64_t Size, ShadowBB* BB) {
     return false;
 
   // Read from constant global?
-  if(Ptr.V.isGV() && Ptr.V.u.GV->G->isConstant())
+  if(Ptr.V.isGV() && Ptr.V.getGV()->G->isConstant())
     return false;
 
   bool verbose = false;
@@ -472,18 +662,17 @@ static bool shouldCheckRead(ImprovedVal& Ptr, uint64_t Size, ShadowBB* BB) {
 
   if(verbose) {
 
-    for(TLMapTy::iterator it = Map->M->begin(), itend = Map->M->end(); it != itend; ++it) {
+    SmallVector<std::pair<uint64_t, uint64_t>, 4> Good;
+    Map->M->getRanges(Good);
+    for(SmallVector<std::pair<uint64_t, uint64_t>, 4>::iterator it = Good.begin(), itend = Good.end(); it != itend; ++it) {
 
-      errs() << it.start() << "-" << it.stop() << "\n";
+      errs() << it->first << "-" << it->second << "\n";
 
     }
 
   }
 
-  TLMapTy::iterator it = Map->M->find(Ptr.Offset);
-  bool coveredByMap = (it != Map->M->end() && ((int64_t)it.start()) <= Ptr.Offset && ((int64_t)it.stop()) >= Ptr.Offset + ((int64_t)Size));
-
-  return !coveredByMap;
+  return !Map->M->covers(Ptr.Offset, Ptr.Offset + Size);
     
 }
 
@@ -561,9 +750,11 @@ ThreadLocalState IntegrationAttempt::shouldCheckLoad(ShadowInstruction& SI) {
   if(SI.readsMemoryDirectly() && !SI.isCopyInst()) {
 
     // Load doesn't extract any useful information?
+    // An ordered access that loaded nothing useful still needs no check, but unless the main
+    // phase found it thread-local it may synchronise, so don't claim it can't be clobbered.
     ImprovedValSetSingle* IVS = dyn_cast<ImprovedValSetSingle>(SI.i.PB);
     if(IVS && IVS->isWhollyUnknown())
-      return TLS_NEVERCHECK;
+      return SI.hasOrderingConstraint() ? TLS_NOCHECK : TLS_NEVERCHECK;
 
   }
 
@@ -578,7 +769,7 @@ ThreadLocalState IntegrationAttempt::shouldCheckLoad(ShadowInstruction& SI) {
     std::pair<ValSetType, ImprovedVal> Single;
     ImprovedValSet* IV;
 
-    uint64_t LoadSize = GlobalAA->getTypeStoreSize(SI.getType());
+    uint64_t LoadSize = getTypeStoreSize(SI.getType());
 
     getIVOrSingleVal(PtrOp, IV, Single);
     if(IV) {
@@ -743,6 +934,8 @@ void llvm::doTLStoreMerge(ShadowBB* BB) {
 
 void InlineAttempt::findTentativeLoads(bool commitDisabledHere, bool secondPass) {
 
+  PhaseTimer Timer(PhaseTL);
+
   if(isRootMainCall()) {
     BBs[0]->tlStore = new TLLocalStore(0);
     BBs[0]->tlStore->allOthersClobbered = false;
@@ -828,7 +1021,7 @@ bool IntegrationAttempt::squashUnavailableObject(ShadowInstruction& SI, const Im
 void IntegrationAttempt::squashUnavailableObjects(ShadowInstruction& SI, ImprovedValSet* PB, bool inLoopAnalyser) {
 
   if(ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(PB)) {
-    if(squashUnavailableObject(SI, *IVS, inLoopAnalyser, SI.getOperand(0), 0, GlobalTD->getTypeStoreSize(SI.getType())))
+    if(squashUnavailableObject(SI, *IVS, inLoopAnalyser, SI.getOperand(0), 0, getTypeStoreSize(SI.getType())))
       IVS->setOverdef();
   }
   else {
@@ -1016,8 +1209,17 @@ void IntegrationAttempt::TLAnalyseInstruction(ShadowInstruction& SI, bool commit
 
 void IntegrationAttempt::findTentativeLoadsInUnboundedLoop(const ShadowLoopInvar* UL, bool commitDisabledHere, bool secondPass) {
 
+  PhaseTimer Timer(PhaseTL);
+
   ShadowBB* BB = getBB(UL->headerIdx);
 
+  // A load that is only tentative on entry from the preheader is checked on every iteration,
+  // not just the first. Hoisting such a check into the preheader would need its address
+  // available there and a failure path to the unspecialised header, neither of which the
+  // per-block check emission in ConditionalSpec.cpp provides. Peeled iterations don't need
+  // this: a checked load marks its bytes good, so the next iteration doesn't check them again
+  // unless a yield point intervenes, in which case the check is genuinely required.
+
   // Give header its store:
   BB->tlStore = getBB(UL->preheaderIdx)->tlStore;
   
@@ -1216,76 +1418,7 @@ bool llvm::requiresRuntimeCheck(ShadowValue V, bool includeSpecialChecks) {
   if(!V.isInst())
     return false;
 
-  return V.u.I->parent->IA->requiresRuntimeCheck2(V, includeSpecialChecks);
-
-}
-
-void IntegrationAttempt::countTentativeInstructions() {
-
-  if(isCommitted())
-    return;
-
-  for(uint32_t i = BBsOffset, ilim = BBsOffset + nBBs; i != ilim; ++i) {
-
-    ShadowBBInvar* BBI = getBBInvar(i);
-    ShadowBB* BB = getBB(*BBI);
-    if(!BB)
-      continue;
-
-    if(BBI->naturalScope != L) {
-
-      const ShadowLoopInvar* subL = immediateChildLoop(L, BBI->naturalScope);
-      PeelAttempt* LPA;
-      if((LPA = getPeelAttempt(subL)) && LPA->isTerminated()) {
-
-	while(i != ilim && subL->contains(getBBInvar(i)->naturalScope))
-	  ++i;
-	--i;
-	continue;
-
-      }
-
-    }
-
-    for(uint32_t j = 0, jlim = BBI->insts.size(); j != jlim; ++j) {
-
-      ShadowInstruction* SI = &BB->insts[j];
-
-      // This should count only instructions that are checked because their result might be
-      // invalidated by the concurrent action of other threads in the same address space.
-      // Instructions with SI->needsRuntimeCheck set are checked to implement a path condition
-      // or other check and so should not be included in the count.
-      
-      if(requiresRuntimeCheck2(ShadowValue(SI), false) && SI->needsRuntimeCheck == RUNTIME_CHECK_NONE)
-	++checkedInstructionsHere;
-
-    }
-
-  }
-
-  checkedInstructionsChildren = checkedInstructionsHere;
-
-  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it) {
-
-    it->second->countTentativeInstructions();
-    checkedInstructionsChildren += it->second->checkedInstructionsChildren;
-
-  }
-
-  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
-	itend = peelChildren.end(); it != itend; ++it) {
-
-    if(!it->second->isTerminated())
-      continue;
-
-    for(uint32_t i = 0, ilim = it->second->Iterations.size(); i != ilim; ++i) {
-     
-      it->second->Iterations[i]->countTentativeInstructions();
-      checkedInstructionsChildren += it->second->Iterations[i]->checkedInstructionsChildren;
-
-    }
-
-  }
+  return V.getInst()->parent->IA->requiresRuntimeCheck2(V, includeSpecialChecks);
 
 }
 
@@ -1308,7 +1441,7 @@ bool IntegrationAttempt::containsTentativeLoads() {
 bool IntegrationAttempt::requiresRuntimeCheck2(ShadowValue V, bool includeSpecialChecks) {
 
   release_assert(V.isInst());
-  ShadowInstruction* SI = V.u.I;
+  ShadowInstruction* SI = V.getInst();
 
   if(SI->getType()->isVoidTy())
     return false;
@@ -1437,6 +1570,8 @@ void IntegrationAttempt::addCheckpointFailedBlocks() {
 
 void llvm::rerunTentativeLoads(ShadowInstruction* SI, InlineAttempt* IA, bool inLoopAnalyser) {
 
+  PhaseTimer Timer(PhaseTL);
+
   // This indicates the call never returns, and so there will be no further exploration along these lines.
   if(!SI->parent->tlStore)
     return;
@@ -13,6 +13,12 @@
 
 #include <llvm/Analysis/LLPE.h>
 #include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <list>
 
 // For various structures and constants:
 #include <termios.h>
@@ -23,9 +29,12 @@
 #include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/epoll.h>
 
 using namespace llvm;
 
+static cl::list<std::string> ModRefFiles("int-modref-file", cl::ZeroOrMore);
+
 static void isReadBuf(ShadowValue CS, ShadowValue& V, uint64_t& Size) {
 
   if(!tryGetConstantInt(getValArgOperand(CS, 2), Size))
@@ -82,6 +91,12 @@ struct IHPLocationInfo locSocklenArg2 = { 0, 2, sizeof(socklen_t) };
 struct IHPLocationInfo locSocklenArg5 = { 0, 5, sizeof(socklen_t) };
 struct IHPLocationInfo locRlimitArg1 = { 0, 1, sizeof(struct rlimit) };
 struct IHPLocationInfo locVaListArg0 = { 0, 0, 24 };
+struct IHPLocationInfo locPipeFds = { 0, 0, 2 * sizeof(int) };
+
+// Parameters sized by another parameter:
+struct IHPLocationInfo locArg0SizeArg1 = { 0, 0, 0, 1, 1 };
+struct IHPLocationInfo locArg1SizeArg2 = { 0, 1, 0, 2, 1 };
+struct IHPLocationInfo locEpollEvents = { 0, 1, 0, 2, sizeof(struct epoll_event) };
 
 // Call-dependent parameters
 struct IHPLocationInfo locReturnVal = { isReturnVal, 0, 0 };
@@ -99,6 +114,11 @@ static IHPLocationMRInfo JustErrno[] = {
   { 0 }
 };
 
+// Writes nothing, but may read through its arguments.
+static IHPLocationMRInfo NoWriteMR[] = {
+  { 0 }
+};
+
 static IHPLocationMRInfo ReadMR[] = {
   { &locErrno },
   { &locReadBuf },
@@ -238,6 +258,38 @@ static IHPLocationMRInfo UnameMR[] = {
 
 };
 
+static IHPLocationMRInfo EpollWaitMR[] = {
+
+  { &locErrno },
+  { &locEpollEvents },
+  { 0 }
+
+};
+
+static IHPLocationMRInfo PipeMR[] = {
+
+  { &locErrno },
+  { &locPipeFds },
+  { 0 }
+
+};
+
+static IHPLocationMRInfo GetcwdMR[] = {
+
+  { &locErrno },
+  { &locArg0SizeArg1 },
+  { 0 }
+
+};
+
+static IHPLocationMRInfo ReadlinkMR[] = {
+
+  { &locErrno },
+  { &locArg1SizeArg2 },
+  { 0 }
+
+};
+
 static const IHPLocationMRInfo* getIoctlLocDetails(ShadowValue CS) {
 
   uint64_t ioctlCode;
@@ -259,12 +311,15 @@ static IHPFunctionInfo VFSCallFunctions[] = {
 
   { "open", false, JustErrno, 0 },
   { "read", false, ReadMR, 0 },
+  { "pread", false, ReadMR, 0 },
+  { "pread64", false, ReadMR, 0 },
   { "lseek", false, JustErrno, 0 },
   { "llseek", false, JustErrno, 0 },
   { "lseek64", false, JustErrno, 0 },
   { "close", false, JustErrno, 0 },
   { "free", false, JustErrno, 0 },
   { "malloc", false, MallocMR, 0 },
+  { "calloc", false, MallocMR, 0 },
   { "realloc", false, ReallocMR, 0 },
   { "ioctl", false, 0, getIoctlLocDetails },
   { "clock_gettime", false, Arg1AndErrnoMR, 0 },
@@ -313,6 +368,7 @@ static IHPFunctionInfo VFSCallFunctions[] = {
   { "sigprocmask", false, SigprocmaskMR, 0 },
   { "unlink", false, JustErrno, 0 },
   { "__getdents64", false, DirentsMR, 0 },
+  { "getdents64", false, DirentsMR, 0 },
   { "brk", false, JustErrno, 0 },
   { "getpid", false, JustErrno, 0 },
   { "kill", false, JustErrno, 0 },
@@ -325,13 +381,165 @@ static IHPFunctionInfo VFSCallFunctions[] = {
   { "pthread_setcancelstate", false, Arg1AndErrnoMR, 0 },
   { "writev", false, JustErrno, 0 },
   { "epoll_create", false, JustErrno, 0 },
+  { "epoll_create1", false, JustErrno, 0 },
+  { "epoll_ctl", false, JustErrno, 0 },
+  { "epoll_wait", false, EpollWaitMR, 0 },
+  { "epoll_pwait", false, EpollWaitMR, 0 },
+  { "dup", false, JustErrno, 0 },
   { "dup2", false, JustErrno, 0 },
   { "access", false, JustErrno, 0 },
+  { "lstat", false, StatMR, 0 },
+  { "fsync", false, JustErrno, 0 },
+  { "fdatasync", false, JustErrno, 0 },
+  { "ftruncate", false, JustErrno, 0 },
+  { "pipe", false, PipeMR, 0 },
+  { "pipe2", false, PipeMR, 0 },
+  { "getcwd", false, GetcwdMR, 0 },
+  { "readlink", false, ReadlinkMR, 0 },
+  { "getppid", false, JustErrno, 0 },
+  { "sysconf", false, JustErrno, 0 },
+  { "getpagesize", false, JustErrno, 0 },
+  { "sched_yield", false, JustErrno, 0 },
+  { "memchr", false, NoWriteMR, 0 },
+  { "memrchr", false, NoWriteMR, 0 },
+  { "memcmp", false, NoWriteMR, 0 },
+  { "strlen", false, NoWriteMR, 0 },
+  { "strnlen", false, NoWriteMR, 0 },
+  { "strchr", false, NoWriteMR, 0 },
+  { "strrchr", false, NoWriteMR, 0 },
+  { "strcmp", false, NoWriteMR, 0 },
+  { "strncmp", false, NoWriteMR, 0 },
   // Terminator
   { 0, false, 0, 0 }
 
 };
 
+// Further descriptions can be given with -int-modref-file, each line of which names a
+// function and lists what a call to it may write:
+//
+//   # comment
+//   clock_gettime errno arg1:16
+//   epoll_wait errno arg1:arg2*12
+//   memchr
+//   getpid nomodref
+//
+// Each location is one of errno; return, the object the call returns; argN, whatever
+// argument N points to; argN:BYTES, that many bytes of it; or argN:argM[*K], as many
+// bytes (times K) as argument M's value, or an unknown amount if that isn't constant.
+// A name with no locations writes nothing but may read memory through its arguments;
+// nomodref says it does neither. A file's entry replaces any built-in one.
+
+// Names and descriptions read from -int-modref-file, kept for the pass's lifetime.
+static std::list<std::string> modRefNames;
+static std::list<IHPLocationInfo> modRefLocations;
+static std::list<std::vector<IHPLocationMRInfo> > modRefDetails;
+
+static void dieModRef(const std::string& Path, uint32_t Line, const Twine& Msg) {
+
+  errs() << Path << ":" << Line << ": " << Msg << "\n";
+  exit(1);
+
+}
+
+static uint64_t parseModRefArg(const std::string& Path, uint32_t Line, StringRef Word) {
+
+  uint64_t Idx;
+  if((!Word.startswith("arg")) || Word.substr(3).getAsInteger(10, Idx))
+    dieModRef(Path, Line, "expected argN, not " + Word);
+  return Idx;
+
+}
+
+static IHPLocationInfo* parseModRefLocation(const std::string& Path, uint32_t Line, StringRef Word) {
+
+  if(Word == "errno")
+    return &locErrno;
+  if(Word == "return")
+    return &locReturnVal;
+
+  std::pair<StringRef, StringRef> ArgAndSize = Word.split(':');
+
+  IHPLocationInfo Loc = { 0, 0, AliasAnalysis::UnknownSize, 0, 0 };
+  Loc.argIndex = parseModRefArg(Path, Line, ArgAndSize.first);
+
+  StringRef Size = ArgAndSize.second;
+  if(!Size.empty()) {
+
+    if(Size.startswith("arg")) {
+
+      std::pair<StringRef, StringRef> ArgAndScale = Size.split('*');
+      Loc.sizeArgIndex = parseModRefArg(Path, Line, ArgAndScale.first);
+      Loc.sizeArgScale = 1;
+      if((!ArgAndScale.second.empty()) && (ArgAndScale.second.getAsInteger(10, Loc.sizeArgScale) || !Loc.sizeArgScale))
+	dieModRef(Path, Line, "bad size multiplier in " + Word);
+
+    }
+    else if(Size.getAsInteger(10, Loc.argSize)) {
+
+      dieModRef(Path, Line, "bad size in " + Word);
+
+    }
+
+  }
+
+  modRefLocations.push_back(Loc);
+  return &modRefLocations.back();
+
+}
+
+static void loadModRefFile(const std::string& Path, Module* M, DenseMap<Function*, IHPFunctionInfo>& Info) {
+
+  noteCacheDependency(Path);
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(Path);
+  if(std::error_code ec = MB.getError()) {
+    errs() << "Failed to load from " << Path << ": " << ec.message() << "\n";
+    exit(1);
+  }
+
+  StringRef Rest = (*MB)->getBuffer();
+  for(uint32_t LineNo = 1; !Rest.empty(); ++LineNo) {
+
+    std::pair<StringRef, StringRef> LineAndRest = Rest.split('\n');
+    StringRef Line = LineAndRest.first.split('#').first;
+    Rest = LineAndRest.second;
+
+    std::pair<StringRef, StringRef> Tok = getToken(Line);
+    if(Tok.first.empty())
+      continue;
+
+    modRefNames.push_back(Tok.first.str());
+    IHPFunctionInfo FI = { modRefNames.back().c_str(), false, 0, 0 };
+
+    modRefDetails.push_back(std::vector<IHPLocationMRInfo>());
+    std::vector<IHPLocationMRInfo>& Details = modRefDetails.back();
+
+    for(Tok = getToken(Tok.second); !Tok.first.empty(); Tok = getToken(Tok.second)) {
+
+      if(Tok.first == "nomodref") {
+	FI.NoModRef = true;
+	continue;
+      }
+
+      IHPLocationMRInfo Entry = { parseModRefLocation(Path, LineNo, Tok.first) };
+      Details.push_back(Entry);
+
+    }
+
+    if(FI.NoModRef && !Details.empty())
+      dieModRef(Path, LineNo, "nomodref function " + modRefNames.back() + " can't also write locations");
+
+    IHPLocationMRInfo Terminator = { 0 };
+    Details.push_back(Terminator);
+    FI.LocationDetails = &Details[0];
+
+    if(Function* F = M->getFunction(FI.Name))
+      Info[F] = FI;
+
+  }
+
+}
+
 void LLPEAnalysisPass::initMRInfo(Module* M) {
 
   for(uint32_t i = 0; VFSCallFunctions[i].Name; ++i) {
@@ -341,6 +549,9 @@ void LLPEAnalysisPass::initMRInfo(Module* M) {
 
   }
 
+  for(cl::list<std::string>::iterator it = ModRefFiles.begin(), itend = ModRefFiles.end(); it != itend; ++it)
+    loadModRefFile(*it, M, functionMRInfo);
+
 }
 
 IHPFunctionInfo* LLPEAnalysisPass::getMRInfo(Function* F) {
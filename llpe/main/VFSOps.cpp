@@ -20,13 +20,21 @@
 #include "llvm/Support/Debug.h"
 #include "llvm/System/Path.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include <fcntl.h> // For O_RDONLY et al
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <dirent.h>
+#include <stddef.h>
 #include <errno.h>
 #include <stdio.h>
 
+#include <set>
+
 // Implement a backward walker to identify a VFS operation's predecessor, and a forward walker to identify open instructions
 // which can be shown pointless because along all paths it ends up at a close instruction.
 
@@ -34,6 +42,37 @@ using namespace llvm;
 
 static cl::opt<bool> ElimRedundantChecks("int-elim-read-checks");
 static cl::opt<std::string> SpecStdIn("int-spec-stdin");
+// Take -int-spec-stdin as only the start of stdin, such as a protocol header, rather than
+// the whole stream. Reads within it are specialised and checked as usual; a read that
+// crosses its end asks for just the rest of it, as a short read from a pipe may return,
+// and stdin is unknown from then on, so the code consuming the remainder runs
+// unspecialised on what the real reads deliver.
+static cl::opt<bool> SpecStdInPrefix("int-spec-stdin-prefix");
+
+// With -int-elim-read-checks the first checked read of a file validates all of it,
+// so every descriptor open on the same file along this path is clean from then on.
+static bool isFileValidated(FDStore* FDS, const std::string& Filename) {
+
+  const std::string* Interned = internFilename(Filename);
+  for(uint32_t i = 0, ilim = FDS->size(); i != ilim; ++i) {
+    const FDState& State = FDS->getFD(i);
+    if(State.clean && State.filename == Interned)
+      return true;
+  }
+
+  return false;
+
+}
+
+static void markFileValidated(FDStore* FDS, const std::string& Filename) {
+
+  const std::string* Interned = internFilename(Filename);
+  for(uint32_t i = 0, ilim = FDS->size(); i != ilim; ++i) {
+    if(FDS->getFD(i).filename == Interned && !FDS->getFD(i).clean)
+      FDS->getWritableFD(i).clean = true;
+  }
+
+}
 
 bool IntegrationAttempt::getConstantString(ShadowValue Ptr, ShadowInstruction* SearchFrom, std::string& Result) {
 
@@ -128,6 +167,23 @@ bool IntegrationAttempt::getConstantString(ShadowValue Ptr, ShadowInstruction* S
 
 }
 
+static std::set<std::string> internedFilenames;
+
+const std::string* llvm::internFilename(const std::string& Filename) {
+
+  if(Filename.empty())
+    return 0;
+  return &*internedFilenames.insert(Filename).first;
+
+}
+
+const std::string& FDState::getFilename() const {
+
+  static const std::string noFilename;
+  return filename ? *filename : noFilename;
+
+}
+
 FDStore* ShadowBB::getWritableFDStore() {
 
   fdStore = fdStore->getWritable();
@@ -140,14 +196,84 @@ void FDStoreMerger::merge2(FDStore* mergeTo, FDStore* mergeFrom)  {
   // Simple merge rule: FDs only defined on one path or the other go away entirely,
   // FDs with conflicting positions go to pos -1 (unknown), all others stay.
 
-  mergeTo->fds.resize(std::min(mergeTo->fds.size(), mergeFrom->fds.size()));
+  mergeTo->resize(std::min(mergeTo->size(), mergeFrom->size()));
+
+  for(uint32_t page = 0, pagelim = mergeTo->pages.size(); page != pagelim; ++page) {
+
+    // Both sides share this page and so agree on every descriptor in it.
+    if(mergeTo->pages[page] == mergeFrom->pages[page])
+      continue;
+
+    for(uint32_t i = page << FDSTOREPAGESIZELOG2, ilim = std::min(mergeTo->size(), (page + 1) << FDSTOREPAGESIZELOG2); i != ilim; ++i) {
+
+      const FDState& From = mergeFrom->getFD(i);
+      bool posDiffers = From.pos != mergeTo->getFD(i).pos;
+      bool loseClean = (!From.clean) && mergeTo->getFD(i).clean;
+
+      if(posDiffers || loseClean) {
+	FDState& To = mergeTo->getWritableFD(i);
+	if(posDiffers)
+	  To.pos = (uint64_t)-1;
+	if(loseClean)
+	  To.clean = false;
+      }
+
+    }
+
+  }
+
+}
+
+// Resolved reads and seeks leave an FD's real position behind its symbolic one until the
+// next instruction that uses it for real (see flushSeek). The lag can only be carried
+// past a merge if every incoming path agrees on the position and the edge doesn't leave a
+// loop iteration (whose code is emitted only if the loop is); otherwise the incoming block
+// brings the position up to date before branching. Sets keepPending for each FD whose
+// merged state is still pending.
+void FDStoreMerger::flushSeeks(SmallVector<bool, 4>& keepPending) {
+
+  uint32_t minSize = UINT_MAX, maxSize = 0;
+  for(SmallVector<ShadowBB*, 4>::iterator it = incomingBlocks.begin(), itend = incomingBlocks.end(); it != itend; ++it) {
+    minSize = std::min(minSize, (*it)->fdStore->size());
+    maxSize = std::max(maxSize, (*it)->fdStore->size());
+  }
+
+  keepPending.assign(minSize, false);
+
+  for(uint32_t i = 0; i != maxSize; ++i) {
+
+    bool anyPending = false;
+    bool agree = i < minSize;
+    const FDState* First = 0;
 
-  for(uint32_t i = 0, ilim = mergeTo->fds.size(); i != ilim; ++i) {
+    for(SmallVector<ShadowBB*, 4>::iterator it = incomingBlocks.begin(), itend = incomingBlocks.end(); it != itend; ++it) {
+      if(i < (*it)->fdStore->size()) {
+	const FDState& State = (*it)->fdStore->getFD(i);
+	if(!First)
+	  First = &State;
+	anyPending |= State.seekPending;
+	agree &= State.pos == First->pos;
+      }
+    }
+
+    if(!anyPending)
+      continue;
+
+    for(SmallVector<ShadowBB*, 4>::iterator it = incomingBlocks.begin(), itend = incomingBlocks.end(); it != itend; ++it) {
 
-    if(mergeFrom->fds[i].pos != mergeTo->fds[i].pos)
-      mergeTo->fds[i].pos = (uint64_t)-1;
-    if(!mergeFrom->fds[i].clean)
-      mergeTo->fds[i].clean = false;
+      ShadowBB* BB = *it;
+      if(i >= BB->fdStore->size() || !BB->fdStore->getFD(i).seekPending)
+	continue;
+
+      if(agree && !(mergeIA && BB->IA != mergeIA)) {
+	keepPending[i] = true;
+	continue;
+      }
+
+      FDState State = BB->fdStore->getFD(i);
+      flushSeek(&BB->insts.back(), State, i);
+
+    }
 
   }
 
@@ -158,6 +284,9 @@ void FDStoreMerger::doMerge() {
   if(incomingBlocks.empty())
     return;
 
+  SmallVector<bool, 4> keepPending;
+  flushSeeks(keepPending);
+
   // Discard wholesale block duplicates:
   SmallVector<FDStore*, 4> incomingStores;
   incomingStores.reserve(std::distance(incomingBlocks.begin(), incomingBlocks.end()));
@@ -231,6 +360,81 @@ void FDStoreMerger::doMerge() {
 
   }
 
+  for(uint32_t i = 0, ilim = newStore->size(); i != ilim; ++i) {
+
+    if(newStore->getFD(i).seekPending != keepPending[i]) {
+      newStore = newStore->getWritable();
+      newStore->getWritableFD(i).seekPending = keepPending[i];
+    }
+
+  }
+
+}
+
+// Called before SI uses FD's position for real, or before the state of the FD is lost:
+// emit, before SI, the seek that resolved reads and seeks so far have left pending.
+void llvm::flushSeek(ShadowInstruction* SI, FDState& FDS, uint32_t FD) {
+
+  if(!FDS.seekPending)
+    return;
+
+  FDS.seekPending = false;
+
+  SmallVector<SeekFixup, 1>& Fixups = GlobalIHP->seekFixups[SI];
+  for(SmallVector<SeekFixup, 1>::iterator it = Fixups.begin(), itend = Fixups.end(); it != itend; ++it) {
+    if(it->FD == FD) {
+      *it = SeekFixup(FD, FDS.filename, FDS.pos);
+      return;
+    }
+  }
+
+  Fixups.push_back(SeekFixup(FD, FDS.filename, FDS.pos));
+
+  // The fix-up depends on the file positions this context was entered with.
+  SI->parent->IA->noteVFSOp();
+
+}
+
+void llvm::flushAllSeeks(ShadowInstruction* SI) {
+
+  ShadowBB* BB = SI->parent;
+  if(!BB->fdStore)
+    return;
+
+  for(uint32_t i = 0, ilim = BB->fdStore->size(); i != ilim; ++i) {
+
+    if(BB->fdStore->getFD(i).seekPending)
+      flushSeek(SI, BB->getWritableFDStore()->getWritableFD(i), i);
+
+  }
+
+}
+
+// SI, a resolved read or seek, leaves the real position behind: cancel the fix-up
+// flushSeek may have given it and pass the lag on to the FD's next real use.
+static void deferSeek(ShadowInstruction* SI, FDState& FDS) {
+
+  GlobalIHP->seekFixups.erase(SI);
+  FDS.seekPending = true;
+
+}
+
+// An expanded call's context may turn out not to be committed, in which case the original
+// call runs and needs the positions up to date. Note the fix-ups for that case without
+// clearing them from the store, since if the context is committed its code carries them on.
+void llvm::noteCallSeekFixups(ShadowInstruction* SI) {
+
+  GlobalIHP->callSeekFixups.erase(SI);
+
+  FDStore* FDS = SI->parent->fdStore;
+  for(uint32_t i = 0, ilim = FDS->size(); i != ilim; ++i) {
+
+    const FDState& State = FDS->getFD(i);
+    if(State.seekPending)
+      GlobalIHP->callSeekFixups[SI].push_back(SeekFixup(i, State.filename, State.pos));
+
+  }
+
 }
 
 void llvm::doBlockFDStoreMerge(ShadowBB* BB) {
@@ -244,6 +448,7 @@ void llvm::doBlockFDStoreMerge(ShadowBB* BB) {
   // rather than a local map.
 
   FDStoreMerger V;
+  V.mergeIA = BB->IA;
   BB->IA->visitNormalPredecessorsBW(BB, &V, /* ctx = */0);
   V.doMerge();
   BB->fdStore = V.newStore;
@@ -260,7 +465,7 @@ void llvm::doCallFDStoreMerge(ShadowBB* CallerBB, InlineAttempt* CallIA) {
 
 }
 
-static bool filenameIsForbidden(std::string& s) {
+static bool filenameIsForbidden(const std::string& s) {
 
   return s.empty() || s.find("/proc/") == 0 || s.find("/sys/") == 0 || s.find("/dev/") == 0;
 
@@ -318,9 +523,12 @@ bool IntegrationAttempt::tryPromoteOpenCall(ShadowInstruction* SI) {
 	    FDStore* FDS = SI->parent->getWritableFDStore();
 	    uint32_t newId = pass->fds.size();
 	    pass->fds.push_back(FDGlobalState(SI, /* not a fifo */ false));
-	    if(FDS->fds.size() <= newId)
-	      FDS->fds.resize(newId + 1);
-	    FDS->fds[newId] = FDState(Filename);
+	    if(FDS->size() <= newId)
+	      FDS->resize(newId + 1);
+	    FDState& NewFD = FDS->getWritableFD(newId);
+	    NewFD = FDState(Filename);
+	    if(ElimRedundantChecks && isFileValidated(FDS, Filename))
+	      NewFD.clean = true;
 	    
 	    cast<ImprovedValSetSingle>(SI->i.PB)->set(ImprovedVal(ShadowValue::getFdIdx(newId)), ValSetTypeFD);
 
@@ -388,7 +596,7 @@ static uint32_t getFD(ShadowValue V) {
   if(VPB.Overdef || VPB.Values.size() != 1 || VPB.SetType != ValSetTypeFD)
     return (uint32_t)-1;
 
-  return VPB.Values[0].V.u.PtrOrFd.idx;
+  return VPB.Values[0].V.getIdx();
 
 }
 
@@ -419,17 +627,19 @@ static AliasAnalysis::AliasResult aliasesFD(ShadowValue V, ShadowInstruction* FD
 
 }
 
-void llvm::noteLLIODependency(std::string& Filename) {
+void llvm::noteLLIODependency(const std::string& Filename) {
   
   std::vector<std::string>::iterator findit = 
     std::find(GlobalIHP->llioDependentFiles.begin(), GlobalIHP->llioDependentFiles.end(), Filename);
 
   if(findit == GlobalIHP->llioDependentFiles.end())
     GlobalIHP->llioDependentFiles.push_back(Filename);
+
+  noteCacheDependency(Filename);
   
 }
 
-bool IntegrationAttempt::executeStatCall(ShadowInstruction* SI, Function* F, std::string& Filename) {
+bool IntegrationAttempt::executeStatCall(ShadowInstruction* SI, Function* F, const std::string& Filename) {
 
   struct stat file_stat;
   int stat_ret = ::stat(Filename.c_str(), &file_stat);
@@ -470,7 +680,270 @@ bool IntegrationAttempt::executeStatCall(ShadowInstruction* SI, Function* F, std
 }
 
 // Return value: is this a VFS call (regardless of whether we resolved it successfully)
-bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
+// Model a read-only mapping of a file opened on this path as a new heap object holding the
+// file's contents. The call itself stays in the residual program, so the specialised code
+// reads the real mapping, guarded by an lliowd check like a resolved read.
+bool IntegrationAttempt::executeMmapCall(ShadowInstruction* SI) {
+
+  // Already modelled: this is a loop or recursion revisiting the call.
+  if(SI->i.PB) {
+
+    ImprovedValSetSingle* IVS = dyn_cast<ImprovedValSetSingle>(SI->i.PB);
+    if(IVS && IVS->SetType == ValSetTypePB && IVS->Values.size() == 1 && 
+       IVS->Values[0].V.isPtrIdx() && getAllocData(IVS->Values[0].V)->allocValue == ShadowValue(SI)) {
+      markVagueAllocation(SI);
+      return true;
+    }
+
+    return false;
+
+  }
+
+  uint64_t Addr, Len, Prot, Flags, Off;
+  if(!(tryGetConstantIntReplacement(SI->getCallArgOperand(0), Addr) &&
+       tryGetConstantIntReplacement(SI->getCallArgOperand(1), Len) &&
+       tryGetConstantIntReplacement(SI->getCallArgOperand(2), Prot) &&
+       tryGetConstantIntReplacement(SI->getCallArgOperand(3), Flags) &&
+       tryGetConstantIntReplacement(SI->getCallArgOperand(5), Off))) {
+    LPDEBUG("Can't model mmap call " << itcache(SI) << " because its arguments are unresolved\n");
+    return false;
+  }
+
+  if(Addr != 0 || (Prot & PROT_WRITE) || (Flags & MAP_FIXED) || Len == 0) {
+    LPDEBUG("Can't model mmap call " << itcache(SI) << ": only read-only mappings at a kernel-chosen address are supported\n");
+    return false;
+  }
+
+  uint32_t FD = getFD(SI->getCallArgOperand(4));
+  if(FD == (uint32_t)-1 || SI->parent->fdStore->size() <= FD || pass->fds[FD].isFifo)
+    return false;
+
+  const FDState& FDS = SI->parent->fdStore->getFD(FD);
+  if(FDS.getFilename().empty())
+    return false;
+
+  // Only model mappings lying wholly within the file: beyond EOF the mapping is zero-filled
+  // to the end of the page and faults after that.
+  ArrayRef<uint8_t> fileBytes;
+  std::string errors;
+  if((!getFileBytes(FDS.getFilename(), Off, Len, fileBytes, errors)) || fileBytes.size() != Len) {
+    LPDEBUG("Can't model mmap call " << itcache(SI) << " which maps beyond EOF or can't be read\n");
+    return false;
+  }
+
+  LLVMContext& Context = SI->invar->I->getContext();
+  Type* allocType = ArrayType::get(Type::getInt8Ty(Context), Len);
+
+  noteMalloc(SI);
+
+  AllocData& AD = addHeapAlloc(SI);
+  executeAllocInst(SI, AD, allocType, Len, -1, AD.allocIdx);
+
+  ImprovedValSetSingle PtrSet = *cast<ImprovedValSetSingle>(SI->i.PB);
+  ImprovedValSetSingle WriteIVS(ImprovedVal(ShadowValue(ConstantDataArray::get(Context, fileBytes)), 0), ValSetTypeScalar);
+  executeWriteInst(0, PtrSet, WriteIVS, Len, SI);
+
+  noteVFSOp();
+  noteLLIODependency(FDS.getFilename());
+
+  if(!FDS.clean)
+    SI->needsRuntimeCheck = RUNTIME_CHECK_READ_LLIOWD;
+
+  this->containsCheckedReads = true;
+
+  return true;
+
+}
+
+// Unmapping a modelled mapping frees it, as for free().
+bool IntegrationAttempt::executeMunmapCall(ShadowInstruction* SI) {
+
+  ShadowInstruction* MappedPtr = SI->getCallArgOperand(0).getInst();
+  if(!MappedPtr)
+    return false;
+
+  ImprovedValSetSingle* MappedIVS = dyn_cast_or_null<ImprovedValSetSingle>(MappedPtr->i.PB);
+  if((!MappedIVS) || MappedIVS->SetType != ValSetTypePB || MappedIVS->Values.size() != 1 ||
+     MappedIVS->Values[0].Offset != 0 || !MappedIVS->Values[0].V.isPtrIdx())
+    return false;
+
+  ShadowInstruction* MapSI = getAllocData(MappedIVS->Values[0].V)->allocValue.getInst();
+  if((!MapSI) || !inst_is<CallInst>(MapSI))
+    return false;
+
+  Function* MapF = getCalledFunction(MapSI);
+  if((!MapF) || !(MapF->getName() == "mmap" || MapF->getName() == "mmap64"))
+    return false;
+
+  if(SI->i.PB)
+    deleteIV(SI->i.PB);
+  SI->i.PB = newOverdefIVS();
+
+  ImprovedValSetSingle TagIVS;
+  TagIVS.SetType = ValSetTypeDeallocated;
+
+  executeWriteInst(0, *MappedIVS, TagIVS, SI->parent->getAllocSize(MappedIVS->Values[0].V), SI);
+
+  return true;
+
+}
+
+// A positional read: like read, but from a given offset and leaving the FD's position alone,
+// so an unresolved pread need not forget where the FD is.
+// Returns false to let the call clobber its buffer as an ordinary unexpanded call if we can't resolve it.
+bool IntegrationAttempt::executePreadCall(ShadowInstruction* SI) {
+
+  if(SI->i.PB) {
+
+    deleteIV(SI->i.PB);
+    SI->i.PB = 0;
+    pass->resolvedReadCalls.erase(SI);
+
+  }
+
+  uint32_t FD = getFD(SI->getCallArgOperand(0));
+  if(FD == (uint32_t)-1 || SI->parent->fdStore->size() <= FD || pass->fds[FD].isFifo)
+    return false;
+
+  uint64_t ucBytes, readPos;
+  if(!(tryGetConstantIntReplacement(SI->getCallArgOperand(2), ucBytes) &&
+       tryGetConstantIntReplacement(SI->getCallArgOperand(3), readPos)))
+    return false;
+
+  FDStore* fdStore = SI->parent->getWritableFDStore();
+  FDState& FDS = fdStore->getWritableFD(FD);
+
+  if(FDS.getFilename().empty() || filenameIsForbidden(FDS.getFilename()))
+    return false;
+
+  std::string errors;
+  CachedFile* CF = getCachedFile(FDS.getFilename(), errors);
+  if(!CF)
+    return false;
+
+  uint64_t fileSize = CF->contents->getBufferSize();
+  uint64_t cBytes = readPos >= fileSize ? 0 : std::min(ucBytes, fileSize - readPos);
+
+  LPDEBUG("Successfully resolved " << itcache(SI) << " which reads " << cBytes << " bytes at " << readPos << "\n");
+
+  noteVFSOp();
+
+  SI->i.PB = newOverdefIVS();
+  resolveReadCall(SI, ReadFile(FDS.getFilename(), readPos, cBytes, false));
+  pass->resolvedReadCalls[SI].needsSeek = false;
+
+  setReplacement(SI, ConstantInt::get(SI->getType(), cBytes));
+
+  executeReadInst(SI, FDS.getFilename(), readPos, cBytes);
+
+  noteLLIODependency(FDS.getFilename());
+
+  if(!FDS.clean)
+    SI->needsRuntimeCheck = RUNTIME_CHECK_READ_LLIOWD;
+
+  this->containsCheckedReads = true;
+
+  if(ElimRedundantChecks)
+    markFileValidated(fdStore, FDS.getFilename());
+
+  return true;
+
+}
+
+// Length of the getdents64 record starting at pos in a directory listing, or 0 at its end.
+static uint64_t getDirentLength(StringRef Listing, uint64_t pos) {
+
+  if(pos + offsetof(struct dirent64, d_name) > Listing.size())
+    return 0;
+
+  unsigned short reclen;
+  memcpy(&reclen, Listing.data() + pos + offsetof(struct dirent64, d_reclen), sizeof(reclen));
+  return reclen;
+
+}
+
+// Reading a directory: getdents64 is modelled as a read of the directory's listing (see
+// getCachedFile) that only ever returns whole records, so the directory scans libc builds
+// on it resolve like file reads and are guarded the same way.
+bool IntegrationAttempt::executeGetdentsCall(ShadowInstruction* SI, bool inLoopAnalyser) {
+
+  if(SI->i.PB) {
+
+    deleteIV(SI->i.PB);
+    SI->i.PB = 0;
+    pass->resolvedReadCalls.erase(SI);
+
+  }
+  pass->seekFixups.erase(SI);
+
+  uint32_t FD = getFD(SI->getCallArgOperand(0));
+  if(FD == (uint32_t)-1 || SI->parent->fdStore->size() <= FD || pass->fds[FD].isFifo)
+    return false;
+
+  FDStore* fdStore = SI->parent->getWritableFDStore();
+  FDState& FDS = fdStore->getWritableFD(FD);
+  flushSeek(SI, FDS, FD);
+
+  uint64_t ucBytes;
+  if(FDS.getFilename().empty() || FDS.pos == (uint64_t)-1 || filenameIsForbidden(FDS.getFilename()) ||
+     !tryGetConstantIntReplacement(SI->getCallArgOperand(2), ucBytes)) {
+    FDS.pos = (uint64_t)-1;
+    return false;
+  }
+
+  std::string errors;
+  CachedFile* CF = getCachedFile(FDS.getFilename(), errors);
+  if((!CF) || !CF->isDirectory) {
+    FDS.pos = (uint64_t)-1;
+    return false;
+  }
+
+  StringRef Listing = CF->contents->getBuffer();
+  uint64_t cBytes = 0;
+  while(uint64_t recLen = getDirentLength(Listing, FDS.pos + cBytes)) {
+    if(cBytes + recLen > ucBytes)
+      break;
+    cBytes += recLen;
+  }
+
+  // Buffer too small for the next record: the real call fails with EINVAL.
+  if(cBytes == 0 && FDS.pos < Listing.size()) {
+    FDS.pos = (uint64_t)-1;
+    return false;
+  }
+
+  LPDEBUG("Successfully resolved " << itcache(SI) << " which lists " << cBytes << " bytes of " << FDS.getFilename() << "\n");
+
+  noteVFSOp();
+
+  SI->i.PB = newOverdefIVS();
+  resolveReadCall(SI, ReadFile(FDS.getFilename(), FDS.pos, cBytes, false));
+  if(!inLoopAnalyser) {
+    pass->resolvedReadCalls[SI].needsSeek = false;
+    pass->resolvedReadCalls[SI].seekDeferredFD = FD;
+    deferSeek(SI, FDS);
+  }
+
+  setReplacement(SI, ConstantInt::get(SI->getType(), cBytes));
+
+  executeReadInst(SI, FDS.getFilename(), FDS.pos, cBytes);
+
+  noteLLIODependency(FDS.getFilename());
+
+  if(!FDS.clean)
+    SI->needsRuntimeCheck = RUNTIME_CHECK_READ_LLIOWD;
+
+  this->containsCheckedReads = true;
+
+  FDS.pos += cBytes;
+  if(ElimRedundantChecks)
+    markFileValidated(fdStore, FDS.getFilename());
+
+  return true;
+
+}
+
+bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI, bool inLoopAnalyser) {
 
   // No currently-accepted VFS call can be invoked.
   if(!inst_is<CallInst>(SI))
@@ -481,10 +954,20 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     return false;
 
   const FunctionType *FT = F->getFunctionType();
+
+  if(F->getName() == "mmap" || F->getName() == "mmap64")
+    return executeMmapCall(SI);
+  if(F->getName() == "munmap")
+    return executeMunmapCall(SI);
+  if(F->getName() == "pread" || F->getName() == "pread64")
+    return executePreadCall(SI);
+  if(F->getName() == "getdents64" || F->getName() == "__getdents64")
+    return executeGetdentsCall(SI, inLoopAnalyser);
   
   if(!(F->getName() == "read" || F->getName() == "llseek" || F->getName() == "lseek" || 
        F->getName() == "lseek64" || F->getName() == "close" || F->getName() == "stat" ||
-       F->getName() == "fstat" || F->getName() == "isatty" || F->getName() == "recvfrom"))
+       F->getName() == "fstat" || F->getName() == "isatty" || F->getName() == "recvfrom" ||
+       F->getName() == "recv"))
     return false;
 
   if(SI->i.PB) {
@@ -492,6 +975,7 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     deleteIV(SI->i.PB);
     pass->resolvedReadCalls.erase(SI);
     pass->resolvedSeekCalls.erase(SI);
+    pass->seekFixups.erase(SI);
 
   }
   SI->i.PB = newOverdefIVS();
@@ -520,19 +1004,25 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
   uint32_t FD = getFD(SI->getCallArgOperand(0));
 
   bool perturbsFDs = F->getName() == "read" || F->getName() == "llseek" || F->getName() == "lseek" || 
-    F->getName() == "lseek64";
+    F->getName() == "lseek64" || F->getName() == "recv" || F->getName() == "recvfrom";
  
   // Operates on an unknown FD?
   if(FD == (uint32_t)-1 && perturbsFDs) {
-    fdStore->fds.clear();
+    flushAllSeeks(SI);
+    fdStore->clear();
     return true;
   }
 
   // Operates on an FD not opened on this path?
-  if(SI->parent->fdStore->fds.size() <= FD)
+  if(SI->parent->fdStore->size() <= FD)
     return true;
 
-  FDState& FDS = SI->parent->fdStore->fds[FD];
+  FDState& FDS = fdStore->getWritableFD(FD);
+
+  // If this call isn't resolved it uses the real position, so bring that up to date first;
+  // if it is, the fix-up is cancelled below.
+  if(perturbsFDs)
+    flushSeek(SI, FDS, FD);
 
   if(F->getName() == "isatty") {
 
@@ -575,9 +1065,9 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     case SEEK_END:
       {
 	struct stat file_stat;
-	if(::stat(FDS.filename.c_str(), &file_stat) == -1) {
+	if(::stat(FDS.getFilename().c_str(), &file_stat) == -1) {
 	  
-	  LPDEBUG("Failed to stat " << FDS.filename << "\n");
+	  LPDEBUG("Failed to stat " << FDS.getFilename() << "\n");
 	  return true;
 	  
 	}
@@ -591,32 +1081,80 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
       return true;
     }
 
+    // A directory's offsets are the kernel's opaque record cookies, not positions in
+    // our listing; only a rewind is understood.
+    if(intOffset != 0) {
+
+      struct stat file_stat;
+      if(::stat(FDS.getFilename().c_str(), &file_stat) == 0 && S_ISDIR(file_stat.st_mode)) {
+	FDS.pos = (uint64_t)-1;
+	return true;
+      }
+
+    }
+
     noteVFSOp();
 
     // Doesn't matter what came before, resolve this call here.
     setReplacement(SI, ConstantInt::get(FT->getParamType(1), intOffset));
-    resolveSeekCall(SI, SeekFile(FDS.filename, intOffset));
+    resolveSeekCall(SI, SeekFile(FDS.getFilename(), intOffset));
     FDS.pos = intOffset;
+
+    // Leave the seek itself to the FD's next real use. Not in the loop analyser, whose
+    // repeated passes over a loop body would leave fix-ups from earlier passes behind.
+    if(!inLoopAnalyser) {
+      pass->resolvedSeekCalls[SI].seekDeferredFD = FD;
+      deferSeek(SI, FDS);
+    }
+
     return true;
 
   }
   else if(F->getName() == "fstat") {
 
-    return executeStatCall(SI, F, FDS.filename);
+    return executeStatCall(SI, F, FDS.getFilename());
 
   }
   else if(F->getName() == "close") {
 
     noteVFSOp();
     setReplacement(SI, ConstantInt::get(FT->getReturnType(), 0));
+    // The position goes with the descriptor.
+    FDS.seekPending = false;
     return true;
 
   }
-  else if(F->getName() == "read" || F->getName() == "recvfrom") {
+  else if(F->getName() == "read" || F->getName() == "recvfrom" || F->getName() == "recv") {
 
     ShadowValue readBytes = SI->getCallArgOperand(2);
     uint64_t ucBytes;
 
+    // Socket receives only make sense on a recorded stream (see -int-path-condition-stream).
+    // A peek delivers the same bytes without consuming them, and a sender address, which the
+    // trace doesn't record, is left to the real call to fill in: give up in that case and let
+    // the call clobber its arguments as usual.
+    bool isPeek = false;
+    if(F->getName() != "read") {
+
+      uint64_t recvFlags;
+      bool wantsAddr = F->getName() == "recvfrom" && 
+	!(getConstReplacement(SI->getCallArgOperand(4)) && getConstReplacement(SI->getCallArgOperand(4))->isNullValue());
+
+      if((!pass->fds[FD].isFifo) || wantsAddr ||
+	 !tryGetConstantIntReplacement(SI->getCallArgOperand(3), recvFlags) ||
+	 (recvFlags & ~(uint64_t)(MSG_PEEK | MSG_WAITALL))) {
+
+	FDS.pos = (uint64_t)-1;
+	deleteIV(SI->i.PB);
+	SI->i.PB = 0;
+	return false;
+
+      }
+
+      isPeek = !!(recvFlags & MSG_PEEK);
+
+    }
+
     if(!tryGetConstantIntReplacement(readBytes, ucBytes)) {
       FDS.pos = (uint64_t)-1;
       return true;
@@ -624,14 +1162,14 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     
     int64_t cBytes = (int64_t)ucBytes;
 
-    if(filenameIsForbidden(FDS.filename)) {
+    if(filenameIsForbidden(FDS.getFilename())) {
       FDS.pos = (uint64_t)-1;
       return true;
     }
 
     struct stat file_stat;
-    if(::stat(FDS.filename.c_str(), &file_stat) == -1) {
-      LPDEBUG("Failed to stat " << FDS.filename << "\n");
+    if(::stat(FDS.getFilename().c_str(), &file_stat) == -1) {
+      LPDEBUG("Failed to stat " << FDS.getFilename() << "\n");
       FDS.pos = (uint64_t)-1;
       return true;
     }
@@ -642,6 +1180,13 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     }
 
     int64_t bytesAvail = file_stat.st_size - FDS.pos;
+    bool prefixRead = FD == 0 && SpecStdInPrefix;
+    if(prefixRead && bytesAvail <= 0) {
+      LPDEBUG("Read " << itcache(SI) << " is past the known prefix of stdin\n");
+      FDS.pos = (uint64_t)-1;
+      return true;
+    }
+
     if(cBytes > bytesAvail) {
       LPDEBUG("Desired read of " << cBytes << " truncated to " << bytesAvail << " (EOF)\n");
       cBytes = bytesAvail;
@@ -654,17 +1199,26 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
 
     bool isFifo = pass->fds[FD].isFifo;
 
-    resolveReadCall(SI, ReadFile(FDS.filename, FDS.pos, cBytes, isFifo));
+    resolveReadCall(SI, ReadFile(FDS.getFilename(), FDS.pos, cBytes, isFifo));
+    pass->resolvedReadCalls[SI].prefixRead = prefixRead;
     if(isFifo)
       pass->resolvedReadCalls[SI].needsSeek = false;
+    else if(!inLoopAnalyser) {
+      // Leave the seek past what we read to the FD's next real use.
+      pass->resolvedReadCalls[SI].needsSeek = false;
+      pass->resolvedReadCalls[SI].seekDeferredFD = FD;
+      deferSeek(SI, FDS);
+    }
     
     // The number of bytes read is also the return value of read.
     setReplacement(SI, ConstantInt::get(Type::getInt64Ty(F->getContext()), cBytes));
 
-    executeReadInst(SI, FDS.filename, FDS.pos, cBytes);
+    executeReadInst(SI, FDS.getFilename(), FDS.pos, cBytes);
 
     if(!isFifo)
-      noteLLIODependency(FDS.filename);
+      noteLLIODependency(FDS.getFilename());
+    else
+      pass->cacheable = false;
 
     if(isFifo)
       SI->needsRuntimeCheck = RUNTIME_CHECK_READ_MEMCMP;
@@ -673,9 +1227,10 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
 
     this->containsCheckedReads = true;
 
-    FDS.pos += cBytes;
+    if(!isPeek)
+      FDS.pos += cBytes;
     if(ElimRedundantChecks && !isFifo)
-      FDS.clean = true;
+      markFileValidated(fdStore, FDS.getFilename());
 
   }
 
@@ -693,7 +1248,56 @@ ReadFile* IntegrationAttempt::tryGetReadFile(ShadowInstruction* CI) {
 
 }
 
+// Find every call in this context that is not a WIRContinue with respect to FD.
+DenseMap<ShadowInstruction*, WalkInstructionResult>& IntegrationAttempt::getFDUseSummary(ShadowInstruction* FD) {
+
+  std::pair<DenseMap<ShadowInstruction*, DenseMap<ShadowInstruction*, WalkInstructionResult> >::iterator, bool> it =
+    fdUseSummaries.insert(std::make_pair(FD, DenseMap<ShadowInstruction*, WalkInstructionResult>()));
+
+  DenseMap<ShadowInstruction*, WalkInstructionResult>& Summary = it.first->second;
+  if(!it.second)
+    return Summary;
+
+  for(uint32_t i = 0, ilim = nBBs; i != ilim; ++i) {
+
+    ShadowBB* BB = BBs[i];
+    if(!BB)
+      continue;
+
+    for(uint32_t j = 0, jlim = BB->insts.size(); j != jlim; ++j) {
+
+      ShadowInstruction* SI = &(BB->insts[j]);
+      if(!inst_is<CallInst>(SI))
+	continue;
+
+      WalkInstructionResult WIR = computeVfsCallUsingFD(SI, FD, false);
+      if(WIR != WIRContinue)
+	Summary[SI] = WIR;
+
+    }
+
+  }
+
+  return Summary;
+
+}
+
 WalkInstructionResult IntegrationAttempt::isVfsCallUsingFD(ShadowInstruction* VFSCall, ShadowInstruction* FD, bool ignoreClose) {
+
+  // Walkers looking for the successors of a read or seek query every call they pass,
+  // so answer those from the per-FD summary rather than re-examining the call each time.
+  if(ignoreClose)
+    return computeVfsCallUsingFD(VFSCall, FD, ignoreClose);
+
+  DenseMap<ShadowInstruction*, WalkInstructionResult>& Summary = getFDUseSummary(FD);
+  DenseMap<ShadowInstruction*, WalkInstructionResult>::iterator it = Summary.find(VFSCall);
+  if(it == Summary.end())
+    return WIRContinue;
+  return it->second;
+
+}
+
+WalkInstructionResult IntegrationAttempt::computeVfsCallUsingFD(ShadowInstruction* VFSCall, ShadowInstruction* FD, bool ignoreClose) {
   
   // Is VFSCall a call to open, read, seek or close that concerns FD?
   
@@ -705,7 +1309,9 @@ WalkInstructionResult IntegrationAttempt::isVfsCallUsingFD(ShadowInstruction* VF
     return WIRStopThisPath;
 
   StringRef CalleeName = Callee->getName();
-  if(CalleeName == "read") {
+  if(CalleeName == "read" || CalleeName == "pread" || CalleeName == "pread64" ||
+     CalleeName == "recv" || CalleeName == "recvfrom" ||
+     CalleeName == "getdents64" || CalleeName == "__getdents64") {
     
     ShadowValue readFD = VFSCall->getCallArgOperand(0);
     
@@ -782,7 +1388,8 @@ bool IntegrationAttempt::VFSCallWillUseFD(ShadowInstruction* CI) {
   {
     DenseMap<ShadowInstruction*, ReadFile>::iterator it = pass->resolvedReadCalls.find(CI);
     if(it != pass->resolvedReadCalls.end()) {
-      return it->second.needsSeek;
+      // A deferred seek is emitted at a later use, which needs the FD all the same.
+      return it->second.needsSeek || it->second.seekDeferredFD != (uint32_t)-1;
     }
   }
 
@@ -992,49 +1599,113 @@ void IntegrationAttempt::tryKillAllVFSOps() {
 
 }
 
-bool llvm::getFileBytes(std::string& strFileName, uint64_t realFilePos, uint64_t realBytes, std::vector<Constant*>& arrayBytes, LLVMContext& Context, std::string& errors) {
+// Fetch a directory's records exactly as getdents64 presents them: lliowd hashes the same
+// stream, so the listing's hash changes whenever an entry is added, removed or renamed.
+static bool readDirectoryListing(const std::string& Dirname, std::string& Listing, std::string& errors) {
 
-  FILE* fp = fopen(strFileName.c_str(), "r");
-  if(!fp) {
-    errors = "Couldn't open " + strFileName + ": " + strerror(errno);
+  int dirfd = ::open(Dirname.c_str(), O_RDONLY | O_DIRECTORY);
+  if(dirfd == -1) {
+    errors = "Couldn't open directory " + Dirname;
     return false;
   }
 
-  int rc = fseek(fp, realFilePos, SEEK_SET);
-  if(rc == -1) {
-    errors = "Couldn't seek " + strFileName + ": " + strerror(errno);
+  char buf[32768];
+  long nread;
+  while((nread = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0)
+    Listing.append(buf, nread);
+
+  ::close(dirfd);
+
+  if(nread == -1) {
+    errors = "Couldn't list directory " + Dirname;
     return false;
   }
 
-  uint64_t bytesRead = 0;
-  uint8_t buffer[4096];
-  Type* charType = IntegerType::get(Context, 8);
-  while(bytesRead < realBytes) {
-    uint64_t toRead = realBytes - bytesRead;
-    toRead = std::min(toRead, (uint64_t)4096);
-    size_t reallyRead = fread(buffer, 1, (size_t)toRead, fp);
-    if(reallyRead == 0) {
-      if(feof(fp))
-        break;
-      else {
-        errors = "Error reading from " + strFileName + ": " + strerror(errno);
-        fclose(fp);
-        return false;
-      }
-    }
-    for(size_t i = 0; i < reallyRead; i++) {
-      Constant* byteAsConst = ConstantInt::get(charType, buffer[i]);
-      arrayBytes.push_back(byteAsConst);
-    }
-    bytesRead += reallyRead;
+  return true;
+
+}
+
+// Each input file is read once per run, mapped where MemoryBuffer thinks it worthwhile, and every
+// later request for its data or hash -- analysis, commit, the lliowd config and the specialisation
+// cache -- is served from that copy. This also ensures all of them see the same contents.
+CachedFile* llvm::getCachedFile(const std::string& Filename, std::string& errors) {
+
+  CachedFile& CF = GlobalIHP->fileContents[Filename];
+  if(CF.contents)
+    return &CF;
+
+  struct stat file_stat;
+  if(::stat(Filename.c_str(), &file_stat) == 0 && S_ISDIR(file_stat.st_mode)) {
+
+    std::string Listing;
+    if(!readDirectoryListing(Filename, Listing, errors))
+      return 0;
+
+    CF.contents = MemoryBuffer::getMemBufferCopy(Listing, Filename);
+    CF.isDirectory = true;
+    return &CF;
+
+  }
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(Filename, -1, /* RequiresNullTerminator = */ false);
+  if(std::error_code ec = MB.getError()) {
+    errors = "Couldn't open " + Filename + ": " + ec.message();
+    return 0;
   }
 
-  fclose(fp);
+  CF.contents = MB->release();
+  return &CF;
 
+}
+
+bool llvm::getFileBytes(const std::string& strFileName, uint64_t realFilePos, uint64_t realBytes, ArrayRef<uint8_t>& Bytes, std::string& errors) {
+
+  CachedFile* CF = getCachedFile(strFileName, errors);
+  if(!CF)
+    return false;
+
+  // Reads past EOF are truncated, as read() would.
+  uint64_t fileSize = CF->contents->getBufferSize();
+  if(realFilePos > fileSize)
+    realFilePos = fileSize;
+  if(realBytes > fileSize - realFilePos)
+    realBytes = fileSize - realFilePos;
+
+  Bytes = ArrayRef<uint8_t>((const uint8_t*)CF->contents->getBufferStart() + realFilePos, realBytes);
   return true;
 
 }
 
+// Translate a position in a file as we model it to the offset lseek needs to get there:
+// the same thing for a regular file, and the cookie of the last record consumed for a directory.
+uint64_t llvm::getFileSeekOffset(const std::string& Filename, uint64_t pos) {
+
+  std::string errors;
+  CachedFile* CF = getCachedFile(Filename, errors);
+  if((!CF) || (!CF->isDirectory) || pos == 0)
+    return pos;
+
+  StringRef Listing = CF->contents->getBuffer();
+  uint64_t recStart = 0;
+  while(uint64_t recLen = getDirentLength(Listing, recStart)) {
+
+    if(recStart + recLen == pos) {
+
+      int64_t cookie;
+      memcpy(&cookie, Listing.data() + recStart + offsetof(struct dirent64, d_off), sizeof(cookie));
+      return (uint64_t)cookie;
+
+    }
+
+    recStart += recLen;
+
+  }
+
+  release_assert(0 && "Directory position not at a record boundary");
+  return pos;
+
+}
+
 void LLPEAnalysisPass::initGlobalFDStore() {
 
   // Reserve a slot for stdin.
@@ -1045,9 +1716,8 @@ void LLPEAnalysisPass::initGlobalFDStore() {
 void IntegrationAttempt::initialiseFDStore(FDStore* S) {
 
   // Initialise stdin with position 0
-  S->fds.push_back(FDState());
-  S->fds[0].filename = SpecStdIn;
-  S->fds[0].pos = 0;
-  S->fds[0].clean = false;
+  S->resize(1);
+  FDState& StdIn = S->getWritableFD(0);
+  StdIn = FDState(SpecStdIn);
 
 }
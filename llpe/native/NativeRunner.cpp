@@ -0,0 +1,187 @@
+//===-- NativeRunner.cpp --------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// The NativeCallRunner for -int-native-calls (see main/NativeCalls.cpp), using MCJIT. It
+// is loaded after the LLPE module into the llpe tool, which links MCJIT and initialises
+// the native target:
+//
+//   llpe -load LLVMLLPEMain.so -load LLVMLLPEDriver.so -load LLVMLLPENative.so -int-native-calls ...
+//
+// For each function run, the module is cloned, cut down to the function and what it
+// reaches, and given a wrapper taking the arguments as an array of integers, which is
+// compiled once and then called directly. The qualifying checks made before a call reaches
+// the runner guarantee that what is left refers to nothing outside the clone but
+// intrinsics.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/ADT/Triple.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/PassManager.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+using namespace llvm;
+
+#define NATIVE_WRAPPER_NAME "__llpe_native_call"
+
+namespace {
+
+typedef uint64_t (*NativeWrapper)(const uint64_t*);
+
+class MCJITNativeCallRunner : public NativeCallRunner {
+
+  DenseMap<Function*, NativeWrapper> wrappers;
+  // The compiled code lives as long as its engine; both outlive the run.
+  std::vector<ExecutionEngine*> engines;
+
+  NativeWrapper compile(Function* F);
+
+public:
+
+  bool run(Function* F, const std::vector<uint64_t>& Args, uint64_t& Ret);
+
+};
+
+}
+
+// uint64_t wrapper(const uint64_t* args) { return (uint64_t)F((T0)args[0], ...); }
+static void buildWrapper(Function* F) {
+
+  LLVMContext& Ctx = F->getContext();
+  Type* Int64 = Type::getInt64Ty(Ctx);
+  FunctionType* WrapperTy = FunctionType::get(Int64, PointerType::getUnqual(Int64), false);
+  Function* Wrapper = Function::Create(WrapperTy, GlobalValue::ExternalLinkage, NATIVE_WRAPPER_NAME, F->getParent());
+
+  IRBuilder<> Builder(BasicBlock::Create(Ctx, "entry", Wrapper));
+  Value* ArgsPtr = Wrapper->arg_begin();
+
+  std::vector<Value*> CallArgs;
+  for(Function::arg_iterator it = F->arg_begin(), itend = F->arg_end(); it != itend; ++it) {
+
+    Value* Slot = Builder.CreateConstGEP1_32(ArgsPtr, it->getArgNo());
+    Value* Arg = Builder.CreateLoad(Slot);
+    if(it->getType()->isPointerTy())
+      Arg = Builder.CreateIntToPtr(Arg, it->getType());
+    else
+      Arg = Builder.CreateTrunc(Arg, it->getType());
+    CallArgs.push_back(Arg);
+
+  }
+
+  Value* Result = Builder.CreateCall(F, CallArgs);
+  if(F->getReturnType()->isVoidTy())
+    Builder.CreateRet(ConstantInt::get(Int64, 0));
+  else
+    Builder.CreateRet(Builder.CreateZExt(Result, Int64));
+
+}
+
+NativeWrapper MCJITNativeCallRunner::compile(Function* F) {
+
+  Module* M = F->getParent();
+
+  if(Triple(M->getTargetTriple()).getArch() != Triple(sys::getProcessTriple()).getArch()) {
+    errs() << "-int-native-calls: the module's target " << M->getTargetTriple() << " isn't this host's\n";
+    return 0;
+  }
+
+  ValueToValueMapTy VMap;
+  Module* Clone = CloneModule(M, VMap);
+  Function* CloneF = cast<Function>(VMap[F]);
+
+  // Leave the wrapper the only root, so that GlobalDCE strips everything F doesn't reach.
+  for(Module::iterator it = Clone->begin(), itend = Clone->end(); it != itend; ++it) {
+    if(!it->isDeclaration())
+      it->setLinkage(GlobalValue::InternalLinkage);
+  }
+  for(Module::global_iterator it = Clone->global_begin(), itend = Clone->global_end(); it != itend; ++it) {
+    if(!it->isDeclaration())
+      it->setLinkage(GlobalValue::InternalLinkage);
+  }
+  while(!Clone->alias_empty()) {
+    GlobalAlias* A = Clone->alias_begin();
+    A->replaceAllUsesWith(A->getAliasee());
+    A->eraseFromParent();
+  }
+
+  buildWrapper(CloneF);
+
+  {
+    PassManager PM;
+    PM.add(createGlobalDCEPass());
+    PM.run(*Clone);
+  }
+
+  std::string error;
+  ExecutionEngine* EE = EngineBuilder(std::unique_ptr<Module>(Clone)).setErrorStr(&error).setEngineKind(EngineKind::JIT).create();
+  if(!EE) {
+    errs() << "-int-native-calls: failed to create the JIT for " << F->getName() << ": " << error << "\n";
+    return 0;
+  }
+
+  NativeWrapper W = (NativeWrapper)EE->getFunctionAddress(NATIVE_WRAPPER_NAME);
+  if(!W) {
+    errs() << "-int-native-calls: failed to compile " << F->getName() << "\n";
+    delete EE;
+    return 0;
+  }
+
+  engines.push_back(EE);
+  return W;
+
+}
+
+bool MCJITNativeCallRunner::run(Function* F, const std::vector<uint64_t>& Args, uint64_t& Ret) {
+
+  NativeWrapper W;
+
+  DenseMap<Function*, NativeWrapper>::iterator findit = wrappers.find(F);
+  if(findit != wrappers.end())
+    W = findit->second;
+  else
+    W = wrappers[F] = compile(F);
+
+  if(!W)
+    return false;
+
+  Ret = W(Args.empty() ? 0 : &Args[0]);
+  return true;
+
+}
+
+static MCJITNativeCallRunner Runner;
+
+namespace {
+
+struct InstallNativeCallRunner {
+
+  InstallNativeCallRunner() {
+
+    // The compiled code's calls to memcpy and the like resolve against the process.
+    sys::DynamicLibrary::LoadLibraryPermanently(0);
+    GlobalNativeCallRunner = &Runner;
+
+  }
+
+};
+
+}
+
+static InstallNativeCallRunner Install;
@@ -0,0 +1,159 @@
+//===-- llpe.cpp ----------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// A standalone driver that runs the preparation passes from scripts/prepare-int.sh and
+// then LLPE in one process and one PassManager, so the module is parsed once and written
+// once instead of going through bitcode between each opt invocation. The LLPE modules are
+// loaded as with opt:
+//
+//   llpe -load LLVMLLPEMain.so -load LLVMLLPEDriver.so [LLPE options] in.bc -o out.bc
+//
+// -llpe-skip-prepare runs LLPE alone on an already prepared module, -llpe-split-paths adds
+// the optional path-splitting pass (see PathSplit.cpp) before it, and -llpe-pass names the
+// pass to run last, by default the driver's "llpe". LLPE's own options are passed through.
+//
+// -llpe-lazy reads function bodies from the bitcode only as the specialiser reaches them,
+// which for big whole-program inputs of which it explores a small part cuts start-up time
+// and the memory held during analysis. The rest are read once analysis is over, to be
+// written out unchanged. The preparation passes would read every body anyway, so it
+// needs -llpe-skip-prepare, and an already prepared module.
+//
+// The driver also links MCJIT and initialises the native target, for modules such as
+// LLVMLLPENative (see native/NativeRunner.cpp) that compile and run code as they go.
+
+#include "llvm/ADT/Triple.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Pass.h"
+#include "llvm/PassManager.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/PluginLoader.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetLibraryInfo.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/UnifyFunctionExitNodes.h"
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFilename(cl::Positional, cl::desc("<input bitcode>"), cl::init("-"));
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output filename"), cl::value_desc("filename"), cl::init("-"));
+static cl::opt<bool> SkipPrepare("llpe-skip-prepare", cl::desc("Don't run the preparation passes before LLPE"));
+static cl::opt<bool> SplitPaths("llpe-split-paths", cl::desc("Run -llpe-split-paths before LLPE"));
+static cl::opt<bool> Lazy("llpe-lazy", cl::desc("Read function bodies only when LLPE reaches them"));
+static cl::opt<std::string> LLPEPassName("llpe-pass", cl::desc("The pass to run after preparation"), cl::init("llpe"));
+
+static void addPass(PassManager& PM, const char* Name) {
+
+  const PassInfo* PI = PassRegistry::getPassRegistry()->getPassInfo(Name);
+  if(!PI) {
+    errs() << "No pass named " << Name << " is registered; is the LLPE module loaded with -load?\n";
+    exit(1);
+  }
+
+  PM.add(PI->createPass());
+
+}
+
+static void addPreparationPasses(PassManager& PM) {
+
+  // As scripts/prepare-int.sh, followed by the canonicalisation from scripts/integrate.sh.
+  PM.add(createStripSymbolsPass(true));
+  PM.add(createFunctionAttrsPass());
+  PM.add(createUnifyFunctionExitNodesPass());
+  PM.add(createLoopRotatePass());
+  PM.add(createInstructionCombiningPass());
+  PM.add(createJumpThreadingPass());
+  PM.add(createCFGSimplificationPass());
+  PM.add(createGlobalOptimizerPass());
+  PM.add(createLoopSimplifyPass());
+  PM.add(createLCSSAPass());
+
+}
+
+int main(int argc, char** argv) {
+
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+
+  LLVMContext& Context = getGlobalContext();
+
+  PassRegistry& Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeScalarOpts(Registry);
+  initializeIPO(Registry);
+  initializeAnalysis(Registry);
+  initializeIPA(Registry);
+  initializeTransformUtils(Registry);
+  initializeInstCombine(Registry);
+  initializeTarget(Registry);
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  cl::ParseCommandLineOptions(argc, argv, "LLPE partial evaluator\n");
+
+  if(Lazy && !(SkipPrepare && !SplitPaths)) {
+    errs() << "-llpe-lazy needs -llpe-skip-prepare and can't be used with -llpe-split-paths\n";
+    return 1;
+  }
+
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = Lazy ? getLazyIRFileModule(InputFilename, Err, Context) : parseIRFile(InputFilename, Err, Context);
+  if(!M) {
+    Err.print(argv[0], errs());
+    return 1;
+  }
+
+  std::error_code error;
+  raw_fd_ostream Out(OutputFilename.c_str(), error, sys::fs::F_None);
+  if(error) {
+    errs() << "Failed to open " << OutputFilename << ": " << error.message() << "\n";
+    return 1;
+  }
+
+  PassManager PM;
+
+  PM.add(new TargetLibraryInfo(Triple(M->getTargetTriple())));
+  PM.add(new DataLayoutPass());
+
+  if(!SkipPrepare)
+    addPreparationPasses(PM);
+
+  if(SplitPaths)
+    addPass(PM, "llpe-split-paths");
+
+  addPass(PM, LLPEPassName.c_str());
+
+  PM.run(*M);
+
+  WriteBitcodeToFile(M.get(), Out);
+  Out.close();
+  if(Out.has_error()) {
+    Out.clear_error();
+    errs() << "Failed to write " << OutputFilename << "\n";
+    return 1;
+  }
+
+  return 0;
+
+}
@@ -1,5 +1,5 @@
 #!/bin/bash
 
 # Rotate loops so they can be peeled; instcombine and jump thread to eliminate the silly results of loop-rotate (e.g. trivially constant comparisons and jumps).
-# We then jump thread again because the integrator leaves lots of empty blocks lying about and we might as well automate the cleanup process.
+# We then jump thread again: the integrator folds the empty blocks it leaves itself, but commit also leaves branches on PHIs of constants and on conditions known along some edges, which only jump threading removes.
 opt -load /home/chris/integrator/llvm/Release/lib/IntegratorAnalyses.so -load /home/chris/integrator/llvm/Release/lib/IntegratorTransforms.so -loop-rotate -instcombine -jump-threading -loopsimplify -lcssa -integrator -jump-threading $@
@@ -0,0 +1,422 @@
+#!/usr/bin/python
+
+# Specialises one module for several configurations, or several entry points, and links
+# the variants into a single module.
+#
+# The manifest is JSON:
+#
+#   {"module": "prog-pre.bc", "root": "main", "args": ["-int-malloc-alignment=4"],
+#    "select_env": "LLPE_VARIANT",
+#    "variants": [{"name": "small", "args": ["-spec-argv=0,1,small_argv"]},
+#                 {"name": "big", "args": ["-spec-argv=0,1,big_argv", "-spec-env=2,big_env"]}]}
+#
+# Each variant's args (argv, environment, path conditions, --spec-param facts and so on)
+# follow the manifest-wide ones and may also set a different "root". Relative paths,
+# including those inside arguments, are taken relative to the manifest's directory,
+# where LLPE is run.
+#
+# The module is first externalised: its local definitions get hidden visibility
+# instead, and each root is renamed ROOT.llpe.orig. The variants are then specialised
+# in parallel (--jobs at a time), each with -int-variant-name=ROOT.llpe.NAME, which
+# leaves only that variant's code with everything else declared. Linking the
+# externalised module, the variants and the dispatchers gives the output.
+#
+# A root's dispatcher takes the root's name and calls the variant named by the
+# select_env environment variable, or the original root if the variable is unset or
+# names no variant. It has to be the program's entry: any call to the root from inside
+# the module goes to the original.
+#
+# With "select": "input" the dispatcher instead checks the live input against each
+# variant's profile in manifest order and calls the first that matches: argc and each
+# known argument must equal those in its --spec-argv file, and the environment must be
+# exactly that in its --spec-env file. A variant specialised without either matches any
+# input for that part, so list the most specific first. Facts about files are left to
+# the lliowd checks each variant makes where it reads them.
+#
+# Residual functions that variants committed identically, because their configurations
+# agree about that part of the program, are merged after linking (-llpe-merge-variants).
+#
+# A variant marked "replace": true must be its root's only variant, and instead simply
+# replaces the root, as a single LLPE run would: it takes the root's name and every use
+# of the root, and the original is kept as ROOT.old. That suits a library's entry
+# points, each specialised against facts about its arguments:
+#
+#   {"module": "libfoo.bc", "variants": [
+#     {"name": "spec", "root": "foo_parse", "replace": true, "args": ["-spec-param=1,@foo_default_config"]},
+#     {"name": "spec", "root": "foo_emit", "replace": true, "args": ["-spec-param=2,0"]}]}
+
+from __future__ import print_function
+
+import argparse
+import json
+import multiprocessing
+import os
+import os.path
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+name_chars = "-a-zA-Z$._0-9"
+
+def check_call(cmd, **kwargs):
+
+	ret = subprocess.call(cmd, **kwargs)
+	if ret != 0:
+		raise Exception("%s failed with status %d" % (" ".join(cmd), ret))
+
+def externalise(text, roots):
+
+	# Local linkage on a named definition becomes hidden visibility, so the variants'
+	# declarations of it can be resolved against the input's definition. Unnamed
+	# definitions (@0) are left local; -int-variant-name leaves those alone too.
+	text = re.sub(r"(?m)^define (internal|private|linker_private|linker_private_weak) ", "define hidden ", text)
+	text = re.sub(r"(?m)^(@[-a-zA-Z$._][%s]*|@\"[^\"]*\") = (internal|private|linker_private|linker_private_weak) " % name_chars,
+		      r"\1 = hidden ", text)
+	for root in roots:
+		text = re.sub("@%s(?![%s])" % (re.escape(root), name_chars), "@%s.llpe.orig" % root, text)
+	return text
+
+def split_args(argtext):
+
+	# Split at top-level commas; types may contain nested (), [], {} and <>.
+	args = []
+	depth = 0
+	cur = ""
+	for c in argtext:
+		if c in "([{<":
+			depth += 1
+		elif c in ")]}>":
+			depth -= 1
+		if c == "," and depth == 0:
+			args.append(cur.strip())
+			cur = ""
+		else:
+			cur += c
+	if cur.strip():
+		args.append(cur.strip())
+	return args
+
+prefix_keywords = set(["internal", "private", "linker_private", "linker_private_weak", "external", "hidden",
+		       "protected", "default", "dllexport", "dllimport", "weak", "weak_odr", "linkonce",
+		       "linkonce_odr", "available_externally", "extern_weak", "common", "appending",
+		       "ccc", "fastcc", "coldcc", "x86_stdcallcc", "x86_fastcallcc", "x86_thiscallcc",
+		       "zeroext", "signext", "inreg", "noalias", "nonnull", "unnamed_addr"])
+
+def get_signature(text, root):
+
+	# The return type and arguments of the root's definition, from the disassembly.
+	m = re.search(r"(?m)^define ([^@\n]*)@%s\((.*)\)[^()\n]*\{$" % re.escape(root), text)
+	if not m:
+		raise Exception("no definition of %s found" % root)
+	prefix = [t for t in m.group(1).split() if t not in prefix_keywords and not t.startswith("dereferenceable(")]
+	rettype = " ".join(prefix)
+	args = split_args(m.group(2))
+	if "..." in args:
+		raise Exception("%s is variadic, which the dispatcher does not support" % root)
+	named = []
+	for (i, a) in enumerate(args):
+		if a.split()[-1].startswith("%"):
+			named.append(a)
+		else:
+			# Unnamed arguments are numbered from %0.
+			named.append("%s %%%d" % (a, i))
+	return rettype, named
+
+def c_string(name, s):
+
+	data = "".join(c if (c.isalnum() or c in " ._-") else "\\%02X" % ord(c) for c in s)
+	return "@%s = private unnamed_addr constant [%d x i8] c\"%s\\00\"\n" % (name, len(s) + 1, data)
+
+def str_ptr(name, s):
+
+	return "i8* getelementptr inbounds ([%d x i8]* @%s, i32 0, i32 0)" % (len(s) + 1, name)
+
+def spec_option(argv, name):
+
+	# The value of the last --NAME=... or -NAME=... in argv, as LLPE would see it.
+	value = None
+	for a in argv:
+		m = re.match(r"^--?%s=(.*)$" % re.escape(name), a)
+		if m:
+			value = m.group(1)
+	return value
+
+def read_lines(path):
+
+	with open(path) as f:
+		text = f.read()
+	# As LLPE, ignoring any text after the last newline.
+	return text.split("\n")[:-1]
+
+def load_profile(mdir, argv):
+
+	# (argc index, argv index, argv entries with None for __undef__) and
+	# (env index, KEY=VALUE lines), either None if the variant doesn't assume them.
+	argvspec = None
+	envspec = None
+	a = spec_option(argv, "spec-argv")
+	if a:
+		(argcidx, argvidx, path) = a.split(",", 2)
+		entries = []
+		for line in read_lines(os.path.join(mdir, path)):
+			if line == "__undef__":
+				entries.append(None)
+			elif line.strip():
+				entries.append(line)
+		argvspec = (int(argcidx), int(argvidx), entries)
+	e = spec_option(argv, "spec-env")
+	if e:
+		(envidx, path) = e.split(",", 1)
+		envspec = (int(envidx), [l for l in read_lines(os.path.join(mdir, path)) if "=" in l])
+	return (argvspec, envspec)
+
+def make_input_dispatcher(root, rettype, args, variants):
+
+	# variants: (name, (argvspec, envspec)) in the order to try them.
+	out = []
+	argtypes = ", ".join(" ".join(a.split()[:-1]) for a in args)
+	argnames = [a.split()[-1] for a in args]
+	out.append("declare %s @%s.llpe.orig(%s)\n" % (rettype, root, argtypes))
+	for (v, profile) in variants:
+		out.append("declare %s @%s.llpe.%s(%s)\n" % (rettype, root, v, argtypes))
+
+	callargs = ", ".join(args)
+	def tailcall(target, label):
+		if rettype == "void":
+			return "%s:\n  call void @%s(%s)\n  ret void\n" % (label, target, callargs)
+		return "%s:\n  %%r.%s = call %s @%s(%s)\n  ret %s %%r.%s\n" % (label, label, rettype, target, callargs, rettype, label)
+
+	body = []
+	counter = [0]
+	def fresh():
+		counter[0] += 1
+		return "llpe.t%d" % counter[0]
+	def require(cond, fail):
+		# End the current block on cond, continuing in a fresh one.
+		label = fresh()
+		body.append("  br i1 %%%s, label %%%s, label %%%s\n%s:\n" % (cond, label, fail, label))
+	def load_entry(array, idx):
+		ptr = fresh()
+		val = fresh()
+		body.append("  %%%s = getelementptr inbounds i8** %s, i64 %d\n" % (ptr, array, idx))
+		body.append("  %%%s = load i8** %%%s\n" % (val, ptr))
+		return val
+	def require_string(val, strname, s, fail):
+		out.append(c_string(strname, s))
+		cmp = fresh()
+		eq = fresh()
+		body.append("  %%%s = call i32 @strcmp(i8* %%%s, %s)\n" % (cmp, val, str_ptr(strname, s)))
+		body.append("  %%%s = icmp eq i32 %%%s, 0\n" % (eq, cmp))
+		require(eq, fail)
+
+	body.append("\ndefine %s @%s(%s) {\nentry:\n" % (rettype, root, callargs))
+	for (i, (v, (argvspec, envspec))) in enumerate(variants):
+		fail = "check%d" % (i + 1) if i + 1 < len(variants) else "orig"
+		if i != 0:
+			body.append("check%d:\n" % i)
+		if argvspec:
+			(argcidx, argvidx, entries) = argvspec
+			argctype = args[argcidx].split()[0]
+			eq = fresh()
+			body.append("  %%%s = icmp eq %s %s, %d\n" % (eq, argctype, argnames[argcidx], len(entries)))
+			require(eq, fail)
+			for (j, entry) in enumerate(entries):
+				if entry is not None:
+					val = load_entry(argnames[argvidx], j)
+					require_string(val, ".llpe.%s.v%d.arg%d" % (root, i, j), entry, fail)
+		if envspec:
+			(envidx, lines) = envspec
+			for (j, line) in enumerate(lines + [None]):
+				val = load_entry(argnames[envidx], j)
+				isnull = fresh()
+				if line is None:
+					body.append("  %%%s = icmp eq i8* %%%s, null\n" % (isnull, val))
+					require(isnull, fail)
+				else:
+					body.append("  %%%s = icmp ne i8* %%%s, null\n" % (isnull, val))
+					require(isnull, fail)
+					require_string(val, ".llpe.%s.v%d.env%d" % (root, i, j), line, fail)
+		body.append("  br label %%variant%d\n" % i)
+		body.append(tailcall("%s.llpe.%s" % (root, v), "variant%d" % i))
+	if not variants:
+		body.append("  br label %orig\n")
+	body.append(tailcall("%s.llpe.orig" % root, "orig"))
+	body.append("}\n\n")
+	return "".join(out + body)
+
+def make_dispatcher(root, rettype, args, variants, select_env):
+
+	out = []
+	out.append(c_string(".llpe.%s.select" % root, select_env))
+	for (i, v) in enumerate(variants):
+		out.append(c_string(".llpe.%s.variant%d" % (root, i), v))
+	argtypes = ", ".join(" ".join(a.split()[:-1]) for a in args)
+	out.append("declare %s @%s.llpe.orig(%s)\n" % (rettype, root, argtypes))
+	for v in variants:
+		out.append("declare %s @%s.llpe.%s(%s)\n" % (rettype, root, v, argtypes))
+
+	callargs = ", ".join(args)
+	def tailcall(target, label):
+		if rettype == "void":
+			return "%s:\n  call void @%s(%s)\n  ret void\n" % (label, target, callargs)
+		return "%s:\n  %%r.%s = call %s @%s(%s)\n  ret %s %%r.%s\n" % (label, label, rettype, target, callargs, rettype, label)
+
+	out.append("\ndefine %s @%s(%s) {\n" % (rettype, root, callargs))
+	out.append("entry:\n  %%sel = call i8* @getenv(%s)\n" % str_ptr(".llpe.%s.select" % root, select_env))
+	out.append("  %unset = icmp eq i8* %sel, null\n")
+	out.append("  br i1 %%unset, label %%orig, label %%%s\n" % ("check0" if variants else "orig"))
+	for (i, v) in enumerate(variants):
+		nextlabel = "check%d" % (i + 1) if i + 1 < len(variants) else "orig"
+		out.append("check%d:\n  %%cmp%d = call i32 @strcmp(i8* %%sel, %s)\n" % (i, i, str_ptr(".llpe.%s.variant%d" % (root, i), v)))
+		out.append("  %%match%d = icmp eq i32 %%cmp%d, 0\n" % (i, i))
+		out.append("  br i1 %%match%d, label %%variant%d, label %%%s\n" % (i, i, nextlabel))
+		out.append(tailcall("%s.llpe.%s" % (root, v), "variant%d" % i))
+	out.append(tailcall("%s.llpe.orig" % root, "orig"))
+	out.append("}\n\n")
+	return "".join(out)
+
+def replace_roots(text, replaced):
+
+	# Like LLPEAnalysisPass::commit: every use of the original now refers to the
+	# specialised version, which takes the root's name; the original becomes ROOT.old.
+	for (root, v) in replaced:
+		orig = "@" + re.escape("%s.llpe.orig" % root)
+		end = "(?![%s])" % name_chars
+		text = re.sub(r"(?m)^(define [^@\n]*)%s%s" % (orig, end), r"\1@%s.old" % root, text)
+		text = re.sub(orig + end, "@%s" % root, text)
+		text = re.sub("@%s%s" % (re.escape("%s.llpe.%s" % (root, v)), end), "@%s" % root, text)
+	return text
+
+def main():
+
+	root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+	parser = argparse.ArgumentParser(description = "Specialise a module for several configurations at once")
+	parser.add_argument("manifest")
+	parser.add_argument("-o", "--output", required = True)
+	parser.add_argument("--opt-cmd", default = "opt -load %s/llpe/build/main/LLVMLLPEMain.so -load %s/llpe/build/driver/LLVMLLPEDriver.so" % (root, root),
+			    help = "opt invocation with LLPE loaded")
+	parser.add_argument("--jobs", type = int, default = multiprocessing.cpu_count())
+	parser.add_argument("--keep", action = "store_true", help = "keep the intermediate files")
+	parser.add_argument("--verbose", action = "store_true", help = "show LLPE's stderr")
+	args = parser.parse_args()
+
+	with open(args.manifest) as f:
+		manifest = json.load(f)
+
+	mdir = os.path.dirname(os.path.abspath(args.manifest))
+	output = os.path.abspath(args.output)
+	defroot = manifest.get("root", "main")
+	variants = manifest["variants"]
+	select_env = manifest.get("select_env", "LLPE_VARIANT")
+	select = manifest.get("select", "env")
+	if select not in ("env", "input"):
+		print("select must be \"env\" or \"input\"")
+		return 1
+
+	names = [(v.get("root", defroot), v["name"]) for v in variants]
+	if len(set(names)) != len(names):
+		print("Variant names must be unique for each root")
+		return 1
+	for (r, n) in names:
+		if not re.match("^[a-zA-Z$._][%s]*$" % name_chars, n):
+			print("Variant name %s must be a plain LLVM identifier" % n)
+			return 1
+	byroot = {}
+	for v in variants:
+		byroot.setdefault(v.get("root", defroot), []).append(v)
+	roots = sorted(byroot)
+	replaced = []
+	for r in roots:
+		if any(v.get("replace", False) for v in byroot[r]):
+			if len(byroot[r]) != 1:
+				print("A variant replacing %s must be its only variant" % r)
+				return 1
+			replaced.append((r, byroot[r][0]["name"]))
+	dispatched = [r for r in roots if r not in dict(replaced)]
+
+	workdir = tempfile.mkdtemp(prefix = "llpe-batch-")
+	try:
+
+		text = subprocess.check_output(["llvm-dis", os.path.join(mdir, manifest["module"]), "-o", "-"]).decode("utf-8")
+		signatures = dict((r, get_signature(text, r)) for r in dispatched)
+
+		base = os.path.join(workdir, "base.bc")
+		p = subprocess.Popen(["llvm-as", "-o", base], stdin = subprocess.PIPE)
+		p.communicate(externalise(text, roots).encode("utf-8"))
+		if p.returncode != 0:
+			print("Failed to reassemble the externalised module")
+			return 1
+
+		# Specialise up to --jobs variants at a time.
+		pending = list(variants)
+		running = []
+		failed = []
+		outputs = []
+		with open(os.devnull, "w") as nul:
+			while pending or running:
+				while pending and len(running) < args.jobs:
+					v = pending.pop(0)
+					vroot = v.get("root", defroot)
+					vout = os.path.join(workdir, "%s.%s.bc" % (vroot, v["name"]))
+					cmd = "%s -llpe -intheuristics-root=%s.llpe.orig -int-variant-name=%s.llpe.%s %s %s %s -o %s" % \
+					    (args.opt_cmd, vroot, vroot, v["name"], " ".join(manifest.get("args", [])),
+					     " ".join(v.get("args", [])), base, vout)
+					start = time.time()
+					running.append((v, vout, start, subprocess.Popen(cmd, shell = True, cwd = mdir, stdout = nul,
+											   stderr = None if args.verbose else nul)))
+				time.sleep(0.1)
+				still = []
+				for (v, vout, start, proc) in running:
+					ret = proc.poll()
+					if ret is None:
+						still.append((v, vout, start, proc))
+					elif ret != 0:
+						print("%s.%s: LLPE failed with status %d" % (v.get("root", defroot), v["name"], ret))
+						failed.append(v["name"])
+					else:
+						print("%s.%s: specialised in %.1fs" % (v.get("root", defroot), v["name"], time.time() - start))
+						outputs.append(vout)
+				running = still
+
+		if failed:
+			return 1
+
+		dispatch = os.path.join(workdir, "dispatch.ll")
+		with open(dispatch, "w") as f:
+			if dispatched:
+				f.write("declare i8* @getenv(i8*)\n")
+				f.write("declare i32 @strcmp(i8*, i8*)\n\n")
+			for r in dispatched:
+				rettype, sigargs = signatures[r]
+				if select == "input":
+					profiles = [(v["name"], load_profile(mdir, manifest.get("args", []) + v.get("args", []))) for v in byroot[r]]
+					f.write(make_input_dispatcher(r, rettype, sigargs, profiles))
+				else:
+					f.write(make_dispatcher(r, rettype, sigargs, [v["name"] for v in byroot[r]], select_env))
+
+		linked = os.path.join(workdir, "linked.bc")
+		check_call(["llvm-link", base, dispatch] + sorted(outputs) + ["-o", linked])
+		if replaced:
+			text = subprocess.check_output(["llvm-dis", linked, "-o", "-"]).decode("utf-8")
+			p = subprocess.Popen(["llvm-as", "-o", linked], stdin = subprocess.PIPE)
+			p.communicate(replace_roots(text, replaced).encode("utf-8"))
+			if p.returncode != 0:
+				print("Failed to reassemble the linked module")
+				return 1
+
+		check_call("%s -llpe-merge-variants %s -o %s" % (args.opt_cmd, linked, output), shell = True)
+
+	finally:
+		if args.keep:
+			print("Intermediate files kept in", workdir)
+		else:
+			shutil.rmtree(workdir)
+
+	return 0
+
+if __name__ == "__main__":
+	sys.exit(main())
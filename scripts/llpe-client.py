@@ -0,0 +1,53 @@
+#!/usr/bin/python
+
+# Submits a specialisation job to an LLPE server started with -int-serve=SOCKET (see
+# llpe/main/Serve.cpp) and waits for it: the job's options are read from CONFIG, as for
+# -int-config, and the specialised module is written to OUTPUT. Exits non-zero if the
+# job failed; the server's stderr has the details. --quit stops the server instead.
+# A CONFIG of "-" sends none, e.g. to resume from an -int-checkpoint server as it was.
+
+from __future__ import print_function
+
+import argparse
+import os.path
+import socket
+import sys
+
+def main():
+
+	parser = argparse.ArgumentParser(description = "Submit a job to an LLPE -int-serve or -int-checkpoint server")
+	parser.add_argument("socket")
+	parser.add_argument("config", nargs = "?")
+	parser.add_argument("output", nargs = "?")
+	parser.add_argument("--quit", action = "store_true", help = "stop the server")
+	args = parser.parse_args()
+
+	if args.quit:
+		request = "quit\n"
+	elif args.config and args.output:
+		# The server may be running in another directory.
+		config = "" if args.config == "-" else os.path.abspath(args.config)
+		request = "%s\t%s\n" % (config, os.path.abspath(args.output))
+	else:
+		parser.error("need CONFIG and OUTPUT, or --quit")
+
+	s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+	s.connect(args.socket)
+	s.sendall(request.encode("utf-8"))
+
+	reply = b""
+	while not reply.endswith(b"\n"):
+		data = s.recv(256)
+		if not data:
+			break
+		reply += data
+	s.close()
+
+	reply = reply.decode("utf-8").strip()
+	if reply != "ok":
+		print("Job failed" + (": " + reply if reply else ""))
+		return 1
+	return 0
+
+if __name__ == "__main__":
+	sys.exit(main())
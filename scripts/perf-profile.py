@@ -0,0 +1,25 @@
+#!/usr/bin/python
+
+# Turn perf samples of the original program into a profile for LLPE's -int-profile:
+#
+#   perf record -o perf.data ./prog args
+#   perf script -i perf.data -F sym | scripts/perf-profile.py > prog.profile
+#
+# writes one "function samples" line per sampled symbol.
+
+from __future__ import print_function
+
+import sys
+
+counts = {}
+
+for line in sys.stdin:
+	sym = line.strip()
+	if not sym or sym == "[unknown]":
+		continue
+	# Drop any +0x offset perf appends.
+	sym = sym.split("+")[0]
+	counts[sym] = counts.get(sym, 0) + 1
+
+for sym in sorted(counts, key = lambda s: -counts[s]):
+	print(sym, counts[sym])
@@ -0,0 +1,225 @@
+#!/usr/bin/python
+
+# Times original programs against their LLPE-specialised counterparts.
+#
+# By default every test/progs program with a -opt twin is measured; name some to
+# measure only those, and add other workloads (e.g. the eval/*-spec.sh outputs, linked
+# and run with the argv and environment they were specialised for) with
+# --pair NAME ORIG OPT and --args NAME "ARGS". Each binary gets --warmup unmeasured
+# runs and then --runs measured ones, optionally pinned to a CPU, and with --perf the
+# runs go under perf stat to count instructions, branches and I-cache misses too.
+#
+# Results are medians with a distribution-free 95% confidence interval. --save FILE
+# keeps them as a baseline; --baseline FILE compares against one and exits non-zero if
+# the specialised binary of any workload got slower by more than --threshold percent
+# with the intervals not overlapping.
+
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import os.path
+import subprocess
+import sys
+import tempfile
+import time
+
+perf_events = ["instructions", "branches", "L1-icache-load-misses"]
+
+def median(xs):
+
+	xs = sorted(xs)
+	n = len(xs)
+	if n % 2:
+		return xs[n // 2]
+	return (xs[n // 2 - 1] + xs[n // 2]) / 2.0
+
+def binom_cdf(k, n):
+
+	# P(X <= k) for X ~ Binomial(n, 1/2).
+	total = 0
+	c = 1
+	for i in range(k + 1):
+		total += c
+		c = c * (n - i) // (i + 1)
+	return float(total) / (2 ** n)
+
+def median_ci(xs, level = 0.95):
+
+	# The widest symmetric pair of order statistics whose coverage of the median
+	# is at least level; with too few samples for that, the whole range.
+	xs = sorted(xs)
+	n = len(xs)
+	# [xs[j], xs[n - j - 1]] misses the median when at most j samples fall below it or
+	# at most j above.
+	j = 0
+	while j + 1 <= (n - 1) // 2 and 1 - 2 * binom_cdf(j + 1, n) >= level:
+		j += 1
+	return (xs[j], xs[n - j - 1])
+
+def summarise(xs):
+
+	lo, hi = median_ci(xs)
+	return {"median": median(xs), "ci_low": lo, "ci_high": hi, "samples": xs}
+
+def read_perf(path):
+
+	counts = {}
+	with open(path, "r") as f:
+		for line in f:
+			fields = line.strip().split(",")
+			if len(fields) < 3 or line.startswith("#"):
+				continue
+			try:
+				counts[fields[2]] = int(fields[0])
+			except ValueError:
+				# "<not counted>" or "<not supported>"
+				pass
+	return counts
+
+def run_once(cmd, args, cwd):
+
+	prefix = []
+	if args.cpu is not None:
+		prefix = ["taskset", "-c", str(args.cpu)]
+
+	perf_file = None
+	if args.perf:
+		fd, perf_file = tempfile.mkstemp(prefix = "llpe-bench-perf-")
+		os.close(fd)
+		prefix = prefix + ["perf", "stat", "-x", ",", "-o", perf_file, "-e", ",".join(perf_events), "--"]
+
+	with open(os.devnull, "w") as nul:
+		with open(args.stdin or os.devnull, "r") as inf:
+			start = time.time()
+			ret = subprocess.call(prefix + cmd, stdin = inf, stdout = nul, stderr = nul, cwd = cwd)
+			elapsed = time.time() - start
+
+	counts = {}
+	if perf_file is not None:
+		counts = read_perf(perf_file)
+		os.unlink(perf_file)
+
+	return ret, elapsed, counts
+
+def measure(cmd, args, cwd):
+
+	for i in range(args.warmup):
+		run_once(cmd, args, cwd)
+
+	times = []
+	counters = dict((e, []) for e in perf_events)
+	rets = set()
+	for i in range(args.runs):
+		ret, elapsed, counts = run_once(cmd, args, cwd)
+		rets.add(ret)
+		times.append(elapsed)
+		for e in perf_events:
+			if e in counts:
+				counters[e].append(counts[e])
+
+	result = {"wall_seconds": summarise(times), "return_codes": sorted(rets)}
+	for e in perf_events:
+		if len(counters[e]) == len(times):
+			result[e] = summarise(counters[e])
+	return result
+
+def find_progs(progdir):
+
+	progs = []
+	for name in sorted(os.listdir(progdir)):
+		path = os.path.join(progdir, name)
+		if name.endswith("-opt") or not os.access(path, os.X_OK) or os.path.isdir(path):
+			continue
+		if os.path.exists(path + "-opt"):
+			progs.append(name)
+	return progs
+
+def fmt(s, scale = 1.0, unit = ""):
+
+	return "%.4g%s [%.4g, %.4g]" % (s["median"] * scale, unit, s["ci_low"] * scale, s["ci_high"] * scale)
+
+def main():
+
+	parser = argparse.ArgumentParser(description = "Benchmark original against specialised binaries")
+	parser.add_argument("progs", nargs = "*", help = "test/progs programs to run (default: all with a -opt twin)")
+	parser.add_argument("--pair", nargs = 3, action = "append", default = [], metavar = ("NAME", "ORIG", "OPT"))
+	parser.add_argument("--args", nargs = 2, action = "append", default = [], metavar = ("NAME", "ARGS"))
+	parser.add_argument("--stdin", help = "file to feed every run on standard input")
+	parser.add_argument("--runs", type = int, default = 10)
+	parser.add_argument("--warmup", type = int, default = 2)
+	parser.add_argument("--cpu", type = int, help = "pin runs to this CPU with taskset")
+	parser.add_argument("--perf", action = "store_true", help = "collect counters with perf stat")
+	parser.add_argument("--no-build", action = "store_true", help = "don't run make in test/progs first")
+	parser.add_argument("--save", help = "write the results here as a baseline")
+	parser.add_argument("--baseline", help = "compare against a baseline written by --save")
+	parser.add_argument("--threshold", type = float, default = 5.0, help = "percent slowdown to flag")
+	args = parser.parse_args()
+
+	progdir = os.path.join(os.path.dirname(os.path.abspath(__file__)), "progs")
+
+	workloads = []
+	if args.progs or not args.pair:
+		if not args.no_build:
+			subprocess.check_call(["make", "-C", progdir])
+		for name in (args.progs or find_progs(progdir)):
+			path = os.path.join(progdir, name)
+			workloads.append((name, path, path + "-opt", progdir))
+	for (name, orig, opt) in args.pair:
+		workloads.append((name, os.path.abspath(orig), os.path.abspath(opt), os.getcwd()))
+
+	extra_args = dict((name, a.split()) for (name, a) in args.args)
+
+	results = {}
+	for (name, orig, opt, cwd) in workloads:
+
+		wargs = extra_args.get(name, [])
+		r = {"orig": measure([orig] + wargs, args, cwd), "opt": measure([opt] + wargs, args, cwd)}
+		results[name] = r
+
+		if r["orig"]["return_codes"] != r["opt"]["return_codes"]:
+			print(name, "original and specialised return codes differ!")
+
+		orig_t = r["orig"]["wall_seconds"]
+		opt_t = r["opt"]["wall_seconds"]
+		print("%s: original %s, specialised %s, speedup %.3fx" %
+		      (name, fmt(orig_t, 1000, "ms"), fmt(opt_t, 1000, "ms"), orig_t["median"] / opt_t["median"]))
+		for e in perf_events:
+			if e in r["orig"] and e in r["opt"]:
+				print("  %s: original %s, specialised %s" % (e, fmt(r["orig"][e]), fmt(r["opt"][e])))
+
+	if args.save:
+		with open(args.save, "w") as f:
+			json.dump(results, f, indent = 2, sort_keys = True)
+
+	regressions = 0
+	if args.baseline:
+
+		with open(args.baseline, "r") as f:
+			baseline = json.load(f)
+
+		for name in sorted(results):
+
+			if name not in baseline:
+				print(name, "not in baseline")
+				continue
+
+			for key in ["wall_seconds"] + perf_events:
+
+				if key not in results[name]["opt"] or key not in baseline[name]["opt"]:
+					continue
+				new = results[name]["opt"][key]
+				old = baseline[name]["opt"][key]
+				change = (new["median"] - old["median"]) * 100.0 / old["median"] if old["median"] else 0.0
+				overlap = new["ci_low"] <= old["ci_high"] and old["ci_low"] <= new["ci_high"]
+				if change > args.threshold and not overlap:
+					print("REGRESSION: %s %s %+.1f%% (%s -> %s)" % (name, key, change, fmt(old), fmt(new)))
+					regressions += 1
+				elif change < -args.threshold and not overlap:
+					print("Improvement: %s %s %+.1f%%" % (name, key, change))
+
+	return 1 if regressions else 0
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -0,0 +1,211 @@
+#!/usr/bin/python
+
+# Measures LLPE itself: how long specialising each workload takes, and how big it gets.
+#
+# Each workload is a command run with -int-stats-file pointing at a scratch file; the
+# statistics it writes there give the analysis and commit times (from the phase
+# profile), peak RSS and the number of contexts explored. A workload may be run at
+# several scales: it names an input file that LLPE reads at specialisation time, and
+# that file is regenerated at each size listed (the original is put back afterwards).
+#
+# --save FILE keeps the medians as a baseline; --baseline FILE compares against one and
+# exits non-zero if any time or memory figure grew by more than --threshold percent.
+# Context counts are reported whenever they change, since that means LLPE explored
+# differently rather than ran slower.
+#
+# Command placeholders: {opt} is --opt-cmd, {root} the repository root, {specdir}
+# --specdir (where the eval workloads' *-pre.bc files were built), {stats} the
+# statistics file and {scale} the current scale.
+
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import os.path
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from bench import median
+
+default_suite = [
+
+	{"name": "read", "dir": "{root}/test/progs", "input": "read-input", "scales": [64, 1024, 16384],
+	 "command": "{opt} -llpe -int-stats-file={stats} read.bc -o /dev/null"},
+	{"name": "heapstress", "dir": "{root}/test/progs",
+	 "command": "{opt} -llpe -int-stats-file={stats} heapstress.bc -o /dev/null"},
+	{"name": "deepnesting", "dir": "{root}/test/progs",
+	 "command": "{opt} -llpe -int-stats-file={stats} deepnesting.bc -o /dev/null"},
+	{"name": "nested_loops", "dir": "{root}/test/progs",
+	 "command": "{opt} -llpe -int-stats-file={stats} nested_loops.bc -o /dev/null"},
+	{"name": "md5sum", "dir": "{specdir}", "command": "bash {root}/eval/md5sum-spec.sh -int-stats-file={stats}"},
+	{"name": "xml", "dir": "{specdir}", "command": "bash {root}/eval/xml-spec.sh -int-stats-file={stats}"},
+	{"name": "printf", "dir": "{specdir}", "command": "bash {root}/eval/printf-spec.sh -int-stats-file={stats}"},
+	{"name": "date", "dir": "{specdir}", "command": "bash {root}/eval/date-spec.sh -int-stats-file={stats}"},
+	{"name": "mongoose", "dir": "{specdir}",
+	 "command": "cat {root}/eval/mongoose/mongoose-spec-args-post | xargs {opt} -llpe -int-stats-file={stats} mongoose-models.bc -o /dev/null"}
+
+]
+
+analysis_phases = ["interpret", "benefit", "tl", "dse", "die", "savesplit"]
+commit_phases = ["commit", "postcommit"]
+compared = ["wall_seconds", "analysis_seconds", "commit_seconds", "peak_rss_bytes"]
+
+def make_input(path, size):
+
+	# Deterministic text, so runs at the same scale see the same file.
+	line = "the quick brown fox jumps over the lazy dog 0123456789\n"
+	with open(path, "w") as f:
+		written = 0
+		while written < size:
+			chunk = line[:size - written]
+			f.write(chunk)
+			written += len(chunk)
+
+def run_once(w, scale, args):
+
+	fd, stats = tempfile.mkstemp(prefix = "llpe-bench-stats-")
+	os.close(fd)
+
+	subst = {"opt": args.opt_cmd, "root": args.root, "specdir": args.specdir, "stats": stats, "scale": scale}
+	cmd = w["command"].format(**subst)
+	cwd = w.get("dir", "{root}").format(**subst)
+
+	with open(os.devnull, "w") as nul:
+		start = time.time()
+		ret = subprocess.call(cmd, shell = True, cwd = cwd, stdout = nul, stderr = nul if not args.verbose else None)
+		elapsed = time.time() - start
+
+	try:
+		if ret != 0:
+			print("%s (scale %s): command failed with status %d: %s" % (w["name"], scale, ret, cmd))
+			return None
+		with open(stats + ".phases.json") as f:
+			phases = json.load(f)
+		with open(stats + ".json") as f:
+			totals = json.load(f)["totals"]
+	except IOError:
+		print("%s (scale %s): no statistics written; is -int-stats-file reaching LLPE?" % (w["name"], scale))
+		return None
+	finally:
+		for suffix in ["", ".json", ".phases.json", ".functions.csv"]:
+			if os.path.exists(stats + suffix):
+				os.unlink(stats + suffix)
+
+	return {"wall_seconds": elapsed,
+		"analysis_seconds": sum(phases["phases"][p]["wall_seconds"] for p in analysis_phases),
+		"commit_seconds": sum(phases["phases"][p]["wall_seconds"] for p in commit_phases),
+		"peak_rss_bytes": phases["overall"]["peak_rss_bytes"],
+		"contexts": totals["dynamic_contexts"],
+		"functions": totals["dynamic_functions"]}
+
+def measure(w, scale, args):
+
+	inpath = None
+	backup = None
+	if "input" in w:
+		cwd = w.get("dir", "{root}").format(root = args.root, specdir = args.specdir)
+		inpath = os.path.join(cwd, w["input"])
+		if os.path.exists(inpath):
+			backup = inpath + ".llpe-bench-orig"
+			shutil.copy2(inpath, backup)
+		make_input(inpath, scale)
+
+	try:
+		samples = []
+		for i in range(args.runs):
+			s = run_once(w, scale, args)
+			if s is None:
+				return None
+			samples.append(s)
+	finally:
+		if backup is not None:
+			shutil.move(backup, inpath)
+		elif inpath is not None:
+			os.unlink(inpath)
+
+	result = dict((k, median([s[k] for s in samples])) for k in samples[0])
+	result["samples"] = samples
+	return result
+
+def describe(r):
+
+	return "wall %.3fs, analysis %.3fs, commit %.3fs, peak RSS %.1fMB, %d contexts in %d functions" % \
+	    (r["wall_seconds"], r["analysis_seconds"], r["commit_seconds"], r["peak_rss_bytes"] / 1048576.0,
+	     r["contexts"], r["functions"])
+
+def main():
+
+	root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+	parser = argparse.ArgumentParser(description = "Benchmark LLPE's own specialisation time and memory")
+	parser.add_argument("workloads", nargs = "*", help = "workloads to run (default: the whole suite)")
+	parser.add_argument("--suite", help = "JSON list of workloads to use instead of the built-in suite")
+	parser.add_argument("--opt-cmd", default = "opt -load %s/llpe/build/main/LLVMLLPEMain.so -load %s/llpe/build/driver/LLVMLLPEDriver.so" % (root, root),
+			    help = "opt invocation with LLPE loaded")
+	parser.add_argument("--specdir", default = os.getcwd(), help = "directory holding the eval *-pre.bc files")
+	parser.add_argument("--runs", type = int, default = 3)
+	parser.add_argument("--save", help = "write the results here as a baseline")
+	parser.add_argument("--baseline", help = "compare against a baseline written by --save")
+	parser.add_argument("--threshold", type = float, default = 10.0, help = "percent growth to flag")
+	parser.add_argument("--verbose", action = "store_true", help = "show LLPE's stderr")
+	args = parser.parse_args()
+	args.root = root
+
+	suite = default_suite
+	if args.suite:
+		with open(args.suite) as f:
+			suite = json.load(f)
+	if args.workloads:
+		suite = [w for w in suite if w["name"] in args.workloads]
+
+	results = {}
+	for w in suite:
+		for scale in w.get("scales", [1]):
+			key = w["name"] if "scales" not in w else "%s@%d" % (w["name"], scale)
+			r = measure(w, scale, args)
+			if r is None:
+				continue
+			results[key] = r
+			print("%s: %s" % (key, describe(r)))
+
+	if args.save:
+		with open(args.save, "w") as f:
+			json.dump(results, f, indent = 2, sort_keys = True)
+
+	regressions = 0
+	if args.baseline:
+
+		with open(args.baseline) as f:
+			baseline = json.load(f)
+
+		for key in sorted(results):
+
+			if key not in baseline:
+				print(key, "not in baseline")
+				continue
+
+			new = results[key]
+			old = baseline[key]
+
+			if new["contexts"] != old["contexts"]:
+				print("%s: contexts changed from %d to %d" % (key, old["contexts"], new["contexts"]))
+
+			for m in compared:
+				if not old[m]:
+					continue
+				change = (new[m] - old[m]) * 100.0 / old[m]
+				if change > args.threshold:
+					print("REGRESSION: %s %s %+.1f%% (%s -> %s)" % (key, m, change, old[m], new[m]))
+					regressions += 1
+				elif change < -args.threshold:
+					print("Improvement: %s %s %+.1f%%" % (key, m, change))
+
+	return 1 if regressions else 0
+
+if __name__ == "__main__":
+	sys.exit(main())
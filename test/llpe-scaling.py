@@ -0,0 +1,279 @@
+#!/usr/bin/python
+
+# Scaling curves: how LLPE's analysis time and memory, and the specialised program's
+# runtime, grow as one parameter of a workload is swept.
+#
+# A workload is a C source specialised against a file it reads. At each point of its
+# sweep a scratch copy of the source is made with the parameters substituted in, compiled,
+# specialised with -int-stats-file (as llpe-bench.py does, for the analysis and commit
+# times and peak RSS), linked, and the result is timed, --runs times each. The
+# parameters are:
+#
+#   input    the size in bytes of the input file, which is regenerated at each point
+#   bufsize  the size of the program's read buffer
+#   trips    the read loop's trip count: the input is made trips * bufsize bytes long
+#
+# The built-in suite sweeps each of them over test/wc.c, and the input size over
+# test/wc-stdio.c. The eval programs read inputs named by their argv files, so they are
+# swept by giving --suite a JSON list of workloads, each with "name", "dir", "sweep",
+# "values", "input" (the file to regenerate, relative to dir), and "specialise" and
+# "run" commands, which replace the compile, specialise and link steps. For example:
+#
+#   {"name": "md5sum", "dir": "/path/to/specdir", "sweep": "input", "values": [1024, 65536],
+#    "input": "md5-input", "specialise": "bash {root}/eval/md5sum-spec.sh -int-stats-file={stats}",
+#    "run": "./md5sum-opt md5-input"}
+#
+# Each point gives one row of --csv (default llpe-scaling.csv); with matplotlib available,
+# each workload also gets a log-log plot, WORKLOAD.png in --plot-dir. A warning is printed
+# wherever a figure grows faster than --max-slope powers of the swept parameter between
+# two points, such as 1.5 for a quadratic blow-up. Like the program's own file checks,
+# the timed runs of file-specialised code need lliowd running to take the specialised
+# path.
+#
+# Command placeholders: {opt} is --opt-cmd, {cc} --cc, {root} the repository root,
+# {scratch} the point's scratch directory, {src}, {bc}, {optbc} and {exe} the files made
+# there, {stats} the statistics file and {llpeargs} --llpe-args.
+
+from __future__ import print_function
+
+import argparse
+import csv
+import json
+import math
+import os
+import os.path
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from bench import median
+
+wc_path = "/local/scratch/cs448/integrator/test/wc.c"
+
+default_suite = [
+
+	{"name": "wc-input", "source": "test/wc.c", "sweep": "input", "values": [1024, 8192, 65536],
+	 "bufsize": 128, "subst": [[wc_path, "{input}"], [r"#define BUFSIZE \d+", "#define BUFSIZE {bufsize}"]]},
+	{"name": "wc-bufsize", "source": "test/wc.c", "sweep": "bufsize", "values": [16, 64, 256, 1024],
+	 "input_size": 16384, "subst": [[wc_path, "{input}"], [r"#define BUFSIZE \d+", "#define BUFSIZE {bufsize}"]]},
+	{"name": "wc-trips", "source": "test/wc.c", "sweep": "trips", "values": [8, 64, 512],
+	 "bufsize": 64, "subst": [[wc_path, "{input}"], [r"#define BUFSIZE \d+", "#define BUFSIZE {bufsize}"]]},
+	{"name": "wc-stdio-input", "source": "test/wc-stdio.c", "sweep": "input", "values": [1024, 8192, 65536],
+	 "subst": [["/tmp/chars", "{input}"]]}
+
+]
+
+compile_cmd = "{cc} -O1 -g -std=c99 -emit-llvm -c {src} -o {bc}"
+specialise_cmd = "{opt} -llpe -int-stats-file={stats} {llpeargs} {bc} -o {optbc}"
+link_cmd = "{cc} {optbc} -o {exe}"
+run_cmd = "{exe}"
+
+analysis_phases = ["interpret", "benefit", "tl", "dse", "die", "savesplit"]
+commit_phases = ["commit", "postcommit"]
+columns = ["analysis_seconds", "commit_seconds", "peak_rss_bytes", "contexts", "runtime_seconds"]
+slope_checked = ["analysis_seconds", "commit_seconds", "peak_rss_bytes", "runtime_seconds"]
+
+def make_input(path, size):
+
+	# Deterministic text, so runs at the same point see the same file.
+	line = "the quick brown fox jumps over the lazy dog 0123456789\n"
+	with open(path, "w") as f:
+		written = 0
+		while written < size:
+			chunk = line[:size - written]
+			f.write(chunk)
+			written += len(chunk)
+
+def point_params(w, value):
+
+	params = {"bufsize": w.get("bufsize", 128), "input_size": w.get("input_size", 4096)}
+	if w["sweep"] == "input":
+		params["input_size"] = value
+	elif w["sweep"] == "bufsize":
+		params["bufsize"] = value
+	elif w["sweep"] == "trips":
+		params["input_size"] = value * params["bufsize"]
+	return params
+
+def run(cmd, cwd, args):
+
+	with open(os.devnull, "w") as nul:
+		ret = subprocess.call(cmd, shell = True, cwd = cwd, stdout = nul, stderr = None if args.verbose else nul)
+	if ret != 0:
+		print("command failed with status %d: %s" % (ret, cmd))
+	return ret == 0
+
+def read_stats(stats):
+
+	try:
+		with open(stats + ".phases.json") as f:
+			phases = json.load(f)
+		with open(stats + ".json") as f:
+			totals = json.load(f)["totals"]
+	except IOError:
+		print("no statistics written to %s; is -int-stats-file reaching LLPE?" % stats)
+		return None
+	finally:
+		for suffix in ["", ".json", ".phases.json", ".functions.csv"]:
+			if os.path.exists(stats + suffix):
+				os.unlink(stats + suffix)
+
+	return {"analysis_seconds": sum(phases["phases"][p]["wall_seconds"] for p in analysis_phases),
+		"commit_seconds": sum(phases["phases"][p]["wall_seconds"] for p in commit_phases),
+		"peak_rss_bytes": phases["overall"]["peak_rss_bytes"],
+		"contexts": totals["dynamic_contexts"]}
+
+def measure_once(w, params, scratch, args):
+
+	cwd = w.get("dir", "{root}").format(root = args.root, scratch = scratch)
+	inpath = os.path.join(cwd if "input" in w else scratch, w.get("input", "input"))
+	make_input(inpath, params["input_size"])
+
+	subst = {"opt": args.opt_cmd, "cc": args.cc, "root": args.root, "scratch": scratch,
+		 "src": os.path.join(scratch, "prog.c"), "bc": os.path.join(scratch, "prog.bc"),
+		 "optbc": os.path.join(scratch, "prog-opt.bc"), "exe": os.path.join(scratch, "prog-opt"),
+		 "stats": os.path.join(scratch, "stats"), "llpeargs": args.llpe_args,
+		 "input": inpath, "bufsize": params["bufsize"]}
+
+	if "source" in w:
+
+		with open(os.path.join(args.root, w["source"])) as f:
+			text = f.read()
+		for (pattern, repl) in w.get("subst", []):
+			text = re.sub(pattern, repl.format(**subst), text)
+		with open(subst["src"], "w") as f:
+			f.write(text)
+
+		if not run(w.get("compile", compile_cmd).format(**subst), cwd, args):
+			return None
+
+	if not run(w.get("specialise", specialise_cmd).format(**subst), cwd, args):
+		return None
+	result = read_stats(subst["stats"])
+	if result is None:
+		return None
+
+	if "source" in w and not run(w.get("link", link_cmd).format(**subst), cwd, args):
+		return None
+
+	start = time.time()
+	if not run(w.get("run", run_cmd).format(**subst), cwd, args):
+		return None
+	result["runtime_seconds"] = time.time() - start
+
+	return result
+
+def measure(w, value, args):
+
+	params = point_params(w, value)
+	scratch = tempfile.mkdtemp(prefix = "llpe-scaling-")
+
+	try:
+		samples = []
+		for i in range(args.runs):
+			s = measure_once(w, params, scratch, args)
+			if s is None:
+				return None
+			samples.append(s)
+	finally:
+		shutil.rmtree(scratch)
+		if "input" in w:
+			inpath = os.path.join(w.get("dir", "{root}").format(root = args.root), w["input"])
+			if os.path.exists(inpath):
+				os.unlink(inpath)
+
+	return dict((k, median([s[k] for s in samples])) for k in samples[0])
+
+def check_slopes(w, points, args):
+
+	for m in slope_checked:
+		for (x1, r1), (x2, r2) in zip(points, points[1:]):
+			if x1 <= 0 or x2 <= x1 or r1[m] <= 0 or r2[m] <= 0:
+				continue
+			slope = math.log(float(r2[m]) / r1[m]) / math.log(float(x2) / x1)
+			if slope > args.max_slope:
+				print("SUPERLINEAR: %s %s grows as %s^%.2f between %d and %d" % (w["name"], m, w["sweep"], slope, x1, x2))
+
+def plot(w, points, args):
+
+	try:
+		import matplotlib
+		matplotlib.use("Agg")
+		import matplotlib.pyplot as plt
+	except ImportError:
+		return False
+
+	xs = [x for (x, r) in points]
+	fig, axes = plt.subplots(1, 3, figsize = (15, 4))
+	for ax, (title, keys, scale) in zip(axes, [("LLPE time (s)", ["analysis_seconds", "commit_seconds"], 1.0),
+						   ("LLPE peak RSS (MB)", ["peak_rss_bytes"], 1.0 / 1048576),
+						   ("Specialised runtime (s)", ["runtime_seconds"], 1.0)]):
+		for k in keys:
+			ax.plot(xs, [r[k] * scale for (x, r) in points], marker = "o", label = k)
+		ax.set_xscale("log")
+		ax.set_yscale("log")
+		ax.set_xlabel(w["sweep"])
+		ax.set_title(title)
+		ax.legend()
+	fig.suptitle(w["name"])
+	fig.savefig(os.path.join(args.plot_dir, w["name"] + ".png"))
+	plt.close(fig)
+	return True
+
+def main():
+
+	root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+	parser = argparse.ArgumentParser(description = "Sweep workload parameters and chart how LLPE and its output scale")
+	parser.add_argument("workloads", nargs = "*", help = "workloads to run (default: the whole suite)")
+	parser.add_argument("--suite", help = "JSON list of workloads to use instead of the built-in suite")
+	parser.add_argument("--opt-cmd", default = "opt -load %s/llpe/build/main/LLVMLLPEMain.so -load %s/llpe/build/driver/LLVMLLPEDriver.so" % (root, root),
+			    help = "opt invocation with LLPE loaded")
+	parser.add_argument("--cc", default = "clang", help = "compiler for the sources and the specialised bitcode")
+	parser.add_argument("--llpe-args", default = "", help = "extra options for the built-in workloads' LLPE runs")
+	parser.add_argument("--runs", type = int, default = 3)
+	parser.add_argument("--csv", default = "llpe-scaling.csv")
+	parser.add_argument("--plot-dir", default = ".")
+	parser.add_argument("--max-slope", type = float, default = 1.5, help = "growth exponent to flag")
+	parser.add_argument("--verbose", action = "store_true", help = "show the commands' stderr")
+	args = parser.parse_args()
+	args.root = root
+
+	suite = default_suite
+	if args.suite:
+		with open(args.suite) as f:
+			suite = json.load(f)
+	if args.workloads:
+		suite = [w for w in suite if w["name"] in args.workloads]
+
+	with open(args.csv, "w") as f:
+
+		out = csv.writer(f)
+		out.writerow(["workload", "sweep", "value"] + columns)
+
+		for w in suite:
+
+			points = []
+			for value in w["values"]:
+				r = measure(w, value, args)
+				if r is None:
+					print("%s: %s=%d failed" % (w["name"], w["sweep"], value))
+					continue
+				points.append((value, r))
+				out.writerow([w["name"], w["sweep"], value] + [r[c] for c in columns])
+				print("%s: %s=%d: analysis %.3fs, commit %.3fs, peak RSS %.1fMB, %d contexts, runtime %.4fs" % \
+				      (w["name"], w["sweep"], value, r["analysis_seconds"], r["commit_seconds"],
+				       r["peak_rss_bytes"] / 1048576.0, r["contexts"], r["runtime_seconds"]))
+
+			check_slopes(w, points, args)
+			if points and not plot(w, points, args):
+				print("matplotlib not available; see %s for the figures" % args.csv)
+
+	return 0
+
+if __name__ == "__main__":
+	sys.exit(main())